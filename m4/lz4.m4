@@ -0,0 +1,43 @@
+dnl Check to find the lz4 headers/libraries
+
+AC_DEFUN([tinc_LZ4],
+[
+  AC_ARG_ENABLE([lz4],
+    AS_HELP_STRING([--disable-lz4], [disable lz4 compression support]))
+  AS_IF([test "x$enable_lz4" != "xno"], [
+    AC_ARG_WITH(lz4,
+      AS_HELP_STRING([--with-lz4=DIR], [lz4 base directory, or:]),
+      [lz4="$withval"
+       CPPFLAGS="$CPPFLAGS -I$withval/include"
+       LDFLAGS="$LDFLAGS -L$withval/lib"]
+    )
+
+    AC_ARG_WITH(lz4-include,
+      AS_HELP_STRING([--with-lz4-include=DIR], [lz4 headers directory]),
+      [lz4_include="$withval"
+       CPPFLAGS="$CPPFLAGS -I$withval"]
+    )
+
+    AC_ARG_WITH(lz4-lib,
+      AS_HELP_STRING([--with-lz4-lib=DIR], [lz4 library directory]),
+      [lz4_lib="$withval"
+       LDFLAGS="$LDFLAGS -L$withval"]
+    )
+
+    dnl Unlike zlib and lzo, lz4 is only used if it is found, unless explicitly enabled
+
+    AC_CHECK_HEADERS([lz4.h lz4hc.h], [], [tinc_lz4=no])
+
+    AS_IF([test "x$tinc_lz4" != "xno"],
+      [AC_CHECK_LIB(lz4, LZ4_compress_HC_extStateHC,
+        [LIBS="$LIBS -llz4"
+         AC_DEFINE(HAVE_LZ4, 1, [enable lz4 compression support])],
+        [tinc_lz4=no]
+      )]
+    )
+
+    AS_IF([test "x$tinc_lz4" = "xno" && test "x$enable_lz4" = "xyes"],
+      [AC_MSG_ERROR("lz4 header files or libraries not found.")]
+    )
+  ])
+])
@@ -256,11 +256,14 @@ static void avl_rebalance(avl_tree_t *tree, avl_node_t *node)
 
 /* (De)constructors */
 
+static xslab_t avl_tree_slab = XSLAB_INIT("avl_tree", avl_tree_t);
+static xslab_t avl_node_slab = XSLAB_INIT("avl_node", avl_node_t);
+
 avl_tree_t *avl_alloc_tree(avl_compare_t compare, avl_action_t delete)
 {
 	avl_tree_t *tree;
 
-	tree = xmalloc_and_zero(sizeof(avl_tree_t));
+	tree = xslab_alloc_and_zero(&avl_tree_slab);
 	tree->compare = compare;
 	tree->delete = delete;
 
@@ -269,12 +272,12 @@ avl_tree_t *avl_alloc_tree(avl_compare_t compare, avl_action_t delete)
 
 void avl_free_tree(avl_tree_t *tree)
 {
-	free(tree);
+	xslab_free(&avl_tree_slab, tree);
 }
 
 avl_node_t *avl_alloc_node(void)
 {
-	return xmalloc_and_zero(sizeof(avl_node_t));
+	return xslab_alloc_and_zero(&avl_node_slab);
 }
 
 void avl_free_node(avl_tree_t *tree, avl_node_t *node)
@@ -282,7 +285,7 @@ void avl_free_node(avl_tree_t *tree, avl_node_t *node)
 	if(node->data && tree->delete)
 		tree->delete(node->data);
 
-	free(node);
+	xslab_free(&avl_node_slab, node);
 }
 
 /* Searching */
@@ -0,0 +1,611 @@
+/*
+    bench.c -- measure the throughput of the data path and of packet crypto
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "system.h"
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#ifndef OPENSSL_NO_ENGINE
+#include <openssl/engine.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "bench.h"
+#include "compress.h"
+#include "device.h"
+#include "ethernet.h"
+#include "ipv4.h"
+#include "logger.h"
+#include "net.h"
+#include "node.h"
+#include "route.h"
+#include "subnet.h"
+#include "xalloc.h"
+
+/*
+  The benchmark adds a node to the running daemon whose UDP address is our
+  own UDP socket, and that uses the same key in both directions. Synthetic
+  packets for him go through route(), send_udppacket() and sendmmsg(), come
+  back in through handle_incoming_vpn_data(), and are decrypted and routed
+  again, where route() drops them because they would loop back to him.
+  So one daemon does the work of both ends of a tunnel, without a device.
+*/
+
+int bench_packets = 0;
+bool bench_crypto = false;
+
+/* Packets sent before waiting for them to come back, well below any socket buffer */
+#define BENCH_BATCH 32
+
+static const struct {
+	const char *cipher;
+	const char *digest;
+} bench_suites[] = {
+	{"none", "none"},
+	{"none", "sha1"},
+	{"aes-128-cbc", "sha1"},
+	{"aes-256-cbc", "sha256"},
+	{"aes-128-gcm", "none"},
+	{"aes-256-gcm", "none"},
+	{"chacha20-poly1305", "none"},
+	{NULL, NULL},
+};
+
+static const int bench_levels[] = {0, 1, 10, 12, -1};
+static const int bench_sizes[] = {64, 576, 1514, 0};
+
+static const ipv4_t bench_source = {{10, 255, 255, 1}};
+static const ipv4_t bench_dest = {{10, 255, 255, 2}};
+static const mac_t bench_mac = {{0x02, 0x00, 0x00, 0xbe, 0x4c, 0x00}};
+
+static const size_t ether_size = sizeof(struct ether_header);
+
+static uint64_t bench_cycles(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static double bench_time(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Give him the same key, cipher, digest and compression in both directions */
+
+static bool bench_keys(node_t *n, const EVP_CIPHER *cipher, const EVP_MD *digest, int level) {
+	node_tunnel_t *t = node_tunnel(n);
+
+	n->status.validkey = false;
+
+	t->incipher = t->outcipher = cipher;
+	t->inkeylength = t->outkeylength = cipher ? cipher->key_len + cipher->iv_len : 1;
+	t->inkey = xrealloc(t->inkey, t->inkeylength);
+	t->outkey = xrealloc(t->outkey, t->outkeylength);
+
+	if(1 != RAND_bytes((unsigned char *)t->inkey, t->inkeylength))
+		return false;
+
+	memcpy(t->outkey, t->inkey, t->inkeylength);
+
+	if(cipher)
+		if(!EVP_EncryptInit_ex(&t->outctx, cipher, NULL, (unsigned char *)t->outkey, (unsigned char *)t->outkey + cipher->key_len)
+				|| !EVP_DecryptInit_ex(&t->inctx, cipher, NULL, (unsigned char *)t->inkey, (unsigned char *)t->inkey + cipher->key_len))
+			return false;
+
+	t->indigest = t->outdigest = digest;
+	t->inmaclength = t->outmaclength = digest ? 4 : 0;
+
+	if(digest)
+		if(!HMAC_Init_ex(&t->outhmac, t->outkey, t->outkeylength, digest, NULL)
+				|| !HMAC_Init_ex(&t->inhmac, t->inkey, t->inkeylength, digest, NULL))
+			return false;
+
+	t->incompression = t->outcompression = level;
+	t->compressskip = t->compressbackoff = 0;
+
+	t->sent_seqno = t->received_seqno = 0;
+	if(replaywin) memset(t->replay, 0, REPLAY_SIZE);
+
+	update_node_forwarding(n);
+	n->status.validkey = true;
+
+	return true;
+}
+
+/* An UDP packet of the given size from a made up address behind us to him */
+
+static void bench_packet(vpn_packet_t *packet, int size) {
+	struct ip ip = {0};
+
+	packet->len = size;
+	packet->priority = 0;
+
+	memcpy(packet->data, bench_mac.x, ETH_ALEN);
+	memcpy(packet->data + ETH_ALEN, mymac.x, ETH_ALEN);
+	packet->data[12] = ETH_P_IP >> 8;
+	packet->data[13] = ETH_P_IP & 0xff;
+
+	ip.ip_v = 4;
+	ip.ip_hl = sizeof ip / 4;
+	ip.ip_len = htons(size - ether_size);
+	ip.ip_ttl = 64;
+	ip.ip_p = IPPROTO_UDP;
+	memcpy(&ip.ip_src, &bench_source, sizeof bench_source);
+	memcpy(&ip.ip_dst, &bench_dest, sizeof bench_dest);
+	memcpy(packet->data + ether_size, &ip, sizeof ip);
+
+	uint32_t sum = 0;
+
+	for(int i = 0; i < sizeof ip; i += 2)
+		sum += packet->data[ether_size + i] << 8 | packet->data[ether_size + i + 1];
+
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = ~((sum & 0xffff) + (sum >> 16));
+	packet->data[ether_size + 10] = sum >> 8;
+	packet->data[ether_size + 11] = sum;
+
+	/* The payload is random, so compression only shows what trying it costs */
+
+	RAND_bytes(packet->data + ether_size + sizeof ip, size - ether_size - sizeof ip);
+}
+
+/* Send packets to him and wait for each batch to come back, returns how many did */
+
+static int bench_run(node_t *n, listen_socket_t *ls, vpn_packet_t *packet, int count) {
+	int sent = 0;
+	uint64_t received = n->stats.in_packets;
+
+	while(sent < count) {
+		int batch = count - sent < BENCH_BATCH ? count - sent : BENCH_BATCH;
+
+		for(int i = 0; i < batch; i++)
+			route(myself, packet);
+
+		flush_udp_queue();
+		sent += batch;
+
+		while(n->stats.in_packets - received < sent) {
+			struct timeval tv = {1, 0};
+			fd_set fds;
+
+			FD_ZERO(&fds);
+			FD_SET(ls->udp, &fds);
+
+			if(select(ls->udp + 1, &fds, NULL, NULL, &tv) <= 0)
+				return n->stats.in_packets - received;
+
+			handle_incoming_vpn_data(ls, IO_READ);
+		}
+	}
+
+	return n->stats.in_packets - received;
+}
+
+bool run_benchmark(void) {
+	listen_socket_t *ls = &listen_socket[0];
+	sockaddr_t sa;
+	socklen_t salen = sizeof sa;
+
+	if(routing_mode == RMODE_HUB) {
+		logger(LOG_ERR, "The benchmark needs Mode = router or switch");
+		return false;
+	}
+
+	if(!listen_sockets || getsockname(ls->udp, &sa.sa, &salen)) {
+		logger(LOG_ERR, "The benchmark needs an UDP socket to send to");
+		return false;
+	}
+
+	/* Send to the loopback address if we listen on all of them */
+
+	if(sa.sa.sa_family == AF_INET && sa.in.sin_addr.s_addr == htonl(INADDR_ANY))
+		sa.in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	else if(sa.sa.sa_family == AF_INET6 && IN6_IS_ADDR_UNSPECIFIED(&sa.in6.sin6_addr))
+		sa.in6.sin6_addr = in6addr_loopback;
+
+	/* Set up the node at the other end, and subnets so route() sends packets to him */
+
+	node_t *n = new_node();
+	n->name = xstrdup("tinc_bench");
+	node_add(n);
+	n->nexthop = n->via = n;
+	n->status.visited = n->status.reachable = true;
+	update_node_udp(n, &sa);
+
+	subnet_t *subnet = new_subnet();
+	subnet->type = SUBNET_IPV4;
+	subnet->net.ipv4.address = bench_dest;
+	subnet->net.ipv4.prefixlength = 32;
+	subnet_add(n, subnet);
+
+	subnet = new_subnet();
+	subnet->type = SUBNET_MAC;
+	subnet->net.mac.address = bench_mac;
+	subnet_add(n, subnet);
+
+	/* Packets for us go nowhere while the benchmark runs */
+
+	devops_t saved_devops = devops;
+	devops = dummy_devops;
+
+	/* Batches would come back through the main loop, which is not running */
+
+	bool saved_pipeline = crypto_pipeline;
+	crypto_pipeline = false;
+
+	vpn_packet_t *packet = new_packet();
+	bool success = true;
+
+	printf("%-18s %-7s %5s %5s %12s %9s %9s %11s\n",
+			"cipher", "digest", "compr", "size", "packets/s", "Gbit/s", "ns/pkt", "cycles/pkt");
+
+	for(int i = 0; bench_suites[i].cipher; i++) {
+		const EVP_CIPHER *cipher = NULL;
+		const EVP_MD *digest = NULL;
+
+		if(strcasecmp(bench_suites[i].cipher, "none") && !(cipher = EVP_get_cipherbyname(bench_suites[i].cipher)))
+			continue;
+
+		if(strcasecmp(bench_suites[i].digest, "none") && !(digest = EVP_get_digestbyname(bench_suites[i].digest)))
+			continue;
+
+		for(int j = 0; bench_levels[j] >= 0; j++) {
+			if(!compression_supported(bench_levels[j]))
+				continue;
+
+			for(int k = 0; bench_sizes[k]; k++) {
+				if(bench_sizes[k] > max_frame_size)
+					continue;
+
+				if(!bench_keys(n, cipher, digest, bench_levels[j])) {
+					logger(LOG_ERR, "Could not set up %s/%s for the benchmark", bench_suites[i].cipher, bench_suites[i].digest);
+					success = false;
+					goto end;
+				}
+
+				bench_packet(packet, bench_sizes[k]);
+
+				double start = bench_time();
+				uint64_t cycles = bench_cycles();
+				int done = bench_run(n, ls, packet, bench_packets);
+				cycles = bench_cycles() - cycles;
+				double elapsed = bench_time() - start;
+
+				if(done < bench_packets)
+					logger(LOG_WARNING, "Only %d of %d packets came back", done, bench_packets);
+
+				if(!done || elapsed <= 0) {
+					printf("%-18s %-7s %5d %5d %12s\n", bench_suites[i].cipher, bench_suites[i].digest,
+							bench_levels[j], bench_sizes[k], "failed");
+					continue;
+				}
+
+				printf("%-18s %-7s %5d %5d %12.0f %9.3f %9.1f %11.0f\n",
+						bench_suites[i].cipher, bench_suites[i].digest, bench_levels[j], bench_sizes[k],
+						done / elapsed, done * bench_sizes[k] * 8 / elapsed / 1e9,
+						elapsed * 1e9 / done, (double)cycles / done);
+				fflush(stdout);
+			}
+		}
+	}
+
+end:
+	free_packet(packet);
+	devops = saved_devops;
+	crypto_pipeline = saved_pipeline;
+	node_del(n);
+
+	return success;
+}
+
+/*
+  The crypto benchmark only calls OpenSSL the way the data path does for
+  every packet, without any sockets or routing, so it shows what the choice
+  of Cipher, Digest and MACLength costs on this machine by itself.
+*/
+
+/* Seconds spent on each packet size, for --bench-crypto and for the self-test */
+#define BENCH_CRYPTO_TIME 0.1
+#define SELFTEST_CRYPTO_TIME 0.01
+
+/* The self-test warns when an alternative is this many times faster */
+#define SELFTEST_SLOWDOWN 2
+
+typedef struct crypto_result_t {
+	double bytes_per_second;
+	double cycles_per_byte;			/* 0 if there is no cycle counter */
+	int overhead;				/* bytes added to each packet on the wire */
+} crypto_result_t;
+
+/* Tell what might accelerate a cipher, the measured speed tells whether it does */
+
+static const char *crypto_acceleration(const EVP_CIPHER *cipher) {
+	if(!cipher)
+		return "-";
+
+#ifndef OPENSSL_NO_ENGINE
+	static char engine_id[64];
+	ENGINE *engine = ENGINE_get_cipher_engine(EVP_CIPHER_nid(cipher));
+
+	if(engine) {
+		snprintf(engine_id, sizeof engine_id, "engine %s", ENGINE_get_id(engine));
+		ENGINE_finish(engine);
+		return engine_id;
+	}
+#endif
+
+	if(strncasecmp(OBJ_nid2ln(EVP_CIPHER_nid(cipher)), "aes", 3))
+		return "software";
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	unsigned int eax, ebx, ecx, edx;
+
+	if(__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_AES))
+		return "AES-NI";
+#endif
+
+#if defined(__aarch64__) && defined(__linux__) && defined(HWCAP_AES)
+	if(getauxval(AT_HWCAP) & HWCAP_AES)
+		return "ARMv8 AES";
+#endif
+
+	return "software";
+}
+
+/* Encrypt and authenticate packets of the given size for about the given time */
+
+static bool measure_crypto(const EVP_CIPHER *cipher, const EVP_MD *digest, int maclength, int size, double duration, crypto_result_t *result) {
+	static uint8_t in[MAXSIZE], out[MAXSIZE + EVP_MAX_BLOCK_LENGTH + EVP_MAX_MD_SIZE];
+	unsigned char key[EVP_MAX_KEY_LENGTH + EVP_MAX_IV_LENGTH];
+	unsigned char nonce[EVP_MAX_IV_LENGTH];
+	unsigned char hmac[EVP_MAX_MD_SIZE];
+	EVP_CIPHER_CTX ctx;
+	HMAC_CTX hmacctx;
+	bool aead = !digest && CIPHER_IS_AEAD(cipher);
+	int keylength = cipher ? cipher->key_len + cipher->iv_len : 1;
+	int outlen = size, outpad = 0, aadlen;
+	unsigned int hmaclen;
+	uint32_t seqno = 0;
+	uint64_t packets = 0, cycles;
+	double start, elapsed;
+	bool success = false;
+
+	EVP_CIPHER_CTX_init(&ctx);
+	HMAC_CTX_init(&hmacctx);
+
+	if(1 != RAND_bytes(key, keylength) || 1 != RAND_bytes(in, size))
+		goto end;
+
+	if(cipher && !EVP_EncryptInit_ex(&ctx, cipher, NULL, key, key + cipher->key_len))
+		goto end;
+
+	if(digest && !HMAC_Init_ex(&hmacctx, key, keylength, digest, NULL))
+		goto end;
+
+	start = bench_time();
+	cycles = bench_cycles();
+
+	do {
+		/* Check the time only now and then, it costs as much as a small packet */
+
+		for(int i = 0; i < 64; i++) {
+			seqno++;
+			memcpy(out, &seqno, sizeof seqno);
+
+			if(aead) {
+				memcpy(nonce, key + cipher->key_len, cipher->iv_len);
+
+				for(int j = 0; j < sizeof seqno; j++)
+					nonce[cipher->iv_len - sizeof seqno + j] ^= ((unsigned char *)&seqno)[j];
+
+				if(!EVP_EncryptInit_ex(&ctx, NULL, NULL, NULL, nonce)
+						|| !EVP_EncryptUpdate(&ctx, NULL, &aadlen, (unsigned char *)&seqno, sizeof seqno)
+						|| !EVP_EncryptUpdate(&ctx, out + sizeof seqno, &outlen, in, size)
+						|| !EVP_EncryptFinal_ex(&ctx, out + sizeof seqno + outlen, &outpad)
+						|| !EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_SIZE, out + sizeof seqno + outlen + outpad))
+					goto end;
+			} else if(cipher) {
+				if(!EVP_EncryptInit_ex(&ctx, NULL, NULL, NULL, NULL)
+						|| !EVP_EncryptUpdate(&ctx, out + sizeof seqno, &outlen, in, size)
+						|| !EVP_EncryptFinal_ex(&ctx, out + sizeof seqno + outlen, &outpad))
+					goto end;
+			} else
+				memcpy(out + sizeof seqno, in, size);
+
+			if(digest) {
+				if(!HMAC_Init_ex(&hmacctx, NULL, 0, NULL, NULL)
+						|| !HMAC_Update(&hmacctx, out, sizeof seqno + outlen + outpad)
+						|| !HMAC_Final(&hmacctx, hmac, &hmaclen))
+					goto end;
+
+				memcpy(out + sizeof seqno + outlen + outpad, hmac, maclength);
+			}
+		}
+
+		packets += 64;
+		elapsed = bench_time() - start;
+	} while(elapsed < duration);
+
+	cycles = bench_cycles() - cycles;
+
+	result->bytes_per_second = packets * size / elapsed;
+	result->cycles_per_byte = (double)cycles / packets / size;
+	result->overhead = sizeof seqno + outlen + outpad - size + (aead ? AEAD_TAG_SIZE : digest ? maclength : 0);
+	success = true;
+
+end:
+	EVP_CIPHER_CTX_cleanup(&ctx);
+	HMAC_CTX_cleanup(&hmacctx);
+
+	return success;
+}
+
+/* Look up a suite by name, false if this build of OpenSSL does not have it */
+
+static bool crypto_suite(int i, const EVP_CIPHER **cipher, const EVP_MD **digest) {
+	*cipher = NULL;
+	*digest = NULL;
+
+	if(strcasecmp(bench_suites[i].cipher, "none") && !(*cipher = EVP_get_cipherbyname(bench_suites[i].cipher)))
+		return false;
+
+	if(strcasecmp(bench_suites[i].digest, "none") && !(*digest = EVP_get_digestbyname(bench_suites[i].digest)))
+		return false;
+
+	return true;
+}
+
+static const char *cipher_name(const EVP_CIPHER *cipher) {
+	return cipher ? OBJ_nid2ln(EVP_CIPHER_nid(cipher)) : "none";
+}
+
+static const char *digest_name(const EVP_MD *digest) {
+	return digest ? OBJ_nid2ln(EVP_MD_type(digest)) : "none";
+}
+
+static bool print_crypto(const EVP_CIPHER *cipher, const EVP_MD *digest, int maclength, const char *note) {
+	crypto_result_t result;
+
+	for(int k = 0; bench_sizes[k]; k++) {
+		if(!measure_crypto(cipher, digest, maclength, bench_sizes[k], BENCH_CRYPTO_TIME, &result)) {
+			printf("%-18s %-7s %6d %5d %10s\n", cipher_name(cipher), digest_name(digest), maclength, bench_sizes[k], "failed");
+			return false;
+		}
+
+		printf("%-18s %-7s %6d %5d %10.1f", cipher_name(cipher), digest_name(digest), maclength, bench_sizes[k],
+				result.bytes_per_second / 1e6);
+
+		if(result.cycles_per_byte)
+			printf(" %11.2f", result.cycles_per_byte);
+		else
+			printf(" %11s", "-");
+
+		printf(" %8d  %s%s\n", result.overhead, crypto_acceleration(cipher), note);
+		fflush(stdout);
+	}
+
+	return true;
+}
+
+bool run_crypto_benchmark(void) {
+	node_tunnel_t *t = myself->tunnel;
+	const EVP_CIPHER *cipher;
+	const EVP_MD *digest;
+	bool configured = false;
+	bool success = true;
+
+	printf("%-18s %-7s %6s %5s %10s %11s %8s  %s\n",
+			"cipher", "digest", "maclen", "size", "MB/s", "cycles/byte", "overhead", "acceleration");
+
+	for(int i = 0; bench_suites[i].cipher; i++) {
+		if(!crypto_suite(i, &cipher, &digest))
+			continue;
+
+		int maclength = digest ? 4 : 0;
+		bool mine = cipher == t->incipher && digest == t->indigest && maclength == t->inmaclength;
+
+		if(!print_crypto(cipher, digest, maclength, mine ? " (configured)" : ""))
+			success = false;
+
+		configured |= mine;
+	}
+
+	if(!configured && !print_crypto(t->incipher, t->indigest, t->inmaclength, " (configured)"))
+		success = false;
+
+	return success;
+}
+
+/* Seconds to encrypt and authenticate one packet of every typical size */
+
+static double crypto_cost(const EVP_CIPHER *cipher, const EVP_MD *digest, int maclength) {
+	crypto_result_t result;
+	double cost = 0;
+
+	for(int k = 0; bench_sizes[k]; k++) {
+		if(!measure_crypto(cipher, digest, maclength, bench_sizes[k], SELFTEST_CRYPTO_TIME, &result))
+			return 0;
+
+		cost += bench_sizes[k] / result.bytes_per_second;
+	}
+
+	return cost;
+}
+
+/*
+  Measure the configured Cipher, Digest and MACLength, and compare them with
+  the suites that also encrypt and authenticate packets. Only logs, since a
+  slower choice may well be deliberate.
+*/
+
+void check_crypto_speed(void) {
+	node_tunnel_t *t = myself->tunnel;
+	double mine = crypto_cost(t->incipher, t->indigest, t->inmaclength);
+	double best = 0;
+	int besti = -1, bytes = 0;
+
+	for(int k = 0; bench_sizes[k]; k++)
+		bytes += bench_sizes[k];
+
+	if(!mine) {
+		logger(LOG_WARNING, "Could not measure the speed of cipher %s with digest %s", cipher_name(t->incipher), digest_name(t->indigest));
+		return;
+	}
+
+	logger(LOG_INFO, "Cipher %s with digest %s and MAC length %d: %.1f MB/s, %s",
+			cipher_name(t->incipher), digest_name(t->indigest), t->inmaclength,
+			bytes / mine / 1e6, crypto_acceleration(t->incipher));
+
+	if(!t->incipher || (!t->indigest && !CIPHER_IS_AEAD(t->incipher)))
+		return;
+
+	for(int i = 0; bench_suites[i].cipher; i++) {
+		const EVP_CIPHER *cipher;
+		const EVP_MD *digest;
+
+		if(!crypto_suite(i, &cipher, &digest) || !cipher || (!digest && !CIPHER_IS_AEAD(cipher)))
+			continue;
+
+		double cost = crypto_cost(cipher, digest, digest ? 4 : 0);
+
+		if(cost && (besti < 0 || cost < best)) {
+			best = cost;
+			besti = i;
+		}
+	}
+
+	if(besti >= 0 && best * SELFTEST_SLOWDOWN < mine)
+		logger(LOG_WARNING, "Cipher %s with digest %s is %.1f times slower than cipher %s with digest %s on this machine",
+				cipher_name(t->incipher), digest_name(t->indigest), mine / best,
+				bench_suites[besti].cipher, bench_suites[besti].digest);
+}
@@ -203,86 +203,110 @@ static void close_device(void) {
 	free(iface);
 }
 
-static bool read_packet(vpn_packet_t *packet) {
-	int lenin;
+/*
+  Whatever header the device puts in front of the IP packet is read into, and
+  written from, the space for the Ethernet header at the start of
+  packet->data, so the IP packet itself is never copied. For writes, the
+  bytes that get clobbered are restored afterwards, since the packet may
+  still be sent elsewhere.
+*/
 
+static int header_offset(void) {
 	switch(device_type) {
-		case DEVICE_TYPE_TUN:
+		case DEVICE_TYPE_TUNIFHEAD:
+			return 14 - sizeof(uint32_t);
 #ifdef ENABLE_TUNEMU
 		case DEVICE_TYPE_TUNEMU:
-			if(device_type == DEVICE_TYPE_TUNEMU)
-				lenin = tunemu_read(device_fd, packet->data + 14, MTU - 14);
-			else
+			return 14;
 #endif
-				lenin = read(device_fd, packet->data + 14, MTU - 14);
+		case DEVICE_TYPE_TAP:
+			return 0;
+		default:
+			return 14;
+	}
+}
 
-			if(lenin <= 0) {
-				logger(LOG_ERR, "Error while reading from %s %s: %s", device_info,
-					   device, strerror(errno));
-				return false;
-			}
+static bool set_ethertype(vpn_packet_t *packet, int af) {
+	switch(af) {
+		case AF_INET:
+			packet->data[12] = 0x08;
+			packet->data[13] = 0x00;
+			break;
+
+		case AF_INET6:
+			packet->data[12] = 0x86;
+			packet->data[13] = 0xDD;
+			break;
+
+		default:
+			return false;
+	}
+
+	memset(packet->data, 0, 12);
+	return true;
+}
+
+static bool read_packet(vpn_packet_t *packet) {
+	int offset = header_offset();
+	int lenin, af;
+	uint32_t type;
+
+#ifdef ENABLE_TUNEMU
+	if(device_type == DEVICE_TYPE_TUNEMU)
+		lenin = tunemu_read(device_fd, (char *)packet->data + offset, max_frame_size - offset);
+	else
+#endif
+		lenin = read(device_fd, packet->data + offset, max_frame_size - offset);
 
+	if(lenin <= 0) {
+		logger(LOG_ERR, "Error while reading from %s %s: %s", device_info,
+			   device, strerror(errno));
+		return false;
+	}
+
+	packet->len = lenin + offset;
+
+	switch(device_type) {
+		case DEVICE_TYPE_TUN:
+#ifdef ENABLE_TUNEMU
+		case DEVICE_TYPE_TUNEMU:
+#endif
 			switch(packet->data[14] >> 4) {
 				case 4:
-					packet->data[12] = 0x08;
-					packet->data[13] = 0x00;
+					af = AF_INET;
 					break;
 				case 6:
-					packet->data[12] = 0x86;
-					packet->data[13] = 0xDD;
+					af = AF_INET6;
 					break;
 				default:
-					ifdebug(TRAFFIC) logger(LOG_ERR,
-							   "Unknown IP version %d while reading packet from %s %s",
-							   packet->data[14] >> 4, device_info, device);
-					return false;
+					af = AF_UNSPEC;
 			}
 
-			memset(packet->data, 0, 12);
-			packet->len = lenin + 14;
+			if(!set_ethertype(packet, af)) {
+				ifdebug(TRAFFIC) logger(LOG_ERR,
+						   "Unknown IP version %d while reading packet from %s %s",
+						   packet->data[14] >> 4, device_info, device);
+				return false;
+			}
 			break;
 
-		case DEVICE_TYPE_TUNIFHEAD: {
-			u_int32_t type;
-			struct iovec vector[2] = {{&type, sizeof(type)}, {packet->data + 14, MTU - 14}};
-
-			if((lenin = readv(device_fd, vector, 2)) <= 0) {
-				logger(LOG_ERR, "Error while reading from %s %s: %s", device_info,
-					   device, strerror(errno));
+		case DEVICE_TYPE_TUNIFHEAD:
+			if(packet->len < 14) {
+				ifdebug(TRAFFIC) logger(LOG_ERR, "Short packet while reading from %s %s", device_info, device);
 				return false;
 			}
 
-			switch (ntohl(type)) {
-				case AF_INET:
-					packet->data[12] = 0x08;
-					packet->data[13] = 0x00;
-					break;
-
-				case AF_INET6:
-					packet->data[12] = 0x86;
-					packet->data[13] = 0xDD;
-					break;
+			memcpy(&type, packet->data + offset, sizeof type);
 
-				default:
-					ifdebug(TRAFFIC) logger(LOG_ERR,
-							   "Unknown address family %x while reading packet from %s %s",
-							   ntohl(type), device_info, device);
-					return false;
+			if(!set_ethertype(packet, ntohl(type))) {
+				ifdebug(TRAFFIC) logger(LOG_ERR,
+						   "Unknown address family %x while reading packet from %s %s",
+						   ntohl(type), device_info, device);
+				return false;
 			}
-
-			memset(packet->data, 0, 12);
-			packet->len = lenin + 10;
 			break;
-		}
 
 		case DEVICE_TYPE_TAP:
-			if((lenin = read(device_fd, packet->data, MTU)) <= 0) {
-				logger(LOG_ERR, "Error while reading from %s %s: %s", device_info,
-					   device, strerror(errno));
-				return false;
-			}
-
-			packet->len = lenin;
 			break;
 
 		default:
@@ -297,68 +321,69 @@ static bool read_packet(vpn_packet_t *packet) {
 	return true;
 }
 
-static bool write_packet(vpn_packet_t *packet) {
-	ifdebug(TRAFFIC) logger(LOG_DEBUG, "Writing packet of %d bytes to %s",
-			   packet->len, device_info);
+/* The tun and tap drivers queue whole packets, FIONREAD returns the size of the next one */
 
-	switch(device_type) {
-		case DEVICE_TYPE_TUN:
-			if(write(device_fd, packet->data + 14, packet->len - 14) < 0) {
-				logger(LOG_ERR, "Error while writing to %s %s: %s", device_info,
-					   device, strerror(errno));
-				return false;
-			}
-			break;
+#define MAX_BATCH 64
 
-		case DEVICE_TYPE_TUNIFHEAD: {
-			u_int32_t type;
-			struct iovec vector[2] = {{&type, sizeof(type)}, {packet->data + 14, packet->len - 14}};
-			int af;
-			
-			af = (packet->data[12] << 8) + packet->data[13];
+static int batch = 0;
 
-			switch (af) {
-				case 0x0800:
-					type = htonl(AF_INET);
-					break;
-				case 0x86DD:
-					type = htonl(AF_INET6);
-					break;
-				default:
-					ifdebug(TRAFFIC) logger(LOG_ERR,
-							   "Unknown address family %x while writing packet to %s %s",
-							   af, device_info, device);
-					return false;
-			}
+static bool pending_packets(void) {
+	int len = 0;
+
+	if(++batch < MAX_BATCH && ioctl(device_fd, FIONREAD, &len) == 0 && len > 0)
+		return true;
 
-			if(writev(device_fd, vector, 2) < 0) {
-				logger(LOG_ERR, "Can't write to %s %s: %s", device_info, device,
-					   strerror(errno));
+	batch = 0;
+	return false;
+}
+
+static bool write_packet(vpn_packet_t *packet) {
+	int offset = header_offset();
+	uint8_t saved[4];
+	uint32_t type;
+	int af;
+	ssize_t result;
+
+	ifdebug(TRAFFIC) logger(LOG_DEBUG, "Writing packet of %d bytes to %s",
+			   packet->len, device_info);
+
+	if(device_type == DEVICE_TYPE_TUNIFHEAD) {
+		af = (packet->data[12] << 8) + packet->data[13];
+
+		switch (af) {
+			case 0x0800:
+				type = htonl(AF_INET);
+				break;
+			case 0x86DD:
+				type = htonl(AF_INET6);
+				break;
+			default:
+				ifdebug(TRAFFIC) logger(LOG_ERR,
+						   "Unknown address family %x while writing packet to %s %s",
+						   af, device_info, device);
 				return false;
-			}
-			break;
 		}
-			
-		case DEVICE_TYPE_TAP:
-			if(write(device_fd, packet->data, packet->len) < 0) {
-				logger(LOG_ERR, "Error while writing to %s %s: %s", device_info,
-					   device, strerror(errno));
-				return false;
-			}
-			break;
+
+		memcpy(saved, packet->data + offset, sizeof type);
+		memcpy(packet->data + offset, &type, sizeof type);
+	}
 
 #ifdef ENABLE_TUNEMU
-		case DEVICE_TYPE_TUNEMU:
-			if(tunemu_write(device_fd, packet->data + 14, packet->len - 14) < 0) {
-				logger(LOG_ERR, "Error while writing to %s %s: %s", device_info,
-					   device, strerror(errno));
-				return false;
-			}
-			break;
+	if(device_type == DEVICE_TYPE_TUNEMU) {
+		memcpy(saved, packet->data + offset - TUNEMU_WRITE_HEADROOM, TUNEMU_WRITE_HEADROOM);
+		result = tunemu_write(device_fd, (char *)packet->data + offset, packet->len - offset);
+		memcpy(packet->data + offset - TUNEMU_WRITE_HEADROOM, saved, TUNEMU_WRITE_HEADROOM);
+	} else
 #endif
+		result = write(device_fd, packet->data + offset, packet->len - offset);
 
-		default:
-			return false;
+	if(device_type == DEVICE_TYPE_TUNIFHEAD)
+		memcpy(packet->data + offset, saved, sizeof type);
+
+	if(result < 0) {
+		logger(LOG_ERR, "Error while writing to %s %s: %s", device_info,
+			   device, strerror(errno));
+		return false;
 	}
 
 	device_total_out += packet->len;
@@ -377,5 +402,6 @@ const devops_t os_devops = {
 	.close = close_device,
 	.read = read_packet,
 	.write = write_packet,
+	.pending = pending_packets,
 	.dump_stats = dump_device_stats,
 };
@@ -80,9 +80,6 @@ char tunemu_error[ERROR_BUFFER_SIZE];
 static int pcap_use_count = 0;
 static pcap_t *pcap = NULL;
 
-static int data_buffer_length = 0;
-static char *data_buffer = NULL;
-
 static void tun_error(char *format, ...)
 {
 	va_list vl;
@@ -254,16 +251,6 @@ static void close_pcap()
 	}
 }
 
-static void allocate_data_buffer(int size)
-{
-	if (data_buffer_length < size)
-	{
-		free(data_buffer);
-		data_buffer_length = size;
-		data_buffer = malloc(data_buffer_length);
-	}
-}
-
 static void make_device_name(tunemu_device device, int unit_number)
 {
 	snprintf(device, sizeof(tunemu_device), "ppp%d", unit_number);
@@ -332,11 +319,11 @@ int tunemu_close(int ppp_sockfd)
 	return ret;
 }
 
+/* The PPP header is read into, and the pcap header written from, the bytes in front of buffer */
+
 int tunemu_read(int ppp_sockfd, char *buffer, int length)
 {
-	allocate_data_buffer(length + 2);
-
-	length = read(ppp_sockfd, data_buffer, length + 2);
+	length = read(ppp_sockfd, buffer - TUNEMU_READ_HEADROOM, length + TUNEMU_READ_HEADROOM);
 	if (length < 0)
 	{
 		tun_error("reading packet: %s", strerror(errno));
@@ -344,25 +331,21 @@ int tunemu_read(int ppp_sockfd, char *buffer, int length)
 	}
 	tun_noerror();
 
-	length -= 2;
+	length -= TUNEMU_READ_HEADROOM;
 	if (length < 0)
 		return 0;
 
-	memcpy(buffer, data_buffer + 2, length);
-
 	return length;
 }
 
 int tunemu_write(int ppp_sockfd, char *buffer, int length)
 {
-	allocate_data_buffer(length + 4);
-
-	data_buffer[0] = 0x02;
-	data_buffer[1] = 0x00;
-	data_buffer[2] = 0x00;
-	data_buffer[3] = 0x00;
+	char *header = buffer - TUNEMU_WRITE_HEADROOM;
 
-	memcpy(data_buffer + 4, buffer, length);
+	header[0] = 0x02;
+	header[1] = 0x00;
+	header[2] = 0x00;
+	header[3] = 0x00;
 
 	if (pcap == NULL)
 	{
@@ -370,7 +353,7 @@ int tunemu_write(int ppp_sockfd, char *buffer, int length)
 		return -1;
 	}
 
-	length = pcap_inject(pcap, data_buffer, length + 4);
+	length = pcap_inject(pcap, header, length + TUNEMU_WRITE_HEADROOM);
 	if (length < 0)
 	{
 		tun_error("injecting packet: %s", pcap_geterr(pcap));
@@ -378,7 +361,7 @@ int tunemu_write(int ppp_sockfd, char *buffer, int length)
 	}
 	tun_noerror();
 
-	length -= 4;
+	length -= TUNEMU_WRITE_HEADROOM;
 	if (length < 0)
 		return 0;
 
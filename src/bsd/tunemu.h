@@ -26,6 +26,11 @@ extern char tunemu_error[];
 
 int tunemu_open(tunemu_device dev);
 int tunemu_close(int fd);
+/* tunemu_read() and tunemu_write() use this many bytes in front of buffer for their own headers */
+
+#define TUNEMU_READ_HEADROOM 2
+#define TUNEMU_WRITE_HEADROOM 4
+
 int tunemu_read(int fd, char *buffer, int length);
 int tunemu_write(int fd, char *buffer, int length);
 
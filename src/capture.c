@@ -0,0 +1,175 @@
+/*
+    capture.c -- keep the most recent packets in memory for debugging
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "system.h"
+
+#include "capture.h"
+#include "conf.h"
+#include "logger.h"
+#include "net.h"
+#include "node.h"
+#include "xalloc.h"
+
+/*
+  When CaptureSize is set, the first CaptureLength bytes of every packet
+  are copied into a ring of that many entries, together with the time, the
+  node it came from or went to, and the stage at which it was seen. When
+  the ring is full the oldest entry is overwritten, so capturing never
+  allocates memory or blocks, and costs a memcpy() and gettimeofday() per
+  packet. Nothing is logged. tincd handles all packets in a single thread,
+  so the ring needs no locking.
+
+  The ring is drained through the control socket, either as records or by
+  having it written to a pcap file. Packets that were dropped before they
+  were decrypted are captured as they were received, so they do not parse
+  as Ethernet frames in the pcap file.
+*/
+
+int capture_size = 0;
+int capture_length = 128;
+
+const char *const capture_stage_names[CAPTURE_STAGES] = {
+	"device_in",
+	"device_out",
+	"received",
+	"sent",
+	"drop_nokey",
+	"drop_invalid",
+	"drop_mac",
+	"drop_replay",
+};
+
+static capture_t *ring;
+static uint8_t *ring_data;
+static unsigned int head;			/* number of packets captured */
+static unsigned int tail;			/* number of packets drained or overwritten */
+
+void capture_packet(capture_stage_t stage, const node_t *n, const void *data, length_t len) {
+	capture_t *c = &ring[head % capture_size];
+
+	gettimeofday(&c->tv, NULL);
+	c->stage = stage;
+	c->len = len;
+	c->caplen = len < capture_length ? len : capture_length;
+	memcpy(c->data, data, c->caplen);
+	strncpy(c->node, n->name, sizeof c->node - 1);
+
+	if(++head - tail > (unsigned int)capture_size)
+		tail = head - capture_size;
+}
+
+/* Returns the oldest packet in the ring and removes it, or NULL if the ring is empty */
+
+const capture_t *capture_next(void) {
+	if(!capture_size || tail == head)
+		return NULL;
+
+	return &ring[tail++ % capture_size];
+}
+
+/* Drains the ring into a pcap file, returns the number of packets written or -1 */
+
+int capture_pcap(const char *filename) {
+	const capture_t *c;
+	int count = 0;
+	FILE *f;
+
+	struct {
+		uint32_t magic;
+		uint16_t version_major;
+		uint16_t version_minor;
+		int32_t thiszone;
+		uint32_t sigfigs;
+		uint32_t snaplen;
+		uint32_t linktype;
+	} header = {0xa1b2c3d4, 2, 4, 0, 0, capture_length, 1};
+
+	struct {
+		uint32_t ts_sec;
+		uint32_t ts_usec;
+		uint32_t incl_len;
+		uint32_t orig_len;
+	} record;
+
+	f = fopen(filename, "wb");
+
+	if(!f) {
+		logger(LOG_ERR, "Could not write capture to %s: %s", filename, strerror(errno));
+		return -1;
+	}
+
+	fwrite(&header, sizeof header, 1, f);
+
+	while((c = capture_next())) {
+		record.ts_sec = c->tv.tv_sec;
+		record.ts_usec = c->tv.tv_usec;
+		record.incl_len = c->caplen;
+		record.orig_len = c->len;
+		fwrite(&record, sizeof record, 1, f);
+		fwrite(c->data, c->caplen, 1, f);
+		count++;
+	}
+
+	if(fclose(f)) {
+		logger(LOG_ERR, "Could not write capture to %s: %s", filename, strerror(errno));
+		return -1;
+	}
+
+	return count;
+}
+
+bool init_capture(void) {
+	if(get_config_int(lookup_config(config_tree, "CaptureLength"), &capture_length)) {
+		if(capture_length < 14 || capture_length > MAXSIZE) {
+			logger(LOG_ERR, "CaptureLength must be between 14 and %d!", MAXSIZE);
+			return false;
+		}
+	}
+
+	get_config_int(lookup_config(config_tree, "CaptureSize"), &capture_size);
+
+	if(capture_size < 0) {
+		logger(LOG_ERR, "CaptureSize cannot be negative!");
+		return false;
+	}
+
+	if(!capture_size)
+		return true;
+
+	ring = xmalloc_and_zero(capture_size * sizeof *ring);
+	ring_data = xmalloc(capture_size * capture_length);
+
+	for(int i = 0; i < capture_size; i++)
+		ring[i].data = ring_data + i * capture_length;
+
+	head = tail = 0;
+
+	logger(LOG_INFO, "Capturing the last %d packets, %d bytes each", capture_size, capture_length);
+
+	return true;
+}
+
+void exit_capture(void) {
+	free(ring);
+	free(ring_data);
+	ring = NULL;
+	ring_data = NULL;
+	capture_size = 0;
+	capture_length = 128;
+}
@@ -0,0 +1,62 @@
+/*
+    capture.h -- header for capture.c
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __TINC_CAPTURE_H__
+#define __TINC_CAPTURE_H__
+
+#include "net.h"
+#include "node.h"
+
+typedef enum capture_stage_t {
+	CAPTURE_DEVICE_IN,			/* read from the device, before routing */
+	CAPTURE_DEVICE_OUT,			/* written to the device */
+	CAPTURE_RECEIVED,			/* received from a node, after decryption */
+	CAPTURE_SENT,				/* sent to a node, before encryption */
+	CAPTURE_DROP_NOKEY,			/* dropped, we have no key for the sender */
+	CAPTURE_DROP_INVALID,			/* dropped, too short or could not be decrypted or uncompressed */
+	CAPTURE_DROP_MAC,			/* dropped, failed authentication */
+	CAPTURE_DROP_REPLAY,			/* dropped, sequence number seen before or too old */
+	CAPTURE_STAGES,
+} capture_stage_t;
+
+#define CAPTURE_NAMELEN 32
+
+typedef struct capture_t {
+	struct timeval tv;
+	capture_stage_t stage;
+	length_t len;				/* length of the packet */
+	length_t caplen;			/* bytes of it in data */
+	char node[CAPTURE_NAMELEN];		/* name of the node it came from or went to, truncated */
+	uint8_t *data;
+} capture_t;
+
+extern int capture_size;
+extern int capture_length;
+extern const char *const capture_stage_names[CAPTURE_STAGES];
+
+/* Costs a single test when capturing is off */
+#define capture(stage, n, data, len) do { if(capture_size) capture_packet((stage), (n), (data), (len)); } while(0)
+
+extern void capture_packet(capture_stage_t, const struct node_t *, const void *, length_t);
+extern const capture_t *capture_next(void);
+extern int capture_pcap(const char *);
+extern bool init_capture(void);
+extern void exit_capture(void);
+
+#endif							/* __TINC_CAPTURE_H__ */
@@ -0,0 +1,171 @@
+/*
+    compress.c -- compression of VPN packets
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "system.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_LZO
+#include LZO1X_H
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+#include "compress.h"
+#include "xalloc.h"
+
+bool compression_supported(int level) {
+	if(level == 0)
+		return true;
+#ifdef HAVE_ZLIB
+	if(level < 10)
+		return true;
+#endif
+#ifdef HAVE_LZO
+	if(level == 10 || level == 11)
+		return true;
+#endif
+#ifdef HAVE_LZ4
+	if(level == 12 || level == 13)
+		return true;
+#endif
+	return false;
+}
+
+/* zlib allocates its own state, the others get the largest work area any of them needs */
+
+static size_t wrkmem_size(void) {
+	size_t size = 0;
+
+#ifdef HAVE_LZO
+	if(size < LZO1X_1_MEM_COMPRESS)
+		size = LZO1X_1_MEM_COMPRESS;
+	if(size < LZO1X_999_MEM_COMPRESS)
+		size = LZO1X_999_MEM_COMPRESS;
+#endif
+#ifdef HAVE_LZ4
+	if(size < LZ4_sizeofState())
+		size = LZ4_sizeofState();
+	if(size < LZ4_sizeofStateHC())
+		size = LZ4_sizeofStateHC();
+#endif
+
+	return size;
+}
+
+compress_ctx_t *new_compress_ctx(void) {
+	compress_ctx_t *ctx = xmalloc(sizeof *ctx);
+	size_t size = wrkmem_size();
+
+	ctx->wrkmem = size ? xmalloc(size) : NULL;
+
+	return ctx;
+}
+
+void free_compress_ctx(compress_ctx_t *ctx) {
+	if(ctx) {
+		free(ctx->wrkmem);
+		free(ctx);
+	}
+}
+
+length_t compress_packet(compress_ctx_t *ctx, uint8_t *dest, const uint8_t *source, length_t len, int level) {
+	if(level == 0) {
+		memcpy(dest, source, len);
+		return len;
+	} else if(level == 10) {
+#ifdef HAVE_LZO
+		lzo_uint lzolen = MAXSIZE;
+		lzo1x_1_compress(source, len, dest, &lzolen, ctx->wrkmem);
+		return lzolen;
+#else
+		return -1;
+#endif
+	} else if(level < 10) {
+#ifdef HAVE_ZLIB
+		unsigned long destlen = MAXSIZE;
+		if(compress2(dest, &destlen, source, len, level) == Z_OK)
+			return destlen;
+		else
+#endif
+			return -1;
+	} else if(level == 11) {
+#ifdef HAVE_LZO
+		lzo_uint lzolen = MAXSIZE;
+		lzo1x_999_compress(source, len, dest, &lzolen, ctx->wrkmem);
+		return lzolen;
+#else
+		return -1;
+#endif
+	} else if(level == 12) {
+#ifdef HAVE_LZ4
+		int lz4len = LZ4_compress_fast_extState(ctx->wrkmem, (const char *)source, (char *)dest, len, MAXSIZE, 1);
+		return lz4len > 0 ? lz4len : -1;
+#else
+		return -1;
+#endif
+	} else if(level == 13) {
+#ifdef HAVE_LZ4
+		int lz4len = LZ4_compress_HC_extStateHC(ctx->wrkmem, (const char *)source, (char *)dest, len, MAXSIZE, LZ4HC_CLEVEL_DEFAULT);
+		return lz4len > 0 ? lz4len : -1;
+#else
+		return -1;
+#endif
+	}
+
+	return -1;
+}
+
+length_t uncompress_packet(uint8_t *dest, const uint8_t *source, length_t len, int level) {
+	if(level == 0) {
+		memcpy(dest, source, len);
+		return len;
+	} else if(level > 11) {
+#ifdef HAVE_LZ4
+		int lz4len = LZ4_decompress_safe((const char *)source, (char *)dest, len, MAXSIZE);
+		return lz4len >= 0 ? lz4len : -1;
+#else
+		return -1;
+#endif
+	} else if(level > 9) {
+#ifdef HAVE_LZO
+		lzo_uint lzolen = MAXSIZE;
+		if(lzo1x_decompress_safe(source, len, dest, &lzolen, NULL) == LZO_E_OK)
+			return lzolen;
+		else
+#endif
+			return -1;
+	}
+#ifdef HAVE_ZLIB
+	else {
+		unsigned long destlen = MAXSIZE;
+		if(uncompress(dest, &destlen, source, len) == Z_OK)
+			return destlen;
+		else
+			return -1;
+	}
+#endif
+
+	return -1;
+}
@@ -0,0 +1,39 @@
+/*
+    compress.h -- header for compress.c
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __TINC_COMPRESS_H__
+#define __TINC_COMPRESS_H__
+
+#include "net.h"
+
+/* Compression levels: 0 = off, 1-9 = zlib, 10 = fast lzo, 11 = best lzo, 12 = fast lz4, 13 = best lz4 */
+#define COMPRESS_MAX_LEVEL 13
+
+/* Work memory for the compressors; every thread that compresses packets needs its own */
+typedef struct compress_ctx_t {
+	void *wrkmem;
+} compress_ctx_t;
+
+extern bool compression_supported(int level);
+extern compress_ctx_t *new_compress_ctx(void) __attribute__ ((__malloc__));
+extern void free_compress_ctx(compress_ctx_t *);
+extern length_t compress_packet(compress_ctx_t *ctx, uint8_t *dest, const uint8_t *source, length_t len, int level);
+extern length_t uncompress_packet(uint8_t *dest, const uint8_t *source, length_t len, int level);
+
+#endif							/* __TINC_COMPRESS_H__ */
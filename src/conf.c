@@ -37,6 +37,7 @@ avl_tree_t *config_tree;
 
 int pinginterval = 0;			/* seconds between pings */
 int pingtimeout = 0;			/* seconds to wait for response */
+int pingtimeout_msec = 0;		/* the same in milliseconds, for the connection timers */
 char *confbase = NULL;			/* directory in which all config files are */
 char *netname = NULL;			/* name of the vpn network */
 list_t *cmdline_conf = NULL;	/* global/host configuration values given at the command line */
@@ -410,17 +411,108 @@ bool read_server_config(void) {
 	return x;
 }
 
+/*
+  Host config files are read again for every connection, which adds up when
+  many nodes reconnect at once. The parsed contents of each file are kept,
+  and copied into the connection's tree as long as stat() says the file has
+  not changed. The cache is also emptied on SIGHUP.
+*/
+
+typedef struct host_config_t {
+	char *fname;
+	struct stat st;
+	avl_tree_t *config_tree;
+} host_config_t;
+
+static avl_tree_t *host_config_cache;
+
+static int host_config_compare(const host_config_t *a, const host_config_t *b) {
+	return strcmp(a->fname, b->fname);
+}
+
+static void free_host_config(host_config_t *hc) {
+	if(hc->config_tree)
+		exit_configuration(&hc->config_tree);
+
+	free(hc->fname);
+	free(hc);
+}
+
+bool same_file(const struct stat *a, const struct stat *b) {
+	return a->st_mtime == b->st_mtime && a->st_ctime == b->st_ctime && a->st_size == b->st_size
+		&& a->st_ino == b->st_ino && a->st_dev == b->st_dev;
+}
+
+static host_config_t *read_host_config(const char *fname) {
+	host_config_t *hc, search;
+	struct stat st;
+
+	if(!host_config_cache)
+		host_config_cache = avl_alloc_tree((avl_compare_t) host_config_compare, (avl_action_t) free_host_config);
+
+	search.fname = (char *)fname;
+	hc = avl_search(host_config_cache, &search);
+
+	if(stat(fname, &st)) {
+		logger(LOG_ERR, "Cannot open config file %s: %s", fname, strerror(errno));
+		if(hc)
+			avl_delete(host_config_cache, hc);
+		return NULL;
+	}
+
+	if(hc && same_file(&hc->st, &st))
+		return hc;
+
+	if(hc)
+		avl_delete(host_config_cache, hc);
+
+	hc = xmalloc_and_zero(sizeof *hc);
+	hc->fname = xstrdup(fname);
+	hc->st = st;
+	init_configuration(&hc->config_tree);
+
+	if(!read_config_file(hc->config_tree, fname)) {
+		free_host_config(hc);
+		return NULL;
+	}
+
+	avl_insert(host_config_cache, hc);
+
+	return hc;
+}
+
+void flush_host_config_cache(void) {
+	if(host_config_cache) {
+		avl_delete_tree(host_config_cache);
+		host_config_cache = NULL;
+	}
+}
+
 bool read_connection_config(connection_t *c) {
 	char *fname;
-	bool x;
+	host_config_t *hc;
 
 	read_config_options(c->config_tree, c->name);
 
 	xasprintf(&fname, "%s/hosts/%s", confbase, c->name);
-	x = read_config_file(c->config_tree, fname);
+	hc = read_host_config(fname);
 	free(fname);
 
-	return x;
+	if(!hc)
+		return false;
+
+	for(avl_node_t *node = hc->config_tree->head; node; node = node->next) {
+		config_t *orig = node->data;
+		config_t *cfg = new_config();
+
+		cfg->variable = xstrdup(orig->variable);
+		cfg->value = xstrdup(orig->value);
+		cfg->file = xstrdup(orig->file);
+		cfg->line = orig->line;
+		config_add(c->config_tree, cfg);
+	}
+
+	return true;
 }
 
 static void disable_old_keys(const char *filename) {
@@ -37,6 +37,7 @@ extern avl_tree_t *config_tree;
 
 extern int pinginterval;
 extern int pingtimeout;
+extern int pingtimeout_msec;
 extern int maxtimeout;
 extern int mintimeout;
 extern bool bypass_security;
@@ -62,6 +63,8 @@ extern bool read_config_file(avl_tree_t *, const char *);
 extern void read_config_options(avl_tree_t *, const char *);
 extern bool read_server_config(void);
 extern bool read_connection_config(struct connection_t *);
+extern void flush_host_config_cache(void);
+extern bool same_file(const struct stat *, const struct stat *);
 extern FILE *ask_and_open(const char *, const char *);
 extern bool is_safe_path(const char *);
 
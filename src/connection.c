@@ -24,6 +24,8 @@
 #include "avl_tree.h"
 #include "conf.h"
 #include "logger.h"
+#include "meta.h"
+#include "resume.h"
 #include "subnet.h"
 #include "utils.h"
 #include "xalloc.h"
@@ -55,12 +57,31 @@ connection_t *new_connection(void) {
 	if(!c)
 		return NULL;
 
-	gettimeofday(&c->start, NULL);
+	c->start = event_clock();
 
 	return c;
 }
 
+/* Stop all connects racing the one on his socket */
+
+void cancel_attempts(connection_t *c) {
+	attempt_t *a, *next;
+
+	event_del(&c->attemptevent);
+
+	for(a = c->attempts; a; a = next) {
+		next = a->next;
+		io_del(&a->io);
+		closesocket(a->socket);
+		free(a);
+	}
+
+	c->attempts = NULL;
+}
+
 void free_connection_partially(connection_t *c) {
+	cancel_attempts(c);
+
 	free(c->inkey);
 	free(c->outkey);
 	free(c->mychallenge);
@@ -73,6 +94,14 @@ void free_connection_partially(connection_t *c) {
 	c->hischallenge = NULL;
 	c->outbuf = NULL;
 
+	if(c->resume) {
+		free_resume(c->resume);
+		c->resume = NULL;
+	}
+
+	stop_compress_meta(c);
+	clear_meta_packets(c);
+
 	c->status.pinged = false;
 	c->status.active = false;
 	c->status.connecting = false;
@@ -80,8 +109,13 @@ void free_connection_partially(connection_t *c) {
 	c->status.encryptout = false;
 	c->status.decryptin = false;
 	c->status.mst = false;
+	c->status.flush = false;
+	c->status.waiting = false;
+	c->status.resumable = false;
+	c->status.resuming = false;
 
 	c->options = 0;
+	c->bufstart = 0;
 	c->buflen = 0;
 	c->reqlen = 0;
 	c->tcplen = 0;
@@ -92,6 +126,8 @@ void free_connection_partially(connection_t *c) {
 	c->last_ping_time = 0;
 	c->last_flushed_time = 0;
 
+	event_del(&c->pingevent);
+
 	if(c->inctx) {
 		EVP_CIPHER_CTX_cleanup(c->inctx);
 		free(c->inctx);
@@ -108,6 +144,13 @@ void free_connection_partially(connection_t *c) {
 		RSA_free(c->rsa_key);
 		c->rsa_key = NULL;
 	}
+
+	/* A worker may still be busy with a request of his, its result is thrown away */
+
+	if(c->job) {
+		c->job->data = NULL;
+		c->job = NULL;
+	}
 }
 
 void free_connection(connection_t *c) {
@@ -143,5 +186,7 @@ void dump_connections(void) {
 			   c->outbufsize, c->outbufstart, c->outbuflen);
 	}
 
+	logger(LOG_DEBUG, " %d handshakes in progress, %"PRIu64" connections accepted, %"PRIu64" rejected, %"PRIu64" resumed",
+		   count_handshakes(), connections_accepted, connections_rejected, connections_resumed);
 	logger(LOG_DEBUG, "End of connections.");
 }
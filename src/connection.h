@@ -25,11 +25,20 @@
 #include <openssl/evp.h>
 
 #include "avl_tree.h"
+#include "event.h"
+#include "worker.h"
 
 #define OPTION_INDIRECT		0x0001
 #define OPTION_TCPONLY		0x0002
 #define OPTION_PMTU_DISCOVERY	0x0004
 #define OPTION_CLAMP_MSS	0x0008
+#define OPTION_AGGREGATE	0x0010
+#define OPTION_FRAGMENT		0x0020
+#define OPTION_BULK		0x0040
+
+#define MAX_REQUEST_ARGS	256		/* arguments of a request beyond this are ignored */
+
+#define RESUME_NONCE_LENGTH	16		/* of the nonces in the ID of a connection that may resume a session */
 
 typedef struct connection_status_t {
 	unsigned int pinged:1;				/* sent ping */
@@ -41,13 +50,32 @@ typedef struct connection_status_t {
 	unsigned int encryptout:1;			/* 1 if we can encrypt outgoing traffic */
 	unsigned int decryptin:1;			/* 1 if we have to decrypt incoming traffic */
 	unsigned int mst:1;				/* 1 if this connection is part of a minimum spanning tree */
-	unsigned int unused:23;
+	unsigned int flush:1;				/* 1 if the outbuf has data that flush_meta_all() has yet to send */
+	unsigned int metacompression:1;			/* 1 if he can decompress meta data */
+	unsigned int compressout:1;			/* 1 if we compress outgoing traffic */
+	unsigned int compressflush:1;			/* 1 if the compressor holds data that has not been flushed yet */
+	unsigned int decompressin:1;			/* 1 if we have to decompress incoming traffic */
+	unsigned int waiting:1;				/* 1 if a request is waiting for a worker thread, and input is not looked at */
+	unsigned int codel_dropping:1;			/* 1 if CoDel is dropping packets from the packet queue */
+	unsigned int resumable:1;			/* 1 if he sent a nonce in his ID, so he can resume a session */
+	unsigned int resuming:1;			/* 1 if we offered to resume a session, and wait for him to take it or not */
+	unsigned int unused:14;
 } connection_status_t;
 
 #include "edge.h"
 #include "net.h"
 #include "node.h"
 
+/* A connect to another of his addresses, racing the one on the connection's own socket */
+
+typedef struct attempt_t {
+	struct connection_t *c;
+	int socket;
+	union sockaddr_t address;
+	io_t io;
+	struct attempt_t *next;
+} attempt_t;
+
 typedef struct connection_t {
 	char *name;					/* name he claims to have */
 
@@ -56,11 +84,14 @@ typedef struct connection_t {
 	int protocol_version;		/* used protocol */
 
 	int socket;					/* socket used for this connection */
+	io_t io;					/* readiness notification for the socket */
 	uint32_t options;			/* options for this connection */
 	connection_status_t status;	/* status info */
 	int estimated_weight;		/* estimation for the weight of the edge for this connection */
-	struct timeval start;		/* time this connection was started, used for above estimation */
+	uint64_t start;			/* event_clock() when this connection was started, used for above estimation */
 	struct outgoing_t *outgoing;	/* used to keep track of outgoing connections */
+	struct attempt_t *attempts;	/* connects to his other addresses, racing the one on socket */
+	event_t attemptevent;		/* starts the next of those */
 
 	struct node_t *node;		/* node associated with the other end */
 	struct edge_t *edge;		/* edge associated with this connection */
@@ -78,14 +109,26 @@ typedef struct connection_t {
 	const EVP_MD *outdigest;
 	int inmaclength;
 	int outmaclength;
-	int incompression;
-	int outcompression;
+	int incompression;			/* zlib level he compresses meta data with, 0 = no compression */
+	int outcompression;			/* zlib level we compress meta data with, 0 = no compression */
+	struct z_stream_s *instream;		/* Decompressor for meta data from him */
+	struct z_stream_s *outstream;		/* Compressor for meta data to him */
 	char *mychallenge;			/* challenge we received from him */
 	char *hischallenge;			/* challenge we sent to him */
+	struct resume_t *resume;		/* session that is being resumed, see resume.c */
+	char mynonce[RESUME_NONCE_LENGTH];	/* nonce we sent in our ID */
+	char hisnonce[RESUME_NONCE_LENGTH];	/* nonce he sent in his ID */
 
 	char buffer[MAXBUFSIZE];	/* metadata input buffer */
+	int bufstart;				/* index of first unprocessed byte in buffer */
 	int buflen;					/* bytes read into buffer */
+	char *request;				/* incoming request, points into buffer */
 	int reqlen;					/* length of incoming request */
+	int argc;					/* number of arguments of the incoming request */
+	char **argv;				/* arguments of the incoming request, see split_request() */
+	char *inzbuf;				/* compressed metadata input buffer, only used if decompressin */
+	int inzstart;				/* index of first byte in inzbuf that has not been inflated yet */
+	int inzlen;					/* number of bytes left to inflate in inzbuf */
 	int tcplen;					/* length of incoming TCPpacket */
 	int allow_request;			/* defined if there's only one request possible */
 
@@ -94,10 +137,21 @@ typedef struct connection_t {
 	int outbuflen;				/* number of meaningful bytes in output buffer */
 	int outbufsize;				/* number of bytes allocated to output buffer */
 
-	time_t last_ping_time;		/* last time we saw some activity from the other end or pinged them */
-	time_t last_flushed_time;	/* last time buffer was empty. Only meaningful if outbuflen > 0 */
+	struct meta_packet_t *packetq;		/* packets waiting to be sent over TCP, behind the requests in outbuf */
+	struct meta_packet_t *packetq_tail;
+	int packetqlen;				/* number of bytes of packet data in packetq */
+	int codel_count;			/* CoDel state for packetq, see meta.c */
+	int codel_lastcount;
+	uint64_t codel_first_above;
+	uint64_t codel_drop_next;
+
+	uint64_t last_ping_time;	/* event_clock() when he connected or we last pinged him */
+	uint64_t ping_sent;		/* event_clock_usec() when the last PING was sent */
+	uint64_t last_flushed_time;	/* event_clock() when the buffer was last empty. Only meaningful if outbuflen > 0 */
+	event_t pingevent;		/* sends the next PING and checks for timeouts */
 
 	avl_tree_t *config_tree;	/* Pointer to configuration tree belonging to him */
+	struct job_t *job;		/* job a worker thread is doing for this connection */
 } connection_t;
 
 extern avl_tree_t *connection_tree;
@@ -108,6 +162,7 @@ extern void exit_connections(void);
 extern connection_t *new_connection(void) __attribute__ ((__malloc__));
 extern void free_connection(connection_t *);
 extern void free_connection_partially(connection_t *);
+extern void cancel_attempts(connection_t *);
 extern void connection_add(connection_t *);
 extern void connection_del(connection_t *);
 extern void dump_connections(void);
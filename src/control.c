@@ -0,0 +1,783 @@
+/*
+    control.c -- UNIX socket for monitoring a running tinc daemon
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "system.h"
+
+#ifdef HAVE_SYS_UN_H
+#include <sys/un.h>
+#endif
+
+#include "avl_tree.h"
+#include "capture.h"
+#include "connection.h"
+#include "control.h"
+#include "edge.h"
+#include "flow.h"
+#include "io.h"
+#include "list.h"
+#include "logger.h"
+#include "net.h"
+#include "netutl.h"
+#include "node.h"
+#include "profile.h"
+#include "resume.h"
+#include "subnet.h"
+#include "utils.h"
+#include "xalloc.h"
+
+/*
+  Clients connect to the control socket and send commands, one per line:
+
+    nodes | edges | subnets | connections | stats | capture | watch  [json]
+    pcap <filename>  [json]
+    flows [reset]  [json]
+
+  Each command is answered with one record per line, followed by an "end"
+  record. Records are written as "type key=value ...", or as one JSON object
+  per line if "json" is given. The answer is assembled in memory and written
+  out by the event loop whenever the socket is writable, so a slow client
+  never blocks the daemon, and nothing is sent to the log.
+
+  "stats" is followed by a udp_socket record for every UDP socket, with its
+  current buffer sizes and how often they were found full.
+
+  After "watch" has answered with all nodes, edges and subnets, every change
+  to them follows as a node, edge or subnet record with an "event" field and
+  a timestamp, as it happens. A client that falls more than MAX_BACKLOG
+  bytes behind is disconnected, and can reconnect to get a new snapshot.
+*/
+
+char *controlsocketname = NULL;
+
+#ifdef HAVE_SYS_UN_H
+
+#define MAX_COMMAND 256
+#define MAX_BACKLOG (4 * 1024 * 1024)
+
+typedef struct control_t {
+	int fd;
+	io_t io;
+	list_node_t *node;			/* entry in control_list */
+	bool json;				/* current answer is in JSON */
+	bool watching;				/* gets a record for every change */
+	bool watchjson;				/* those are in JSON */
+	int nfields;				/* fields written in the current record */
+	char inbuf[MAX_COMMAND];
+	int inlen;
+	char *outbuf;
+	int outsize;
+	int outstart;
+	int outlen;
+} control_t;
+
+static int control_fd = -1;
+static io_t control_io;
+static list_t *control_list;
+static int watchers;
+
+static void out_printf(control_t *ctl, const char *format, ...) __attribute__ ((__format__(printf, 2, 3)));
+
+static void out_printf(control_t *ctl, const char *format, ...) {
+	va_list ap;
+	int len;
+
+	if(ctl->outstart && ctl->outstart == ctl->outlen)
+		ctl->outstart = ctl->outlen = 0;
+
+	for(;;) {
+		int room = ctl->outsize - ctl->outlen;
+
+		va_start(ap, format);
+		len = vsnprintf(ctl->outbuf + ctl->outlen, room, format, ap);
+		va_end(ap);
+
+		if(len < 0)
+			return;
+
+		if(len < room)
+			break;
+
+		ctl->outsize = (ctl->outsize + len) * 2;
+		ctl->outbuf = xrealloc(ctl->outbuf, ctl->outsize);
+	}
+
+	ctl->outlen += len;
+}
+
+static void out_char(control_t *ctl, char c) {
+	if(ctl->outlen + 1 >= ctl->outsize) {
+		ctl->outsize = (ctl->outsize + 1) * 2;
+		ctl->outbuf = xrealloc(ctl->outbuf, ctl->outsize);
+	}
+
+	ctl->outbuf[ctl->outlen++] = c;
+}
+
+/* Strings are quoted for JSON, and have their blanks replaced in the line format */
+
+static void out_string(control_t *ctl, const char *s) {
+	if(!ctl->json) {
+		for(; *s; s++)
+			out_char(ctl, isspace((unsigned char)*s) || *s == '=' ? '_' : *s);
+		return;
+	}
+
+	out_char(ctl, '"');
+
+	for(; *s; s++) {
+		if(*s == '"' || *s == '\\') {
+			out_char(ctl, '\\');
+			out_char(ctl, *s);
+		} else if((unsigned char)*s < 0x20)
+			out_printf(ctl, "\\u%04x", *s);
+		else
+			out_char(ctl, *s);
+	}
+
+	out_char(ctl, '"');
+}
+
+static void record_begin(control_t *ctl, const char *type) {
+	ctl->nfields = 0;
+
+	if(ctl->json) {
+		out_printf(ctl, "{\"type\":");
+		out_string(ctl, type);
+		ctl->nfields++;
+	} else
+		out_printf(ctl, "%s", type);
+}
+
+static void record_end(control_t *ctl) {
+	out_printf(ctl, ctl->json ? "}\n" : "\n");
+}
+
+static void field_key(control_t *ctl, const char *key) {
+	if(ctl->json)
+		out_printf(ctl, "%s\"%s\":", ctl->nfields++ ? "," : "", key);
+	else
+		out_printf(ctl, " %s=", key);
+}
+
+static void field_str(control_t *ctl, const char *key, const char *value) {
+	field_key(ctl, key);
+	out_string(ctl, value ? value : "-");
+}
+
+static void field_int(control_t *ctl, const char *key, int64_t value) {
+	field_key(ctl, key);
+	out_printf(ctl, "%"PRId64, value);
+}
+
+static void field_u64(control_t *ctl, const char *key, uint64_t value) {
+	field_key(ctl, key);
+	out_printf(ctl, "%"PRIu64, value);
+}
+
+static void field_address(control_t *ctl, const sockaddr_t *sa) {
+	char *address, *port;
+
+	if(sa->sa.sa_family == AF_UNSPEC)
+		return;
+
+	sockaddr2str(sa, &address, &port);
+	field_str(ctl, "address", address);
+	field_str(ctl, "port", port);
+	free(address);
+	free(port);
+}
+
+/* Set while the records of a change are written, NULL for dumps */
+
+static const char *event;
+static struct timeval event_tv;
+
+static void field_event(control_t *ctl) {
+	if(!event)
+		return;
+
+	field_str(ctl, "event", event);
+	field_int(ctl, "time", event_tv.tv_sec);
+	field_int(ctl, "usec", event_tv.tv_usec);
+}
+
+static void dump_control_nodes(control_t *ctl, const char *arg) {
+	for(avl_node_t *node = node_tree->head; node; node = node->next) {
+		node_t *n = node->data;
+		node_tunnel_t *t = n->tunnel;
+
+		record_begin(ctl, "node");
+		field_str(ctl, "name", n->name);
+		field_address(ctl, &n->address);
+		field_int(ctl, "reachable", n->status.reachable);
+		field_int(ctl, "validkey", n->status.validkey);
+		field_str(ctl, "nexthop", n->nexthop ? n->nexthop->name : NULL);
+		field_str(ctl, "via", n->via ? n->via->name : NULL);
+		field_int(ctl, "options", n->options);
+		field_int(ctl, "status", bitfield_to_int(&n->status, sizeof n->status));
+		field_int(ctl, "cipher", t && t->outcipher ? t->outcipher->nid : 0);
+		field_int(ctl, "digest", t && t->outdigest ? t->outdigest->type : 0);
+		field_int(ctl, "maclength", t ? t->outmaclength : 0);
+		field_int(ctl, "compression", t ? t->outcompression : 0);
+		field_int(ctl, "compressratio", t ? t->compressratio * 100 / 256 : 0);
+		field_int(ctl, "mtu", n->mtu);
+		field_int(ctl, "minmtu", n->minmtu);
+		field_int(ctl, "maxmtu", n->maxmtu);
+		field_u64(ctl, "in_packets", n->stats.in_packets);
+		field_u64(ctl, "in_bytes", n->stats.in_bytes);
+		field_u64(ctl, "out_packets", n->stats.out_packets);
+		field_u64(ctl, "out_bytes", n->stats.out_bytes);
+		field_u64(ctl, "tcp_packets", n->stats.tcp_packets);
+		field_u64(ctl, "nokey_packets", n->stats.nokey_packets);
+		field_u64(ctl, "toobig_packets", n->stats.toobig_packets);
+		field_u64(ctl, "replay_drops", n->stats.replay_drops);
+		field_u64(ctl, "mac_drops", n->stats.mac_drops);
+		field_u64(ctl, "tcp_drops", n->stats.tcp_drops);
+		field_u64(ctl, "queue_drops", n->stats.queue_drops);
+		field_u64(ctl, "rate_drops", n->stats.rate_drops);
+		record_end(ctl);
+	}
+}
+
+static void edge_record(control_t *ctl, const void *data) {
+	const edge_t *e = data;
+
+	record_begin(ctl, "edge");
+	field_event(ctl);
+	field_str(ctl, "from", e->from->name);
+	field_str(ctl, "to", e->to->name);
+	field_address(ctl, &e->address);
+	field_int(ctl, "options", e->options);
+	field_int(ctl, "weight", e->weight);
+	field_int(ctl, "rtt", e->rtt);
+	record_end(ctl);
+}
+
+static void dump_control_edges(control_t *ctl, const char *arg) {
+	for(avl_node_t *node = node_tree->head; node; node = node->next) {
+		node_t *n = node->data;
+
+		for(avl_node_t *node2 = n->edge_tree->head; node2; node2 = node2->next)
+			edge_record(ctl, node2->data);
+	}
+}
+
+static void subnet_record(control_t *ctl, const void *data) {
+	const subnet_t *subnet = data;
+	char netstr[MAXNETSTR];
+
+	if(!net2str(netstr, sizeof netstr, subnet))
+		return;
+
+	record_begin(ctl, "subnet");
+	field_event(ctl);
+	field_str(ctl, "subnet", netstr);
+	field_str(ctl, "owner", subnet->owner->name);
+	record_end(ctl);
+}
+
+static void dump_control_subnets(control_t *ctl, const char *arg) {
+	for(avl_node_t *node = subnet_tree->head; node; node = node->next)
+		subnet_record(ctl, node->data);
+}
+
+static void dump_control_connections(control_t *ctl, const char *arg) {
+	for(avl_node_t *node = connection_tree->head; node; node = node->next) {
+		connection_t *c = node->data;
+
+		record_begin(ctl, "connection");
+		field_str(ctl, "name", c->name);
+		field_address(ctl, &c->address);
+		field_int(ctl, "options", c->options);
+		field_int(ctl, "socket", c->socket);
+		field_int(ctl, "status", bitfield_to_int(&c->status, sizeof c->status));
+		field_int(ctl, "outbuflen", c->outbuflen);
+		field_int(ctl, "outbufsize", c->outbufsize);
+		record_end(ctl);
+	}
+}
+
+static void dump_control_stats(control_t *ctl, const char *arg) {
+	record_begin(ctl, "stats");
+	field_u64(ctl, "udp_rx_packets", udp_rx_packets);
+	field_u64(ctl, "udp_rx_batches", udp_rx_batches);
+	field_u64(ctl, "udp_tx_packets", udp_tx_packets);
+	field_u64(ctl, "udp_tx_calls", udp_tx_calls);
+	field_u64(ctl, "replay_late", replay_late);
+	field_u64(ctl, "replay_replayed", replay_replayed);
+	field_u64(ctl, "replay_farfuture", replay_farfuture);
+	field_u64(ctl, "compress_in_bytes", compress_in_bytes);
+	field_u64(ctl, "compress_out_bytes", compress_out_bytes);
+	field_u64(ctl, "compress_raw_packets", compress_raw_packets);
+	field_u64(ctl, "compress_shared_packets", compress_shared_packets);
+	field_u64(ctl, "connections_accepted", connections_accepted);
+	field_u64(ctl, "connections_rejected", connections_rejected);
+	field_u64(ctl, "connections_resumed", connections_resumed);
+	field_int(ctl, "handshakes", count_handshakes());
+	record_end(ctl);
+
+	for(int i = 0; i < listen_sockets; i++) {
+		const listen_socket_t *ls = &listen_socket[i];
+
+		for(int j = 0; j <= ls->shards; j++) {
+			const udp_buffer_t *buf = j ? &ls->shard[j - 1].buf : &ls->buf;
+
+			record_begin(ctl, "udp_socket");
+			field_int(ctl, "socket", i);
+			field_int(ctl, "shard", j);
+			field_int(ctl, "rcvbuf", buf->rcvbuf);
+			field_int(ctl, "sndbuf", buf->sndbuf);
+			field_u64(ctl, "rx_drops", buf->rx_drops);
+			field_u64(ctl, "tx_full", buf->tx_full);
+			record_end(ctl);
+		}
+	}
+}
+
+static void dump_control_memory(control_t *ctl, const char *arg) {
+	memory_use_t use[MEMORY_USES];
+	int n = get_memory_use(use);
+
+	for(int i = 0; i < n; i++) {
+		record_begin(ctl, "usage");
+		field_str(ctl, "name", use[i].name);
+		field_u64(ctl, "count", use[i].count);
+		field_u64(ctl, "bytes", use[i].bytes);
+		record_end(ctl);
+	}
+
+	for(xslab_t *slab = xslabs; slab; slab = slab->next) {
+		record_begin(ctl, "slab");
+		field_str(ctl, "name", slab->name);
+		field_int(ctl, "size", slab->size);
+		field_int(ctl, "used", slab->used);
+		field_int(ctl, "total", slab->total);
+		record_end(ctl);
+	}
+}
+
+/* The histograms are only cleared when asked to, with "profile reset" */
+
+static void dump_control_profile(control_t *ctl, const char *arg) {
+#ifdef ENABLE_PROFILING
+	char histogram[PROFILE_BUCKETS * 40];
+
+	for(int i = 0; i < PROFILE_STAGES; i++) {
+		const profile_histogram_t *h = &profile_histograms[i];
+		int len = 0;
+
+		histogram[0] = 0;
+
+		for(int j = 0; j < PROFILE_BUCKETS; j++)
+			if(h->buckets[j])
+				len += snprintf(histogram + len, sizeof histogram - len, "%s%"PRIu64":%"PRIu64,
+						len ? "," : "", (uint64_t)1 << j, h->buckets[j]);
+
+		record_begin(ctl, "profile");
+		field_str(ctl, "stage", profile_stage_names[i]);
+		field_str(ctl, "unit", profile_unit);
+		field_u64(ctl, "count", h->count);
+		field_u64(ctl, "total", h->total);
+		field_u64(ctl, "p50", profile_percentile(h, 50));
+		field_u64(ctl, "p90", profile_percentile(h, 90));
+		field_u64(ctl, "p99", profile_percentile(h, 99));
+		field_str(ctl, "histogram", histogram);
+		record_end(ctl);
+	}
+
+	if(arg && !strcasecmp(arg, "reset"))
+		profile_reset();
+#else
+	record_begin(ctl, "error");
+	field_str(ctl, "message", "built without --enable-profiling");
+	record_end(ctl);
+#endif
+}
+
+/* The flows with the most bytes first, with their counts estimated from the samples */
+
+static void dump_control_flows(control_t *ctl, const char *arg) {
+	char src[40], dst[40];
+	flow_t **sorted;
+	int count;
+
+	if(!flow_sampling) {
+		record_begin(ctl, "error");
+		field_str(ctl, "message", "FlowSampling is not enabled");
+		record_end(ctl);
+		return;
+	}
+
+	sorted = flow_sorted(&count);
+
+	record_begin(ctl, "flows");
+	field_int(ctl, "sampling", flow_sampling);
+	field_int(ctl, "count", count);
+	field_u64(ctl, "evictions", flow_evictions);
+	record_end(ctl);
+
+	for(int i = 0; i < count; i++) {
+		const flow_t *f = sorted[i];
+
+		flow_addresses(f, src, dst, sizeof src);
+
+		record_begin(ctl, "flow");
+		field_str(ctl, "node", f->node);
+		field_str(ctl, "direction", f->direction == FLOW_IN ? "in" : "out");
+		field_int(ctl, "type", f->type);
+		field_int(ctl, "protocol", f->protocol);
+		field_str(ctl, "src", src);
+		field_int(ctl, "sport", f->sport);
+		field_str(ctl, "dst", dst);
+		field_int(ctl, "dport", f->dport);
+		field_u64(ctl, "samples", f->samples);
+		field_u64(ctl, "packets", (uint64_t)f->samples * flow_sampling);
+		field_u64(ctl, "bytes", f->bytes * flow_sampling);
+		field_int(ctl, "first", f->first);
+		field_int(ctl, "last", f->last);
+		record_end(ctl);
+	}
+
+	free(sorted);
+
+	if(arg && !strcasecmp(arg, "reset"))
+		flow_reset();
+}
+
+/* The capture ring is drained, so every packet is shown only once */
+
+static void dump_control_capture(control_t *ctl, const char *arg) {
+	const capture_t *c;
+	char hex[2 * MAXSIZE + 1];
+
+	while((c = capture_next())) {
+		bin2hex((char *)c->data, hex, c->caplen);
+		hex[2 * c->caplen] = 0;
+
+		record_begin(ctl, "packet");
+		field_int(ctl, "time", c->tv.tv_sec);
+		field_int(ctl, "usec", c->tv.tv_usec);
+		field_str(ctl, "stage", capture_stage_names[c->stage]);
+		field_str(ctl, "node", c->node);
+		field_int(ctl, "len", c->len);
+		field_str(ctl, "data", hex);
+		record_end(ctl);
+	}
+}
+
+static void dump_control_pcap(control_t *ctl, const char *arg) {
+	int count;
+
+	if(!arg || !*arg) {
+		record_begin(ctl, "error");
+		field_str(ctl, "message", "no filename given");
+		record_end(ctl);
+		return;
+	}
+
+	if((count = capture_pcap(arg)) < 0) {
+		record_begin(ctl, "error");
+		field_str(ctl, "message", "could not write file");
+		record_end(ctl);
+		return;
+	}
+
+	record_begin(ctl, "pcap");
+	field_str(ctl, "file", arg);
+	field_int(ctl, "packets", count);
+	record_end(ctl);
+}
+
+/* A snapshot to apply the changes that follow to */
+
+static void dump_control_watch(control_t *ctl, const char *arg) {
+	dump_control_nodes(ctl, arg);
+	dump_control_edges(ctl, arg);
+	dump_control_subnets(ctl, arg);
+
+	if(!ctl->watching)
+		watchers++;
+
+	ctl->watching = true;
+	ctl->watchjson = ctl->json;
+}
+
+static const struct {
+	const char *name;
+	void (*dump)(control_t *, const char *);
+} control_commands[] = {
+	{"nodes", dump_control_nodes},
+	{"edges", dump_control_edges},
+	{"subnets", dump_control_subnets},
+	{"connections", dump_control_connections},
+	{"stats", dump_control_stats},
+	{"memory", dump_control_memory},
+	{"profile", dump_control_profile},
+	{"capture", dump_control_capture},
+	{"flows", dump_control_flows},
+	{"pcap", dump_control_pcap},
+	{"watch", dump_control_watch},
+	{NULL, NULL},
+};
+
+static void control_command(control_t *ctl, char *line) {
+	char *command = strtok(line, " \t\r");
+	char *arg = strtok(NULL, " \t\r");
+	char *format = arg ? strtok(NULL, " \t\r") : NULL;
+	int i;
+
+	/* The format comes last, after the argument of commands that take one */
+
+	if(arg && !strcasecmp(arg, "json")) {
+		format = arg;
+		arg = NULL;
+	}
+
+	ctl->json = format && !strcasecmp(format, "json");
+
+	for(i = 0; control_commands[i].name; i++)
+		if(command && !strcasecmp(command, control_commands[i].name))
+			break;
+
+	if(control_commands[i].name)
+		control_commands[i].dump(ctl, arg);
+	else {
+		record_begin(ctl, "error");
+		field_str(ctl, "message", "unknown command");
+		record_end(ctl);
+	}
+
+	record_begin(ctl, "end");
+	record_end(ctl);
+}
+
+static void free_control(control_t *ctl) {
+	if(ctl->watching)
+		watchers--;
+
+	io_del(&ctl->io);
+	close(ctl->fd);
+	free(ctl->outbuf);
+	free(ctl);
+}
+
+static void handle_control_io(void *data, int flags) {
+	control_t *ctl = data;
+
+	if(flags & IO_WRITE) {
+		int result = send(ctl->fd, ctl->outbuf + ctl->outstart, ctl->outlen - ctl->outstart, 0);
+
+		if(result < 0 && !sockwouldblock(sockerrno)) {
+			list_delete_node(control_list, ctl->node);
+			return;
+		}
+
+		if(result > 0)
+			ctl->outstart += result;
+	}
+
+	if(flags & IO_READ) {
+		int result = recv(ctl->fd, ctl->inbuf + ctl->inlen, sizeof ctl->inbuf - ctl->inlen, 0);
+
+		if(result <= 0) {
+			if(!result || !sockwouldblock(sockerrno))
+				list_delete_node(control_list, ctl->node);
+			return;
+		}
+
+		ctl->inlen += result;
+
+		char *line = ctl->inbuf, *newline;
+
+		while((newline = memchr(line, '\n', ctl->inbuf + ctl->inlen - line))) {
+			*newline = '\0';
+			control_command(ctl, line);
+			line = newline + 1;
+		}
+
+		ctl->inlen -= line - ctl->inbuf;
+		memmove(ctl->inbuf, line, ctl->inlen);
+
+		if(ctl->inlen == sizeof ctl->inbuf) {
+			list_delete_node(control_list, ctl->node);
+			return;
+		}
+	}
+
+	io_set(&ctl->io, ctl->outstart < ctl->outlen ? IO_READ | IO_WRITE : IO_READ);
+}
+
+static void handle_new_control_connection(void *data, int flags) {
+	int fd = accept(control_fd, NULL, NULL);
+
+	if(fd < 0) {
+		logger(LOG_ERR, "Accepting a new control connection failed: %s", sockstrerror(sockerrno));
+		return;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	control_t *ctl = xmalloc_and_zero(sizeof *ctl);
+	ctl->fd = fd;
+	ctl->node = list_insert_tail(control_list, ctl);
+	io_add(&ctl->io, handle_control_io, ctl, fd, IO_READ);
+}
+
+/* Send a record about a change to every client that watches */
+
+static void send_event(const char *what, void (*record)(control_t *, const void *), const void *data) {
+	list_node_t *node, *next;
+
+	event = what;
+	gettimeofday(&event_tv, NULL);
+
+	for(node = control_list->head; node; node = next) {
+		next = node->next;
+		control_t *ctl = node->data;
+
+		if(!ctl->watching)
+			continue;
+
+		ctl->json = ctl->watchjson;
+		record(ctl, data);
+
+		if(ctl->outlen - ctl->outstart > MAX_BACKLOG) {
+			logger(LOG_WARNING, "Control client is too far behind, disconnecting it");
+			list_delete_node(control_list, node);
+			continue;
+		}
+
+		io_set(&ctl->io, IO_READ | IO_WRITE);
+	}
+
+	event = NULL;
+}
+
+static void node_record(control_t *ctl, const void *data) {
+	const node_t *n = data;
+
+	record_begin(ctl, "node");
+	field_event(ctl);
+	field_str(ctl, "name", n->name);
+	field_address(ctl, &n->address);
+	field_int(ctl, "reachable", n->status.reachable);
+	field_str(ctl, "nexthop", n->nexthop ? n->nexthop->name : NULL);
+	field_str(ctl, "via", n->via ? n->via->name : NULL);
+	record_end(ctl);
+}
+
+void control_node_changed(const node_t *n) {
+	if(watchers)
+		send_event(n->status.reachable ? "up" : "down", node_record, n);
+}
+
+void control_edge_changed(const edge_t *e, const char *what) {
+	if(watchers)
+		send_event(what, edge_record, e);
+}
+
+void control_subnet_changed(const subnet_t *subnet, const char *what) {
+	if(watchers)
+		send_event(what, subnet_record, subnet);
+}
+
+bool init_control(void) {
+	struct sockaddr_un sa = {0};
+
+	if(!controlsocketname)
+		return true;
+
+	if(strlen(controlsocketname) >= sizeof sa.sun_path) {
+		logger(LOG_ERR, "ControlSocket name %s is too long", controlsocketname);
+		return false;
+	}
+
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, controlsocketname);
+
+	control_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if(control_fd < 0) {
+		logger(LOG_ERR, "Could not create control socket: %s", strerror(errno));
+		return false;
+	}
+
+	fcntl(control_fd, F_SETFD, FD_CLOEXEC);
+	fcntl(control_fd, F_SETFL, fcntl(control_fd, F_GETFL) | O_NONBLOCK);
+
+	/* Only the user tincd runs as may talk to it */
+
+	unlink(controlsocketname);
+	mode_t mask = umask(0077);
+	int result = bind(control_fd, (struct sockaddr *)&sa, sizeof sa);
+	umask(mask);
+
+	if(result < 0 || listen(control_fd, 3) < 0) {
+		logger(LOG_ERR, "Could not bind control socket to %s: %s", controlsocketname, strerror(errno));
+		close(control_fd);
+		control_fd = -1;
+		return false;
+	}
+
+	control_list = list_alloc((list_action_t) free_control);
+	io_add(&control_io, handle_new_control_connection, NULL, control_fd, IO_READ);
+
+	return true;
+}
+
+void exit_control(void) {
+	if(control_fd >= 0) {
+		list_delete_list(control_list);
+		io_del(&control_io);
+		close(control_fd);
+		control_fd = -1;
+		unlink(controlsocketname);
+	}
+
+	free(controlsocketname);
+	controlsocketname = NULL;
+}
+
+#else
+
+bool init_control(void) {
+	if(controlsocketname) {
+		logger(LOG_ERR, "ControlSocket is not supported on this platform");
+		return false;
+	}
+
+	return true;
+}
+
+void exit_control(void) {
+	free(controlsocketname);
+	controlsocketname = NULL;
+}
+
+void control_node_changed(const node_t *n) {
+}
+
+void control_edge_changed(const edge_t *e, const char *what) {
+}
+
+void control_subnet_changed(const subnet_t *subnet, const char *what) {
+}
+
+#endif
@@ -0,0 +1,35 @@
+/*
+    control.h -- header for control.c
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __TINC_CONTROL_H__
+#define __TINC_CONTROL_H__
+
+struct node_t;
+struct edge_t;
+struct subnet_t;
+
+extern char *controlsocketname;
+
+extern bool init_control(void);
+extern void exit_control(void);
+extern void control_node_changed(const struct node_t *);
+extern void control_edge_changed(const struct edge_t *, const char *);
+extern void control_subnet_changed(const struct subnet_t *, const char *);
+
+#endif							/* __TINC_CONTROL_H__ */
@@ -196,7 +196,7 @@ static bool setup_device(void) {
 		/* Pass packets */
 
 		for(;;) {
-			ReadFile(device_handle, buf, MTU, &lenin, NULL);
+			ReadFile(device_handle, buf, max_frame_size, &lenin, NULL);
 			write(sp[1], buf, lenin);
 		}
 	}
@@ -228,7 +228,7 @@ static void close_device(void) {
 static bool read_packet(vpn_packet_t *packet) {
 	int lenin;
 
-	if((lenin = read(sp[0], packet->data, MTU)) <= 0) {
+	if((lenin = read(sp[0], packet->data, max_frame_size)) <= 0) {
 		logger(LOG_ERR, "Error while reading from %s %s: %s", device_info,
 			   device, strerror(errno));
 		return false;
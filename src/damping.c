@@ -0,0 +1,328 @@
+/*
+    damping.c -- suppress updates of flapping edges
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "system.h"
+
+#include "avl_tree.h"
+#include "damping.h"
+#include "edge.h"
+#include "graph.h"
+#include "logger.h"
+#include "netutl.h"
+#include "protocol.h"
+#include "utils.h"
+#include "xalloc.h"
+
+/*
+  Every update of an edge that another node sends us costs a graph run,
+  perhaps scripts, and a broadcast to all our other peers. A node that keeps
+  deleting and adding the same edges makes every node on the VPN pay for it.
+
+  So, like BGP route flap damping, every deletion or change of an edge adds
+  to its penalty, which halves every damping_half_life seconds. When the
+  penalty gets above damping_suppress, the edge is taken out of our graph,
+  and updates of it are no longer applied or forwarded. Only the latest one
+  is held, and applied and sent on once the penalty has decayed back to
+  damping_reuse. The penalty is capped, so no edge is suppressed for longer
+  than four half lives after its last update. Edges of our own are never
+  damped, we know their state better than anyone.
+
+  Only edges with a penalty have an entry here, and it is forgotten once the
+  penalty has decayed to half of damping_reuse.
+*/
+
+bool damping = true;
+int damping_half_life = 60;
+int damping_suppress = 3000;
+int damping_reuse = 750;
+
+static avl_tree_t *damping_tree;
+
+static int damping_compare(const damping_t *a, const damping_t *b) {
+	int result = strcmp(a->from, b->from);
+
+	return result ? result : strcmp(a->to, b->to);
+}
+
+static void free_damping(damping_t *d) {
+	event_del(&d->event);
+	sockaddrfree(&d->address);
+	free(d->from);
+	free(d->to);
+	free(d);
+}
+
+void init_damping(void) {
+	damping_tree = avl_alloc_tree((avl_compare_t) damping_compare, (avl_action_t) free_damping);
+}
+
+void exit_damping(void) {
+	avl_delete_tree(damping_tree);
+}
+
+static damping_t *lookup_damping(const node_t *from, const node_t *to) {
+	damping_t v;
+
+	v.from = from->name;
+	v.to = to->name;
+
+	return avl_search(damping_tree, &v);
+}
+
+/* 2^(-i/4) in 1/1024ths; the penalty decays in steps of a quarter half life */
+
+static const unsigned int decay_table[4] = {1024, 861, 724, 609};
+
+static unsigned int decay_steps(unsigned int penalty, uint64_t steps) {
+	if(steps >= 128)
+		return 0;
+
+	return (uint64_t)(penalty >> (steps / 4)) * decay_table[steps % 4] >> 10;
+}
+
+static unsigned int current_penalty(const damping_t *d) {
+	return decay_steps(d->penalty, (now_msec - d->updated) * 4 / (damping_half_life * 1000ULL));
+}
+
+/* Milliseconds until the penalty has decayed to the given value */
+
+static int decay_time(const damping_t *d, unsigned int target) {
+	uint64_t steps = 0, elapsed;
+
+	while(decay_steps(d->penalty, steps) > target)
+		steps++;
+
+	elapsed = (steps * damping_half_life * 1000 + 3) / 4;
+
+	return elapsed > now_msec - d->updated ? elapsed - (now_msec - d->updated) : 0;
+}
+
+static void damping_handler(void *data);
+
+static void schedule(damping_t *d) {
+	unsigned int target = d->suppressed ? damping_reuse : damping_reuse / 2;
+
+	event_add(&d->event, damping_handler, d, decay_time(d, target));
+}
+
+/* Apply the update that was held while the edge was suppressed, and tell the others */
+
+static void reuse(damping_t *d) {
+	node_t *from = lookup_node(d->from);
+	node_t *to = lookup_node(d->to);
+	edge_t *e;
+
+	logger(LOG_NOTICE, "No longer suppressing updates of edge %s to %s", d->from, d->to);
+
+	d->suppressed = false;
+
+	if(!d->present) {
+		if(!from || !to)
+			return;
+
+		e = lookup_edge(from, to);
+
+		if(e)
+			graph_del_edge(e);
+
+		if(!tunnelserver) {
+			edge_t v = {.from = from, .to = to};
+			send_del_edge(everyone, &v);
+		}
+
+		return;
+	}
+
+	if(!from) {
+		from = new_node();
+		from->name = xstrdup(d->from);
+		node_add(from);
+	}
+
+	if(!to) {
+		to = new_node();
+		to->name = xstrdup(d->to);
+		node_add(to);
+	}
+
+	e = lookup_edge(from, to);
+
+	if(e)
+		graph_del_edge(e);
+
+	e = new_edge();
+	e->from = from;
+	e->to = to;
+	sockaddrcpy(&e->address, &d->address);
+	e->options = d->options;
+	e->weight = d->weight;
+
+	graph_add_edge(e);
+
+	if(!tunnelserver)
+		send_add_edge(everyone, e);
+}
+
+static void damping_handler(void *data) {
+	damping_t *d = data;
+
+	if(d->suppressed) {
+		if(current_penalty(d) > (unsigned int)damping_reuse) {
+			schedule(d);
+			return;
+		}
+
+		reuse(d);
+		schedule(d);
+		return;
+	}
+
+	avl_delete(damping_tree, d);
+}
+
+/* Add a penalty to an edge; true if its updates are suppressed now */
+
+static bool penalize(damping_t *d, unsigned int penalty) {
+	unsigned int ceiling = damping_reuse << 4;
+	node_t *from, *to;
+	edge_t *e;
+
+	if(ceiling < (unsigned int)damping_suppress)
+		ceiling = damping_suppress;
+
+	d->penalty = current_penalty(d) + penalty;
+	d->updated = now_msec;
+
+	if(d->penalty > ceiling)
+		d->penalty = ceiling;
+
+	if(!d->suppressed && d->penalty > (unsigned int)damping_suppress) {
+		logger(LOG_NOTICE, "Edge %s to %s is flapping, suppressing its updates", d->from, d->to);
+		d->suppressed = true;
+
+		/* A flapping edge is best treated as down */
+
+		from = lookup_node(d->from);
+		to = lookup_node(d->to);
+		e = from && to ? lookup_edge(from, to) : NULL;
+
+		if(e)
+			graph_del_edge(e);
+	}
+
+	schedule(d);
+
+	return d->suppressed;
+}
+
+/* Called for every ADD_EDGE, with the penalty of the change it makes;
+   if it returns true, the update is held and should not be applied or forwarded */
+
+bool damp_add_edge(node_t *from, node_t *to, const sockaddr_t *address, uint32_t options, int weight, unsigned int penalty) {
+	damping_t *d;
+
+	if(!damping || from == myself)
+		return false;
+
+	d = lookup_damping(from, to);
+
+	if(!d) {
+		if(!penalty)
+			return false;
+
+		d = xmalloc_and_zero(sizeof *d);
+		d->from = xstrdup(from->name);
+		d->to = xstrdup(to->name);
+		d->updated = now_msec;
+		avl_insert(damping_tree, d);
+	}
+
+	if(!penalize(d, penalty))
+		return false;
+
+	d->present = true;
+	sockaddrfree(&d->address);
+	sockaddrcpy(&d->address, address);
+	d->options = options;
+	d->weight = weight;
+
+	ifdebug(PROTOCOL) logger(LOG_DEBUG, "Holding %s of suppressed edge %s to %s", "ADD_EDGE", d->from, d->to);
+
+	return true;
+}
+
+/* Called for every DEL_EDGE, whether the edge is known or not */
+
+bool damp_del_edge(node_t *from, node_t *to, bool known) {
+	damping_t *d;
+
+	if(!damping || from == myself)
+		return false;
+
+	d = lookup_damping(from, to);
+
+	if(!d) {
+		if(!known)
+			return false;
+
+		d = xmalloc_and_zero(sizeof *d);
+		d->from = xstrdup(from->name);
+		d->to = xstrdup(to->name);
+		d->updated = now_msec;
+		avl_insert(damping_tree, d);
+	}
+
+	/* Deleting an edge we do not know about again does not count */
+
+	if(!known && !d->suppressed)
+		return false;
+
+	if(!penalize(d, known ? DAMPING_PENALTY_DEL : 0))
+		return false;
+
+	d->present = false;
+	sockaddrfree(&d->address);
+	memset(&d->address, 0, sizeof d->address);
+
+	ifdebug(PROTOCOL) logger(LOG_DEBUG, "Holding %s of suppressed edge %s to %s", "DEL_EDGE", d->from, d->to);
+
+	return true;
+}
+
+int damping_count(void) {
+	int count = 0;
+
+	for(avl_node_t *node = damping_tree->head; node; node = node->next)
+		count++;
+
+	return count;
+}
+
+void dump_damping(void) {
+	logger(LOG_DEBUG, "Flapping edges:");
+
+	for(avl_node_t *node = damping_tree->head; node; node = node->next) {
+		damping_t *d = node->data;
+
+		logger(LOG_DEBUG, " %s to %s penalty %u%s", d->from, d->to, current_penalty(d),
+				d->suppressed ? (d->present ? " suppressed, held up" : " suppressed, held down") : "");
+	}
+
+	logger(LOG_DEBUG, "End of flapping edges.");
+}
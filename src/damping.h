@@ -0,0 +1,62 @@
+/*
+    damping.h -- header for damping.c
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __TINC_DAMPING_H__
+#define __TINC_DAMPING_H__
+
+#include "event.h"
+#include "net.h"
+#include "node.h"
+
+/* Penalties for the updates of an edge, as in BGP route flap damping (RFC 2439) */
+
+#define DAMPING_PENALTY_DEL 1000		/* the edge was deleted */
+#define DAMPING_PENALTY_CHANGE 500		/* its address or options changed */
+#define DAMPING_PENALTY_WEIGHT 100		/* only its weight changed */
+
+typedef struct damping_t {
+	char *from;				/* names, the nodes may be deleted while this is kept */
+	char *to;
+
+	unsigned int penalty;			/* at the time of the last update */
+	uint64_t updated;			/* now_msec of the last update */
+	bool suppressed;			/* updates are held until penalty decays to damping_reuse */
+
+	/* The latest update while suppressed */
+	bool present;
+	sockaddr_t address;
+	uint32_t options;
+	int weight;
+
+	event_t event;				/* time of reuse, or of forgetting about the edge */
+} damping_t;
+
+extern bool damping;
+extern int damping_half_life;
+extern int damping_suppress;
+extern int damping_reuse;
+
+extern void init_damping(void);
+extern void exit_damping(void);
+extern bool damp_add_edge(node_t *, node_t *, const sockaddr_t *, uint32_t, int, unsigned int);
+extern bool damp_del_edge(node_t *, node_t *, bool);
+extern int damping_count(void);
+extern void dump_damping(void);
+
+#endif							/* __TINC_DAMPING_H__ */
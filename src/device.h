@@ -34,6 +34,10 @@ typedef struct devops_t {
 	bool (*read)(struct vpn_packet_t *);
 	bool (*write)(struct vpn_packet_t *);
 	void (*dump_stats)(void);
+	bool (*pending)(void);		/* optional, true if read() has more packets without reading from the device */
+	void (*flush)(void);		/* optional, called once per iteration of the main loop to send what write() queued */
+	int (*read_batch)(struct vpn_packet_t **, int);		/* optional, reads up to that many packets, returns how many or -1 on error */
+	int (*write_batch)(struct vpn_packet_t **, int);	/* optional, writes that many packets, returns how many were written or -1 */
 } devops_t;
 
 extern const devops_t os_devops;
@@ -21,7 +21,9 @@
 #include "system.h"
 
 #include "avl_tree.h"
+#include "control.h"
 #include "edge.h"
+#include "graph.h"
 #include "logger.h"
 #include "netutl.h"
 #include "node.h"
@@ -68,34 +70,57 @@ void exit_edges(void) {
 
 /* Creation and deletion of connection elements */
 
+static xslab_t edge_slab = XSLAB_INIT("edge", edge_t);
+
 edge_t *new_edge(void) {
-	return xmalloc_and_zero(sizeof(edge_t));
+	return xslab_alloc_and_zero(&edge_slab);
 }
 
 void free_edge(edge_t *e) {
 	sockaddrfree(&e->address);
 
-	free(e);
+	xslab_free(&edge_slab, e);
 }
 
 void edge_add(edge_t *e) {
 	avl_insert(edge_weight_tree, e);
 	avl_insert(e->from->edge_tree, e);
+	e->to->inedges++;
 
 	e->reverse = lookup_edge(e->to, e->from);
 
 	if(e->reverse)
 		e->reverse->reverse = e;
+
+	graph_edge_added(e);
+	control_edge_changed(e, "add");
 }
 
 void edge_del(edge_t *e) {
+	control_edge_changed(e, "del");
+	graph_edge_deleted(e);
+
 	if(e->reverse)
 		e->reverse->reverse = NULL;
 
+	e->to->inedges--;
 	avl_delete(edge_weight_tree, e);
 	avl_delete(e->from->edge_tree, e);
 }
 
+/* The trees sorted on weight need the edge taken out while its weight changes */
+
+void edge_set_weight(edge_t *e, int weight) {
+	graph_edge_deleted(e);
+	avl_delete(edge_weight_tree, e);
+
+	e->weight = weight;
+
+	avl_insert(edge_weight_tree, e);
+	graph_edge_added(e);
+	control_edge_changed(e, "weight");
+}
+
 edge_t *lookup_edge(node_t *from, node_t *to) {
 	edge_t v;
 	
@@ -118,8 +143,8 @@ void dump_edges(void) {
 		for(node2 = n->edge_tree->head; node2; node2 = node2->next) {
 			e = node2->data;
 			address = sockaddr2hostname(&e->address);
-			logger(LOG_DEBUG, " %s to %s at %s options %x weight %d",
-				   e->from->name, e->to->name, address, e->options, e->weight);
+			logger(LOG_DEBUG, " %s to %s at %s options %x weight %d rtt %d.%03d ms",
+				   e->from->name, e->to->name, address, e->options, e->weight, e->rtt / 1000, e->rtt % 1000);
 			free(address);
 		}
 	}
@@ -33,9 +33,14 @@ typedef struct edge_t {
 
 	uint32_t options;			/* options turned on for this edge */
 	int weight;					/* weight of this edge */
+	int rtt;					/* smoothed round trip time of PING/PONG in microseconds, 0 if unknown */
 
 	struct connection_t *connection;	/* connection associated with this edge, if available */
 	struct edge_t *reverse;		/* edge in the opposite direction, if available */
+
+	unsigned int sssp_generation;		/* last run of sssp_bfs() in which this edge updated e->to */
+	unsigned int mst_generation;		/* last run of mst_kruskal() that put this edge in the tree */
+	unsigned int mst_pending;		/* position in the list of edges graph.c has yet to sort in, plus one */
 } edge_t;
 
 extern avl_tree_t *edge_weight_tree;	/* Tree with all known edges sorted on weight */
@@ -48,6 +53,7 @@ extern avl_tree_t *new_edge_tree(void) __attribute__ ((__malloc__));
 extern void free_edge_tree(avl_tree_t *);
 extern void edge_add(edge_t *);
 extern void edge_del(edge_t *);
+extern void edge_set_weight(edge_t *, int);
 extern edge_t *lookup_edge(struct node_t *, struct node_t *);
 extern void dump_edges(void);
 
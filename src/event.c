@@ -20,95 +20,328 @@
 
 #include "system.h"
 
-#include "avl_tree.h"
 #include "event.h"
 #include "utils.h"
-#include "xalloc.h"
 
-avl_tree_t *event_tree;
-extern time_t now;
+/*
+  Pending events are kept in a hierarchical timer wheel with a resolution of
+  one millisecond. Level 0 has a slot for each of the next 256 milliseconds,
+  each slot of level 1 covers 256 milliseconds, and so on. Whenever level 0
+  wraps around, the events in the next slot of level 1 are moved down to the
+  level below, and likewise for the higher levels when those wrap around.
+
+  Adding and deleting an event is O(1) and never allocates memory, since the
+  event_t itself is linked into the wheel.
+*/
 
-static int id;
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
 
-static int event_compare(const event_t *a, const event_t *b) {
-	if(a->time > b->time)
-		return 1;
+static event_t *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static unsigned int wheel_count[WHEEL_LEVELS];
 
-	if(a->time < b->time)
-		return -1;
+/* Events whose time has come, waiting to be returned by get_expired_event() */
+
+static event_t *expired;
+
+/* All milliseconds before this one have been processed */
+
+static uint64_t wheel_time;
+
+/*
+  The daemon keeps time in milliseconds on the monotonic clock, so jumps of
+  the wall clock do not affect timers. It is offset to start at the wall
+  clock time, which keeps the whole seconds of it usable as a time_t.
+  Reading the clock costs a system call on some platforms, so now_msec holds
+  the time at the start of the current iteration of the main loop.
+*/
+
+uint64_t now_msec = 0;
+
+static uint64_t clock_offset = 0;
+
+static uint64_t monotonic_usec(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
 
-	return a->id - b->id;
+	if(!clock_gettime(CLOCK_MONOTONIC, &ts))
+		return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
-void init_events(void) {
-	event_tree = avl_alloc_tree((avl_compare_t) event_compare, (avl_action_t) free_event);
+static uint64_t monotonic_clock(void) {
+	return monotonic_usec() / 1000;
 }
 
-void exit_events(void) {
-	avl_delete_tree(event_tree);
+/* The mesh simulator runs many daemons in one process, each on a clock that only moves when it says so */
+
+static bool simulated_clock = false;
+
+uint64_t event_clock(void) {
+	if(simulated_clock)
+		return now_msec;
+
+	return monotonic_clock() + clock_offset;
 }
 
-void expire_events(void) {
-	avl_node_t *node;
-	event_t *event;
-	time_t diff;
+/* The same clock in microseconds, for measuring round trip times */
 
-	/*
-	 * Make all events appear expired by substracting the difference between
-         * the expiration time of the last event and the current time.
-	 */
+uint64_t event_clock_usec(void) {
+	if(simulated_clock)
+		return now_msec * 1000;
 
-	if(!event_tree->tail)
-		return;
+	return monotonic_usec() + clock_offset * 1000;
+}
+
+void set_clock(uint64_t msec) {
+	simulated_clock = true;
+	now_msec = msec;
+}
 
-	event = event_tree->tail->data;
-	if(event->time <= now)
+void update_clock(void) {
+	now_msec = event_clock();
+}
+
+static void event_link(event_t **head, event_t *event) {
+	event->next = *head;
+	if(event->next)
+		event->next->pprev = &event->next;
+	event->pprev = head;
+	*head = event;
+}
+
+static void event_unlink(event_t *event) {
+	*event->pprev = event->next;
+	if(event->next)
+		event->next->pprev = event->pprev;
+	event->next = NULL;
+	event->pprev = NULL;
+}
+
+static void event_insert(event_t *event) {
+	uint64_t delta, time = event->time;
+	int level;
+
+	if(time < wheel_time) {
+		event->level = -1;
+		event_link(&expired, event);
 		return;
+	}
+
+	delta = time - wheel_time;
+
+	for(level = 0; level < WHEEL_LEVELS - 1; level++)
+		if(delta < (uint64_t)1 << (WHEEL_BITS * (level + 1)))
+			break;
 
-	diff = event->time - now;
-	
-	for(node = event_tree->head; node; node = node->next) {
-		event = node->data;
-		event->time -= diff;
+	/* Events too far in the future go in the last slot, and are put back when that slot is reached */
+
+	if(delta >= (uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+		time = wheel_time + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+	event->level = level;
+	event_link(&wheel[level][(time >> (WHEEL_BITS * level)) & WHEEL_MASK], event);
+	wheel_count[level]++;
+}
+
+static void event_remove(event_t *event) {
+	if(event->level >= 0)
+		wheel_count[event->level]--;
+
+	event_unlink(event);
+}
+
+/* Move all events of a slot one or more levels down */
+
+static void cascade(int level) {
+	event_t **slot = &wheel[level][(wheel_time >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+	while(*slot) {
+		event_t *event = *slot;
+		event_remove(event);
+		event_insert(event);
 	}
 }
 
-event_t *new_event(void) {
-	return xmalloc_and_zero(sizeof(event_t));
+/* Process all milliseconds up to and including the current one */
+
+static void advance(void) {
+	uint64_t clock = event_clock();
+
+	while(wheel_time <= clock) {
+		int total = 0;
+
+		for(int level = 0; level < WHEEL_LEVELS; level++)
+			total += wheel_count[level];
+
+		if(!total) {
+			wheel_time = clock + 1;
+			break;
+		}
+
+		/* Skip ahead to the next level 0 wraparound if there is nothing to do before then */
+
+		if(!wheel_count[0] && (wheel_time & WHEEL_MASK)) {
+			uint64_t wrap = (wheel_time | WHEEL_MASK) + 1;
+
+			if(wrap > clock) {
+				wheel_time = clock + 1;
+				break;
+			}
+
+			wheel_time = wrap;
+			continue;
+		}
+
+		for(int level = 1; level < WHEEL_LEVELS; level++) {
+			if(wheel_time & (((uint64_t)1 << (WHEEL_BITS * level)) - 1))
+				break;
+			cascade(level);
+		}
+
+		event_t **slot = &wheel[0][wheel_time & WHEEL_MASK];
+		wheel_time++;
+
+		while(*slot) {
+			event_t *event = *slot;
+			event_remove(event);
+			event->level = -1;
+			event_link(&expired, event);
+		}
+	}
 }
 
-void free_event(event_t *event) {
-	free(event);
+void init_events(void) {
+	if(!clock_offset)
+		clock_offset = time(NULL) * 1000ULL - monotonic_clock();
+
+	memset(wheel, 0, sizeof wheel);
+	memset(wheel_count, 0, sizeof wheel_count);
+	expired = NULL;
+	wheel_time = event_clock();
+	update_clock();
 }
 
-void event_add(event_t *event) {
-	event->id = ++id;
-	avl_insert(event_tree, event);
+/* The events themselves belong to other structures, just make sure none of them is left linked */
+
+void exit_events(void) {
+	for(int level = 0; level < WHEEL_LEVELS; level++)
+		for(int i = 0; i < WHEEL_SLOTS; i++)
+			while(wheel[level][i])
+				event_remove(wheel[level][i]);
+
+	while(expired)
+		event_remove(expired);
+}
+
+/* Make all pending events expire right now */
+
+void expire_events(void) {
+	uint64_t clock = event_clock();
+
+	for(int level = 0; level < WHEEL_LEVELS; level++) {
+		for(int i = 0; i < WHEEL_SLOTS; i++) {
+			while(wheel[level][i]) {
+				event_t *event = wheel[level][i];
+				event_remove(event);
+				event->time = clock;
+				event->level = -1;
+				event_link(&expired, event);
+			}
+		}
+	}
+}
+
+/* (Re)schedule an event to run after timeout milliseconds */
+
+void event_add(event_t *event, event_handler_t handler, void *data, int timeout) {
+	if(event->pprev)
+		event_remove(event);
+
+	event->handler = handler;
+	event->data = data;
+	event->time = event_clock() + (timeout > 0 ? timeout : 0);
+
+	event_insert(event);
 }
 
 void event_del(event_t *event) {
-	avl_delete(event_tree, event);
+	if(event->pprev)
+		event_remove(event);
+}
+
+bool event_pending(const event_t *event) {
+	return event->pprev;
 }
 
+/* Returns and unlinks the next expired event, so its handler may add it again */
+
 event_t *get_expired_event(void) {
 	event_t *event;
 
-	if(event_tree->head) {
-		event = event_tree->head->data;
+	if(!expired)
+		advance();
+
+	event = expired;
+
+	if(event)
+		event_remove(event);
+
+	return event;
+}
+
+/*
+  Returns the number of milliseconds until the wheel needs attention again, or
+  -1 if there are no pending events at all. This is either the time the first
+  event on the lowest level expires, or when events on a higher level have to
+  be moved down.
+*/
+
+int event_timeout(void) {
+	uint64_t clock, next = UINT64_MAX;
+
+	if(expired)
+		return 0;
+
+	for(int level = 0; level < WHEEL_LEVELS; level++) {
+		int shift = WHEEL_BITS * level;
+		uint64_t base = wheel_time >> shift;
+
+		if(!wheel_count[level])
+			continue;
+
+		/* Level 0 slots correspond to exact times, higher levels become relevant
+		   when their slot is cascaded, which for the current slot has already
+		   happened unless we are exactly at its start. */
+
+		int first = (wheel_time & (((uint64_t)1 << shift) - 1)) ? 1 : 0;
 
-		if(event->time <= now) {
-			avl_node_t *node = event_tree->head;
-			avl_unlink_node(event_tree, node);
-			free(node);
-			return event;
+		for(int i = first; i <= WHEEL_SLOTS; i++) {
+			if(wheel[level][(base + i) & WHEEL_MASK]) {
+				if((base + i) << shift < next)
+					next = (base + i) << shift;
+				break;
+			}
 		}
+
 	}
 
-	return NULL;
-}
+	if(next == UINT64_MAX)
+		return -1;
+
+	clock = event_clock();
+
+	if(next <= clock)
+		return 0;
+
+	if(next - clock > INT_MAX)
+		return INT_MAX;
 
-event_t *peek_next_event(void) {
-	if (event_tree->head)
-		return event_tree->head->data;
-	return NULL;
+	return next - clock;
 }
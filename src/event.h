@@ -21,27 +21,32 @@
 #ifndef __TINC_EVENT_H__
 #define __TINC_EVENT_H__
 
-#include "avl_tree.h"
-
-extern avl_tree_t *event_tree;
-
 typedef void (*event_handler_t)(void *);
 
+/* Events are meant to be embedded in the structure they belong to; a zeroed event_t is not pending */
+
 typedef struct event {
-	time_t time;
-	int id;
+	struct event *next;
+	struct event **pprev;
+	uint64_t time;				/* expiry time on the monotonic clock, in milliseconds */
+	int level;				/* level of the timer wheel the event is on, -1 if expired */
 	event_handler_t handler;
 	void *data;
 } event_t;
 
+extern uint64_t now_msec;
+
+extern uint64_t event_clock(void);
+extern uint64_t event_clock_usec(void);
+extern void update_clock(void);
+extern void set_clock(uint64_t);
 extern void init_events(void);
 extern void exit_events(void);
 extern void expire_events(void);
-extern event_t *new_event(void) __attribute__ ((__malloc__));
-extern void free_event(event_t *);
-extern void event_add(event_t *);
+extern void event_add(event_t *, event_handler_t, void *, int);
 extern void event_del(event_t *);
+extern bool event_pending(const event_t *);
 extern event_t *get_expired_event(void);
-extern event_t *peek_next_event(void);
+extern int event_timeout(void);
 
 #endif							/* __TINC_EVENT_H__ */
@@ -0,0 +1,310 @@
+/*
+    flow.c -- sampled accounting of the flows in the VPN
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "system.h"
+
+#include "conf.h"
+#include "ethernet.h"
+#include "flow.h"
+#include "logger.h"
+#include "net.h"
+#include "node.h"
+#include "xalloc.h"
+
+/*
+  When FlowSampling is set to N, on average one in N packets that are
+  received from or sent to another node is accounted for in a table of
+  flows, keyed by that node, the direction, and the addresses, protocol
+  and ports of the packet. Which packets are sampled is random, so
+  periodic traffic cannot hide between the samples, and the counts
+  multiplied by N estimate the real ones. Packets that are not sampled
+  cost a decrement.
+
+  The table has a fixed size and is never resized. A new flow that finds
+  no free entry within FLOW_PROBES of its hash replaces the one with the
+  fewest samples there, so the flows that carry the most traffic stay.
+  The table is read through the control socket, sorted by bytes, and
+  cleared with "flows reset", so a client that polls that way gets the
+  top talkers of every interval.
+*/
+
+#define FLOW_PROBES 8
+#define FLOW_KEYLEN offsetof(flow_t, samples)
+
+int flow_sampling = 0;
+int flow_table_size = 1024;
+unsigned int flow_countdown = 1;
+uint64_t flow_evictions = 0;
+
+static flow_t *table;
+static unsigned int mask;			/* size of the table minus one, a power of two */
+
+static void next_sample(void) {
+	flow_countdown = flow_sampling > 1 ? 1 + rand() % (2 * flow_sampling - 1) : 1;
+}
+
+/* FNV-1a */
+
+static uint32_t flow_hash(const flow_t *key) {
+	const uint8_t *p = (const uint8_t *)key;
+	uint32_t hash = 2166136261U;
+
+	for(size_t i = 0; i < FLOW_KEYLEN; i++)
+		hash = (hash ^ p[i]) * 16777619U;
+
+	return hash;
+}
+
+static void ports(flow_t *key, const uint8_t *l4, length_t len) {
+	switch(key->protocol) {
+		case IPPROTO_TCP:
+		case IPPROTO_UDP:
+		case 132:				/* SCTP */
+			if(len >= 4) {
+				key->sport = l4[0] << 8 | l4[1];
+				key->dport = l4[2] << 8 | l4[3];
+			}
+			break;
+
+		case IPPROTO_ICMP:
+		case IPPROTO_ICMPV6:
+			if(len >= 2)
+				key->dport = l4[0] << 8 | l4[1];
+			break;
+
+		default:
+			break;
+	}
+}
+
+static void parse(flow_t *key, const vpn_packet_t *packet) {
+	const uint8_t *ip = packet->data + 14;
+	length_t len = packet->len - 14;
+
+	key->type = packet->data[12] << 8 | packet->data[13];
+
+	if(key->type == ETH_P_IP && len >= 20) {
+		length_t hl = (ip[0] & 0x0f) * 4;
+
+		key->protocol = ip[9];
+		memcpy(key->src, ip + 12, 4);
+		memcpy(key->dst, ip + 16, 4);
+
+		/* Only the first fragment has the ports */
+
+		if(!((ip[6] & 0x1f) || ip[7]) && len > hl)
+			ports(key, ip + hl, len - hl);
+	} else if(key->type == ETH_P_IPV6 && len >= 40) {
+		key->protocol = ip[6];
+		memcpy(key->src, ip + 8, 16);
+		memcpy(key->dst, ip + 24, 16);
+		ports(key, ip + 40, len - 40);
+	}
+}
+
+void flow_packet(flow_direction_t direction, const node_t *n, const vpn_packet_t *packet) {
+	flow_t key, *f, *victim = NULL;
+	uint32_t hash;
+
+	next_sample();
+
+	if(packet->len < 14)
+		return;
+
+	memset(&key, 0, sizeof key);
+	strncpy(key.node, n->name, sizeof key.node - 1);
+	key.direction = direction;
+	parse(&key, packet);
+
+	hash = flow_hash(&key);
+
+	for(int i = 0; i < FLOW_PROBES; i++) {
+		f = &table[(hash + i) & mask];
+
+		if(!f->samples || !memcmp(f, &key, FLOW_KEYLEN))
+			break;
+
+		if(!victim || f->samples < victim->samples)
+			victim = f;
+
+		f = NULL;
+	}
+
+	if(!f) {
+		f = victim;
+		f->samples = 0;
+		flow_evictions++;
+	}
+
+	if(!f->samples) {
+		memcpy(f, &key, FLOW_KEYLEN);
+		f->bytes = 0;
+		f->first = now;
+	}
+
+	f->samples++;
+	f->bytes += packet->len;
+	f->last = now;
+}
+
+static int flow_compare(const void *va, const void *vb) {
+	const flow_t *a = *(const flow_t **)va;
+	const flow_t *b = *(const flow_t **)vb;
+
+	return a->bytes < b->bytes ? 1 : a->bytes > b->bytes ? -1 : 0;
+}
+
+/* The flows in the table, most bytes first; the array has to be freed */
+
+flow_t **flow_sorted(int *count) {
+	flow_t **sorted;
+	int n = 0;
+
+	if(!table) {
+		*count = 0;
+		return NULL;
+	}
+
+	sorted = xmalloc((mask + 1) * sizeof *sorted);
+
+	for(unsigned int i = 0; i <= mask; i++)
+		if(table[i].samples)
+			sorted[n++] = &table[i];
+
+	qsort(sorted, n, sizeof *sorted, flow_compare);
+
+	*count = n;
+	return sorted;
+}
+
+void flow_reset(void) {
+	if(table)
+		memset(table, 0, (mask + 1) * sizeof *table);
+
+	flow_evictions = 0;
+}
+
+unsigned long flow_memory(int *entries) {
+	*entries = 0;
+
+	if(!table)
+		return 0;
+
+	for(unsigned int i = 0; i <= mask; i++)
+		if(table[i].samples)
+			(*entries)++;
+
+	return (mask + 1) * sizeof *table;
+}
+
+/* Format the addresses of a flow, both are empty if it is not IP */
+
+void flow_addresses(const flow_t *f, char *src, char *dst, size_t len) {
+	const uint8_t *a[2] = {f->src, f->dst};
+	char *out[2] = {src, dst};
+
+	for(int i = 0; i < 2; i++) {
+		const uint8_t *x = a[i];
+
+		if(f->type == ETH_P_IP)
+			snprintf(out[i], len, "%u.%u.%u.%u", x[0], x[1], x[2], x[3]);
+		else if(f->type == ETH_P_IPV6)
+			snprintf(out[i], len, "%x:%x:%x:%x:%x:%x:%x:%x",
+					x[0] << 8 | x[1], x[2] << 8 | x[3], x[4] << 8 | x[5], x[6] << 8 | x[7],
+					x[8] << 8 | x[9], x[10] << 8 | x[11], x[12] << 8 | x[13], x[14] << 8 | x[15]);
+		else
+			*out[i] = 0;
+	}
+}
+
+/* The ten flows with the most bytes */
+
+void dump_flows(void) {
+	char src[40], dst[40];
+	flow_t **sorted;
+	int count;
+
+	if(!flow_sampling)
+		return;
+
+	sorted = flow_sorted(&count);
+
+	logger(LOG_DEBUG, "Top flows, 1 in %d packets sampled, %"PRIu64" evicted:", flow_sampling, flow_evictions);
+
+	for(int i = 0; i < count && i < 10; i++) {
+		const flow_t *f = sorted[i];
+
+		flow_addresses(f, src, dst, sizeof src);
+
+		if(*src)
+			logger(LOG_DEBUG, " %s %s proto %d %s port %d to %s port %d: ~%"PRIu64" packets ~%"PRIu64" bytes",
+					f->direction == FLOW_IN ? "from" : "to", f->node, f->protocol,
+					src, f->sport, dst, f->dport,
+					(uint64_t)f->samples * flow_sampling, f->bytes * flow_sampling);
+		else
+			logger(LOG_DEBUG, " %s %s type %04x: ~%"PRIu64" packets ~%"PRIu64" bytes",
+					f->direction == FLOW_IN ? "from" : "to", f->node, f->type,
+					(uint64_t)f->samples * flow_sampling, f->bytes * flow_sampling);
+	}
+
+	logger(LOG_DEBUG, "End of flows.");
+
+	free(sorted);
+}
+
+bool init_flows(void) {
+	unsigned int size = 1;
+
+	flow_table_size = low_memory ? 256 : 1024;
+	get_config_int(lookup_config(config_tree, "FlowTableSize"), &flow_table_size);
+
+	if(flow_table_size < FLOW_PROBES) {
+		logger(LOG_ERR, "FlowTableSize must be at least %d!", FLOW_PROBES);
+		return false;
+	}
+
+	get_config_int(lookup_config(config_tree, "FlowSampling"), &flow_sampling);
+
+	if(flow_sampling < 0) {
+		logger(LOG_ERR, "FlowSampling cannot be negative!");
+		return false;
+	}
+
+	if(!flow_sampling)
+		return true;
+
+	while(size < (unsigned int)flow_table_size)
+		size <<= 1;
+
+	table = xmalloc_and_zero(size * sizeof *table);
+	mask = size - 1;
+	flow_evictions = 0;
+	next_sample();
+
+	logger(LOG_INFO, "Sampling 1 in %d packets into a table of %u flows", flow_sampling, size);
+
+	return true;
+}
+
+void exit_flows(void) {
+	free(table);
+	table = NULL;
+	mask = 0;
+	flow_sampling = 0;
+}
@@ -0,0 +1,67 @@
+/*
+    flow.h -- header for flow.c
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __TINC_FLOW_H__
+#define __TINC_FLOW_H__
+
+#include "net.h"
+#include "node.h"
+
+typedef enum flow_direction_t {
+	FLOW_IN,				/* received from a node */
+	FLOW_OUT,				/* sent to a node */
+} flow_direction_t;
+
+#define FLOW_NAMELEN 32
+
+typedef struct flow_t {
+	/* The key, compared with memcmp() up to samples */
+	char node[FLOW_NAMELEN];		/* name of the node it came from or went to, truncated */
+	uint8_t direction;
+	uint8_t protocol;			/* IP protocol number, 0 if it is not IP */
+	uint16_t type;				/* ethertype */
+	uint16_t sport;				/* TCP, UDP or SCTP ports */
+	uint16_t dport;				/* or ICMP type << 8 | code */
+	uint8_t src[16];			/* IPv4 addresses use the first 4 bytes */
+	uint8_t dst[16];
+
+	uint32_t samples;			/* sampled packets, 0 if this entry is unused */
+	uint64_t bytes;				/* bytes in those */
+	time_t first;				/* time of the first and last one */
+	time_t last;
+} flow_t;
+
+extern int flow_sampling;
+extern int flow_table_size;
+extern unsigned int flow_countdown;
+extern uint64_t flow_evictions;
+
+/* Costs a single test when sampling is off, and a decrement as well when it is on */
+#define flow_sample(direction, n, packet) do { if(flow_sampling && !--flow_countdown) flow_packet((direction), (n), (packet)); } while(0)
+
+extern void flow_packet(flow_direction_t, const struct node_t *, const vpn_packet_t *);
+extern flow_t **flow_sorted(int *);
+extern void flow_reset(void);
+extern unsigned long flow_memory(int *);
+extern void dump_flows(void);
+extern void flow_addresses(const flow_t *, char *, char *, size_t);
+extern bool init_flows(void);
+extern void exit_flows(void);
+
+#endif							/* __TINC_FLOW_H__ */
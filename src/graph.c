@@ -27,19 +27,33 @@
    take longer routes than necessary.
 
    For the MST algorithm we can choose from Prim's or Kruskal's. I personally
-   favour Kruskal's, because we make an extra AVL tree of edges sorted on
-   weights (metric). That tree only has to be updated when an edge is added or
-   removed, and during the MST algorithm we just have go linearly through that
-   tree, adding safe edges until #edges = #nodes - 1. The implementation here
-   however is not so fast, because I tried to avoid having to make a forest and
-   merge trees.
-
-   For the SSSP algorithm Dijkstra's seems to be a nice choice. Currently a
-   simple breadth-first search is presented here.
+   favour Kruskal's, because we keep the edges sorted on weights (metric).
+   That order only has to be updated when an edge is added or removed, and
+   during the MST algorithm we just have go linearly through the sorted edges,
+   adding safe edges. A union-find forest of the nodes tells whether an
+   edge is safe.
+
+   For the SSSP algorithm a simple breadth-first search is used by default,
+   which finds the paths with the fewest hops. With LatencyRouting, Dijkstra's
+   algorithm is used instead, with the edge weights as distances. Nodes with
+   LatencyRouting publish the measured round trip time of their edges as the
+   weight, so the paths with the lowest latency are found.
 
    The SSSP algorithm will also be used to determine whether nodes are directly,
    indirectly or not reachable from the source. It will also set the correct
    destination address and port of a node if possible.
+
+   Both are only rerun when a single edge change can make a difference:
+   an edge is only used once its reverse is known, edges between unreachable
+   nodes are never looked at, and removing an edge that is neither in the MST
+   nor updated any node during the last SSSP run leaves both trees as they are.
+
+   When they have to be rerun after an edge change, that is postponed for
+   graph_delay milliseconds, or to the end of the current iteration of the
+   main loop, so a burst of ADD_EDGE and DEL_EDGE requests is handled with
+   a single run. Until then, packets are routed using the previous results.
+   Only closing a connection reruns them right away, see
+   graph_del_connection_edge().
 */
 
 #include "system.h"
@@ -47,33 +61,407 @@
 #include "avl_tree.h"
 #include "conf.h"
 #include "connection.h"
+#include "control.h"
 #include "device.h"
 #include "edge.h"
+#include "event.h"
 #include "graph.h"
 #include "logger.h"
 #include "netutl.h"
 #include "node.h"
 #include "process.h"
 #include "protocol.h"
+#include "route.h"
 #include "subnet.h"
 #include "utils.h"
 #include "xalloc.h"
 
+int graph_delay = 0;
+bool latency_routing = false;
+
 static bool graph_changed = true;
+static unsigned int sssp_generation = 0;
+static unsigned int mst_generation = 0;
+static event_t graph_event;
+static bool cleanup_edges = true;		/* drop stale edges to us from nodes that became unreachable */
+
+/* Compact copy of the graph
+
+   Both algorithms work on arrays instead of walking the AVL trees and
+   the large node_t structures. Every node gets a slot that it keeps until
+   it is deleted, holding the edges of that node that have a reverse, in
+   the same order as in its edge_tree. The edges used by Kruskal's algorithm
+   are kept in an array sorted like edge_weight_tree.
+
+   edge.c and node.c tell us about every change. Only the slots of nodes
+   whose edges changed are copied again before the next run, and new edges
+   are sorted into the array for Kruskal's algorithm, while deleted ones are
+   marked and left out when it is compacted. The results are written back to
+   the nodes when the search is done.
+*/
+
+#define NO_EDGE UINT_MAX
+#define NO_SLOT UINT_MAX
+
+typedef struct graph_edge_t {
+	unsigned int to;			/* slot of the node this edge leads to */
+	bool indirect;				/* true if OPTION_INDIRECT is set on this edge */
+	int weight;
+	edge_t *edge;
+} graph_edge_t;
+
+typedef struct graph_node_t {
+	node_t *node;				/* NULL if this slot is free */
+	graph_edge_t *edges;
+	unsigned int nedges;
+	unsigned int size;
+	unsigned int nexthop;
+	unsigned int via;
+	edge_t *firstedge;			/* edge it was first visited through */
+	edge_t *prevedge;			/* edge it was last visited through */
+	edge_t *lastedge;			/* prevedge of the previous run, only compared against */
+	unsigned long distance;			/* sum of the weights along the path, with LatencyRouting */
+	unsigned int heappos;			/* position in the heap used by Dijkstra's algorithm, NO_SLOT if not in it */
+	bool visited;
+	bool indirect;
+	bool reachable;				/* copy of node->status.reachable */
+	bool dirty;				/* its edges have to be copied again */
+} graph_node_t;
+
+typedef struct mst_edge_t {
+	unsigned int from;
+	unsigned int to;
+	edge_t *edge;				/* NULL if it was deleted since the last run */
+} mst_edge_t;
+
+static graph_node_t *graph_nodes;
+static unsigned int graph_node_count;		/* number of slots in use or on the free list */
+static unsigned int graph_node_size;
+static unsigned int *free_slots;
+static unsigned int free_slot_count;
+static unsigned int *dirty_slots;
+static unsigned int dirty_slot_count;
+static unsigned int *todo;
+static unsigned int *mst_set;
+
+static mst_edge_t *mst_edges;
+static mst_edge_t *mst_spare;
+static unsigned int mst_count;
+static unsigned int mst_size;
+static unsigned int mst_deleted;
+static edge_t **mst_pending_edges;
+static unsigned int mst_pending_count;
+static unsigned int mst_pending_size;
+static bool mst_rebuild = true;
+
+static void graph_mark_dirty(unsigned int i) {
+	if(graph_nodes[i].dirty)
+		return;
+
+	graph_nodes[i].dirty = true;
+	dirty_slots[dirty_slot_count++] = i;
+}
+
+void graph_node_added(node_t *n) {
+	unsigned int i;
+
+	if(free_slot_count) {
+		i = free_slots[--free_slot_count];
+	} else {
+		if(graph_node_count == graph_node_size) {
+			graph_node_size = graph_node_size ? graph_node_size * 2 : 64;
+			graph_nodes = xrealloc(graph_nodes, graph_node_size * sizeof *graph_nodes);
+			memset(graph_nodes + graph_node_count, 0, (graph_node_size - graph_node_count) * sizeof *graph_nodes);
+			free_slots = xrealloc(free_slots, graph_node_size * sizeof *free_slots);
+			dirty_slots = xrealloc(dirty_slots, graph_node_size * sizeof *dirty_slots);
+			todo = xrealloc(todo, graph_node_size * 2 * sizeof *todo);
+			mst_set = xrealloc(mst_set, graph_node_size * sizeof *mst_set);
+		}
+
+		i = graph_node_count++;
+	}
+
+	/* The slot may still be on the dirty list, so leave that flag alone */
+
+	graph_nodes[i].node = n;
+	graph_nodes[i].nedges = 0;
+	graph_nodes[i].visited = false;
+	graph_nodes[i].reachable = n->status.reachable;
+	n->graph_index = i;
+}
+
+void graph_node_deleted(node_t *n) {
+	graph_node_t *g = &graph_nodes[n->graph_index];
+
+	free(g->edges);
+	g->edges = NULL;
+	g->nedges = 0;
+	g->size = 0;
+	g->node = NULL;
+	g->visited = false;
+	free_slots[free_slot_count++] = n->graph_index;
+}
+
+static int mst_compare(const edge_t *a, const edge_t *b) {
+	return edge_weight_tree->compare(a, b);
+}
+
+static int mst_pending_compare(const void *a, const void *b) {
+	return mst_compare(*(edge_t *const *)a, *(edge_t *const *)b);
+}
+
+/* Binary search for the place of an edge in mst_edges, starting at lo.
+   Every edge that is still there before the returned index sorts before e,
+   every one from there on does not. */
+
+static unsigned int mst_search(const edge_t *e, unsigned int lo) {
+	unsigned int hi = mst_count, mid, probe;
+
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		for(probe = mid; probe < hi && !mst_edges[probe].edge; probe++);
+
+		if(probe == hi)
+			hi = mid;
+		else if(mst_compare(mst_edges[probe].edge, e) < 0)
+			lo = probe + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void mst_add(edge_t *e) {
+	unsigned int i;
+
+	if(mst_rebuild)
+		return;
+
+	/* When lots of edges come in, sorting them all again is faster */
+
+	if(mst_pending_count > mst_count / 8 + 64) {
+		for(i = 0; i < mst_pending_count; i++)
+			mst_pending_edges[i]->mst_pending = 0;
+
+		mst_pending_count = 0;
+		mst_rebuild = true;
+		return;
+	}
+
+	if(mst_pending_count == mst_pending_size) {
+		mst_pending_size = mst_pending_size ? mst_pending_size * 2 : 64;
+		mst_pending_edges = xrealloc(mst_pending_edges, mst_pending_size * sizeof *mst_pending_edges);
+	}
+
+	mst_pending_edges[mst_pending_count++] = e;
+	e->mst_pending = mst_pending_count;
+}
+
+static void mst_remove(edge_t *e) {
+	edge_t *last;
+	unsigned int i;
+
+	if(mst_rebuild)
+		return;
+
+	if(e->mst_pending) {
+		last = mst_pending_edges[--mst_pending_count];
+		mst_pending_edges[e->mst_pending - 1] = last;
+		last->mst_pending = e->mst_pending;
+		e->mst_pending = 0;
+		return;
+	}
+
+	for(i = mst_search(e, 0); i < mst_count && !mst_edges[i].edge; i++);
+
+	if(i < mst_count && mst_edges[i].edge == e) {
+		mst_edges[i].edge = NULL;
+		mst_deleted++;
+	}
+}
+
+/* An edge is only used once its reverse is known, so both edges come and go at the same time */
+
+void graph_edge_added(edge_t *e) {
+	if(!e->reverse)
+		return;
+
+	graph_mark_dirty(e->from->graph_index);
+	graph_mark_dirty(e->to->graph_index);
+	mst_add(e);
+	mst_add(e->reverse);
+}
+
+void graph_edge_deleted(edge_t *e) {
+	if(!e->reverse)
+		return;
+
+	graph_mark_dirty(e->from->graph_index);
+	graph_mark_dirty(e->to->graph_index);
+	mst_remove(e);
+	mst_remove(e->reverse);
+}
+
+static void mst_grow(unsigned int count) {
+	if(count <= mst_size)
+		return;
+
+	mst_size = mst_size ? mst_size * 2 : 256;
+
+	if(mst_size < count)
+		mst_size = count;
+
+	mst_edges = xrealloc(mst_edges, mst_size * sizeof *mst_edges);
+	mst_spare = xrealloc(mst_spare, mst_size * sizeof *mst_spare);
+}
+
+static void mst_copy(mst_edge_t *dst, unsigned int *count, unsigned int from, unsigned int to) {
+	for(; from < to; from++)
+		if(mst_edges[from].edge)
+			dst[(*count)++] = mst_edges[from];
+}
+
+/* Bring the copy of the graph up to date */
+
+static void graph_update(void) {
+	avl_node_t *node;
+	graph_node_t *g;
+	graph_edge_t *ge;
+	mst_edge_t *tmp;
+	edge_t *e;
+	unsigned int i, j, k, count;
+
+	for(i = 0; i < dirty_slot_count; i++) {
+		g = &graph_nodes[dirty_slots[i]];
+		g->dirty = false;
+		g->nedges = 0;
+
+		if(!g->node)
+			continue;
+
+		for(node = g->node->edge_tree->head; node; node = node->next) {
+			e = node->data;
+
+			if(!e->reverse)
+				continue;
+
+			if(g->nedges == g->size) {
+				g->size = g->size ? g->size * 2 : 4;
+				g->edges = xrealloc(g->edges, g->size * sizeof *g->edges);
+			}
+
+			ge = &g->edges[g->nedges++];
+			ge->to = e->to->graph_index;
+			ge->indirect = e->options & OPTION_INDIRECT;
+			ge->weight = e->weight > 0 ? e->weight : 1;
+			ge->edge = e;
+		}
+	}
+
+	dirty_slot_count = 0;
+
+	if(mst_rebuild) {
+		mst_count = 0;
+
+		for(node = edge_weight_tree->head; node; node = node->next) {
+			e = node->data;
+
+			if(!e->reverse)
+				continue;
+
+			mst_grow(mst_count + 1);
+			mst_edges[mst_count].from = e->from->graph_index;
+			mst_edges[mst_count].to = e->to->graph_index;
+			mst_edges[mst_count].edge = e;
+			mst_count++;
+		}
+
+		mst_deleted = 0;
+		mst_rebuild = false;
+		return;
+	}
+
+	if(!mst_pending_count && !mst_deleted)
+		return;
+
+	/* Merge the new edges in, leaving out the deleted ones */
+
+	qsort(mst_pending_edges, mst_pending_count, sizeof *mst_pending_edges, mst_pending_compare);
+	mst_grow(mst_count + mst_pending_count);
+
+	for(i = 0, j = 0, count = 0; j < mst_pending_count; j++, i = k) {
+		e = mst_pending_edges[j];
+		e->mst_pending = 0;
+		k = mst_search(e, i);
+		mst_copy(mst_spare, &count, i, k);
+		mst_spare[count].from = e->from->graph_index;
+		mst_spare[count].to = e->to->graph_index;
+		mst_spare[count].edge = e;
+		count++;
+	}
+
+	mst_copy(mst_spare, &count, i, mst_count);
+
+	tmp = mst_edges;
+	mst_edges = mst_spare;
+	mst_spare = tmp;
+	mst_count = count;
+	mst_pending_count = 0;
+	mst_deleted = 0;
+}
+
+void exit_graph(void) {
+	unsigned int i;
+
+	event_del(&graph_event);
+
+	for(i = 0; i < graph_node_count; i++)
+		free(graph_nodes[i].edges);
+
+	free(graph_nodes);
+	free(free_slots);
+	free(dirty_slots);
+	free(todo);
+	free(mst_set);
+	free(mst_edges);
+	free(mst_spare);
+	free(mst_pending_edges);
+
+	graph_nodes = NULL;
+	free_slots = dirty_slots = todo = mst_set = NULL;
+	mst_edges = mst_spare = NULL;
+	mst_pending_edges = NULL;
+	graph_node_count = graph_node_size = free_slot_count = dirty_slot_count = 0;
+	mst_count = mst_size = mst_deleted = mst_pending_count = mst_pending_size = 0;
+	mst_rebuild = true;
+}
+
+static unsigned int mst_find(unsigned int i) {
+	while(mst_set[i] != i) {
+		mst_set[i] = mst_set[mst_set[i]];
+		i = mst_set[i];
+	}
+
+	return i;
+}
 
 /* Implementation of Kruskal's algorithm.
-   Running time: O(EN)
-   Please note that sorting on weight is already done by add_edge().
+   Running time: O(E log N)
+   Please note that sorting on weight is already done by graph_update().
+   Edges between unreachable nodes end up in the forest too, but only the
+   tree containing myself has edges with connections.
 */
 
 static void mst_kruskal(void) {
-	avl_node_t *node, *next;
+	avl_node_t *node;
 	edge_t *e;
-	node_t *n;
 	connection_t *c;
-	int nodes = 0;
+	unsigned int i, from, to;
 	int safe_edges = 0;
-	bool skipped;
+
+	mst_generation++;
 
 	/* Clear MST status on connections */
 
@@ -84,42 +472,29 @@ static void mst_kruskal(void) {
 
 	/* Do we have something to do at all? */
 
-	if(!edge_weight_tree->head)
+	if(!mst_count)
 		return;
 
 	ifdebug(SCARY_THINGS) logger(LOG_DEBUG, "Running Kruskal's algorithm:");
 
-	/* Clear visited status on nodes */
-
-	for(node = node_tree->head; node; node = node->next) {
-		n = node->data;
-		n->status.visited = false;
-		nodes++;
-	}
+	/* Start with every node in a set of its own */
 
-	/* Starting point */
-
-	for(node = edge_weight_tree->head; node; node = node->next) {
-		e = node->data;
-		if(e->from->status.reachable) {
-			e->from->status.visited = true;
-			break;
-		}
-	}
+	for(i = 0; i < graph_node_count; i++)
+		mst_set[i] = i;
 
 	/* Add safe edges */
 
-	for(skipped = false, node = edge_weight_tree->head; node; node = next) {
-		next = node->next;
-		e = node->data;
+	for(i = 0; i < mst_count; i++) {
+		from = mst_find(mst_edges[i].from);
+		to = mst_find(mst_edges[i].to);
 
-		if(!e->reverse || e->from->status.visited == e->to->status.visited) {
-			skipped = true;
+		if(from == to)
 			continue;
-		}
 
-		e->from->status.visited = true;
-		e->to->status.visited = true;
+		mst_set[from] = to;
+
+		e = mst_edges[i].edge;
+		e->mst_generation = mst_generation;
 
 		if(e->connection)
 			e->connection->status.mst = true;
@@ -131,109 +506,311 @@ static void mst_kruskal(void) {
 
 		ifdebug(SCARY_THINGS) logger(LOG_DEBUG, " Adding edge %s - %s weight %d", e->from->name,
 				   e->to->name, e->weight);
-
-		if(skipped) {
-			skipped = false;
-			next = edge_weight_tree->head;
-			continue;
-		}
 	}
 
-	ifdebug(SCARY_THINGS) logger(LOG_DEBUG, "Done, counted %d nodes and %d safe edges.", nodes,
-			   safe_edges);
+	ifdebug(SCARY_THINGS) logger(LOG_DEBUG, "Done, counted %u nodes and %d safe edges.",
+			   graph_node_count - free_slot_count, safe_edges);
 }
 
-/* Implementation of a simple breadth-first search algorithm.
-   Running time: O(E)
-*/
+/* For MulticastSnooping, find out which of our MST connections leads to each node.
+   Every node computes the same tree, so copies sent down a branch whose nodes
+   have members never come back. Running time: O(E) */
 
-static void sssp_bfs(void) {
-	avl_node_t *node, *next, *to;
+static void mst_branches(unsigned int me) {
+	unsigned int head, tail, i, k;
+	graph_node_t *from, *to;
+	graph_edge_t *ge;
 	edge_t *e;
-	node_t *n;
-	list_t *todo_list;
-	list_node_t *from, *todonext;
-	bool indirect;
-	char *name;
-	char *address, *port;
-	char *envp[8] = {NULL};
-	int i;
 
-	todo_list = list_alloc(NULL);
+	for(i = 0; i < graph_node_count; i++)
+		if(graph_nodes[i].node)
+			graph_nodes[i].node->mstbranch = NULL;
 
-	/* Clear visited status on nodes */
+	head = tail = 0;
+	todo[tail++] = me;
 
-	for(node = node_tree->head; node; node = node->next) {
-		n = node->data;
-		n->status.visited = false;
-		n->status.indirect = true;
+	while(head < tail) {
+		i = todo[head++];
+		from = &graph_nodes[i];
+
+		for(k = 0; k < from->nedges; k++) {
+			ge = &from->edges[k];
+			e = ge->edge;
+			to = &graph_nodes[ge->to];
+
+			if(ge->to == me || !to->node || to->node->mstbranch)
+				continue;
+
+			if(e->mst_generation != mst_generation && e->reverse->mst_generation != mst_generation)
+				continue;
+
+			to->node->mstbranch = (i == me) ? e->connection : from->node->mstbranch;
+
+			if(to->node->mstbranch)
+				todo[tail++] = ge->to;
+		}
 	}
+}
 
-	/* Begin with myself */
+/* Remember that the edge was used, and set the node's address from it, like the search itself would have */
 
-	myself->status.visited = true;
-	myself->status.indirect = false;
-	myself->nexthop = myself;
-	myself->prevedge = NULL;
-	myself->via = myself;
-	list_insert_head(todo_list, myself);
+static void sssp_use_edge(node_t *n, edge_t *e) {
+	e->sssp_generation = sssp_generation;
 
-	/* Loop while todo_list is filled */
+	if(n->address.sa.sa_family == AF_UNSPEC && e->address.sa.sa_family != AF_UNKNOWN)
+		update_node_udp(n, &e->address);
+}
 
-	for(from = todo_list->head; from; from = todonext) {	/* "from" is the node from which we start */
-		n = from->data;
+/* Implementation of a simple breadth-first search algorithm.
+   Running time: O(E)
+   A node is queued when it is first visited, and at most once more when it
+   turns out to be directly reachable after all, so the queue never holds
+   more than twice the number of nodes.
+*/
 
-		for(to = n->edge_tree->head; to; to = to->next) {	/* "to" is the edge connected to "from" */
-			e = to->data;
+static void sssp_bfs(unsigned int me) {
+	unsigned int head, tail, i, k;
+	graph_node_t *from, *to;
+	graph_edge_t *ge;
+	bool indirect;
 
-			if(!e->reverse)
-				continue;
+	head = tail = 0;
+	todo[tail++] = me;
+
+	/* Loop while the todo queue is filled */
+
+	while(head < tail) {
+		i = todo[head++];
+		from = &graph_nodes[i];			/* "from" is the node from which we start */
+
+		for(k = 0; k < from->nedges; k++) {	/* "ge" is the edge connected to "from" */
+			ge = &from->edges[k];
 
 			/* Situation:
 
 				   /
 				  /
-			   ----->(n)---e-->(e->to)
+			   ----->(from)---ge-->(to)
 				  \
 				   \
 
-			   Where e is an edge, (n) and (e->to) are nodes.
-			   n->address is set to the e->address of the edge left of n to n.
-			   We are currently examining the edge e right of n from n:
+			   Where ge is an edge, (from) and (to) are nodes.
+			   We are currently examining the edge ge right of from:
 
-			   - If edge e provides for better reachability of e->to, update
-			     e->to and (re)add it to the todo_list to (re)examine the reachability
+			   - If edge ge provides for better reachability of to, update
+			     to and (re)add it to the todo queue to (re)examine the reachability
 			     of nodes behind it.
 			 */
 
-			indirect = n->status.indirect || e->options & OPTION_INDIRECT;
+			to = &graph_nodes[ge->to];
+			indirect = from->indirect || ge->indirect;
 
-			if(e->to->status.visited
-			   && (!e->to->status.indirect || indirect))
+			if(to->visited && (!to->indirect || indirect))
 				continue;
 
 			// Only update nexthop the first time we visit this node.
 
-			if(!e->to->status.visited)
-				e->to->nexthop = (n->nexthop == myself) ? e->to : n->nexthop;
+			if(!to->visited) {
+				to->nexthop = (from->nexthop == me) ? ge->to : from->nexthop;
+				to->firstedge = ge->edge;
+			}
+
+			to->visited = true;
+			to->indirect = indirect;
+			to->prevedge = ge->edge;
+			to->via = indirect ? from->via : ge->to;
+
+			todo[tail++] = ge->to;
+		}
+	}
+}
+
+/* Binary heap of the nodes Dijkstra's algorithm has yet to finish, in todo[].
+   Like with the breadth-first search, direct paths go before indirect ones,
+   whatever their length. */
+
+static bool sssp_closer(const graph_node_t *a, const graph_node_t *b) {
+	if(a->indirect != b->indirect)
+		return !a->indirect;
+
+	return a->distance < b->distance;
+}
+
+static void heap_place(unsigned int pos, unsigned int i) {
+	todo[pos] = i;
+	graph_nodes[i].heappos = pos;
+}
+
+static void heap_up(unsigned int pos) {
+	unsigned int i = todo[pos];
+
+	while(pos && sssp_closer(&graph_nodes[i], &graph_nodes[todo[(pos - 1) / 2]])) {
+		heap_place(pos, todo[(pos - 1) / 2]);
+		pos = (pos - 1) / 2;
+	}
+
+	heap_place(pos, i);
+}
+
+static unsigned int heap_pop(unsigned int *count) {
+	unsigned int top = todo[0], i, pos = 0, child;
+
+	graph_nodes[top].heappos = NO_SLOT;
+
+	if(!--*count)
+		return top;
+
+	i = todo[*count];
+
+	while((child = 2 * pos + 1) < *count) {
+		if(child + 1 < *count && sssp_closer(&graph_nodes[todo[child + 1]], &graph_nodes[todo[child]]))
+			child++;
+
+		if(!sssp_closer(&graph_nodes[todo[child]], &graph_nodes[i]))
+			break;
+
+		heap_place(pos, todo[child]);
+		pos = child;
+	}
+
+	heap_place(pos, i);
+	return top;
+}
+
+/* Implementation of Dijkstra's algorithm, used with LatencyRouting.
+   Running time: O(E log N)
+   The edge a node was reached through in the previous run counts as
+   LATENCY_HYSTERESIS percent shorter, so that a path is only replaced by one
+   that is clearly better, and routes do not flap between paths with about
+   the same round trip time.
+*/
+
+static void sssp_dijkstra(unsigned int me) {
+	unsigned int count = 0, i, k;
+	graph_node_t *from, *to, next;
+	graph_edge_t *ge;
+	unsigned long weight;
+
+	for(i = 0; i < graph_node_count; i++)
+		graph_nodes[i].heappos = NO_SLOT;
+
+	graph_nodes[me].distance = 0;
+	heap_place(count++, me);
+
+	while(count) {
+		i = heap_pop(&count);
+		from = &graph_nodes[i];
+
+		for(k = 0; k < from->nedges; k++) {
+			ge = &from->edges[k];
+			to = &graph_nodes[ge->to];
+
+			if(to->visited && to->heappos == NO_SLOT)
+				continue;
+
+			weight = ge->weight;
+
+			if(ge->edge == to->lastedge)
+				weight -= weight * LATENCY_HYSTERESIS / 100;
+
+			next.indirect = from->indirect || ge->indirect;
+			next.distance = from->distance + weight;
+
+			if(to->visited && !sssp_closer(&next, to))
+				continue;
+
+			to->indirect = next.indirect;
+			to->distance = next.distance;
+			to->nexthop = (from->nexthop == me) ? ge->to : from->nexthop;
+			to->via = to->indirect ? from->via : ge->to;
+			to->firstedge = to->prevedge = ge->edge;
+
+			if(!to->visited) {
+				to->visited = true;
+				heap_place(count++, ge->to);
+			}
+
+			heap_up(to->heappos);
+		}
+	}
+}
+
+static void sssp(void) {
+	unsigned int i, me;
+	avl_node_t *node, *next;
+	edge_t *e;
+	node_t *n;
+	bool changed = false;
+	char *name;
+	char *address, *port;
+	char *envp[8] = {NULL};
+
+	sssp_generation++;
+
+	/* Clear visited status on nodes */
+
+	for(i = 0; i < graph_node_count; i++) {
+		graph_nodes[i].lastedge = graph_nodes[i].prevedge;
+		graph_nodes[i].visited = false;
+		graph_nodes[i].indirect = true;
+	}
+
+	/* Begin with myself */
 
-			e->to->status.visited = true;
-			e->to->status.indirect = indirect;
-			e->to->prevedge = e;
-			e->to->via = indirect ? n->via : e->to;
-			e->to->options = e->options;
+	me = myself->graph_index;
+	graph_nodes[me].visited = true;
+	graph_nodes[me].indirect = false;
+	graph_nodes[me].nexthop = me;
+	graph_nodes[me].via = me;
+
+	if(latency_routing)
+		sssp_dijkstra(me);
+	else
+		sssp_bfs(me);
+
+	/* Write the results back */
+
+	for(i = 0; i < graph_node_count; i++) {
+		n = graph_nodes[i].node;
+
+		if(!n)
+			continue;
+
+		n->status.visited = graph_nodes[i].visited;
+		n->status.indirect = graph_nodes[i].indirect;
+
+		if(graph_nodes[i].visited != graph_nodes[i].reachable)
+			changed = true;
+
+		if(!graph_nodes[i].visited)
+			continue;
 
-			if(e->to->address.sa.sa_family == AF_UNSPEC && e->address.sa.sa_family != AF_UNKNOWN)
-				update_node_udp(e->to, &e->address);
+		n->nexthop = graph_nodes[graph_nodes[i].nexthop].node;
+		n->via = graph_nodes[graph_nodes[i].via].node;
 
-			list_insert_tail(todo_list, e->to);
+		if(i == me) {
+			n->prevedge = NULL;
+			continue;
 		}
 
-		todonext = from->next;
-		list_delete_node(todo_list, from);
+		e = graph_nodes[i].prevedge;
+		n->prevedge = e;
+		n->options = e->options;
+
+		sssp_use_edge(n, graph_nodes[i].firstedge);
+
+		if(e != graph_nodes[i].firstedge)
+			sssp_use_edge(n, e);
 	}
 
-	list_free(todo_list);
+	/* Work out where packets for each node go from now on */
+
+	for(i = 0; i < graph_node_count; i++)
+		if(graph_nodes[i].node)
+			update_node_forwarding(graph_nodes[i].node);
+
+	if(!changed)
+		return;
 
 	/* Check reachability status. */
 
@@ -244,6 +821,10 @@ static void sssp_bfs(void) {
 		if(n->status.visited != n->status.reachable) {
 			n->status.reachable = !n->status.reachable;
 
+			/* Lookups prefer subnets of reachable nodes */
+
+			subnet_cache_flush();
+
 			if(n->status.reachable) {
 				ifdebug(TRAFFIC) logger(LOG_DEBUG, "Node %s (%s) became reachable",
 					   n->name, n->hostname);
@@ -252,19 +833,18 @@ static void sssp_bfs(void) {
 					   n->name, n->hostname);
 			}
 
+			control_node_changed(n);
+
 			/* TODO: only clear status.validkey if node is unreachable? */
 
 			n->status.validkey = false;
 			n->last_req_key = 0;
+			update_node_id(n, 0);
+			n->outsessionid = 0;
 
-			n->maxmtu = MTU;
-			n->minmtu = 0;
-			n->mtuprobes = 0;
+			/* Keys, PMTU and the rest of the UDP state start afresh */
 
-			if(n->mtuevent) {
-				event_del(n->mtuevent);
-				n->mtuevent = NULL;
-			}
+			free_node_tunnel(n);
 
 			xasprintf(&envp[0], "NETNAME=%s", netname ? : "");
 			xasprintf(&envp[1], "DEVICE=%s", device ? : "");
@@ -275,12 +855,12 @@ static void sssp_bfs(void) {
 			xasprintf(&envp[5], "REMOTEPORT=%s", port);
 			xasprintf(&envp[6], "NAME=%s", myself->name);
 
-			execute_script(n->status.reachable ? "host-up" : "host-down", envp);
+			queue_script(n->status.reachable ? "host-up" : "host-down", envp);
 
 			xasprintf(&name,
 					 n->status.reachable ? "hosts/%s-up" : "hosts/%s-down",
 					 n->name);
-			execute_script(name, envp);
+			queue_script(name, envp);
 
 			free(name);
 			free(address);
@@ -295,21 +875,120 @@ static void sssp_bfs(void) {
 				update_node_udp(n, NULL);
 				memset(&n->status, 0, sizeof n->status);
 				n->options = 0;
+
+				/* If we remember it had an edge to us, clean it up */
+
+				e = cleanup_edges ? lookup_edge(n, myself) : NULL;
+
+				if(e) {
+					if(!tunnelserver)
+						send_del_edge(everyone, e);
+					edge_del(e);
+				}
 			} else if(n->connection) {
 				send_ans_key(n);
 			}
+
+			graph_nodes[n->graph_index].reachable = n->status.reachable;
 		}
 	}
 }
 
 void graph(void) {
-	subnet_cache_flush();
-	sssp_bfs();
+	event_del(&graph_event);
+	graph_update();
+	sssp();
 	mst_kruskal();
+
+	if(multicast_snooping)
+		mst_branches(myself->graph_index);
+
 	graph_changed = true;
 }
 
+static void graph_handler(void *data) {
+	graph();
+}
 
+static void graph_schedule(void) {
+	if(!event_pending(&graph_event))
+		event_add(&graph_event, graph_handler, NULL, graph_delay);
+}
+
+/* Add an edge, and only rerun the graph algorithms if it can change their outcome */
+
+void graph_add_edge(edge_t *e) {
+	edge_add(e);
+	graph_changed = true;
+
+	/* If a run is already scheduled, the results below are out of date anyway */
+
+	if(event_pending(&graph_event))
+		return;
+
+	/* Without its reverse, an edge is ignored by both algorithms */
+
+	if(!e->reverse)
+		return;
+
+	/* A new link between two unreachable nodes doesn't make them reachable */
+
+	if(!e->from->status.reachable && !e->to->status.reachable)
+		return;
+
+	graph_schedule();
+}
+
+/* Delete an edge, and only rerun the graph algorithms if it was used by them */
+
+void graph_del_edge(edge_t *e) {
+	bool used = false;
+	edge_t *reverse = e->reverse;
+
+	if(reverse && (e->from->status.reachable || e->to->status.reachable))
+		used = e->mst_generation == mst_generation || reverse->mst_generation == mst_generation
+			|| e->sssp_generation == sssp_generation
+			|| reverse->sssp_generation == sssp_generation;
+
+	/* Packets are still routed using the old results until the next run */
+
+	if(e->to->prevedge == e)
+		e->to->prevedge = NULL;
+
+	edge_del(e);
+	graph_changed = true;
+
+	if(used)
+		graph_schedule();
+}
+
+/*
+  Delete the edge of a connection that is being closed. The nodes we reach
+  through it would still have it as their nexthop until the next run, so that
+  run happens right away. Stale edges to us are only cleaned up if report is
+  set, so closing all connections on exit does not tell others to forget them.
+*/
+
+void graph_del_connection_edge(edge_t *e, bool report) {
+	graph_del_edge(e);
+
+	if(!event_pending(&graph_event))
+		return;
+
+	cleanup_edges = report;
+	graph();
+	cleanup_edges = true;
+}
+
+/* Change the weight of an edge, and rerun the graph algorithms if they use it */
+
+void graph_set_weight(edge_t *e, int weight) {
+	edge_set_weight(e, weight);
+	graph_changed = true;
+
+	if(e->reverse && (e->from->status.reachable || e->to->status.reachable))
+		graph_schedule();
+}
 
 /* Dump nodes and edges to a graphviz file.
 	   
@@ -21,7 +21,25 @@
 #ifndef __TINC_GRAPH_H__
 #define __TINC_GRAPH_H__
 
+#include "edge.h"
+
+/* Percentage by which a path has to be shorter to replace the current one with LatencyRouting */
+
+#define LATENCY_HYSTERESIS 20
+
+extern int graph_delay;
+extern bool latency_routing;
+
 extern void graph(void);
+extern void exit_graph(void);
+extern void graph_node_added(node_t *);
+extern void graph_node_deleted(node_t *);
+extern void graph_edge_added(edge_t *);
+extern void graph_edge_deleted(edge_t *);
+extern void graph_add_edge(edge_t *);
+extern void graph_del_edge(edge_t *);
+extern void graph_del_connection_edge(edge_t *, bool);
+extern void graph_set_weight(edge_t *, int);
 extern void dump_graph(void);
 
 #endif /* __TINC_GRAPH_H__ */
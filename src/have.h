@@ -31,6 +31,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
@@ -168,6 +169,10 @@
 #include <netinet/tcp.h>
 #endif
 
+#ifdef HAVE_NETINET_UDP_H
+#include <netinet/udp.h>
+#endif
+
 #ifdef HAVE_NETINET_IN6_H
 #include <netinet/in6.h>
 #endif
@@ -0,0 +1,450 @@
+/*
+    io.c -- I/O readiness notification
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "system.h"
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_PWAIT)
+#include <sys/epoll.h>
+#define USE_EPOLL
+#elif defined(HAVE_SYS_EVENT_H) && defined(HAVE_KQUEUE)
+#include <sys/event.h>
+#define USE_KQUEUE
+#else
+#define USE_SELECT
+#endif
+
+#include "avl_tree.h"
+#include "io.h"
+#include "logger.h"
+#include "utils.h"
+
+/*
+  File descriptors are registered once with io_add(), and their interest set
+  is changed with io_set() only when it actually changes. io_wait() blocks
+  until at least one of them is ready, io_dispatch() then calls the handlers
+  of only those file descriptors that are ready.
+
+  Handlers may add, change and delete any io_t, including ones that still
+  have pending events from the same io_wait() call; such events are dropped.
+*/
+
+#define MAXEVENTS 64
+
+#ifdef HAVE_PSELECT
+static sigset_t sigmask;
+static bool sigmask_set = false;
+#endif
+
+#ifdef USE_EPOLL
+static const char *io_backend = "epoll";
+static int epfd = -1;
+static struct epoll_event events[MAXEVENTS];
+static int nevents;
+static int nextevent;
+
+static uint32_t epoll_flags(int flags) {
+	return (flags & IO_READ ? EPOLLIN : 0) | (flags & IO_WRITE ? EPOLLOUT : 0);
+}
+#endif
+
+#ifdef USE_KQUEUE
+static const char *io_backend = "kqueue";
+static int kq = -1;
+static struct kevent events[MAXEVENTS];
+static int nevents;
+static int nextevent;
+
+static void kqueue_change(io_t *io, int filter, bool enable) {
+	struct kevent change;
+
+	EV_SET(&change, io->fd, filter, enable ? EV_ADD : EV_DELETE, 0, 0, (void *)io);
+
+	if(kevent(kq, &change, 1, NULL, 0, NULL) < 0 && enable)
+		logger(LOG_ERR, "Could not register file descriptor %d with kqueue: %s", io->fd, strerror(errno));
+}
+#endif
+
+#ifdef USE_SELECT
+static const char *io_backend = "select";
+static avl_tree_t *io_tree;
+static fd_set readfds, writefds;
+static fd_set readset, writeset;
+static int maxfd = -1;
+static int nready;
+
+static int io_compare(const io_t *a, const io_t *b) {
+	if(a->fd < b->fd)
+		return -1;
+
+	return a->fd > b->fd;
+}
+
+/* Forget any result from the last select() call for this file descriptor */
+
+static void select_forget(int fd) {
+	if(FD_ISSET(fd, &readset)) {
+		FD_CLR(fd, &readset);
+		nready--;
+	}
+
+	if(FD_ISSET(fd, &writeset)) {
+		FD_CLR(fd, &writeset);
+		nready--;
+	}
+}
+#endif
+
+bool init_io(void) {
+#ifdef USE_EPOLL
+	epfd = epoll_create(MAXEVENTS);
+
+	if(epfd < 0) {
+		logger(LOG_ERR, "Could not create epoll instance: %s", strerror(errno));
+		return false;
+	}
+
+#ifdef FD_CLOEXEC
+	fcntl(epfd, F_SETFD, FD_CLOEXEC);
+#endif
+	nevents = nextevent = 0;
+#endif
+
+#ifdef USE_KQUEUE
+	kq = kqueue();
+
+	if(kq < 0) {
+		logger(LOG_ERR, "Could not create kqueue: %s", strerror(errno));
+		return false;
+	}
+
+#ifdef FD_CLOEXEC
+	fcntl(kq, F_SETFD, FD_CLOEXEC);
+#endif
+	nevents = nextevent = 0;
+#endif
+
+#ifdef USE_SELECT
+	io_tree = avl_alloc_tree((avl_compare_t) io_compare, NULL);
+	FD_ZERO(&readfds);
+	FD_ZERO(&writefds);
+	FD_ZERO(&readset);
+	FD_ZERO(&writeset);
+	maxfd = -1;
+	nready = 0;
+#endif
+
+	ifdebug(STATUS) logger(LOG_DEBUG, "Using %s for I/O readiness notification", io_backend);
+
+	return true;
+}
+
+void exit_io(void) {
+#ifdef USE_EPOLL
+	if(epfd >= 0)
+		close(epfd);
+	epfd = -1;
+	nevents = nextevent = 0;
+#endif
+
+#ifdef USE_KQUEUE
+	if(kq >= 0)
+		close(kq);
+	kq = -1;
+	nevents = nextevent = 0;
+#endif
+
+#ifdef USE_SELECT
+	avl_delete_tree(io_tree);
+	io_tree = NULL;
+#endif
+}
+
+void io_add(io_t *io, io_cb_t cb, void *data, int fd, int flags) {
+	io->fd = fd;
+	io->flags = 0;
+	io->cb = cb;
+	io->data = data;
+
+#ifdef USE_EPOLL
+	struct epoll_event ev = {0};
+
+	ev.events = epoll_flags(flags);
+	ev.data.ptr = io;
+
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		logger(LOG_ERR, "Could not register file descriptor %d with epoll: %s", fd, strerror(errno));
+
+	io->flags = flags;
+#endif
+
+#ifdef USE_KQUEUE
+	io_set(io, flags);
+#endif
+
+#ifdef USE_SELECT
+	avl_insert(io_tree, io);
+	select_forget(fd);
+
+	if(fd > maxfd)
+		maxfd = fd;
+
+	io_set(io, flags);
+#endif
+}
+
+void io_set(io_t *io, int flags) {
+	if(!io->cb || flags == io->flags)
+		return;
+
+#ifdef USE_EPOLL
+	struct epoll_event ev = {0};
+
+	ev.events = epoll_flags(flags);
+	ev.data.ptr = io;
+
+	if(epoll_ctl(epfd, EPOLL_CTL_MOD, io->fd, &ev) < 0)
+		logger(LOG_ERR, "Could not change epoll events for file descriptor %d: %s", io->fd, strerror(errno));
+#endif
+
+#ifdef USE_KQUEUE
+	if((flags ^ io->flags) & IO_READ)
+		kqueue_change(io, EVFILT_READ, flags & IO_READ);
+
+	if((flags ^ io->flags) & IO_WRITE)
+		kqueue_change(io, EVFILT_WRITE, flags & IO_WRITE);
+#endif
+
+#ifdef USE_SELECT
+	if(flags & IO_READ)
+		FD_SET(io->fd, &readfds);
+	else
+		FD_CLR(io->fd, &readfds);
+
+	if(flags & IO_WRITE)
+		FD_SET(io->fd, &writefds);
+	else
+		FD_CLR(io->fd, &writefds);
+#endif
+
+	io->flags = flags;
+}
+
+void io_del(io_t *io) {
+	if(!io->cb)
+		return;
+
+#ifdef USE_EPOLL
+	struct epoll_event ev = {0};
+
+	/* The file descriptor might already be closed, which removes it from the epoll set anyway */
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, io->fd, &ev);
+
+	for(int i = nextevent; i < nevents; i++)
+		if(events[i].data.ptr == io)
+			events[i].data.ptr = NULL;
+#endif
+
+#ifdef USE_KQUEUE
+	io_set(io, 0);
+
+	for(int i = nextevent; i < nevents; i++)
+		if(events[i].udata == (void *)io)
+			events[i].udata = NULL;
+#endif
+
+#ifdef USE_SELECT
+	io_set(io, 0);
+	select_forget(io->fd);
+	avl_delete(io_tree, io);
+
+	if(io->fd == maxfd)
+		maxfd = io_tree->tail ? ((io_t *)io_tree->tail->data)->fd : -1;
+#endif
+
+	io->flags = 0;
+	io->cb = NULL;
+}
+
+#ifdef HAVE_PSELECT
+void io_set_sigmask(const sigset_t *mask) {
+	sigmask = *mask;
+	sigmask_set = true;
+
+#ifdef USE_KQUEUE
+	/* Signals that are blocked outside io_wait() would not interrupt kevent(),
+	   so have the kqueue itself wake us up when one of them is raised. */
+
+	sigset_t blocked;
+	struct kevent change;
+
+	sigprocmask(SIG_SETMASK, NULL, &blocked);
+
+	for(int sig = 1; sig < NSIG; sig++) {
+		if(sigismember(&blocked, sig) == 1 && sigismember(mask, sig) == 0) {
+			EV_SET(&change, sig, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+			kevent(kq, &change, 1, NULL, 0, NULL);
+		}
+	}
+#endif
+}
+
+/* Unblock the signals main_loop() blocks, for a child that is about to run a script */
+
+void io_restore_sigmask(void) {
+	if(sigmask_set)
+		sigprocmask(SIG_SETMASK, &sigmask, NULL);
+}
+#endif
+
+/*
+  Wait at most timeout milliseconds for any registered file descriptor to become ready.
+  Returns the number of pending events, 0 on timeout or -1 on error.
+*/
+int io_wait(int timeout) {
+#ifdef USE_EPOLL
+#ifdef HAVE_PSELECT
+	nevents = epoll_pwait(epfd, events, MAXEVENTS, timeout, sigmask_set ? &sigmask : NULL);
+#else
+	nevents = epoll_wait(epfd, events, MAXEVENTS, timeout);
+#endif
+	nextevent = 0;
+
+	if(nevents < 0) {
+		nevents = 0;
+		return -1;
+	}
+
+	return nevents;
+#endif
+
+#ifdef USE_KQUEUE
+	struct timespec ts = {timeout / 1000, (timeout % 1000) * 1000000};
+	int err;
+
+	nevents = kevent(kq, NULL, 0, events, MAXEVENTS, &ts);
+	err = errno;
+	nextevent = 0;
+
+#ifdef HAVE_PSELECT
+	/* Let the handlers of any signals caught by the kqueue run now */
+
+	if(sigmask_set) {
+		sigset_t oldmask;
+		sigprocmask(SIG_SETMASK, &sigmask, &oldmask);
+		sigprocmask(SIG_SETMASK, &oldmask, NULL);
+	}
+#endif
+
+	if(nevents < 0) {
+		nevents = 0;
+		errno = err;
+		return -1;
+	}
+
+	return nevents;
+#endif
+
+#ifdef USE_SELECT
+	readset = readfds;
+	writeset = writefds;
+
+#ifdef HAVE_PSELECT
+	struct timespec tv = {timeout / 1000, (timeout % 1000) * 1000000};
+	nready = pselect(maxfd + 1, &readset, &writeset, NULL, &tv, sigmask_set ? &sigmask : NULL);
+#else
+	struct timeval tv = {timeout / 1000, (timeout % 1000) * 1000};
+	nready = select(maxfd + 1, &readset, &writeset, NULL, &tv);
+#endif
+
+	if(nready < 0) {
+		nready = 0;
+		return -1;
+	}
+
+	return nready;
+#endif
+}
+
+/* Call the handlers of all file descriptors that io_wait() found to be ready */
+
+void io_dispatch(void) {
+#if defined(USE_EPOLL) || defined(USE_KQUEUE)
+	while(nextevent < nevents) {
+		int flags = 0;
+#ifdef USE_EPOLL
+		struct epoll_event *ev = &events[nextevent++];
+		io_t *io = ev->data.ptr;
+
+		if(ev->events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			flags |= IO_READ;
+
+		if(ev->events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			flags |= IO_WRITE;
+#else
+		struct kevent *ev = &events[nextevent++];
+		io_t *io = (io_t *)ev->udata;
+
+		if(ev->filter == EVFILT_READ)
+			flags |= IO_READ;
+		else if(ev->filter == EVFILT_WRITE)
+			flags |= IO_WRITE;
+#endif
+
+		if(!io)
+			continue;
+
+		flags &= io->flags;
+
+		if(flags)
+			io->cb(io->data, flags);
+	}
+
+	nevents = nextevent = 0;
+#endif
+
+#ifdef USE_SELECT
+	avl_node_t *node;
+	io_t key;
+
+	/* Handlers may delete io_ts, so look up the next one by file descriptor
+	   every time instead of following the tree's next pointers. */
+
+	for(node = io_tree->head; node && nready > 0; node = avl_search_closest_greater_node(io_tree, &key)) {
+		io_t *io = node->data;
+		int fd = io->fd;
+		int flags = 0;
+
+		key.fd = fd + 1;
+
+		if(FD_ISSET(fd, &readset))
+			flags |= IO_READ;
+
+		if(FD_ISSET(fd, &writeset))
+			flags |= IO_WRITE;
+
+		select_forget(fd);
+
+		flags &= io->flags;
+
+		if(flags)
+			io->cb(io->data, flags);
+	}
+#endif
+}
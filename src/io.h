@@ -0,0 +1,47 @@
+/*
+    io.h -- header for io.c
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __TINC_IO_H__
+#define __TINC_IO_H__
+
+#define IO_READ 1
+#define IO_WRITE 2
+
+typedef void (*io_cb_t)(void *data, int flags);
+
+typedef struct io_t {
+	int fd;
+	int flags;
+	io_cb_t cb;
+	void *data;
+} io_t;
+
+extern bool init_io(void);
+extern void exit_io(void);
+extern void io_add(io_t *io, io_cb_t cb, void *data, int fd, int flags);
+extern void io_set(io_t *io, int flags);
+extern void io_del(io_t *io);
+#ifdef HAVE_PSELECT
+extern void io_set_sigmask(const sigset_t *sigmask);
+extern void io_restore_sigmask(void);
+#endif
+extern int io_wait(int timeout);
+extern void io_dispatch(void);
+
+#endif							/* __TINC_IO_H__ */
@@ -29,6 +29,22 @@
 #define IPPROTO_ICMP 1
 #endif
 
+#ifndef IPPROTO_IGMP
+#define IPPROTO_IGMP 2
+#endif
+
+#ifndef IGMP_V1_MEMBERSHIP_REPORT
+#define IGMP_V1_MEMBERSHIP_REPORT 0x12
+#endif
+
+#ifndef IGMP_V2_MEMBERSHIP_REPORT
+#define IGMP_V2_MEMBERSHIP_REPORT 0x16
+#endif
+
+#ifndef IGMP_V3_MEMBERSHIP_REPORT
+#define IGMP_V3_MEMBERSHIP_REPORT 0x22
+#endif
+
 #ifndef ICMP_DEST_UNREACH
 #define ICMP_DEST_UNREACH 3
 #endif
@@ -29,6 +29,10 @@
 #define IPPROTO_ICMPV6 58
 #endif
 
+#ifndef IPPROTO_HOPOPTS
+#define IPPROTO_HOPOPTS 0
+#endif
+
 #ifndef HAVE_STRUCT_IN6_ADDR
 struct in6_addr {
 	union {
@@ -120,6 +124,16 @@ struct nd_neighbor_solicit {
 #define nd_ns_reserved nd_ns_hdr.icmp6_data32[0]
 #endif
 
+#ifndef MLD_LISTENER_QUERY
+#define MLD_LISTENER_QUERY 130
+#define MLD_LISTENER_REPORT 131
+#define MLD_LISTENER_REDUCTION 132
+#endif
+
+#ifndef MLD2_LISTENER_REPORT
+#define MLD2_LISTENER_REPORT 143
+#endif
+
 #ifndef HAVE_STRUCT_ND_OPT_HDR
 struct nd_opt_hdr {
 	uint8_t nd_opt_type;
@@ -27,8 +27,18 @@
 #define DEFAULT_DEVICE "/dev/tap0"
 #endif
 
+#ifdef HAVE_LINUX_VIRTIO_NET_H
+#include <linux/virtio_net.h>
+#endif
+
+#if defined(IFF_VNET_HDR) && defined(TUNSETOFFLOAD) && defined(HAVE_LINUX_VIRTIO_NET_H)
+#define HAVE_OFFLOAD
+#endif
+
 #include "../conf.h"
 #include "../device.h"
+#include "../ethernet.h"
+#include "../io.h"
 #include "../logger.h"
 #include "../net.h"
 #include "../route.h"
@@ -52,6 +62,359 @@ static char *device_info;
 static uint64_t device_total_in = 0;
 static uint64_t device_total_out = 0;
 
+/* Additional queues of a multi-queue tun/tap device, queue_fd[0] is device_fd */
+
+#define MAXQUEUES 16
+
+static int device_queues = 1;
+static int queue_fd[MAXQUEUES];
+static io_t queue_io[MAXQUEUES];
+static int read_fd = -1;
+
+/* While read_batch() reads until the device has nothing left, that is not an error */
+
+static bool draining = false;
+
+static bool read_error(void) {
+	if(!draining || (errno != EAGAIN && errno != EWOULDBLOCK))
+		logger(LOG_ERR, "Error while reading from %s %s: %s",
+			   device_info, device, strerror(errno));
+
+	return false;
+}
+
+#ifdef HAVE_OFFLOAD
+/*
+  With DeviceOffload, every read and write starts with a virtio-net header,
+  and the kernel lets the device do TCP segmentation and checksumming. We
+  then read TCP super-packets of up to 64 kB, which are cut into segments
+  of the size the kernel asked for here, and passed on one by one. Doing
+  that in one go is much cheaper than having the kernel push every segment
+  through the device separately. What we write is never offloaded.
+*/
+
+#define GSO_FRAME_SIZE (MTU + 65536)
+
+static bool offload = false;
+static uint8_t *gso_frame;		/* the super-packet being segmented */
+static int gso_len = 0;			/* its length, 0 if there is none */
+static int gso_l3, gso_l4;		/* where its IP and TCP headers start */
+static int gso_hdrlen;			/* length of all headers, copied to every segment */
+static int gso_size;			/* maximum payload of a segment */
+static int gso_offset;			/* where the payload of the next segment starts */
+static const struct virtio_net_hdr vnet_none;
+static const size_t ether_size = sizeof(struct ether_header);
+#endif
+
+static void handle_queue_data(void *data, int flags) {
+	read_fd = *(int *)data;
+	handle_device_data(NULL, flags);
+	read_fd = device_fd;
+}
+
+static void setup_queues(struct ifreq *ifr) {
+	int i;
+
+	queue_fd[0] = device_fd;
+
+	for(i = 1; i < device_queues; i++) {
+		queue_fd[i] = open(device, O_RDWR | O_NONBLOCK);
+
+		if(queue_fd[i] < 0) {
+			logger(LOG_WARNING, "Could not open queue %d of %s: %s", i, device, strerror(errno));
+			break;
+		}
+
+#ifdef FD_CLOEXEC
+		fcntl(queue_fd[i], F_SETFD, FD_CLOEXEC);
+#endif
+
+		if(ioctl(queue_fd[i], TUNSETIFF, ifr)) {
+			logger(LOG_WARNING, "Could not attach queue %d to %s: %s", i, ifrname, strerror(errno));
+			close(queue_fd[i]);
+			break;
+		}
+
+		io_add(&queue_io[i], handle_queue_data, &queue_fd[i], queue_fd[i], IO_READ);
+	}
+
+	device_queues = i;
+
+	ifdebug(STATUS) logger(LOG_DEBUG, "Using %d queues on %s", device_queues, ifrname);
+}
+
+/*
+  Spread writes over the queues by IP addresses, so all packets of a flow use the same queue.
+  The kernel remembers which queue a flow arrived on and sends replies out the same queue.
+*/
+static int select_queue(const vpn_packet_t *packet) {
+	const uint8_t *p;
+	int i, len;
+	uint32_t hash = 0;
+
+	if(device_queues <= 1)
+		return device_fd;
+
+	switch(packet->data[12] << 8 | packet->data[13]) {
+		case ETH_P_IP:
+			if(packet->len < 34)
+				return device_fd;
+			p = packet->data + 26;
+			len = 8;
+			break;
+		case ETH_P_IPV6:
+			if(packet->len < 54)
+				return device_fd;
+			p = packet->data + 22;
+			len = 32;
+			break;
+		default:
+			return device_fd;
+	}
+
+	for(i = 0; i < len; i++)
+		hash = hash * 31 + p[i];
+
+	return queue_fd[hash % device_queues];
+}
+
+#ifdef HAVE_OFFLOAD
+static void setup_offload(void) {
+	if(ioctl(device_fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN))
+		logger(LOG_WARNING, "Could not enable offloading on %s: %s", ifrname, strerror(errno));
+	else
+		ifdebug(STATUS) logger(LOG_DEBUG, "Enabled segmentation offloading on %s", ifrname);
+
+	gso_frame = xmalloc(GSO_FRAME_SIZE);
+	gso_len = 0;
+}
+
+/* Fill in a checksum the kernel left to us, see VIRTIO_NET_HDR_F_NEEDS_CSUM */
+
+static bool complete_checksum(uint8_t *frame, int len, int start, int offset) {
+	if(start < 0 || start + offset + 2 > len)
+		return false;
+
+	uint16_t sum = inet_checksum(frame + start, len - start, ~0);
+
+	/* In UDP, a checksum of zero means there is none */
+
+	if(!sum && offset == 6)
+		sum = 0xFFFF;
+
+	memcpy(frame + start + offset, &sum, 2);
+
+	return true;
+}
+
+/* Check the headers of a TCP super-packet in gso_frame, and prepare to cut it into segments */
+
+static bool setup_segments(const struct virtio_net_hdr *hdr, int start, int len) {
+	int type = hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+	int l3 = ether_size;
+	int ethertype = gso_frame[12] << 8 | gso_frame[13];
+
+	if(ethertype == ETH_P_8021Q) {
+		l3 += 4;
+		ethertype = gso_frame[16] << 8 | gso_frame[17];
+	}
+
+	if(!(hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM))
+		return false;
+
+	if(!(type == VIRTIO_NET_HDR_GSO_TCPV4 && ethertype == ETH_P_IP)
+			&& !(type == VIRTIO_NET_HDR_GSO_TCPV6 && ethertype == ETH_P_IPV6))
+		return false;
+
+	gso_l3 = l3;
+	gso_l4 = start + hdr->csum_start;
+
+	if(gso_l4 < gso_l3 + 20 || gso_l4 + 20 > len)
+		return false;
+
+	gso_hdrlen = gso_l4 + (gso_frame[gso_l4 + 12] >> 4) * 4;
+	gso_size = hdr->gso_size;
+
+	if(gso_hdrlen < gso_l4 + 20 || gso_hdrlen >= len || !gso_size || gso_hdrlen + gso_size > max_frame_size)
+		return false;
+
+	gso_offset = gso_hdrlen;
+	gso_len = len;
+
+	return true;
+}
+
+/* Copy the next segment out of gso_frame, with the IP and TCP headers adjusted for it */
+
+static void next_segment(vpn_packet_t *packet) {
+	int payload = gso_len - gso_offset < gso_size ? gso_len - gso_offset : gso_size;
+	int segment = (gso_offset - gso_hdrlen) / gso_size;
+	bool last = gso_offset + payload == gso_len;
+	uint8_t *ip = packet->data + gso_l3;
+	uint8_t *tcp = packet->data + gso_l4;
+	uint8_t pseudo[40];
+	int pseudolen, tcplen;
+	uint16_t sum;
+	uint32_t seq;
+
+	memcpy(packet->data, gso_frame, gso_hdrlen);
+	memcpy(packet->data + gso_hdrlen, gso_frame + gso_offset, payload);
+	packet->len = gso_hdrlen + payload;
+	tcplen = packet->len - gso_l4;
+
+	if(ip[0] >> 4 == 4) {
+		int id = (ip[4] << 8 | ip[5]) + segment;
+
+		ip[2] = (packet->len - gso_l3) >> 8;
+		ip[3] = packet->len - gso_l3;
+		ip[4] = id >> 8;
+		ip[5] = id;
+		ip[10] = ip[11] = 0;
+		sum = inet_checksum(ip, (ip[0] & 0xf) * 4, ~0);
+		memcpy(ip + 10, &sum, 2);
+
+		memcpy(pseudo, ip + 12, 8);
+		pseudo[8] = 0;
+		pseudo[9] = IPPROTO_TCP;
+		pseudo[10] = tcplen >> 8;
+		pseudo[11] = tcplen;
+		pseudolen = 12;
+	} else {
+		ip[4] = (packet->len - gso_l3 - 40) >> 8;
+		ip[5] = packet->len - gso_l3 - 40;
+
+		memcpy(pseudo, ip + 8, 32);
+		pseudo[32] = pseudo[33] = 0;
+		pseudo[34] = tcplen >> 8;
+		pseudo[35] = tcplen;
+		pseudo[36] = pseudo[37] = pseudo[38] = 0;
+		pseudo[39] = IPPROTO_TCP;
+		pseudolen = 40;
+	}
+
+	seq = (tcp[4] << 24 | tcp[5] << 16 | tcp[6] << 8 | tcp[7]) + (gso_offset - gso_hdrlen);
+	tcp[4] = seq >> 24;
+	tcp[5] = seq >> 16;
+	tcp[6] = seq >> 8;
+	tcp[7] = seq;
+
+	/* FIN and PSH only go with the last segment, CWR only with the first */
+
+	if(!last)
+		tcp[13] &= ~0x09;
+
+	if(segment)
+		tcp[13] &= ~0x80;
+
+	tcp[16] = tcp[17] = 0;
+	sum = inet_checksum(pseudo, pseudolen, ~0);
+	sum = inet_checksum(tcp, tcplen, sum);
+	memcpy(tcp + 16, &sum, 2);
+
+	gso_offset += payload;
+
+	if(last)
+		gso_len = 0;
+}
+
+/*
+  Read a packet with a virtio-net header in front of it, and in tun mode the
+  packet information in front of that. The packet goes straight into the
+  vpn_packet_t, only the part of a super-packet beyond that goes to gso_frame.
+*/
+
+static bool read_offload(vpn_packet_t *packet) {
+	struct virtio_net_hdr hdr;
+	struct iovec iov[4];
+	int n = 0, start = 0, len;
+
+	if(gso_len) {
+		next_segment(packet);
+		return true;
+	}
+
+	if(device_type == DEVICE_TYPE_TUN) {
+		iov[n].iov_base = packet->data + 10;
+		iov[n++].iov_len = 4;
+		start = ether_size;
+	}
+
+	iov[n].iov_base = &hdr;
+	iov[n++].iov_len = sizeof hdr;
+	iov[n].iov_base = packet->data + start;
+	iov[n++].iov_len = max_frame_size - start;
+	iov[n].iov_base = gso_frame + max_frame_size;
+	iov[n++].iov_len = GSO_FRAME_SIZE - max_frame_size;
+
+	len = readv(read_fd, iov, n);
+
+	if(len <= 0) {
+		return read_error();
+	}
+
+	len -= (start ? 4 : 0) + sizeof hdr;
+
+	if(len <= 0) {
+		packet->len = 0;
+		return true;
+	}
+
+	len += start;
+
+	if(start)
+		memset(packet->data, 0, 12);
+
+	/* An ordinary packet */
+
+	if(hdr.gso_type == VIRTIO_NET_HDR_GSO_NONE && len <= max_frame_size) {
+		packet->len = len;
+
+		if(hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM && !complete_checksum(packet->data, len, start + hdr.csum_start, hdr.csum_offset)) {
+			ifdebug(TRAFFIC) logger(LOG_DEBUG, "Dropping packet from %s with bad checksum offsets", device_info);
+			packet->len = 0;
+		}
+
+		return true;
+	}
+
+	/* A super-packet, put it all in gso_frame */
+
+	memcpy(gso_frame, packet->data, len < max_frame_size ? len : max_frame_size);
+
+	if(hdr.gso_type == VIRTIO_NET_HDR_GSO_NONE || !setup_segments(&hdr, start, len)) {
+		ifdebug(TRAFFIC) logger(LOG_DEBUG, "Dropping packet of %d bytes from %s that we cannot segment", len, device_info);
+		packet->len = 0;
+		return true;
+	}
+
+	next_segment(packet);
+
+	return true;
+}
+
+static bool pending_packets(void) {
+	return gso_len;
+}
+#endif
+
+/* Write a frame, with an empty virtio-net header after the first pilen bytes if we use one */
+
+static ssize_t write_frame(int fd, uint8_t *data, int len, int pilen) {
+#ifdef HAVE_OFFLOAD
+	if(offload) {
+		struct iovec iov[3] = {
+			{data, pilen},
+			{(void *)&vnet_none, sizeof vnet_none},
+			{data + pilen, len - pilen},
+		};
+
+		return writev(fd, iov, 3);
+	}
+#endif
+
+	return write(fd, data, len);
+}
+
 static bool setup_device(void) {
 	struct ifreq ifr;
 	bool t1q = false;
@@ -101,6 +464,16 @@ static bool setup_device(void) {
 		device_info = "Linux tun/tap device (tap mode)";
 	}
 
+#ifdef HAVE_OFFLOAD
+	get_config_bool(lookup_config(config_tree, "DeviceOffload"), &offload);
+
+	if(offload)
+		ifr.ifr_flags |= IFF_VNET_HDR;
+#else
+	if(lookup_config(config_tree, "DeviceOffload"))
+		logger(LOG_WARNING, "DeviceOffload is not supported on this platform");
+#endif
+
 #ifdef IFF_ONE_QUEUE
 	/* Set IFF_ONE_QUEUE flag... */
 	if(get_config_bool(lookup_config(config_tree, "IffOneQueue"), &t1q) && t1q)
@@ -112,13 +485,49 @@ static bool setup_device(void) {
 		ifr.ifr_name[IFNAMSIZ - 1] = 0;
 	}
 
-	if(!ioctl(device_fd, TUNSETIFF, &ifr)) {
+	int result = -1;
+
+#ifdef IFF_MULTI_QUEUE
+	if(get_config_int(lookup_config(config_tree, "DeviceQueues"), &device_queues)) {
+		if(device_queues < 1 || device_queues > MAXQUEUES) {
+			logger(LOG_ERR, "DeviceQueues must be between 1 and %d!", MAXQUEUES);
+			return false;
+		}
+	}
+
+	if(device_queues > 1) {
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+		result = ioctl(device_fd, TUNSETIFF, &ifr);
+
+		if(result) {
+			logger(LOG_WARNING, "Could not enable multiple queues on %s: %s", device, strerror(errno));
+			ifr.ifr_flags &= ~IFF_MULTI_QUEUE;
+			device_queues = 1;
+		}
+	}
+#else
+	if(lookup_config(config_tree, "DeviceQueues"))
+		logger(LOG_WARNING, "DeviceQueues is not supported on this platform");
+#endif
+
+	if(!result || !ioctl(device_fd, TUNSETIFF, &ifr)) {
 		strncpy(ifrname, ifr.ifr_name, IFNAMSIZ);
 		ifrname[IFNAMSIZ - 1] = 0;
 		free(iface);
 		iface = xstrdup(ifrname);
+
+#ifdef HAVE_OFFLOAD
+		if(offload)
+			setup_offload();
+#endif
+
+		if(device_queues > 1)
+			setup_queues(&ifr);
 	} else if(!ioctl(device_fd, (('T' << 8) | 202), &ifr)) {
 		logger(LOG_WARNING, "Old ioctl() request was needed for %s", device);
+#ifdef HAVE_OFFLOAD
+		offload = false;
+#endif
 		strncpy(ifrname, ifr.ifr_name, IFNAMSIZ);
 		ifrname[IFNAMSIZ - 1] = 0;
 		free(iface);
@@ -128,6 +537,10 @@ static bool setup_device(void) {
 	{
 		if(routing_mode == RMODE_ROUTER)
 			overwrite_mac = true;
+		device_queues = 1;
+#ifdef HAVE_OFFLOAD
+		offload = false;
+#endif
 		device_info = "Linux ethertap device";
 		device_type = DEVICE_TYPE_ETHERTAP;
 		free(iface);
@@ -139,12 +552,26 @@ static bool setup_device(void) {
 
 	logger(LOG_INFO, "%s is a %s", device, device_info);
 
+	read_fd = device_fd;
+
 	return true;
 }
 
 static void close_device(void) {
+	for(int i = 1; i < device_queues; i++) {
+		io_del(&queue_io[i]);
+		close(queue_fd[i]);
+	}
+
 	close(device_fd);
 
+#ifdef HAVE_OFFLOAD
+	free(gso_frame);
+	gso_frame = NULL;
+	gso_len = 0;
+	offload = false;
+#endif
+
 	free(type);
 	free(device);
 	free(iface);
@@ -152,44 +579,50 @@ static void close_device(void) {
 
 static bool read_packet(vpn_packet_t *packet) {
 	int lenin;
+
+#ifdef HAVE_OFFLOAD
+	if(offload) {
+		if(!read_offload(packet))
+			return false;
+
+		goto done;
+	}
+#endif
 	
 	switch(device_type) {
 		case DEVICE_TYPE_TUN:
-			lenin = read(device_fd, packet->data + 10, MTU - 10);
+			lenin = read(read_fd, packet->data + 10, max_frame_size - 10);
 
 			if(lenin <= 0) {
-				logger(LOG_ERR, "Error while reading from %s %s: %s",
-					   device_info, device, strerror(errno));
-				return false;
+				return read_error();
 			}
 
 			memset(packet->data, 0, 12);
 			packet->len = lenin + 10;
 			break;
 		case DEVICE_TYPE_TAP:
-			lenin = read(device_fd, packet->data, MTU);
+			lenin = read(read_fd, packet->data, max_frame_size);
 
 			if(lenin <= 0) {
-				logger(LOG_ERR, "Error while reading from %s %s: %s",
-					   device_info, device, strerror(errno));
-				return false;
+				return read_error();
 			}
 
 			packet->len = lenin;
 			break;
 		case DEVICE_TYPE_ETHERTAP:
-			lenin = read(device_fd, packet->data - 2, MTU + 2);
+			lenin = read(device_fd, packet->data - 2, max_frame_size + 2);
 
 			if(lenin <= 0) {
-				logger(LOG_ERR, "Error while reading from %s %s: %s",
-					   device_info, device, strerror(errno));
-				return false;
+				return read_error();
 			}
 
 			packet->len = lenin - 2;
 			break;
 	}
 
+#ifdef HAVE_OFFLOAD
+done:
+#endif
 	device_total_in += packet->len;
 
 	ifdebug(TRAFFIC) logger(LOG_DEBUG, "Read packet of %d bytes from %s", packet->len,
@@ -199,20 +632,22 @@ static bool read_packet(vpn_packet_t *packet) {
 }
 
 static bool write_packet(vpn_packet_t *packet) {
+	int fd = select_queue(packet);
+
 	ifdebug(TRAFFIC) logger(LOG_DEBUG, "Writing packet of %d bytes to %s",
 			   packet->len, device_info);
 
 	switch(device_type) {
 		case DEVICE_TYPE_TUN:
 			packet->data[10] = packet->data[11] = 0;
-			if(write(device_fd, packet->data + 10, packet->len - 10) < 0) {
+			if(write_frame(fd, packet->data + 10, packet->len - 10, 4) < 0) {
 				logger(LOG_ERR, "Can't write to %s %s: %s", device_info, device,
 					   strerror(errno));
 				return false;
 			}
 			break;
 		case DEVICE_TYPE_TAP:
-			if(write(device_fd, packet->data, packet->len) < 0) {
+			if(write_frame(fd, packet->data, packet->len, 0) < 0) {
 				logger(LOG_ERR, "Can't write to %s %s: %s", device_info, device,
 					   strerror(errno));
 				return false;
@@ -234,6 +669,24 @@ static bool write_packet(vpn_packet_t *packet) {
 	return true;
 }
 
+/* There is no system call that reads many packets from a tun/tap device, but we can read
+   all it has at once, instead of waiting for the next iteration of the main loop every time */
+
+static int read_batch(vpn_packet_t **packets, int n) {
+	int num;
+
+	for(num = 0; num < n; num++) {
+		draining = num > 0;
+
+		if(!read_packet(packets[num]))
+			break;
+	}
+
+	draining = false;
+
+	return num ? num : -1;
+}
+
 static void dump_device_stats(void) {
 	logger(LOG_DEBUG, "Statistics for %s %s:", device_info, device);
 	logger(LOG_DEBUG, " total bytes in:  %10"PRIu64, device_total_in);
@@ -246,4 +699,8 @@ const devops_t os_devops = {
 	.read = read_packet,
 	.write = write_packet,
 	.dump_stats = dump_device_stats,
+#ifdef HAVE_OFFLOAD
+	.pending = pending_packets,
+#endif
+	.read_batch = read_batch,
 };
@@ -25,6 +25,8 @@
 
 /* (De)constructors */
 
+static xslab_t list_node_slab = XSLAB_INIT("list_node", list_node_t);
+
 list_t *list_alloc(list_action_t delete) {
 	list_t *list;
 
@@ -39,14 +41,14 @@ void list_free(list_t *list) {
 }
 
 list_node_t *list_alloc_node(void) {
-	return xmalloc_and_zero(sizeof(list_node_t));
+	return xslab_alloc_and_zero(&list_node_slab);
 }
 
 void list_free_node(list_t *list, list_node_t *node) {
 	if(node->data && list->delete)
 		list->delete(node->data);
 
-	free(node);
+	xslab_free(&list_node_slab, node);
 }
 
 /* Insertion and deletion */
@@ -33,6 +33,44 @@ static HANDLE loghandle = NULL;
 #endif
 static const char *logident = NULL;
 
+/*
+  While the main loop runs, messages are collected in logbuf and written
+  out in one go when the loop is about to wait for I/O, or when logbuf is
+  full, instead of with a write and a flush per message. The timestamp for
+  the log file is only formatted again when the second changes. In syslog
+  mode, each message is stored with its priority in front of it and
+  terminated by a NUL.
+
+  Unless packets are being debugged, each distinct warning or error is
+  logged at most logratelimit times per second. Messages are told apart by
+  their text, so the same error about two different peers is logged for
+  both. The rest are counted, and a summary is logged once the second is
+  over. Informational and debug messages, such as the dumps made on
+  SIGUSR1 and SIGUSR2, are never limited.
+*/
+
+#define LOGBUFSIZE 65536
+#define LOGRATESLOTS 64
+
+int logratelimit = 10;
+
+static char logbuf[LOGBUFSIZE];
+static int loglen = 0;
+static bool logbuffered = false;
+
+static time_t logtime = 0;
+static char logtimestr[32] = "";
+
+static struct {
+	uint32_t hash;
+	char message[128];		/* the start of the message, for the summary */
+	time_t second;
+	int count;
+	int suppressed;
+} lograte[LOGRATESLOTS];
+
+static int logsuppressed = 0;		/* slots with a summary still to be logged */
+
 void openlogger(const char *ident, logmode_t mode) {
 	logident = ident;
 	logmode = mode;
@@ -68,71 +106,195 @@ void openlogger(const char *ident, logmode_t mode) {
 	}
 }
 
-void reopenlogger() {
-	if(logmode != LOGMODE_FILE)
+static void writelogger(void) {
+	if(!loglen)
 		return;
 
-	fflush(logfile);
-	FILE *newfile = fopen(logfilename, "a");
-	if(!newfile) {
-		logger(LOG_ERR, "Unable to reopen log file %s: %s", logfilename, strerror(errno));
-		return;
+	switch(logmode) {
+		case LOGMODE_STDERR:
+			fwrite(logbuf, loglen, 1, stderr);
+			fflush(stderr);
+			break;
+		case LOGMODE_FILE:
+			fwrite(logbuf, loglen, 1, logfile);
+			fflush(logfile);
+			break;
+		case LOGMODE_SYSLOG:
+#if defined(HAVE_SYSLOG_H) && !defined(HAVE_MINGW)
+			for(char *p = logbuf; p < logbuf + loglen; p += strlen(p) + 1) {
+				int priority = *p++;
+				syslog(priority, "%s", p);
+			}
+#endif
+			break;
+		case LOGMODE_NULL:
+			break;
 	}
-	fclose(logfile);
-	logfile = newfile;
+
+	loglen = 0;
 }
 
-void logger(int priority, const char *format, ...) {
-	va_list ap;
-	char timestr[32] = "";
+static void logmessage(int priority, const char *message) {
 	time_t now;
-
-	va_start(ap, format);
+	int len;
 
 	switch(logmode) {
 		case LOGMODE_STDERR:
-			vfprintf(stderr, format, ap);
-			fprintf(stderr, "\n");
-			fflush(stderr);
+			if(!logbuffered) {
+				fprintf(stderr, "%s\n", message);
+				fflush(stderr);
+				break;
+			}
+
+			len = strlen(message) + 1;
+			if(loglen + len > LOGBUFSIZE)
+				writelogger();
+			memcpy(logbuf + loglen, message, len - 1);
+			logbuf[loglen + len - 1] = '\n';
+			loglen += len;
 			break;
 		case LOGMODE_FILE:
 			now = time(NULL);
-			strftime(timestr, sizeof timestr, "%Y-%m-%d %H:%M:%S", localtime(&now));
-			fprintf(logfile, "%s %s[%ld]: ", timestr, logident, (long)logpid);
-			vfprintf(logfile, format, ap);
-			fprintf(logfile, "\n");
-			fflush(logfile);
+			if(now != logtime) {
+				strftime(logtimestr, sizeof logtimestr, "%Y-%m-%d %H:%M:%S", localtime(&now));
+				logtime = now;
+			}
+
+			if(!logbuffered) {
+				fprintf(logfile, "%s %s[%ld]: %s\n", logtimestr, logident, (long)logpid, message);
+				fflush(logfile);
+				break;
+			}
+
+			len = strlen(logtimestr) + strlen(logident) + strlen(message) + 32;
+			if(loglen + len > LOGBUFSIZE)
+				writelogger();
+			loglen += snprintf(logbuf + loglen, LOGBUFSIZE - loglen, "%s %s[%ld]: %s\n", logtimestr, logident, (long)logpid, message);
 			break;
 		case LOGMODE_SYSLOG:
 #ifdef HAVE_MINGW
 			{
-				char message[4096];
 				const char *messages[] = {message};
-				vsnprintf(message, sizeof(message), format, ap);
 				ReportEvent(loghandle, priority, 0, 0, NULL, 1, 0, messages, NULL);
 			}
 #else
 #ifdef HAVE_SYSLOG_H
-#ifdef HAVE_VSYSLOG
-			vsyslog(priority, format, ap);
-#else
-			{
-				char message[4096];
-				vsnprintf(message, sizeof(message), format, ap);
+			if(!logbuffered) {
 				syslog(priority, "%s", message);
+				break;
 			}
-#endif
-			break;
+
+			len = strlen(message) + 2;
+			if(loglen + len > LOGBUFSIZE)
+				writelogger();
+			logbuf[loglen] = priority;
+			memcpy(logbuf + loglen + 1, message, len - 1);
+			loglen += len;
 #endif
 #endif
+			break;
 		case LOGMODE_NULL:
 			break;
 	}
+}
+
+static void logsummary(int slot) {
+	char message[256];
+
+	snprintf(message, sizeof message, "Suppressed %d more messages like \"%s\"",
+			lograte[slot].suppressed, lograte[slot].message);
+	lograte[slot].suppressed = 0;
+	logsuppressed--;
+	logmessage(LOG_NOTICE, message);
+}
+
+/* Log the summaries of seconds that are over, and write out buffered messages */
+
+void flushlogger(void) {
+	if(logsuppressed) {
+		time_t now = time(NULL);
+
+		for(int i = 0; i < LOGRATESLOTS; i++)
+			if(lograte[i].suppressed && lograte[i].second != now)
+				logsummary(i);
+	}
+
+	writelogger();
+}
+
+/* Buffer messages from now on, or write them out and stop doing so */
+
+void bufferlogger(bool enable) {
+	if(!enable)
+		flushlogger();
+
+	logbuffered = enable;
+}
+
+void reopenlogger() {
+	if(logmode != LOGMODE_FILE)
+		return;
+
+	writelogger();
+	fflush(logfile);
+	FILE *newfile = fopen(logfilename, "a");
+	if(!newfile) {
+		logger(LOG_ERR, "Unable to reopen log file %s: %s", logfilename, strerror(errno));
+		return;
+	}
+	fclose(logfile);
+	logfile = newfile;
+}
+
+void logger(int priority, const char *format, ...) {
+	va_list ap;
+	char message[4096];
+
+	if(logmode == LOGMODE_NULL)
+		return;
 
+	va_start(ap, format);
+	vsnprintf(message, sizeof message, format, ap);
 	va_end(ap);
+
+	if(logratelimit > 0 && priority <= LOG_WARNING && debug_level < DEBUG_TRAFFIC) {
+		uint32_t hash = 2166136261U;
+		time_t now = time(NULL);
+
+		for(const char *p = message; *p; p++)
+			hash = (hash ^ (uint8_t)*p) * 16777619U;
+
+		int slot = hash % LOGRATESLOTS;
+
+		if(lograte[slot].hash != hash || lograte[slot].second != now) {
+			if(lograte[slot].suppressed)
+				logsummary(slot);
+
+			lograte[slot].hash = hash;
+			size_t len = strlen(message);
+
+			if(len >= sizeof lograte[slot].message)
+				len = sizeof lograte[slot].message - 1;
+
+			memcpy(lograte[slot].message, message, len);
+			lograte[slot].message[len] = 0;
+			lograte[slot].second = now;
+			lograte[slot].count = 0;
+		}
+
+		if(++lograte[slot].count > logratelimit) {
+			if(!lograte[slot].suppressed++)
+				logsuppressed++;
+			return;
+		}
+	}
+
+	logmessage(priority, message);
 }
 
 void closelogger(void) {
+	flushlogger();
+
 	switch(logmode) {
 		case LOGMODE_FILE:
 			fclose(logfile);
@@ -46,9 +46,12 @@ enum {
 #endif
 
 extern debug_t debug_level;
+extern int logratelimit;
 extern void openlogger(const char *, logmode_t);
 extern void reopenlogger(void);
 extern void logger(int, const char *, ...) __attribute__ ((__format__(printf, 2, 3)));
+extern void bufferlogger(bool);
+extern void flushlogger(void);
 extern void closelogger(void);
 
 #define ifdebug(l) if(debug_level >= DEBUG_##l)
@@ -0,0 +1,948 @@
+/*
+    meshsim.c -- run many daemons in one process to measure convergence
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "system.h"
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <openssl/evp.h>
+
+#include "avl_tree.h"
+#include "conf.h"
+#include "connection.h"
+#include "damping.h"
+#include "edge.h"
+#include "event.h"
+#include "graph.h"
+#include "logger.h"
+#include "meta.h"
+#include "net.h"
+#include "node.h"
+#include "protocol.h"
+#include "subnet.h"
+#include "xalloc.h"
+
+/*
+  Built with "make meshsim", and linked with everything in tincd except
+  tincd.c. It runs a number of logical daemons in one process, connects
+  their meta connections with in-memory pipes, and plays a script of churn
+  against them, reporting how long the mesh takes to settle after each step.
+
+  The daemon keeps its state in global variables. Each simulated node gets
+  its own copy of all of them: the data and bss segments of the program are
+  mapped from a memory file per node, and switching to another node maps
+  its file there instead. Only what is in those segments is switched; the
+  heap is shared, which is fine, since every node only frees what it
+  allocated itself. The simulator's own state lives on the heap, reached
+  through a pointer that is set before the first copy is made.
+  This relies on the GNU toolchain's __data_start and _end symbols, and on
+  being linked dynamically, so the C library keeps its state to itself.
+
+  Time is simulated: nodes only run when a message arrives for them or one
+  of their timers expires, and the clock jumps ahead to whatever is next.
+  Meta connections are set up with the same requests as real ones, but
+  without authentication, as with the --bypass-security option.
+
+  Every result is one line of the form
+
+    name key=value ...
+
+  as with microbench, and the random numbers come from a fixed seed, so a
+  script always produces the same messages.
+*/
+
+/* The variables tincd.c normally provides to the rest of the daemon */
+
+char *program_name = "meshsim";
+bool bypass_security = true;
+bool do_mlock = false;
+bool use_logfile = false;
+char *identname = NULL;
+char *pidfilename = NULL;
+char *logfilename = NULL;
+char **g_argv;
+
+#define SIM_START 1400000000000ULL		/* milliseconds, the clock of all nodes starts here */
+#define SIM_TIMEOUT 600000			/* milliseconds to wait for the mesh to settle */
+
+/* Data written by one side of a link, and when it arrives at the other, a negative length is a closed connection */
+
+typedef struct sim_chunk_t {
+	struct sim_chunk_t *next;
+	uint64_t time;
+	int len;
+	char data[];
+} sim_chunk_t;
+
+typedef struct sim_link_t {
+	int node[2];				/* the two ends, the first one made the connection */
+	int latency;				/* milliseconds, also the weight of the edges */
+	bool up;				/* whether the script wants this link to be there */
+	bool cut;				/* taken down by partition or isolate, to be brought back by heal */
+	connection_t *c[2];			/* the connection each end has, NULL once it is gone */
+	sim_chunk_t *head[2];			/* data on its way to each end */
+	sim_chunk_t *tail[2];
+} sim_link_t;
+
+typedef struct sim_node_t {
+	char name[16];
+	int fd;					/* memory file with this node's copy of the data and bss segments */
+	uint64_t next_timer;			/* when the node's first event expires, UINT64_MAX if none */
+	uint64_t next_input;			/* when the first data for the node arrives, UINT64_MAX if none */
+	uint64_t last_aged;			/* when age_past_requests() ran last */
+	uint64_t cpu_ns;			/* CPU time used since the last report */
+	int *links;				/* indices of the links this node is an end of */
+	int nlinks;
+	int component;				/* see converged() */
+} sim_node_t;
+
+typedef struct sim_t {
+	char *data;				/* the part of the address space that is switched */
+	size_t datalen;
+	sim_node_t *current;
+
+	uint32_t seed;
+	uint64_t clock;
+	uint64_t event_time;			/* when the step that is being measured started */
+	bool stepped;				/* whether any node ran since the last check for convergence */
+	int latency;				/* for new links */
+	int subnets;				/* per node */
+
+	sim_node_t *nodes;
+	int nnodes;
+	sim_link_t *links;
+	int nlinks;
+	int maxlinks;
+	int inflight;				/* chunks on their way */
+
+	uint64_t messages[LAST];		/* requests sent since the last report */
+	uint64_t bytes;
+	int *component_size;			/* scratch space for converged() */
+	int *component_links;
+	int *queue;
+} sim_t;
+
+static sim_t *sim;
+
+static uint32_t xorshift(void) {
+	sim->seed ^= sim->seed << 13;
+	sim->seed ^= sim->seed >> 17;
+	sim->seed ^= sim->seed << 5;
+	return sim->seed;
+}
+
+/* Switching between nodes */
+
+static void setup_segments(void) {
+	extern char __data_start[], _end[];
+	long pagesize = sysconf(_SC_PAGESIZE);
+	struct rlimit limit;
+
+	sim->data = (char *)((uintptr_t)__data_start & ~(uintptr_t)(pagesize - 1));
+	sim->datalen = ((uintptr_t)_end - (uintptr_t)sim->data + pagesize - 1) & ~(uintptr_t)(pagesize - 1);
+
+	/* Every node keeps a file descriptor open */
+
+	if(!getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+/* Give a node a copy of the segments as they are now, only pages that are not all zeroes take up memory */
+
+static void copy_segments(sim_node_t *sn) {
+	long pagesize = sysconf(_SC_PAGESIZE);
+
+#ifdef MFD_CLOEXEC
+	sn->fd = memfd_create(sn->name, MFD_CLOEXEC);
+#else
+	FILE *f = tmpfile();
+	sn->fd = f ? dup(fileno(f)) : -1;
+	if(f)
+		fclose(f);
+#endif
+
+	if(sn->fd < 0 || ftruncate(sn->fd, sim->datalen)) {
+		fprintf(stderr, "Could not create memory file for %s: %s\n", sn->name, strerror(errno));
+		exit(1);
+	}
+
+	for(size_t offset = 0; offset < sim->datalen; offset += pagesize) {
+		const char *page = sim->data + offset;
+		long i;
+
+		for(i = 0; i < pagesize && !page[i]; i++);
+
+		if(i < pagesize && pwrite(sn->fd, page, pagesize, offset) != pagesize) {
+			fprintf(stderr, "Could not write memory file for %s: %s\n", sn->name, strerror(errno));
+			exit(1);
+		}
+	}
+}
+
+static void enter(sim_node_t *sn) {
+	if(sim->current != sn && mmap(sim->data, sim->datalen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, sn->fd, 0) == MAP_FAILED) {
+		fprintf(stderr, "Could not switch to %s: %s\n", sn->name, strerror(errno));
+		exit(1);
+	}
+
+	sim->current = sn;
+	set_clock(sim->clock);
+	now = sim->clock / 1000;
+}
+
+/* What setup_network() and setup_myself() do, without any configuration files, sockets or device */
+
+static void boot(sim_node_t *sn) {
+	int index = sn - sim->nodes;
+
+	enter(sn);
+
+	init_events();
+	init_connections();
+	init_subnets();
+	init_nodes();
+	init_edges();
+	init_damping();
+	init_requests();
+
+	myself = new_node();
+	myself->connection = new_connection();
+	node_tunnel(myself);
+
+	myself->name = xstrdup(sn->name);
+	myself->hostname = xstrdup("MYSELF");
+	myself->connection->name = xstrdup(sn->name);
+	myself->connection->hostname = xstrdup("MYSELF");
+	myself->connection->protocol_version = PROT_CURRENT;
+
+	myself->tunnel->incipher = EVP_bf_cbc();
+	myself->tunnel->inkeylength = myself->tunnel->incipher->key_len + myself->tunnel->incipher->iv_len;
+	myself->tunnel->indigest = EVP_sha1();
+	myself->tunnel->inmaclength = 4;
+	myself->connection->outcipher = EVP_bf_ofb();
+	myself->connection->outdigest = EVP_sha1();
+
+	for(int i = 0; i < sim->subnets; i++) {
+		subnet_t *subnet = new_subnet();
+		uint32_t address = index * sim->subnets + i;
+
+		subnet->type = SUBNET_IPV4;
+		subnet->weight = 10;
+		subnet->net.ipv4.address = (ipv4_t){{172, 16 + (address >> 16), address >> 8, address}};
+		subnet->net.ipv4.prefixlength = 32;
+		subnet_add(myself, subnet);
+	}
+
+	myself->nexthop = myself;
+	myself->via = myself;
+	myself->status.reachable = true;
+	node_add(myself);
+
+	graph();
+
+	sn->next_timer = sim->clock;
+	sn->next_input = UINT64_MAX;
+	sn->last_aged = sim->clock;
+}
+
+static void create_nodes(int count) {
+	sim->nodes = xmalloc_and_zero(count * sizeof *sim->nodes);
+	sim->nnodes = count;
+	sim->component_size = xmalloc(count * sizeof *sim->component_size);
+	sim->component_links = xmalloc(count * sizeof *sim->component_links);
+	sim->queue = xmalloc(count * sizeof *sim->queue);
+
+	/* All copies are made from the same state, before any node has run.
+	   Objects still on the free lists of the slabs would be handed out to
+	   every node at once, so they are left behind. */
+
+	for(xslab_t *slab = xslabs; slab; slab = slab->next)
+		slab->free = NULL;
+
+	for(int i = 0; i < count; i++) {
+		snprintf(sim->nodes[i].name, sizeof sim->nodes[i].name, "n%d", i);
+		copy_segments(&sim->nodes[i]);
+	}
+
+	for(int i = 0; i < count; i++)
+		boot(&sim->nodes[i]);
+}
+
+/* In-memory pipes */
+
+static void push_chunk(sim_link_t *link, int side, const char *data, int len) {
+	sim_node_t *sn = &sim->nodes[link->node[side]];
+	sim_chunk_t *chunk = xmalloc(sizeof *chunk + (len > 0 ? len : 0));
+
+	chunk->next = NULL;
+	chunk->time = sim->clock + link->latency;
+	chunk->len = len;
+	if(len > 0)
+		memcpy(chunk->data, data, len);
+
+	if(link->tail[side])
+		link->tail[side]->next = chunk;
+	else
+		link->head[side] = chunk;
+
+	link->tail[side] = chunk;
+	sim->inflight++;
+
+	if(chunk->time < sn->next_input)
+		sn->next_input = chunk->time;
+}
+
+static sim_chunk_t *pop_chunk(sim_link_t *link, int side) {
+	sim_chunk_t *chunk = link->head[side];
+
+	link->head[side] = chunk->next;
+	if(!link->head[side])
+		link->tail[side] = NULL;
+
+	sim->inflight--;
+	return chunk;
+}
+
+static void drop_chunks(sim_link_t *link, int side) {
+	while(link->head[side])
+		free(pop_chunk(link, side));
+}
+
+static int side_of(const sim_link_t *link, const sim_node_t *sn) {
+	return link->node[1] == sn - sim->nodes;
+}
+
+/* Hand him what has arrived for him, the way receive_meta() would */
+
+static void deliver(sim_node_t *sn) {
+	for(int i = 0; i < sn->nlinks; i++) {
+		sim_link_t *link = &sim->links[sn->links[i]];
+		int side = side_of(link, sn);
+
+		while(link->head[side] && link->head[side]->time <= sim->clock) {
+			sim_chunk_t *chunk = pop_chunk(link, side);
+			connection_t *c = link->c[side];
+
+			if(c && !c->status.remove) {
+				if(chunk->len < 0) {
+					ifdebug(CONNECTIONS) logger(LOG_NOTICE, "Connection closed by %s (%s)", c->name, c->hostname);
+					terminate_connection(c, c->status.active);
+				}
+
+				for(int done = 0, result; done < chunk->len; done += result) {
+					result = feed_meta(c, chunk->data + done, chunk->len - done);
+
+					if(result < 0) {
+						terminate_connection(c, c->status.active);
+						break;
+					}
+				}
+			}
+
+			free(chunk);
+		}
+	}
+}
+
+/* Count the requests in what he sends, and put it in the pipe to the other side, the way flush_meta() would */
+
+static void count_requests(const char *data, int len) {
+	const char *end = data + len, *eol;
+
+	for(; data < end; data = eol + 1) {
+		int request = atoi(data);
+
+		if(request >= 0 && request < LAST)
+			sim->messages[request]++;
+
+		eol = memchr(data, '\n', end - data);
+		if(!eol)
+			break;
+	}
+
+	sim->bytes += len;
+}
+
+static void drain(sim_node_t *sn) {
+	for(int i = 0; i < sn->nlinks; i++) {
+		sim_link_t *link = &sim->links[sn->links[i]];
+		int side = side_of(link, sn);
+		connection_t *c = link->c[side];
+
+		if(!c || !c->outbuflen)
+			continue;
+
+		/* Nobody is listening anymore if the other side has closed the connection */
+
+		if(link->c[!side]) {
+			count_requests(c->outbuf + c->outbufstart, c->outbuflen);
+			push_chunk(link, !side, c->outbuf + c->outbufstart, c->outbuflen);
+		}
+
+		c->outbufstart = 0;
+		c->outbuflen = 0;
+		c->status.flush = false;
+	}
+}
+
+/* Forget the connections he has terminated before remove_connections() frees them, and tell the other side */
+
+static void close_terminated(sim_node_t *sn) {
+	for(int i = 0; i < sn->nlinks; i++) {
+		sim_link_t *link = &sim->links[sn->links[i]];
+		int side = side_of(link, sn);
+
+		if(!link->c[side] || !link->c[side]->status.remove)
+			continue;
+
+		link->c[side] = NULL;
+		drop_chunks(link, side);
+
+		if(link->c[!side])
+			push_chunk(link, !side, NULL, -1);
+	}
+}
+
+/* One iteration of main_loop() for one node, at the current time */
+
+static void step(sim_node_t *sn) {
+	struct timespec start, end;
+	event_t *event;
+	int timeout;
+
+	enter(sn);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+	deliver(sn);
+
+	while((event = get_expired_event()))
+		event->handler(event->data);
+
+	if(do_purge) {
+		purge();
+		do_purge = false;
+	}
+
+	if(sn->last_aged + pingtimeout * 1000ULL <= sim->clock) {
+		age_past_requests();
+		sn->last_aged = sim->clock;
+	}
+
+	close_terminated(sn);
+
+	if(remove_pending)
+		remove_connections();
+
+	drain(sn);
+
+	timeout = event_timeout();
+	sn->next_timer = timeout < 0 ? UINT64_MAX : sim->clock + timeout;
+
+	sn->next_input = UINT64_MAX;
+
+	for(int i = 0; i < sn->nlinks; i++) {
+		sim_link_t *link = &sim->links[sn->links[i]];
+		int side = side_of(link, sn);
+
+		if(link->head[side] && link->head[side]->time < sn->next_input)
+			sn->next_input = link->head[side]->time;
+	}
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	sn->cpu_ns += (end.tv_sec - start.tv_sec) * 1000000000LL + end.tv_nsec - start.tv_nsec;
+	sim->stepped = true;
+}
+
+/* Links */
+
+static sim_link_t *find_link(int a, int b) {
+	sim_node_t *sn = &sim->nodes[a];
+
+	for(int i = 0; i < sn->nlinks; i++) {
+		sim_link_t *link = &sim->links[sn->links[i]];
+
+		if(link->node[!side_of(link, sn)] == b)
+			return link;
+	}
+
+	if(sim->nlinks == sim->maxlinks) {
+		sim->maxlinks = sim->maxlinks ? sim->maxlinks * 2 : 64;
+		sim->links = xrealloc(sim->links, sim->maxlinks * sizeof *sim->links);
+	}
+
+	sim_link_t *link = &sim->links[sim->nlinks];
+
+	memset(link, 0, sizeof *link);
+	link->node[0] = a;
+	link->node[1] = b;
+	link->latency = sim->latency;
+
+	for(int side = 0; side < 2; side++) {
+		sn = &sim->nodes[link->node[side]];
+		sn->links = xrealloc(sn->links, (sn->nlinks + 1) * sizeof *sn->links);
+		sn->links[sn->nlinks++] = sim->nlinks;
+	}
+
+	sim->nlinks++;
+	return link;
+}
+
+/* What new_incoming_connection() does, both sides send their ID once both exist */
+
+static void open_connection(sim_link_t *link, int side) {
+	sim_node_t *sn = &sim->nodes[link->node[side]];
+	sim_node_t *peer = &sim->nodes[link->node[!side]];
+	int index = peer - sim->nodes;
+	config_t *cfg;
+	connection_t *c;
+
+	enter(sn);
+
+	c = new_connection();
+	c->name = xstrdup("<unknown>");
+	c->hostname = xstrdup(peer->name);
+	c->outcipher = myself->connection->outcipher;
+	c->outdigest = myself->connection->outdigest;
+
+	c->address.in.sin_family = AF_INET;
+	c->address.in.sin_addr.s_addr = htonl(0x0a000000 | index);
+	c->address.in.sin_port = htons(655);
+	c->socket = -1;
+	c->last_ping_time = now_msec;
+
+	/* The latency of the link is the weight of its edges */
+
+	init_configuration(&c->config_tree);
+	cfg = new_config();
+	cfg->variable = xstrdup("Weight");
+	xasprintf(&cfg->value, "%d", link->latency);
+	cfg->file = xstrdup("meshsim");
+	config_add(c->config_tree, cfg);
+
+	schedule_connection_check(c);
+	connection_add(c);
+
+	c->allow_request = ID;
+	link->c[side] = c;
+}
+
+static void connect_link(int a, int b) {
+	sim_link_t *link;
+
+	if(a == b)
+		return;
+
+	link = find_link(a, b);
+
+	link->up = true;
+	link->cut = false;
+
+	if(link->c[0] || link->c[1])
+		return;
+
+	open_connection(link, 0);
+	open_connection(link, 1);
+
+	for(int side = 0; side < 2; side++) {
+		sim_node_t *sn = &sim->nodes[link->node[side]];
+
+		enter(sn);
+		send_id(link->c[side]);
+		step(sn);
+	}
+}
+
+static void disconnect_link(sim_link_t *link) {
+	link->up = false;
+
+	for(int side = 0; side < 2; side++) {
+		sim_node_t *sn = &sim->nodes[link->node[side]];
+		connection_t *c = link->c[side];
+
+		drop_chunks(link, side);
+
+		if(!c)
+			continue;
+
+		enter(sn);
+		terminate_connection(c, c->status.active);
+		step(sn);
+	}
+}
+
+/* Running time forward */
+
+/*
+  The mesh has settled when nothing is on its way, and every node sees as
+  reachable exactly the nodes that the links that are up connect it to,
+  with the two edges of each of those links.
+*/
+
+static bool converged(void) {
+	if(sim->inflight)
+		return false;
+
+	for(int i = 0; i < sim->nnodes; i++)
+		sim->nodes[i].component = -1;
+
+	for(int i = 0; i < sim->nnodes; i++) {
+		int head = 0, tail = 0;
+
+		if(sim->nodes[i].component >= 0)
+			continue;
+
+		sim->component_size[i] = 0;
+		sim->component_links[i] = 0;
+		sim->nodes[i].component = i;
+		sim->queue[tail++] = i;
+
+		while(head < tail) {
+			sim_node_t *sn = &sim->nodes[sim->queue[head++]];
+
+			sim->component_size[i]++;
+
+			for(int j = 0; j < sn->nlinks; j++) {
+				sim_link_t *link = &sim->links[sn->links[j]];
+				sim_node_t *other = &sim->nodes[link->node[!side_of(link, sn)]];
+
+				if(!link->up)
+					continue;
+
+				if(!side_of(link, sn))
+					sim->component_links[i]++;
+
+				if(other->component < 0) {
+					other->component = i;
+					sim->queue[tail++] = other - sim->nodes;
+				}
+			}
+		}
+	}
+
+	for(int i = 0; i < sim->nnodes; i++) {
+		sim_node_t *sn = &sim->nodes[i];
+		int reachable = 0, edges = 0;
+
+		enter(sn);
+
+		for(avl_node_t *node = node_tree->head; node; node = node->next) {
+			node_t *n = node->data;
+
+			if(n->status.reachable)
+				reachable++;
+		}
+
+		for(avl_node_t *node = edge_weight_tree->head; node; node = node->next) {
+			edge_t *e = node->data;
+
+			if(e->from->status.reachable && e->to->status.reachable)
+				edges++;
+		}
+
+		if(reachable != sim->component_size[sn->component] || edges != 2 * sim->component_links[sn->component])
+			return false;
+	}
+
+	return true;
+}
+
+/* Run until the given time, or until the mesh has settled if wait is set; returns whether it has */
+
+static bool run(uint64_t until, bool wait) {
+	for(;;) {
+		uint64_t next = UINT64_MAX;
+
+		if(wait && sim->stepped) {
+			sim->stepped = false;
+
+			if(converged())
+				return true;
+		}
+
+		for(int i = 0; i < sim->nnodes; i++) {
+			if(sim->nodes[i].next_timer < next)
+				next = sim->nodes[i].next_timer;
+			if(sim->nodes[i].next_input < next)
+				next = sim->nodes[i].next_input;
+		}
+
+		if(next > until) {
+			if(until > sim->clock)
+				sim->clock = until;
+			return false;
+		}
+
+		if(next > sim->clock)
+			sim->clock = next;
+
+		for(int i = 0; i < sim->nnodes; i++) {
+			sim_node_t *sn = &sim->nodes[i];
+
+			if(sn->next_timer <= sim->clock || sn->next_input <= sim->clock)
+				step(sn);
+		}
+	}
+}
+
+/* Reporting */
+
+static void report(const char *label, bool settled) {
+	uint64_t total = 0, max = 0, messages = 0, keys, pings, handshakes;
+	int links = 0;
+	struct rusage usage;
+
+	for(int i = 0; i < sim->nnodes; i++) {
+		total += sim->nodes[i].cpu_ns;
+		if(sim->nodes[i].cpu_ns > max)
+			max = sim->nodes[i].cpu_ns;
+		sim->nodes[i].cpu_ns = 0;
+	}
+
+	for(int i = 0; i < sim->nlinks; i++)
+		if(sim->links[i].up)
+			links++;
+
+	for(int i = 0; i < LAST; i++)
+		messages += sim->messages[i];
+
+	handshakes = sim->messages[ID] + sim->messages[ACK];
+	pings = sim->messages[PING] + sim->messages[PONG];
+	keys = sim->messages[KEY_CHANGED] + sim->messages[REQ_KEY] + sim->messages[ANS_KEY];
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("converge label=%s nodes=%d links=%d converged=%s time_ms=%"PRIu64" messages=%"PRIu64" bytes=%"PRIu64
+			" handshake=%"PRIu64" add_edge=%"PRIu64" add_edges=%"PRIu64" del_edge=%"PRIu64
+			" add_subnet=%"PRIu64" add_subnets=%"PRIu64" del_subnet=%"PRIu64
+			" key=%"PRIu64" ping=%"PRIu64" cpu_us_per_node=%.1f cpu_us_max=%.1f peak_rss_kb=%ld\n",
+			label, sim->nnodes, links, settled ? "yes" : "no", sim->clock - sim->event_time, messages, sim->bytes,
+			handshakes, sim->messages[ADD_EDGE], sim->messages[ADD_EDGES], sim->messages[DEL_EDGE],
+			sim->messages[ADD_SUBNET], sim->messages[ADD_SUBNETS], sim->messages[DEL_SUBNET],
+			keys, pings, sim->nnodes ? total / 1e3 / sim->nnodes : 0.0, max / 1e3, usage.ru_maxrss);
+	fflush(stdout);
+
+	memset(sim->messages, 0, sizeof sim->messages);
+	sim->bytes = 0;
+	sim->event_time = sim->clock;
+}
+
+/* The script */
+
+static const char *default_script[] = {
+	"nodes 100",
+	"random 3",
+	"converge join",
+	"partition 50",
+	"converge partition",
+	"heal",
+	"converge heal",
+	"isolate 0",
+	"converge leave",
+	"heal",
+	"converge rejoin",
+	"flap 1 2 10 100",
+	"converge flap",
+	"purge",
+	"converge purge",
+	NULL,
+};
+
+static int node_arg(const char *arg) {
+	int i = atoi(arg);
+
+	if(!arg[0] || i < 0 || i >= sim->nnodes) {
+		fprintf(stderr, "Invalid node %s\n", arg);
+		exit(1);
+	}
+
+	return i;
+}
+
+static void command(const char *line) {
+	char cmd[32], arg[4][32];
+	int argc = sscanf(line, "%31s %31s %31s %31s %31s", cmd, arg[0], arg[1], arg[2], arg[3]) - 1;
+
+	if(argc < 0 || cmd[0] == '#')
+		return;
+
+	/* Settings that all nodes have to start with */
+
+	if(!strcmp(cmd, "nodes") && argc == 1 && !sim->nnodes) {
+		create_nodes(atoi(arg[0]));
+		sim->event_time = sim->clock;
+	} else if(!strcmp(cmd, "subnets") && argc == 1 && !sim->nnodes) {
+		sim->subnets = atoi(arg[0]);
+	} else if(!strcmp(cmd, "graphdelay") && argc == 1 && !sim->nnodes) {
+		graph_delay = atoi(arg[0]);
+	} else if(!strcmp(cmd, "damping") && argc == 1 && !sim->nnodes) {
+		damping = atoi(arg[0]);
+	} else if(!strcmp(cmd, "latency") && argc == 1) {
+		sim->latency = atoi(arg[0]) > 0 ? atoi(arg[0]) : 1;
+	} else if(!sim->nnodes) {
+		fprintf(stderr, "Unknown command or no nodes yet: %s\n", line);
+		exit(1);
+
+	/* Changes to the links */
+
+	} else if(!strcmp(cmd, "connect") && argc == 2) {
+		connect_link(node_arg(arg[0]), node_arg(arg[1]));
+	} else if(!strcmp(cmd, "disconnect") && argc == 2) {
+		disconnect_link(find_link(node_arg(arg[0]), node_arg(arg[1])));
+	} else if(!strcmp(cmd, "ring") && argc == 0) {
+		for(int i = 0; i < sim->nnodes; i++)
+			connect_link(i, (i + 1) % sim->nnodes);
+	} else if(!strcmp(cmd, "star") && argc == 1) {
+		for(int i = 0, hub = node_arg(arg[0]); i < sim->nnodes; i++)
+			if(i != hub)
+				connect_link(i, hub);
+	} else if(!strcmp(cmd, "random") && argc == 1) {
+		for(int i = 1; i < sim->nnodes; i++)
+			for(int j = 0; j < atoi(arg[0]); j++)
+				connect_link(i, j ? xorshift() % sim->nnodes : xorshift() % i);
+	} else if(!strcmp(cmd, "partition") && argc == 1) {
+		int size = atoi(arg[0]);
+
+		for(int i = 0; i < sim->nlinks; i++) {
+			sim_link_t *link = &sim->links[i];
+
+			if(link->up && (link->node[0] < size) != (link->node[1] < size)) {
+				disconnect_link(link);
+				link->cut = true;
+			}
+		}
+	} else if(!strcmp(cmd, "isolate") && argc == 1) {
+		sim_node_t *sn = &sim->nodes[node_arg(arg[0])];
+
+		for(int i = 0; i < sn->nlinks; i++) {
+			sim_link_t *link = &sim->links[sn->links[i]];
+
+			if(link->up) {
+				disconnect_link(link);
+				link->cut = true;
+			}
+		}
+	} else if(!strcmp(cmd, "heal") && argc == 0) {
+		for(int i = 0; i < sim->nlinks; i++)
+			if(sim->links[i].cut)
+				connect_link(sim->links[i].node[0], sim->links[i].node[1]);
+	} else if(!strcmp(cmd, "flap") && argc == 4) {
+		int a = node_arg(arg[0]), b = node_arg(arg[1]);
+		int interval = atoi(arg[3]);
+
+		for(int i = 0; i < atoi(arg[2]); i++) {
+			disconnect_link(find_link(a, b));
+			run(sim->clock + interval, false);
+			connect_link(a, b);
+			run(sim->clock + interval, false);
+		}
+	} else if(!strcmp(cmd, "purge") && argc == 0) {
+		for(int i = 0; i < sim->nnodes; i++) {
+			enter(&sim->nodes[i]);
+			do_purge = true;
+			step(&sim->nodes[i]);
+		}
+
+	/* Time */
+
+	} else if(!strcmp(cmd, "run") && argc == 1) {
+		run(sim->clock + atoi(arg[0]), false);
+	} else if(!strcmp(cmd, "converge")) {
+		report(argc ? arg[0] : "-", run(sim->clock + SIM_TIMEOUT, true));
+	} else {
+		fprintf(stderr, "Unknown command: %s\n", line);
+		exit(1);
+	}
+}
+
+static void usage(void) {
+	fprintf(stderr, "Usage: %s [-d LEVEL] [SCRIPT]\n\n", program_name);
+	fprintf(stderr, "Without a script, a built-in one with 100 nodes is run. Commands, one per line:\n"
+			"  subnets N, graphdelay MS       before nodes: subnets per node, GraphUpdateDelay\n"
+			"  damping 0|1                    before nodes: FlapDamping\n"
+			"  nodes N                        create nodes 0 to N - 1\n"
+			"  latency MS                     latency and weight of links made after this\n"
+			"  connect A B, disconnect A B    bring a link up or down\n"
+			"  ring, star HUB, random DEGREE  connect all nodes\n"
+			"  partition N                    take down all links between nodes below N and the rest\n"
+			"  isolate A                      take down all links of a node\n"
+			"  heal                           bring back links taken down by partition and isolate\n"
+			"  flap A B COUNT MS              take a link down and up COUNT times, MS apart\n"
+			"  purge                          let all nodes forget unreachable nodes\n"
+			"  run MS                         let time pass\n"
+			"  converge [LABEL]               wait until the mesh has settled, and report\n");
+}
+
+int main(int argc, char **argv) {
+	FILE *script = NULL;
+	char line[1024];
+	int opt;
+
+	program_name = argv[0];
+	g_argv = argv;
+
+	while((opt = getopt(argc, argv, "d:h")) != -1) {
+		switch(opt) {
+			case 'd':
+				debug_level = atoi(optarg);
+				break;
+			default:
+				usage();
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if(optind < argc && !(script = strcmp(argv[optind], "-") ? fopen(argv[optind], "r") : stdin)) {
+		fprintf(stderr, "Could not open %s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+
+	/* Everything every node shares, set before the first copy of the segments is made */
+
+	sim = xmalloc_and_zero(sizeof *sim);
+	sim->seed = 1;
+	sim->clock = SIM_START;
+	sim->latency = 1;
+	sim->subnets = 1;
+
+	OpenSSL_add_all_algorithms();
+
+	init_configuration(&config_tree);
+	confbase = xstrdup("/nonexistent");
+	myport = xstrdup("655");
+	pinginterval = 60;
+	pingtimeout = 5;
+	pingtimeout_msec = 5000;
+	maxoutbufsize = 10 * max_frame_size;
+	set_clock(sim->clock);
+
+	setup_segments();
+
+	if(script) {
+		while(fgets(line, sizeof line, script))
+			command(line);
+	} else {
+		for(int i = 0; default_script[i]; i++)
+			command(default_script[i]);
+	}
+
+	return 0;
+}
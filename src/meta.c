@@ -24,8 +24,13 @@
 #include <openssl/err.h>
 #include <openssl/evp.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
 #include "avl_tree.h"
 #include "connection.h"
+#include "event.h"
 #include "logger.h"
 #include "meta.h"
 #include "net.h"
@@ -33,30 +38,36 @@
 #include "utils.h"
 #include "xalloc.h"
 
-bool send_meta(connection_t *c, const char *buffer, int length) {
-	int outlen;
+int metacompression = 0;
+static bool flush_pending = false;
+
+/* Append data to the output buffer, encrypting it if necessary */
+
+static bool buffer_meta(connection_t *c, const char *buffer, int length) {
+	int outlen, size;
 	int result;
 
-	if(!c) {
-		logger(LOG_ERR, "send_meta() called with NULL pointer!");
-		abort();
-	}
+	/* Find room in connection's buffer */
+	if(length + c->outbuflen + c->outbufstart > c->outbufsize) {
+		if(c->outbufstart) {
+			memmove(c->outbuf, c->outbuf + c->outbufstart, c->outbuflen);
+			c->outbufstart = 0;
+		}
 
-	ifdebug(META) logger(LOG_DEBUG, "Sending %d bytes of metadata to %s (%s)", length,
-			   c->name, c->hostname);
+		if(length + c->outbuflen > c->outbufsize) {
+			/* Grow geometrically, but never reserve more than maxoutbufsize bytes in advance */
 
-	if(!c->outbuflen)
-		c->last_flushed_time = now;
+			size = c->outbufsize ? c->outbufsize * 2 : MAXBUFSIZE;
 
-	/* Find room in connection's buffer */
-	if(length + c->outbuflen > c->outbufsize) {
-		c->outbufsize = length + c->outbuflen;
-		c->outbuf = xrealloc(c->outbuf, c->outbufsize);
-	}
+			if(size < length + c->outbuflen)
+				size = length + c->outbuflen;
 
-	if(length + c->outbuflen + c->outbufstart > c->outbufsize) {
-		memmove(c->outbuf, c->outbuf + c->outbufstart, c->outbuflen);
-		c->outbufstart = 0;
+			if(size > length + c->outbuflen + maxoutbufsize)
+				size = length + c->outbuflen + maxoutbufsize;
+
+			c->outbufsize = size;
+			c->outbuf = xrealloc(c->outbuf, c->outbufsize);
+		}
 	}
 
 	/* Add our data to buffer */
@@ -80,40 +91,456 @@ bool send_meta(connection_t *c, const char *buffer, int length) {
 	return true;
 }
 
+#ifdef HAVE_ZLIB
+/* Feed data to the compressor, and append whatever it produces to the output buffer */
+
+static bool deflate_meta(connection_t *c, const char *buffer, int length, int flush) {
+	char zbuf[MAXBUFSIZE];
+	z_stream *z = c->outstream;
+	int len;
+
+	z->next_in = (Bytef *)buffer;
+	z->avail_in = length;
+
+	do {
+		z->next_out = (Bytef *)zbuf;
+		z->avail_out = sizeof zbuf;
+
+		if(deflate(z, flush) == Z_STREAM_ERROR) {
+			logger(LOG_ERR, "Error while compressing metadata to %s (%s)", c->name, c->hostname);
+			return false;
+		}
+
+		len = sizeof zbuf - z->avail_out;
+
+		if(len && !buffer_meta(c, zbuf, len))
+			return false;
+	} while(!z->avail_out);
+
+	return true;
+}
+
+/* Inflate as much of the compressed input as fits into the input buffer */
+
+static bool inflate_meta(connection_t *c) {
+	z_stream *z = c->instream;
+	int result;
+
+	z->next_in = (Bytef *)c->inzbuf + c->inzstart;
+	z->avail_in = c->inzlen;
+	z->next_out = (Bytef *)c->buffer + c->buflen;
+	z->avail_out = MAXBUFSIZE - c->buflen;
+
+	result = inflate(z, Z_SYNC_FLUSH);
+
+	if(result != Z_OK && result != Z_BUF_ERROR) {
+		logger(LOG_ERR, "Error while decompressing metadata from %s (%s): %s",
+				c->name, c->hostname, z->msg ? z->msg : "unexpected end of stream");
+		return false;
+	}
+
+	c->inzstart += c->inzlen - z->avail_in;
+	c->inzlen = z->avail_in;
+	c->buflen = MAXBUFSIZE - z->avail_out;
+
+	return true;
+}
+#endif
+
+/* Everything sent from now on is compressed, respectively everything received from now on has to be decompressed */
+
+bool start_compress_meta(connection_t *c, int level) {
+#ifdef HAVE_ZLIB
+	c->outstream = xmalloc_and_zero(sizeof(z_stream));
+
+	if(deflateInit(c->outstream, level) != Z_OK) {
+		logger(LOG_ERR, "Error during initialisation of compression for %s (%s)", c->name, c->hostname);
+		return false;
+	}
+
+	c->status.compressout = true;
+	return true;
+#else
+	logger(LOG_ERR, "Compression of metadata is not supported by this build of tinc!");
+	return false;
+#endif
+}
+
+bool start_decompress_meta(connection_t *c) {
+#ifdef HAVE_ZLIB
+	c->instream = xmalloc_and_zero(sizeof(z_stream));
+
+	if(inflateInit(c->instream) != Z_OK) {
+		logger(LOG_ERR, "Error during initialisation of decompression for %s (%s)", c->name, c->hostname);
+		return false;
+	}
+
+	c->inzbuf = xmalloc(MAXBUFSIZE);
+	c->inzstart = 0;
+	c->inzlen = 0;
+	c->status.decompressin = true;
+	return true;
+#else
+	logger(LOG_ERR, "Compression of metadata is not supported by this build of tinc!");
+	return false;
+#endif
+}
+
+void stop_compress_meta(connection_t *c) {
+#ifdef HAVE_ZLIB
+	if(c->outstream) {
+		deflateEnd(c->outstream);
+		free(c->outstream);
+		c->outstream = NULL;
+	}
+
+	if(c->instream) {
+		inflateEnd(c->instream);
+		free(c->instream);
+		c->instream = NULL;
+	}
+#endif
+
+	free(c->inzbuf);
+	c->inzbuf = NULL;
+	c->inzstart = 0;
+	c->inzlen = 0;
+
+	c->status.compressout = false;
+	c->status.compressflush = false;
+	c->status.decompressin = false;
+}
+
+/* Append data to the output stream, compressing it if necessary */
+
+static bool append_meta(connection_t *c, const char *buffer, int length) {
+	ifdebug(META) logger(LOG_DEBUG, "Sending %d bytes of metadata to %s (%s)", length,
+			   c->name, c->hostname);
+
+	if(!c->outbuflen) {
+		c->last_flushed_time = now_msec;
+		schedule_connection_check(c);
+	}
+
+	/* Compressed data is only flushed out of the compressor by flush_meta(), so that it can use the whole batch */
+
+#ifdef HAVE_ZLIB
+	if(c->status.compressout) {
+		if(!deflate_meta(c, buffer, length, Z_NO_FLUSH))
+			return false;
+
+		c->status.compressflush = true;
+		return true;
+	}
+#endif
+
+	return buffer_meta(c, buffer, length);
+}
+
+bool send_meta(connection_t *c, const char *buffer, int length) {
+	if(!c) {
+		logger(LOG_ERR, "send_meta() called with NULL pointer!");
+		abort();
+	}
+
+	if(!append_meta(c, buffer, length))
+		return false;
+
+	/* Everything queued during this iteration of the main loop is sent in one go by flush_meta_all() */
+
+	c->status.flush = true;
+	flush_pending = true;
+
+	return true;
+}
+
+/*
+  Packets that have to go over TCP are not appended to the output buffer
+  right away, but kept in a queue of their own. They are only moved to the
+  output buffer when less than PACKET_WATERMARK bytes are left in it, so
+  requests never wait behind more than that amount of packet data.
+
+  The queue is limited to maxoutbufsize bytes, and managed with CoDel: once
+  packets have been waiting longer than CODEL_TARGET for a whole
+  CODEL_INTERVAL, packets are dropped from the head at an increasing rate,
+  until the delay goes below the target again.
+*/
+
+#define PACKET_WATERMARK MAXBUFSIZE
+#define CODEL_TARGET 5				/* milliseconds */
+#define CODEL_INTERVAL 100			/* milliseconds */
+
+typedef struct meta_packet_t {
+	struct meta_packet_t *next;
+	uint64_t time;				/* when it was queued, see now_msec */
+	length_t len;
+	uint8_t data[];
+} meta_packet_t;
+
+bool send_meta_packet(connection_t *c, const vpn_packet_t *packet) {
+	meta_packet_t *p;
+
+	if(c->packetqlen + packet->len > maxoutbufsize) {
+		ifdebug(TRAFFIC) logger(LOG_DEBUG, "Packet queue to %s (%s) is full, dropping packet",
+				c->name, c->hostname);
+		return false;
+	}
+
+	p = xmalloc(sizeof *p + packet->len);
+	p->next = NULL;
+	p->time = now_msec;
+	p->len = packet->len;
+	memcpy(p->data, packet->data, packet->len);
+
+	if(c->packetq_tail)
+		c->packetq_tail->next = p;
+	else
+		c->packetq = p;
+
+	c->packetq_tail = p;
+	c->packetqlen += p->len;
+
+	c->status.flush = true;
+	flush_pending = true;
+
+	return true;
+}
+
+static meta_packet_t *pop_meta_packet(connection_t *c) {
+	meta_packet_t *p = c->packetq;
+
+	if(p) {
+		c->packetq = p->next;
+		if(!c->packetq)
+			c->packetq_tail = NULL;
+		c->packetqlen -= p->len;
+	}
+
+	return p;
+}
+
+void clear_meta_packets(connection_t *c) {
+	meta_packet_t *p;
+
+	while((p = pop_meta_packet(c)))
+		free(p);
+
+	c->status.codel_dropping = false;
+	c->codel_count = 0;
+	c->codel_lastcount = 0;
+	c->codel_first_above = 0;
+	c->codel_drop_next = 0;
+}
+
+/* Returns the time of the next drop, interval / sqrt(count) after t, using a square root with 8 fractional bits */
+
+static uint64_t codel_control_law(uint64_t t, int count) {
+	uint64_t n = (uint64_t)count << 16;
+	uint64_t r = n, y = (n + 1) / 2;
+
+	while(y < r) {
+		r = y;
+		y = (r + n / r) / 2;
+	}
+
+	return t + ((uint64_t)CODEL_INTERVAL << 8) / r;
+}
+
+/* Take a packet from the head of the queue, and tell whether CoDel considers it droppable */
+
+static meta_packet_t *codel_pop(connection_t *c, uint64_t clock, bool *ok_to_drop) {
+	meta_packet_t *p = pop_meta_packet(c);
+
+	*ok_to_drop = false;
+
+	if(!p) {
+		c->codel_first_above = 0;
+		return NULL;
+	}
+
+	if(clock - p->time < CODEL_TARGET || c->packetqlen <= max_frame_size) {
+		c->codel_first_above = 0;
+	} else if(!c->codel_first_above) {
+		c->codel_first_above = clock + CODEL_INTERVAL;
+	} else if(clock >= c->codel_first_above) {
+		*ok_to_drop = true;
+	}
+
+	return p;
+}
+
+static void codel_drop(connection_t *c, meta_packet_t *p) {
+	ifdebug(TRAFFIC) logger(LOG_DEBUG, "Packet to %s (%s) waited %d ms in the queue, dropping it",
+			c->name, c->hostname, (int)(now_msec - p->time));
+
+	if(c->node)
+		c->node->stats.tcp_drops++;
+
+	free(p);
+}
+
+static meta_packet_t *codel_dequeue(connection_t *c) {
+	uint64_t clock = now_msec;
+	bool ok_to_drop;
+	meta_packet_t *p = codel_pop(c, clock, &ok_to_drop);
+
+	if(!p) {
+		c->status.codel_dropping = false;
+		return NULL;
+	}
+
+	if(c->status.codel_dropping) {
+		if(!ok_to_drop) {
+			c->status.codel_dropping = false;
+		} else {
+			while(p && clock >= c->codel_drop_next && c->status.codel_dropping) {
+				codel_drop(c, p);
+				c->codel_count++;
+				p = codel_pop(c, clock, &ok_to_drop);
+
+				if(!ok_to_drop)
+					c->status.codel_dropping = false;
+				else
+					c->codel_drop_next = codel_control_law(c->codel_drop_next, c->codel_count);
+			}
+		}
+	} else if(ok_to_drop) {
+		int delta;
+
+		codel_drop(c, p);
+		p = codel_pop(c, clock, &ok_to_drop);
+		c->status.codel_dropping = true;
+
+		/* If we were dropping recently, continue at the rate we left off */
+
+		delta = c->codel_count - c->codel_lastcount;
+
+		if(delta > 1 && clock - c->codel_drop_next < 16 * CODEL_INTERVAL)
+			c->codel_count = delta;
+		else
+			c->codel_count = 1;
+
+		c->codel_drop_next = codel_control_law(clock, c->codel_count);
+		c->codel_lastcount = c->codel_count;
+	}
+
+	return p;
+}
+
+/* Move queued packets into the output buffer, behind any requests that are already there */
+
+static bool dequeue_meta_packets(connection_t *c) {
+	char request[32];
+	int len;
+	meta_packet_t *p;
+
+	while(c->outbuflen < PACKET_WATERMARK && (p = codel_dequeue(c))) {
+		ifdebug(PROTOCOL) logger(LOG_DEBUG, "Sending PACKET to %s (%s)",
+				c->name, c->hostname);
+
+		len = snprintf(request, sizeof request, "%d %hd\n", PACKET, p->len);
+
+		if(!append_meta(c, request, len) || !append_meta(c, (char *)p->data, p->len)) {
+			free(p);
+			return false;
+		}
+
+		free(p);
+	}
+
+	return true;
+}
+
 bool flush_meta(connection_t *c) {
 	int result;
 	
 	ifdebug(META) logger(LOG_DEBUG, "Flushing %d bytes to %s (%s)",
 			 c->outbuflen, c->name, c->hostname);
 
-	while(c->outbuflen) {
-		result = send(c->socket, c->outbuf + c->outbufstart, c->outbuflen, 0);
-		if(result <= 0) {
-			if(!errno || errno == EPIPE) {
-				ifdebug(CONNECTIONS) logger(LOG_NOTICE, "Connection closed by %s (%s)",
-						   c->name, c->hostname);
-			} else if(errno == EINTR) {
-				continue;
-			} else if(sockwouldblock(sockerrno)) {
-				ifdebug(CONNECTIONS) logger(LOG_DEBUG, "Flushing %d bytes to %s (%s) would block",
-						c->outbuflen, c->name, c->hostname);
-				return true;
-			} else {
-				logger(LOG_ERR, "Flushing meta data to %s (%s) failed: %s", c->name,
-					   c->hostname, sockstrerror(sockerrno));
-			}
+	c->status.flush = false;
 
+	/* Packets are only taken from their queue when the output buffer is (nearly) empty */
+
+	do {
+		if(c->packetq && c->outbuflen < PACKET_WATERMARK && !dequeue_meta_packets(c))
 			return false;
+
+#ifdef HAVE_ZLIB
+		if(c->status.compressflush) {
+			c->status.compressflush = false;
+
+			if(!deflate_meta(c, NULL, 0, Z_SYNC_FLUSH))
+				return false;
 		}
+#endif
+
+		while(c->outbuflen) {
+			result = send(c->socket, c->outbuf + c->outbufstart, c->outbuflen, 0);
+			if(result <= 0) {
+				if(!errno || errno == EPIPE) {
+					ifdebug(CONNECTIONS) logger(LOG_NOTICE, "Connection closed by %s (%s)",
+							   c->name, c->hostname);
+				} else if(errno == EINTR) {
+					continue;
+				} else if(sockwouldblock(sockerrno)) {
+					ifdebug(CONNECTIONS) logger(LOG_DEBUG, "Flushing %d bytes to %s (%s) would block",
+							c->outbuflen, c->name, c->hostname);
+					io_set(&c->io, (c->status.waiting ? 0 : IO_READ) | IO_WRITE);
+					return true;
+				} else {
+					logger(LOG_ERR, "Flushing meta data to %s (%s) failed: %s", c->name,
+						   c->hostname, sockstrerror(sockerrno));
+				}
 
-		c->outbufstart += result;
-		c->outbuflen -= result;
-	}
+				return false;
+			}
+
+			c->outbufstart += result;
+			c->outbuflen -= result;
+
+			if(c->packetq && c->outbuflen < PACKET_WATERMARK)
+				break;
+		}
+	} while(c->outbuflen || c->packetq);
 
 	c->outbufstart = 0; /* avoid unnecessary memmoves */
+
+	/* A burst, like sending everything to a new peer, leaves a large buffer behind; with LowMemory it is given back */
+
+	if(low_memory && c->outbufsize > MAXBUFSIZE) {
+		free(c->outbuf);
+		c->outbuf = NULL;
+		c->outbufsize = 0;
+	}
+	io_set(&c->io, c->status.waiting ? 0 : IO_READ);
 	return true;
 }
 
+/* Send what has been queued on all connections, called once per iteration of the main loop */
+
+void flush_meta_all(void) {
+	avl_node_t *node;
+	connection_t *c;
+
+	/* Terminating a connection can queue more data for the others, so repeat until nothing is left */
+
+	while(flush_pending) {
+		flush_pending = false;
+
+		for(node = connection_tree->head; node; node = node->next) {
+			c = node->data;
+
+			/* Connections that are still connecting are flushed when they become writable */
+
+			if(!c->status.flush || c->status.remove || c->status.connecting)
+				continue;
+
+			if(!flush_meta(c))
+				terminate_connection(c, c->status.active);
+		}
+	}
+}
+
 void broadcast_meta(connection_t *from, const char *buffer, int length) {
 	avl_node_t *node;
 	connection_t *c;
@@ -126,22 +553,55 @@ void broadcast_meta(connection_t *from, const char *buffer, int length) {
 	}
 }
 
+static bool decrypt_meta(connection_t *c, char *data, int len) {
+	int outlen;
+
+	if(!EVP_DecryptUpdate(c->inctx, (unsigned char *)data, &outlen, (unsigned char *)data, len) || outlen != len) {
+		logger(LOG_ERR, "Error while decrypting metadata from %s (%s): %s",
+				c->name, c->hostname, ERR_error_string(ERR_get_error(), NULL));
+		return false;
+	}
+
+	return true;
+}
+
+static bool process_meta(connection_t *c, int start, bool decrypted);
+
 bool receive_meta(connection_t *c) {
-	int oldlen, i, result;
-	int lenin, lenout, reqlen;
+	int start;
+	int lenin;
 	bool decrypted = false;
-	char inbuf[MAXBUFSIZE];
 
 	/* Strategy:
 	   - Read as much as possible from the TCP socket in one go.
-	   - Decrypt it.
+	   - Decrypt it in place.
 	   - Check if a full request is in the input buffer.
-	   - If yes, process request and remove it from the buffer,
+	   - If yes, process request and skip past it in the buffer,
 	   then check again.
 	   - If not, keep stuff in buffer and exit.
+	   Only what is left of an incomplete request is moved to the front
+	   of the buffer, once per read.
+	   Compressed meta data is read into a separate buffer and decrypted
+	   there, and inflated into the input buffer as far as there is room.
 	 */
 
-	lenin = recv(c->socket, c->buffer + c->buflen, MAXBUFSIZE - c->buflen, 0);
+	if(c->bufstart) {
+		c->buflen -= c->bufstart;
+		memmove(c->buffer, c->buffer + c->bufstart, c->buflen);
+		c->bufstart = 0;
+	}
+
+#ifdef HAVE_ZLIB
+	if(c->status.decompressin) {
+		if(c->inzstart) {
+			memmove(c->inzbuf, c->inzbuf + c->inzstart, c->inzlen);
+			c->inzstart = 0;
+		}
+
+		lenin = recv(c->socket, c->inzbuf + c->inzlen, MAXBUFSIZE - c->inzlen, 0);
+	} else
+#endif
+		lenin = recv(c->socket, c->buffer + c->buflen, MAXBUFSIZE - c->buflen, 0);
 
 	if(lenin <= 0) {
 		if(!lenin || !errno) {
@@ -156,106 +616,199 @@ bool receive_meta(connection_t *c) {
 		return false;
 	}
 
-	oldlen = c->buflen;
-	c->buflen += lenin;
+	start = c->buflen;			/* first byte that has not been looked at yet */
 
-	while(lenin > 0) {
-		/* Decrypt */
+#ifdef HAVE_ZLIB
+	if(c->status.decompressin) {
+		if(c->status.decryptin && !decrypt_meta(c, c->inzbuf + c->inzlen, lenin))
+			return false;
 
-		if(c->status.decryptin && !decrypted) {
-			result = EVP_DecryptUpdate(c->inctx, (unsigned char *)inbuf, &lenout, (unsigned char *)c->buffer + oldlen, lenin);
-			if(!result || lenout != lenin) {
-				logger(LOG_ERR, "Error while decrypting metadata from %s (%s): %s",
-						c->name, c->hostname, ERR_error_string(ERR_get_error(), NULL));
-				return false;
-			}
-			memcpy(c->buffer + oldlen, inbuf, lenin);
-			decrypted = true;
-		}
+		c->inzlen += lenin;
+		decrypted = true;
 
-		/* Are we receiving a TCPpacket? */
+		if(!inflate_meta(c))
+			return false;
+	} else
+#endif
+		c->buflen += lenin;
 
-		if(c->tcplen) {
-			if(c->tcplen <= c->buflen) {
-				if(!c->node) {
-					if(c->outgoing && proxytype == PROXY_SOCKS4 && c->allow_request == ID) {
-						if(c->buffer[0] == 0 && c->buffer[1] == 0x5a) {
-							ifdebug(CONNECTIONS) logger(LOG_DEBUG, "Proxy request granted");
+	return process_meta(c, start, decrypted);
+}
+
+/*
+  Handle data that did not come from his socket, as much of it as fits in the
+  input buffer. Used by the mesh simulator, which connects daemons without
+  sockets, and never turns on encryption or compression of the meta data.
+  Returns the number of bytes taken, or -1 if the connection has to go.
+*/
+
+int feed_meta(connection_t *c, const char *data, int len) {
+	int start;
+
+	if(c->bufstart) {
+		c->buflen -= c->bufstart;
+		memmove(c->buffer, c->buffer + c->bufstart, c->buflen);
+		c->bufstart = 0;
+	}
+
+	if(len > MAXBUFSIZE - c->buflen)
+		len = MAXBUFSIZE - c->buflen;
+
+	start = c->buflen;
+	memcpy(c->buffer + c->buflen, data, len);
+	c->buflen += len;
+
+	return process_meta(c, start, false) ? len : -1;
+}
+
+/* Handle the requests in the input buffer, starting with unseen data at start */
+
+static bool process_meta(connection_t *c, int start, bool decrypted) {
+	int lenin, reqlen;
+	bool compressed;
+	char *data, *eol;
+
+	for(;;) {
+		while(start < c->buflen) {
+			/* Decrypt */
+
+			if(c->status.decryptin && !decrypted) {
+				if(!decrypt_meta(c, c->buffer + start, c->buflen - start))
+					return false;
+				decrypted = true;
+			}
+
+			data = c->buffer + c->bufstart;
+
+			/* Are we receiving a TCPpacket? */
+
+			if(c->tcplen) {
+				if(c->tcplen <= c->buflen - c->bufstart) {
+					if(!c->node) {
+						if(c->outgoing && proxytype == PROXY_SOCKS4 && c->allow_request == ID) {
+							if(data[0] == 0 && data[1] == 0x5a) {
+								ifdebug(CONNECTIONS) logger(LOG_DEBUG, "Proxy request granted");
+							} else {
+								logger(LOG_ERR, "Proxy request rejected");
+								return false;
+							}
+						} else if(c->outgoing && proxytype == PROXY_SOCKS5 && c->allow_request == ID) {
+							if(data[0] != 5) {
+								logger(LOG_ERR, "Invalid response from proxy server");
+								return false;
+							}
+							if(data[1] == (char)0xff) {
+								logger(LOG_ERR, "Proxy request rejected: unsuitable authentication method");
+								return false;
+							}
+							if(data[2] != 5) {
+								logger(LOG_ERR, "Invalid response from proxy server");
+								return false;
+							}
+							if(data[3] == 0) {
+								ifdebug(CONNECTIONS) logger(LOG_DEBUG, "Proxy request granted");
+							} else {
+								logger(LOG_ERR, "Proxy request rejected");
+								return false;
+							}
 						} else {
-							logger(LOG_ERR, "Proxy request rejected");
-							return false;
-						}
-					} else if(c->outgoing && proxytype == PROXY_SOCKS5 && c->allow_request == ID) {
-						if(c->buffer[0] != 5) {
-							logger(LOG_ERR, "Invalid response from proxy server");
-							return false;
-						}
-						if(c->buffer[1] == (char)0xff) {
-							logger(LOG_ERR, "Proxy request rejected: unsuitable authentication method");
-							return false;
-						}
-						if(c->buffer[2] != 5) {
-							logger(LOG_ERR, "Invalid response from proxy server");
-							return false;
+							logger(LOG_ERR, "c->tcplen set but c->node is NULL!");
+							abort();
 						}
-						if(c->buffer[3] == 0) {
-							ifdebug(CONNECTIONS) logger(LOG_DEBUG, "Proxy request granted");
+					} else {
+						if(c->allow_request == ALL) {
+							receive_tcppacket(c, data, c->tcplen);
 						} else {
-							logger(LOG_ERR, "Proxy request rejected");
+							logger(LOG_ERR, "Got unauthorized TCP packet from %s (%s)", c->name, c->hostname);
 							return false;
 						}
-					} else {
-						logger(LOG_ERR, "c->tcplen set but c->node is NULL!");
-						abort();
 					}
+
+					c->bufstart += c->tcplen;
+					c->tcplen = 0;
+
+					if(start < c->bufstart)
+						start = c->bufstart;
+
+					continue;
 				} else {
-					if(c->allow_request == ALL) {
-						receive_tcppacket(c, c->buffer, c->tcplen);
-					} else {
-						logger(LOG_ERR, "Got unauthorized TCP packet from %s (%s)", c->name, c->hostname);
+					break;
+				}
+			}
+
+			/* Otherwise we are waiting for a request */
+
+			eol = memchr(c->buffer + start, '\n', c->buflen - start);
+
+			if(eol) {
+				*eol = '\0';	/* replace end-of-line by end-of-string so we can use sscanf */
+				reqlen = eol + 1 - data;
+				c->request = data;
+				c->reqlen = reqlen;
+				compressed = c->status.decompressin;
+				if(!receive_request(c))
+					return false;
+
+				c->bufstart += reqlen;
+				start = c->bufstart;
+
+				/* The rest has to wait until a worker has done what the request needs, see resume_meta() */
+
+				if(c->status.waiting)
+					return true;
+
+#ifdef HAVE_ZLIB
+				/* Everything after his METAKEY is compressed, move it over to the compressed input buffer */
+
+				if(c->status.decompressin && !compressed) {
+					lenin = c->buflen - c->bufstart;
+
+					if(c->status.decryptin && !decrypted && lenin && !decrypt_meta(c, c->buffer + c->bufstart, lenin))
+						return false;
+
+					memcpy(c->inzbuf, c->buffer + c->bufstart, lenin);
+					c->inzlen = lenin;
+					c->buflen = c->bufstart;
+					decrypted = true;
+
+					if(!inflate_meta(c))
 						return false;
-					}
 				}
+#endif
 
-				c->buflen -= c->tcplen;
-				lenin -= c->tcplen - oldlen;
-				memmove(c->buffer, c->buffer + c->tcplen, c->buflen);
-				oldlen = 0;
-				c->tcplen = 0;
 				continue;
 			} else {
 				break;
 			}
 		}
 
-		/* Otherwise we are waiting for a request */
+#ifdef HAVE_ZLIB
+		/* If we made room in the input buffer, see if the decompressor has more for us */
 
-		reqlen = 0;
+		if(!c->status.decompressin || !c->bufstart)
+			break;
 
-		for(i = oldlen; i < c->buflen; i++) {
-			if(c->buffer[i] == '\n') {
-				c->buffer[i] = '\0';	/* replace end-of-line by end-of-string so we can use sscanf */
-				reqlen = i + 1;
-				break;
-			}
-		}
+		c->buflen -= c->bufstart;
+		memmove(c->buffer, c->buffer + c->bufstart, c->buflen);
+		c->bufstart = 0;
+		start = c->buflen;
 
-		if(reqlen) {
-			c->reqlen = reqlen;
-			if(!receive_request(c))
-				return false;
+		if(!inflate_meta(c))
+			return false;
 
-			c->buflen -= reqlen;
-			lenin -= reqlen - oldlen;
-			memmove(c->buffer, c->buffer + reqlen, c->buflen);
-			oldlen = 0;
-			continue;
-		} else {
+		if(start == c->buflen)
 			break;
-		}
+#else
+		break;
+#endif
+	}
+
+	if(c->bufstart == c->buflen) {
+		c->bufstart = 0;
+		c->buflen = 0;
 	}
 
-	if(c->buflen >= MAXBUFSIZE) {
+	if(c->buflen - c->bufstart >= MAXBUFSIZE) {
 		logger(LOG_ERR, "Metadata read buffer overflow for %s (%s)",
 			   c->name, c->hostname);
 		return false;
@@ -263,3 +816,42 @@ bool receive_meta(connection_t *c) {
 
 	return true;
 }
+
+/* Stop reading from him while a worker does something for his last request */
+
+void suspend_meta(connection_t *c, job_t *job) {
+	c->job = job;
+	c->status.waiting = true;
+	io_set(&c->io, c->outbuflen ? IO_WRITE : 0);
+}
+
+/* Handle what he sent after that request, and read from him again */
+
+bool resume_meta(connection_t *c) {
+	bool decrypted = false;
+
+	c->job = NULL;
+	c->status.waiting = false;
+	io_set(&c->io, IO_READ | (c->outbuflen ? IO_WRITE : 0));
+
+#ifdef HAVE_ZLIB
+	/* As in process_meta(), everything after his METAKEY is compressed */
+
+	if(c->status.decompressin && !c->inzlen) {
+		int lenin = c->buflen - c->bufstart;
+
+		if(c->status.decryptin && lenin && !decrypt_meta(c, c->buffer + c->bufstart, lenin))
+			return false;
+
+		memcpy(c->inzbuf, c->buffer + c->bufstart, lenin);
+		c->inzlen = lenin;
+		c->buflen = c->bufstart;
+		decrypted = true;
+
+		if(!inflate_meta(c))
+			return false;
+	}
+#endif
+
+	return process_meta(c, c->bufstart, decrypted);
+}
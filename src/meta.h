@@ -23,9 +23,20 @@
 
 #include "connection.h"
 
+extern int metacompression;
+
+extern bool start_compress_meta(struct connection_t *, int);
+extern bool start_decompress_meta(struct connection_t *);
+extern void stop_compress_meta(struct connection_t *);
 extern bool send_meta(struct connection_t *, const char *, int);
+extern bool send_meta_packet(struct connection_t *, const vpn_packet_t *);
+extern void clear_meta_packets(struct connection_t *);
 extern void broadcast_meta(struct connection_t *, const char *, int);
 extern bool flush_meta(struct connection_t *);
+extern void flush_meta_all(void);
 extern bool receive_meta(struct connection_t *);
+extern int feed_meta(struct connection_t *, const char *, int);
+extern void suspend_meta(struct connection_t *, struct job_t *);
+extern bool resume_meta(struct connection_t *);
 
 #endif							/* __TINC_META_H__ */
@@ -0,0 +1,726 @@
+/*
+    microbench.c -- microbenchmarks for lookups, graph(), parsing requests and route()
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "system.h"
+
+#include "avl_tree.h"
+#include "connection.h"
+#include "device.h"
+#include "edge.h"
+#include "ethernet.h"
+#include "graph.h"
+#include "ipv4.h"
+#include "ipv6.h"
+#include "net.h"
+#include "node.h"
+#include "protocol.h"
+#include "route.h"
+#include "subnet.h"
+#include "xalloc.h"
+
+/*
+  Built with "make microbench", and linked with everything in tincd except
+  tincd.c. Every result is one line of the form
+
+    name key=value ...
+
+  with the same keys in every run, so results can be compared with diff or
+  a script between releases. The random numbers come from a fixed seed, so
+  every run does exactly the same work.
+*/
+
+/* The variables tincd.c normally provides to the rest of the daemon */
+
+char *program_name = "microbench";
+bool bypass_security = false;
+bool do_mlock = false;
+bool use_logfile = false;
+char *identname = NULL;
+char *pidfilename = NULL;
+char *logfilename = NULL;
+char **g_argv;
+
+static uint32_t seed = 1;
+
+static uint32_t xorshift(void) {
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static double elapsed(const struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_usec - start->tv_usec) * 1e3;
+}
+
+/* AVL tree operations on trees of 10^2 to 10^6 integers */
+
+static int compare_uint32(const uint32_t *a, const uint32_t *b) {
+	return *a < *b ? -1 : *a > *b;
+}
+
+static void bench_avl(void) {
+	for(int size = 100; size <= 1000000; size *= 10) {
+		uint32_t *keys = xmalloc(size * sizeof *keys);
+		int rounds = size < 1000000 ? 1000000 / size : 1;
+		double insert = 0, search = 0, delete = 0;
+		struct timeval start;
+
+		for(int i = 0; i < size; i++)
+			keys[i] = xorshift();
+
+		for(int r = 0; r < rounds; r++) {
+			avl_tree_t *tree = avl_alloc_tree((avl_compare_t) compare_uint32, NULL);
+
+			gettimeofday(&start, NULL);
+			for(int i = 0; i < size; i++)
+				avl_insert(tree, &keys[i]);
+			insert += elapsed(&start);
+
+			gettimeofday(&start, NULL);
+			for(int i = 0; i < size; i++)
+				if(!avl_search(tree, &keys[(uint64_t)i * 7919 % size]))
+					abort();
+			search += elapsed(&start);
+
+			gettimeofday(&start, NULL);
+			for(int i = 0; i < size; i++)
+				avl_delete(tree, &keys[i]);
+			delete += elapsed(&start);
+
+			avl_free_tree(tree);
+		}
+
+		printf("avl_insert size=%d ns_per_op=%.1f\n", size, insert / rounds / size);
+		printf("avl_search size=%d ns_per_op=%.1f\n", size, search / rounds / size);
+		printf("avl_delete size=%d ns_per_op=%.1f\n", size, delete / rounds / size);
+
+		free(keys);
+	}
+}
+
+/*
+  A mesh of nodes that each own an IPv4 /24 and /32, an IPv6 /64 and a MAC
+  address, and us owning 10.255.0.0/24, fd00:ffff::/64 and a MAC address.
+  Lookups pick addresses from a small pool, which the subnet cache holds, or
+  from a large one, which it does not. Misses are addresses nobody owns.
+*/
+
+#define BENCH_NODES 1000
+#define BENCH_LOOKUPS 1000000
+
+static node_t *remote;
+static int subnets;
+
+static void add_subnet(node_t *owner, subnet_type_t type, const void *address, int prefixlength) {
+	subnet_t *subnet = new_subnet();
+
+	subnet->type = type;
+	subnet->weight = 10;
+
+	switch(type) {
+		case SUBNET_MAC:
+			memcpy(&subnet->net.mac.address, address, sizeof(mac_t));
+			break;
+		case SUBNET_IPV4:
+			memcpy(&subnet->net.ipv4.address, address, sizeof(ipv4_t));
+			subnet->net.ipv4.prefixlength = prefixlength;
+			break;
+		default:
+			memcpy(&subnet->net.ipv6.address, address, sizeof(ipv6_t));
+			subnet->net.ipv6.prefixlength = prefixlength;
+			break;
+	}
+
+	subnet_add(owner, subnet);
+	subnets++;
+}
+
+static node_t *add_node(const char *name) {
+	node_t *n = new_node();
+
+	n->name = xstrdup(name);
+	n->nexthop = n->via = n;
+	n->status.reachable = true;
+	node_add(n);
+
+	return n;
+}
+
+static void setup_mesh(void) {
+	init_nodes();
+	init_subnets();
+
+	myself = add_node("myself");
+	add_subnet(myself, SUBNET_IPV4, (ipv4_t[]){{{10, 255, 0, 0}}}, 24);
+	add_subnet(myself, SUBNET_IPV6, (ipv6_t[]){{{htons(0xfd00), htons(0xffff)}}}, 64);
+	add_subnet(myself, SUBNET_MAC, (mac_t[]){{{0x02, 0, 0, 0xff, 0xff, 0xff}}}, 0);
+
+	for(int i = 0; i < BENCH_NODES; i++) {
+		char name[16];
+		snprintf(name, sizeof name, "node%d", i);
+		node_t *n = add_node(name);
+
+		if(!i)
+			remote = n;
+
+		add_subnet(n, SUBNET_IPV4, (ipv4_t[]){{{10, i >> 8, i & 0xff, 0}}}, 24);
+		add_subnet(n, SUBNET_IPV4, (ipv4_t[]){{{172, 16 + (i >> 8), i & 0xff, 1}}}, 32);
+		add_subnet(n, SUBNET_IPV6, (ipv6_t[]){{{htons(0xfd00), htons(i)}}}, 64);
+		add_subnet(n, SUBNET_MAC, (mac_t[]){{{0x02, 0, 0, 0, i >> 8, i & 0xff}}}, 0);
+	}
+}
+
+/*
+  lookup_node() and lookup_node_udp() in a mesh of 10^4 nodes, against
+  searching node_tree and node_udp_tree, which is what they used to do.
+  This runs on a mesh of its own, before the one above is set up.
+*/
+
+#define BENCH_LOOKUP_NODES 10000
+
+static void bench_nodes(void) {
+	static const char *methods[] = {"hash", "avl", NULL};
+	char (*names)[16] = xmalloc(BENCH_LOOKUP_NODES * sizeof *names);
+	sockaddr_t *addresses = xmalloc(BENCH_LOOKUP_NODES * sizeof *addresses);
+	uint32_t *picks = xmalloc(BENCH_LOOKUPS * sizeof *picks);
+	node_t key = {0};
+
+	init_nodes();
+
+	for(int i = 0; i < BENCH_LOOKUP_NODES; i++) {
+		snprintf(names[i], sizeof names[i], "node%d", i);
+		memset(&addresses[i], 0, sizeof addresses[i]);
+		addresses[i].in.sin_family = AF_INET;
+		addresses[i].in.sin_addr.s_addr = htonl(0x0a000000 | i);
+		addresses[i].in.sin_port = htons(655);
+		update_node_udp(add_node(names[i]), &addresses[i]);
+	}
+
+	for(int i = 0; i < BENCH_LOOKUPS; i++)
+		picks[i] = xorshift() % BENCH_LOOKUP_NODES;
+
+	for(int m = 0; methods[m]; m++) {
+		int found = 0;
+		struct timeval start;
+
+		gettimeofday(&start, NULL);
+
+		for(int i = 0; i < BENCH_LOOKUPS; i++) {
+			if(m) {
+				key.name = names[picks[i]];
+				found += !!avl_search(node_tree, &key);
+			} else {
+				found += !!lookup_node(names[picks[i]]);
+			}
+		}
+
+		printf("lookup_node nodes=%d method=%s found=%d ns_per_op=%.1f\n",
+				BENCH_LOOKUP_NODES, methods[m], found, elapsed(&start) / BENCH_LOOKUPS);
+
+		found = 0;
+		gettimeofday(&start, NULL);
+
+		for(int i = 0; i < BENCH_LOOKUPS; i++) {
+			if(m) {
+				key.address = addresses[picks[i]];
+				found += !!avl_search(node_udp_tree, &key);
+			} else {
+				found += !!lookup_node_udp(&addresses[picks[i]]);
+			}
+		}
+
+		printf("lookup_node_udp nodes=%d method=%s found=%d ns_per_op=%.1f\n",
+				BENCH_LOOKUP_NODES, methods[m], found, elapsed(&start) / BENCH_LOOKUPS);
+	}
+
+	exit_nodes();
+	exit_graph();
+
+	free(picks);
+	free(addresses);
+	free(names);
+}
+
+/*
+  graph() in a mesh of 10^4 nodes with 2.5 * 10^4 links, each an edge in
+  both directions. A random spanning tree keeps every node reachable, the
+  rest of the links are between random pairs. Every run first gives a
+  number of random links new weights, so only part of the graph changed,
+  as when a few meta connections come and go. Like bench_nodes(), this
+  has a mesh of its own.
+*/
+
+#define BENCH_GRAPH_NODES 10000
+#define BENCH_GRAPH_LINKS 25000
+#define BENCH_GRAPH_RUNS 20
+
+static edge_t *add_edge(node_t *from, node_t *to, int weight) {
+	edge_t *e = new_edge();
+
+	e->from = from;
+	e->to = to;
+	e->weight = weight;
+	e->address.in.sin_family = AF_INET;
+	e->address.in.sin_addr.s_addr = htonl(0x0a000000 | to->graph_index);
+	e->address.in.sin_port = htons(655);
+	edge_add(e);
+
+	return e;
+}
+
+static void bench_graph(void) {
+	static const int changes[] = {1, 10, 0};
+	node_t **nodes = xmalloc(BENCH_GRAPH_NODES * sizeof *nodes);
+	edge_t **links = xmalloc(BENCH_GRAPH_LINKS * sizeof *links);
+	int count = 0;
+
+	init_connections();
+	init_nodes();
+	init_edges();
+
+	myself = nodes[0] = add_node("myself");
+
+	for(int i = 1; i < BENCH_GRAPH_NODES; i++) {
+		char name[16];
+		snprintf(name, sizeof name, "node%d", i);
+		nodes[i] = add_node(name);
+	}
+
+	while(count < BENCH_GRAPH_LINKS) {
+		int a, b, weight = 1 + xorshift() % 1000;
+
+		/* The first links connect every node to one added before it */
+
+		if(count < BENCH_GRAPH_NODES - 1) {
+			a = count + 1;
+			b = xorshift() % a;
+		} else {
+			a = xorshift() % BENCH_GRAPH_NODES;
+			b = xorshift() % BENCH_GRAPH_NODES;
+		}
+
+		if(a == b || lookup_edge(nodes[a], nodes[b]))
+			continue;
+
+		links[count++] = add_edge(nodes[a], nodes[b], weight);
+		add_edge(nodes[b], nodes[a], weight);
+	}
+
+	graph();
+
+	for(int c = 0; changes[c]; c++) {
+		double total = 0;
+		struct timeval start;
+
+		for(int r = 0; r < BENCH_GRAPH_RUNS; r++) {
+			for(int i = 0; i < changes[c]; i++) {
+				edge_t *e = links[xorshift() % BENCH_GRAPH_LINKS];
+				int weight = 1 + xorshift() % 1000;
+
+				edge_set_weight(e, weight);
+				edge_set_weight(e->reverse, weight);
+			}
+
+			gettimeofday(&start, NULL);
+			graph();
+			total += elapsed(&start);
+		}
+
+		printf("graph nodes=%d edges=%d changes=%d ns_per_op=%.1f\n",
+				BENCH_GRAPH_NODES, 2 * BENCH_GRAPH_LINKS, changes[c], total / BENCH_GRAPH_RUNS);
+	}
+
+	exit_nodes();
+	exit_edges();
+	exit_graph();
+	exit_connections();
+	myself = NULL;
+
+	free(links);
+	free(nodes);
+}
+
+/* Address number i of a pool, owned by a node if hit is set */
+
+static void pool_ipv4(ipv4_t *address, uint32_t i, bool hit) {
+	uint32_t n = i % BENCH_NODES;
+
+	if(hit)
+		*address = (ipv4_t){{10, n >> 8, n & 0xff, 1 + i / BENCH_NODES % 254}};
+	else
+		*address = (ipv4_t){{192, 168, i >> 8, i & 0xff}};
+}
+
+static void pool_ipv6(ipv6_t *address, uint32_t i, bool hit) {
+	memset(address, 0, sizeof *address);
+	address->x[0] = htons(hit ? 0xfd00 : 0xfd01);
+	address->x[1] = htons(i % BENCH_NODES);
+	address->x[7] = htons(i);
+}
+
+static void pool_mac(mac_t *address, uint32_t i, bool hit) {
+	uint32_t n = hit ? i % BENCH_NODES : 0x8000 | i;
+
+	*address = (mac_t){{0x02, 0, 0, hit ? 0 : 1, n >> 8, n & 0xff}};
+}
+
+static void bench_subnets(void) {
+	static const int pools[] = {16, 65536, 0};
+	static const int hitrates[] = {100, 90, 50, 0, -1};
+	static const char *types[] = {"ipv4", "ipv6", "mac", NULL};
+
+	for(int t = 0; types[t]; t++) {
+		for(int p = 0; pools[p]; p++) {
+			for(int h = 0; hitrates[h] >= 0; h++) {
+				uint32_t *picks = xmalloc(BENCH_LOOKUPS * sizeof *picks);
+				int found = 0;
+				struct timeval start;
+
+				/* The top bit says whether to look up an address someone owns */
+
+				for(int i = 0; i < BENCH_LOOKUPS; i++)
+					picks[i] = xorshift() % pools[p] | (xorshift() % 100 < hitrates[h]) << 31;
+
+				subnet_cache_flush();
+				gettimeofday(&start, NULL);
+
+				for(int i = 0; i < BENCH_LOOKUPS; i++) {
+					uint32_t pick = picks[i] & 0x7fffffff;
+					bool hit = picks[i] >> 31;
+					ipv4_t ipv4;
+					ipv6_t ipv6;
+					mac_t mac;
+
+					switch(t) {
+						case 0:
+							pool_ipv4(&ipv4, pick, hit);
+							found += !!lookup_subnet_ipv4(&ipv4);
+							break;
+						case 1:
+							pool_ipv6(&ipv6, pick, hit);
+							found += !!lookup_subnet_ipv6(&ipv6);
+							break;
+						default:
+							pool_mac(&mac, pick, hit);
+							found += !!lookup_subnet_mac(NULL, &mac);
+							break;
+					}
+				}
+
+				printf("lookup_subnet_%s subnets=%d pool=%d hitrate=%d found=%d ns_per_op=%.1f\n",
+						types[t], subnets, pools[p], hitrates[h], found,
+						elapsed(&start) / BENCH_LOOKUPS);
+
+				free(picks);
+			}
+		}
+	}
+}
+
+/*
+  Parsing canned requests, as receive_request() and the handlers do with
+  split_request(), and as they used to, with a sscanf() per handler into
+  MAX_STRING_SIZE buffers. Only the fields are taken apart, nothing is
+  looked up or checked.
+*/
+
+#define BENCH_REQUESTS 2000000
+
+static int parse_sscanf(request_t request, const char *line) {
+	char from_name[MAX_STRING_SIZE];
+	char to_name[MAX_STRING_SIZE];
+	char address[MAX_STRING_SIZE] = "";
+	char port[MAX_STRING_SIZE] = "";
+	char key[MAX_STRING_SIZE];
+	int cipher, digest, maclength, compression, weight;
+	uint32_t options;
+
+	switch(request) {
+		case ADD_EDGE:
+			return sscanf(line, "%*d %*x "MAX_STRING" "MAX_STRING" "MAX_STRING" "MAX_STRING" %x %d",
+					from_name, to_name, address, port, &options, &weight);
+		case ADD_SUBNET:
+			return sscanf(line, "%*d %*x "MAX_STRING" "MAX_STRING, from_name, to_name);
+		default:
+			return sscanf(line, "%*d "MAX_STRING" "MAX_STRING" "MAX_STRING" %d %d %d %d "MAX_STRING" "MAX_STRING,
+					from_name, to_name, key, &cipher, &digest, &maclength,
+					&compression, address, port);
+	}
+}
+
+static int parse_split(request_t request, connection_t *c) {
+	int cipher, digest, maclength, compression, weight;
+	uint32_t options;
+
+	split_request(c);
+
+	switch(request) {
+		case ADD_EDGE:
+			return c->argc >= 8 && arg2hex(c->argv[6], &options) && arg2int(c->argv[7], &weight) ? c->argc - 2 : 0;
+		case ADD_SUBNET:
+			return c->argc >= 4 ? c->argc - 2 : 0;
+		default:
+			return c->argc >= 8 && arg2int(c->argv[4], &cipher) && arg2int(c->argv[5], &digest)
+					&& arg2int(c->argv[6], &maclength) && arg2int(c->argv[7], &compression) ? c->argc - 1 : 0;
+	}
+}
+
+static void bench_requests(void) {
+	static const char *methods[] = {"sscanf", "split", NULL};
+	static const struct {
+		const char *name;
+		request_t request;
+		const char *format;
+	} requests[] = {
+		{"ADD_EDGE", ADD_EDGE, "%d 3f2a91c4 node12 node345 192.168.17.34 655 c 142\n"},
+		{"ADD_SUBNET", ADD_SUBNET, "%d 5be07d13 node12 10.12.0.0/16#10\n"},
+		{"ANS_KEY", ANS_KEY, "%d node12 node345 "
+				"8a1f3e0b9c2d4e5f6a7b8c9d0e1f2a3b4c5d6e7f8091a2b3c4d5e6f708192a3b"
+				" 91 64 4 0 192.168.17.34 655\n"},
+		{NULL},
+	};
+
+	connection_t *c = new_connection();
+
+	for(int r = 0; requests[r].name; r++) {
+		char line[MAXBUFSIZE];
+		int len = snprintf(line, sizeof line, requests[r].format, requests[r].request);
+
+		for(int m = 0; methods[m]; m++) {
+			int fields = 0;
+			struct timeval start;
+
+			/* What receive_meta() leaves for receive_request() */
+
+			memcpy(c->buffer, line, len);
+			c->buffer[len - 1] = '\0';
+			c->request = c->buffer;
+			c->reqlen = len;
+
+			gettimeofday(&start, NULL);
+
+			for(int i = 0; i < BENCH_REQUESTS; i++)
+				fields += m ? parse_split(requests[r].request, c) : parse_sscanf(requests[r].request, c->request);
+
+			printf("parse request=%s method=%s fields=%d ns_per_op=%.1f\n",
+					requests[r].name, methods[m], fields / BENCH_REQUESTS, elapsed(&start) / BENCH_REQUESTS);
+		}
+	}
+
+	free_connection(c);
+}
+
+/* route() on canned frames, from another node to us or from our device to the VPN */
+
+#define BENCH_FRAMES 1000000
+
+static const mac_t remote_mac = {{0x02, 0, 0, 0, 0, 0}};
+static const mac_t my_mac = {{0x02, 0, 0, 0xff, 0xff, 0xff}};
+
+static uint16_t checksum(const uint8_t *data, int len, uint32_t sum) {
+	for(int i = 0; i + 1 < len; i += 2)
+		sum += data[i] << 8 | data[i + 1];
+
+	if(len & 1)
+		sum += data[len - 1] << 8;
+
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+static void frame_ether(vpn_packet_t *packet, const mac_t *dest, const mac_t *source, uint16_t type) {
+	memcpy(packet->data, dest, ETH_ALEN);
+	memcpy(packet->data + ETH_ALEN, source, ETH_ALEN);
+	packet->data[12] = type >> 8;
+	packet->data[13] = type;
+	packet->priority = 0;
+}
+
+static void frame_ipv4(vpn_packet_t *packet) {
+	struct ip ip = {0};
+
+	frame_ether(packet, &my_mac, &remote_mac, ETH_P_IP);
+	ip.ip_v = 4;
+	ip.ip_hl = 5;
+	ip.ip_len = htons(1400 - ETHER_HDR_LEN);
+	ip.ip_ttl = 64;
+	ip.ip_p = IPPROTO_UDP;
+	memcpy(&ip.ip_src, (uint8_t[]){10, 0, 0, 1}, 4);
+	memcpy(&ip.ip_dst, (uint8_t[]){10, 255, 0, 1}, 4);
+	memcpy(packet->data + ETHER_HDR_LEN, &ip, sizeof ip);
+	ip.ip_sum = htons(~checksum(packet->data + ETHER_HDR_LEN, sizeof ip, 0));
+	memcpy(packet->data + ETHER_HDR_LEN, &ip, sizeof ip);
+	memset(packet->data + ETHER_HDR_LEN + sizeof ip, 0xaa, 1400 - ETHER_HDR_LEN - sizeof ip);
+	packet->len = 1400;
+}
+
+static void frame_ipv6(vpn_packet_t *packet) {
+	struct ip6_hdr ip6 = {{{0}}};
+
+	frame_ether(packet, &my_mac, &remote_mac, ETH_P_IPV6);
+	ip6.ip6_flow = htonl(0x60000000);
+	ip6.ip6_plen = htons(1400 - ETHER_HDR_LEN - sizeof ip6);
+	ip6.ip6_nxt = IPPROTO_UDP;
+	ip6.ip6_hlim = 64;
+	ip6.ip6_src.s6_addr[0] = 0xfd;
+	ip6.ip6_src.s6_addr[15] = 1;
+	ip6.ip6_dst.s6_addr[0] = 0xfd;
+	ip6.ip6_dst.s6_addr[2] = 0xff;
+	ip6.ip6_dst.s6_addr[3] = 0xff;
+	ip6.ip6_dst.s6_addr[15] = 1;
+	memcpy(packet->data + ETHER_HDR_LEN, &ip6, sizeof ip6);
+	memset(packet->data + ETHER_HDR_LEN + sizeof ip6, 0xaa, 1400 - ETHER_HDR_LEN - sizeof ip6);
+	packet->len = 1400;
+}
+
+static void frame_arp(vpn_packet_t *packet) {
+	struct ether_arp arp = {{0}};
+
+	frame_ether(packet, &(mac_t){{0xff, 0xff, 0xff, 0xff, 0xff, 0xff}}, &my_mac, ETH_P_ARP);
+	arp.arp_hrd = htons(ARPHRD_ETHER);
+	arp.arp_pro = htons(ETH_P_IP);
+	arp.arp_hln = ETH_ALEN;
+	arp.arp_pln = 4;
+	arp.arp_op = htons(ARPOP_REQUEST);
+	memcpy(arp.arp_sha, &my_mac, ETH_ALEN);
+	memcpy(arp.arp_spa, (uint8_t[]){10, 255, 0, 1}, 4);
+	memcpy(arp.arp_tpa, (uint8_t[]){10, 0, 0, 1}, 4);
+	memcpy(packet->data + ETHER_HDR_LEN, &arp, sizeof arp);
+	packet->len = ETHER_HDR_LEN + sizeof arp;
+}
+
+static void frame_ndp(vpn_packet_t *packet) {
+	struct ip6_hdr ip6 = {{{0}}};
+	struct nd_neighbor_solicit ns = {{0}};
+	struct nd_opt_hdr opt = {0};
+	int len = sizeof ns + sizeof opt + ETH_ALEN;
+	uint8_t *icmp = packet->data + ETHER_HDR_LEN + sizeof ip6;
+
+	frame_ether(packet, &(mac_t){{0x33, 0x33, 0xff, 0, 0, 1}}, &my_mac, ETH_P_IPV6);
+	ip6.ip6_flow = htonl(0x60000000);
+	ip6.ip6_plen = htons(len);
+	ip6.ip6_nxt = IPPROTO_ICMPV6;
+	ip6.ip6_hlim = 255;
+	ip6.ip6_src.s6_addr[0] = 0xfd;
+	ip6.ip6_src.s6_addr[2] = 0xff;
+	ip6.ip6_src.s6_addr[3] = 0xff;
+	ip6.ip6_src.s6_addr[15] = 1;
+	ip6.ip6_dst.s6_addr[0] = 0xff;
+	ip6.ip6_dst.s6_addr[1] = 0x02;
+	ip6.ip6_dst.s6_addr[11] = 1;
+	ip6.ip6_dst.s6_addr[12] = 0xff;
+	ip6.ip6_dst.s6_addr[15] = 1;
+	ns.nd_ns_type = ND_NEIGHBOR_SOLICIT;
+	ns.nd_ns_target.s6_addr[0] = 0xfd;
+	ns.nd_ns_target.s6_addr[15] = 1;
+	opt.nd_opt_type = ND_OPT_SOURCE_LINKADDR;
+	opt.nd_opt_len = 1;
+
+	memcpy(packet->data + ETHER_HDR_LEN, &ip6, sizeof ip6);
+	memcpy(icmp, &ns, sizeof ns);
+	memcpy(icmp + sizeof ns, &opt, sizeof opt);
+	memcpy(icmp + sizeof ns + sizeof opt, &my_mac, ETH_ALEN);
+
+	/* ICMPv6 checksum over the pseudo header and the message */
+
+	uint32_t sum = checksum(ip6.ip6_src.s6_addr, 16, 0);
+	sum = checksum(ip6.ip6_dst.s6_addr, 16, sum);
+	sum = checksum(icmp, len, sum + len + IPPROTO_ICMPV6);
+	icmp[2] = ~sum >> 8;
+	icmp[3] = ~sum;
+
+	packet->len = ETHER_HDR_LEN + sizeof ip6 + len;
+}
+
+static void frame_mac(vpn_packet_t *packet) {
+	frame_ether(packet, &my_mac, &remote_mac, ETH_P_IP);
+	memset(packet->data + ETHER_HDR_LEN, 0xaa, 1400 - ETHER_HDR_LEN);
+	packet->len = 1400;
+}
+
+static int delivered;
+
+static bool count_packet(vpn_packet_t *packet) {
+	delivered++;
+	return true;
+}
+
+static void bench_route(void) {
+	static const struct {
+		const char *name;
+		rmode_t mode;
+		bool fromdevice;
+		void (*frame)(vpn_packet_t *);
+	} frames[] = {
+		{"ipv4", RMODE_ROUTER, false, frame_ipv4},
+		{"ipv6", RMODE_ROUTER, false, frame_ipv6},
+		{"arp", RMODE_ROUTER, true, frame_arp},
+		{"ndp", RMODE_ROUTER, true, frame_ndp},
+		{"ethernet", RMODE_SWITCH, false, frame_mac},
+		{NULL},
+	};
+
+	vpn_packet_t canned, packet;
+
+	/* Whatever reaches us is counted instead of written to a device */
+
+	devops = dummy_devops;
+	devops.write = count_packet;
+
+	for(int f = 0; frames[f].name; f++) {
+		struct timeval start;
+
+		routing_mode = frames[f].mode;
+		frames[f].frame(&canned);
+
+		/* ARP and NDP replies are written over the request, so every frame starts from a fresh copy */
+
+		delivered = 0;
+		gettimeofday(&start, NULL);
+
+		for(int i = 0; i < BENCH_FRAMES; i++) {
+			memcpy(&packet, &canned, offsetof(vpn_packet_t, data) + canned.len);
+			route(frames[f].fromdevice ? myself : remote, &packet);
+		}
+
+		printf("route frame=%s size=%d delivered=%d ns_per_op=%.1f\n",
+				frames[f].name, canned.len, delivered, elapsed(&start) / BENCH_FRAMES);
+	}
+}
+
+int main(int argc, char **argv) {
+	program_name = argv[0];
+	g_argv = argv;
+
+	bench_avl();
+	bench_nodes();
+	bench_graph();
+	setup_mesh();
+	bench_subnets();
+	bench_requests();
+	bench_route();
+
+	return 0;
+}
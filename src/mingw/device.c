@@ -27,7 +27,6 @@
 #include "../device.h"
 #include "../logger.h"
 #include "../net.h"
-#include "../route.h"
 #include "../utils.h"
 #include "../xalloc.h"
 
@@ -44,57 +43,146 @@ static uint64_t device_total_out = 0;
 
 extern char *myport;
 
-static DWORD WINAPI tapreader(void *bla) {
-	int status;
-	DWORD len;
+/*
+  The tap reader thread keeps several overlapped reads outstanding, each
+  directly into a slot of a ring buffer. Completed slots are handed to the
+  main loop in the order the reads were issued, without taking the global
+  mutex. Only the reader advances queue_head, only the main loop advances
+  queue_tail. The main loop is woken up through a loopback UDP socket, but
+  only when it is not already busy draining the queue.
+*/
+
+#define TAP_READS 8
+#define TAP_QUEUE 256			/* Must be a power of two */
+
+typedef struct tap_slot_t {
 	OVERLAPPED overlapped;
 	vpn_packet_t packet;
+} tap_slot_t;
+
+static tap_slot_t *queue;
+static volatile LONG queue_head = 0;
+static volatile LONG queue_tail = 0;
+static volatile LONG wakeup_pending = 0;
+static volatile LONG reader_waiting = 0;
+static HANDLE space_event;
+static SOCKET wakeup_send = INVALID_SOCKET;
+static bool draining = false;
+static int batch = 0;
+
+static bool start_read(tap_slot_t *slot) {
+	slot->overlapped.Offset = 0;
+	slot->overlapped.OffsetHigh = 0;
+	ResetEvent(slot->overlapped.hEvent);
+
+	if(!ReadFile(device_handle, slot->packet.data, max_frame_size, NULL, &slot->overlapped) && GetLastError() != ERROR_IO_PENDING) {
+		logger(LOG_ERR, "Error while reading from %s %s: %s", device_info,
+			   device, winerror(GetLastError()));
+		return false;
+	}
+
+	return true;
+}
+
+static DWORD WINAPI tapreader(void *bla) {
+	DWORD len;
+	LONG head = queue_head;
+	LONG issued = head;
+	tap_slot_t *slot;
 	int errors = 0;
 
 	logger(LOG_DEBUG, "Tap reader running");
 
-	/* Read from tap device and send to parent */
+	for(;;) {
+		/* Keep TAP_READS reads outstanding, as long as there is room in the queue */
 
-	overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		while(issued - head < TAP_READS && issued - queue_tail < TAP_QUEUE) {
+			if(!start_read(&queue[issued & (TAP_QUEUE - 1)]))
+				break;
+			issued++;
+		}
 
-	for(;;) {
-		overlapped.Offset = 0;
-		overlapped.OffsetHigh = 0;
-		ResetEvent(overlapped.hEvent);
-
-		status = ReadFile(device_handle, packet.data, MTU, &len, &overlapped);
-
-		if(!status) {
-			if(GetLastError() == ERROR_IO_PENDING) {
-				WaitForSingleObject(overlapped.hEvent, INFINITE);
-				if(!GetOverlappedResult(device_handle, &overlapped, &len, FALSE))
-					continue;
-			} else {
-				logger(LOG_ERR, "Error while reading from %s %s: %s", device_info,
-					   device, strerror(errno));
-				errors++;
-				if(errors >= 10) {
+		if(issued == head) {
+			if(issued - queue_tail < TAP_QUEUE) {
+				if(++errors >= 10) {
 					EnterCriticalSection(&mutex);
 					running = false;
 					LeaveCriticalSection(&mutex);
+					return 0;
 				}
 				usleep(1000000);
 				continue;
 			}
+
+			/* The queue is full, wait until the main loop has made room */
+
+			InterlockedExchange(&reader_waiting, 1);
+			if(issued - queue_tail >= TAP_QUEUE)
+				WaitForSingleObject(space_event, INFINITE);
+			InterlockedExchange(&reader_waiting, 0);
+			continue;
 		}
 
-		errors = 0;
-		packet.len = len;
-		packet.priority = 0;
+		/* Failed reads are passed on as empty packets, to keep the ring in order */
+
+		slot = &queue[head & (TAP_QUEUE - 1)];
 
-		EnterCriticalSection(&mutex);
-		route(myself, &packet);
-		LeaveCriticalSection(&mutex);
+		if(!GetOverlappedResult(device_handle, &slot->overlapped, &len, TRUE))
+			len = 0;
+		else
+			errors = 0;
+
+		slot->packet.len = len;
+		slot->packet.priority = 0;
+
+		MemoryBarrier();
+		queue_head = ++head;
+
+		if(!InterlockedExchange(&wakeup_pending, 1))
+			send(wakeup_send, "", 1, 0);
 	}
 
 	return 0;
 }
 
+static bool setup_queue(void) {
+	SOCKET sock[2];
+	struct sockaddr_in sin = {0};
+	int len = sizeof sin;
+	unsigned long arg = 1;
+
+	queue = xmalloc_and_zero(TAP_QUEUE * sizeof *queue);
+
+	for(int i = 0; i < TAP_QUEUE; i++)
+		queue[i].overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	space_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	/* There is no socketpair() on Windows, use two connected loopback sockets */
+
+	sock[0] = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	sock[1] = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if(sock[0] == INVALID_SOCKET || sock[1] == INVALID_SOCKET
+	   || bind(sock[0], (struct sockaddr *)&sin, sizeof sin)
+	   || getsockname(sock[0], (struct sockaddr *)&sin, &len)
+	   || connect(sock[1], (struct sockaddr *)&sin, sizeof sin)
+	   || ioctlsocket(sock[0], FIONBIO, &arg)) {
+		logger(LOG_ERR, "Could not create wakeup socket for %s: %s", device_info, sockstrerror(sockerrno));
+		closesocket(sock[0]);
+		closesocket(sock[1]);
+		return false;
+	}
+
+	device_fd = sock[0];
+	wakeup_send = sock[1];
+
+	return true;
+}
+
 static bool setup_device(void) {
 	HKEY key, key2;
 	int i;
@@ -203,6 +291,11 @@ static bool setup_device(void) {
 
 	/* Start the tap reader */
 
+	device_info = "Windows tap device";
+
+	if(!setup_queue())
+		return false;
+
 	thread = CreateThread(NULL, 0, tapreader, NULL, 0, NULL);
 
 	if(!thread) {
@@ -215,8 +308,6 @@ static bool setup_device(void) {
 	status = true;
 	DeviceIoControl(device_handle, TAP_IOCTL_SET_MEDIA_STATUS, &status, sizeof(status), &status, sizeof(status), &len, NULL);
 
-	device_info = "Windows tap device";
-
 	logger(LOG_INFO, "%s (%s) is a %s", device, iface, device_info);
 
 	return true;
@@ -224,12 +315,68 @@ static bool setup_device(void) {
 
 static void close_device(void) {
 	CloseHandle(device_handle);
+	closesocket(device_fd);
+	closesocket(wakeup_send);
 
 	free(device);
 	free(iface);
 }
 
+/* Called by the main loop when woken up, and then as long as pending_packets() returns true */
+
 static bool read_packet(vpn_packet_t *packet) {
+	char buf[64];
+	tap_slot_t *slot;
+
+	if(!draining) {
+		recv(device_fd, buf, sizeof buf, 0);
+		draining = true;
+	}
+
+	if(queue_tail == queue_head) {
+		packet->len = 0;
+		return true;
+	}
+
+	slot = &queue[queue_tail & (TAP_QUEUE - 1)];
+	packet->len = slot->packet.len;
+	memcpy(packet->data, slot->packet.data, packet->len);
+
+	MemoryBarrier();
+	queue_tail++;
+
+	if(InterlockedExchange(&reader_waiting, 0))
+		SetEvent(space_event);
+
+	device_total_in += packet->len;
+
+	ifdebug(TRAFFIC) logger(LOG_DEBUG, "Read packet of %d bytes from %s",
+			   packet->len, device_info);
+
+	return true;
+}
+
+/* Clear wakeup_pending before the final check, so the reader knows it has to wake us up again.
+   After a full queue's worth of packets, give the rest of the main loop a chance as well. */
+
+static bool pending_packets(void) {
+	if(queue_tail != queue_head) {
+		if(++batch < TAP_QUEUE)
+			return true;
+
+		send(wakeup_send, "", 1, 0);
+		batch = 0;
+		draining = false;
+		return false;
+	}
+
+	InterlockedExchange(&wakeup_pending, 0);
+
+	if(queue_tail != queue_head)
+		return true;
+
+	batch = 0;
+	draining = false;
 	return false;
 }
 
@@ -261,5 +408,6 @@ const devops_t os_devops = {
 	.close = close_device,
 	.read = read_packet,
 	.write = write_packet,
+	.pending = pending_packets,
 	.dump_stats = dump_device_stats,
 };
@@ -165,7 +165,7 @@ static void close_device(void) {
 static bool read_packet(vpn_packet_t *packet) {
 	int lenin;
 
-	if((lenin = recv(device_fd, (void *)packet->data, MTU, 0)) <= 0) {
+	if((lenin = recv(device_fd, (void *)packet->data, max_frame_size, 0)) <= 0) {
 		logger(LOG_ERR, "Error while reading from %s %s: %s", device_info,
 			   device, strerror(errno));
 		return false;
@@ -204,6 +204,55 @@ static bool write_packet(vpn_packet_t *packet) {
 	return true;
 }
 
+/* With recvmmsg() and sendmmsg(), many frames are read or written with one system call */
+
+static int read_batch(vpn_packet_t **packets, int n) {
+	int num = recv_packets(device_fd, packets, n);
+
+	if(num < 0) {
+		logger(LOG_ERR, "Error while reading from %s %s: %s", device_info,
+			   device, strerror(errno));
+		return -1;
+	}
+
+	for(int i = 0; i < num; i++) {
+		if(!memcmp(&ignore_src, packets[i]->data + 6, sizeof ignore_src)) {
+			ifdebug(SCARY_THINGS) logger(LOG_DEBUG, "Ignoring loopback packet of %d bytes from %s", packets[i]->len, device_info);
+			packets[i]->len = 0;
+			continue;
+		}
+
+		device_total_in += packets[i]->len;
+
+		ifdebug(TRAFFIC) logger(LOG_DEBUG, "Read packet of %d bytes from %s", packets[i]->len,
+				   device_info);
+	}
+
+	return num;
+}
+
+static int write_batch(vpn_packet_t **packets, int n) {
+	int num;
+
+	ifdebug(TRAFFIC) logger(LOG_DEBUG, "Writing %d packets to %s", n, device_info);
+
+	num = send_packets(device_fd, packets, n, ai->ai_addr, ai->ai_addrlen);
+
+	if(num < 0) {
+		logger(LOG_ERR, "Can't write to %s %s: %s", device_info, device,
+			   strerror(errno));
+		return -1;
+	}
+
+	for(int i = 0; i < num; i++)
+		device_total_out += packets[i]->len;
+
+	if(num)
+		memcpy(&ignore_src, packets[num - 1]->data + 6, sizeof ignore_src);
+
+	return num;
+}
+
 static void dump_device_stats(void) {
 	logger(LOG_DEBUG, "Statistics for %s %s:", device_info, device);
 	logger(LOG_DEBUG, " total bytes in:  %10"PRIu64, device_total_in);
@@ -216,6 +265,12 @@ const devops_t multicast_devops = {
 	.read = read_packet,
 	.write = write_packet,
 	.dump_stats = dump_device_stats,
+#ifdef HAVE_RECVMMSG
+	.read_batch = read_batch,
+#endif
+#ifdef HAVE_SENDMMSG
+	.write_batch = write_batch,
+#endif
 };
 
 #if 0
@@ -28,20 +28,26 @@
 #include "avl_tree.h"
 #include "conf.h"
 #include "connection.h"
+#include "damping.h"
 #include "device.h"
+#include "edge.h"
 #include "event.h"
+#include "flow.h"
 #include "graph.h"
 #include "logger.h"
 #include "meta.h"
 #include "net.h"
 #include "netutl.h"
+#include "node.h"
 #include "process.h"
 #include "protocol.h"
+#include "resume.h"
 #include "route.h"
 #include "subnet.h"
 #include "xalloc.h"
 
 bool do_purge = false;
+bool remove_pending = false;
 volatile bool running = false;
 #ifdef HAVE_PSELECT
 bool graph_dump = false;
@@ -54,7 +60,7 @@ static int sleeptime = 10;
 
 /* Purge edges and subnets of unreachable nodes. Use carefully. */
 
-static void purge(void) {
+void purge(void) {
 	avl_node_t *nnode, *nnext, *enode, *enext, *snode, *snext;
 	node_t *n;
 	edge_t *e;
@@ -97,32 +103,111 @@ static void purge(void) {
 		n = nnode->data;
 
 		if(!n->status.reachable) {
-			for(enode = edge_weight_tree->head; enode; enode = enext) {
-				enext = enode->next;
-				e = enode->data;
-
-				if(e->to == n)
-					break;
-			}
-
-			if(!enode && (!strictsubnets || !n->subnet_tree->head))
+			if(!n->inedges && (!strictsubnets || !n->subnet_tree->head))
 				/* in strictsubnets mode do not delete nodes with subnets */
 				node_del(n);
 		}
 	}
 }
 
+/* A rough account of where the memory goes, counting the fixed size of each object and its buffers */
+
+static int tree_count(const avl_tree_t *tree) {
+	int count = 0;
+
+	for(avl_node_t *node = tree->head; node; node = node->next)
+		count++;
+
+	return count;
+}
+
+int get_memory_use(memory_use_t *use) {
+	avl_node_t *node;
+	int n = 0, count;
+
+	use[n] = (memory_use_t){"nodes", 0, 0};
+	use[n + 1] = (memory_use_t){"tunnels", 0, 0};
+
+	for(node = node_tree->head; node; node = node->next) {
+		node_t *nd = node->data;
+
+		use[n].count++;
+		use[n].bytes += sizeof *nd;
+
+		if(nd->tunnel) {
+			use[n + 1].count++;
+			use[n + 1].bytes += sizeof *nd->tunnel;
+		}
+	}
+
+	n += 2;
+
+	count = tree_count(edge_weight_tree);
+	use[n++] = (memory_use_t){"edges", count, count * sizeof(edge_t)};
+
+	count = damping_count();
+	use[n++] = (memory_use_t){"edge_damping", count, count * sizeof(damping_t)};
+
+	count = tree_count(subnet_tree);
+	use[n++] = (memory_use_t){"subnets", count, count * sizeof(subnet_t)};
+
+	use[n] = (memory_use_t){"connections", 0, 0};
+
+	for(node = connection_tree->head; node; node = node->next) {
+		connection_t *c = node->data;
+
+		use[n].count++;
+		use[n].bytes += sizeof *c + c->outbufsize + c->packetqlen + (c->inzbuf ? MAXBUFSIZE : 0);
+	}
+
+	n++;
+
+	count = resume_count();
+	use[n++] = (memory_use_t){"meta_sessions", count, count * sizeof(resume_t)};
+
+	use[n].name = "seen_requests";
+	use[n].bytes = past_requests_memory(&count);
+	use[n++].count = count;
+
+	use[n].name = "subnet_cache";
+	use[n].bytes = subnet_cache_memory(&count);
+	use[n++].count = count;
+
+	use[n].name = "flow_table";
+	use[n].bytes = flow_memory(&count);
+	use[n++].count = count;
+
+	use[n].name = "packet_pool";
+	use[n].bytes = packet_pool_memory(&count);
+	use[n++].count = count;
+
+	return n;
+}
+
+void dump_memory(void) {
+	memory_use_t use[MEMORY_USES];
+	int n = get_memory_use(use);
+	unsigned long total = 0;
+
+	logger(LOG_DEBUG, "Memory use%s:", low_memory ? " (LowMemory)" : "");
+
+	for(int i = 0; i < n; i++) {
+		logger(LOG_DEBUG, " %-14s %8lu entries %10lu bytes", use[i].name, use[i].count, use[i].bytes);
+		total += use[i].bytes;
+	}
+
+	logger(LOG_DEBUG, " %-14s %8s         %10lu bytes", "total", "", total);
+}
+
 /*
-  put all file descriptors in an fd_set array
+  Delete connections that have been marked for removal.
   While we're at it, purge stuff that needs to be removed.
 */
-static int build_fdset(fd_set *readset, fd_set *writeset) {
+void remove_connections(void) {
 	avl_node_t *node, *next;
 	connection_t *c;
-	int i, max = 0;
 
-	FD_ZERO(readset);
-	FD_ZERO(writeset);
+	remove_pending = false;
 
 	for(node = connection_tree->head; node; node = next) {
 		next = node->next;
@@ -132,30 +217,8 @@ static int build_fdset(fd_set *readset, fd_set *writeset) {
 			connection_del(c);
 			if(!connection_tree->head)
 				purge();
-		} else {
-			FD_SET(c->socket, readset);
-			if(c->outbuflen > 0 || c->status.connecting)
-				FD_SET(c->socket, writeset);
-			if(c->socket > max)
-				max = c->socket;
 		}
 	}
-
-	for(i = 0; i < listen_sockets; i++) {
-		FD_SET(listen_socket[i].tcp, readset);
-		if(listen_socket[i].tcp > max)
-			max = listen_socket[i].tcp;
-		FD_SET(listen_socket[i].udp, readset);
-		if(listen_socket[i].udp > max)
-			max = listen_socket[i].udp;
-	}
-
-	if(device_fd >= 0)
-		FD_SET(device_fd, readset);
-	if(device_fd > max)
-		max = device_fd;
-	
-	return max;
 }
 
 /*
@@ -174,10 +237,15 @@ void terminate_connection(connection_t *c, bool report) {
 
 	c->status.remove = true;
 	c->status.active = false;
+	remove_pending = true;
 
 	if(c->node)
 		c->node->connection = NULL;
 
+	resume_closed(c);
+
+	io_del(&c->io);
+
 	if(c->socket)
 		closesocket(c->socket);
 
@@ -191,23 +259,9 @@ void terminate_connection(connection_t *c, bool report) {
 		if(report && !tunnelserver)
 			send_del_edge(everyone, c->edge);
 
-		edge_del(c->edge);
-
 		/* Run MST and SSSP algorithms */
 
-		graph();
-
-		/* If the node is not reachable anymore but we remember it had an edge to us, clean it up */
-
-		if(report && !c->node->status.reachable) {
-			edge_t *e;
-			e = lookup_edge(c->node, myself);
-			if(e) {
-				if(!tunnelserver)
-					send_del_edge(everyone, e);
-				edge_del(e);
-			}
-		}
+		graph_del_connection_edge(c->edge, report);
 	}
 
 	free_connection_partially(c);
@@ -219,144 +273,128 @@ void terminate_connection(connection_t *c, bool report) {
 		do_outgoing_connection(c);	
 	}
 
-#ifndef HAVE_MINGW
+	check_handshakes();
+
 	/* Clean up dead proxy processes */
 
-	while(waitpid(-1, NULL, WNOHANG) > 0);
-#endif
+	reap_children();
 }
 
 /*
-  Check if the other end is active.
-  If we have sent packets, but didn't receive any,
-  then possibly the other end is dead. We send a
-  PING request over the meta connection. If the other
-  end does not reply in time, we consider them dead
-  and close the connection.
+  Every connection has a timer that fires when the next thing is due: a
+  PING once PingInterval has passed since the last one, or giving up on him
+  once PingTimeout has passed since the PING, since he connected, or since
+  his output buffer stopped draining. Each timer runs on its own, so the
+  PINGs to all peers are spread out instead of going out at once.
 */
-static void check_dead_connections(void) {
-	avl_node_t *node, *next;
-	connection_t *c;
+static void check_connection(void *data);
 
-	for(node = connection_tree->head; node; node = next) {
-		next = node->next;
-		c = node->data;
+void schedule_connection_check(connection_t *c) {
+	uint64_t clock = now_msec;
+	uint64_t when;
 
-		if(c->last_ping_time + pingtimeout <= now) {
-			if(c->status.active) {
-				if(c->status.pinged) {
-					ifdebug(CONNECTIONS) logger(LOG_INFO, "%s (%s) didn't respond to PING in %ld seconds",
-							   c->name, c->hostname, (long)now - c->last_ping_time);
-					c->status.timeout = true;
-					terminate_connection(c, true);
-				} else if(c->last_ping_time + pinginterval <= now) {
-					send_ping(c);
-				}
-			} else {
-				if(c->status.remove) {
-					logger(LOG_WARNING, "Old connection_t for %s (%s) status %04x still lingering, deleting...",
-						   c->name, c->hostname, bitfield_to_int(&c->status, sizeof c->status));
-					connection_del(c);
-					continue;
-				}
-				ifdebug(CONNECTIONS) logger(LOG_WARNING, "Timeout from %s (%s) during authentication",
-						   c->name, c->hostname);
-				if(c->status.connecting) {
-					c->status.connecting = false;
-					closesocket(c->socket);
-					do_outgoing_connection(c);
-				} else {
-					terminate_connection(c, false);
-				}
-			}
+	if(c->status.remove)
+		return;
+
+	if(c->status.active && !c->status.pinged)
+		when = c->last_ping_time + pinginterval * 1000ULL;
+	else
+		when = c->last_ping_time + pingtimeout_msec;
+
+	if(c->status.active && c->outbuflen > 0 && c->last_flushed_time + pingtimeout_msec < when)
+		when = c->last_flushed_time + pingtimeout_msec;
+
+	event_add(&c->pingevent, check_connection, c, when > clock ? when - clock : 0);
+}
+
+static void check_connection(void *data) {
+	connection_t *c = data;
+	uint64_t clock = now_msec;
+
+	if(c->status.remove)
+		return;
+
+	if(c->status.active) {
+		if(c->outbuflen > 0 && c->last_flushed_time + pingtimeout_msec <= clock) {
+			ifdebug(CONNECTIONS) logger(LOG_INFO,
+					"%s (%s) could not flush for %lu ms (%d bytes remaining)",
+					c->name, c->hostname, (unsigned long)(clock - c->last_flushed_time), c->outbuflen);
+			c->status.timeout = true;
+			terminate_connection(c, true);
+			return;
 		}
 
-		if(c->outbuflen > 0 && c->last_flushed_time + pingtimeout <= now) {
-			if(c->status.active) {
-				ifdebug(CONNECTIONS) logger(LOG_INFO,
-						"%s (%s) could not flush for %ld seconds (%d bytes remaining)",
-						c->name, c->hostname, (long)now - c->last_flushed_time, c->outbuflen);
+		if(c->status.pinged) {
+			if(c->last_ping_time + pingtimeout_msec <= clock) {
+				ifdebug(CONNECTIONS) logger(LOG_INFO, "%s (%s) didn't respond to PING in %lu ms",
+						   c->name, c->hostname, (unsigned long)(clock - c->last_ping_time));
 				c->status.timeout = true;
 				terminate_connection(c, true);
+				return;
 			}
+		} else if(c->last_ping_time + pinginterval * 1000ULL <= clock) {
+			send_ping(c);
+			return;
+		}
+	} else if(c->last_ping_time + pingtimeout_msec <= clock) {
+		ifdebug(CONNECTIONS) logger(LOG_WARNING, "Timeout from %s (%s) during authentication",
+				   c->name, c->hostname);
+		if(c->status.connecting) {
+			c->status.connecting = false;
+			io_del(&c->io);
+			closesocket(c->socket);
+			do_outgoing_connection(c);
+		} else {
+			terminate_connection(c, false);
 		}
+		return;
 	}
+
+	schedule_connection_check(c);
 }
 
 /*
-  check all connections to see if anything
-  happened on their sockets
+  handle activity on a meta connection's socket
 */
-static void check_network_activity(fd_set * readset, fd_set * writeset) {
-	connection_t *c;
-	avl_node_t *node;
-	int result, i;
+void handle_meta_io(void *data, int flags) {
+	connection_t *c = data;
+	int result;
 	socklen_t len = sizeof(result);
-	vpn_packet_t packet;
-	static int errors = 0;
-
-	/* check input from kernel */
-	if(device_fd >= 0 && FD_ISSET(device_fd, readset)) {
-		if(devops.read(&packet)) {
-			if(packet.len) {
-				errors = 0;
-				packet.priority = 0;
-				route(myself, &packet);
-			}
-		} else {
-			usleep(errors * 50000);
-			errors++;
-			if(errors > 10) {
-				logger(LOG_ERR, "Too many errors from %s, exiting!", device);
-				running = false;
-			}
-		}
-	}
 
-	/* check meta connections */
-	for(node = connection_tree->head; node; node = node->next) {
-		c = node->data;
-
-		if(c->status.remove)
-			continue;
-
-		if(FD_ISSET(c->socket, writeset)) {
-			if(c->status.connecting) {
-				c->status.connecting = false;
-				getsockopt(c->socket, SOL_SOCKET, SO_ERROR, (void *)&result, &len);
-
-				if(!result)
-					finish_connecting(c);
-				else {
-					ifdebug(CONNECTIONS) logger(LOG_DEBUG,
-							   "Error while connecting to %s (%s): %s",
-							   c->name, c->hostname, sockstrerror(result));
-					closesocket(c->socket);
-					do_outgoing_connection(c);
-					continue;
-				}
-			}
+	if(c->status.remove)
+		return;
 
-			if(!flush_meta(c)) {
-				terminate_connection(c, c->status.active);
-				continue;
+	if(flags & IO_WRITE) {
+		if(c->status.connecting) {
+			c->status.connecting = false;
+			getsockopt(c->socket, SOL_SOCKET, SO_ERROR, (void *)&result, &len);
+
+			if(!result)
+				finish_connecting(c);
+			else {
+				ifdebug(CONNECTIONS) logger(LOG_DEBUG,
+						   "Error while connecting to %s (%s): %s",
+						   c->name, c->hostname, sockstrerror(result));
+				io_del(&c->io);
+				closesocket(c->socket);
+				do_outgoing_connection(c);
+				return;
 			}
 		}
 
-		if(FD_ISSET(c->socket, readset)) {
-			if(!receive_meta(c)) {
-				terminate_connection(c, c->status.active);
-				continue;
-			}
+		if(!flush_meta(c)) {
+			terminate_connection(c, c->status.active);
+			return;
 		}
 	}
 
-	for(i = 0; i < listen_sockets; i++) {
-		if(FD_ISSET(listen_socket[i].udp, readset))
-			handle_incoming_vpn_data(i);
+	/* While a worker is busy with his last request, what follows it stays in the socket */
 
-		if(FD_ISSET(listen_socket[i].tcp, readset))
-			handle_new_meta_connection(listen_socket[i].tcp);
+	if(flags & IO_READ && !c->status.waiting) {
+		if(!receive_meta(c)) {
+			terminate_connection(c, c->status.active);
+			return;
+		}
 	}
 }
 
@@ -364,15 +402,11 @@ static void check_network_activity(fd_set * readset, fd_set * writeset) {
   this is where it all happens...
 */
 int main_loop(void) {
-	fd_set readset, writeset;
 #ifdef HAVE_PSELECT
-	struct timespec tv;
 	sigset_t omask, block_mask;
 	time_t next_event;
-#else
-	struct timeval tv;
 #endif
-	int r, maxfd;
+	int r, timeout, event_ms;
 	time_t last_ping_check, last_config_check, last_graph_dump;
 	event_t *event;
 
@@ -385,14 +419,17 @@ int main_loop(void) {
 #ifdef HAVE_PSELECT
 	if(lookup_config(config_tree, "GraphDumpFile"))
 		graph_dump = true;
-	/* Block SIGHUP & SIGALRM */
+	/* Block SIGHUP, SIGALRM & SIGCHLD */
 	sigemptyset(&block_mask);
 	sigaddset(&block_mask, SIGHUP);
 	sigaddset(&block_mask, SIGALRM);
+	sigaddset(&block_mask, SIGCHLD);
 	sigprocmask(SIG_BLOCK, &block_mask, &omask);
+	io_set_sigmask(&omask);
 #endif
 
 	running = true;
+	bufferlogger(true);
 
 	while(running) {
 #ifdef HAVE_PSELECT
@@ -400,30 +437,37 @@ int main_loop(void) {
 		if(graph_dump && next_event > last_graph_dump + 60)
 			next_event = last_graph_dump + 60;
 
-		if((event = peek_next_event()) && next_event > event->time)
-			next_event = event->time;
-
 		if(next_event <= now)
-			tv.tv_sec = 0;
+			timeout = 0;
 		else
-			tv.tv_sec = next_event - now;
-		tv.tv_nsec = 0;
+			timeout = (next_event - now) * 1000;
 #else
-		tv.tv_sec = 1;
-		tv.tv_usec = 0;
+		timeout = 1000;
 #endif
 
-		maxfd = build_fdset(&readset, &writeset);
+		event_ms = event_timeout();
+		if(event_ms >= 0 && event_ms < timeout)
+			timeout = event_ms;
+
+		flush_aggregates();
+		flush_crypto_pipeline();
+		flush_udp_queue();
+		flush_device_queue();
+		if(devops.flush)
+			devops.flush();
+		run_scripts();
+		flush_meta_all();
+		flushlogger();
+
+		if(remove_pending)
+			remove_connections();
 
 #ifdef HAVE_MINGW
 		LeaveCriticalSection(&mutex);
 #endif
-#ifdef HAVE_PSELECT
-		r = pselect(maxfd + 1, &readset, &writeset, NULL, &tv, &omask);
-#else
-		r = select(maxfd + 1, &readset, &writeset, NULL, &tv);
-#endif
-		now = time(NULL);
+		r = io_wait(timeout);
+		update_clock();
+		now = now_msec / 1000;
 #ifdef HAVE_MINGW
 		EnterCriticalSection(&mutex);
 #endif
@@ -432,12 +476,13 @@ int main_loop(void) {
 			if(!sockwouldblock(sockerrno)) {
 				logger(LOG_ERR, "Error while waiting for input: %s", sockstrerror(sockerrno));
 				dump_connections();
+				bufferlogger(false);
 				return 1;
 			}
 		}
 
 		if(r > 0)
-			check_network_activity(&readset, &writeset);
+			io_dispatch();
 
 		if(do_purge) {
 			purge();
@@ -447,32 +492,23 @@ int main_loop(void) {
 		/* Let's check if everybody is still alive */
 
 		if(last_ping_check + pingtimeout <= now) {
-			check_dead_connections();
 			last_ping_check = now;
 
 			if(routing_mode == RMODE_SWITCH)
 				age_subnets();
 
 			age_past_requests();
+			expire_node_tunnels();
 
 			/* Should we regenerate our key? */
 
 			if(keyexpires <= now) {
-				avl_node_t *node;
-				node_t *n;
+				ifdebug(STATUS) logger(LOG_INFO, "Renewing symmetric keys");
 
-				ifdebug(STATUS) logger(LOG_INFO, "Expiring symmetric keys");
+				rotate_keys();
 
-				for(node = node_tree->head; node; node = node->next) {
-					n = node->data;
-					if(n->inkey) {
-						free(n->inkey);
-						n->inkey = NULL;
-					}
-				}
-
-				send_key_changed();
-				keyexpires = now + keylifetime;
+				/* Jitter the lifetime, so nodes that started together do not keep rotating together */
+				keyexpires = now + keylifetime - rand() % (keylifetime / 10 + 1);
 			}
 
 			/* Detect ADD_EDGE/DEL_EDGE storms that are caused when
@@ -508,10 +544,8 @@ int main_loop(void) {
 			sigalrm = false;
 		}
 
-		while((event = get_expired_event())) {
+		while((event = get_expired_event()))
 			event->handler(event->data);
-			free_event(event);
-		}
 
 		if(sighup) {
 			connection_t *c;
@@ -522,6 +556,9 @@ int main_loop(void) {
 			sighup = false;
 
 			reopenlogger();
+			flush_host_config_cache();
+			flush_public_key_cache();
+			flush_resume();
 			
 			/* Reread our own configuration file */
 
@@ -530,6 +567,7 @@ int main_loop(void) {
 
 			if(!read_server_config()) {
 				logger(LOG_ERR, "Unable to reread configuration file, exitting.");
+				bufferlogger(false);
 				return 1;
 			}
 
@@ -552,20 +590,24 @@ int main_loop(void) {
 			for(list_node_t *node = outgoing_list->head; node; node = node->next) {
 				outgoing_t *outgoing = node->data;
 
-				if(outgoing->event)
-					event_del(outgoing->event);
+				event_del(&outgoing->event);
 			}
 
 			list_delete_list(outgoing_list);
 
-			/* Close connections to hosts that have a changed or deleted host config file */
+			/* Close connections to hosts that have a deleted host config file,
+			   or a changed one that differs in more than Subnets and Addresses */
 			
 			for(node = connection_tree->head; node; node = node->next) {
 				c = node->data;
 				
 				xasprintf(&fname, "%s/hosts/%s", confbase, c->name);
-				if(stat(fname, &s) || s.st_mtime > last_config_check)
+				if(stat(fname, &s))
 					terminate_connection(c, c->status.active);
+				else if(s.st_mtime > last_config_check && (!c->status.active || !reload_connection_config(c))) {
+					ifdebug(CONNECTIONS) logger(LOG_INFO, "Host configuration of %s changed, reconnecting", c->name);
+					terminate_connection(c, c->status.active);
+				}
 				free(fname);
 			}
 
@@ -619,5 +661,7 @@ int main_loop(void) {
 	sigprocmask(SIG_SETMASK, &omask, NULL);
 #endif
 
+	bufferlogger(false);
+
 	return 0;
 }
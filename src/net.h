@@ -22,16 +22,38 @@
 #define __TINC_NET_H__
 
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 
+#include "event.h"
+#include "io.h"
 #include "ipv6.h"
 
+/* The largest frame MaxFrameSize can ask for, and its default */
+
 #ifdef ENABLE_JUMBOGRAMS
 #define MTU 9018				/* 9000 bytes payload + 14 bytes ethernet header + 4 bytes VLAN tag */
 #else
 #define MTU 1518				/* 1500 bytes payload + 14 bytes ethernet header + 4 bytes VLAN tag */
 #endif
 
-#define MAXSIZE (MTU + 4 + EVP_MAX_BLOCK_LENGTH + EVP_MAX_MD_SIZE + MTU/64 + 20)	/* MTU + seqno + padding + HMAC + compressor overhead */
+#define MINMTU 590				/* 576 bytes payload + 14 bytes ethernet header, what ICMP replies need */
+
+#define PACKET_SIZE(mtu) ((mtu) + 4 + EVP_MAX_BLOCK_LENGTH + EVP_MAX_MD_SIZE + (mtu)/64 + 20)	/* frame + seqno + padding + HMAC + compressor overhead */
+#define MAXSIZE PACKET_SIZE(MTU)
+/* AEAD ciphers authenticate packets themselves, with a tag of this many bytes instead of a HMAC */
+#define AEAD_TAG_SIZE 16
+
+#ifdef EVP_CIPH_FLAG_AEAD_CIPHER
+#define CIPHER_IS_AEAD(cipher) ((cipher) && (EVP_CIPHER_flags(cipher) & EVP_CIPH_FLAG_AEAD_CIPHER))
+#else
+#define CIPHER_IS_AEAD(cipher) false
+#endif
+
+#ifndef EVP_CTRL_AEAD_GET_TAG
+#define EVP_CTRL_AEAD_GET_TAG EVP_CTRL_GCM_GET_TAG
+#define EVP_CTRL_AEAD_SET_TAG EVP_CTRL_GCM_SET_TAG
+#endif
+
 #define MAXBUFSIZE ((MAXSIZE > 2048 ? MAXSIZE : 2048) + 128)	/* Enough room for a request with a MAXSIZEd packet or a 8192 bits RSA key */
 
 #define MAXSOCKETS 128			/* Overkill... */
@@ -79,45 +101,129 @@ typedef union sockaddr_t {
 typedef struct vpn_packet_t {
 	length_t len;				/* the actual number of bytes in the `data' field */
 	int priority;				/* priority or TOS */
+	uint32_t sessionid;			/* optional session ID, sent directly in front of the seqno */
 	uint32_t seqno;				/* 32 bits sequence number (network byte order of course) */
 	uint8_t data[MAXSIZE];
 } vpn_packet_t;
 
+/* Packets from new_packet() only have room for max_packet_size bytes of data, this is rounded up so they can be put side by side */
+#define PACKET_ALLOC_SIZE ((offsetof(vpn_packet_t, data) + max_packet_size + 7) & ~7)
+
+#if defined(HAVE_RECVMMSG) && defined(SOL_UDP) && defined(UDP_GRO)
+#define HAVE_UDP_GRO
+#endif
+
+#define MAXSHARDS 16
+
+/* How full the kernel buffers of a UDP socket got, see UDPRcvBufMax and UDPSndBufMax */
+
+typedef struct udp_buffer_t {
+	int rcvbuf;				/* sizes as getsockopt() reports them */
+	int sndbuf;
+	int rcvwant;				/* sizes last asked for with setsockopt() */
+	int sndwant;
+	uint32_t kernel_drops;			/* the kernel's drop counter at the last check */
+	uint64_t rx_drops;			/* datagrams dropped because the receive buffer was full */
+	uint64_t tx_full;			/* sends that failed with EAGAIN or ENOBUFS */
+	uint64_t tx_checked;			/* tx_full at the last check */
+} udp_buffer_t;
+
+/* An extra UDP socket bound to the same address as a listen socket, see UDPSockets */
+
+typedef struct udp_shard_t {
+	int udp;
+	io_t udp_io;
+	udp_buffer_t buf;
+	struct listen_socket_t *ls;
+} udp_shard_t;
+
 typedef struct listen_socket_t {
 	int tcp;
 	int udp;
+	io_t tcp_io;
+	io_t udp_io;
 	sockaddr_t sa;
 	int priority;
+	udp_buffer_t buf;
+	int shards;					/* number of extra UDP sockets */
+	udp_shard_t shard[MAXSHARDS - 1];
 } listen_socket_t;
 
 #include "conf.h"
 #include "list.h"
 
+/* What a table of the daemon holds and how much memory that takes */
+
+typedef struct memory_use_t {
+	const char *name;
+	unsigned long count;
+	unsigned long bytes;
+} memory_use_t;
+
+#define MEMORY_USES 11
+
 typedef struct outgoing_t {
 	char *name;
 	int timeout;
-	struct config_t *cfg;
-	struct addrinfo *ai;
-	struct addrinfo *aip;
-	struct event *event;
+	bool resolved;				/* the Addresses have been looked up */
+	sockaddr_t *addresses;			/* the results, with the address families alternating */
+	int naddresses;
+	int nextaddress;			/* index of the next address to try */
+	event_t event;
 } outgoing_t;
 
 extern list_t *outgoing_list;
 
 extern int maxoutbufsize;
+extern length_t max_frame_size;
+extern length_t max_packet_size;
+extern int max_handshakes;
+extern int connection_rate;
+extern uint64_t connections_accepted;
+extern uint64_t connections_rejected;
 extern int seconds_till_retry;
 extern int addressfamily;
 extern unsigned replaywin;
+
+/* The ring of the replay window has a word more than the window, see replay_check() */
+#define REPLAY_SIZE ((replaywin / 8 + 1) * sizeof(uint64_t))
 extern bool localdiscovery;
+extern bool sessionids;
 
 extern listen_socket_t listen_socket[MAXSOCKETS];
+extern io_t device_io;
 extern int listen_sockets;
 extern int keyexpires;
 extern int keylifetime;
 extern int udp_rcvbuf;
+extern int udp_rcvbuf_max;
+extern int udp_sndbuf_max;
+extern bool udp_gro;
+extern bool fair_queueing;
+extern bool crypto_pipeline;
+extern bool aggregation;
+extern int aggregation_delay;
+extern bool fragmentation;
+extern int ingress_rate;
+extern int egress_rate;
+extern bool multipath;
+extern int udp_sockets;
+extern bool low_memory;
+extern uint64_t udp_rx_packets;
+extern uint64_t udp_rx_batches;
+extern uint64_t udp_tx_packets;
+extern uint64_t udp_tx_calls;
+extern uint64_t replay_late;
+extern uint64_t replay_replayed;
+extern uint64_t replay_farfuture;
+extern uint64_t compress_in_bytes;
+extern uint64_t compress_out_bytes;
+extern uint64_t compress_raw_packets;
+extern uint64_t compress_shared_packets;
 extern int udp_sndbuf;
 extern bool do_prune;
 extern bool do_purge;
+extern bool remove_pending;
 extern char *myport;
 extern time_t now;
 extern int contradicting_add_edge;
@@ -144,15 +250,43 @@ extern volatile bool running;
 #include "node.h"
 
 extern void retry_outgoing(outgoing_t *);
-extern void handle_incoming_vpn_data(int);
+extern void handle_incoming_vpn_data(void *, int);
+extern void handle_incoming_shard_data(void *, int);
+extern void handle_device_data(void *, int);
+extern void dump_udp_stats(void);
+extern void flush_udp_queue(void);
+extern void clear_node_txq(struct node_t *);
+extern void flush_crypto_pipeline(void);
+extern void flush_aggregates(void);
+extern void clear_node_aggregate(struct node_t *);
+extern void clear_node_reassembly(struct node_t *);
+extern bool can_fragment(const struct node_t *);
+extern void flush_node_batches(struct node_t *, bool);
+extern vpn_packet_t *new_packet(void) __attribute__ ((__malloc__));
+extern void free_packet(vpn_packet_t *);
+extern void exit_packets(void);
+extern unsigned long packet_pool_memory(int *);
+extern void flush_device_queue(void);
+extern int recv_packets(int, vpn_packet_t **, int);
+extern int send_packets(int, vpn_packet_t **, int, const struct sockaddr *, socklen_t);
 extern void finish_connecting(struct connection_t *);
 extern void do_outgoing_connection(struct connection_t *);
-extern bool handle_new_meta_connection(int);
+extern void forget_addresses(outgoing_t *);
+extern void handle_new_meta_connection(void *, int);
+extern void setup_udp_shards(listen_socket_t *);
+extern void init_udp_buffers(void);
+extern void exit_udp_buffers(void);
+extern void check_handshakes(void);
+extern int count_handshakes(void);
 extern int setup_listen_socket(const sockaddr_t *);
 extern int setup_vpn_in_socket(const sockaddr_t *);
-extern void send_packet(const struct node_t *, vpn_packet_t *);
+extern int get_path_mtu(const sockaddr_t *);
+extern void send_packet(struct node_t *, vpn_packet_t *);
+extern void set_rate_limit(struct bucket_t *, int);
+extern void update_node_forwarding(struct node_t *);
 extern void receive_tcppacket(struct connection_t *, const char *, int);
 extern void broadcast_packet(const struct node_t *, vpn_packet_t *);
+extern void multicast_packet(const struct node_t *, vpn_packet_t *, const avl_tree_t *);
 extern char *get_name(void);
 extern bool setup_network(void);
 extern void setup_outgoing_connection(struct outgoing_t *);
@@ -160,8 +294,16 @@ extern void try_outgoing_connections(void);
 extern void close_network_connections(void);
 extern int main_loop(void);
 extern void terminate_connection(struct connection_t *, bool);
+extern void remove_connections(void);
+extern void purge(void);
+extern int get_memory_use(memory_use_t *);
+extern void dump_memory(void);
+extern void schedule_connection_check(struct connection_t *);
+extern void handle_meta_io(void *, int);
 extern void flush_queue(struct node_t *);
 extern bool read_rsa_public_key(struct connection_t *);
+extern bool reload_connection_config(struct connection_t *);
+extern void flush_public_key_cache(void);
 extern void send_mtu_probe(struct node_t *);
 extern void load_all_subnets(void);
 
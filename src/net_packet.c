@@ -28,495 +28,2986 @@
 #include <openssl/pem.h>
 #include <openssl/hmac.h>
 
-#ifdef HAVE_ZLIB
-#include <zlib.h>
-#endif
-
-#ifdef HAVE_LZO
-#include LZO1X_H
-#endif
-
 #include "avl_tree.h"
+#include "capture.h"
+#include "compress.h"
 #include "conf.h"
 #include "connection.h"
 #include "device.h"
+#include "edge.h"
 #include "ethernet.h"
 #include "event.h"
+#include "flow.h"
 #include "graph.h"
 #include "logger.h"
 #include "net.h"
 #include "netutl.h"
 #include "protocol.h"
 #include "process.h"
+#include "profile.h"
 #include "route.h"
+#include "subnet.h"
 #include "utils.h"
+#include "worker.h"
 #include "xalloc.h"
 
 int keylifetime = 0;
 int keyexpires = 0;
-#ifdef HAVE_LZO
-static char lzo_wrkmem[LZO1X_999_MEM_COMPRESS > LZO1X_1_MEM_COMPRESS ? LZO1X_999_MEM_COMPRESS : LZO1X_1_MEM_COMPRESS];
-#endif
+static compress_ctx_t *compress_ctx;
 
 static void send_udppacket(node_t *, vpn_packet_t *);
+static void receive_aggregate(node_t *, vpn_packet_t *);
+static void receive_fragment(node_t *, vpn_packet_t *);
+static void pipeline_receive(node_t *, const vpn_packet_t *);
+static void exit_crypto_pipeline(void);
 
 unsigned replaywin = 16;
 bool localdiscovery = false;
+bool sessionids = true;
+io_t device_io;
+
+uint64_t udp_rx_packets = 0;
+uint64_t udp_rx_batches = 0;
+uint64_t udp_tx_packets = 0;
+uint64_t udp_tx_calls = 0;
+uint64_t replay_late = 0;
+uint64_t replay_replayed = 0;
+uint64_t replay_farfuture = 0;
+uint64_t compress_in_bytes = 0;
+uint64_t compress_out_bytes = 0;
+uint64_t compress_raw_packets = 0;
+uint64_t compress_shared_packets = 0;
 
 #define MAX_SEQNO 1073741824
 
-/* mtuprobes == 1..30: initial discovery, send bursts with 1 second interval
-   mtuprobes ==    31: sleep pinginterval seconds
-   mtuprobes ==    32: send 1 burst, sleep pingtimeout second
-   mtuprobes ==    33: no response from other side, restart PMTU discovery process
+/* Set in the sequence number of packets that are sent uncompressed even though compression is on */
+#define SEQNO_UNCOMPRESSED 0x80000000
 
-   Probes are sent in batches of at least three, with random sizes between the
-   lower and upper boundaries for the MTU thus far discovered.
+/* Sizes in 1/256ths of the original above which compression is not worth it,
+   and the range of the number of packets sent uncompressed before trying again */
+#define COMPRESS_WORTHWHILE 243
+#define COMPRESS_BACKOFF_MIN 16
+#define COMPRESS_BACKOFF_MAX 4096
 
-   After the initial discovery, a fourth packet is added to each batch with a
-   size larger than the currently known PMTU, to test if the PMTU has increased.
+/* Maximum number of UDP packets read or written with a single recvmmsg() or sendmmsg() call */
+#define MAX_MSG 64
 
-   In case local discovery is enabled, another packet is added to each batch,
-   which will be broadcast to the local network.
+/* With LowMemory, fewer packet buffers are used per call, and fewer are kept around */
+#define LOW_MSG 8
+#define BATCH_MSG (low_memory ? LOW_MSG : MAX_MSG)
+
+#ifdef HAVE_UDP_GRO
+/* Buffers for coalesced datagrams read with one recvmmsg() call, and the size of each */
+#define GRO_MSG 8
+#define GRO_SIZE 65536
+#endif
+
+#ifdef HAVE_SENDMMSG
+/* Packets encrypted by send_udppacket(), waiting to be sent by flush_udp_queue() */
+
+typedef struct udp_queue_t {
+	struct udp_queue_t *next;		/* next packet in the same FairQueueing queue */
+	node_t *node;
+	int sock;
+	int origlen;
+	int priority;				/* TOS or traffic class to send it with */
+	sockaddr_t sa;
+	socklen_t sl;
+	char *start;
+	vpn_packet_t pkt;
+} udp_queue_t;
+
+static udp_queue_t udp_queue[MAX_MSG];
+static int udp_queued = 0;
+
+/* Set if the kernel takes IP_TOS and IPV6_TCLASS as ancillary data, otherwise setsockopt() is used */
+static bool tos_cmsg = true;
+#endif
+
+bool fair_queueing = false;
 
+length_t max_frame_size = MTU;			/* MaxFrameSize */
+length_t max_packet_size = MAXSIZE;		/* PACKET_SIZE(max_frame_size) */
+
+/*
+  Packet buffers.
+
+  Packets that are too large to comfortably put on the stack, or that have to
+  outlive the function that created them, are allocated with new_packet().
+  free_packet() returns them to a pool of free buffers, so in the steady
+  state no memory is allocated per packet.
+
+  They only have room for frames of max_frame_size bytes, not for the
+  largest frame tinc was compiled for, so nodes that are not configured for
+  jumbo frames do not pay for them.
 */
 
-void send_mtu_probe(node_t *n) {
-	vpn_packet_t packet;
-	int len, i;
-	int timeout = 1;
-	
-	n->mtuprobes++;
-	n->mtuevent = NULL;
+#define PACKET_POOL_SIZE 64
 
-	if(!n->status.reachable || !n->status.validkey) {
-		ifdebug(TRAFFIC) logger(LOG_INFO, "Trying to send MTU probe to unreachable or rekeying node %s (%s)", n->name, n->hostname);
-		n->mtuprobes = 0;
+static vpn_packet_t *packet_pool[PACKET_POOL_SIZE];
+static int packet_pool_free = 0;
+
+vpn_packet_t *new_packet(void) {
+	vpn_packet_t *packet;
+
+	if(packet_pool_free)
+		packet = packet_pool[--packet_pool_free];
+	else
+		packet = xmalloc(PACKET_ALLOC_SIZE);
+
+	packet->len = 0;
+	packet->priority = 0;
+
+	return packet;
+}
+
+void free_packet(vpn_packet_t *packet) {
+	if(packet_pool_free < (low_memory ? LOW_MSG : PACKET_POOL_SIZE))
+		packet_pool[packet_pool_free++] = packet;
+	else
+		free(packet);
+}
+
+unsigned long packet_pool_memory(int *packets) {
+	*packets = packet_pool_free;
+	return packet_pool_free * PACKET_ALLOC_SIZE;
+}
+
+/*
+  Batched device I/O. A device with read_batch() is drained of up to
+  BATCH_MSG frames each time it is readable. With write_batch(), frames for
+  our own device are copied to device_queue, and written together when it is
+  full or at the end of the iteration of the main loop, like UDP packets.
+  Devices that are datagram sockets use recv_packets() and send_packets().
+*/
+
+static vpn_packet_t *device_queue[MAX_MSG];
+static int device_queued = 0;
+
+void flush_device_queue(void) {
+	int done = 0, n;
+
+	if(!device_queued)
 		return;
-	}
 
-	if(n->mtuprobes > 32) {
-		if(!n->minmtu) {
-			n->mtuprobes = 31;
-			timeout = pinginterval;
-			goto end;
-		}
+	profile_begin(start);
 
-		ifdebug(TRAFFIC) logger(LOG_INFO, "%s (%s) did not respond to UDP ping, restarting PMTU discovery", n->name, n->hostname);
-		n->mtuprobes = 1;
-		n->minmtu = 0;
-		n->maxmtu = MTU;
-	}
+	while(done < device_queued) {
+		n = devops.write_batch(device_queue + done, device_queued - done);
 
-	if(n->mtuprobes >= 10 && n->mtuprobes < 32 && !n->minmtu) {
-		ifdebug(TRAFFIC) logger(LOG_INFO, "No response to MTU probes from %s (%s)", n->name, n->hostname);
-		n->mtuprobes = 31;
-	}
+		/* The device has logged why, what is left is dropped */
 
-	if(n->mtuprobes == 30 || (n->mtuprobes < 30 && n->minmtu >= n->maxmtu)) {
-		if(n->minmtu > n->maxmtu)
-			n->minmtu = n->maxmtu;
-		else
-			n->maxmtu = n->minmtu;
-		n->mtu = n->minmtu;
-		ifdebug(TRAFFIC) logger(LOG_INFO, "Fixing MTU of %s (%s) to %d after %d probes", n->name, n->hostname, n->mtu, n->mtuprobes);
-		n->mtuprobes = 31;
-	}
+		if(n <= 0)
+			break;
 
-	if(n->mtuprobes == 31) {
-		timeout = pinginterval;
-		goto end;
-	} else if(n->mtuprobes == 32) {
-		timeout = pingtimeout;
+		done += n;
 	}
 
-	for(i = 0; i < 4 + localdiscovery; i++) {
-		if(i == 0) {
-			if(n->mtuprobes < 30 || n->maxmtu + 8 >= MTU)
-				continue;
-			len = n->maxmtu + 8;
-		} else if(n->maxmtu <= n->minmtu) {
-			len = n->maxmtu;
-		} else {
-			len = n->minmtu + 1 + rand() % (n->maxmtu - n->minmtu);
-		}
+	profile_end(PROFILE_DEVICE_WRITE, start);
 
-		if(len < 64)
-			len = 64;
-		
-		memset(packet.data, 0, 14);
-		RAND_pseudo_bytes(packet.data + 14, len - 14);
-		packet.len = len;
-		if(i >= 4 && n->mtuprobes <= 10)
-			packet.priority = -1;
-		else
-			packet.priority = 0;
+	for(int i = 0; i < device_queued; i++)
+		free_packet(device_queue[i]);
 
-		ifdebug(TRAFFIC) logger(LOG_INFO, "Sending MTU probe length %d to %s (%s)", len, n->name, n->hostname);
+	device_queued = 0;
+}
 
-		send_udppacket(n, &packet);
-	}
+static void queue_device_packet(const vpn_packet_t *packet) {
+	vpn_packet_t *copy = new_packet();
 
-end:
-	n->mtuevent = new_event();
-	n->mtuevent->handler = (event_handler_t)send_mtu_probe;
-	n->mtuevent->data = n;
-	n->mtuevent->time = now + timeout;
-	event_add(n->mtuevent);
+	copy->len = packet->len;
+	copy->priority = packet->priority;
+	memcpy(copy->data, packet->data, packet->len);
+
+	device_queue[device_queued++] = copy;
+
+	if(device_queued >= BATCH_MSG)
+		flush_device_queue();
 }
 
-void mtu_probe_h(node_t *n, vpn_packet_t *packet, length_t len) {
-	ifdebug(TRAFFIC) logger(LOG_INFO, "Got MTU probe length %d from %s (%s)", packet->len, n->name, n->hostname);
+/* Read up to n datagrams without blocking; returns 0 if there were none, -1 on errors */
 
-	if(!packet->data[0]) {
-		packet->data[0] = 1;
-		send_udppacket(n, packet);
-	} else {
-		if(n->mtuprobes > 30) {
-			if (len == n->maxmtu + 8) {
-				ifdebug(TRAFFIC) logger(LOG_INFO, "Increase in PMTU to %s (%s) detected, restarting PMTU discovery", n->name, n->hostname);
-				n->maxmtu = MTU;
-				n->mtuprobes = 10;
-				return;
-			}
+int recv_packets(int fd, vpn_packet_t **packets, int n) {
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msg[MAX_MSG];
+	struct iovec iov[MAX_MSG];
+	int num;
 
-			if(n->minmtu)
-				n->mtuprobes = 30;
-			else
-				n->mtuprobes = 1;
-		}
+	if(n > MAX_MSG)
+		n = MAX_MSG;
 
-		if(len > n->maxmtu)
-			len = n->maxmtu;
-		if(n->minmtu < len)
-			n->minmtu = len;
+	for(int i = 0; i < n; i++) {
+		iov[i] = (struct iovec){packets[i]->data, max_frame_size};
+		msg[i].msg_hdr = (struct msghdr){.msg_iov = &iov[i], .msg_iovlen = 1};
 	}
-}
 
-static length_t compress_packet(uint8_t *dest, const uint8_t *source, length_t len, int level) {
-	if(level == 0) {
-		memcpy(dest, source, len);
-		return len;
-	} else if(level == 10) {
-#ifdef HAVE_LZO
-		lzo_uint lzolen = MAXSIZE;
-		lzo1x_1_compress(source, len, dest, &lzolen, lzo_wrkmem);
-		return lzolen;
-#else
-		return -1;
-#endif
-	} else if(level < 10) {
-#ifdef HAVE_ZLIB
-		unsigned long destlen = MAXSIZE;
-		if(compress2(dest, &destlen, source, len, level) == Z_OK)
-			return destlen;
-		else
-#endif
-			return -1;
-	} else {
-#ifdef HAVE_LZO
-		lzo_uint lzolen = MAXSIZE;
-		lzo1x_999_compress(source, len, dest, &lzolen, lzo_wrkmem);
-		return lzolen;
+	num = recvmmsg(fd, msg, n, MSG_DONTWAIT, NULL);
+
+	if(num < 0)
+		return sockwouldblock(sockerrno) ? 0 : -1;
+
+	for(int i = 0; i < num; i++)
+		packets[i]->len = msg[i].msg_len;
+
+	return num;
 #else
-		return -1;
-#endif
-	}
-	
-	return -1;
-}
-
-static length_t uncompress_packet(uint8_t *dest, const uint8_t *source, length_t len, int level) {
-	if(level == 0) {
-		memcpy(dest, source, len);
-		return len;
-	} else if(level > 9) {
-#ifdef HAVE_LZO
-		lzo_uint lzolen = MAXSIZE;
-		if(lzo1x_decompress_safe(source, len, dest, &lzolen, NULL) == LZO_E_OK)
-			return lzolen;
-		else
-#endif
-			return -1;
-	}
-#ifdef HAVE_ZLIB
-	else {
-		unsigned long destlen = MAXSIZE;
-		if(uncompress(dest, &destlen, source, len) == Z_OK)
-			return destlen;
-		else
-			return -1;
-	}
-#endif
+	int len = recv(fd, (void *)packets[0]->data, max_frame_size, 0);
+
+	if(len < 0)
+		return sockwouldblock(sockerrno) ? 0 : -1;
+
+	packets[0]->len = len;
 
-	return -1;
+	return 1;
+#endif
 }
 
-/* VPN packet I/O */
+/* Send n datagrams to sa, or to the peer the socket is connected to; returns how many were sent, -1 on errors */
 
-static void receive_packet(node_t *n, vpn_packet_t *packet) {
-	ifdebug(TRAFFIC) logger(LOG_DEBUG, "Received packet of %d bytes from %s (%s)",
-			   packet->len, n->name, n->hostname);
+int send_packets(int fd, vpn_packet_t **packets, int n, const struct sockaddr *sa, socklen_t sl) {
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msg[MAX_MSG];
+	struct iovec iov[MAX_MSG];
 
-	route(n, packet);
+	if(n > MAX_MSG)
+		n = MAX_MSG;
+
+	for(int i = 0; i < n; i++) {
+		iov[i] = (struct iovec){packets[i]->data, packets[i]->len};
+		msg[i].msg_hdr = (struct msghdr){.msg_name = (void *)sa, .msg_namelen = sl, .msg_iov = &iov[i], .msg_iovlen = 1};
+	}
+
+	return sendmmsg(fd, msg, n, 0);
+#else
+	if(sendto(fd, (void *)packets[0]->data, packets[0]->len, 0, sa, sl) < 0)
+		return -1;
+
+	return 1;
+#endif
 }
 
-static bool try_mac(const node_t *n, const vpn_packet_t *inpkt) {
-	unsigned char hmac[EVP_MAX_MD_SIZE];
+void exit_packets(void) {
+	for(int i = 0; i < device_queued; i++)
+		free_packet(device_queue[i]);
 
-	if(!n->indigest || !n->inmaclength || !n->inkey || inpkt->len < sizeof inpkt->seqno + n->inmaclength)
-		return false;
+	device_queued = 0;
+
+	while(packet_pool_free)
+		free(packet_pool[--packet_pool_free]);
 
-	HMAC(n->indigest, n->inkey, n->inkeylength, (unsigned char *) &inpkt->seqno, inpkt->len - n->inmaclength, (unsigned char *)hmac, NULL);
+	free_compress_ctx(compress_ctx);
+	compress_ctx = NULL;
 
-	return !memcmp_constant_time(hmac, (char *) &inpkt->seqno + inpkt->len - n->inmaclength, n->inmaclength);
+	exit_crypto_pipeline();
 }
 
-static void receive_udppacket(node_t *n, vpn_packet_t *inpkt) {
-	vpn_packet_t pkt1, pkt2;
-	vpn_packet_t *pkt[] = { &pkt1, &pkt2, &pkt1, &pkt2 };
-	int nextpkt = 0;
-	vpn_packet_t *outpkt = pkt[0];
-	int outlen, outpad;
-	unsigned char hmac[EVP_MAX_MD_SIZE];
-	int i;
+/* mtuprobes == 1..29: initial discovery, send bursts of probes
+   mtuprobes ==    30: fix the MTU to the largest probe that was answered
+   mtuprobes ==    31: sleep pinginterval seconds
+   mtuprobes ==    32: send 1 burst, sleep pingtimeout second
+   mtuprobes ==    33: no response from other side, restart PMTU discovery process
 
-	if(!n->inkey) {
-		ifdebug(TRAFFIC) logger(LOG_DEBUG, "Got packet from %s (%s) but he hasn't got our key yet",
-					n->name, n->hostname);
-		return;
-	}
+   During discovery, each burst has up to MTU_BURST probes: the largest size
+   that already worked, which shows whether the burst got through at all,
+   the upper boundary found so far, the MTU found for his address before,
+   evenly spaced sizes in between and the sizes that just fit the most common
+   path MTUs. Once a probe of a burst is answered, the sizes in it that were
+   not are taken to be too large, so the interval shrinks at least fivefold
+   with each burst. Probes carry the number of their burst, so late replies
+   do not count against the next one. Bursts start MTU_INTERVAL_MIN apart,
+   which doubles when a reply comes in too late or a burst is not answered.
 
-	/* Check packet length */
+   After the initial discovery, a fourth packet is added to each batch with a
+   size larger than the currently known PMTU, to test if the PMTU has increased.
 
-	if(inpkt->len < sizeof(inpkt->seqno) + n->inmaclength) {
-		ifdebug(TRAFFIC) logger(LOG_DEBUG, "Got too short packet from %s (%s)",
-					n->name, n->hostname);
-		return;
-	}
+   In case local discovery is enabled, another packet is added to each batch,
+   which will be broadcast to the local network.
 
-	/* Check the message authentication code */
+*/
 
-	if(n->indigest && n->inmaclength) {
-		inpkt->len -= n->inmaclength;
-		HMAC(n->indigest, n->inkey, n->inkeylength,
-			 (unsigned char *) &inpkt->seqno, inpkt->len, (unsigned char *)hmac, NULL);
+#define MTU_INTERVAL_MIN 200
+#define MTU_INTERVAL_MAX 1000
 
-		if(memcmp_constant_time(hmac, (char *) &inpkt->seqno + inpkt->len, n->inmaclength)) {
-			ifdebug(TRAFFIC) logger(LOG_DEBUG, "Got unauthenticated packet from %s (%s)",
-					   n->name, n->hostname);
-			return;
-		}
-	}
+static const int common_path_mtus[] = {1500, 1492, 1480, 1460, 1400, 1280};
 
-	/* Decrypt the packet */
+/* The MTUs found for recently seen addresses, so reconnecting nodes can check those first */
 
-	if(n->incipher) {
-		outpkt = pkt[nextpkt++];
+#define MTU_CACHE_SIZE 64
+#define MTU_CACHE_TIME 3600
 
-		if(!EVP_DecryptInit_ex(&n->inctx, NULL, NULL, NULL, NULL)
-				|| !EVP_DecryptUpdate(&n->inctx, (unsigned char *) &outpkt->seqno, &outlen,
-					(unsigned char *) &inpkt->seqno, inpkt->len)
-				|| !EVP_DecryptFinal_ex(&n->inctx, (unsigned char *) &outpkt->seqno + outlen, &outpad)) {
-			ifdebug(TRAFFIC) logger(LOG_DEBUG, "Error decrypting packet from %s (%s): %s",
-						n->name, n->hostname, ERR_error_string(ERR_get_error(), NULL));
-			return;
-		}
-		
-		outpkt->len = outlen + outpad;
-		inpkt = outpkt;
-	}
+typedef struct mtu_cache_t {
+	sockaddr_t address;
+	length_t mtu;
+	time_t time;
+} mtu_cache_t;
 
-	/* Check the sequence number */
+static mtu_cache_t mtu_cache[MTU_CACHE_SIZE];
 
-	inpkt->len -= sizeof(inpkt->seqno);
-	inpkt->seqno = ntohl(inpkt->seqno);
+static void cache_mtu(const node_t *n) {
+	mtu_cache_t *slot = &mtu_cache[0];
 
-	if(replaywin) {
-		if(inpkt->seqno != n->received_seqno + 1) {
-			if(inpkt->seqno >= n->received_seqno + replaywin * 8) {
-				if(n->farfuture++ < replaywin >> 2) {
-					logger(LOG_WARNING, "Packet from %s (%s) is %d seqs in the future, dropped (%u)",
-						n->name, n->hostname, inpkt->seqno - n->received_seqno - 1, n->farfuture);
-					return;
-				}
-				logger(LOG_WARNING, "Lost %d packets from %s (%s)",
-					   	inpkt->seqno - n->received_seqno - 1, n->name, n->hostname);
-				memset(n->late, 0, replaywin);
-			} else if (inpkt->seqno <= n->received_seqno) {
-				if((n->received_seqno >= replaywin * 8 && inpkt->seqno <= n->received_seqno - replaywin * 8) || !(n->late[(inpkt->seqno / 8) % replaywin] & (1 << inpkt->seqno % 8))) {
-					logger(LOG_WARNING, "Got late or replayed packet from %s (%s), seqno %d, last received %d",
-					   	n->name, n->hostname, inpkt->seqno, n->received_seqno);
-					return;
-				}
-			} else {
-				for(i = n->received_seqno + 1; i < inpkt->seqno; i++)
-					n->late[(i / 8) % replaywin] |= 1 << i % 8;
-			}
+	if(n->address.sa.sa_family != AF_INET && n->address.sa.sa_family != AF_INET6)
+		return;
+
+	for(int i = 0; i < MTU_CACHE_SIZE; i++) {
+		if(!sockaddrcmp(&mtu_cache[i].address, &n->address)) {
+			slot = &mtu_cache[i];
+			break;
 		}
 
-		n->farfuture = 0;
-		n->late[(inpkt->seqno / 8) % replaywin] &= ~(1 << inpkt->seqno % 8);
+		if(mtu_cache[i].time < slot->time)
+			slot = &mtu_cache[i];
 	}
 
-	if(inpkt->seqno > n->received_seqno)
-		n->received_seqno = inpkt->seqno;
-			
-	if(n->received_seqno > MAX_SEQNO)
-		keyexpires = 0;
+	slot->address = n->address;
+	slot->mtu = n->mtu;
+	slot->time = now;
+}
 
-	/* Decompress the packet */
+static length_t cached_mtu(const node_t *n) {
+	if(n->address.sa.sa_family != AF_INET && n->address.sa.sa_family != AF_INET6)
+		return 0;
 
-	length_t origlen = inpkt->len;
+	for(int i = 0; i < MTU_CACHE_SIZE; i++)
+		if(!sockaddrcmp(&mtu_cache[i].address, &n->address))
+			return mtu_cache[i].time + MTU_CACHE_TIME > now ? mtu_cache[i].mtu : 0;
 
-	if(n->incompression) {
-		outpkt = pkt[nextpkt++];
+	return 0;
+}
 
-		if((outpkt->len = uncompress_packet(outpkt->data, inpkt->data, inpkt->len, n->incompression)) < 0) {
-			ifdebug(TRAFFIC) logger(LOG_ERR, "Error while uncompressing packet from %s (%s)",
-				  		 n->name, n->hostname);
-			return;
-		}
+static int udp_header_size(const sockaddr_t *sa) {
+	return (sa->sa.sa_family == AF_INET6 ? 40 : 20) + 8;
+}
 
-		inpkt = outpkt;
+static void send_probe(node_t *n, int len, int priority) {
+	vpn_packet_t packet;
 
-		origlen -= MTU/64 + 20;
-	}
+	if(len < 64)
+		len = 64;
 
-	inpkt->priority = 0;
+	memset(packet.data, 0, 14);
+	packet.data[1] = n->tunnel->mtuburst;
+	RAND_pseudo_bytes(packet.data + 14, len - 14);
+	packet.len = len;
+	packet.priority = priority;
 
-	if(!inpkt->data[12] && !inpkt->data[13])
-		mtu_probe_h(n, inpkt, origlen);
-	else
-		receive_packet(n, inpkt);
+	ifdebug(TRAFFIC) logger(LOG_INFO, "Sending MTU probe length %d to %s (%s)", len, n->name, n->hostname);
+
+	send_udppacket(n, &packet);
 }
 
-void receive_tcppacket(connection_t *c, const char *buffer, int len) {
-	vpn_packet_t outpkt;
+/* Send a probe of this size in the current burst, unless it is useless or already sent */
 
-	if(len > sizeof outpkt.data)
+static void add_probe(node_t *n, int len) {
+	node_tunnel_t *t = n->tunnel;
+	if(len <= n->minmtu || len > n->maxmtu || t->mtuprobed >= MTU_BURST)
 		return;
 
-	outpkt.len = len;
-	if(c->options & OPTION_TCPONLY)
-		outpkt.priority = 0;
-	else
-		outpkt.priority = -1;
-	memcpy(outpkt.data, buffer, len);
+	for(int i = 0; i < t->mtuprobed; i++)
+		if(t->mtuprobelen[i] == len)
+			return;
 
-	receive_packet(c->node, &outpkt);
+	t->mtuprobelen[t->mtuprobed++] = len;
+	send_probe(n, len, 0);
 }
 
-static void send_udppacket(node_t *n, vpn_packet_t *origpkt) {
-	vpn_packet_t pkt1, pkt2;
-	vpn_packet_t *pkt[] = { &pkt1, &pkt2, &pkt1, &pkt2 };
-	vpn_packet_t *inpkt = origpkt;
-	int nextpkt = 0;
-	vpn_packet_t *outpkt;
-	int origlen;
-	int outlen, outpad;
-	int origpriority;
+static void send_mtu_burst(node_t *n) {
+	node_tunnel_t *t = n->tunnel;
+	length_t cached = cached_mtu(n);
+	int slots;
 
-	if(!n->status.reachable) {
-		ifdebug(TRAFFIC) logger(LOG_INFO, "Trying to send UDP packet to unreachable node %s (%s)", n->name, n->hostname);
-		return;
-	}
+	t->mtuburst++;
+	t->mtureplied = false;
+	t->mtuprobed = 0;
 
-	/* Make sure we have a valid key */
+	/* A size that is known to work shows whether the burst got through at all */
 
-	if(!n->status.validkey) {
-		ifdebug(TRAFFIC) logger(LOG_INFO,
-				   "No valid key known yet for %s (%s), forwarding via TCP",
-				   n->name, n->hostname);
+	if(n->minmtu) {
+		t->mtuprobelen[t->mtuprobed++] = n->minmtu;
+		send_probe(n, n->minmtu, 0);
+	}
 
-		if(n->last_req_key + 10 <= now) {
-			send_req_key(n);
-			n->last_req_key = now;
-		}
+	/* The first probe also tells us how much encoding adds to his packets */
 
-		send_tcppacket(n->nexthop->connection, origpkt);
+	add_probe(n, n->maxmtu);
 
-		return;
+	if(cached) {
+		add_probe(n, cached);
+		add_probe(n, cached + 1);
 	}
 
-	if(n->options & OPTION_PMTU_DISCOVERY && inpkt->len > n->minmtu && (inpkt->data[12] | inpkt->data[13])) {
-		ifdebug(TRAFFIC) logger(LOG_INFO,
-				"Packet for %s (%s) larger than minimum MTU, forwarding via %s",
-				n->name, n->hostname, n != n->nexthop ? n->nexthop->name : "TCP");
+	/* Half of the rest is evenly spaced, so the interval always shrinks */
 
-		if(n != n->nexthop)
-			send_packet(n->nexthop, origpkt);
-		else
-			send_tcppacket(n->nexthop->connection, origpkt);
+	slots = (MTU_BURST - t->mtuprobed) / 2;
+
+	for(int i = 1; i <= slots; i++)
+		add_probe(n, n->minmtu + (n->maxmtu - n->minmtu) * i / (slots + 1));
+
+	for(int i = 0; i < sizeof common_path_mtus / sizeof *common_path_mtus; i++)
+		add_probe(n, common_path_mtus[i] - udp_header_size(&n->address) - t->mtuoverhead);
 
+	slots = MTU_BURST - t->mtuprobed;
+
+	for(int i = 1; i <= slots; i++)
+		add_probe(n, n->minmtu + (n->maxmtu - n->minmtu) * i / (slots + 1));
+
+	if(localdiscovery && t->mtuprobes <= 10)
+		send_probe(n, n->minmtu, -1);
+}
+
+static void slow_down_mtu_burst(node_t *n) {
+	node_tunnel_t *t = n->tunnel;
+	t->mtuinterval *= 2;
+
+	if(t->mtuinterval > MTU_INTERVAL_MAX)
+		t->mtuinterval = MTU_INTERVAL_MAX;
+}
+
+/* Sizes of an answered burst that were not answered themselves are too large */
+
+static void update_maxmtu(node_t *n) {
+	node_tunnel_t *t = n->tunnel;
+	if(!t->mtuprobed)
+		return;
+
+	if(!t->mtureplied) {
+		slow_down_mtu_burst(n);
 		return;
 	}
 
-	origlen = inpkt->len;
-	origpriority = inpkt->priority;
+	for(int i = 0; i < t->mtuprobed; i++)
+		if(t->mtuprobelen[i] > n->minmtu && t->mtuprobelen[i] <= n->maxmtu)
+			n->maxmtu = t->mtuprobelen[i] - 1;
+}
 
-	/* Compress the packet */
+static void reset_mtu_burst(node_t *n) {
+	node_tunnel_t *t = n->tunnel;
+	t->mtuinterval = MTU_INTERVAL_MIN;
+	t->mtuprobed = 0;
+	t->mtureplied = false;
+}
 
-	if(n->outcompression) {
-		outpkt = pkt[nextpkt++];
+void send_mtu_probe(node_t *n) {
+	node_tunnel_t *t = n->tunnel;
+	int i;
+	int timeout = 1000;
+	
+	t->mtuprobes++;
 
-		if((outpkt->len = compress_packet(outpkt->data, inpkt->data, inpkt->len, n->outcompression)) < 0) {
-			ifdebug(TRAFFIC) logger(LOG_ERR, "Error while compressing packet to %s (%s)",
-				   n->name, n->hostname);
-			return;
+	if(!n->status.reachable || !n->status.validkey) {
+		ifdebug(TRAFFIC) logger(LOG_INFO, "Trying to send MTU probe to unreachable or rekeying node %s (%s)", n->name, n->hostname);
+		t->mtuprobes = 0;
+		return;
+	}
+
+	if(t->mtuprobes > 32) {
+		if(!n->minmtu) {
+			t->mtuprobes = 31;
+			timeout = pinginterval * 1000;
+			goto end;
 		}
 
-		inpkt = outpkt;
+		ifdebug(TRAFFIC) logger(LOG_INFO, "%s (%s) did not respond to UDP ping, restarting PMTU discovery", n->name, n->hostname);
+		t->mtuprobes = 1;
+		n->minmtu = 0;
+		n->maxmtu = max_frame_size;
 	}
 
-	/* Add sequence number */
+	if(t->mtuprobes == 1)
+		reset_mtu_burst(n);
 
-	inpkt->seqno = htonl(++(n->sent_seqno));
-	inpkt->len += sizeof(inpkt->seqno);
+	if(t->mtuprobes < 30)
+		update_maxmtu(n);
+
+	if(t->mtuprobes >= 10 && t->mtuprobes < 32 && !n->minmtu) {
+		ifdebug(TRAFFIC) logger(LOG_INFO, "No response to MTU probes from %s (%s)", n->name, n->hostname);
+		t->mtuprobes = 31;
+	}
+
+	if(t->mtuprobes == 30 || (t->mtuprobes < 30 && n->minmtu >= n->maxmtu)) {
+		if(n->minmtu > n->maxmtu)
+			n->minmtu = n->maxmtu;
+		else
+			n->maxmtu = n->minmtu;
+		n->mtu = n->minmtu;
+		ifdebug(TRAFFIC) logger(LOG_INFO, "Fixing MTU of %s (%s) to %d after %d bursts of probes", n->name, n->hostname, n->mtu, t->mtuprobes);
+		cache_mtu(n);
+		t->mtuprobes = 31;
+	}
+
+	if(t->mtuprobes == 31) {
+		timeout = pinginterval * 1000;
+		goto end;
+	} else if(t->mtuprobes == 32) {
+		timeout = pingtimeout * 1000;
+	} else {
+		send_mtu_burst(n);
+		timeout = t->mtuinterval;
+		goto end;
+	}
+
+	for(i = 0; i < 4 + localdiscovery; i++) {
+		if(i == 0) {
+			if(n->maxmtu + 8 >= max_frame_size)
+				continue;
+			send_probe(n, n->maxmtu + 8, 0);
+		} else {
+			send_probe(n, n->maxmtu, 0);
+		}
+	}
+
+end:
+	event_add(&t->mtuevent, (event_handler_t)send_mtu_probe, n, timeout);
+}
+
+/*
+  Multipath
+
+  With Multipath, packets for a node are spread over all the UDP addresses we
+  know work for him, not just his address. Besides his address, up to
+  MAX_PATHS - 1 others are tried: those other nodes see him at according to
+  their edges, and those authenticated packets from him arrive from. Every
+  PATH_INTERVAL seconds a keepalive is sent to each of them, and the addresses
+  he replies from within PATH_TIMEOUT seconds are used. They are weighted by
+  the inverse of their round trip time, so a path that gets congested and
+  queues packets gets a smaller share. Packets of the same flow are always
+  sent to the same address, so they are not reordered.
+*/
+
+#define PATH_INTERVAL 5
+#define PATH_TIMEOUT 15
+
+/* Keepalives are MTU probes with these values in data[0] */
+#define PATH_PROBE 2
+#define PATH_REPLY 3
+
+/* And packets sent together with Aggregation and pieces of a fragmented frame these */
+#define PACKET_AGGREGATE 4
+#define PACKET_FRAGMENT 5
+
+bool multipath = false;
+
+static node_path_t *rx_path;		/* address the packet being received came from */
+static node_path_t *tx_path;	/* address to send the next packet to, NULL to let send_udppacket() decide */
+
+static bool path_alive(const node_path_t *p) {
+	return p->last_rx && p->last_rx + PATH_TIMEOUT > now;
+}
+
+/* Hash the addresses and ports of a packet, so all packets of a flow give the same result */
+
+static uint32_t flow_hash(const vpn_packet_t *packet) {
+	int start = 14;
+	int len;
+	int ports = 0;
+	uint32_t hash = 2166136261U;
+	uint16_t type = packet->data[12] << 8 | packet->data[13];
+
+	if(type == ETH_P_8021Q) {
+		start += 4;
+		type = packet->data[16] << 8 | packet->data[17];
+	}
+
+	/* The ports are only used if they directly follow the IP header */
+
+	if(type == ETH_P_IP && packet->len >= start + 20) {
+		if((packet->data[start + 9] == 6 || packet->data[start + 9] == 17) && !(packet->data[start + 6] & 0x3f) && !packet->data[start + 7])
+			ports = start + (packet->data[start] & 0xf) * 4;
+		start += 12;
+		len = 8;
+	} else if(type == ETH_P_IPV6 && packet->len >= start + 40) {
+		if(packet->data[start + 6] == 6 || packet->data[start + 6] == 17)
+			ports = start + 40;
+		start += 8;
+		len = 32;
+	} else {
+		start = 0;
+		len = 12;
+	}
+
+	for(int i = start; i < start + len; i++)
+		hash = (hash ^ packet->data[i]) * 16777619U;
+
+	if(ports && packet->len >= ports + 4)
+		for(int i = ports; i < ports + 4; i++)
+			hash = (hash ^ packet->data[i]) * 16777619U;
+
+	return hash ^ hash >> 16;
+}
+
+static node_path_t *choose_path(node_t *n, const vpn_packet_t *packet) {
+	node_tunnel_t *t = n->tunnel;
+	int point = flow_hash(packet) % t->pathweight;
+
+	for(int i = 0; i < MAX_PATHS; i++) {
+		point -= t->path[i].weight;
+
+		if(point < 0)
+			return i ? &t->path[i] : NULL;
+	}
+
+	return NULL;
+}
+
+static void send_path_probe(node_t *n, node_path_t *p) {
+	vpn_packet_t packet;
+	int len = n->minmtu > 64 ? n->minmtu : 64;
+
+	memset(packet.data, 0, 14);
+	packet.data[0] = PATH_PROBE;
+	RAND_pseudo_bytes(packet.data + 14, len - 14);
+	packet.len = len;
+	packet.priority = 0;
+
+	p->probe_sent = now_msec;
+	tx_path = p == &n->tunnel->path[0] ? NULL : p;
+	send_udppacket(n, &packet);
+	tx_path = NULL;
+}
+
+static void path_probe_h(node_t *n, vpn_packet_t *packet) {
+	if(!rx_path)
+		return;
+
+	if(packet->data[0] == PATH_PROBE) {
+		packet->data[0] = PATH_REPLY;
+		tx_path = rx_path == &n->tunnel->path[0] ? NULL : rx_path;
+		send_udppacket(n, packet);
+		tx_path = NULL;
+	} else if(rx_path->probe_sent) {
+		int rtt = now_msec - rx_path->probe_sent;
+
+		if(rtt < 1)
+			rtt = 1;
+
+		rx_path->rtt = rx_path->rtt ? rx_path->rtt + (rtt - rx_path->rtt) / 4 : rtt;
+		rx_path->probe_sent = 0;
+	}
+}
+
+/* Give each address that works a share of the flows, the faster it is the larger */
+
+static void update_path_weights(node_t *n) {
+	node_tunnel_t *t = n->tunnel;
+	int total = 0;
+	bool others = false;
+
+	for(int i = 0; i < MAX_PATHS; i++) {
+		node_path_t *p = &t->path[i];
+
+		if((i && !path_alive(p)) || !p->rtt) {
+			p->weight = 0;
+			continue;
+		}
+
+		p->weight = 10000 / p->rtt + 1;
+		total += p->weight;
+
+		if(i)
+			others = true;
+	}
+
+	t->pathweight = others && t->path[0].weight ? total : 0;
+}
+
+static void check_paths(node_t *n) {
+	node_tunnel_t *t = n->tunnel;
+	avl_node_t *node;
+	int used = 0;
+
+	if(!multipath || !n->status.reachable || n->address.sa.sa_family == AF_UNSPEC) {
+		for(int i = 1; i < MAX_PATHS; i++)
+			del_node_path(&t->path[i]);
+
+		t->pathweight = 0;
+		return;
+	}
+
+	/* Forget addresses that stopped working, or that never did */
+
+	for(int i = 1; i < MAX_PATHS; i++) {
+		node_path_t *p = &t->path[i];
+
+		if(p->address.sa.sa_family == AF_UNSPEC)
+			continue;
+
+		if(p->last_rx ? !path_alive(p) : p->added + PATH_TIMEOUT <= now)
+			del_node_path(p);
+		else
+			used++;
+	}
+
+	/* If his address stopped working but another one still does, switch to that one */
+
+	if(!path_alive(&t->path[0])) {
+		for(int i = 1; i < MAX_PATHS; i++) {
+			if(path_alive(&t->path[i])) {
+				sockaddr_t sa = t->path[i].address;
+				update_node_udp(n, &sa);
+				used--;
+				break;
+			}
+		}
+	}
+
+	/* Try the addresses other nodes see him at */
+
+	for(node = n->edge_tree->head; node && used < MAX_PATHS - 1; node = node->next) {
+		edge_t *e = node->data;
+
+		if(e->to != n || e->from == myself)
+			continue;
+
+		for(int sock = 0; sock < listen_sockets; sock++) {
+			if(e->address.sa.sa_family == listen_socket[sock].sa.sa.sa_family) {
+				if(add_node_path(n, &e->address, sock))
+					used++;
+				break;
+			}
+		}
+	}
+
+	if(used && n->status.validkey)
+		for(int i = 0; i < MAX_PATHS; i++)
+			if(!i || t->path[i].address.sa.sa_family != AF_UNSPEC)
+				send_path_probe(n, &t->path[i]);
+
+	update_path_weights(n);
+
+	event_add(&t->pathevent, (event_handler_t)check_paths, n, PATH_INTERVAL * 1000);
+}
+
+/* Packets from an address of his we did not know came from a new address, or from another one he has */
+
+static node_path_t *new_udp_address(node_t *n, listen_socket_t *ls, const sockaddr_t *from) {
+	node_path_t *p;
+
+	if(multipath && n->tunnel && path_alive(&n->tunnel->path[0]) && (p = add_node_path(n, from, ls - listen_socket)))
+		return p;
+
+	update_node_udp(n, from);
+	return n->tunnel ? &n->tunnel->path[0] : NULL;
+}
+
+void mtu_probe_h(node_t *n, vpn_packet_t *packet, length_t len) {
+	node_tunnel_t *t = n->tunnel;
+	ifdebug(TRAFFIC) logger(LOG_INFO, "Got MTU probe length %d from %s (%s)", packet->len, n->name, n->hostname);
+
+	if(packet->data[0] == PATH_PROBE || packet->data[0] == PATH_REPLY) {
+		path_probe_h(n, packet);
+	} else if(!packet->data[0]) {
+		packet->data[0] = 1;
+		send_udppacket(n, packet);
+	} else {
+		if(t->mtuprobes > 30) {
+			if (len == n->maxmtu + 8) {
+				ifdebug(TRAFFIC) logger(LOG_INFO, "Increase in PMTU to %s (%s) detected, restarting PMTU discovery", n->name, n->hostname);
+				n->maxmtu = max_frame_size;
+				t->mtuprobes = 10;
+				reset_mtu_burst(n);
+				return;
+			}
+
+			if(n->minmtu) {
+				t->mtuprobes = 30;
+			} else {
+				t->mtuprobes = 1;
+				reset_mtu_burst(n);
+			}
+		} else if(packet->data[1] == t->mtuburst) {
+			t->mtureplied = true;
+		} else {
+			slow_down_mtu_burst(n);
+		}
+
+		if(len > n->maxmtu)
+			len = n->maxmtu;
+		if(n->minmtu < len)
+			n->minmtu = len;
+	}
+}
+
+/*
+  Keep track of how well packets to a node compress. If he accepts uncompressed packets,
+  and compression has not been saving at least 5% recently, stop compressing for a while.
+  The first packet compressed after such a period decides whether to resume or to back off
+  for twice as long.
+*/
+static void update_compression(node_t *n, length_t origlen, length_t len) {
+	node_tunnel_t *t = n->tunnel;
+	int ratio = origlen ? len * 256 / origlen : 256;
+
+	compress_in_bytes += origlen;
+	compress_out_bytes += len;
+
+	if(t->compressbackoff) {
+		if(ratio < COMPRESS_WORTHWHILE) {
+			t->compressbackoff = 0;
+			t->compressratio = ratio;
+		} else {
+			if(t->compressbackoff < COMPRESS_BACKOFF_MAX)
+				t->compressbackoff *= 2;
+			t->compressskip = t->compressbackoff;
+		}
+
+		return;
+	}
+
+	t->compressratio += (ratio - t->compressratio) / 8;
+
+	if(n->status.sendraw && t->compressratio >= COMPRESS_WORTHWHILE) {
+		ifdebug(TRAFFIC) logger(LOG_DEBUG, "Packets to %s (%s) do not compress well, sending them uncompressed for a while",
+					n->name, n->hostname);
+		t->compressbackoff = COMPRESS_BACKOFF_MIN;
+		t->compressskip = COMPRESS_BACKOFF_MIN;
+	}
+}
+
+/* VPN packet I/O */
+
+static void receive_packet(node_t *n, vpn_packet_t *packet) {
+	ifdebug(TRAFFIC) logger(LOG_DEBUG, "Received packet of %d bytes from %s (%s)",
+			   packet->len, n->name, n->hostname);
+
+	n->stats.in_packets++;
+	n->stats.in_bytes += packet->len;
+
+	capture(CAPTURE_RECEIVED, n, packet->data, packet->len);
+	flow_sample(FLOW_IN, n, packet);
+
+	profile_begin(start);
+	route(n, packet);
+	profile_end(PROFILE_ROUTE, start);
+}
+
+/*
+  AEAD ciphers encrypt and authenticate a packet in a single pass.
+  The sequence number is sent in the clear and authenticated as additional data,
+  and the nonce is the IV part of the key with the sequence number mixed into
+  its last four bytes. Sequence numbers are never reused with the same key,
+  since the key is renewed long before they would wrap around.
+*/
+static void aead_nonce(const EVP_CIPHER *cipher, const char *key, uint32_t seqno, unsigned char *nonce) {
+	int ivlen = cipher->iv_len;
+
+	memcpy(nonce, key + cipher->key_len, ivlen);
+
+	for(int i = 0; i < sizeof seqno; i++)
+		nonce[ivlen - sizeof seqno + i] ^= ((unsigned char *)&seqno)[i];
+}
+
+/*
+  The cipher and HMAC that packets in one direction are encrypted and
+  authenticated with. They normally point into his node_tunnel_t, but the
+  CryptoPipeline gives them their own copies, so worker threads only ever
+  touch state that belongs to them.
+*/
+
+typedef struct packet_keys_t {
+	const EVP_CIPHER *cipher;
+	const char *key;
+	EVP_CIPHER_CTX *ctx;
+	const EVP_MD *digest;
+	int maclength;
+	HMAC_CTX *hmac;
+} packet_keys_t;
+
+static packet_keys_t in_keys(node_tunnel_t *t) {
+	return (packet_keys_t){t->incipher, t->inkey, &t->inctx, t->indigest, t->inmaclength, &t->inhmac};
+}
+
+static packet_keys_t out_keys(node_tunnel_t *t) {
+	return (packet_keys_t){t->outcipher, t->outkey, &t->outctx, t->outdigest, t->outmaclength, &t->outhmac};
+}
+
+static bool aead_encrypt(const packet_keys_t *k, const vpn_packet_t *inpkt, vpn_packet_t *outpkt) {
+	unsigned char nonce[EVP_MAX_IV_LENGTH];
+	int len = inpkt->len - sizeof inpkt->seqno;
+	int outlen, outpad, aadlen;
+
+	aead_nonce(k->cipher, k->key, inpkt->seqno, nonce);
+	outpkt->seqno = inpkt->seqno;
+
+	if(!EVP_EncryptInit_ex(k->ctx, NULL, NULL, NULL, nonce)
+			|| !EVP_EncryptUpdate(k->ctx, NULL, &aadlen, (unsigned char *) &outpkt->seqno, sizeof outpkt->seqno)
+			|| !EVP_EncryptUpdate(k->ctx, outpkt->data, &outlen, inpkt->data, len)
+			|| !EVP_EncryptFinal_ex(k->ctx, outpkt->data + outlen, &outpad)
+			|| !EVP_CIPHER_CTX_ctrl(k->ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_SIZE, outpkt->data + outlen + outpad))
+		return false;
+
+	outpkt->len = sizeof outpkt->seqno + outlen + outpad + AEAD_TAG_SIZE;
+	return true;
+}
+
+/* Decrypt and authenticate a packet, the plaintext may overwrite the ciphertext */
+
+static bool aead_decrypt(const packet_keys_t *k, const vpn_packet_t *inpkt, uint8_t *out, length_t *outlen) {
+	unsigned char nonce[EVP_MAX_IV_LENGTH];
+	unsigned char tag[AEAD_TAG_SIZE];
+	int len, declen, decpad, aadlen;
+
+	if(inpkt->len < sizeof inpkt->seqno + AEAD_TAG_SIZE)
+		return false;
+
+	len = inpkt->len - sizeof inpkt->seqno - AEAD_TAG_SIZE;
+	memcpy(tag, inpkt->data + len, AEAD_TAG_SIZE);
+	aead_nonce(k->cipher, k->key, inpkt->seqno, nonce);
+
+	if(!EVP_DecryptInit_ex(k->ctx, NULL, NULL, NULL, nonce)
+			|| !EVP_CIPHER_CTX_ctrl(k->ctx, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_SIZE, tag)
+			|| !EVP_DecryptUpdate(k->ctx, NULL, &aadlen, (unsigned char *) &inpkt->seqno, sizeof inpkt->seqno)
+			|| !EVP_DecryptUpdate(k->ctx, out, &declen, inpkt->data, len)
+			|| !EVP_DecryptFinal_ex(k->ctx, out + declen, &decpad))
+		return false;
+
+	*outlen = declen + decpad;
+	return true;
+}
+
+/*
+  Calculate the MAC of a packet with a HMAC context that has already been keyed.
+  Reinitialising it without a key just restores the precomputed inner digest state,
+  so the key schedule is not derived again for every packet.
+*/
+static bool packet_hmac(HMAC_CTX *ctx, const void *data, length_t len, unsigned char *hmac) {
+	unsigned int hmaclen;
+
+	return HMAC_Init_ex(ctx, NULL, 0, NULL, NULL)
+		&& HMAC_Update(ctx, data, len)
+		&& HMAC_Final(ctx, hmac, &hmaclen);
+}
+
+/*
+  Encrypt a packet that already has its seqno and add its MAC. Returns the
+  packet holding the result, which is outpkt unless there was nothing to
+  copy it there for, or NULL on error.
+*/
+static vpn_packet_t *seal_packet(const packet_keys_t *k, vpn_packet_t *inpkt, vpn_packet_t *outpkt) {
+	int outlen, outpad;
+
+	if(CIPHER_IS_AEAD(k->cipher)) {
+		profile_begin(start);
+
+		if(!aead_encrypt(k, inpkt, outpkt))
+			return NULL;
+
+		profile_end(PROFILE_ENCRYPT, start);
+		inpkt = outpkt;
+	} else if(k->cipher) {
+		profile_begin(start);
+
+		if(!EVP_EncryptInit_ex(k->ctx, NULL, NULL, NULL, NULL)
+				|| !EVP_EncryptUpdate(k->ctx, (unsigned char *) &outpkt->seqno, &outlen,
+					(unsigned char *) &inpkt->seqno, inpkt->len)
+				|| !EVP_EncryptFinal_ex(k->ctx, (unsigned char *) &outpkt->seqno + outlen, &outpad))
+			return NULL;
+
+		profile_end(PROFILE_ENCRYPT, start);
+		outpkt->len = outlen + outpad;
+		inpkt = outpkt;
+	}
+#ifdef HAVE_SENDMMSG
+	else if(inpkt != outpkt) {
+		/* The queue outlives the original packet, so it needs its own copy */
+
+		memcpy(&outpkt->seqno, &inpkt->seqno, inpkt->len);
+		outpkt->len = inpkt->len;
+		inpkt = outpkt;
+	}
+#endif
+
+	if(k->digest && k->maclength) {
+		profile_begin(start);
+
+		if(!packet_hmac(k->hmac, &inpkt->seqno, inpkt->len, (unsigned char *) &inpkt->seqno + inpkt->len))
+			return NULL;
+
+		profile_end(PROFILE_MAC, start);
+		inpkt->len += k->maclength;
+	}
+
+	return inpkt;
+}
+
+/* Why open_packet() rejected a packet */
+
+typedef enum open_status_t {
+	OPEN_OK,
+	OPEN_SHORT,				/* too short to hold a seqno and MAC */
+	OPEN_UNAUTHENTICATED,			/* wrong MAC or AEAD tag */
+	OPEN_UNDECRYPTABLE,			/* bad padding */
+} open_status_t;
+
+/*
+  Incoming packets are authenticated and decrypted in place. The seqno field
+  directly precedes the data, and the data field has enough tailroom for the
+  padding and HMAC. Afterwards the packet holds the plaintext seqno and data,
+  if it was rejected its length is left alone.
+*/
+static open_status_t open_packet(const packet_keys_t *k, vpn_packet_t *inpkt) {
+	unsigned char hmac[EVP_MAX_MD_SIZE];
+	length_t len = inpkt->len;
+	int outlen, outpad;
+
+	if(len < sizeof(inpkt->seqno) + k->maclength)
+		return OPEN_SHORT;
+
+	if(k->digest && k->maclength) {
+		profile_begin(start);
+		len -= k->maclength;
+
+		if(!packet_hmac(k->hmac, &inpkt->seqno, len, hmac)
+				|| memcmp_constant_time(hmac, (char *) &inpkt->seqno + len, k->maclength))
+			return OPEN_UNAUTHENTICATED;
+
+		profile_end(PROFILE_VERIFY, start);
+	}
+
+	if(CIPHER_IS_AEAD(k->cipher)) {
+		length_t declen;
+		profile_begin(start);
+
+		if(!aead_decrypt(k, inpkt, inpkt->data, &declen))
+			return OPEN_UNAUTHENTICATED;
+
+		profile_end(PROFILE_DECRYPT, start);
+		len = sizeof inpkt->seqno + declen;
+	} else if(k->cipher) {
+		profile_begin(start);
+
+		if(!EVP_DecryptInit_ex(k->ctx, NULL, NULL, NULL, NULL)
+				|| !EVP_DecryptUpdate(k->ctx, (unsigned char *) &inpkt->seqno, &outlen,
+					(unsigned char *) &inpkt->seqno, len)
+				|| !EVP_DecryptFinal_ex(k->ctx, (unsigned char *) &inpkt->seqno + outlen, &outpad))
+			return OPEN_UNDECRYPTABLE;
+
+		profile_end(PROFILE_DECRYPT, start);
+		len = outlen + outpad;
+	}
+
+	inpkt->len = len;
+	return OPEN_OK;
+}
+
+static bool try_mac(node_t *n, const vpn_packet_t *inpkt) {
+	node_tunnel_t *t = n->tunnel;
+	unsigned char hmac[EVP_MAX_MD_SIZE];
+
+	if(!t)
+		return false;
+
+	if(!t->indigest && CIPHER_IS_AEAD(t->incipher)) {
+		static uint8_t scratch[MAXSIZE];
+		length_t len;
+		packet_keys_t k = in_keys(t);
+
+		return t->inkey && aead_decrypt(&k, inpkt, scratch, &len);
+	}
+
+	if(!t->indigest || !t->inmaclength || !t->inkey || inpkt->len < sizeof inpkt->seqno + t->inmaclength)
+		return false;
+
+	if(!packet_hmac(&t->inhmac, &inpkt->seqno, inpkt->len - t->inmaclength, hmac))
+		return false;
+
+	return !memcmp_constant_time(hmac, (char *) &inpkt->seqno + inpkt->len - t->inmaclength, t->inmaclength);
+}
+
+/*
+  Check a seqno against the replay window, and mark it as received.
+
+  The window is a ring of replaywin / 8 + 1 64 bit words, with one bit for
+  every seqno that has been received, indexed by seqno modulo the ring size.
+  When received_seqno moves forward only the words it passes are cleared,
+  so each packet costs O(1) amortized however large the window is.
+  A seqno is late once it is replaywin * 8 or more behind received_seqno,
+  like it always was. The extra word keeps the word holding the oldest seqno
+  in the window from being reused by the one holding received_seqno.
+*/
+static bool replay_check(node_t *n, uint32_t seqno) {
+	node_tunnel_t *t = n->tunnel;
+	uint32_t words = replaywin / 8 + 1;
+	uint32_t word = seqno / 64;
+	uint32_t top = t->received_seqno / 64;
+	uint64_t bit = (uint64_t)1 << (seqno % 64);
+
+	if(seqno > t->received_seqno) {
+		if(seqno - t->received_seqno >= replaywin * 8) {
+			if(t->farfuture++ < replaywin >> 2) {
+				replay_farfuture++;
+				logger(LOG_WARNING, "Packet from %s (%s) is %d seqs in the future, dropped (%u)",
+					n->name, n->hostname, seqno - t->received_seqno - 1, t->farfuture);
+				return false;
+			}
+
+			logger(LOG_WARNING, "Lost %d packets from %s (%s)",
+					seqno - t->received_seqno - 1, n->name, n->hostname);
+		}
+
+		/* Clear the words that now start a new part of the window */
+
+		if(word - top >= words)
+			memset(t->replay, 0, REPLAY_SIZE);
+		else
+			for(uint32_t i = top + 1; i <= word; i++)
+				t->replay[i % words] = 0;
+	} else if(t->received_seqno - seqno >= replaywin * 8) {
+		replay_late++;
+		logger(LOG_WARNING, "Got late packet from %s (%s), seqno %d, last received %d",
+				n->name, n->hostname, seqno, t->received_seqno);
+		return false;
+	} else if(t->replay[word % words] & bit) {
+		replay_replayed++;
+		logger(LOG_WARNING, "Got replayed packet from %s (%s), seqno %d, last received %d",
+				n->name, n->hostname, seqno, t->received_seqno);
+		return false;
+	}
+
+	t->farfuture = 0;
+	t->replay[word % words] |= bit;
+
+	return true;
+}
+
+/* Account for a packet from him that open_packet() rejected */
+
+static void drop_unopened(node_t *n, vpn_packet_t *inpkt, open_status_t status) {
+	switch(status) {
+		case OPEN_SHORT:
+			ifdebug(TRAFFIC) logger(LOG_DEBUG, "Got too short packet from %s (%s)",
+						n->name, n->hostname);
+			capture(CAPTURE_DROP_INVALID, n, &inpkt->seqno, inpkt->len);
+			break;
+
+		case OPEN_UNAUTHENTICATED:
+			ifdebug(TRAFFIC) logger(LOG_DEBUG, "Got unauthenticated packet from %s (%s)",
+					   n->name, n->hostname);
+			n->stats.mac_drops++;
+			capture(CAPTURE_DROP_MAC, n, &inpkt->seqno, inpkt->len);
+			break;
+
+		default:
+			ifdebug(TRAFFIC) logger(LOG_DEBUG, "Error decrypting packet from %s (%s)",
+						n->name, n->hostname);
+			capture(CAPTURE_DROP_INVALID, n, &inpkt->seqno, inpkt->len);
+			break;
+	}
+}
+
+/*
+  The rest of receiving a packet once open_packet() accepted it: the replay
+  check, decompression and handing it on. This has to see his packets in
+  the order they were opened in, so the replay window and the adaptive
+  compression state stay consistent.
+*/
+static void receive_opened(node_t *n, vpn_packet_t *inpkt) {
+	node_tunnel_t *t = n->tunnel;
+	static vpn_packet_t outpkt;
+
+	/* Check the sequence number */
+
+	inpkt->len -= sizeof(inpkt->seqno);
+	inpkt->seqno = ntohl(inpkt->seqno);
+
+	bool compressed = t->incompression;
+
+	if(compressed && inpkt->seqno & SEQNO_UNCOMPRESSED) {
+		inpkt->seqno &= ~SEQNO_UNCOMPRESSED;
+		compressed = false;
+	}
+
+	if(replaywin && !replay_check(n, inpkt->seqno)) {
+		n->stats.replay_drops++;
+		capture(CAPTURE_DROP_REPLAY, n, inpkt->data, inpkt->len);
+		return;
+	}
+
+	if(inpkt->seqno > t->received_seqno)
+		t->received_seqno = inpkt->seqno;
+
+	if(rx_path)
+		rx_path->last_rx = now;
+			
+	if(t->received_seqno > MAX_SEQNO)
+		schedule_rekey(n, 0);
+
+	/* Decompress the packet */
+
+	length_t origlen = inpkt->len;
+
+	if(compressed) {
+		profile_begin(start);
+		outpkt.len = uncompress_packet(outpkt.data, inpkt->data, inpkt->len, t->incompression);
+		profile_end(PROFILE_UNCOMPRESS, start);
+
+		if(outpkt.len < 0) {
+			ifdebug(TRAFFIC) logger(LOG_ERR, "Error while uncompressing packet from %s (%s)",
+				  		 n->name, n->hostname);
+			capture(CAPTURE_DROP_INVALID, n, inpkt->data, inpkt->len);
+			return;
+		}
+
+		inpkt = &outpkt;
+
+		origlen -= MTU/64 + 20;
+	}
+
+	if(!inpkt->data[12] && !inpkt->data[13] && inpkt->data[0] == PACKET_AGGREGATE) {
+		t->last_used = now;
+		receive_aggregate(n, inpkt);
+		return;
+	}
+
+	if(!inpkt->data[12] && !inpkt->data[13] && inpkt->data[0] == PACKET_FRAGMENT) {
+		t->last_used = now;
+		receive_fragment(n, inpkt);
+		return;
+	}
+
+	inpkt->priority = 0;
+
+	if(!inpkt->data[12] && !inpkt->data[13]) {
+		mtu_probe_h(n, inpkt, origlen);
+	} else {
+		t->last_used = now;
+		receive_packet(n, inpkt);
+	}
+}
+
+static void receive_udppacket_key(node_t *n, vpn_packet_t *inpkt) {
+	node_tunnel_t *t = n->tunnel;
+
+	if(!t->inkey) {
+		ifdebug(TRAFFIC) logger(LOG_DEBUG, "Got packet from %s (%s) but he hasn't got our key yet",
+					n->name, n->hostname);
+		capture(CAPTURE_DROP_NOKEY, n, &inpkt->seqno, inpkt->len);
+		return;
+	}
+
+	packet_keys_t k = in_keys(t);
+	open_status_t status = open_packet(&k, inpkt);
+
+	if(status != OPEN_OK) {
+		drop_unopened(n, inpkt, status);
+		return;
+	}
+
+	receive_opened(n, inpkt);
+}
+
+/*
+  After we sent him a new key, packets he sent with the previous one may still
+  arrive for a while. Those that do not authenticate with the new key are
+  tried with the old one. Once packets with the new key come in, anything
+  older that is still underway will arrive within KEY_SETTLE seconds.
+*/
+
+#define KEY_SETTLE 2
+
+static void receive_udppacket(node_t *n, vpn_packet_t *inpkt) {
+	node_tunnel_t *t = n->tunnel;
+
+	/* If we forgot his key while he was idle, he gets a new one */
+
+	if(!t) {
+		ifdebug(TRAFFIC) logger(LOG_DEBUG, "Got packet from %s (%s) with a key we no longer have",
+					n->name, n->hostname);
+		capture(CAPTURE_DROP_NOKEY, n, &inpkt->seqno, inpkt->len);
+
+		if(n->status.reachable && n->nexthop && n->nexthop->connection)
+			send_ans_key(n);
+
+		return;
+	}
+
+	/* Packets larger than a batch has room for, sent by a node with a larger MaxFrameSize, are opened right here */
+
+	if(crypto_pipeline && t->inkey && (t->incipher || (t->indigest && t->inmaclength)) && inpkt->len <= max_packet_size) {
+		pipeline_receive(n, inpkt);
+		return;
+	}
+
+	if(t->oldkey.expires) {
+		if(t->oldkey.expires <= now) {
+			t->oldkey.expires = 0;
+		} else if(try_mac(n, inpkt)) {
+			if(t->oldkey.expires > now + KEY_SETTLE)
+				t->oldkey.expires = now + KEY_SETTLE;
+		} else {
+			swap_inkey(n);
+
+			if(try_mac(n, inpkt)) {
+				receive_udppacket_key(n, inpkt);
+				swap_inkey(n);
+				return;
+			}
+
+			swap_inkey(n);
+		}
+	}
+
+	receive_udppacket_key(n, inpkt);
+}
+
+/*
+  Per-node rate limits. IngressRate and EgressRate are token buckets in bytes,
+  checked before any crypto work is done for a packet. The bucket holds a tenth
+  of a second worth of traffic, but always a few full frames, so a slow limit
+  does not starve large packets.
+*/
+
+int ingress_rate = 0;
+int egress_rate = 0;
+
+void set_rate_limit(bucket_t *bucket, int rate) {
+	bucket->rate = rate > 0 ? rate * 125ULL : 0;
+	bucket->burst = bucket->rate / 10;
+	if(bucket->burst < 4 * max_packet_size)
+		bucket->burst = 4 * max_packet_size;
+	if(bucket->tokens > bucket->burst * 1000)
+		bucket->tokens = bucket->burst * 1000;
+}
+
+static bool rate_limited(node_t *n, bucket_t *bucket, length_t len) {
+	if(bucket_take(bucket, now_msec, len))
+		return false;
+
+	ifdebug(TRAFFIC) logger(LOG_INFO, "Dropping packet of %d bytes %s %s (%s), rate limit exceeded",
+			len, bucket == &n->inbucket ? "from" : "to", n->name, n->hostname);
+
+	n->stats.rate_drops++;
+	return true;
+}
+
+void receive_tcppacket(connection_t *c, const char *buffer, int len) {
+	vpn_packet_t *outpkt;
+
+	if(len > max_packet_size)
+		return;
+
+	if(rate_limited(c->node, &c->node->inbucket, len))
+		return;
+
+	outpkt = new_packet();
+	outpkt->len = len;
+	if(c->options & OPTION_TCPONLY)
+		outpkt->priority = 0;
+	else
+		outpkt->priority = -1;
+	memcpy(outpkt->data, buffer, len);
+
+	receive_packet(c->node, outpkt);
+	free_packet(outpkt);
+}
+
+static void udp_send_error(node_t *n, const sockaddr_t *sa, int origlen, int len, int err) {
+	if(sockmsgsize(err)) {
+		int maxlen = origlen - 1;
+
+		/* If an ICMP message told the kernel the path MTU, there is no need to search for it */
+
+		if(origlen <= n->maxmtu) {
+			int pmtu = get_path_mtu(sa);
+
+			if(pmtu > 0 && origlen - (len + udp_header_size(sa) - pmtu) < maxlen)
+				maxlen = origlen - (len + udp_header_size(sa) - pmtu);
+		}
+
+		if(maxlen < 0)
+			maxlen = 0;
+
+		if(n->maxmtu > maxlen)
+			n->maxmtu = maxlen;
+		if(n->mtu > maxlen)
+			n->mtu = maxlen;
+	} else
+		ifdebug(TRAFFIC) logger(LOG_WARNING, "Error sending packet to %s (%s): %s", n->name, n->hostname, sockstrerror(err));
+}
+
+/* Change the TOS or traffic class that a UDP socket sends packets with */
+
+static void set_udp_priority(int sock, int priority) {
+	if(priority == listen_socket[sock].priority)
+		return;
+
+	listen_socket[sock].priority = priority;
+
+	switch(listen_socket[sock].sa.sa.sa_family) {
+#if defined(SOL_IP) && defined(IP_TOS)
+	case AF_INET:
+		ifdebug(TRAFFIC) logger(LOG_DEBUG, "Setting IPv4 outgoing packet priority to %d", priority);
+		if(setsockopt(listen_socket[sock].udp, SOL_IP, IP_TOS, &priority, sizeof(priority))) /* SO_PRIORITY doesn't seem to work */
+			logger(LOG_ERR, "System call `%s' failed: %s", "setsockopt", strerror(errno));
+		break;
+#endif
+#if defined(IPPROTO_IPV6) && defined(IPV6_TCLASS)
+	case AF_INET6:
+		ifdebug(TRAFFIC) logger(LOG_DEBUG, "Setting IPv6 outgoing packet priority to %d", priority);
+		if(setsockopt(listen_socket[sock].udp, IPPROTO_IPV6, IPV6_TCLASS, &priority, sizeof(priority)))
+			logger(LOG_ERR, "System call `%s' failed: %s", "setsockopt", strerror(errno));
+		break;
+#endif
+	default:
+		break;
+	}
+}
+
+#ifdef HAVE_SENDMMSG
+/* Attach the packet's priority as ancillary data, returns false if this is not possible for this socket */
+
+static bool set_priority_cmsg(struct msghdr *hdr, char *buf, int sock, int priority) {
+	struct cmsghdr *cmsg = (struct cmsghdr *)buf;
+
+	switch(listen_socket[sock].sa.sa.sa_family) {
+#if defined(SOL_IP) && defined(IP_TOS)
+	case AF_INET:
+		cmsg->cmsg_level = SOL_IP;
+		cmsg->cmsg_type = IP_TOS;
+		break;
+#endif
+#if defined(IPPROTO_IPV6) && defined(IPV6_TCLASS)
+	case AF_INET6:
+		cmsg->cmsg_level = IPPROTO_IPV6;
+		cmsg->cmsg_type = IPV6_TCLASS;
+		break;
+#endif
+	default:
+		return false;
+	}
+
+	cmsg->cmsg_len = CMSG_LEN(sizeof priority);
+	memcpy(CMSG_DATA(cmsg), &priority, sizeof priority);
+	hdr->msg_control = buf;
+	hdr->msg_controllen = CMSG_SPACE(sizeof priority);
+
+	return true;
+}
+
+/*
+  Send a batch of packets with sendmmsg(). That only sends on one socket, so
+  each run of packets for the same socket is sent separately. Returns the
+  number of packets from the start of the batch that have been dealt with,
+  which is less than count if a socket buffer filled up.
+*/
+
+static int send_udp_batch(udp_queue_t **batch, int count) {
+	static struct mmsghdr msg[MAX_MSG];
+	static struct iovec iov[MAX_MSG];
+	static char control[MAX_MSG][CMSG_SPACE(sizeof(int))];
+	bool cmsg = priorityinheritance && tos_cmsg;
+	int start, end, i, result;
+
+	for(i = 0; i < count; i++) {
+		iov[i].iov_base = batch[i]->start;
+		iov[i].iov_len = batch[i]->pkt.len;
+		msg[i].msg_hdr.msg_name = &batch[i]->sa.sa;
+		msg[i].msg_hdr.msg_namelen = batch[i]->sl;
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+		msg[i].msg_hdr.msg_control = NULL;
+		msg[i].msg_hdr.msg_controllen = 0;
+		msg[i].msg_hdr.msg_flags = 0;
+
+		if(cmsg)
+			set_priority_cmsg(&msg[i].msg_hdr, control[i], batch[i]->sock, batch[i]->priority);
+	}
+
+	for(start = 0; start < count; start = end) {
+		int sock = batch[start]->sock;
+
+		/* Without ancillary data, the socket's priority has to be changed between runs */
+
+		for(end = start + 1; end < count && batch[end]->sock == sock; end++)
+			if(priorityinheritance && !cmsg && batch[end]->priority != batch[start]->priority)
+				break;
+
+		if(priorityinheritance && !cmsg)
+			set_udp_priority(sock, batch[start]->priority);
+
+		for(i = start; i < end;) {
+			udp_tx_calls++;
+
+			profile_begin(start);
+			result = sendmmsg(listen_socket[sock].udp, msg + i, end - i, 0);
+			profile_end(PROFILE_SEND, start);
+
+			if(result >= 0) {
+				udp_tx_packets += result;
+				i += result;
+				continue;
+			}
+
+			if(sockwouldblock(sockerrno)) {
+				listen_socket[sock].buf.tx_full++;
+				return i;
+			}
+
+			if(socknobufs(sockerrno))
+				listen_socket[sock].buf.tx_full++;
+
+			/* Old kernels do not know IP_TOS as ancillary data, fall back to setsockopt() */
+
+			if(cmsg && sockerrno == EINVAL && msg[i].msg_hdr.msg_control) {
+				logger(LOG_WARNING, "Sending the priority along with UDP packets does not work, using setsockopt()");
+				tos_cmsg = false;
+				return i + send_udp_batch(batch + i, count - i);
+			}
+
+			/* Skip the packet that caused the error */
+
+			udp_send_error(batch[i]->node, &batch[i]->sa, batch[i]->origlen, batch[i]->pkt.len, sockerrno);
+			i++;
+		}
+	}
+
+	return count;
+}
+
+/*
+  With FairQueueing, packets are not sent in the order send_udppacket() got
+  them. Every node has a queue per priority band. flush_udp_queue() always
+  serves the highest band that has packets queued, and serves the nodes in
+  a band with deficit round robin, so each gets an equal share of the bytes.
+  If a socket buffer fills up, the rest stays queued until the socket is
+  writable again, so a bulk transfer cannot delay interactive traffic, and
+  one busy node cannot starve the others. Each queue is bounded, packets
+  that do not fit are dropped.
+*/
+
+#define TXQ_MAX 128				/* packets per band per node */
+#define TXQ_QUANTUM max_frame_size		/* bytes per node per round */
+
+static node_t *txq_active[TXQ_BANDS];		/* round robin list of nodes with packets in each band */
+static node_t *txq_active_tail[TXQ_BANDS];
+static udp_queue_t *txq_free;			/* entries for reuse */
+
+/* Band 0 is for DSCP class 4 and up and the old "low delay" TOS, band 2 for CS1 and the old "high throughput" TOS */
+
+static int priority_band(int priority) {
+	int dscp = priority >> 2;
+
+	if(dscp >= 32 || priority == 0x10)
+		return 0;
+
+	if(dscp == 8 || priority == 0x08)
+		return 2;
+
+	return 1;
+}
+
+static udp_queue_t *txq_alloc(void) {
+	udp_queue_t *entry = txq_free;
+
+	if(entry)
+		txq_free = entry->next;
+	else
+		entry = xmalloc(offsetof(udp_queue_t, pkt) + PACKET_ALLOC_SIZE);
+
+	return entry;
+}
+
+static void txq_release(udp_queue_t *entry) {
+	entry->next = txq_free;
+	txq_free = entry;
+}
+
+static void txq_activate(node_t *n, int band) {
+	node_txq_t *q = &n->tunnel->txq[band];
+
+	q->active = true;
+	q->deficit = 0;
+	q->next = NULL;
+
+	if(txq_active_tail[band])
+		txq_active_tail[band]->tunnel->txq[band].next = n;
+	else
+		txq_active[band] = n;
+
+	txq_active_tail[band] = n;
+}
+
+static void txq_enqueue(udp_queue_t *entry) {
+	int band = priority_band(entry->priority);
+	node_txq_t *q = &entry->node->tunnel->txq[band];
+
+	if(q->len >= TXQ_MAX) {
+		entry->node->stats.queue_drops++;
+		txq_release(entry);
+		return;
+	}
+
+	entry->next = NULL;
+
+	if(q->tail)
+		q->tail->next = entry;
+	else
+		q->head = entry;
+
+	q->tail = entry;
+	q->len++;
+
+	if(!q->active)
+		txq_activate(entry->node, band);
+}
+
+/* Put a packet that could not be sent back at the head of its queue */
+
+static void txq_requeue(udp_queue_t *entry) {
+	int band = priority_band(entry->priority);
+	node_txq_t *q = &entry->node->tunnel->txq[band];
+
+	entry->next = q->head;
+	q->head = entry;
+	if(!q->tail)
+		q->tail = entry;
+	q->len++;
+
+	if(!q->active)
+		txq_activate(entry->node, band);
+
+	q->deficit += entry->pkt.len;
+}
+
+static udp_queue_t *txq_dequeue(void) {
+	for(int band = 0; band < TXQ_BANDS; band++) {
+		while(txq_active[band]) {
+			node_t *n = txq_active[band];
+			node_txq_t *q = &n->tunnel->txq[band];
+			udp_queue_t *entry = q->head;
+
+			/* If he used up his share, he gets a new quantum and goes to the back of the list */
+
+			if(q->deficit < entry->pkt.len) {
+				q->deficit += TXQ_QUANTUM;
+
+				if(q->next) {
+					txq_active[band] = q->next;
+					q->next = NULL;
+					txq_active_tail[band]->tunnel->txq[band].next = n;
+					txq_active_tail[band] = n;
+				}
+
+				continue;
+			}
+
+			q->deficit -= entry->pkt.len;
+			q->head = entry->next;
+			q->len--;
+
+			if(!q->head) {
+				q->tail = NULL;
+				q->active = false;
+				txq_active[band] = q->next;
+				if(!txq_active[band])
+					txq_active_tail[band] = NULL;
+			}
+
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+static void flush_txq(void) {
+	udp_queue_t *batch[MAX_MSG];
+	udp_queue_t *entry;
+	int count, sent, i;
+
+	for(;;) {
+		for(count = 0; count < MAX_MSG && (entry = txq_dequeue()); count++)
+			batch[count] = entry;
+
+		if(!count)
+			return;
+
+		sent = send_udp_batch(batch, count);
+
+		for(i = 0; i < sent; i++)
+			txq_release(batch[i]);
+
+		if(sent < count) {
+			/* Wait until the socket that is full becomes writable again */
+
+			io_set(&listen_socket[batch[sent]->sock].udp_io, IO_READ | IO_WRITE);
+
+			for(i = count - 1; i >= sent; i--)
+				txq_requeue(batch[i]);
+
+			return;
+		}
+	}
+}
+
+/* Throw away the packets still queued for a node that is about to be freed */
+
+void clear_node_txq(node_t *n) {
+	for(int band = 0; band < TXQ_BANDS; band++) {
+		node_txq_t *q = &n->tunnel->txq[band];
+
+		if(!q->active)
+			continue;
+
+		for(udp_queue_t *entry = q->head, *next; entry; entry = next) {
+			next = entry->next;
+			txq_release(entry);
+		}
+
+		/* Take him out of the round robin list */
+
+		node_t **prev = &txq_active[band], *last = NULL;
+
+		while(*prev != n) {
+			last = *prev;
+			prev = &(*prev)->tunnel->txq[band].next;
+		}
+
+		*prev = q->next;
+		if(txq_active_tail[band] == n)
+			txq_active_tail[band] = last;
+
+		memset(q, 0, sizeof *q);
+	}
+}
+#else
+void clear_node_txq(node_t *n) {
+}
+#endif
+
+/* Send all packets queued by send_udppacket() */
+
+void flush_udp_queue(void) {
+#ifdef HAVE_SENDMMSG
+	udp_queue_t *batch[MAX_MSG];
+
+	if(fair_queueing) {
+		flush_txq();
+		return;
+	}
+
+	for(int i = 0; i < udp_queued; i++)
+		batch[i] = &udp_queue[i];
+
+	/* If a socket buffer is full, drop the rest like sendto() would */
+
+	send_udp_batch(batch, udp_queued);
+	udp_queued = 0;
+#endif
+}
+
+/*
+  Outgoing packets are built in a single buffer: the seqno field is the
+  headroom for the sequence number, and the data field has enough tailroom for
+  the padding and HMAC. Compression and encryption write their output directly
+  into that buffer, and encryption and the HMAC are done in place if possible.
+  The original packet is left intact, since it may be sent to other nodes.
+
+  Which of these steps a packet goes through only changes when the node sends
+  us a new key, so update_node_forwarding() picks one of the functions below
+  for him then. They return the packet holding the result, or NULL on error.
+*/
+
+/*
+  Fan-out. While broadcast_packet() and multicast_packet() send one frame to
+  many nodes, it is compressed only once for every compression level they
+  asked for. The result is kept in a buffer from new_packet() until the
+  fan-out ends, and the other nodes with that level get a copy of it.
+*/
+
+static const vpn_packet_t *fanout_packet = NULL;
+static vpn_packet_t *fanout_compressed[COMPRESS_MAX_LEVEL + 1];
+
+static void begin_fanout(const vpn_packet_t *packet) {
+	fanout_packet = packet;
+}
+
+static void end_fanout(void) {
+	for(int level = 0; level <= COMPRESS_MAX_LEVEL; level++) {
+		if(fanout_compressed[level]) {
+			free_packet(fanout_compressed[level]);
+			fanout_compressed[level] = NULL;
+		}
+	}
+
+	fanout_packet = NULL;
+}
+
+static length_t compress_fanout(uint8_t *dest, const vpn_packet_t *inpkt, int level) {
+	if(!compress_ctx)
+		compress_ctx = new_compress_ctx();
+
+	if(inpkt != fanout_packet)
+		return compress_packet(compress_ctx, dest, inpkt->data, inpkt->len, level);
+
+	vpn_packet_t *compressed = fanout_compressed[level];
+
+	if(compressed) {
+		compress_shared_packets++;
+	} else {
+		compressed = fanout_compressed[level] = new_packet();
+		compressed->len = compress_packet(compress_ctx, compressed->data, inpkt->data, inpkt->len, level);
+	}
+
+	if(compressed->len > 0)
+		memcpy(dest, compressed->data, compressed->len);
+
+	return compressed->len;
+}
+
+/* No compression, cipher or HMAC */
+static vpn_packet_t *encode_plain(node_t *n, vpn_packet_t *inpkt, vpn_packet_t *outpkt) {
+	inpkt->seqno = htonl(++(n->tunnel->sent_seqno));
+	inpkt->len += sizeof(inpkt->seqno);
+
+#ifdef HAVE_SENDMMSG
+	/* The queue outlives the original packet, so it needs its own copy */
+
+	memcpy(&outpkt->seqno, &inpkt->seqno, inpkt->len);
+	outpkt->len = inpkt->len;
+	return outpkt;
+#else
+	return inpkt;
+#endif
+}
+
+/* Only an AEAD cipher, which authenticates the packet itself */
+static vpn_packet_t *encode_aead(node_t *n, vpn_packet_t *inpkt, vpn_packet_t *outpkt) {
+	packet_keys_t k = out_keys(n->tunnel);
+
+	inpkt->seqno = htonl(++(n->tunnel->sent_seqno));
+	inpkt->len += sizeof(inpkt->seqno);
+
+	if(!aead_encrypt(&k, inpkt, outpkt)) {
+		ifdebug(TRAFFIC) logger(LOG_ERR, "Error while encrypting packet to %s (%s): %s",
+					n->name, n->hostname, ERR_error_string(ERR_get_error(), NULL));
+		return NULL;
+	}
+
+	return outpkt;
+}
+
+/* Any other combination */
+static vpn_packet_t *encode_packet(node_t *n, vpn_packet_t *inpkt, vpn_packet_t *outpkt) {
+	node_tunnel_t *t = n->tunnel;
+
+	/* Compress the packet, unless it does not pay off and he accepts uncompressed packets */
+
+	uint32_t seqflags = 0;
+
+	if(t->outcompression) {
+		bool raw = n->status.sendraw && t->sent_seqno < SEQNO_UNCOMPRESSED - 1;
+
+		if(raw && t->compressskip) {
+			t->compressskip--;
+		} else {
+			profile_begin(start);
+			outpkt->len = compress_fanout(outpkt->data, inpkt, t->outcompression);
+			profile_end(PROFILE_COMPRESS, start);
+
+			if(outpkt->len < 0) {
+				ifdebug(TRAFFIC) logger(LOG_ERR, "Error while compressing packet to %s (%s)",
+					   n->name, n->hostname);
+				return NULL;
+			}
+
+			update_compression(n, inpkt->len, outpkt->len);
+
+			if(!raw || outpkt->len < inpkt->len) {
+				inpkt = outpkt;
+				raw = false;
+			}
+		}
+
+		if(raw) {
+			seqflags = SEQNO_UNCOMPRESSED;
+			compress_raw_packets++;
+		}
+	}
+
+	/* Add sequence number */
+
+	inpkt->seqno = htonl(++(t->sent_seqno) | seqflags);
+	inpkt->len += sizeof(inpkt->seqno);
+
+	/* Encrypt it and add the message authentication code */
+
+	packet_keys_t k = out_keys(t);
+	vpn_packet_t *result = seal_packet(&k, inpkt, outpkt);
+
+	if(!result)
+		ifdebug(TRAFFIC) logger(LOG_ERR, "Error while encrypting packet to %s (%s): %s",
+					n->name, n->hostname, ERR_error_string(ERR_get_error(), NULL));
+
+	return result;
+}
+
+/*
+  Work out how packets for a node leave this daemon, so send_packet() and
+  send_udppacket() do not have to for every packet. graph() calls this when
+  the route to him may have changed, ans_key_h() when he gave us a new key and
+  update_node_udp() when his UDP address changed.
+*/
+void update_node_forwarding(node_t *n) {
+	if(n == myself)
+		return;
+
+	/* The node UDP packets for him are sent to, and whether TCP has to be used instead */
+
+	if(n->status.visited) {
+		n->udpvia = (n->via == myself) ? n->nexthop : n->via;
+		n->status.sendtcp = ((myself->options | n->udpvia->options) & OPTION_TCPONLY) != 0;
+	} else {
+		n->udpvia = NULL;
+		n->status.sendtcp = false;
+	}
+
+	/* The socket and address to send UDP packets to him with */
+
+	if(n->address.sa.sa_family != listen_socket[n->sock].sa.sa.sa_family) {
+		for(int sock = 0; sock < listen_sockets; sock++) {
+			if(n->address.sa.sa_family == listen_socket[sock].sa.sa.sa_family) {
+				n->sock = sock;
+				break;
+			}
+		}
+	}
+
+	n->addresslen = SALEN(n->address.sa);
+
+	node_tunnel_t *t = n->tunnel;
+
+	if(!t)
+		return;
+
+	if(multipath && n->status.visited && !event_pending(&t->pathevent))
+		event_add(&t->pathevent, (event_handler_t)check_paths, n, PATH_INTERVAL * 1000);
+
+	/* What to do to packets for him before they are sent */
+
+	if(t->outcompression || (t->outcipher && !CIPHER_IS_AEAD(t->outcipher)) || (t->outdigest && t->outmaclength))
+		t->encode = encode_packet;
+	else if(t->outcipher)
+		t->encode = encode_aead;
+	else
+		t->encode = encode_plain;
+}
+
+#ifdef HAVE_SENDMMSG
+/* The queue entry to build the next outgoing packet in */
+
+static udp_queue_t *udp_entry(void) {
+	if(fair_queueing)
+		return txq_alloc();
+
+	if(udp_queued >= BATCH_MSG)
+		flush_udp_queue();
+
+	return &udp_queue[udp_queued];
+}
+#endif
+
+/*
+  Put the session ID he gave us in front of an encoded packet, and send it.
+  With sendmmsg() the packet is the one in the entry udp_entry() returned,
+  and it is queued instead.
+*/
+static void transmit_udppacket(node_t *n, vpn_packet_t *inpkt, int sock, const struct sockaddr *sa, socklen_t sl, int origlen, int priority) {
+	char *start = (char *) &inpkt->seqno;
+
+	if(n->outsessionid) {
+		inpkt->sessionid = n->outsessionid;
+		inpkt->len += sizeof(inpkt->sessionid);
+		start = (char *) &inpkt->sessionid;
+	}
+
+	n->stats.out_packets++;
+	n->stats.out_bytes += origlen;
+
+#ifdef HAVE_SENDMMSG
+	udp_queue_t *entry = (udp_queue_t *)((char *) inpkt - offsetof(udp_queue_t, pkt));
+
+	entry->node = n;
+	entry->sock = sock;
+	entry->origlen = origlen;
+	entry->priority = priority;
+	memcpy(&entry->sa, sa, sl);
+	entry->sl = sl;
+	entry->start = start;
+
+	if(fair_queueing)
+		txq_enqueue(entry);
+	else
+		udp_queued++;
+#else
+	if(priorityinheritance)
+		set_udp_priority(sock, priority);
+
+	udp_tx_calls++;
+	udp_tx_packets++;
+
+	profile_begin(sendstart);
+	int result = sendto(listen_socket[sock].udp, start, inpkt->len, 0, sa, sl);
+	profile_end(PROFILE_SEND, sendstart);
+
+	if(result < 0) {
+		if(sockwouldblock(sockerrno) || socknobufs(sockerrno))
+			listen_socket[sock].buf.tx_full++;
+
+		if(!sockwouldblock(sockerrno))
+			udp_send_error(n, (sockaddr_t *)sa, origlen, inpkt->len, sockerrno);
+	}
+#endif
+}
+
+/*
+  CryptoPipeline.
+
+  Instead of encrypting and decrypting packets one by one, the main loop can
+  collect them in a batch per node and direction, and let the worker threads
+  of CryptoThreads do the cipher and HMAC work. Each batch has its own copy
+  of his cipher and HMAC contexts, so a worker never touches his node_t.
+
+  Everything that has to happen in order stays in the main loop: sequence
+  numbers are given out when packets join a batch, and the replay check,
+  decompression and routing happen when it comes back. Batches come back in
+  the order they were started, however fast each worker is, so packets of
+  one flow, and all packets between two nodes, keep their order.
+
+  A batch is handed to the workers when it is full, or at the end of a pass
+  through the main loop if no batch is underway. So when traffic is light
+  every packet goes right away, and while the workers are busy the batches
+  grow, until they are full and go to the workers side by side. When
+  PIPELINE_DEPTH batches are in use, new packets are dropped, as a full
+  socket buffer would.
+*/
+
+#define PIPELINE_BATCH 32
+#define PIPELINE_DEPTH 64
+
+bool crypto_pipeline = false;
+
+typedef struct crypto_slot_t {
+	vpn_packet_t *in;			/* the packet with its seqno, opened in place if received */
+	vpn_packet_t *out;			/* the encrypted packet if sent */
+	vpn_packet_t *result;			/* in or out, NULL if it could not be encrypted */
+	open_status_t status;			/* what open_packet() said about a received packet */
+	int key;				/* which of the batch's keys opened it */
+	node_path_t *path;			/* address a received packet came from */
+	int sock;				/* where a packet is sent to, as in send_udppacket() */
+	sockaddr_t sa;
+	socklen_t sl;
+	int origlen;
+	int priority;
+} crypto_slot_t;
+
+typedef struct crypto_batch_t {
+	job_t job;				/* job.data is his node, NULL if the packets are to be forgotten */
+	struct crypto_batch_t *next;		/* the next batch that was started */
+	bool receiving;
+	bool submitted;				/* handed to the workers */
+	bool finished;				/* job.done() has been called */
+	int rekeys;				/* how often we sent him a new key since it was opened */
+	int nkeys;				/* 2 if his previous key was still accepted when it was opened */
+	packet_keys_t keys[2];			/* his key and his previous one, pointing at the copies below */
+	EVP_CIPHER_CTX ctx[2];
+	HMAC_CTX hmac[2];
+	char key[2][EVP_MAX_KEY_LENGTH + EVP_MAX_IV_LENGTH];
+	int count;
+	crypto_slot_t slot[PIPELINE_BATCH];
+	char packets[];				/* room for in and out of each slot, only as large as MaxFrameSize needs */
+} crypto_batch_t;
+
+static crypto_batch_t *batch_head, *batch_tail;	/* batches in use, in the order they were started */
+static crypto_batch_t *batch_free;			/* batches for reuse */
+static int batches_used;
+static int batches_underway;			/* submitted but not finished */
+static bool delivering;
+
+static uint64_t pipeline_batches;
+static uint64_t pipeline_packets;
+static uint64_t pipeline_drops;
+
+static void check_rx_path(node_t *n, node_path_t *path);
+
+static bool authenticates(const packet_keys_t *k) {
+	return k->digest ? k->maclength : CIPHER_IS_AEAD(k->cipher);
+}
+
+/*
+  Called in a worker thread, only uses the batch itself. While his previous
+  key is accepted, packets are tried with both, as receive_udppacket() does:
+  the current key first, unless only the previous one can tell whether it
+  fits. A failed AEAD decryption overwrites the packet, so it is first kept
+  in the slot's other buffer.
+*/
+static void open_slot(crypto_batch_t *b, crypto_slot_t *slot) {
+	slot->key = 0;
+
+	if(b->nkeys == 1) {
+		slot->status = open_packet(&b->keys[0], slot->in);
+		return;
+	}
+
+	memcpy(&slot->out->seqno, &slot->in->seqno, slot->in->len);
+	slot->out->len = slot->in->len;
+
+	int first = authenticates(&b->keys[0]) ? 0 : 1;
+
+	for(int i = 0; i < 2; i++) {
+		int key = first ^ i;
+
+		if(i) {
+			memcpy(&slot->in->seqno, &slot->out->seqno, slot->out->len);
+			slot->in->len = slot->out->len;
+		}
+
+		open_status_t status = open_packet(&b->keys[key], slot->in);
+
+		if(status == OPEN_OK || !key) {
+			slot->key = key;
+			slot->status = status;
+		}
+
+		if(status == OPEN_OK)
+			return;
+	}
+
+	memcpy(&slot->in->seqno, &slot->out->seqno, slot->out->len);
+	slot->in->len = slot->out->len;
+}
+
+static void crypto_work(job_t *job) {
+	crypto_batch_t *b = (crypto_batch_t *) job;
+
+	for(int i = 0; i < b->count; i++) {
+		crypto_slot_t *slot = &b->slot[i];
+
+		if(b->receiving)
+			open_slot(b, slot);
+		else
+			slot->result = seal_packet(&b->keys[0], slot->in, slot->out);
+	}
+}
+
+static void release_batch(crypto_batch_t *b) {
+	for(int i = 0; i < b->nkeys; i++) {
+		EVP_CIPHER_CTX_cleanup(&b->ctx[i]);
+		HMAC_CTX_cleanup(&b->hmac[i]);
+	}
+
+	b->next = batch_free;
+	batch_free = b;
+	batches_used--;
+}
+
+static void deliver_slot(node_t *n, crypto_batch_t *b, crypto_slot_t *slot) {
+	if(b->receiving) {
+		node_tunnel_t *t = n->tunnel;
+		int age = slot->key + b->rekeys;	/* 0 if it was opened with his current key, 1 with his previous one */
+
+		if(t->oldkey.expires && t->oldkey.expires <= now)
+			t->oldkey.expires = 0;
+
+		if(slot->status == OPEN_OK && (age > 1 || (age && !t->oldkey.expires)))
+			slot->status = OPEN_UNAUTHENTICATED;
+
+		rx_path = slot->path;
+
+		if(slot->status != OPEN_OK) {
+			drop_unopened(n, slot->in, slot->status);
+		} else if(age) {
+			swap_inkey(n);
+			receive_opened(n, slot->in);
+			swap_inkey(n);
+		} else {
+			if(t->oldkey.expires > now + KEY_SETTLE)
+				t->oldkey.expires = now + KEY_SETTLE;
+
+			receive_opened(n, slot->in);
+		}
+
+		rx_path = NULL;
+
+		if(n->tunnel)
+			check_rx_path(n, slot->path);
+
+		return;
+	}
+
+	if(!slot->result) {
+		ifdebug(TRAFFIC) logger(LOG_ERR, "Error while encrypting packet to %s (%s)",
+					n->name, n->hostname);
+		return;
+	}
+
+	vpn_packet_t *outpkt;
+
+#ifdef HAVE_SENDMMSG
+	udp_queue_t *entry = udp_entry();
+
+	outpkt = &entry->pkt;
+	memcpy(&outpkt->seqno, &slot->result->seqno, slot->result->len);
+	outpkt->len = slot->result->len;
+#else
+	outpkt = slot->result;
+#endif
+
+	transmit_udppacket(n, outpkt, slot->sock, &slot->sa.sa, slot->sl, slot->origlen, slot->priority);
+}
+
+/*
+  Hand back the finished batches at the head of the list. Packets may cause
+  other batches to be started or even finished while this runs, those are
+  picked up by the same loop so the order still holds.
+*/
+static void deliver_batches(void) {
+	if(delivering)
+		return;
+
+	delivering = true;
+
+	while(batch_head && batch_head->finished) {
+		crypto_batch_t *b = batch_head;
+
+		batch_head = b->next;
+		if(!batch_head)
+			batch_tail = NULL;
+
+		node_t *n = b->job.data;
+
+		for(int i = 0; i < b->count && n && n->tunnel; i++)
+			deliver_slot(n, b, &b->slot[i]);
+
+		release_batch(b);
+	}
+
+	delivering = false;
+}
+
+static void crypto_done(job_t *job) {
+	crypto_batch_t *b = (crypto_batch_t *) job;
+
+	b->finished = true;
+	batches_underway--;
+	deliver_batches();
+}
+
+static bool copy_keys(crypto_batch_t *b, const packet_keys_t *k) {
+	int i = b->nkeys++;
+
+	EVP_CIPHER_CTX_init(&b->ctx[i]);
+	HMAC_CTX_init(&b->hmac[i]);
+
+	b->keys[i] = *k;
+	b->keys[i].ctx = &b->ctx[i];
+	b->keys[i].hmac = &b->hmac[i];
+	b->keys[i].key = b->key[i];
+
+	if(k->cipher)
+		memcpy(b->key[i], k->key, k->cipher->key_len + k->cipher->iv_len);
+
+	return (!k->cipher || EVP_CIPHER_CTX_copy(&b->ctx[i], k->ctx))
+		&& (!k->digest || !k->maclength || HMAC_CTX_copy(&b->hmac[i], k->hmac));
+}
+
+/* Start a batch for him with copies of his contexts, NULL if there are too many already */
+
+static crypto_batch_t *open_batch(node_t *n, bool receiving) {
+	node_tunnel_t *t = n->tunnel;
+
+	if(batches_used >= PIPELINE_DEPTH)
+		return NULL;
+
+	crypto_batch_t *b = batch_free;
+
+	if(b)
+		batch_free = b->next;
+	else {
+		b = xmalloc(sizeof *b + 2 * PIPELINE_BATCH * PACKET_ALLOC_SIZE);
+
+		for(int i = 0; i < PIPELINE_BATCH; i++) {
+			b->slot[i].in = (vpn_packet_t *)(b->packets + 2 * i * PACKET_ALLOC_SIZE);
+			b->slot[i].out = (vpn_packet_t *)(b->packets + (2 * i + 1) * PACKET_ALLOC_SIZE);
+		}
+	}
+
+	batches_used++;
+
+	packet_keys_t k = receiving ? in_keys(t) : out_keys(t);
+	packet_keys_t old = {t->oldkey.incipher, t->oldkey.inkey, &t->oldkey.inctx, t->oldkey.indigest, t->oldkey.inmaclength, &t->oldkey.inhmac};
+	bool ok;
+
+	b->nkeys = 0;
+	ok = copy_keys(b, &k);
+
+	if(ok && receiving && t->oldkey.expires > now && old.key && authenticates(&old))
+		ok = copy_keys(b, &old);
+
+	if(!ok) {
+		logger(LOG_ERR, "Could not copy the keys of %s (%s) for the CryptoPipeline: %s",
+				n->name, n->hostname, ERR_error_string(ERR_get_error(), NULL));
+		b->next = NULL;
+		release_batch(b);
+		return NULL;
+	}
+
+	b->job.work = crypto_work;
+	b->job.done = crypto_done;
+	b->job.data = n;
+	b->receiving = receiving;
+	b->rekeys = 0;
+	b->submitted = false;
+	b->finished = false;
+	b->count = 0;
+	b->next = NULL;
+
+	if(batch_tail)
+		batch_tail->next = b;
+	else
+		batch_head = b;
+
+	batch_tail = b;
+
+	if(receiving)
+		t->rxbatch = b;
+	else
+		t->txbatch = b;
+
+	return b;
+}
+
+static void submit_batch(crypto_batch_t *b) {
+	node_t *n = b->job.data;
+
+	if(b->receiving)
+		n->tunnel->rxbatch = NULL;
+	else
+		n->tunnel->txbatch = NULL;
+
+	b->submitted = true;
+	batches_underway++;
+	pipeline_batches++;
+	pipeline_packets += b->count;
+
+	if(!submit_job(&b->job)) {
+		crypto_work(&b->job);
+		crypto_done(&b->job);
+	}
+}
+
+/* Get a slot for a packet for or from him */
+
+static crypto_slot_t *pipeline_slot(node_t *n, bool receiving) {
+	crypto_batch_t *b = receiving ? n->tunnel->rxbatch : n->tunnel->txbatch;
+
+	if(!b && !(b = open_batch(n, receiving))) {
+		pipeline_drops++;
+		return NULL;
+	}
+
+	return &b->slot[b->count++];
+}
+
+/* Submit his batch once it is full, which may deliver it right away */
+
+static void pipeline_slot_filled(node_t *n, bool receiving) {
+	crypto_batch_t *b = receiving ? n->tunnel->rxbatch : n->tunnel->txbatch;
+
+	if(b->count == PIPELINE_BATCH)
+		submit_batch(b);
+}
+
+static void pipeline_send(node_t *n, const vpn_packet_t *origpkt, int sock, const struct sockaddr *sa, socklen_t sl, int priority) {
+	crypto_slot_t *slot = pipeline_slot(n, false);
+
+	if(!slot)
+		return;
+
+	slot->in->seqno = htonl(++(n->tunnel->sent_seqno));
+	memcpy(slot->in->data, origpkt->data, origpkt->len);
+	slot->in->len = origpkt->len + sizeof slot->in->seqno;
+	slot->sock = sock;
+	memcpy(&slot->sa, sa, sl);
+	slot->sl = sl;
+	slot->origlen = origpkt->len;
+	slot->priority = priority;
+
+	pipeline_slot_filled(n, false);
+}
+
+static void pipeline_receive(node_t *n, const vpn_packet_t *inpkt) {
+	crypto_slot_t *slot = pipeline_slot(n, true);
+
+	if(!slot)
+		return;
+
+	memcpy(&slot->in->seqno, &inpkt->seqno, inpkt->len);
+	slot->in->len = inpkt->len;
+	slot->path = rx_path;
+
+	pipeline_slot_filled(n, true);
+}
+
+/* Called by the main loop before it waits for anything */
+
+void flush_crypto_pipeline(void) {
+	if(batches_underway)
+		return;
+
+	for(crypto_batch_t *b = batch_head; b;) {
+		if(!b->submitted) {
+			submit_batch(b);
+			b = batch_head;
+		} else {
+			b = b->next;
+		}
+	}
+}
+
+/*
+  Called when his keys change or are freed. Packets for him that wait for a
+  batch to fill up are sent with the key they got their seqno for. Packets
+  from him know which key opened them, so when they come back they are
+  checked against the replay window of that key, or dropped if it is no
+  longer accepted by then. If all is set, every batch of his is forgotten.
+*/
+void flush_node_batches(node_t *n, bool all) {
+	node_tunnel_t *t = n->tunnel;
+
+	if(!t)
+		return;
+
+	for(crypto_batch_t *b = batch_head; b; b = b->next) {
+		if(b->job.data != n || (!all && !b->receiving))
+			continue;
+
+		if(!all) {
+			b->rekeys++;
+			continue;
+		}
+
+		/* Forgotten batches that are not underway are finished right away */
+
+		if(!b->submitted) {
+			b->submitted = true;
+			b->finished = true;
+		}
+
+		b->job.data = NULL;
+	}
+
+	if(all) {
+		t->txbatch = t->rxbatch = NULL;
+		return;
+	}
+
+	if(t->txbatch)
+		submit_batch(t->txbatch);
+
+	if(t->rxbatch)
+		submit_batch(t->rxbatch);
+}
+
+static void exit_crypto_pipeline(void) {
+	crypto_batch_t *b, *next;
+
+	for(b = batch_head; b; b = next) {
+		next = b->next;
+
+		for(int i = 0; i < b->nkeys; i++) {
+			EVP_CIPHER_CTX_cleanup(&b->ctx[i]);
+			HMAC_CTX_cleanup(&b->hmac[i]);
+		}
+
+		free(b);
+	}
+
+	for(b = batch_free; b; b = next) {
+		next = b->next;
+		free(b);
+	}
+
+	batch_head = batch_tail = batch_free = NULL;
+	batches_used = 0;
+}
+
+/*
+  Small packet aggregation.
+
+  With Aggregation, small packets for a node that accepts aggregates, which
+  his edges tell with OPTION_AGGREGATE, are not sent right away. They are
+  collected in one packet for him, until the next one would not fit in his
+  PMTU, or AggregationDelay milliseconds after the first one was held back.
+  With an AggregationDelay of 0 they wait until the main loop went through
+  everything there was to read. Then they go out as one UDP packet, with
+  one seqno and one MAC, and he splits it up again.
+
+  An aggregate looks like an MTU probe, with PACKET_AGGREGATE in data[0].
+  From data[14] on it holds the packets, each preceded by its length in two
+  bytes. Packets that are not put in one, other than probes, first send the
+  one that is waiting, so packets for him keep their order.
+*/
+
+#define AGGREGATE_HEADER 14
+#define AGGREGATE_MAX 256			/* larger packets are sent on their own */
+
+bool aggregation = false;
+int aggregation_delay = 1;
+
+static node_t *aggregating;			/* nodes that had packets aggregated since the last send_aggregates() */
+static event_t aggregate_event;
+static bool unpacking;				/* sending the packets of an aggregate one by one */
+
+static uint64_t aggregate_packets;
+static uint64_t aggregated_packets;
+
+static void send_prepared_udppacket(node_t *, vpn_packet_t *);
+static void send_aggregates(void *);
+
+/* Aggregates and fragments carry data, even though they look like MTU probes */
+
+static bool carries_data(const vpn_packet_t *packet) {
+	return packet->data[12] | packet->data[13] || packet->data[0] == PACKET_AGGREGATE || packet->data[0] == PACKET_FRAGMENT;
+}
+
+static void flush_aggregate(node_t *n) {
+	node_tunnel_t *t = n->tunnel;
+	vpn_packet_t *packet = t->aggregate;
+
+	if(!packet)
+		return;
+
+	t->aggregate = NULL;
+
+	/* A single packet is sent as it is, as are all of them if he no longer accepts aggregates */
+
+	if(t->aggregated > 1 && (n->options & OPTION_AGGREGATE) && n->status.validkey) {
+		aggregate_packets++;
+		aggregated_packets += t->aggregated;
+		send_prepared_udppacket(n, packet);
+	} else {
+		vpn_packet_t *inner = new_packet();
+		bool outer = unpacking;
+
+		unpacking = true;
+
+		for(length_t offset = AGGREGATE_HEADER; offset < packet->len; offset += inner->len) {
+			inner->len = packet->data[offset] << 8 | packet->data[offset + 1];
+			inner->priority = packet->priority;
+			offset += 2;
+			memcpy(inner->data, packet->data + offset, inner->len);
+			send_udppacket(n, inner);
+		}
+
+		unpacking = outer;
+		free_packet(inner);
+	}
+
+	free_packet(packet);
+}
+
+/* Add a packet to his aggregate, false if it has to be sent on its own */
+
+static bool aggregate_packet(node_t *n, const vpn_packet_t *packet) {
+	node_tunnel_t *t = n->tunnel;
+
+	if(!(packet->data[12] | packet->data[13]))
+		return false;
+
+	length_t limit = n->options & OPTION_PMTU_DISCOVERY ? n->minmtu : n->mtu;
+
+	if(!aggregation || unpacking || !(n->options & OPTION_AGGREGATE) || packet->len > AGGREGATE_MAX
+			|| packet->priority == -1 || t->pathweight || tx_path
+			|| AGGREGATE_HEADER + 2 + packet->len > limit) {
+		flush_aggregate(n);
+		return false;
+	}
+
+	if(t->aggregate && (t->aggregate->len + 2 + packet->len > limit || t->aggregate->priority != packet->priority))
+		flush_aggregate(n);
+
+	if(!t->aggregate) {
+		t->aggregate = new_packet();
+		memset(t->aggregate->data, 0, AGGREGATE_HEADER);
+		t->aggregate->data[0] = PACKET_AGGREGATE;
+		t->aggregate->len = AGGREGATE_HEADER;
+		t->aggregate->priority = packet->priority;
+		t->aggregated = 0;
+
+		if(!t->aggregating) {
+			t->aggregating = true;
+			t->nextaggregate = aggregating;
+			aggregating = n;
+		}
+
+		if(aggregation_delay && !event_pending(&aggregate_event))
+			event_add(&aggregate_event, send_aggregates, NULL, aggregation_delay);
+	}
+
+	vpn_packet_t *aggregate = t->aggregate;
+
+	aggregate->data[aggregate->len] = packet->len >> 8;
+	aggregate->data[aggregate->len + 1] = packet->len;
+	memcpy(aggregate->data + aggregate->len + 2, packet->data, packet->len);
+	aggregate->len += 2 + packet->len;
+	t->aggregated++;
+
+	return true;
+}
+
+static void send_aggregates(void *data) {
+	while(aggregating) {
+		node_t *n = aggregating;
+
+		aggregating = n->tunnel->nextaggregate;
+		n->tunnel->aggregating = false;
+		flush_aggregate(n);
+	}
+}
+
+/* Called by the main loop once it has handled everything there was to read */
+
+void flush_aggregates(void) {
+	if(!aggregation_delay)
+		send_aggregates(NULL);
+}
+
+/* Throw away his aggregate if his tunnel state is about to be freed */
+
+void clear_node_aggregate(node_t *n) {
+	node_tunnel_t *t = n->tunnel;
+
+	if(t->aggregate) {
+		free_packet(t->aggregate);
+		t->aggregate = NULL;
+	}
+
+	if(!t->aggregating)
+		return;
+
+	node_t **prev = &aggregating;
+
+	while(*prev != n)
+		prev = &(*prev)->tunnel->nextaggregate;
+
+	*prev = t->nextaggregate;
+	t->aggregating = false;
+}
+
+static void receive_aggregate(node_t *n, vpn_packet_t *inpkt) {
+	static vpn_packet_t packet;
+
+	for(length_t offset = AGGREGATE_HEADER; offset < inpkt->len; offset += packet.len) {
+		if(inpkt->len - offset < 2 + 14
+				|| (packet.len = inpkt->data[offset] << 8 | inpkt->data[offset + 1]) < 14
+				|| packet.len > inpkt->len - offset - 2) {
+			ifdebug(TRAFFIC) logger(LOG_DEBUG, "Got bad aggregate from %s (%s)", n->name, n->hostname);
+			capture(CAPTURE_DROP_INVALID, n, inpkt->data, inpkt->len);
+			return;
+		}
+
+		offset += 2;
+		memcpy(packet.data, inpkt->data + offset, packet.len);
+		packet.priority = 0;
+
+		receive_packet(n, &packet);
+	}
+}
+
+/*
+  Fragmentation.
+
+  With Fragmentation, a data packet that is too large for his PMTU is not
+  sent over TCP, but cut into fragments that fit, if he can put them
+  together again, which his edges tell with OPTION_FRAGMENT. Each fragment
+  is a UDP packet of its own, with its own seqno and MAC, so it is checked
+  against the replay window like any other packet.
+
+  A fragment looks like an MTU probe, with PACKET_FRAGMENT in data[0], its
+  index and the number of fragments in data[1] and data[2], the ID of the
+  frame in data[4..7], and the offset of its piece and the length of the
+  whole frame in data[8..9] and data[10..11]. The piece itself follows from
+  data[14] on.
+
+  The receiver puts at most REASSEMBLY_SLOTS frames from each node together
+  at a time, and at most REASSEMBLY_MAX in total. A frame whose fragments
+  did not all arrive within REASSEMBLY_TIMEOUT milliseconds is dropped when
+  its slot is needed again.
+*/
+
+#define FRAGMENT_HEADER 14
+#define FRAGMENT_MAX 32				/* fragments per frame, the size of the bitmap */
+#define REASSEMBLY_MAX 256
+#define REASSEMBLY_TIMEOUT 1000
+
+bool fragmentation = false;
+
+static int reassemblies;			/* slots in use, over all nodes */
+
+static uint64_t fragmented_packets;
+static uint64_t fragments_sent;
+static uint64_t reassembled_packets;
+static uint64_t reassembly_drops;
+
+/* Whether packets too large for his PMTU can go to him in fragments, so route() does not have to refuse them */
+
+bool can_fragment(const node_t *n) {
+	return fragmentation && n->options & OPTION_FRAGMENT && n->minmtu > FRAGMENT_HEADER && (n->minmtu - FRAGMENT_HEADER) * FRAGMENT_MAX >= max_frame_size;
+}
+
+/* Send a packet too large for his PMTU in fragments, false if it cannot be */
+
+static bool send_fragments(node_t *n, vpn_packet_t *origpkt) {
+	node_tunnel_t *t = n->tunnel;
+	int size = n->minmtu - FRAGMENT_HEADER;
+
+	if(size <= 0)
+		return false;
+
+	int count = (origpkt->len + size - 1) / size;
+
+	if(count > FRAGMENT_MAX)
+		return false;
+
+	/* Packets that wait to be sent together go first, so his packets keep their order */
+
+	flush_aggregate(n);
+
+	vpn_packet_t *fragment = new_packet();
+	uint32_t id = htonl(++t->fragment_id);
+
+	memset(fragment->data, 0, FRAGMENT_HEADER);
+	fragment->data[0] = PACKET_FRAGMENT;
+	fragment->data[2] = count;
+	memcpy(fragment->data + 4, &id, sizeof id);
+	fragment->data[10] = origpkt->len >> 8;
+	fragment->data[11] = origpkt->len;
+
+	for(int i = 0; i < count; i++) {
+		int offset = i * size;
+		int len = origpkt->len - offset < size ? origpkt->len - offset : size;
+
+		fragment->data[1] = i;
+		fragment->data[8] = offset >> 8;
+		fragment->data[9] = offset;
+		memcpy(fragment->data + FRAGMENT_HEADER, origpkt->data + offset, len);
+		fragment->len = FRAGMENT_HEADER + len;
+		fragment->priority = origpkt->priority;
+
+		send_prepared_udppacket(n, fragment);
+	}
+
+	free_packet(fragment);
+
+	fragmented_packets++;
+	fragments_sent += count;
+
+	return true;
+}
+
+static void free_reassembly(node_reassembly_t *r) {
+	free_packet(r->packet);
+	r->packet = NULL;
+	reassemblies--;
+}
+
+/* Find the slot for a frame of his, or one to put a new frame together in */
+
+static node_reassembly_t *find_reassembly(node_t *n, uint32_t id) {
+	node_tunnel_t *t = n->tunnel;
+	node_reassembly_t *slot = NULL;
+
+	for(int i = 0; i < REASSEMBLY_SLOTS; i++) {
+		node_reassembly_t *r = &t->reassembly[i];
+
+		if(r->packet && r->id == id)
+			return r;
+
+		if(r->packet && r->started + REASSEMBLY_TIMEOUT <= now_msec) {
+			ifdebug(TRAFFIC) logger(LOG_DEBUG, "Fragments of a packet from %s (%s) did not all arrive in time", n->name, n->hostname);
+			free_reassembly(r);
+			reassembly_drops++;
+		}
+
+		if(!r->packet && !slot)
+			slot = r;
+	}
+
+	/* If all slots are busy, the oldest frame makes way */
+
+	if(!slot) {
+		slot = &t->reassembly[0];
+
+		for(int i = 1; i < REASSEMBLY_SLOTS; i++)
+			if(t->reassembly[i].started < slot->started)
+				slot = &t->reassembly[i];
+
+		free_reassembly(slot);
+		reassembly_drops++;
+	}
+
+	if(reassemblies >= REASSEMBLY_MAX)
+		return NULL;
+
+	reassemblies++;
+	slot->packet = new_packet();
+	slot->id = id;
+	slot->received = 0;
+	slot->count = 0;
+	slot->started = now_msec;
+
+	return slot;
+}
+
+static void receive_fragment(node_t *n, vpn_packet_t *inpkt) {
+	uint32_t id;
+	int index = inpkt->data[1];
+	int count = inpkt->data[2];
+	int offset = inpkt->data[8] << 8 | inpkt->data[9];
+	int total = inpkt->data[10] << 8 | inpkt->data[11];
+	int len = inpkt->len - FRAGMENT_HEADER;
+
+	memcpy(&id, inpkt->data + 4, sizeof id);
+
+	if(len <= 0 || index >= count || count > FRAGMENT_MAX || total < 14 || total > max_packet_size || offset + len > total) {
+		ifdebug(TRAFFIC) logger(LOG_DEBUG, "Got bad fragment from %s (%s)", n->name, n->hostname);
+		capture(CAPTURE_DROP_INVALID, n, inpkt->data, inpkt->len);
+		return;
+	}
+
+	node_reassembly_t *r = find_reassembly(n, id);
+
+	if(!r) {
+		reassembly_drops++;
+		return;
+	}
+
+	if(!r->count) {
+		r->count = count;
+		r->packet->len = total;
+	} else if(r->count != count || r->packet->len != total) {
+		ifdebug(TRAFFIC) logger(LOG_DEBUG, "Got bad fragment from %s (%s)", n->name, n->hostname);
+		capture(CAPTURE_DROP_INVALID, n, inpkt->data, inpkt->len);
+		return;
+	}
+
+	if(r->received & (1U << index))
+		return;
+
+	r->received |= 1U << index;
+	memcpy(r->packet->data + offset, inpkt->data + FRAGMENT_HEADER, len);
+
+	if(r->received != (count == 32 ? 0xffffffffU : (1U << count) - 1))
+		return;
+
+	vpn_packet_t *packet = r->packet;
+
+	r->packet = NULL;
+	reassemblies--;
+	reassembled_packets++;
+
+	packet->priority = 0;
+
+	receive_packet(n, packet);
+	free_packet(packet);
+}
+
+/* Forget the frames he was sending us in fragments */
+
+void clear_node_reassembly(node_t *n) {
+	for(int i = 0; i < REASSEMBLY_SLOTS; i++)
+		if(n->tunnel->reassembly[i].packet)
+			free_reassembly(&n->tunnel->reassembly[i]);
+}
+
+/* Packets sent over TCP are counted on the node they are for, not on the neighbour whose connection carries them */
+
+static void count_tcppacket(node_t *n, const vpn_packet_t *packet) {
+	n->stats.out_packets++;
+	n->stats.out_bytes += packet->len;
+	n->stats.tcp_packets++;
+}
+
+static void send_udppacket(node_t *n, vpn_packet_t *origpkt) {
+	if(!n->status.reachable) {
+		ifdebug(TRAFFIC) logger(LOG_INFO, "Trying to send UDP packet to unreachable node %s (%s)", n->name, n->hostname);
+		return;
+	}
+
+	/* Make sure we have a valid key */
+
+	if(!n->status.validkey) {
+		ifdebug(TRAFFIC) logger(LOG_INFO,
+				   "No valid key known yet for %s (%s), forwarding via TCP",
+				   n->name, n->hostname);
+
+		if(n->last_req_key + 10 <= now) {
+			send_req_key(n);
+			n->last_req_key = now;
+		}
+
+		n->stats.nokey_packets++;
+		count_tcppacket(n, origpkt);
+		send_tcppacket(n->nexthop->connection, origpkt);
+
+		return;
+	}
+
+	/* Only real traffic keeps his keys from expiring, probes do not */
+
+	if(origpkt->data[12] | origpkt->data[13])
+		n->tunnel->last_used = now;
+
+	/* Frames larger than our MaxFrameSize, from a node that allows more, do not fit in the send buffers either */
+
+	if((n->options & OPTION_PMTU_DISCOVERY && origpkt->len > n->minmtu && (origpkt->data[12] | origpkt->data[13])) || origpkt->len > max_frame_size) {
+		if(can_fragment(n) && (origpkt->data[12] | origpkt->data[13]) && send_fragments(n, origpkt))
+			return;
 
-	/* Encrypt the packet */
+		ifdebug(TRAFFIC) logger(LOG_INFO,
+				"Packet for %s (%s) larger than minimum MTU, forwarding via %s",
+				n->name, n->hostname, n != n->nexthop ? n->nexthop->name : "TCP");
 
-	if(n->outcipher) {
-		outpkt = pkt[nextpkt++];
+		n->stats.toobig_packets++;
 
-		if(!EVP_EncryptInit_ex(&n->outctx, NULL, NULL, NULL, NULL)
-				|| !EVP_EncryptUpdate(&n->outctx, (unsigned char *) &outpkt->seqno, &outlen,
-					(unsigned char *) &inpkt->seqno, inpkt->len)
-				|| !EVP_EncryptFinal_ex(&n->outctx, (unsigned char *) &outpkt->seqno + outlen, &outpad)) {
-			ifdebug(TRAFFIC) logger(LOG_ERR, "Error while encrypting packet to %s (%s): %s",
-						n->name, n->hostname, ERR_error_string(ERR_get_error(), NULL));
-			goto end;
+		if(n != n->nexthop) {
+			send_packet(n->nexthop, origpkt);
+		} else {
+			count_tcppacket(n, origpkt);
+			send_tcppacket(n->nexthop->connection, origpkt);
 		}
 
-		outpkt->len = outlen + outpad;
-		inpkt = outpkt;
+		return;
 	}
 
-	/* Add the message authentication code */
+	if(aggregation && aggregate_packet(n, origpkt))
+		return;
 
-	if(n->outdigest && n->outmaclength) {
-		HMAC(n->outdigest, n->outkey, n->outkeylength, (unsigned char *) &inpkt->seqno,
-			 inpkt->len, (unsigned char *) &inpkt->seqno + inpkt->len, NULL);
-		inpkt->len += n->outmaclength;
-	}
+	send_prepared_udppacket(n, origpkt);
+}
 
-	/* Determine which socket we have to use */
+/* The rest of send_udppacket(), once the packet is known to go over UDP right away */
 
-	if(n->address.sa.sa_family != listen_socket[n->sock].sa.sa.sa_family) {
-		for(int sock = 0; sock < listen_sockets; sock++) {
-			if(n->address.sa.sa_family == listen_socket[sock].sa.sa.sa_family) {
-				n->sock = sock;
-				break;
-			}
-		}
-	}
+static void send_prepared_udppacket(node_t *n, vpn_packet_t *origpkt) {
+	vpn_packet_t *inpkt;
+	vpn_packet_t *outpkt;
+	int origlen;
+	int origpriority;
 
-	/* Send the packet */
+	origlen = origpkt->len;
+	origpriority = origpkt->priority;
+
+	/* Determine the destination address */
 
 	struct sockaddr *sa;
 	socklen_t sl;
 	int sock;
 	sockaddr_t broadcast;
+	node_path_t *path = tx_path;
+
+	/* With Multipath, data packets may go to another address of his */
+
+	if(!path && n->tunnel->pathweight && (origpkt->data[12] | origpkt->data[13]))
+		path = choose_path(n, origpkt);
 
 	/* Overloaded use of priority field: -1 means local broadcast */
 
@@ -537,46 +3028,53 @@ static void send_udppacket(node_t *n, vpn_packet_t *origpkt) {
 		}
 		sa = &broadcast.sa;
 		sl = SALEN(broadcast.sa);
+	} else if(path) {
+		sa = &path->address.sa;
+		sl = path->addresslen;
+		sock = path->sock;
 	} else {
-		if(origpriority == -1)
-			origpriority = 0;
-
 		sa = &(n->address.sa);
-		sl = SALEN(n->address.sa);
+		sl = n->addresslen;
 		sock = n->sock;
 	}
 
-	if(priorityinheritance && origpriority != listen_socket[n->sock].priority) {
-		listen_socket[n->sock].priority = origpriority;
-		switch(listen_socket[n->sock].sa.sa.sa_family) {
-#if defined(SOL_IP) && defined(IP_TOS)
-		case AF_INET:
-			ifdebug(TRAFFIC) logger(LOG_DEBUG, "Setting IPv4 outgoing packet priority to %d", origpriority);
-			if(setsockopt(listen_socket[n->sock].udp, SOL_IP, IP_TOS, &origpriority, sizeof(origpriority))) /* SO_PRIORITY doesn't seem to work */
-				logger(LOG_ERR, "System call `%s' failed: %s", "setsockopt", strerror(errno));
-			break;
+	if(origpriority == -1)
+		origpriority = 0;
+
+	/* Data packets go to the CryptoPipeline, unless they are compressed, which the main loop has to do */
+
+	if(crypto_pipeline && n->tunnel->encode != encode_plain && !n->tunnel->outcompression && carries_data(origpkt)) {
+		pipeline_send(n, origpkt, sock, sa, sl, origpriority);
+		goto end;
+	}
+
+	/* Get the buffer to build the outgoing packet in */
+
+#ifdef HAVE_SENDMMSG
+	udp_queue_t *entry = udp_entry();
+
+	outpkt = &entry->pkt;
+#else
+	static vpn_packet_t pkt;
+	outpkt = &pkt;
 #endif
-#if defined(IPPROTO_IPV6) && defined(IPV6_TCLASS)
-		case AF_INET6:
-			ifdebug(TRAFFIC) logger(LOG_DEBUG, "Setting IPv6 outgoing packet priority to %d", origpriority);
-			if(setsockopt(listen_socket[n->sock].udp, IPPROTO_IPV6, IPV6_TCLASS, &origpriority, sizeof(origpriority)))
-				logger(LOG_ERR, "System call `%s' failed: %s", "setsockopt", strerror(errno));
-			break;
+
+	/* Compress, encrypt and authenticate it */
+
+	inpkt = n->tunnel->encode(n, origpkt, outpkt);
+
+	if(!inpkt) {
+#ifdef HAVE_SENDMMSG
+		if(fair_queueing)
+			txq_release(entry);
 #endif
-		default:
-			break;
-		}
+		goto end;
 	}
 
-	if(sendto(listen_socket[sock].udp, (char *) &inpkt->seqno, inpkt->len, 0, sa, sl) < 0 && !sockwouldblock(sockerrno)) {
-		if(sockmsgsize(sockerrno)) {
-			if(n->maxmtu >= origlen)
-				n->maxmtu = origlen - 1;
-			if(n->mtu >= origlen)
-				n->mtu = origlen - 1;
-		} else
-			ifdebug(TRAFFIC) logger(LOG_WARNING, "Error sending packet to %s (%s): %s", n->name, n->hostname, sockstrerror(sockerrno));
-	}
+	transmit_udppacket(n, inpkt, sock, sa, sl, origlen, origpriority);
+
+	if(!carries_data(origpkt))
+		n->tunnel->mtuoverhead = inpkt->len - origlen;
 
 end:
 	origpkt->len = origlen;
@@ -585,16 +3083,28 @@ end:
 /*
   send a packet to the given vpn ip.
 */
-void send_packet(const node_t *n, vpn_packet_t *packet) {
+void send_packet(node_t *n, vpn_packet_t *packet) {
 	node_t *via;
 
 	if(n == myself) {
 		if(overwrite_mac)
 			 memcpy(packet->data, mymac.x, ETH_ALEN);
+		capture(CAPTURE_DEVICE_OUT, myself, packet->data, packet->len);
+
+		if(devops.write_batch) {
+			queue_device_packet(packet);
+			return;
+		}
+
+		profile_begin(start);
 		devops.write(packet);
+		profile_end(PROFILE_DEVICE_WRITE, start);
 		return;
 	}
 
+	if(rate_limited(n, &n->outbucket, packet->len))
+		return;
+
 	ifdebug(TRAFFIC) logger(LOG_ERR, "Sending packet of %d bytes to %s (%s)",
 			   packet->len, n->name, n->hostname);
 
@@ -604,13 +3114,18 @@ void send_packet(const node_t *n, vpn_packet_t *packet) {
 		return;
 	}
 
-	via = (packet->priority == -1 || n->via == myself) ? n->nexthop : n->via;
+	capture(CAPTURE_SENT, n, packet->data, packet->len);
+	flow_sample(FLOW_OUT, n, packet);
+
+	via = (packet->priority == -1) ? n->nexthop : n->udpvia;
 
 	if(via != n)
 		ifdebug(TRAFFIC) logger(LOG_INFO, "Sending packet to %s via %s (%s)",
 			   n->name, via->name, n->via->hostname);
 
-	if(packet->priority == -1 || ((myself->options | via->options) & OPTION_TCPONLY)) {
+	if(packet->priority == -1 || n->status.sendtcp) {
+		count_tcppacket(n, packet);
+
 		if(!send_tcppacket(via->connection, packet))
 			terminate_connection(via->connection, true);
 	} else
@@ -641,12 +3156,16 @@ void broadcast_packet(const node_t *from, vpn_packet_t *packet) {
 		// This guarantees all nodes receive the broadcast packet, and
 		// usually distributes the sending of broadcast packets over all nodes.
 		case BMODE_MST:
+			begin_fanout(packet);
+
 			for(node = connection_tree->head; node; node = node->next) {
 				c = node->data;
 
 				if(c->status.active && c->status.mst && c != from->nexthop->connection)
 					send_packet(c->node, packet);
 			}
+
+			end_fanout();
 			break;
 
 		// In direct mode, we send copies to each node we know of.
@@ -656,12 +3175,113 @@ void broadcast_packet(const node_t *from, vpn_packet_t *packet) {
 			if(from != myself)
 				break;
 
+			begin_fanout(packet);
+
 			for(node = node_udp_tree->head; node; node = node->next) {
 				n = node->data;
 
 				if(n->status.reachable && n != myself && ((n->via == myself && n->nexthop == n) || n->via == n))
 					send_packet(n, packet);
 			}
+
+			end_fanout();
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*
+  Like broadcast_packet(), but only along the MST branches that lead to the
+  owners of the given subnets, the members of a multicast group. If there
+  are more such branches than we care to track, it goes along all of them.
+*/
+
+#define MAX_BRANCHES 32
+
+void multicast_packet(const node_t *from, vpn_packet_t *packet, const avl_tree_t *members) {
+	avl_node_t *node;
+	connection_t *c;
+	connection_t *branch[MAX_BRANCHES];
+	int nbranches = 0;
+	node_t *n;
+
+	if(from != myself)
+		send_packet(myself, packet);
+
+	if(tunnelserver || broadcast_mode == BMODE_NONE || !members)
+		return;
+
+	ifdebug(TRAFFIC) logger(LOG_INFO, "Multicasting packet of %d bytes from %s (%s)",
+			   packet->len, from->name, from->hostname);
+
+	switch(broadcast_mode) {
+		case BMODE_MST:
+			for(node = members->head; node; node = node->next) {
+				n = ((subnet_t *)node->data)->owner;
+
+				if(n == myself || n == from || !n->status.reachable || !n->mstbranch || n->mstbranch == from->mstbranch)
+					continue;
+
+				int i;
+
+				for(i = 0; i < nbranches && branch[i] != n->mstbranch; i++);
+
+				if(i < nbranches)
+					continue;
+
+				if(nbranches == MAX_BRANCHES) {
+					nbranches = -1;
+					break;
+				}
+
+				branch[nbranches++] = n->mstbranch;
+			}
+
+			/* Only compare, the branches may be stale until the graph is updated */
+
+			begin_fanout(packet);
+
+			for(node = connection_tree->head; node && nbranches; node = node->next) {
+				c = node->data;
+
+				if(!c->status.active || !c->status.mst)
+					continue;
+
+				if(nbranches < 0) {
+					if(c != from->nexthop->connection)
+						send_packet(c->node, packet);
+
+					continue;
+				}
+
+				for(int i = 0; i < nbranches; i++) {
+					if(branch[i] == c) {
+						send_packet(c->node, packet);
+						branch[i] = branch[--nbranches];
+						break;
+					}
+				}
+			}
+
+			end_fanout();
+			break;
+
+		case BMODE_DIRECT:
+			if(from != myself)
+				break;
+
+			begin_fanout(packet);
+
+			for(node = members->head; node; node = node->next) {
+				n = ((subnet_t *)node->data)->owner;
+
+				if(n->status.reachable && n != myself && ((n->via == myself && n->nexthop == n) || n->via == n))
+					send_packet(n, packet);
+			}
+
+			end_fanout();
 			break;
 
 		default:
@@ -681,6 +3301,11 @@ static node_t *try_harder(const sockaddr_t *from, const vpn_packet_t *pkt) {
 		if(e->to == myself)
 			continue;
 
+		/* Nodes using a session ID are found by lookup_node_id() instead */
+
+		if(e->to->insessionid)
+			continue;
+
 		if(last_hard_try == now && sockaddrcmp_noport(from, &e->address))
 			continue;
 
@@ -695,31 +3320,60 @@ static node_t *try_harder(const sockaddr_t *from, const vpn_packet_t *pkt) {
 	return n;
 }
 
-void handle_incoming_vpn_data(int sock) {
-	vpn_packet_t pkt;
+/*
+  If any node uses a session ID, packets are received starting at the sessionid field,
+  since we cannot tell beforehand which packets carry one.
+  Packets from an unknown address are matched by their session ID first,
+  so only one MAC has to be checked. Packets without a session ID are moved back in place.
+*/
+static void handle_incoming_vpn_packet(listen_socket_t *ls, vpn_packet_t *pkt, sockaddr_t *from, bool prefixed) {
 	char *hostname;
-	sockaddr_t from;
-	socklen_t fromlen = sizeof(from);
 	node_t *n;
+	node_path_t *path = NULL;
 
-	pkt.len = recvfrom(listen_socket[sock].udp, (char *) &pkt.seqno, MAXSIZE, 0, &from.sa, &fromlen);
+	sockaddrunmap(from);		/* Some braindead IPv6 implementations do stupid things. */
 
-	if(pkt.len < 0) {
-		if(!sockwouldblock(sockerrno))
-			logger(LOG_ERR, "Receiving packet failed: %s", sockstrerror(sockerrno));
-		return;
-	}
+	n = lookup_node_udp(from);
+
+	if(n) {
+		if(n->tunnel)
+			path = &n->tunnel->path[0];
+	} else if(multipath && (path = lookup_node_path(from)))
+		n = path->node;
+
+	if(prefixed) {
+		if(n && n->insessionid) {
+			if(pkt->len < (length_t)sizeof(pkt->sessionid))
+				return;
+
+			pkt->len -= sizeof(pkt->sessionid);
+			prefixed = false;
+		} else if(!n && pkt->len >= (length_t)sizeof(pkt->sessionid)) {
+			node_t *idn = lookup_node_id(pkt->sessionid);
 
-	sockaddrunmap(&from);		/* Some braindead IPv6 implementations do stupid things. */
+			if(idn) {
+				pkt->len -= sizeof(pkt->sessionid);
 
-	n = lookup_node_udp(&from);
+				if(try_mac(idn, pkt)) {
+					path = new_udp_address(idn, ls, from);
+					n = idn;
+					prefixed = false;
+				} else {
+					pkt->len += sizeof(pkt->sessionid);
+				}
+			}
+		}
+
+		if(prefixed)
+			memmove(&pkt->seqno, &pkt->sessionid, pkt->len);
+	}
 
 	if(!n) {
-		n = try_harder(&from, &pkt);
+		n = try_harder(from, pkt);
 		if(n)
-			update_node_udp(n, &from);
+			path = new_udp_address(n, ls, from);
 		else ifdebug(PROTOCOL) {
-			hostname = sockaddr2hostname(&from);
+			hostname = sockaddr2hostname(from);
 			logger(LOG_WARNING, "Received UDP packet from unknown source %s", hostname);
 			free(hostname);
 			return;
@@ -728,7 +3382,312 @@ void handle_incoming_vpn_data(int sock) {
 			return;
 	}
 
-	n->sock = sock;
+	if(path && path != &n->tunnel->path[0])
+		path->sock = ls - listen_socket;
+	else
+		n->sock = ls - listen_socket;
+
+	if(rate_limited(n, &n->inbucket, pkt->len))
+		return;
+
+	rx_path = path;
+	receive_udppacket(n, pkt);
+	rx_path = NULL;
+
+	check_rx_path(n, path);
+}
+
+/* If his address stopped working, switch to the one he is using now */
+
+static void check_rx_path(node_t *n, node_path_t *path) {
+	if(path && path != &n->tunnel->path[0] && path->last_rx == now && !path_alive(&n->tunnel->path[0])) {
+		sockaddr_t sa = path->address;
+		update_node_udp(n, &sa);
+	}
+}
+
+#ifdef HAVE_UDP_GRO
+/*
+  With UDPGRO, the kernel puts consecutive datagrams of the same size from
+  the same sender into one buffer, and tells us their size in a control
+  message. Each one is copied into a vpn_packet_t and handled on its own.
+*/
+
+static void handle_incoming_vpn_gro(listen_socket_t *ls, int fd) {
+	static uint8_t buf[GRO_MSG][GRO_SIZE];
+	static char control[GRO_MSG][CMSG_SPACE(sizeof(int))];
+	static sockaddr_t from[GRO_MSG];
+	static struct mmsghdr msg[GRO_MSG];
+	static struct iovec iov[GRO_MSG];
+	static vpn_packet_t pkt;
+	int num;
+	bool prefixed = node_ids_used();
+	uint8_t *start = prefixed ? (uint8_t *) &pkt.sessionid : (uint8_t *) &pkt.seqno;
+
+	for(int i = 0; i < GRO_MSG; i++) {
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len = GRO_SIZE;
+		msg[i].msg_hdr.msg_name = &from[i].sa;
+		msg[i].msg_hdr.msg_namelen = sizeof from[i];
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+		msg[i].msg_hdr.msg_control = control[i];
+		msg[i].msg_hdr.msg_controllen = sizeof control[i];
+		msg[i].msg_hdr.msg_flags = 0;
+	}
+
+	profile_begin(recvstart);
+	num = recvmmsg(fd, msg, GRO_MSG, 0, NULL);
+	profile_end(PROFILE_RECEIVE, recvstart);
+
+	if(num < 0) {
+		if(!sockwouldblock(sockerrno))
+			logger(LOG_ERR, "Receiving packet failed: %s", sockstrerror(sockerrno));
+		return;
+	}
+
+	udp_rx_batches++;
+
+	for(int i = 0; i < num; i++) {
+		int len = msg[i].msg_len;
+		int size = len;
+
+		for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msg[i].msg_hdr, cmsg))
+			if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+				memcpy(&size, CMSG_DATA(cmsg), sizeof size);
+
+		if(size <= 0)
+			size = len;
+
+		for(int offset = 0; offset < len; offset += size) {
+			int seglen = len - offset < size ? len - offset : size;
+
+			udp_rx_packets++;
+
+			if(seglen > MAXSIZE) {
+				ifdebug(TRAFFIC) logger(LOG_DEBUG, "Dropping oversized UDP packet of %d bytes", seglen);
+				continue;
+			}
+
+			memcpy(start, buf[i] + offset, seglen);
+			pkt.len = seglen;
+			handle_incoming_vpn_packet(ls, &pkt, &from[i], prefixed);
+		}
+	}
+}
+#endif
+
+/* Read from one of the UDP sockets of a listen socket, replies go out through its first one */
+
+static void handle_incoming_udp(listen_socket_t *ls, int fd) {
+#ifdef HAVE_UDP_GRO
+	if(udp_gro) {
+		handle_incoming_vpn_gro(ls, fd);
+		return;
+	}
+#endif
+
+#ifdef HAVE_RECVMMSG
+	static vpn_packet_t pkt[MAX_MSG];
+	static sockaddr_t from[MAX_MSG];
+	static struct mmsghdr msg[MAX_MSG];
+	static struct iovec iov[MAX_MSG];
+	int num;
+	bool prefixed = node_ids_used();
+
+	for(int i = 0; i < MAX_MSG; i++) {
+		iov[i].iov_base = prefixed ? (void *) &pkt[i].sessionid : (void *) &pkt[i].seqno;
+		iov[i].iov_len = MAXSIZE;
+		msg[i].msg_hdr.msg_name = &from[i].sa;
+		msg[i].msg_hdr.msg_namelen = sizeof from[i];
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+		msg[i].msg_hdr.msg_control = NULL;
+		msg[i].msg_hdr.msg_controllen = 0;
+		msg[i].msg_hdr.msg_flags = 0;
+	}
+
+	profile_begin(start);
+	num = recvmmsg(fd, msg, BATCH_MSG, 0, NULL);
+	profile_end(PROFILE_RECEIVE, start);
+
+	if(num < 0) {
+		if(!sockwouldblock(sockerrno))
+			logger(LOG_ERR, "Receiving packet failed: %s", sockstrerror(sockerrno));
+		return;
+	}
+
+	udp_rx_batches++;
+	udp_rx_packets += num;
+
+	for(int i = 0; i < num; i++) {
+		pkt[i].len = msg[i].msg_len;
+		handle_incoming_vpn_packet(ls, &pkt[i], &from[i], prefixed);
+	}
+#else
+	vpn_packet_t pkt;
+	sockaddr_t from;
+	socklen_t fromlen = sizeof(from);
+	bool prefixed = node_ids_used();
+
+	profile_begin(start);
+	pkt.len = recvfrom(fd, prefixed ? (char *) &pkt.sessionid : (char *) &pkt.seqno, MAXSIZE, 0, &from.sa, &fromlen);
+	profile_end(PROFILE_RECEIVE, start);
+
+	if(pkt.len < 0) {
+		if(!sockwouldblock(sockerrno))
+			logger(LOG_ERR, "Receiving packet failed: %s", sockstrerror(sockerrno));
+		return;
+	}
+
+	udp_rx_batches++;
+	udp_rx_packets++;
+
+	handle_incoming_vpn_packet(ls, &pkt, &from, prefixed);
+#endif
+}
+
+void handle_incoming_vpn_data(void *data, int flags) {
+	listen_socket_t *ls = data;
+
+	/* With FairQueueing, flush_txq() waits for this when the socket buffer was full */
+
+	if(flags & IO_WRITE) {
+		io_set(&ls->udp_io, IO_READ);
+		flush_udp_queue();
+	}
+
+	if(flags & IO_READ)
+		handle_incoming_udp(ls, ls->udp);
+}
+
+void handle_incoming_shard_data(void *data, int flags) {
+	udp_shard_t *shard = data;
+
+	handle_incoming_udp(shard->ls, shard->udp);
+}
+
+void dump_udp_stats(void) {
+	logger(LOG_DEBUG, "Statistics for UDP sockets:");
+	logger(LOG_DEBUG, " packets received: %10"PRIu64, udp_rx_packets);
+	logger(LOG_DEBUG, " receive calls:    %10"PRIu64, udp_rx_batches);
+	logger(LOG_DEBUG, " packets per call: %10.2f", udp_rx_batches ? (double)udp_rx_packets / udp_rx_batches : 0.0);
+	logger(LOG_DEBUG, " packets sent:     %10"PRIu64, udp_tx_packets);
+	logger(LOG_DEBUG, " send calls:       %10"PRIu64, udp_tx_calls);
+	logger(LOG_DEBUG, " packets per call: %10.2f", udp_tx_calls ? (double)udp_tx_packets / udp_tx_calls : 0.0);
+	logger(LOG_DEBUG, " late drops:       %10"PRIu64, replay_late);
+	logger(LOG_DEBUG, " replayed drops:   %10"PRIu64, replay_replayed);
+	logger(LOG_DEBUG, " far future drops: %10"PRIu64, replay_farfuture);
+	logger(LOG_DEBUG, " compression ratio:%10.2f", compress_in_bytes ? (double)compress_out_bytes / compress_in_bytes : 0.0);
+	logger(LOG_DEBUG, " sent uncompressed:%10"PRIu64, compress_raw_packets);
+	logger(LOG_DEBUG, " shared compressed:%10"PRIu64, compress_shared_packets);
+
+	if(aggregation) {
+		logger(LOG_DEBUG, " aggregates sent:  %10"PRIu64, aggregate_packets);
+		logger(LOG_DEBUG, " packets per aggr.:%10.2f", aggregate_packets ? (double)aggregated_packets / aggregate_packets : 0.0);
+	}
+
+	if(fragmentation || reassembled_packets) {
+		logger(LOG_DEBUG, " sent fragmented:  %10"PRIu64, fragmented_packets);
+		logger(LOG_DEBUG, " fragments sent:   %10"PRIu64, fragments_sent);
+		logger(LOG_DEBUG, " reassembled:      %10"PRIu64, reassembled_packets);
+		logger(LOG_DEBUG, " reassembly drops: %10"PRIu64, reassembly_drops);
+	}
+
+	if(crypto_pipeline) {
+		logger(LOG_DEBUG, " pipeline batches: %10"PRIu64, pipeline_batches);
+		logger(LOG_DEBUG, " packets per batch:%10.2f", pipeline_batches ? (double)pipeline_packets / pipeline_batches : 0.0);
+		logger(LOG_DEBUG, " pipeline drops:   %10"PRIu64, pipeline_drops);
+	}
+
+	for(int i = 0; i < listen_sockets; i++) {
+		const listen_socket_t *ls = &listen_socket[i];
+
+		logger(LOG_DEBUG, " socket %d: rcvbuf %d sndbuf %d, %"PRIu64" receive drops, %"PRIu64" failed sends", i, ls->buf.rcvbuf, ls->buf.sndbuf, ls->buf.rx_drops, ls->buf.tx_full);
+
+		for(int j = 0; j < ls->shards; j++)
+			logger(LOG_DEBUG, " socket %d.%d: rcvbuf %d, %"PRIu64" receive drops", i, j + 1, ls->shard[j].buf.rcvbuf, ls->shard[j].buf.rx_drops);
+	}
+}
+
+static int device_errors = 0;
+
+/* Wait a bit longer after every error in a row, and give up after too many */
+
+static void device_error(void) {
+	usleep(device_errors * 50000);
+	device_errors++;
+
+	if(device_errors > 10) {
+		logger(LOG_ERR, "Too many errors from %s, exiting!", device);
+		running = false;
+	}
+}
+
+static void route_device_packet(vpn_packet_t *packet) {
+	device_errors = 0;
+	packet->priority = 0;
+	capture(CAPTURE_DEVICE_IN, myself, packet->data, packet->len);
+
+	profile_begin(routestart);
+	route(myself, packet);
+	profile_end(PROFILE_ROUTE, routestart);
+}
+
+static void read_device_batch(void) {
+	vpn_packet_t *packets[MAX_MSG];
+	int want = BATCH_MSG, num;
+
+	for(int i = 0; i < want; i++)
+		packets[i] = new_packet();
+
+	do {
+		profile_begin(start);
+		num = devops.read_batch(packets, want);
+		profile_end(PROFILE_DEVICE_READ, start);
+
+		if(num < 0) {
+			device_error();
+			break;
+		}
+
+		for(int i = 0; i < num; i++)
+			if(packets[i]->len)
+				route_device_packet(packets[i]);
+	} while(num == want && devops.pending && devops.pending());
+
+	for(int i = 0; i < want; i++)
+		free_packet(packets[i]);
+}
+
+void handle_device_data(void *data, int flags) {
+	if(devops.read_batch) {
+		read_device_batch();
+	} else {
+		vpn_packet_t *packet = new_packet();
+
+		do {
+			profile_begin(start);
+			bool ok = devops.read(packet);
+			profile_end(PROFILE_DEVICE_READ, start);
+
+			if(!ok) {
+				device_error();
+				break;
+			}
+
+			if(packet->len)
+				route_device_packet(packet);
+		} while(devops.pending && devops.pending());
+
+		free_packet(packet);
+	}
+
+	/* Some devices, like the UML one, switch to another file descriptor while reading */
 
-	receive_udppacket(n, &pkt);
+	if(device_fd != device_io.fd) {
+		io_del(&device_io);
+		if(device_fd >= 0)
+			io_add(&device_io, handle_device_data, NULL, device_fd, IO_READ);
+	}
 }
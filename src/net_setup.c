@@ -29,19 +29,28 @@
 #include <openssl/evp.h>
 
 #include "avl_tree.h"
+#include "bench.h"
+#include "capture.h"
+#include "compress.h"
 #include "conf.h"
 #include "connection.h"
+#include "damping.h"
+#include "control.h"
 #include "device.h"
 #include "event.h"
+#include "flow.h"
 #include "graph.h"
 #include "logger.h"
+#include "meta.h"
 #include "net.h"
 #include "netutl.h"
 #include "process.h"
 #include "protocol.h"
+#include "resume.h"
 #include "route.h"
 #include "subnet.h"
 #include "utils.h"
+#include "worker.h"
 #include "xalloc.h"
 
 char *myport;
@@ -52,21 +61,110 @@ char *proxyport;
 char *proxyuser;
 char *proxypass;
 proxytype_t proxytype;
+bool low_memory = false;
 
-bool read_rsa_public_key(connection_t *c) {
+/*
+  Public keys read from files are kept, so a node that reconnects does not
+  cost a PEM parse. A cached key is used as long as stat() says the file it
+  came from has not changed, and the cache is emptied on SIGHUP.
+*/
+
+typedef struct public_key_t {
+	char *fname;
+	struct stat st;
+	RSA *rsa_key;
+} public_key_t;
+
+static avl_tree_t *public_key_cache;
+
+static int public_key_compare(const public_key_t *a, const public_key_t *b) {
+	return strcmp(a->fname, b->fname);
+}
+
+static void free_public_key(public_key_t *pk) {
+	if(pk->rsa_key)
+		RSA_free(pk->rsa_key);
+
+	free(pk->fname);
+	free(pk);
+}
+
+void flush_public_key_cache(void) {
+	if(public_key_cache) {
+		avl_delete_tree(public_key_cache);
+		public_key_cache = NULL;
+	}
+}
+
+/* Returns a new reference to the key in the PEM file, or NULL without logging why */
+
+static RSA *read_pem_public_key(const char *fname) {
+	public_key_t *pk, search;
+	struct stat st;
 	FILE *fp;
+	RSA *rsa_key;
+
+	if(!public_key_cache)
+		public_key_cache = avl_alloc_tree((avl_compare_t) public_key_compare, (avl_action_t) free_public_key);
+
+	search.fname = (char *)fname;
+	pk = avl_search(public_key_cache, &search);
+
+	if(pk) {
+		if(!stat(fname, &st) && same_file(&pk->st, &st)) {
+			RSA_up_ref(pk->rsa_key);
+			return pk->rsa_key;
+		}
+
+		avl_delete(public_key_cache, pk);
+	}
+
+	fp = fopen(fname, "r");
+
+	if(!fp)
+		return NULL;
+
+	/* If it is not in the traditional format, try PEM_read_RSA_PUBKEY. */
+
+	rsa_key = PEM_read_RSAPublicKey(fp, NULL, NULL, NULL);
+
+	if(!rsa_key) {
+		rewind(fp);
+		rsa_key = PEM_read_RSA_PUBKEY(fp, NULL, NULL, NULL);
+	}
+
+	if(!rsa_key || fstat(fileno(fp), &st)) {
+		fclose(fp);
+		return rsa_key;
+	}
+
+	fclose(fp);
+
+	pk = xmalloc_and_zero(sizeof *pk);
+	pk->fname = xstrdup(fname);
+	pk->st = st;
+	pk->rsa_key = rsa_key;
+	RSA_up_ref(rsa_key);
+	avl_insert(public_key_cache, pk);
+
+	return rsa_key;
+}
+
+bool read_rsa_public_key(connection_t *c) {
 	char *pubname;
 	char *hcfname;
 	char *key;
 
-	if(!c->rsa_key) {
-		c->rsa_key = RSA_new();
-//		RSA_blinding_on(c->rsa_key, NULL);
+	if(c->rsa_key) {
+		RSA_free(c->rsa_key);
+		c->rsa_key = NULL;
 	}
 
 	/* First, check for simple PublicKey statement */
 
 	if(get_config_string(lookup_config(c->config_tree, "PublicKey"), &key)) {
+		c->rsa_key = RSA_new();
+//		RSA_blinding_on(c->rsa_key, NULL);
 		if(BN_hex2bn(&c->rsa_key->n, key) != strlen(key)) {
 			logger(LOG_ERR, "Invalid PublicKey for %s!", c->name);
 			return false;
@@ -79,40 +177,13 @@ bool read_rsa_public_key(connection_t *c) {
 	/* Else, check for PublicKeyFile statement and read it */
 
 	if(get_config_string(lookup_config(c->config_tree, "PublicKeyFile"), &pubname)) {
-		fp = fopen(pubname, "r");
-
-		if(!fp) {
-			logger(LOG_ERR, "Error reading RSA public key file `%s': %s", pubname, strerror(errno));
-			free(pubname);
-			return false;
-		}
-
-		c->rsa_key = PEM_read_RSAPublicKey(fp, &c->rsa_key, NULL, NULL);
-		fclose(fp);
+		c->rsa_key = read_pem_public_key(pubname);
 
 		if(c->rsa_key) {
 			free(pubname);
 			return true;		/* Woohoo. */
 		}
 
-		/* If it fails, try PEM_read_RSA_PUBKEY. */
-		fp = fopen(pubname, "r");
-
-		if(!fp) {
-			logger(LOG_ERR, "Error reading RSA public key file `%s': %s", pubname, strerror(errno));
-			free(pubname);
-			return false;
-		}
-
-		c->rsa_key = PEM_read_RSA_PUBKEY(fp, &c->rsa_key, NULL, NULL);
-		fclose(fp);
-
-		if(c->rsa_key) {
-//				RSA_blinding_on(c->rsa_key, NULL);
-			free(pubname);
-			return true;
-		}
-
 		logger(LOG_ERR, "Reading RSA public key file `%s' failed: %s", pubname, strerror(errno));
 		free(pubname);
 		return false;
@@ -121,43 +192,74 @@ bool read_rsa_public_key(connection_t *c) {
 	/* Else, check if a harnessed public key is in the config file */
 
 	xasprintf(&hcfname, "%s/hosts/%s", confbase, c->name);
-	fp = fopen(hcfname, "r");
+	c->rsa_key = read_pem_public_key(hcfname);
+	free(hcfname);
 
-	if(!fp) {
-		logger(LOG_ERR, "Error reading RSA public key file `%s': %s", hcfname, strerror(errno));
-		free(hcfname);
-		return false;
-	}
+	if(c->rsa_key)
+		return true;
 
-	c->rsa_key = PEM_read_RSAPublicKey(fp, &c->rsa_key, NULL, NULL);
-	fclose(fp);
+	logger(LOG_ERR, "No public key for %s specified!", c->name);
 
-	if(c->rsa_key) {
-		free(hcfname);
-		return true;
-	}
+	return false;
+}
 
-	/* Try again with PEM_read_RSA_PUBKEY. */
+/*
+  On SIGHUP, a connection is only closed if something that was agreed on
+  when it was set up has changed: his public key, or any variable in his
+  host config file other than Subnet and Address. Those two only matter
+  to StrictSubnets and to the next outgoing connection, which both read
+  them again anyway.
+*/
 
-	fp = fopen(hcfname, "r");
+static bool reload_ignored(const config_t *cfg) {
+	return !strcasecmp(cfg->variable, "Subnet") || !strcasecmp(cfg->variable, "Address");
+}
 
-	if(!fp) {
-		logger(LOG_ERR, "Error reading RSA public key file `%s': %s", hcfname, strerror(errno));
-		free(hcfname);
-		return false;
+static bool same_settings(const avl_tree_t *a, const avl_tree_t *b) {
+	avl_node_t *na = a->head, *nb = b->head;
+
+	while(true) {
+		while(na && reload_ignored(na->data))
+			na = na->next;
+		while(nb && reload_ignored(nb->data))
+			nb = nb->next;
+
+		if(!na || !nb)
+			return na == nb;
+
+		const config_t *ca = na->data, *cb = nb->data;
+
+		if(strcasecmp(ca->variable, cb->variable) || strcmp(ca->value, cb->value))
+			return false;
+
+		na = na->next;
+		nb = nb->next;
 	}
+}
 
-	free(hcfname);
-	c->rsa_key = PEM_read_RSA_PUBKEY(fp, &c->rsa_key, NULL, NULL);
-//	RSA_blinding_on(c->rsa_key, NULL);
-	fclose(fp);
+/* Returns false if he has to reconnect. Either way he is left with the new configuration. */
 
-	if(c->rsa_key)
-		return true;
+bool reload_connection_config(connection_t *c) {
+	avl_tree_t *old_tree = c->config_tree;
+	RSA *old_key = c->rsa_key;
+	bool same;
 
-	logger(LOG_ERR, "No public key for %s specified!", c->name);
+	init_configuration(&c->config_tree);
+	c->rsa_key = NULL;
 
-	return false;
+	same = read_connection_config(c)
+		&& same_settings(old_tree, c->config_tree)
+		&& old_key
+		&& read_rsa_public_key(c)
+		&& !BN_cmp(old_key->n, c->rsa_key->n)
+		&& !BN_cmp(old_key->e, c->rsa_key->e);
+
+	exit_configuration(&old_tree);
+
+	if(old_key)
+		RSA_free(old_key);
+
+	return same;
 }
 
 static bool read_rsa_private_key(void) {
@@ -227,13 +329,117 @@ static bool read_rsa_private_key(void) {
 /*
   Read Subnets from all host config files
 */
+/*
+  The Subnets in every host file are kept after load_all_subnets() has read
+  them, so that a reload only parses the files that stat() says have changed.
+  Unlike the other caches this one survives SIGHUP, since that is exactly
+  when it is needed. Entries for files that have disappeared are dropped
+  every time the hosts directory is read.
+*/
+
+typedef struct host_subnets_t {
+	char *name;
+	struct stat st;
+	int count;
+	subnet_t *subnets;			/* parsed Subnets, without an owner */
+} host_subnets_t;
+
+static avl_tree_t *host_subnets_cache;
+
+static int host_subnets_compare(const host_subnets_t *a, const host_subnets_t *b) {
+	return strcmp(a->name, b->name);
+}
+
+static void free_host_subnets(host_subnets_t *hs) {
+	free(hs->subnets);
+	free(hs->name);
+	free(hs);
+}
+
+static avl_tree_t *new_host_subnets_cache(void) {
+	return avl_alloc_tree((avl_compare_t) host_subnets_compare, (avl_action_t) free_host_subnets);
+}
+
+static void flush_host_subnets_cache(void) {
+	if(host_subnets_cache) {
+		avl_delete_tree(host_subnets_cache);
+		host_subnets_cache = NULL;
+	}
+}
+
+/* Move the entry for this host from the old cache to the new one, parsing his file again if needed */
+
+static host_subnets_t *read_host_subnets(avl_tree_t *old, const char *name) {
+	host_subnets_t *hs, search;
+	avl_node_t *node;
+	avl_tree_t *config_tree;
+	config_t *cfg;
+	subnet_t *s;
+	struct stat st;
+	char *fname;
+	bool ok;
+
+	xasprintf(&fname, "%s/hosts/%s", confbase, name);
+
+	search.name = (char *)name;
+	node = old ? avl_unlink(old, &search) : NULL;
+	hs = node ? node->data : NULL;
+
+	if(stat(fname, &st)) {
+		logger(LOG_ERR, "Cannot open config file %s: %s", fname, strerror(errno));
+		free(fname);
+		if(node)
+			avl_free_node(old, node);
+		return NULL;
+	}
+
+	if(hs && same_file(&hs->st, &st)) {
+		free(fname);
+		avl_insert_node(host_subnets_cache, node);
+		return hs;
+	}
+
+	if(node)
+		avl_free_node(old, node);
+
+	init_configuration(&config_tree);
+	read_config_options(config_tree, name);
+	ok = read_config_file(config_tree, fname);
+	free(fname);
+
+	hs = xmalloc_and_zero(sizeof *hs);
+	hs->name = xstrdup(name);
+	hs->st = st;
+
+	for(cfg = lookup_config(config_tree, "Subnet"); cfg; cfg = lookup_config_next(config_tree, cfg)) {
+		if(!get_config_subnet(cfg, &s))
+			continue;
+
+		hs->subnets = xrealloc(hs->subnets, (hs->count + 1) * sizeof *hs->subnets);
+		hs->subnets[hs->count++] = *s;
+		free_subnet(s);
+	}
+
+	exit_configuration(&config_tree);
+
+	/* A file that could not be parsed is tried again next time */
+
+	if(!ok) {
+		free_host_subnets(hs);
+		return NULL;
+	}
+
+	avl_insert(host_subnets_cache, hs);
+
+	return hs;
+}
+
 void load_all_subnets(void) {
 	DIR *dir;
 	struct dirent *ent;
 	char *dname;
-	char *fname;
-	avl_tree_t *config_tree;
-	config_t *cfg;
+	avl_tree_t *old;
+	host_subnets_t *hs;
 	subnet_t *s, *s2;
 	node_t *n;
 
@@ -245,6 +451,11 @@ void load_all_subnets(void) {
 		return;
 	}
 
+	free(dname);
+
+	old = host_subnets_cache;
+	host_subnets_cache = new_host_subnets_cache();
+
 	while((ent = readdir(dir))) {
 		if(!check_id(ent->d_name))
 			continue;
@@ -255,11 +466,7 @@ void load_all_subnets(void) {
 		//	continue;
 		#endif
 
-		xasprintf(&fname, "%s/hosts/%s", confbase, ent->d_name);
-		init_configuration(&config_tree);
-		read_config_options(config_tree, ent->d_name);
-		read_config_file(config_tree, fname);
-		free(fname);
+		hs = read_host_subnets(old, ent->d_name);
 
 		if(!n) {
 			n = new_node();
@@ -267,21 +474,21 @@ void load_all_subnets(void) {
 			node_add(n);
 		}
 
-		for(cfg = lookup_config(config_tree, "Subnet"); cfg; cfg = lookup_config_next(config_tree, cfg)) {
-			if(!get_config_subnet(cfg, &s))
-				continue;
-
-			if((s2 = lookup_subnet(n, s))) {
+		for(int i = 0; hs && i < hs->count; i++) {
+			if((s2 = lookup_subnet(n, &hs->subnets[i]))) {
 				s2->expires = -1;
 			} else {
+				s = new_subnet();
+				*s = hs->subnets[i];
 				subnet_add(n, s);
 			}
 		}
-
-		exit_configuration(&config_tree);
 	}
 
 	closedir(dir);
+
+	if(old)
+		avl_delete_tree(old);
 }
 
 char *get_name(void) {
@@ -346,6 +553,10 @@ static bool setup_myself(void) {
 	myself = new_node();
 	myself->connection = new_connection();
 
+	/* The cipher, digest and compression others should use for packets to us are kept here */
+
+	node_tunnel(myself);
+
 	myself->hostname = xstrdup("MYSELF");
 	myself->connection->hostname = xstrdup("MYSELF");
 
@@ -478,6 +689,7 @@ static bool setup_myself(void) {
 	get_config_bool(lookup_config(config_tree, "StrictSubnets"), &strictsubnets);
 	get_config_bool(lookup_config(config_tree, "TunnelServer"), &tunnelserver);
 	get_config_bool(lookup_config(config_tree, "LocalDiscovery"), &localdiscovery);
+	get_config_bool(lookup_config(config_tree, "SessionID"), &sessionids);
 	strictsubnets |= tunnelserver;
 
 	if(get_config_string(lookup_config(config_tree, "Mode"), &mode)) {
@@ -515,12 +727,45 @@ static bool setup_myself(void) {
 	if(choice)
 		myself->options |= OPTION_PMTU_DISCOVERY;
 
+	int frame_size = MTU;
+
+	if(get_config_int(lookup_config(config_tree, "MaxFrameSize"), &frame_size) && (frame_size < MINMTU || frame_size > MTU)) {
+		logger(LOG_ERR, "MaxFrameSize must be between %d and %d!", MINMTU, MTU);
+		return false;
+	}
+
+	max_frame_size = frame_size;
+	max_packet_size = PACKET_SIZE(max_frame_size);
+	myself->mtu = myself->maxmtu = max_frame_size;
+
 	choice = true;
 	get_config_bool(lookup_config(config_tree, "ClampMSS"), &choice);
 	if(choice)
 		myself->options |= OPTION_CLAMP_MSS;
 
 	get_config_bool(lookup_config(config_tree, "PriorityInheritance"), &priorityinheritance);
+	get_config_bool(lookup_config(config_tree, "FairQueueing"), &fair_queueing);
+	get_config_bool(lookup_config(config_tree, "CryptoPipeline"), &crypto_pipeline);
+	get_config_bool(lookup_config(config_tree, "Aggregation"), &aggregation);
+
+	if(get_config_int(lookup_config(config_tree, "AggregationDelay"), &aggregation_delay) && (aggregation_delay < 0 || aggregation_delay > 1000)) {
+		logger(LOG_ERR, "AggregationDelay must be between 0 and 1000!");
+		return false;
+	}
+
+	get_config_bool(lookup_config(config_tree, "Fragmentation"), &fragmentation);
+	get_config_bool(lookup_config(config_tree, "Multipath"), &multipath);
+
+	if(get_config_int(lookup_config(config_tree, "IngressRate"), &ingress_rate) && ingress_rate < 0) {
+		logger(LOG_ERR, "IngressRate cannot be negative!");
+		return false;
+	}
+
+	if(get_config_int(lookup_config(config_tree, "EgressRate"), &egress_rate) && egress_rate < 0) {
+		logger(LOG_ERR, "EgressRate cannot be negative!");
+		return false;
+	}
+
 	get_config_bool(lookup_config(config_tree, "DecrementTTL"), &decrement_ttl);
 	if(get_config_string(lookup_config(config_tree, "Broadcast"), &mode)) {
 		if(!strcasecmp(mode, "no"))
@@ -547,9 +792,58 @@ static bool setup_myself(void) {
 		logger(LOG_WARNING, "%s not supported on this platform for IPv6 connection", "PriorityInheritance");
 #endif
 
+#ifndef HAVE_SENDMMSG
+	if(fair_queueing) {
+		logger(LOG_WARNING, "%s not supported on this platform", "FairQueueing");
+		fair_queueing = false;
+	}
+#endif
+
 	if(!get_config_int(lookup_config(config_tree, "MACExpire"), &macexpire))
 		macexpire = 600;
 
+	get_config_bool(lookup_config(config_tree, "MulticastSnooping"), &multicast_snooping);
+	get_config_int(lookup_config(config_tree, "NeighborCacheSize"), &neighbor_cache_size);
+	init_neighbors();
+
+	if(get_config_int(lookup_config(config_tree, "GraphUpdateDelay"), &graph_delay) && graph_delay < 0) {
+		logger(LOG_ERR, "GraphUpdateDelay cannot be negative!");
+		return false;
+	}
+
+	get_config_bool(lookup_config(config_tree, "LatencyRouting"), &latency_routing);
+
+	get_config_bool(lookup_config(config_tree, "FlapDamping"), &damping);
+
+	if(get_config_int(lookup_config(config_tree, "FlapDampingHalfLife"), &damping_half_life) && damping_half_life < 1) {
+		logger(LOG_ERR, "FlapDampingHalfLife must be at least 1 second!");
+		return false;
+	}
+
+	get_config_int(lookup_config(config_tree, "FlapDampingSuppress"), &damping_suppress);
+	get_config_int(lookup_config(config_tree, "FlapDampingReuse"), &damping_reuse);
+
+	if(damping_reuse < 1 || damping_suppress <= damping_reuse) {
+		logger(LOG_ERR, "FlapDampingSuppress must be larger than FlapDampingReuse, which must be positive!");
+		return false;
+	}
+
+	if(get_config_int(lookup_config(config_tree, "ResumeTimeout"), &resume_timeout) && resume_timeout < 0) {
+		logger(LOG_ERR, "ResumeTimeout cannot be negative!");
+		return false;
+	}
+
+	if(get_config_int(lookup_config(config_tree, "ScriptsMaxProcesses"), &script_max)) {
+		if(script_max < 1) {
+			logger(LOG_ERR, "ScriptsMaxProcesses must be at least 1!");
+			return false;
+		}
+	} else
+		script_max = 1;
+
+	if(!get_config_bool(lookup_config(config_tree, "ScriptsBatch"), &script_batch))
+		script_batch = false;
+
 	if(get_config_int(lookup_config(config_tree, "MaxTimeout"), &maxtimeout)) {
 		if(maxtimeout <= 0) {
 			logger(LOG_ERR, "Bogus maximum timeout!");
@@ -584,12 +878,47 @@ static bool setup_myself(void) {
 		}
 	}
 
+	if(!get_config_int(lookup_config(config_tree, "UDPRcvBufMax"), &udp_rcvbuf_max))
+		udp_rcvbuf_max = low_memory ? 0 : 4194304;
+
+	if(!get_config_int(lookup_config(config_tree, "UDPSndBufMax"), &udp_sndbuf_max))
+		udp_sndbuf_max = low_memory ? 0 : 4194304;
+
+	if(udp_rcvbuf_max < 0 || udp_sndbuf_max < 0) {
+		logger(LOG_ERR, "UDPRcvBufMax and UDPSndBufMax cannot be negative!");
+		return false;
+	}
+
+	get_config_bool(lookup_config(config_tree, "UDPGRO"), &udp_gro);
+
+	if(get_config_int(lookup_config(config_tree, "UDPSockets"), &udp_sockets)) {
+		if(udp_sockets < 1 || udp_sockets > MAXSHARDS) {
+			logger(LOG_ERR, "UDPSockets must be between 1 and %d!", MAXSHARDS);
+			return false;
+		}
+
+#ifndef SO_REUSEPORT
+		if(udp_sockets > 1) {
+			logger(LOG_WARNING, "UDPSockets is not supported on this platform");
+			udp_sockets = 1;
+		}
+#endif
+	}
+
+#ifndef HAVE_UDP_GRO
+	if(udp_gro) {
+		logger(LOG_WARNING, "UDPGRO is not supported on this platform");
+		udp_gro = false;
+	}
+#endif
+
 	if(get_config_int(lookup_config(config_tree, "ReplayWindow"), &replaywin_int)) {
 		if(replaywin_int < 0) {
 			logger(LOG_ERR, "ReplayWindow cannot be negative!");
 			return false;
 		}
-		replaywin = (unsigned)replaywin_int;
+		/* The window is kept in 64 bit words */
+		replaywin = ((unsigned)replaywin_int + 7) & ~7U;
 	}
 
 	if(get_config_string(lookup_config(config_tree, "AddressFamily"), &afname)) {
@@ -613,11 +942,11 @@ static bool setup_myself(void) {
 
 	if(get_config_string(lookup_config(config_tree, "Cipher"), &cipher)) {
 		if(!strcasecmp(cipher, "none")) {
-			myself->incipher = NULL;
+			myself->tunnel->incipher = NULL;
 		} else {
-			myself->incipher = EVP_get_cipherbyname(cipher);
+			myself->tunnel->incipher = EVP_get_cipherbyname(cipher);
 
-			if(!myself->incipher) {
+			if(!myself->tunnel->incipher) {
 				logger(LOG_ERR, "Unrecognized cipher type!");
 				free(cipher);
 				return false;
@@ -625,12 +954,12 @@ static bool setup_myself(void) {
 		}
 		free(cipher);
 	} else
-		myself->incipher = EVP_bf_cbc();
+		myself->tunnel->incipher = EVP_bf_cbc();
 
-	if(myself->incipher)
-		myself->inkeylength = myself->incipher->key_len + myself->incipher->iv_len;
+	if(myself->tunnel->incipher)
+		myself->tunnel->inkeylength = myself->tunnel->incipher->key_len + myself->tunnel->incipher->iv_len;
 	else
-		myself->inkeylength = 1;
+		myself->tunnel->inkeylength = 1;
 
 	myself->connection->outcipher = EVP_bf_ofb();
 
@@ -638,16 +967,23 @@ static bool setup_myself(void) {
 		keylifetime = 3600;
 
 	keyexpires = now + keylifetime;
+
+	tunnel_idle_timeout = low_memory ? 60 : 600;
+
+	if(get_config_int(lookup_config(config_tree, "KeyIdleTimeout"), &tunnel_idle_timeout) && tunnel_idle_timeout < 0) {
+		logger(LOG_ERR, "KeyIdleTimeout cannot be negative!");
+		return false;
+	}
 	
 	/* Check if we want to use message authentication codes... */
 
 	if(get_config_string(lookup_config(config_tree, "Digest"), &digest)) {
 		if(!strcasecmp(digest, "none")) {
-			myself->indigest = NULL;
+			myself->tunnel->indigest = NULL;
 		} else {
-			myself->indigest = EVP_get_digestbyname(digest);
+			myself->tunnel->indigest = EVP_get_digestbyname(digest);
 
-			if(!myself->indigest) {
+			if(!myself->tunnel->indigest) {
 				logger(LOG_ERR, "Unrecognized digest type!");
 				free(digest);
 				return false;
@@ -656,37 +992,70 @@ static bool setup_myself(void) {
 
 		free(digest);
 	} else
-		myself->indigest = EVP_sha1();
+		myself->tunnel->indigest = EVP_sha1();
 
 	myself->connection->outdigest = EVP_sha1();
 
-	if(get_config_int(lookup_config(config_tree, "MACLength"), &myself->inmaclength)) {
-		if(myself->indigest) {
-			if(myself->inmaclength > myself->indigest->md_size) {
+	if(get_config_int(lookup_config(config_tree, "MACLength"), &myself->tunnel->inmaclength)) {
+		if(myself->tunnel->indigest) {
+			if(myself->tunnel->inmaclength > myself->tunnel->indigest->md_size) {
 				logger(LOG_ERR, "MAC length exceeds size of digest!");
 				return false;
-			} else if(myself->inmaclength < 0) {
+			} else if(myself->tunnel->inmaclength < 0) {
 				logger(LOG_ERR, "Bogus MAC length!");
 				return false;
 			}
 		}
 	} else
-		myself->inmaclength = 4;
+		myself->tunnel->inmaclength = 4;
+
+	/* AEAD ciphers authenticate packets themselves, a HMAC would only add overhead */
+
+	if(CIPHER_IS_AEAD(myself->tunnel->incipher)) {
+		if(myself->tunnel->indigest && lookup_config(config_tree, "Digest"))
+			logger(LOG_NOTICE, "Ignoring Digest, cipher %s already authenticates packets", OBJ_nid2sn(EVP_CIPHER_nid(myself->tunnel->incipher)));
+
+		myself->tunnel->indigest = NULL;
+		myself->tunnel->inmaclength = 0;
+	}
 
 	myself->connection->outmaclength = 0;
 
+	if(get_config_bool(lookup_config(config_tree, "CryptoSelfTest"), &choice) && choice)
+		check_crypto_speed();
+
 	/* Compression */
 
-	if(get_config_int(lookup_config(config_tree, "Compression"), &myself->incompression)) {
-		if(myself->incompression < 0 || myself->incompression > 11) {
+	if(get_config_int(lookup_config(config_tree, "Compression"), &myself->tunnel->incompression)) {
+		if(myself->tunnel->incompression < 0 || myself->tunnel->incompression > COMPRESS_MAX_LEVEL) {
 			logger(LOG_ERR, "Bogus compression level!");
 			return false;
 		}
+
+		if(!compression_supported(myself->tunnel->incompression)) {
+			logger(LOG_ERR, "Compression level %d is not supported by this build of tinc!", myself->tunnel->incompression);
+			return false;
+		}
 	} else
-		myself->incompression = 0;
+		myself->tunnel->incompression = 0;
 
 	myself->connection->outcompression = 0;
 
+	if(get_config_int(lookup_config(config_tree, "MetaCompression"), &metacompression)) {
+		if(metacompression < 0 || metacompression > 9) {
+			logger(LOG_ERR, "Bogus meta compression level!");
+			return false;
+		}
+
+#ifndef HAVE_ZLIB
+		if(metacompression) {
+			logger(LOG_ERR, "Compression of metadata is not supported by this build of tinc!");
+			return false;
+		}
+#endif
+	} else
+		metacompression = 0;
+
 	/* Done */
 
 	myself->nexthop = myself;
@@ -778,6 +1147,8 @@ static bool setup_myself(void) {
 			if(listen_socket[i].udp < 0)
 				return false;
 
+			setup_udp_shards(&listen_socket[i]);
+
 			ifdebug(CONNECTIONS) {
 				hostname = sockaddr2hostname(&sa);
 				logger(LOG_NOTICE, "Listening on %s", hostname);
@@ -844,6 +1215,8 @@ static bool setup_myself(void) {
 				if(listen_socket[listen_sockets].udp < 0)
 					continue;
 
+				setup_udp_shards(&listen_socket[listen_sockets]);
+
 				ifdebug(CONNECTIONS) {
 					hostname = sockaddr2hostname((sockaddr_t *) aip->ai_addr);
 					logger(LOG_NOTICE, "Listening on %s", hostname);
@@ -876,6 +1249,21 @@ static bool setup_myself(void) {
 		}
 	}
 
+	/* Register the device and listening sockets for readiness notification */
+
+	if(device_fd >= 0)
+		io_add(&device_io, handle_device_data, NULL, device_fd, IO_READ);
+
+	for(i = 0; i < listen_sockets; i++) {
+		io_add(&listen_socket[i].tcp_io, handle_new_meta_connection, &listen_socket[i], listen_socket[i].tcp, IO_READ);
+		io_add(&listen_socket[i].udp_io, handle_incoming_vpn_data, &listen_socket[i], listen_socket[i].udp, IO_READ);
+
+		for(int j = 0; j < listen_socket[i].shards; j++)
+			io_add(&listen_socket[i].shard[j].udp_io, handle_incoming_shard_data, &listen_socket[i].shard[j], listen_socket[i].shard[j].udp, IO_READ);
+	}
+
+	init_udp_buffers();
+
 	/* Done. */
 
 	logger(LOG_NOTICE, "Ready");
@@ -886,13 +1274,27 @@ static bool setup_myself(void) {
   initialize network
 */
 bool setup_network(void) {
+	char *value;
+
 	now = time(NULL);
 
+	/* LowMemory only changes defaults, anything configured explicitly still applies */
+
+	low_memory = false;
+	get_config_bool(lookup_config(config_tree, "LowMemory"), &low_memory);
+
+	subnet_cache_size = low_memory ? 64 : 1024;
+	get_config_int(lookup_config(config_tree, "SubnetCacheSize"), &subnet_cache_size);
+
 	init_events();
+	if(!init_io())
+		return false;
 	init_connections();
 	init_subnets();
 	init_nodes();
 	init_edges();
+	init_damping();
+	init_resume();
 	init_requests();
 
 	if(get_config_int(lookup_config(config_tree, "PingInterval"), &pinginterval)) {
@@ -902,17 +1304,56 @@ bool setup_network(void) {
 	} else
 		pinginterval = 60;
 
-	if(!get_config_int(lookup_config(config_tree, "PingTimeout"), &pingtimeout))
-		pingtimeout = 5;
-	if(pingtimeout < 1 || pingtimeout > pinginterval)
-		pingtimeout = pinginterval;
+	/* PingTimeout may have a fraction, so dead connections can be detected within a second */
+
+	if(get_config_string(lookup_config(config_tree, "PingTimeout"), &value)) {
+		pingtimeout_msec = atof(value) * 1000;
+		free(value);
+	} else
+		pingtimeout_msec = 5000;
+	if(pingtimeout_msec < 1 || pingtimeout_msec > pinginterval * 1000)
+		pingtimeout_msec = pinginterval * 1000;
+
+	/* The periodic checks in main_loop() still run every whole PingTimeout seconds */
+
+	pingtimeout = (pingtimeout_msec + 999) / 1000;
 
 	if(!get_config_int(lookup_config(config_tree, "MaxOutputBufferSize"), &maxoutbufsize))
-		maxoutbufsize = 10 * MTU;
+		maxoutbufsize = (low_memory ? 4 : 10) * max_frame_size;
+
+	if(!get_config_int(lookup_config(config_tree, "LogRateLimit"), &logratelimit))
+		logratelimit = 10;
+
+	if(!get_config_int(lookup_config(config_tree, "MaxHandshakes"), &max_handshakes))
+		max_handshakes = 0;
+
+	if(get_config_int(lookup_config(config_tree, "ConnectionRate"), &connection_rate) && connection_rate < 0) {
+		logger(LOG_ERR, "ConnectionRate cannot be negative!");
+		return false;
+	}
 
 	if(!setup_myself())
 		return false;
 
+	if(!init_capture())
+		return false;
+
+	if(!init_flows())
+		return false;
+
+	if(!init_workers())
+		return false;
+
+	if(crypto_pipeline && !worker_threads) {
+		logger(LOG_WARNING, "CryptoPipeline needs CryptoThreads, ignoring it");
+		crypto_pipeline = false;
+	}
+
+	get_config_string(lookup_config(config_tree, "ControlSocket"), &controlsocketname);
+
+	if(!init_control())
+		return false;
+
 	return true;
 }
 
@@ -932,11 +1373,18 @@ void close_network_connections(void) {
 		terminate_connection(c, false);
 	}
 
+	/* Let the host-down scripts run for every node that became unreachable */
+
+	graph();
+
+	/* Workers may still use our private key */
+
+	exit_workers();
+
 	for(list_node_t *node = outgoing_list->head; node; node = node->next) {
 		outgoing_t *outgoing = node->data;
 
-		if(outgoing->event)
-			event_del(outgoing->event);
+		event_del(&outgoing->event);
 	}
 
 	list_delete_list(outgoing_list);
@@ -948,21 +1396,45 @@ void close_network_connections(void) {
 	}
 
 	for(i = 0; i < listen_sockets; i++) {
+		io_del(&listen_socket[i].tcp_io);
+		io_del(&listen_socket[i].udp_io);
 		close(listen_socket[i].tcp);
 		close(listen_socket[i].udp);
+
+		for(int j = 0; j < listen_socket[i].shards; j++) {
+			io_del(&listen_socket[i].shard[j].udp_io);
+			close(listen_socket[i].shard[j].udp);
+		}
 	}
 
+	exit_udp_buffers();
+	io_del(&device_io);
+
+	exit_control();
+	exit_capture();
+	exit_flows();
+	flush_host_config_cache();
+	flush_host_subnets_cache();
+	flush_public_key_cache();
+
 	xasprintf(&envp[0], "NETNAME=%s", netname ? : "");
 	xasprintf(&envp[1], "DEVICE=%s", device ? : "");
 	xasprintf(&envp[2], "INTERFACE=%s", iface ? : "");
 	xasprintf(&envp[3], "NAME=%s", myself->name);
 
 	exit_requests();
+	exit_damping();
+	exit_resume();
 	exit_edges();
 	exit_subnets();
+	exit_neighbors();
 	exit_nodes();
+	exit_graph();
 	exit_connections();
 	exit_events();
+	exit_io();
+	exit_packets();
+	exit_scripts();
 
 	execute_script("tinc-down", envp);
 
@@ -971,6 +1443,7 @@ void close_network_connections(void) {
 	for(i = 0; i < 4; i++)
 		free(envp[i]);
 
+	flush_device_queue();
 	devops.close();
 
 	return;
@@ -22,6 +22,10 @@
 
 #include "system.h"
 
+#ifdef HAVE_LINUX_SOCK_DIAG_H
+#include <linux/sock_diag.h>
+#endif
+
 #include "avl_tree.h"
 #include "conf.h"
 #include "connection.h"
@@ -32,6 +36,7 @@
 #include "netutl.h"
 #include "protocol.h"
 #include "utils.h"
+#include "worker.h"
 #include "xalloc.h"
 
 /* Needed on Mac OS/X */
@@ -39,12 +44,33 @@
 #define SOL_TCP IPPROTO_TCP
 #endif
 
+/* Not every system can exceed the administrator's limit on socket buffer sizes */
+#ifndef SO_RCVBUFFORCE
+#define SO_RCVBUFFORCE -1
+#endif
+#ifndef SO_SNDBUFFORCE
+#define SO_SNDBUFFORCE -1
+#endif
+
+/* Linux counts the datagrams it dropped for a socket, see check_udp_buffers() */
+#if defined(SO_MEMINFO) && defined(HAVE_LINUX_SOCK_DIAG_H)
+#define HAVE_SOCKET_DROPS
+#endif
+
 int addressfamily = AF_UNSPEC;
 int mintimeout = 0;
 int maxtimeout = 900;
 int seconds_till_retry = 5;
 int udp_rcvbuf = 0;
 int udp_sndbuf = 0;
+int udp_rcvbuf_max = 0;
+int udp_sndbuf_max = 0;
+bool udp_gro = false;
+int udp_sockets = 1;
+int max_handshakes = 0;
+int connection_rate = 0;
+uint64_t connections_accepted = 0;
+uint64_t connections_rejected = 0;
 
 listen_socket_t listen_socket[MAXSOCKETS];
 int listen_sockets;
@@ -52,36 +78,36 @@ list_t *outgoing_list = NULL;
 
 /* Setup sockets */
 
-static void configure_tcp(connection_t *c) {
+static void configure_tcp(int sd, const char *hostname) {
 	int option;
 
 #ifdef O_NONBLOCK
-	int flags = fcntl(c->socket, F_GETFL);
+	int flags = fcntl(sd, F_GETFL);
 
-	if(fcntl(c->socket, F_SETFL, flags | O_NONBLOCK) < 0) {
-		logger(LOG_ERR, "fcntl for %s: %s", c->hostname, strerror(errno));
+	if(fcntl(sd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		logger(LOG_ERR, "fcntl for %s: %s", hostname, strerror(errno));
 	}
 #elif defined(WIN32)
 	unsigned long arg = 1;
 
-	if(ioctlsocket(c->socket, FIONBIO, &arg) != 0) {
-		logger(LOG_ERR, "ioctlsocket for %s: %s", c->hostname, sockstrerror(sockerrno));
+	if(ioctlsocket(sd, FIONBIO, &arg) != 0) {
+		logger(LOG_ERR, "ioctlsocket for %s: %s", hostname, sockstrerror(sockerrno));
 	}
 #endif
 
 #if defined(SOL_TCP) && defined(TCP_NODELAY)
 	option = 1;
-	setsockopt(c->socket, SOL_TCP, TCP_NODELAY, (void *)&option, sizeof(option));
+	setsockopt(sd, SOL_TCP, TCP_NODELAY, (void *)&option, sizeof(option));
 #endif
 
 #if defined(SOL_IP) && defined(IP_TOS) && defined(IPTOS_LOWDELAY)
 	option = IPTOS_LOWDELAY;
-	setsockopt(c->socket, SOL_IP, IP_TOS, (void *)&option, sizeof(option));
+	setsockopt(sd, SOL_IP, IP_TOS, (void *)&option, sizeof(option));
 #endif
 
 #if defined(IPPROTO_IPV6) && defined(IPV6_TCLASS) && defined(IPTOS_LOWDELAY)
 	option = IPTOS_LOWDELAY;
-	setsockopt(c->socket, IPPROTO_IPV6, IPV6_TCLASS, (void *)&option, sizeof(option));
+	setsockopt(sd, IPPROTO_IPV6, IPV6_TCLASS, (void *)&option, sizeof(option));
 #endif
 }
 
@@ -132,6 +158,15 @@ int setup_listen_socket(const sockaddr_t *sa) {
 	fcntl(nfd, F_SETFD, FD_CLOEXEC);
 #endif
 
+	/* handle_new_meta_connection() accepts until the backlog is empty */
+
+#ifdef O_NONBLOCK
+	fcntl(nfd, F_SETFL, fcntl(nfd, F_GETFL) | O_NONBLOCK);
+#elif defined(WIN32)
+	unsigned long arg = 1;
+	ioctlsocket(nfd, FIONBIO, &arg);
+#endif
+
 	/* Optimize TCP settings */
 
 	option = 1;
@@ -179,6 +214,39 @@ int setup_listen_socket(const sockaddr_t *sa) {
 	return nfd;
 }
 
+/*
+  Return the path MTU to an address the kernel has learned from ICMP
+  "fragmentation needed" or "packet too big" messages, or 0 if unknown.
+  A socket only reports it once it is connected to the destination,
+  so a temporary one is used.
+*/
+
+int get_path_mtu(const sockaddr_t *sa) {
+	int mtu = 0;
+
+#if defined(IPPROTO_IP) && defined(IP_MTU) && defined(IPPROTO_IPV6) && defined(IPV6_MTU)
+	socklen_t len = sizeof mtu;
+	int fd;
+
+	if(sa->sa.sa_family != AF_INET && sa->sa.sa_family != AF_INET6)
+		return 0;
+
+	fd = socket(sa->sa.sa_family, SOCK_DGRAM, IPPROTO_UDP);
+
+	if(fd < 0)
+		return 0;
+
+	if(connect(fd, &sa->sa, SALEN(sa->sa))
+			|| getsockopt(fd, sa->sa.sa_family == AF_INET ? IPPROTO_IP : IPPROTO_IPV6,
+				sa->sa.sa_family == AF_INET ? IP_MTU : IPV6_MTU, (void *)&mtu, &len))
+		mtu = 0;
+
+	closesocket(fd);
+#endif
+
+	return mtu;
+}
+
 int setup_vpn_in_socket(const sockaddr_t *sa) {
 	int nfd;
 	char *addrstr;
@@ -227,6 +295,20 @@ int setup_vpn_in_socket(const sockaddr_t *sa) {
 	if(udp_sndbuf && setsockopt(nfd, SOL_SOCKET, SO_SNDBUF, (void *)&udp_sndbuf, sizeof(udp_sndbuf)))
 		logger(LOG_WARNING, "Can't set UDP SO_SNDBUF to %i: %s", udp_sndbuf, strerror(errno));
 
+#ifdef SO_REUSEPORT
+	if(udp_sockets > 1 && setsockopt(nfd, SOL_SOCKET, SO_REUSEPORT, (void *)&option, sizeof(option)))
+		logger(LOG_WARNING, "Can't set SO_REUSEPORT on UDP socket: %s", strerror(errno));
+#endif
+
+#ifdef HAVE_UDP_GRO
+	/* Without it, handle_incoming_vpn_data() just gets one datagram per buffer */
+
+	if(udp_gro && setsockopt(nfd, SOL_UDP, UDP_GRO, (void *)&option, sizeof(option))) {
+		logger(LOG_WARNING, "Can't enable UDP GRO: %s", strerror(errno));
+		udp_gro = false;
+	}
+#endif
+
 #if defined(IPPROTO_IPV6) && defined(IPV6_V6ONLY)
 	if(sa->sa.sa_family == AF_INET6)
 		setsockopt(nfd, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&option, sizeof option);
@@ -276,6 +358,162 @@ int setup_vpn_in_socket(const sockaddr_t *sa) {
 	return nfd;
 } /* int setup_vpn_in_socket */
 
+/*
+  Open the extra UDP sockets for a listen socket, bound to the same address
+  and port. The kernel spreads the peers over them by their address and port,
+  so each socket has its own receive queue and buffer space.
+*/
+
+void setup_udp_shards(listen_socket_t *ls) {
+	sockaddr_t sa;
+	socklen_t salen = sizeof sa;
+
+	ls->shards = 0;
+
+	if(udp_sockets <= 1 || getsockname(ls->udp, &sa.sa, &salen))
+		return;
+
+	while(ls->shards < udp_sockets - 1) {
+		int fd = setup_vpn_in_socket(&sa);
+
+		if(fd < 0)
+			break;
+
+		ls->shard[ls->shards].udp = fd;
+		ls->shard[ls->shards].ls = ls;
+		ls->shards++;
+	}
+}
+
+/*
+  UDPRcvBufMax and UDPSndBufMax.
+
+  Once a second, every UDP socket is checked for datagrams the kernel dropped
+  because its receive buffer was full, and for sends that failed because its
+  send buffer or the interface queue was full. A socket that had any gets
+  its buffer doubled, up to the configured maximum. Buffers never shrink;
+  the kernel only uses the memory when packets actually pile up.
+*/
+
+#define UDP_BUFFER_INTERVAL 1000		/* milliseconds between checks */
+
+static event_t udp_buffer_event;
+
+static int get_buffer_size(int fd, int option) {
+	int size = 0;
+	socklen_t len = sizeof size;
+
+	if(getsockopt(fd, SOL_SOCKET, option, (void *)&size, &len))
+		return 0;
+
+	return size;
+}
+
+static bool get_socket_drops(int fd, uint32_t *drops) {
+#ifdef HAVE_SOCKET_DROPS
+	uint32_t meminfo[SK_MEMINFO_VARS];
+	socklen_t len = sizeof meminfo;
+
+	if(getsockopt(fd, SOL_SOCKET, SO_MEMINFO, (void *)meminfo, &len) || len <= SK_MEMINFO_DROPS * sizeof *meminfo)
+		return false;
+
+	*drops = meminfo[SK_MEMINFO_DROPS];
+	return true;
+#else
+	return false;
+#endif
+}
+
+static void init_udp_buffer(int fd, udp_buffer_t *buf) {
+	buf->rcvbuf = get_buffer_size(fd, SO_RCVBUF);
+	buf->sndbuf = get_buffer_size(fd, SO_SNDBUF);
+	buf->rcvwant = udp_rcvbuf ? udp_rcvbuf : buf->rcvbuf;
+	buf->sndwant = udp_sndbuf ? udp_sndbuf : buf->sndbuf;
+	get_socket_drops(fd, &buf->kernel_drops);
+}
+
+/* Privileged processes may go beyond net.core.rmem_max and wmem_max, others get silently capped */
+
+static void grow_udp_buffer(const listen_socket_t *ls, int fd, int option, int force, int *want, int *size, int max, uint64_t events) {
+	const char *what = option == SO_RCVBUF ? "receive" : "send";
+	int newsize = *want <= max / 2 ? *want * 2 : max;
+	int got;
+
+	if(newsize <= *want)
+		return;
+
+	if(force < 0 || setsockopt(fd, SOL_SOCKET, force, (void *)&newsize, sizeof newsize))
+		setsockopt(fd, SOL_SOCKET, option, (void *)&newsize, sizeof newsize);
+
+	got = get_buffer_size(fd, option);
+
+	char *hostname = sockaddr2hostname(&ls->sa);
+
+	if(got <= *size) {
+		logger(LOG_WARNING, "Can't grow UDP %s buffer on %s beyond %d bytes after %"PRIu64" %s", what, hostname, *size, events, option == SO_RCVBUF ? "drops" : "failed sends");
+		*want = max;
+	} else {
+		logger(LOG_NOTICE, "Grew UDP %s buffer on %s to %d bytes after %"PRIu64" %s", what, hostname, got, events, option == SO_RCVBUF ? "drops" : "failed sends");
+		*want = newsize;
+		*size = got;
+	}
+
+	free(hostname);
+}
+
+static void check_udp_buffer(const listen_socket_t *ls, int fd, udp_buffer_t *buf) {
+	uint32_t drops;
+
+	if(get_socket_drops(fd, &drops) && drops != buf->kernel_drops) {
+		uint32_t dropped = drops - buf->kernel_drops;
+
+		buf->kernel_drops = drops;
+		buf->rx_drops += dropped;
+
+		if(buf->rcvwant < udp_rcvbuf_max)
+			grow_udp_buffer(ls, fd, SO_RCVBUF, SO_RCVBUFFORCE, &buf->rcvwant, &buf->rcvbuf, udp_rcvbuf_max, dropped);
+	}
+
+	if(buf->tx_full != buf->tx_checked) {
+		uint64_t failed = buf->tx_full - buf->tx_checked;
+
+		buf->tx_checked = buf->tx_full;
+
+		if(buf->sndwant < udp_sndbuf_max)
+			grow_udp_buffer(ls, fd, SO_SNDBUF, SO_SNDBUFFORCE, &buf->sndwant, &buf->sndbuf, udp_sndbuf_max, failed);
+	}
+}
+
+static void check_udp_buffers(void *data) {
+	for(int i = 0; i < listen_sockets; i++) {
+		listen_socket_t *ls = &listen_socket[i];
+
+		check_udp_buffer(ls, ls->udp, &ls->buf);
+
+		for(int j = 0; j < ls->shards; j++)
+			check_udp_buffer(ls, ls->shard[j].udp, &ls->shard[j].buf);
+	}
+
+	event_add(&udp_buffer_event, check_udp_buffers, NULL, UDP_BUFFER_INTERVAL);
+}
+
+void init_udp_buffers(void) {
+	for(int i = 0; i < listen_sockets; i++) {
+		listen_socket_t *ls = &listen_socket[i];
+
+		init_udp_buffer(ls->udp, &ls->buf);
+
+		for(int j = 0; j < ls->shards; j++)
+			init_udp_buffer(ls->shard[j].udp, &ls->shard[j].buf);
+	}
+
+	event_add(&udp_buffer_event, check_udp_buffers, NULL, UDP_BUFFER_INTERVAL);
+}
+
+void exit_udp_buffers(void) {
+	event_del(&udp_buffer_event);
+}
+
 void retry_outgoing(outgoing_t *outgoing) {
 	outgoing->timeout += 5;
 
@@ -285,13 +523,7 @@ void retry_outgoing(outgoing_t *outgoing) {
 	if(outgoing->timeout > maxtimeout)
 		outgoing->timeout = maxtimeout;
 
-	if(outgoing->event)
-		event_del(outgoing->event);
-	outgoing->event = new_event();
-	outgoing->event->handler = (event_handler_t) setup_outgoing_connection;
-	outgoing->event->time = now + outgoing->timeout;
-	outgoing->event->data = outgoing;
-	event_add(outgoing->event);
+	event_add(&outgoing->event, (event_handler_t) setup_outgoing_connection, outgoing, outgoing->timeout * 1000);
 
 	ifdebug(CONNECTIONS) logger(LOG_NOTICE,
 			   "Trying to re-establish outgoing connection in %d seconds",
@@ -301,7 +533,10 @@ void retry_outgoing(outgoing_t *outgoing) {
 void finish_connecting(connection_t *c) {
 	ifdebug(CONNECTIONS) logger(LOG_INFO, "Connected to %s (%s)", c->name, c->hostname);
 
-	c->last_ping_time = now;
+	cancel_attempts(c);
+
+	c->last_ping_time = now_msec;
+	schedule_connection_check(c);
 
 	send_id(c);
 }
@@ -354,67 +589,399 @@ static void do_outgoing_pipe(connection_t *c, char *command) {
 #endif
 }
 
-void do_outgoing_connection(connection_t *c) {
-	char *address, *port, *space;
-	struct addrinfo *proxyai = NULL;
-	int result;
+/*
+  Outgoing connections try the addresses of all of his Address lines in
+  turn. The host names are resolved in a thread of their own if there are
+  worker threads, so a slow DNS server holds up neither the main loop nor
+  the cryptography in the other workers, and the results
+  are ordered so that IPv4 and IPv6 addresses alternate (RFC 8305). Once
+  the connect to one address is in progress, the next one is started in
+  parallel every CONNECT_STAGGER milliseconds, and the first one that
+  completes is used. This is only done for direct connections; a proxy
+  gets one connect at a time.
+*/
+
+#define CONNECT_STAGGER 250
+#define MAX_ATTEMPTS 4
+
+typedef struct resolve_job_t {
+	job_t job;
+	int count;
+	char **hosts;			/* host and port of every Address, set by the main loop */
+	char **ports;
+	char **errors;			/* set by the worker for every host that could not be resolved */
+	sockaddr_t *addresses;		/* set by the worker */
+	int naddresses;
+} resolve_job_t;
+
+static void resolve_work(job_t *job) {
+	resolve_job_t *rj = (resolve_job_t *)job;
+	sockaddr_t *found = NULL;
+	int nfound = 0;
+
+	for(int i = 0; i < rj->count; i++) {
+		struct addrinfo *ai, *aip, hint = {0};
+		int err;
+
+		hint.ai_family = addressfamily;
+		hint.ai_socktype = SOCK_STREAM;
+
+		err = getaddrinfo(rj->hosts[i], rj->ports[i], &hint, &ai);
+
+		if(err) {
+			rj->errors[i] = xstrdup(gai_strerror(err));
+			continue;
+		}
+
+		for(aip = ai; aip; aip = aip->ai_next) {
+			if(aip->ai_addrlen > sizeof *found)
+				continue;
+
+			found = xrealloc(found, (nfound + 1) * sizeof *found);
+			memset(&found[nfound], 0, sizeof *found);
+			memcpy(&found[nfound], aip->ai_addr, aip->ai_addrlen);
+			nfound++;
+		}
+
+		freeaddrinfo(ai);
+	}
+
+	/* Alternate between the family of the first address and the others, keeping the order within each */
+
+	rj->addresses = xmalloc((nfound ? nfound : 1) * sizeof *rj->addresses);
+
+	for(int i = 0, j = 0, k = 0; k < nfound; ) {
+		while(i < nfound && found[i].sa.sa_family != found[0].sa.sa_family)
+			i++;
+		if(i < nfound)
+			rj->addresses[k++] = found[i++];
+
+		while(j < nfound && found[j].sa.sa_family == found[0].sa.sa_family)
+			j++;
+		if(j < nfound)
+			rj->addresses[k++] = found[j++];
+	}
+
+	rj->naddresses = nfound;
+	free(found);
+}
+
+static void free_resolve_job(resolve_job_t *rj) {
+	for(int i = 0; i < rj->count; i++) {
+		free(rj->hosts[i]);
+		free(rj->ports[i]);
+		free(rj->errors[i]);
+	}
+
+	free(rj->hosts);
+	free(rj->ports);
+	free(rj->errors);
+	free(rj->addresses);
+	free(rj);
+}
+
+static void resolve_done(job_t *job) {
+	resolve_job_t *rj = (resolve_job_t *)job;
+	connection_t *c = job->data;
+
+	/* The connection may have been closed in the meantime */
+
+	if(!c) {
+		free_resolve_job(rj);
+		return;
+	}
+
+	c->job = NULL;
+
+	for(int i = 0; i < rj->count; i++)
+		if(rj->errors[i])
+			logger(LOG_WARNING, "Error looking up %s port %s: %s", rj->hosts[i], rj->ports[i], rj->errors[i]);
+
+	/* A SIGHUP may have cancelled the outgoing connection */
 
 	if(!c->outgoing) {
-		logger(LOG_ERR, "do_outgoing_connection() for %s called without c->outgoing", c->name);
-		abort();
+		c->status.remove = true;
+		remove_pending = true;
+		free_resolve_job(rj);
+		return;
 	}
 
-begin:
-	if(!c->outgoing->ai) {
-		if(!c->outgoing->cfg) {
-			ifdebug(CONNECTIONS) logger(LOG_ERR, "Could not set up a meta connection to %s",
-					   c->name);
-			c->status.remove = true;
-			retry_outgoing(c->outgoing);
-			c->outgoing = NULL;
-			return;
-		}
+	free(c->outgoing->addresses);
+	c->outgoing->addresses = rj->addresses;
+	c->outgoing->naddresses = rj->naddresses;
+	c->outgoing->nextaddress = 0;
+	c->outgoing->resolved = true;
+	rj->addresses = NULL;
+	free_resolve_job(rj);
+
+	do_outgoing_connection(c);
+}
+
+static void resolve_addresses(connection_t *c) {
+	resolve_job_t *rj = xmalloc_and_zero(sizeof *rj);
+	config_t *cfg;
+	char *address, *space;
+
+	for(cfg = lookup_config(c->config_tree, "Address"); cfg; cfg = lookup_config_next(c->config_tree, cfg))
+		rj->count++;
+
+	rj->hosts = xmalloc_and_zero((rj->count + 1) * sizeof *rj->hosts);
+	rj->ports = xmalloc_and_zero((rj->count + 1) * sizeof *rj->ports);
+	rj->errors = xmalloc_and_zero((rj->count + 1) * sizeof *rj->errors);
+
+	int i = 0;
 
-		get_config_string(c->outgoing->cfg, &address);
+	for(cfg = lookup_config(c->config_tree, "Address"); cfg; cfg = lookup_config_next(c->config_tree, cfg), i++) {
+		get_config_string(cfg, &address);
 
 		space = strchr(address, ' ');
 		if(space) {
-			port = xstrdup(space + 1);
+			rj->ports[i] = xstrdup(space + 1);
 			*space = 0;
 		} else {
-			if(!get_config_string(lookup_config(c->config_tree, "Port"), &port))
-				port = xstrdup("655");
+			if(!get_config_string(lookup_config(c->config_tree, "Port"), &rj->ports[i]))
+				rj->ports[i] = xstrdup("655");
 		}
 
-		c->outgoing->ai = str2addrinfo(address, port, SOCK_STREAM);
-		free(address);
-		free(port);
-
-		c->outgoing->aip = c->outgoing->ai;
-		c->outgoing->cfg = lookup_config_next(c->config_tree, c->outgoing->cfg);
+		rj->hosts[i] = address;
 	}
 
-	if(!c->outgoing->aip) {
-		if(c->outgoing->ai)
-			freeaddrinfo(c->outgoing->ai);
-		c->outgoing->ai = NULL;
-		goto begin;
+	rj->job.work = resolve_work;
+	rj->job.done = resolve_done;
+	rj->job.data = c;
+	c->job = &rj->job;
+
+	/* Without worker threads, resolve right away like tinc always did */
+
+	if(!submit_slow_job(&rj->job)) {
+		resolve_work(&rj->job);
+		resolve_done(&rj->job);
 	}
+}
 
-	memcpy(&c->address, c->outgoing->aip->ai_addr, c->outgoing->aip->ai_addrlen);
-	c->outgoing->aip = c->outgoing->aip->ai_next;
+void forget_addresses(outgoing_t *outgoing) {
+	free(outgoing->addresses);
+	outgoing->addresses = NULL;
+	outgoing->naddresses = 0;
+	outgoing->nextaddress = 0;
+	outgoing->resolved = false;
+}
 
+static void set_hostname(connection_t *c) {
 	if(c->hostname)
 		free(c->hostname);
 
 	c->hostname = sockaddr2hostname(&c->address);
+}
+
+/* Opens a socket to the address and starts connecting, returns -1 if that failed right away */
+
+static int open_outgoing_socket(connection_t *c, const sockaddr_t *sa, bool *inprogress) {
+	int sd = socket(sa->sa.sa_family, SOCK_STREAM, IPPROTO_TCP);
+
+	if(sd == -1) {
+		ifdebug(CONNECTIONS) logger(LOG_ERR, "Creating socket for %s failed: %s", c->hostname, sockstrerror(sockerrno));
+		return -1;
+	}
+
+	configure_tcp(sd, c->hostname);
+
+#ifdef FD_CLOEXEC
+	fcntl(sd, F_SETFD, FD_CLOEXEC);
+#endif
+
+#if defined(SOL_IPV6) && defined(IPV6_V6ONLY)
+	int option = 1;
+	if(sa->sa.sa_family == AF_INET6)
+		setsockopt(sd, SOL_IPV6, IPV6_V6ONLY, (void *)&option, sizeof option);
+#endif
+
+	bind_to_interface(sd);
+
+	*inprogress = false;
+
+	if(connect(sd, &sa->sa, SALEN(sa->sa)) == -1) {
+		if(sockinprogress(sockerrno)) {
+			*inprogress = true;
+			return sd;
+		}
+
+		ifdebug(CONNECTIONS) logger(LOG_ERR, "%s: %s", sockaddr2hostname(sa), sockstrerror(sockerrno));
+		closesocket(sd);
+		return -1;
+	}
+
+	return sd;
+}
+
+/* Makes the attempt the connection's own socket, replacing the one it had */
+
+static void adopt_attempt(connection_t *c, attempt_t *a, bool connected) {
+	attempt_t **pa;
+
+	for(pa = &c->attempts; *pa != a; pa = &(*pa)->next);
+	*pa = a->next;
+
+	io_del(&a->io);
+
+	if(c->status.connecting) {
+		io_del(&c->io);
+		closesocket(c->socket);
+	}
+
+	c->socket = a->socket;
+	c->address = a->address;
+	set_hostname(c);
+	free(a);
+
+	if(connected) {
+		c->status.connecting = false;
+		io_add(&c->io, handle_meta_io, c, c->socket, IO_READ);
+		finish_connecting(c);
+	} else {
+		c->status.connecting = true;
+		c->last_ping_time = now_msec;
+		schedule_connection_check(c);
+		io_add(&c->io, handle_meta_io, c, c->socket, IO_READ | IO_WRITE);
+	}
+}
+
+static void handle_attempt_io(void *data, int flags) {
+	attempt_t *a = data;
+	connection_t *c = a->c;
+	int result;
+	socklen_t len = sizeof result;
+
+	getsockopt(a->socket, SOL_SOCKET, SO_ERROR, (void *)&result, &len);
+
+	if(!result) {
+		adopt_attempt(c, a, true);
+		return;
+	}
+
+	ifdebug(CONNECTIONS) logger(LOG_DEBUG, "Error while connecting to %s (%s): %s",
+			   c->name, sockaddr2hostname(&a->address), sockstrerror(result));
+
+	attempt_t **pa;
+
+	for(pa = &c->attempts; *pa != a; pa = &(*pa)->next);
+	*pa = a->next;
+
+	io_del(&a->io);
+	closesocket(a->socket);
+	free(a);
+}
+
+static void start_attempt(void *data) {
+	connection_t *c = data;
+	outgoing_t *outgoing = c->outgoing;
+	int count = 1;
+	bool inprogress;
+
+	if(!c->status.connecting || !outgoing)
+		return;
+
+	for(attempt_t *a = c->attempts; a; a = a->next)
+		count++;
+
+	while(count < MAX_ATTEMPTS && outgoing->nextaddress < outgoing->naddresses) {
+		sockaddr_t *sa = &outgoing->addresses[outgoing->nextaddress++];
+		int sd;
+
+		ifdebug(CONNECTIONS) logger(LOG_INFO, "Also trying to connect to %s (%s)", c->name, sockaddr2hostname(sa));
+
+		sd = open_outgoing_socket(c, sa, &inprogress);
+
+		if(sd == -1)
+			continue;
+
+		attempt_t *a = xmalloc_and_zero(sizeof *a);
+		a->c = c;
+		a->socket = sd;
+		a->address = *sa;
+		a->next = c->attempts;
+		c->attempts = a;
+
+		if(!inprogress) {
+			adopt_attempt(c, a, true);
+			return;
+		}
+
+		io_add(&a->io, handle_attempt_io, a, sd, IO_WRITE);
+		break;
+	}
+
+	if(outgoing->nextaddress < outgoing->naddresses)
+		event_add(&c->attemptevent, start_attempt, c, CONNECT_STAGGER);
+}
+
+void do_outgoing_connection(connection_t *c) {
+	outgoing_t *outgoing = c->outgoing;
+	struct addrinfo *proxyai = NULL;
+	int result;
+
+	if(!outgoing) {
+		logger(LOG_ERR, "do_outgoing_connection() for %s called without c->outgoing", c->name);
+		abort();
+	}
+
+	/* If a connect racing the one that failed is still going, it takes over */
+
+	if(c->attempts) {
+		c->status.connecting = false;
+		adopt_attempt(c, c->attempts, false);
+		return;
+	}
+
+begin:
+	if(!outgoing->resolved) {
+		resolve_addresses(c);
+		return;
+	}
+
+	if(outgoing->nextaddress >= outgoing->naddresses) {
+		ifdebug(CONNECTIONS) logger(LOG_ERR, "Could not set up a meta connection to %s",
+				   c->name);
+		c->status.remove = true;
+		remove_pending = true;
+		forget_addresses(outgoing);
+		retry_outgoing(outgoing);
+		c->outgoing = NULL;
+		return;
+	}
+
+	c->address = outgoing->addresses[outgoing->nextaddress++];
+	set_hostname(c);
 
 	ifdebug(CONNECTIONS) logger(LOG_INFO, "Trying to connect to %s (%s)", c->name,
 			   c->hostname);
 
 	if(!proxytype) {
-		c->socket = socket(c->address.sa.sa_family, SOCK_STREAM, IPPROTO_TCP);
-	} else if(proxytype == PROXY_EXEC) {
+		bool inprogress;
+
+		c->socket = open_outgoing_socket(c, &c->address, &inprogress);
+
+		if(c->socket == -1)
+			goto begin;
+
+		if(inprogress) {
+			c->status.connecting = true;
+			c->last_ping_time = now_msec;
+			schedule_connection_check(c);
+			io_add(&c->io, handle_meta_io, c, c->socket, IO_READ | IO_WRITE);
+
+			if(outgoing->nextaddress < outgoing->naddresses)
+				event_add(&c->attemptevent, start_attempt, c, CONNECT_STAGGER);
+
+			return;
+		}
+
+		io_add(&c->io, handle_meta_io, c, c->socket, IO_READ);
+		finish_connecting(c);
+		return;
+	}
+
+	if(proxytype == PROXY_EXEC) {
 		do_outgoing_pipe(c, proxyhost);
 	} else {
 		proxyai = str2addrinfo(proxyhost, proxyport, SOCK_STREAM);
@@ -426,31 +993,24 @@ begin:
 
 	if(c->socket == -1) {
 		ifdebug(CONNECTIONS) logger(LOG_ERR, "Creating socket for %s failed: %s", c->hostname, sockstrerror(sockerrno));
+		if(proxyai)
+			freeaddrinfo(proxyai);
 		goto begin;
 	}
 
 	if(proxytype != PROXY_EXEC)
-		configure_tcp(c);
+		configure_tcp(c->socket, c->hostname);
 
 #ifdef FD_CLOEXEC
 	fcntl(c->socket, F_SETFD, FD_CLOEXEC);
 #endif
 
-	if(proxytype != PROXY_EXEC) {
-#if defined(SOL_IPV6) && defined(IPV6_V6ONLY)
-		int option = 1;
-		if(c->address.sa.sa_family == AF_INET6)
-			setsockopt(c->socket, SOL_IPV6, IPV6_V6ONLY, (void *)&option, sizeof option);
-#endif
-
+	if(proxytype != PROXY_EXEC)
 		bind_to_interface(c->socket);
-	}
 
 	/* Connect */
 
-	if(!proxytype) {
-		result = connect(c->socket, &c->address.sa, SALEN(c->address.sa));
-	} else if(proxytype == PROXY_EXEC) {
+	if(proxytype == PROXY_EXEC) {
 		result = 0;
 	} else {
 		result = connect(c->socket, proxyai->ai_addr, proxyai->ai_addrlen);
@@ -460,6 +1020,9 @@ begin:
 	if(result == -1) {
 		if(sockinprogress(sockerrno)) {
 			c->status.connecting = true;
+			c->last_ping_time = now_msec;
+			schedule_connection_check(c);
+			io_add(&c->io, handle_meta_io, c, c->socket, IO_READ | IO_WRITE);
 			return;
 		}
 
@@ -470,6 +1033,7 @@ begin:
 		goto begin;
 	}
 
+	io_add(&c->io, handle_meta_io, c, c->socket, IO_READ);
 	finish_connecting(c);
 
 	return;
@@ -479,7 +1043,7 @@ void setup_outgoing_connection(outgoing_t *outgoing) {
 	connection_t *c;
 	node_t *n;
 
-	outgoing->event = NULL;
+	event_del(&outgoing->event);
 
 	n = lookup_node(outgoing->name);
 
@@ -501,16 +1065,13 @@ void setup_outgoing_connection(outgoing_t *outgoing) {
 	init_configuration(&c->config_tree);
 	read_connection_config(c);
 
-	outgoing->cfg = lookup_config(c->config_tree, "Address");
-
-	if(!outgoing->cfg) {
+	if(!lookup_config(c->config_tree, "Address")) {
 		logger(LOG_ERR, "No address specified for %s", c->name);
 		free_connection(c);
 		return;
 	}
 
 	c->outgoing = outgoing;
-	c->last_ping_time = now;
 
 	connection_add(c);
 
@@ -518,23 +1079,72 @@ void setup_outgoing_connection(outgoing_t *outgoing) {
 }
 
 /*
-  accept a new tcp connect and create a
-  new connection
+  When many daemons connect at once, for example after a hub restarted, the
+  listen backlog fills up faster than one accept() per wakeup can empty it.
+  Up to ACCEPT_BUDGET connections are accepted per wakeup instead, fewer if
+  that would exceed MaxHandshakes. With ConnectionRate, every address gets a
+  token bucket in a small hash table, and connections beyond its rate are
+  closed right away, before any work is spent on them. Colliding addresses
+  just take over the slot, which errs on the side of admitting them.
 */
-bool handle_new_meta_connection(int sock) {
-	connection_t *c;
-	sockaddr_t sa;
-	int fd;
-	socklen_t len = sizeof(sa);
 
-	fd = accept(sock, &sa.sa, &len);
+#define ACCEPT_BUDGET 64
+#define ADMISSION_SLOTS 1024
 
-	if(fd < 0) {
-		logger(LOG_ERR, "Accepting a new connection failed: %s", sockstrerror(sockerrno));
-		return false;
+typedef struct admission_t {
+	sockaddr_t address;
+	uint64_t time;
+	uint64_t tokens;			/* in thousandths of a connection */
+} admission_t;
+
+static admission_t admission[ADMISSION_SLOTS];
+
+static bool admit_connection(const sockaddr_t *sa) {
+	const uint8_t *key;
+	size_t keylen;
+	uint32_t hash = 2166136261U;
+
+	if(!connection_rate)
+		return true;
+
+	switch(sa->sa.sa_family) {
+		case AF_INET:
+			key = (const uint8_t *)&sa->in.sin_addr;
+			keylen = sizeof sa->in.sin_addr;
+			break;
+		case AF_INET6:
+			key = (const uint8_t *)&sa->in6.sin6_addr;
+			keylen = sizeof sa->in6.sin6_addr;
+			break;
+		default:
+			return true;
+	}
+
+	for(size_t i = 0; i < keylen; i++)
+		hash = (hash ^ key[i]) * 16777619U;
+
+	admission_t *slot = &admission[hash % ADMISSION_SLOTS];
+
+	if(sockaddrcmp_noport(&slot->address, sa)) {
+		slot->address = *sa;
+		slot->tokens = connection_rate * 1000ULL;
+	} else {
+		slot->tokens += (now_msec - slot->time) * connection_rate;
+		if(slot->tokens > connection_rate * 1000ULL)
+			slot->tokens = connection_rate * 1000ULL;
 	}
 
-	sockaddrunmap(&sa);
+	slot->time = now_msec;
+
+	if(slot->tokens < 1000)
+		return false;
+
+	slot->tokens -= 1000;
+	return true;
+}
+
+static void new_incoming_connection(int fd, const sockaddr_t *sa) {
+	connection_t *c;
 
 	c = new_connection();
 	c->name = xstrdup("<unknown>");
@@ -543,26 +1153,121 @@ bool handle_new_meta_connection(int sock) {
 	c->outmaclength = myself->connection->outmaclength;
 	c->outcompression = myself->connection->outcompression;
 
-	c->address = sa;
-	c->hostname = sockaddr2hostname(&sa);
+	c->address = *sa;
+	c->hostname = sockaddr2hostname(sa);
 	c->socket = fd;
-	c->last_ping_time = now;
+	c->last_ping_time = now_msec;
+	schedule_connection_check(c);
 
 	ifdebug(CONNECTIONS) logger(LOG_NOTICE, "Connection from %s", c->hostname);
 
-	configure_tcp(c);
+	configure_tcp(c->socket, c->hostname);
 
 	connection_add(c);
+	io_add(&c->io, handle_meta_io, c, c->socket, IO_READ);
 
 	c->allow_request = ID;
 	send_id(c);
+}
 
-	return true;
+/*
+  accept new tcp connects and create
+  new connections
+*/
+void handle_new_meta_connection(void *data, int flags) {
+	listen_socket_t *ls = data;
+	int handshakes = max_handshakes ? count_handshakes() : 0;
+	sockaddr_t sa;
+	socklen_t len;
+	int fd;
+
+	for(int budget = ACCEPT_BUDGET; budget > 0; budget--) {
+		if(max_handshakes && handshakes >= max_handshakes)
+			break;
+
+		len = sizeof sa;
+#if defined(HAVE_ACCEPT4) && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+		fd = accept4(ls->tcp, &sa.sa, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+		fd = accept(ls->tcp, &sa.sa, &len);
+#ifdef FD_CLOEXEC
+		if(fd >= 0)
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+#endif
+
+		if(fd < 0) {
+			if(!sockwouldblock(sockerrno))
+				logger(LOG_ERR, "Accepting a new connection failed: %s", sockstrerror(sockerrno));
+			break;
+		}
+
+		sockaddrunmap(&sa);
+
+		if(!admit_connection(&sa)) {
+			ifdebug(CONNECTIONS) {
+				char *hostname = sockaddr2hostname(&sa);
+				logger(LOG_NOTICE, "Rejected connection from %s: more than %d per second", hostname, connection_rate);
+				free(hostname);
+			}
+			connections_rejected++;
+			closesocket(fd);
+			continue;
+		}
+
+		connections_accepted++;
+		handshakes++;
+		new_incoming_connection(fd, &sa);
+	}
+
+	check_handshakes();
+}
+
+/* Number of connections that have not been authenticated yet */
+
+int count_handshakes(void) {
+	int handshakes = 0;
+
+	for(avl_node_t *node = connection_tree->head; node; node = node->next) {
+		connection_t *c = node->data;
+
+		if(c != myself->connection && !c->status.active && !c->status.remove)
+			handshakes++;
+	}
+
+	return handshakes;
+}
+
+/*
+  Stop accepting connections while MaxHandshakes connections have not
+  been authenticated yet, the kernel queues new ones for us meanwhile.
+*/
+
+void check_handshakes(void) {
+	static bool paused = false;
+	int handshakes;
+
+	if(!max_handshakes && !paused)
+		return;
+
+	handshakes = count_handshakes();
+
+	bool pause = max_handshakes && handshakes >= max_handshakes;
+
+	if(pause == paused)
+		return;
+
+	paused = pause;
+
+	ifdebug(CONNECTIONS) logger(LOG_DEBUG, "%d handshakes in progress, %s accepting connections",
+			handshakes, pause ? "no longer" : "again");
+
+	for(int i = 0; i < listen_sockets; i++)
+		io_set(&listen_socket[i].tcp_io, pause ? 0 : IO_READ);
 }
 
 static void free_outgoing(outgoing_t *outgoing) {
-	if(outgoing->ai)
-		freeaddrinfo(outgoing->ai);
+	free(outgoing->addresses);
 
 	if(outgoing->name)
 		free(outgoing->name);
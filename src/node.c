@@ -20,7 +20,10 @@
 
 #include "system.h"
 
+#include <openssl/err.h>
+
 #include "avl_tree.h"
+#include "graph.h"
 #include "logger.h"
 #include "net.h"
 #include "netutl.h"
@@ -30,6 +33,7 @@
 
 avl_tree_t *node_tree;			/* Known nodes, sorted by name */
 avl_tree_t *node_udp_tree;		/* Known nodes, sorted by address and port */
+int tunnel_idle_timeout = 600;		/* Seconds without packets after which the state for UDP packets to a node is freed */
 
 node_t *myself;
 
@@ -41,12 +45,204 @@ static int node_udp_compare(const node_t *a, const node_t *b) {
        return sockaddrcmp(&a->address, &b->address);
 }
 
+/* Hash tables for node lookups
+
+   lookup_node() is done for every request and lookup_node_udp() for every
+   UDP packet, so besides the trees, which are used to walk the nodes in order,
+   the nodes are also kept in hash tables by name, by address and by session ID.
+   Like the MAC table in subnet.c, these use open addressing with linear probing.
+   As in the trees, only the first node added with a given key is kept.
+   The extra addresses used with Multipath are kept in one of these as well.
+*/
+
+typedef struct node_hash_t {
+	void **table;
+	unsigned int size;
+	unsigned int count;
+	const void *(*key)(const void *);
+	uint32_t (*hash)(const void *);
+	int (*compare)(const void *, const void *);
+} node_hash_t;
+
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t len) {
+	const uint8_t *p = data;
+
+	for(size_t i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 16777619U;
+
+	return hash;
+}
+
+static uint32_t hash_finish(uint32_t hash) {
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3b;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+static const void *name_key(const void *n) {
+	return ((const node_t *)n)->name;
+}
+
+static uint32_t name_hash(const void *key) {
+	return hash_finish(hash_bytes(2166136261U, key, strlen(key)));
+}
+
+static int name_compare(const void *a, const void *b) {
+	return strcmp(a, b);
+}
+
+static const void *udp_key(const void *n) {
+	return &((const node_t *)n)->address;
+}
+
+static uint32_t udp_hash(const void *key) {
+	const sockaddr_t *sa = key;
+	uint32_t hash = hash_bytes(2166136261U, &sa->sa.sa_family, sizeof sa->sa.sa_family);
+
+	switch(sa->sa.sa_family) {
+		case AF_INET:
+			hash = hash_bytes(hash, &sa->in.sin_addr, sizeof sa->in.sin_addr);
+			hash = hash_bytes(hash, &sa->in.sin_port, sizeof sa->in.sin_port);
+			break;
+
+		case AF_INET6:
+			hash = hash_bytes(hash, &sa->in6.sin6_addr, sizeof sa->in6.sin6_addr);
+			hash = hash_bytes(hash, &sa->in6.sin6_port, sizeof sa->in6.sin6_port);
+			break;
+
+		case AF_UNKNOWN:
+			hash = hash_bytes(hash, sa->unknown.address, strlen(sa->unknown.address));
+			hash = hash_bytes(hash, sa->unknown.port, strlen(sa->unknown.port));
+			break;
+
+		default:
+			break;
+	}
+
+	return hash_finish(hash);
+}
+
+static int udp_compare(const void *a, const void *b) {
+	return sockaddrcmp(a, b);
+}
+
+static const void *id_key(const void *n) {
+	return &((const node_t *)n)->insessionid;
+}
+
+static uint32_t id_hash(const void *key) {
+	uint32_t id;
+
+	memcpy(&id, key, sizeof id);
+
+	return hash_finish(id);
+}
+
+static int id_compare(const void *a, const void *b) {
+	return memcmp(a, b, sizeof(uint32_t));
+}
+
+static const void *path_key(const void *p) {
+	return &((const node_path_t *)p)->address;
+}
+
+static node_hash_t node_name_hash = {NULL, 0, 0, name_key, name_hash, name_compare};
+static node_hash_t node_udp_hash = {NULL, 0, 0, udp_key, udp_hash, udp_compare};
+static node_hash_t node_id_hash = {NULL, 0, 0, id_key, id_hash, id_compare};
+static node_hash_t node_path_hash = {NULL, 0, 0, path_key, udp_hash, udp_compare};
+
+/* Return the slot containing this key, or the empty slot where it should go */
+
+static unsigned int node_hash_slot(const node_hash_t *h, const void *key) {
+	unsigned int i = h->hash(key) & (h->size - 1);
+
+	while(h->table[i] && h->compare(h->key(h->table[i]), key))
+		i = (i + 1) & (h->size - 1);
+
+	return i;
+}
+
+static void *node_hash_lookup(const node_hash_t *h, const void *key) {
+	if(!h->count)
+		return NULL;
+
+	return h->table[node_hash_slot(h, key)];
+}
+
+static void node_hash_resize(node_hash_t *h, unsigned int size) {
+	void **old = h->table;
+	unsigned int oldsize = h->size;
+
+	h->table = xmalloc_and_zero(size * sizeof *h->table);
+	h->size = size;
+
+	for(unsigned int i = 0; i < oldsize; i++)
+		if(old[i])
+			h->table[node_hash_slot(h, h->key(old[i]))] = old[i];
+
+	free(old);
+}
+
+static void node_hash_insert(node_hash_t *h, void *n) {
+	unsigned int i;
+
+	if((h->count + 1) * 2 > h->size)
+		node_hash_resize(h, h->size ? h->size * 2 : 16);
+
+	i = node_hash_slot(h, h->key(n));
+
+	if(!h->table[i]) {
+		h->table[i] = n;
+		h->count++;
+	}
+}
+
+static void node_hash_delete(node_hash_t *h, void *n) {
+	unsigned int i, j, k, mask = h->size - 1;
+
+	if(!h->count)
+		return;
+
+	i = node_hash_slot(h, h->key(n));
+
+	if(h->table[i] != n)
+		return;
+
+	h->table[i] = NULL;
+	h->count--;
+
+	/* Move back entries that would otherwise become unreachable through the new hole */
+
+	for(j = (i + 1) & mask; h->table[j]; j = (j + 1) & mask) {
+		k = h->hash(h->key(h->table[j])) & mask;
+
+		if(((j - k) & mask) >= ((j - i) & mask)) {
+			h->table[i] = h->table[j];
+			h->table[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+static void node_hash_free(node_hash_t *h) {
+	free(h->table);
+	h->table = NULL;
+	h->size = 0;
+	h->count = 0;
+}
+
 void init_nodes(void) {
 	node_tree = avl_alloc_tree((avl_compare_t) node_compare, (avl_action_t) free_node);
 	node_udp_tree = avl_alloc_tree((avl_compare_t) node_udp_compare, NULL);
 }
 
 void exit_nodes(void) {
+	node_hash_free(&node_path_hash);
+	node_hash_free(&node_id_hash);
+	node_hash_free(&node_udp_hash);
+	node_hash_free(&node_name_hash);
 	avl_delete_tree(node_udp_tree);
 	avl_delete_tree(node_tree);
 }
@@ -54,23 +250,18 @@ void exit_nodes(void) {
 node_t *new_node(void) {
 	node_t *n = xmalloc_and_zero(sizeof(*n));
 
-	if(replaywin) n->late = xmalloc_and_zero(replaywin);
 	n->subnet_tree = new_subnet_tree();
 	n->edge_tree = new_edge_tree();
-	EVP_CIPHER_CTX_init(&n->inctx);
-	EVP_CIPHER_CTX_init(&n->outctx);
-	n->mtu = MTU;
-	n->maxmtu = MTU;
+	n->mtu = max_frame_size;
+	n->maxmtu = max_frame_size;
+	set_rate_limit(&n->inbucket, ingress_rate);
+	set_rate_limit(&n->outbucket, egress_rate);
 
 	return n;
 }
 
 void free_node(node_t *n) {
-	if(n->inkey)
-		free(n->inkey);
-
-	if(n->outkey)
-		free(n->outkey);
+	free_node_tunnel(n);
 
 	if(n->subnet_tree)
 		free_subnet_tree(n->subnet_tree);
@@ -80,26 +271,125 @@ void free_node(node_t *n) {
 
 	sockaddrfree(&n->address);
 
-	EVP_CIPHER_CTX_cleanup(&n->inctx);
-	EVP_CIPHER_CTX_cleanup(&n->outctx);
-
-	if(n->mtuevent)
-		event_del(n->mtuevent);
-	
 	if(n->hostname)
 		free(n->hostname);
 
 	if(n->name)
 		free(n->name);
 
-	if(n->late)
-		free(n->late);
-
 	free(n);
 }
 
+/*
+  Most nodes in a large VPN never exchange packets with us, so the keys,
+  cipher contexts, replay windows and the rest of the state for UDP packets
+  only exist for those that do. node_tunnel() allocates it when keys are
+  first exchanged, expire_node_tunnels() frees it again when no packets have
+  been sent to or received from him for tunnel_idle_timeout seconds.
+*/
+
+node_tunnel_t *node_tunnel(node_t *n) {
+	node_tunnel_t *t = n->tunnel;
+
+	if(t)
+		return t;
+
+	t = n->tunnel = xmalloc_and_zero(sizeof *t);
+	t->last_used = now;
+
+	if(replaywin) {
+		t->replay = xmalloc_and_zero(REPLAY_SIZE);
+		t->oldkey.replay = xmalloc_and_zero(REPLAY_SIZE);
+	}
+
+	EVP_CIPHER_CTX_init(&t->inctx);
+	EVP_CIPHER_CTX_init(&t->outctx);
+	HMAC_CTX_init(&t->inhmac);
+	HMAC_CTX_init(&t->outhmac);
+	EVP_CIPHER_CTX_init(&t->oldkey.inctx);
+	HMAC_CTX_init(&t->oldkey.inhmac);
+
+	for(int i = 0; i < MAX_PATHS; i++)
+		t->path[i].node = n;
+
+	return t;
+}
+
+void free_node_tunnel(node_t *n) {
+	node_tunnel_t *t = n->tunnel;
+
+	if(!t)
+		return;
+
+	flush_node_batches(n, true);
+
+	for(int i = 1; i < MAX_PATHS; i++)
+		del_node_path(&t->path[i]);
+
+	event_del(&t->mtuevent);
+	event_del(&t->keyevent);
+	event_del(&t->pathevent);
+	clear_node_txq(n);
+	clear_node_aggregate(n);
+	clear_node_reassembly(n);
+
+	if(t->inkey)
+		free(t->inkey);
+
+	if(t->outkey)
+		free(t->outkey);
+
+	if(t->oldkey.inkey)
+		free(t->oldkey.inkey);
+
+	EVP_CIPHER_CTX_cleanup(&t->inctx);
+	EVP_CIPHER_CTX_cleanup(&t->outctx);
+	HMAC_CTX_cleanup(&t->inhmac);
+	HMAC_CTX_cleanup(&t->outhmac);
+	EVP_CIPHER_CTX_cleanup(&t->oldkey.inctx);
+	HMAC_CTX_cleanup(&t->oldkey.inhmac);
+
+	if(t->replay)
+		free(t->replay);
+
+	if(t->oldkey.replay)
+		free(t->oldkey.replay);
+
+	free(t);
+	n->tunnel = NULL;
+
+	/* Without it, keys have to be exchanged and the PMTU discovered again */
+
+	update_node_id(n, 0);
+	n->outsessionid = 0;
+	n->status.validkey = false;
+	n->last_req_key = 0;
+	n->maxmtu = max_frame_size;
+	n->minmtu = 0;
+}
+
+void expire_node_tunnels(void) {
+	avl_node_t *node;
+	node_t *n;
+
+	if(!tunnel_idle_timeout)
+		return;
+
+	for(node = node_tree->head; node; node = node->next) {
+		n = node->data;
+
+		if(n == myself || !n->tunnel || n->tunnel->last_used + tunnel_idle_timeout > now)
+			continue;
+
+		ifdebug(TRAFFIC) logger(LOG_DEBUG, "No packets exchanged with %s (%s) for a while, forgetting the keys", n->name, n->hostname);
+		free_node_tunnel(n);
+	}
+}
+
 void node_add(node_t *n) {
 	avl_insert(node_tree, n);
+	node_hash_insert(&node_name_hash, n);
+	graph_node_added(n);
 }
 
 void node_del(node_t *n) {
@@ -119,25 +409,24 @@ void node_del(node_t *n) {
 		edge_del(e);
 	}
 
+	if(n->insessionid)
+		node_hash_delete(&node_id_hash, n);
+
+	free_node_tunnel(n);
+
+	node_hash_delete(&node_udp_hash, n);
+	node_hash_delete(&node_name_hash, n);
 	avl_delete(node_udp_tree, n);
+	graph_node_deleted(n);
 	avl_delete(node_tree, n);
 }
 
 node_t *lookup_node(char *name) {
-	node_t n = {NULL};
-
-	n.name = name;
-
-	return avl_search(node_tree, &n);
+	return node_hash_lookup(&node_name_hash, name);
 }
 
 node_t *lookup_node_udp(const sockaddr_t *sa) {
-	node_t n = {NULL};
-
-	n.address = *sa;
-	n.name = NULL;
-
-	return avl_search(node_udp_tree, &n);
+	return node_hash_lookup(&node_udp_hash, sa);
 }
 
 void update_node_udp(node_t *n, const sockaddr_t *sa) {
@@ -146,21 +435,164 @@ void update_node_udp(node_t *n, const sockaddr_t *sa) {
 		return;
 	}
 
+	node_hash_delete(&node_udp_hash, n);
 	avl_delete(node_udp_tree, n);
 
 	if(n->hostname)
 		free(n->hostname);
 
+	/* His other addresses are kept only as long as he has this one */
+
+	if(n->tunnel) {
+		node_tunnel_t *t = n->tunnel;
+
+		for(int i = 1; i < MAX_PATHS; i++)
+			if(!sa || !sockaddrcmp(&t->path[i].address, sa))
+				del_node_path(&t->path[i]);
+
+		t->path[0].last_rx = sa ? now : 0;
+		t->path[0].probe_sent = 0;
+		t->path[0].rtt = 0;
+		t->pathweight = 0;
+	}
+
 	if(sa) {
 		n->address = *sa;
 		n->hostname = sockaddr2hostname(&n->address);
 		avl_insert(node_udp_tree, n);
+		node_hash_insert(&node_udp_hash, n);
 		ifdebug(PROTOCOL) logger(LOG_DEBUG, "UDP address of %s set to %s", n->name, n->hostname);
 	} else {
 		memset(&n->address, 0, sizeof n->address);
 		n->hostname = NULL;
 		ifdebug(PROTOCOL) logger(LOG_DEBUG, "UDP address of %s cleared", n->name);
 	}
+
+	update_node_forwarding(n);
+}
+
+node_path_t *lookup_node_path(const sockaddr_t *sa) {
+	return node_hash_lookup(&node_path_hash, sa);
+}
+
+/* Add another address of him, returns NULL if it is already known or all slots are taken */
+
+node_path_t *add_node_path(node_t *n, const sockaddr_t *sa, int sock) {
+	node_path_t *p = NULL;
+
+	if(n == myself || !n->tunnel || (sa->sa.sa_family != AF_INET && sa->sa.sa_family != AF_INET6))
+		return NULL;
+
+	if(!sockaddrcmp(&n->address, sa) || lookup_node_path(sa))
+		return NULL;
+
+	for(int i = 1; i < MAX_PATHS; i++) {
+		if(n->tunnel->path[i].address.sa.sa_family == AF_UNSPEC) {
+			p = &n->tunnel->path[i];
+			break;
+		}
+	}
+
+	if(!p)
+		return NULL;
+
+	p->sock = sock;
+	p->address = *sa;
+	p->addresslen = SALEN(sa->sa);
+	p->added = now;
+	p->last_rx = 0;
+	p->probe_sent = 0;
+	p->rtt = 0;
+	p->weight = 0;
+	node_hash_insert(&node_path_hash, p);
+
+	ifdebug(PROTOCOL) {
+		char *hostname = sockaddr2hostname(sa);
+		logger(LOG_DEBUG, "Added UDP address %s of %s", hostname, n->name);
+		free(hostname);
+	}
+
+	return p;
+}
+
+void del_node_path(node_path_t *p) {
+	if(p->address.sa.sa_family == AF_UNSPEC)
+		return;
+
+	ifdebug(PROTOCOL) {
+		char *hostname = sockaddr2hostname(&p->address);
+		logger(LOG_DEBUG, "Removed UDP address %s of %s", hostname, p->node->name);
+		free(hostname);
+	}
+
+	node_hash_delete(&node_path_hash, p);
+	memset(&p->address, 0, sizeof p->address);
+	p->weight = 0;
+}
+
+node_t *lookup_node_id(uint32_t id) {
+	return node_hash_lookup(&node_id_hash, &id);
+}
+
+void update_node_id(node_t *n, uint32_t id) {
+	if(n->insessionid)
+		node_hash_delete(&node_id_hash, n);
+
+	n->insessionid = id;
+
+	if(id)
+		node_hash_insert(&node_id_hash, n);
+}
+
+bool node_ids_used(void) {
+	return node_id_hash.count;
+}
+
+/* Move a cipher context. Some, like GCM's, point into themselves, so they cannot be moved as plain structs. */
+
+static void move_cipher_ctx(EVP_CIPHER_CTX *to, EVP_CIPHER_CTX *from) {
+	EVP_CIPHER_CTX_cleanup(to);
+
+	if(from->cipher && !EVP_CIPHER_CTX_copy(to, from))
+		logger(LOG_ERR, "Could not copy cipher context: %s", ERR_error_string(ERR_get_error(), NULL));
+
+	EVP_CIPHER_CTX_cleanup(from);
+}
+
+/* Exchange the key he currently uses for packets to us with the previous one.
+   The HMAC contexts are moved as plain structs, they hold no pointers to themselves. */
+
+void swap_inkey(node_t *n) {
+	node_tunnel_t *t = n->tunnel;
+	node_oldkey_t tmp = t->oldkey;
+	EVP_CIPHER_CTX ctx;
+
+	EVP_CIPHER_CTX_init(&ctx);
+	move_cipher_ctx(&ctx, &t->oldkey.inctx);
+	move_cipher_ctx(&t->oldkey.inctx, &t->inctx);
+	move_cipher_ctx(&t->inctx, &ctx);
+
+	t->oldkey.incipher = t->incipher;
+	t->oldkey.inkey = t->inkey;
+	t->oldkey.inkeylength = t->inkeylength;
+	t->oldkey.indigest = t->indigest;
+	t->oldkey.inmaclength = t->inmaclength;
+	t->oldkey.inhmac = t->inhmac;
+	t->oldkey.incompression = t->incompression;
+	t->oldkey.received_seqno = t->received_seqno;
+	t->oldkey.farfuture = t->farfuture;
+	t->oldkey.replay = t->replay;
+
+	t->incipher = tmp.incipher;
+	t->inkey = tmp.inkey;
+	t->inkeylength = tmp.inkeylength;
+	t->indigest = tmp.indigest;
+	t->inmaclength = tmp.inmaclength;
+	t->inhmac = tmp.inhmac;
+	t->incompression = tmp.incompression;
+	t->received_seqno = tmp.received_seqno;
+	t->farfuture = tmp.farfuture;
+	t->replay = tmp.replay;
 }
 
 void dump_nodes(void) {
@@ -171,11 +603,18 @@ void dump_nodes(void) {
 
 	for(node = node_tree->head; node; node = node->next) {
 		n = node->data;
-		logger(LOG_DEBUG, " %s at %s cipher %d digest %d maclength %d compression %d options %x status %04x nexthop %s via %s pmtu %d (min %d max %d)",
-			   n->name, n->hostname, n->outcipher ? n->outcipher->nid : 0,
-			   n->outdigest ? n->outdigest->type : 0, n->outmaclength, n->outcompression,
+		node_tunnel_t *t = n->tunnel;
+
+		logger(LOG_DEBUG, " %s at %s cipher %d digest %d maclength %d compression %d (ratio %d%%%s) options %x status %04x nexthop %s via %s pmtu %d (min %d max %d)",
+			   n->name, n->hostname, t && t->outcipher ? t->outcipher->nid : 0,
+			   t && t->outdigest ? t->outdigest->type : 0, t ? t->outmaclength : 0, t ? t->outcompression : 0,
+			   t ? t->compressratio * 100 / 256 : 0, t && t->compressskip ? ", skipping" : "",
 			   n->options, bitfield_to_int(&n->status, sizeof n->status), n->nexthop ? n->nexthop->name : "-",
 			   n->via ? n->via->name : "-", n->mtu, n->minmtu, n->maxmtu);
+		logger(LOG_DEBUG, " %s in %"PRIu64" packets %"PRIu64" bytes out %"PRIu64" packets %"PRIu64" bytes (tcp %"PRIu64" nokey %"PRIu64" toobig %"PRIu64") drops replay %"PRIu64" mac %"PRIu64" tcp %"PRIu64" queue %"PRIu64" rate %"PRIu64,
+			   n->name, n->stats.in_packets, n->stats.in_bytes, n->stats.out_packets, n->stats.out_bytes,
+			   n->stats.tcp_packets, n->stats.nokey_packets, n->stats.toobig_packets,
+			   n->stats.replay_drops, n->stats.mac_drops, n->stats.tcp_drops, n->stats.queue_drops, n->stats.rate_drops);
 	}
 
 	logger(LOG_DEBUG, "End of nodes.");
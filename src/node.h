@@ -25,6 +25,7 @@
 #include "connection.h"
 #include "event.h"
 #include "subnet.h"
+#include "utils.h"
 
 typedef struct node_status_t {
 	unsigned int unused_active:1;			/* 1 if active (not used for nodes) */
@@ -33,19 +34,95 @@ typedef struct node_status_t {
 	unsigned int visited:1;				/* 1 if this node has been visited by one of the graph algorithms */
 	unsigned int reachable:1;			/* 1 if this node is reachable in the graph */
 	unsigned int indirect:1;				/* 1 if this node is not directly reachable by us */
-	unsigned int unused:26;
+	unsigned int sessionid:1;			/* 1 if he asked us for a session ID in his last key request */
+	unsigned int rawpackets:1;			/* 1 if he asked us to accept uncompressed packets in his last key request */
+	unsigned int sendraw:1;				/* 1 if he accepts uncompressed packets from us */
+	unsigned int sendtcp:1;				/* 1 if packets for him have to go over TCP */
+	unsigned int unused:22;
 } node_status_t;
 
-typedef struct node_t {
-	char *name;				/* name of this node */
-	uint32_t options;			/* options turned on for this node */
+typedef struct node_stats_t {
+	uint64_t in_packets;			/* Packets received from him */
+	uint64_t in_bytes;			/* Bytes of payload received from him */
+	uint64_t out_packets;			/* Packets sent to him, over UDP or TCP */
+	uint64_t out_bytes;			/* Bytes of payload sent to him */
+	uint64_t tcp_packets;			/* Packets sent to him over TCP */
+	uint64_t nokey_packets;			/* Packets sent over TCP because we had no key for him yet */
+	uint64_t toobig_packets;		/* Packets not sent over UDP because they were larger than his PMTU */
+	uint64_t replay_drops;			/* Packets from him rejected by the replay check */
+	uint64_t mac_drops;			/* Packets from him that failed authentication */
+	uint64_t tcp_drops;			/* Packets to him dropped from the TCP packet queue */
+	uint64_t queue_drops;			/* Packets to him dropped because his FairQueueing queue was full */
+	uint64_t rate_drops;			/* Packets from or to him dropped by his IngressRate or EgressRate */
+} node_stats_t;
 
-	int sock;				/* Socket to use for outgoing UDP packets */
-	sockaddr_t address;			/* his real (internet) ip to send UDP packets to */
-	char *hostname;				/* the hostname of its real ip */
+/* Queue of UDP packets for one priority band of a node, only used with FairQueueing, see net_packet.c */
 
-	node_status_t status;
-	time_t last_req_key;
+#define TXQ_BANDS 3
+
+typedef struct node_txq_t {
+	struct udp_queue_t *head;
+	struct udp_queue_t *tail;
+	int len;				/* number of packets queued */
+	int deficit;				/* bytes he may still send in this round */
+	bool active;				/* true if he is in the round robin list of this band */
+	struct node_t *next;			/* next node in the round robin list of this band */
+} node_txq_t;
+
+/* Number of probes in a burst while discovering the PMTU, see send_mtu_probe() */
+
+#define MTU_BURST 8
+
+/* Addresses of a node that UDP packets are spread over with Multipath, see net_packet.c.
+   The first one stands for his address itself and leaves sock and address unused,
+   the others are only kept while they work. */
+
+#define MAX_PATHS 4
+
+typedef struct node_path_t {
+	struct node_t *node;			/* node this is an address of */
+	int sock;				/* socket to use for packets to this address */
+	sockaddr_t address;			/* his address, AF_UNSPEC if the slot is unused */
+	socklen_t addresslen;			/* length of the address */
+	time_t added;				/* time this address was first seen */
+	time_t last_rx;				/* last time an authenticated packet arrived from it, 0 if never */
+	uint64_t probe_sent;			/* time the last keepalive was sent, in milliseconds, 0 if answered */
+	int rtt;				/* smoothed round trip time in milliseconds, 0 if unknown */
+	int weight;				/* share of the flows to him to send to this address */
+} node_path_t;
+
+/* Frames he sent us in fragments that are being put together again, see net_packet.c */
+
+#define REASSEMBLY_SLOTS 4
+
+typedef struct node_reassembly_t {
+	vpn_packet_t *packet;			/* the frame so far, NULL if the slot is unused */
+	uint32_t id;				/* the ID he gave the frame */
+	uint32_t received;			/* bitmap of the fragments that arrived */
+	int count;				/* number of fragments */
+	uint64_t started;			/* time the first one arrived, in milliseconds */
+} node_reassembly_t;
+
+typedef struct node_oldkey_t {
+	time_t expires;				/* Time after which packets with this key are refused, 0 if there is none */
+	const EVP_CIPHER *incipher;
+	char *inkey;
+	int inkeylength;
+	EVP_CIPHER_CTX inctx;
+	const EVP_MD *indigest;
+	int inmaclength;
+	HMAC_CTX inhmac;
+	int incompression;
+	uint32_t received_seqno;
+	uint32_t farfuture;
+	uint64_t *replay;
+} node_oldkey_t;
+
+/* State only needed while packets are exchanged with a node over UDP. It is allocated when
+   keys are first exchanged with him and freed again when he has been idle for a while, see node.c */
+
+typedef struct node_tunnel_t {
+	time_t last_used;			/* Last time a UDP packet was sent to or received from him */
 
 	const EVP_CIPHER *incipher;		/* Cipher type for UDP packets received from him */
 	char *inkey;				/* Cipher key and iv */
@@ -59,38 +136,101 @@ typedef struct node_t {
 	
 	const EVP_MD *indigest;			/* Digest type for MAC of packets received from him */
 	int inmaclength;			/* Length of MAC */
+	HMAC_CTX inhmac;			/* HMAC context, keyed with inkey */
 
 	const EVP_MD *outdigest;		/* Digest type for MAC of packets sent to him*/
 	int outmaclength;			/* Length of MAC */
+	HMAC_CTX outhmac;			/* HMAC context, keyed with outkey */
 
 	int incompression;			/* Compressionlevel, 0 = no compression */
 	int outcompression;			/* Compressionlevel, 0 = no compression */
+	int compressratio;			/* Recent size of compressed packets to him, in 1/256ths of the original */
+	int compressskip;			/* Packets left to send uncompressed before trying compression again */
+	int compressbackoff;			/* Length of the last period of uncompressed packets, 0 if none */
+
+	vpn_packet_t *(*encode)(struct node_t *, vpn_packet_t *, vpn_packet_t *);	/* Compresses, encrypts and authenticates packets sent to him */
+
+	uint32_t sent_seqno;			/* Sequence number last sent to this node */
+	uint32_t received_seqno;		/* Sequence number last received from this node */
+	uint32_t farfuture;			/* Packets in a row that have arrived from the far future */
+	uint64_t *replay;			/* Bitmap of seqnos received within the replay window */
+
+	node_oldkey_t oldkey;			/* Key he used before our last ANS_KEY, still accepted for a short while */
+	event_t keyevent;			/* Sends him a new key when ours for him expires */
+
+	int mtuprobes;				/* Number of probes */
+	event_t mtuevent;			/* Probe event */
+	int mtuinterval;			/* Milliseconds between bursts of probes during discovery */
+	int mtuoverhead;			/* Bytes that encoding adds to the probes, without IP and UDP headers */
+	uint8_t mtuburst;			/* Number of the last burst, echoed back in the replies */
+	bool mtureplied;			/* Whether a probe of the last burst has been answered */
+	int mtuprobed;				/* Number of probes in the last burst */
+	length_t mtuprobelen[MTU_BURST];	/* Their lengths */
+
+	node_path_t path[MAX_PATHS];		/* Addresses to spread UDP packets over with Multipath */
+	int pathweight;				/* Sum of the weights of the usable ones, 0 if only his address is used */
+	event_t pathevent;			/* Probes the addresses and updates their weights */
+
+	node_txq_t txq[TXQ_BANDS];		/* UDP packets waiting to be sent to him with FairQueueing */
+
+	struct crypto_batch_t *txbatch;		/* Packets for him waiting to be encrypted by the CryptoPipeline */
+	struct crypto_batch_t *rxbatch;		/* Packets from him waiting to be decrypted by the CryptoPipeline */
+
+	vpn_packet_t *aggregate;		/* Small packets for him waiting to be sent together with Aggregation */
+	int aggregated;				/* Number of packets in it */
+	bool aggregating;			/* Whether he is in the list flush_aggregates() goes through */
+	struct node_t *nextaggregate;
+
+	uint32_t fragment_id;			/* ID of the last frame sent to him in fragments */
+	node_reassembly_t reassembly[REASSEMBLY_SLOTS];
+} node_tunnel_t;
+
+typedef struct node_t {
+	char *name;				/* name of this node */
+	uint32_t options;			/* options turned on for this node */
+
+	int sock;				/* Socket to use for outgoing UDP packets */
+	sockaddr_t address;			/* his real (internet) ip to send UDP packets to */
+	socklen_t addresslen;			/* length of his address */
+	char *hostname;				/* the hostname of its real ip */
+
+	node_status_t status;
+	time_t last_req_key;
+
+	uint32_t insessionid;			/* ID he puts in front of UDP packets to us, 0 if none */
+	uint32_t outsessionid;			/* ID we put in front of UDP packets to him, 0 if none */
 
 	struct node_t *nexthop;			/* nearest node from us to him */
 	struct edge_t *prevedge;		/* nearest node from him to us */
 	struct node_t *via;			/* next hop for UDP packets */
+	struct node_t *udpvia;			/* node UDP packets for him are actually sent to */
+	struct connection_t *mstbranch;		/* our MST connection that leads to him, only to compare against */
+	unsigned int graph_index;		/* number of this node in the arrays used by graph.c */
 
 	avl_tree_t *subnet_tree;		/* Pointer to a tree of subnets belonging to this node */
 
 	avl_tree_t *edge_tree;			/* Edges with this node as one of the endpoints */
+	int inedges;				/* Number of edges from other nodes to this node */
 
 	struct connection_t *connection;	/* Connection associated with this node (if a direct connection exists) */
 
-	uint32_t sent_seqno;			/* Sequence number last sent to this node */
-	uint32_t received_seqno;		/* Sequence number last received from this node */
-	uint32_t farfuture;			/* Packets in a row that have arrived from the far future */
-	unsigned char* late;			/* Bitfield marking late packets */
-
 	length_t mtu;				/* Maximum size of packets to send to this node */
 	length_t minmtu;			/* Probed minimum MTU */
 	length_t maxmtu;			/* Probed maximum MTU */
-	int mtuprobes;				/* Number of probes */
-	event_t *mtuevent;			/* Probe event */
+
+	node_tunnel_t *tunnel;			/* Keys and other state for UDP packets, NULL until keys are exchanged */
+
+	bucket_t inbucket;			/* Bytes of packets we accept from him, see IngressRate */
+	bucket_t outbucket;			/* Bytes of packets we send to him, see EgressRate */
+	bucket_t icmpbucket;			/* ICMP errors we generate for his packets */
+
+	node_stats_t stats;			/* Traffic counters, last so they stay out of the cache lines used to route packets */
 } node_t;
 
 extern struct node_t *myself;
 extern avl_tree_t *node_tree;
 extern avl_tree_t *node_udp_tree;
+extern int tunnel_idle_timeout;
 
 extern void init_nodes(void);
 extern void exit_nodes(void);
@@ -101,6 +241,16 @@ extern void node_del(node_t *);
 extern node_t *lookup_node(char *);
 extern node_t *lookup_node_udp(const sockaddr_t *);
 extern void update_node_udp(node_t *, const sockaddr_t *);
+extern node_path_t *lookup_node_path(const sockaddr_t *);
+extern node_path_t *add_node_path(node_t *, const sockaddr_t *, int);
+extern void del_node_path(node_path_t *);
+extern node_t *lookup_node_id(uint32_t);
+extern void update_node_id(node_t *, uint32_t);
+extern bool node_ids_used(void);
+extern void swap_inkey(node_t *);
+extern node_tunnel_t *node_tunnel(node_t *);
+extern void free_node_tunnel(node_t *);
+extern void expire_node_tunnels(void);
 extern void dump_nodes(void);
 
 #endif							/* __TINC_NODE_H__ */
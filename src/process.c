@@ -22,13 +22,18 @@
 
 #include "conf.h"
 #include "connection.h"
+#include "damping.h"
 #include "device.h"
 #include "edge.h"
+#include "flow.h"
+#include "io.h"
 #include "logger.h"
 #include "net.h"
 #include "node.h"
 #include "pidfile.h"
 #include "process.h"
+#include "profile.h"
+#include "route.h"
 #include "subnet.h"
 #include "utils.h"
 #include "xalloc.h"
@@ -49,6 +54,7 @@ static sigset_t emptysigset;
 
 static void memory_full(int size) {
 	logger(LOG_ERR, "Memory exhausted (couldn't allocate %d bytes), exitting.", size);
+	bufferlogger(false);
 	exit(1);
 }
 
@@ -384,12 +390,14 @@ void putenv(const char *p) {}
 void unputenv(const char *p) {}
 #endif
 
-bool execute_script(const char *name, char **envp) {
 #ifdef HAVE_SYSTEM
+/* Returns the command that runs a script, or NULL if there is no such script */
+
+static char *script_command(const char *name) {
 	char *scriptname;
 	char *interpreter = NULL;
 	config_t *cfg_interpreter;
-	int status, len, i;
+	int len;
 
 	cfg_interpreter = lookup_config(config_tree, "ScriptsInterpreter");
 #ifndef HAVE_MINGW
@@ -401,14 +409,14 @@ bool execute_script(const char *name, char **envp) {
 		len = xasprintf(&scriptname, "\"%s/%s.bat\"", confbase, name);
 #endif
 	if(len < 0)
-		return false;
+		return NULL;
 
 	scriptname[len - 1] = '\0';
 
 	/* First check if there is a script */
 	if(access(scriptname + 1, F_OK)) {
 		free(scriptname);
-		return true;
+		return NULL;
 	}
 
 	// Custom scripts interpreter
@@ -418,8 +426,44 @@ bool execute_script(const char *name, char **envp) {
 		len = xasprintf(&scriptname, "%s \"%s/%s\"", interpreter, confbase, name);
 		free(interpreter);
 		if(len < 0)
+			return NULL;
+	}
+
+	scriptname[len - 1] = '\"';
+
+	return scriptname;
+}
+
+static bool script_status(const char *name, int status) {
+#ifdef WEXITSTATUS
+	if(WIFEXITED(status)) {	/* Child exited by itself */
+		if(WEXITSTATUS(status)) {
+			logger(LOG_ERR, "Script %s exited with non-zero status %d",
+				   name, WEXITSTATUS(status));
 			return false;
+		}
+	} else if(WIFSIGNALED(status)) {	/* Child was killed by a signal */
+		logger(LOG_ERR, "Script %s was killed by signal %d (%s)",
+			   name, WTERMSIG(status), strsignal(WTERMSIG(status)));
+		return false;
+	} else {			/* Something strange happened */
+		logger(LOG_ERR, "Script %s terminated abnormally", name);
+		return false;
 	}
+#endif
+	return true;
+}
+#endif
+
+bool execute_script(const char *name, char **envp) {
+#ifdef HAVE_SYSTEM
+	char *scriptname;
+	int status, i;
+
+	scriptname = script_command(name);
+
+	if(!scriptname)
+		return true;
 
 	ifdebug(STATUS) logger(LOG_INFO, "Executing script %s", name);
 
@@ -428,7 +472,6 @@ bool execute_script(const char *name, char **envp) {
 	for(i = 0; envp[i]; i++)
 		putenv(envp[i]);
 
-	scriptname[len - 1] = '\"';
 	status = system(scriptname);
 
 	free(scriptname);
@@ -439,22 +482,8 @@ bool execute_script(const char *name, char **envp) {
 		unputenv(envp[i]);
 
 	if(status != -1) {
-#ifdef WEXITSTATUS
-		if(WIFEXITED(status)) {	/* Child exited by itself */
-			if(WEXITSTATUS(status)) {
-				logger(LOG_ERR, "Script %s exited with non-zero status %d",
-					   name, WEXITSTATUS(status));
-				return false;
-			}
-		} else if(WIFSIGNALED(status)) {	/* Child was killed by a signal */
-			logger(LOG_ERR, "Script %s was killed by signal %d (%s)",
-				   name, WTERMSIG(status), strsignal(WTERMSIG(status)));
-			return false;
-		} else {			/* Something strange happened */
-			logger(LOG_ERR, "Script %s terminated abnormally", name);
+		if(!script_status(name, status))
 			return false;
-		}
-#endif
 	} else {
 		logger(LOG_ERR, "System call `%s' failed: %s", "system", strerror(errno));
 		return false;
@@ -463,6 +492,285 @@ bool execute_script(const char *name, char **envp) {
 	return true;
 }
 
+/* Scripts that are run in the background
+
+   Scripts for state changes of nodes and subnets are queued, and started
+   from the main loop without waiting for them, at most script_max at a time.
+   In batch mode, a script that has several changes waiting is only started
+   once. It gets the environment of the first change, BATCH set to the number
+   of changes, and the environment variables of every change on its standard
+   input, one per line, with an empty line after each change. Changes for a
+   node are never moved ahead of other changes for the same node.
+*/
+
+int script_max = 1;
+bool script_batch = false;
+
+#if defined(HAVE_SYSTEM) && !defined(HAVE_MINGW)
+typedef struct script_t {
+	char *name;
+	char **envp;
+	const char *node;		/* value of NODE in envp, if any */
+	struct script_t *next;
+} script_t;
+
+typedef struct script_child_t {
+	pid_t pid;
+	char *name;
+	struct script_child_t *next;
+} script_child_t;
+
+static script_t *script_head;
+static script_t **script_tail = &script_head;
+static script_child_t *script_children;
+static int script_running;
+static bool sigchld = false;
+
+void queue_script(const char *name, char **envp) {
+	script_t *script;
+	char *scriptname;
+	int i, count;
+
+	/* Don't bother if there is no such script */
+
+	scriptname = script_command(name);
+
+	if(!scriptname)
+		return;
+
+	free(scriptname);
+
+	for(count = 0; envp[count]; count++);
+
+	script = xmalloc_and_zero(sizeof *script);
+	script->name = xstrdup(name);
+	script->envp = xmalloc((count + 1) * sizeof *script->envp);
+
+	for(i = 0; i < count; i++) {
+		script->envp[i] = xstrdup(envp[i]);
+
+		if(!strncmp(envp[i], "NODE=", 5))
+			script->node = script->envp[i] + 5;
+	}
+
+	script->envp[count] = NULL;
+
+	*script_tail = script;
+	script_tail = &script->next;
+}
+
+static void free_script(script_t *script) {
+	int i;
+
+	for(i = 0; script->envp[i]; i++)
+		free(script->envp[i]);
+
+	free(script->envp);
+	free(script->name);
+	free(script);
+}
+
+/* Move the changes that can be handled together with the first one into one list */
+
+static script_t *script_gather(void) {
+	script_t *first = script_head, *batch = first, *script, **prev;
+	const char **blocked;
+	int nblocked = 0, i;
+
+	script_head = first->next;
+	first->next = NULL;
+
+	if(!script_batch || !first->node) {
+		if(!script_head)
+			script_tail = &script_head;
+		return first;
+	}
+
+	for(script = script_head; script; script = script->next)
+		nblocked++;
+
+	blocked = xmalloc((nblocked + 1) * sizeof *blocked);
+	nblocked = 0;
+
+	for(prev = &script_head; (script = *prev);) {
+		if(!script->node)
+			break;
+
+		for(i = 0; i < nblocked; i++)
+			if(!strcmp(blocked[i], script->node))
+				break;
+
+		if(i == nblocked && !strcmp(script->name, first->name)) {
+			*prev = script->next;
+			script->next = NULL;
+			batch->next = script;
+			batch = script;
+		} else {
+			blocked[nblocked++] = script->node;
+			prev = &script->next;
+		}
+	}
+
+	free(blocked);
+
+	for(script_tail = &script_head; *script_tail; script_tail = &(*script_tail)->next);
+
+	return first;
+}
+
+static void start_script(void) {
+	script_t *first, *script;
+	script_child_t *child;
+	char *scriptname, *count = NULL;
+	FILE *input = NULL;
+	pid_t pid;
+	int i, changes = 0;
+
+	first = script_gather();
+
+	for(script = first; script; script = script->next)
+		changes++;
+
+	scriptname = script_command(first->name);
+
+	if(!scriptname)
+		goto end;
+
+	if(script_batch) {
+		input = tmpfile();
+
+		if(!input) {
+			logger(LOG_ERR, "Could not create temporary file for script %s: %s", first->name, strerror(errno));
+			goto end;
+		}
+
+		for(script = first; script; script = script->next) {
+			for(i = 0; script->envp[i]; i++)
+				fprintf(input, "%s\n", script->envp[i]);
+
+			fputc('\n', input);
+		}
+
+		fflush(input);
+		rewind(input);
+		xasprintf(&count, "BATCH=%d", changes);
+	}
+
+	ifdebug(STATUS) logger(LOG_INFO, "Executing script %s for %d change%s", first->name, changes, changes == 1 ? "" : "s");
+
+	pid = fork();
+
+	if(!pid) {
+		for(i = 0; first->envp[i]; i++)
+			putenv(first->envp[i]);
+
+		if(count)
+			putenv(count);
+
+		if(input)
+			dup2(fileno(input), 0);
+
+		/* Otherwise the script would start with SIGHUP, SIGALRM and SIGCHLD blocked, and so would anything it starts */
+
+#ifdef HAVE_PSELECT
+		io_restore_sigmask();
+#endif
+
+		execl("/bin/sh", "sh", "-c", scriptname, (char *)NULL);
+		_exit(127);
+	}
+
+	if(pid < 0) {
+		logger(LOG_ERR, "System call `%s' failed: %s", "fork", strerror(errno));
+	} else {
+		child = xmalloc(sizeof *child);
+		child->pid = pid;
+		child->name = xstrdup(first->name);
+		child->next = script_children;
+		script_children = child;
+		script_running++;
+	}
+
+end:
+	if(input)
+		fclose(input);
+
+	free(count);
+	free(scriptname);
+
+	while(first) {
+		script = first->next;
+		free_script(first);
+		first = script;
+	}
+}
+
+static void reap_child(pid_t pid, int status) {
+	script_child_t *child, **prev;
+
+	for(prev = &script_children; (child = *prev); prev = &child->next) {
+		if(child->pid != pid)
+			continue;
+
+		script_status(child->name, status);
+		*prev = child->next;
+		free(child->name);
+		free(child);
+		script_running--;
+		return;
+	}
+}
+
+/* Clean up exited children, which can be scripts and proxy processes */
+
+void reap_children(void) {
+	int status;
+	pid_t pid;
+
+	sigchld = false;
+
+	while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		reap_child(pid, status);
+}
+
+void run_scripts(void) {
+	if(sigchld)
+		reap_children();
+
+	while(script_head && script_running < script_max)
+		start_script();
+}
+
+/* Wait until all queued scripts have finished */
+
+void exit_scripts(void) {
+	int status;
+	pid_t pid;
+
+	for(run_scripts(); script_running; run_scripts()) {
+		pid = waitpid(-1, &status, 0);
+
+		if(pid < 0)
+			break;
+
+		reap_child(pid, status);
+	}
+}
+#else
+void queue_script(const char *name, char **envp) {
+	execute_script(name, envp);
+}
+
+void reap_children(void) {
+}
+
+void run_scripts(void) {
+}
+
+void exit_scripts(void) {
+}
+#endif
+
 
 /*
   Signal handlers.
@@ -494,6 +802,7 @@ static RETSIGTYPE fatal_signal_square(int a) {
 static RETSIGTYPE fatal_signal_handler(int a) {
 	struct sigaction act;
 	logger(LOG_ERR, "Got fatal signal %d (%s)", a, strsignal(a));
+	bufferlogger(false);
 
 	if(do_detach) {
 		logger(LOG_NOTICE, "Trying to re-execute in 5 seconds...");
@@ -546,17 +855,37 @@ static RETSIGTYPE sigusr1_handler(int a) {
 	dump_connections();
 }
 
+static void dump_slabs(void) {
+	logger(LOG_DEBUG, "Object caches:");
+
+	for(xslab_t *slab = xslabs; slab; slab = slab->next)
+		logger(LOG_DEBUG, " %-12s size %4lu used %8lu total %8lu", slab->name, (unsigned long)slab->size, (unsigned long)slab->used, (unsigned long)slab->total);
+}
+
 static RETSIGTYPE sigusr2_handler(int a) {
 	devops.dump_stats();
+	dump_udp_stats();
 	dump_nodes();
 	dump_edges();
+	dump_damping();
 	dump_subnets();
+	dump_neighbors();
+	dump_memory();
+	dump_slabs();
+	dump_profile();
+	dump_flows();
 }
 
 static RETSIGTYPE sigwinch_handler(int a) {
 	do_purge = true;
 }
 
+static RETSIGTYPE sigchld_handler(int a) {
+#ifdef HAVE_SYSTEM
+	sigchld = true;
+#endif
+}
+
 static RETSIGTYPE unexpected_signal_handler(int a) {
 	logger(LOG_WARNING, "Got unexpected signal %d (%s)", a, strsignal(a));
 }
@@ -579,7 +908,7 @@ static struct {
 	{SIGINT, sigint_handler},
 	{SIGUSR1, sigusr1_handler},
 	{SIGUSR2, sigusr2_handler},
-	{SIGCHLD, ignore_signal_handler},
+	{SIGCHLD, sigchld_handler},
 	{SIGALRM, sigalrm_handler},
 	{SIGWINCH, sigwinch_handler},
 	{SIGABRT, SIG_DFL},
@@ -24,9 +24,15 @@
 extern bool do_detach;
 extern bool sighup;
 extern bool sigalrm;
+extern int script_max;
+extern bool script_batch;
 
 extern void setup_signals(void);
 extern bool execute_script(const char *, char **);
+extern void queue_script(const char *, char **);
+extern void reap_children(void);
+extern void run_scripts(void);
+extern void exit_scripts(void);
 extern bool detach(void);
 extern bool kill_other(int);
 
@@ -0,0 +1,113 @@
+/*
+    profile.c -- time spent in each stage of the packet path
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "system.h"
+
+#include "logger.h"
+#include "profile.h"
+
+/*
+  With --enable-profiling, every stage of the packet path records how long
+  it took in a histogram with power of two buckets, in CPU cycles as read
+  with rdtsc on x86, or in nanoseconds from the monotonic clock elsewhere.
+  Without it, the hooks in the packet path compile to nothing, and the
+  histograms stay empty.
+
+  The threads of CryptoPipeline encrypt and decrypt packets as well, so
+  the histograms are updated with atomic additions. Stages nest: route
+  includes the lookup, and for packets that are sent on right away also
+  the compression, encryption and sending.
+*/
+
+const char *const profile_stage_names[PROFILE_STAGES] = {
+	"device_read",
+	"route",
+	"lookup",
+	"compress",
+	"encrypt",
+	"mac",
+	"send",
+	"receive",
+	"verify",
+	"decrypt",
+	"uncompress",
+	"device_write",
+};
+
+#ifdef PROFILE_RDTSC
+const char *const profile_unit = "cycles";
+#else
+const char *const profile_unit = "ns";
+#endif
+
+profile_histogram_t profile_histograms[PROFILE_STAGES];
+
+#ifdef ENABLE_PROFILING
+void profile_record(profile_stage_t stage, uint64_t elapsed) {
+	profile_histogram_t *h = &profile_histograms[stage];
+	int bucket = elapsed ? 64 - __builtin_clzll(elapsed) : 0;
+
+	if(bucket >= PROFILE_BUCKETS)
+		bucket = PROFILE_BUCKETS - 1;
+
+	__sync_fetch_and_add(&h->count, 1);
+	__sync_fetch_and_add(&h->total, elapsed);
+	__sync_fetch_and_add(&h->buckets[bucket], 1);
+}
+#endif
+
+/* The upper bound of the bucket that holds the given percentile */
+
+uint64_t profile_percentile(const profile_histogram_t *h, int percent) {
+	uint64_t wanted = (h->count * percent + 99) / 100;
+	uint64_t seen = 0;
+
+	for(int i = 0; i < PROFILE_BUCKETS; i++) {
+		seen += h->buckets[i];
+
+		if(seen && seen >= wanted)
+			return (uint64_t)1 << i;
+	}
+
+	return 0;
+}
+
+void profile_reset(void) {
+	memset(profile_histograms, 0, sizeof profile_histograms);
+}
+
+void dump_profile(void) {
+#ifdef ENABLE_PROFILING
+	logger(LOG_DEBUG, "Time per stage of the packet path, in %s:", profile_unit);
+	logger(LOG_DEBUG, " %-12s %12s %10s %10s %10s %10s", "stage", "count", "mean", "p50", "p90", "p99");
+
+	for(int i = 0; i < PROFILE_STAGES; i++) {
+		const profile_histogram_t *h = &profile_histograms[i];
+
+		if(!h->count)
+			continue;
+
+		logger(LOG_DEBUG, " %-12s %12"PRIu64" %10"PRIu64" %10"PRIu64" %10"PRIu64" %10"PRIu64,
+				profile_stage_names[i], h->count, h->total / h->count,
+				profile_percentile(h, 50), profile_percentile(h, 90), profile_percentile(h, 99));
+	}
+
+	logger(LOG_DEBUG, "End of profile.");
+#endif
+}
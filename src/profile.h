@@ -0,0 +1,87 @@
+/*
+    profile.h -- header for profile.c
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __TINC_PROFILE_H__
+#define __TINC_PROFILE_H__
+
+#if defined(ENABLE_PROFILING) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define PROFILE_RDTSC 1
+#endif
+
+typedef enum profile_stage_t {
+	PROFILE_DEVICE_READ,			/* devops.read() */
+	PROFILE_ROUTE,				/* route(), including everything it does to send the packet on */
+	PROFILE_LOOKUP,				/* lookup_subnet_*() for a routed packet */
+	PROFILE_COMPRESS,			/* compress_packet() */
+	PROFILE_ENCRYPT,			/* the cipher, or the AEAD cipher and its tag */
+	PROFILE_MAC,				/* the HMAC of an outgoing packet */
+	PROFILE_SEND,				/* one sendto() or sendmmsg() call */
+	PROFILE_RECEIVE,			/* one recvfrom() or recvmmsg() call */
+	PROFILE_VERIFY,				/* the HMAC of an incoming packet */
+	PROFILE_DECRYPT,			/* the cipher, or the AEAD cipher and its tag */
+	PROFILE_UNCOMPRESS,			/* uncompress_packet() */
+	PROFILE_DEVICE_WRITE,			/* devops.write() */
+	PROFILE_STAGES,
+} profile_stage_t;
+
+#define PROFILE_BUCKETS 40			/* bucket i counts times from 2^(i-1) up to 2^i */
+
+typedef struct profile_histogram_t {
+	uint64_t count;
+	uint64_t total;
+	uint64_t buckets[PROFILE_BUCKETS];
+} profile_histogram_t;
+
+extern const char *const profile_stage_names[PROFILE_STAGES];
+extern const char *const profile_unit;
+extern profile_histogram_t profile_histograms[PROFILE_STAGES];
+
+#ifdef ENABLE_PROFILING
+
+static inline uint64_t profile_clock(void) {
+#ifdef PROFILE_RDTSC
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Time a stage: profile_begin(t) declares t, profile_end() records the time since then */
+#define profile_begin(t) uint64_t t = profile_clock()
+#define profile_end(stage, t) profile_record((stage), profile_clock() - (t))
+
+extern void profile_record(profile_stage_t, uint64_t);
+
+#else
+
+/* Nothing at all is left of them */
+#define profile_begin(t)
+#define profile_end(stage, t)
+
+#endif
+
+extern uint64_t profile_percentile(const profile_histogram_t *, int);
+extern void profile_reset(void);
+extern void dump_profile(void);
+
+#endif							/* __TINC_PROFILE_H__ */
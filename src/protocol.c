@@ -40,6 +40,8 @@ static bool (*request_handlers[])(connection_t *) = {
 		add_subnet_h, del_subnet_h,
 		add_edge_h, del_edge_h,
 		key_changed_h, req_key_h, ans_key_h, tcppacket_h,
+		add_subnets_h, add_edges_h,
+		resume_h,
 };
 
 /* Request names */
@@ -50,10 +52,10 @@ static char (*request_name[]) = {
 		"PING", "PONG",
 		"ADD_SUBNET", "DEL_SUBNET",
 		"ADD_EDGE", "DEL_EDGE", "KEY_CHANGED", "REQ_KEY", "ANS_KEY", "PACKET",
+		"ADD_SUBNETS", "ADD_EDGES",
+		"RESUME",
 };
 
-static avl_tree_t *past_request_tree;
-
 bool check_id(const char *id) {
 	for(; *id; id++)
 		if(!isalnum(*id) && *id != '_')
@@ -85,7 +87,7 @@ bool send_request(connection_t *c, const char *format, ...) {
 	}
 
 	ifdebug(PROTOCOL) {
-		sscanf(buffer, "%d", &request);
+		request = atoi(buffer);
 		ifdebug(META)
 			logger(LOG_DEBUG, "Sending %s to %s (%s): %s",
 				   request_name[request], c->name, c->hostname, buffer);
@@ -107,43 +109,254 @@ void forward_request(connection_t *from) {
 	int request;
 
 	ifdebug(PROTOCOL) {
-		sscanf(from->buffer, "%d", &request);
+		request = atoi(from->request);
 		ifdebug(META)
 			logger(LOG_DEBUG, "Forwarding %s from %s (%s): %s",
 				   request_name[request], from->name, from->hostname,
-				   from->buffer);
+				   from->request);
 		else
 			logger(LOG_DEBUG, "Forwarding %s from %s (%s)",
 				   request_name[request], from->name, from->hostname);
 	}
 
-	from->buffer[from->reqlen - 1] = '\n';
+	from->request[from->reqlen - 1] = '\n';
+
+	broadcast_meta(from, from->request, from->reqlen);
+}
+
+/*
+  ADD_SUBNETS and ADD_EDGES carry many subnets of one owner, or many edges
+  from one node: the name, followed by the arguments of as many ADD_SUBNET
+  or ADD_EDGE requests as fit in BULK_SIZE bytes and BULK_ITEMS items. They
+  are only sent to peers that set OPTION_BULK in their ACK. The whole request
+  is checked with seen_request(), and forwarded as it is if every item in it
+  was new to us. Otherwise only the items that were are sent on, and peers
+  without OPTION_BULK get them one request at a time.
+*/
+
+void bulk_begin(bulk_request_t *b, connection_t *c, request_t request, const char *name) {
+	b->c = c;
+	b->request = request;
+	b->name = name;
+	b->items = 0;
+	b->len = 0;
+}
+
+void bulk_end(bulk_request_t *b) {
+	if(b->items)
+		send_request(b->c, "%d %x %s%s", b->request, rand(), b->name, b->buffer);
+
+	b->items = 0;
+	b->len = 0;
+}
+
+void bulk_add(bulk_request_t *b, const char *format, ...) {
+	va_list args;
+	char item[MAX_STRING_SIZE];
+	int len;
+
+	va_start(args, format);
+	len = vsnprintf(item, sizeof item, format, args);
+	va_end(args);
+
+	if(len < 0 || len >= (int)sizeof item)
+		return;
+
+	/* Leave room for the request number, the nonce and the name */
+
+	if(b->items && (b->items >= BULK_ITEMS || b->len + len + 16 + (int)strlen(b->name) >= BULK_SIZE))
+		bulk_end(b);
+
+	if(b->len + len >= (int)sizeof b->buffer)
+		return;
+
+	memcpy(b->buffer + b->len, item, len + 1);
+	b->len += len;
+	b->items++;
+}
+
+/* The arguments of one item of a bulk request, each with a space in front */
+
+static int bulk_item(const connection_t *c, int item, int fields, char *buffer, int size) {
+	int len = 0;
+
+	for(int i = 3 + item * fields; i < 3 + (item + 1) * fields && len < size; i++)
+		len += snprintf(buffer + len, size - len, " %s", c->argv[i]);
+
+	return len < size ? len : -1;
+}
+
+void forward_bulk_request(connection_t *from, request_t single, int fields, const bool *forward) {
+	avl_node_t *node;
+	connection_t *c;
+	int items = (from->argc - 3) / fields;
+	bool all = true, any = false;
+	char buffer[MAXBUFSIZE], item[MAXBUFSIZE];
+	int len = 0, itemlen;
+
+	for(int i = 0; i < items; i++) {
+		all = all && forward[i];
+		any = any || forward[i];
+	}
+
+	if(!any)
+		return;
+
+	if(all) {
+		from->request[from->reqlen - 1] = '\n';
+	} else {
+		len = snprintf(buffer, sizeof buffer, "%s %x %s", from->argv[0], rand(), from->argv[2]);
+
+		for(int i = 0; i < items; i++) {
+			if(forward[i] && (itemlen = bulk_item(from, i, fields, buffer + len, sizeof buffer - len - 1)) > 0)
+				len += itemlen;
+		}
+
+		buffer[len++] = '\n';
+	}
+
+	ifdebug(PROTOCOL) logger(LOG_DEBUG, "Forwarding %s from %s (%s)%s",
+			request_name[atoi(from->request)], from->name, from->hostname, all ? "" : ", in part");
+
+	for(node = connection_tree->head; node; node = node->next) {
+		c = node->data;
+
+		if(c == from || !c->status.active)
+			continue;
+
+		if(c->options & OPTION_BULK) {
+			if(all)
+				send_meta(c, from->request, from->reqlen);
+			else
+				send_meta(c, buffer, len);
+
+			continue;
+		}
+
+		for(int i = 0; i < items; i++)
+			if(forward[i] && bulk_item(from, i, fields, item, sizeof item) > 0)
+				send_request(c, "%d %x %s%s", single, rand(), from->argv[2], item);
+	}
+}
+
+/* Split a request into whitespace separated arguments, in one pass,
+   the way sscanf() would see them. The request is copied first, so that
+   it stays intact for seen_request() and forward_request(). The arguments
+   are valid until the next request is received. */
+
+static char request_args[MAXBUFSIZE];
+static char *request_argv[MAX_REQUEST_ARGS];
+
+void split_request(connection_t *c) {
+	char *p = request_args, *end = request_args + c->reqlen - 1;
+
+	memcpy(request_args, c->request, c->reqlen - 1);
+	*end = '\0';
+	c->argc = 0;
+	c->argv = request_argv;
+
+	while(c->argc < MAX_REQUEST_ARGS) {
+		while(p < end && (isspace((unsigned char)*p) || !*p))
+			p++;
+
+		if(p == end)
+			break;
+
+		c->argv[c->argc++] = p;
+
+		while(p < end && *p && !isspace((unsigned char)*p))
+			p++;
+
+		*p++ = '\0';
+
+		if(p > end)
+			break;
+	}
+}
+
+/* Convert an argument like %d and %x would, ignoring anything after the number */
+
+bool arg2int(const char *arg, int *value) {
+	bool negative = false;
+	long long result = 0;
+
+	if(*arg == '-' || *arg == '+')
+		negative = *arg++ == '-';
+
+	if(*arg < '0' || *arg > '9')
+		return false;
+
+	while(*arg >= '0' && *arg <= '9') {
+		result = result * 10 + (*arg++ - '0');
+
+		if(result > (long long)INT_MAX + 1)
+			return false;
+	}
+
+	if(negative)
+		result = -result;
+
+	if(result > INT_MAX)
+		return false;
+
+	*value = result;
+	return true;
+}
+
+bool arg2hex(const char *arg, uint32_t *value) {
+	uint32_t result = 0;
+	int digit, digits = 0;
+
+	if(arg[0] == '0' && (arg[1] == 'x' || arg[1] == 'X'))
+		arg += 2;
+
+	for(;; arg++, digits++) {
+		if(*arg >= '0' && *arg <= '9')
+			digit = *arg - '0';
+		else if(*arg >= 'a' && *arg <= 'f')
+			digit = *arg - 'a' + 10;
+		else if(*arg >= 'A' && *arg <= 'F')
+			digit = *arg - 'A' + 10;
+		else
+			break;
+
+		if(result >> 28)
+			return false;
+
+		result = result << 4 | digit;
+	}
+
+	if(!digits)
+		return false;
 
-	broadcast_meta(from, from->buffer, from->reqlen);
+	*value = result;
+	return true;
 }
 
 bool receive_request(connection_t *c) {
 	int request;
 
 	if(c->outgoing && proxytype == PROXY_HTTP && c->allow_request == ID) {
-		if(!c->buffer[0] || c->buffer[0] == '\r')
+		if(!c->request[0] || c->request[0] == '\r')
 			return true;
-		if(!strncasecmp(c->buffer, "HTTP/1.1 ", 9)) {
-			if(!strncmp(c->buffer + 9, "200", 3)) {
+		if(!strncasecmp(c->request, "HTTP/1.1 ", 9)) {
+			if(!strncmp(c->request + 9, "200", 3)) {
 				logger(LOG_DEBUG, "Proxy request granted");
 				return true;
 			} else {
-				logger(LOG_DEBUG, "Proxy request rejected: %s", c->buffer + 9);
+				logger(LOG_DEBUG, "Proxy request rejected: %s", c->request + 9);
 				return false;
 			}
 		}
 	}
 
-	if(sscanf(c->buffer, "%d", &request) == 1) {
+	split_request(c);
+
+	if(c->argc && arg2int(c->argv[0], &request)) {
 		if((request < 0) || (request >= LAST) || !request_handlers[request]) {
 			ifdebug(META)
 				logger(LOG_DEBUG, "Unknown request from %s (%s): %s",
-					   c->name, c->hostname, c->buffer);
+					   c->name, c->hostname, c->request);
 			else
 				logger(LOG_ERR, "Unknown request from %s (%s)",
 					   c->name, c->hostname);
@@ -154,14 +367,17 @@ bool receive_request(connection_t *c) {
 				ifdebug(META)
 					logger(LOG_DEBUG, "Got %s from %s (%s): %s",
 						   request_name[request], c->name, c->hostname,
-						   c->buffer);
+						   c->request);
 				else
 					logger(LOG_DEBUG, "Got %s from %s (%s)",
 						   request_name[request], c->name, c->hostname);
 			}
 		}
 
-		if((c->allow_request != ALL) && (c->allow_request != request)) {
+		/* While we wait for him to resume the session we offered, he may send a METAKEY instead */
+
+		if((c->allow_request != ALL) && (c->allow_request != request)
+				&& !(c->status.resuming && request == METAKEY)) {
 			logger(LOG_ERR, "Unauthorized request from %s (%s)", c->name,
 				   c->hostname);
 			return false;
@@ -183,58 +399,116 @@ bool receive_request(connection_t *c) {
 	return true;
 }
 
-static int past_request_compare(const past_request_t *a, const past_request_t *b) {
-	return strcmp(a->request, b->request);
+/* Requests we have already seen are remembered only by a 64-bit fingerprint,
+   in a fixed size table of small sets. Every call to age_past_requests()
+   starts a new generation, and entries older than pinginterval are ignored
+   from then on. When a set is full, its oldest entry is replaced, so memory
+   use stays the same no matter how many requests are flooded at us.
+   With LowMemory, the table is a lot smaller, which is plenty for a node
+   with only a few connections. */
+
+#define PAST_REQUEST_SETS 8192			/* must be a power of two */
+#define PAST_REQUEST_SETS_LOW 256
+#define PAST_REQUEST_WAYS 8
+
+typedef struct past_request_set_t {
+	uint64_t fingerprint[PAST_REQUEST_WAYS];
+	uint32_t generation[PAST_REQUEST_WAYS];	/* 0 means unused */
+} past_request_set_t;
+
+static past_request_set_t *past_requests;
+static unsigned int past_request_sets;
+static uint32_t past_request_generation = 1;
+
+static uint64_t request_fingerprint(const char *request) {
+	uint64_t hash = 14695981039346656037ULL;
+
+	for(; *request; request++)
+		hash = (hash ^ (unsigned char)*request) * 1099511628211ULL;
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+
+	return hash;
 }
 
-static void free_past_request(past_request_t *r) {
-	if(r->request)
-		free(r->request);
+/* Number of generations an entry lives, such that it is kept for at least pinginterval seconds */
 
-	free(r);
+static uint32_t past_request_lifetime(void) {
+	return (pinginterval + pingtimeout - 1) / pingtimeout + 1;
 }
 
 void init_requests(void) {
-	past_request_tree = avl_alloc_tree((avl_compare_t) past_request_compare, (avl_action_t) free_past_request);
+	past_request_sets = low_memory ? PAST_REQUEST_SETS_LOW : PAST_REQUEST_SETS;
+	past_requests = xmalloc_and_zero(past_request_sets * sizeof(*past_requests));
 }
 
 void exit_requests(void) {
-	avl_delete_tree(past_request_tree);
+	free(past_requests);
+	past_requests = NULL;
+}
+
+unsigned long past_requests_memory(int *entries) {
+	*entries = past_request_sets * PAST_REQUEST_WAYS;
+	return past_request_sets * sizeof(*past_requests);
 }
 
 bool seen_request(char *request) {
-	past_request_t *new, p = {NULL};
+	uint64_t fingerprint = request_fingerprint(request);
+	past_request_set_t *set = &past_requests[fingerprint & (past_request_sets - 1)];
+	uint32_t lifetime = past_request_lifetime();
+	uint32_t age, oldest = 0;
+	int i, victim = 0;
 
-	p.request = request;
+	for(i = 0; i < PAST_REQUEST_WAYS; i++) {
+		age = past_request_generation - set->generation[i];
 
-	if(avl_search(past_request_tree, &p)) {
-		ifdebug(SCARY_THINGS) logger(LOG_DEBUG, "Already seen request");
-		return true;
-	} else {
-		new = xmalloc(sizeof(*new));
-		new->request = xstrdup(request);
-		new->firstseen = now;
-		avl_insert(past_request_tree, new);
-		return false;
+		if(set->generation[i] && age < lifetime && set->fingerprint[i] == fingerprint) {
+			ifdebug(SCARY_THINGS) logger(LOG_DEBUG, "Already seen request");
+			return true;
+		}
+
+		/* Unused entries have the highest age, so they are picked first */
+
+		if(age > oldest) {
+			oldest = age;
+			victim = i;
+		}
 	}
+
+	set->fingerprint[victim] = fingerprint;
+	set->generation[victim] = past_request_generation;
+	return false;
 }
 
 void age_past_requests(void) {
-	avl_node_t *node, *next;
-	past_request_t *p;
-	int left = 0, deleted = 0;
+	uint32_t lifetime = past_request_lifetime();
+	uint32_t age;
+	int i, j, left = 0, deleted = 0;
 
-	for(node = past_request_tree->head; node; node = next) {
-		next = node->next;
-		p = node->data;
+	if(!++past_request_generation)
+		past_request_generation = 1;
 
-		if(p->firstseen + pinginterval <= now)
-			avl_delete_node(past_request_tree, node), deleted++;
-		else
-			left++;
-	}
+	/* Expired entries are simply ignored from now on; only count them if someone is looking */
+
+	ifdebug(SCARY_THINGS) {
+		for(i = 0; i < past_request_sets; i++) {
+			for(j = 0; j < PAST_REQUEST_WAYS; j++) {
+				if(!past_requests[i].generation[j])
+					continue;
 
-	if(left || deleted)
-		ifdebug(SCARY_THINGS) logger(LOG_DEBUG, "Aging past requests: deleted %d, left %d",
-			   deleted, left);
+				age = past_request_generation - past_requests[i].generation[j];
+
+				if(age < lifetime)
+					left++;
+				else if(age == lifetime)
+					deleted++;
+			}
+		}
+
+		if(left || deleted)
+			logger(LOG_DEBUG, "Aging past requests: deleted %d, left %d",
+				   deleted, left);
+	}
 }
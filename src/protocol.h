@@ -27,6 +27,15 @@
 
 #define PROT_CURRENT 17
 
+/* Optional extension offered in REQ_KEY, and acknowledged with a flag in the compression field of ANS_KEY */
+
+#define KEY_EXT_SESSIONID "SessionID"
+#define KEY_EXT_SESSIONID_FLAG 0x100
+#define KEY_EXT_RAWPACKETS "RawPackets"
+#define KEY_EXT_RAWPACKETS_FLAG 0x200
+#define ID_EXT_METACOMPRESSION "MetaCompression"
+#define ID_EXT_RESUME "Resume"			/* Resume=<nonce>[:<ticket>], see resume.c */
+
 /* Silly Windows */
 
 #ifdef ERROR
@@ -44,14 +53,11 @@ typedef enum request_t {
 	ADD_EDGE, DEL_EDGE,
 	KEY_CHANGED, REQ_KEY, ANS_KEY,
 	PACKET,
+	ADD_SUBNETS, ADD_EDGES,			/* many at once, only to peers that set OPTION_BULK */
+	RESUME,					/* instead of METAKEY, only to peers that sent ID_EXT_RESUME */
 	LAST						/* Guardian for the highest request number */
 } request_t;
 
-typedef struct past_request_t {
-	char *request;
-	time_t firstseen;
-} past_request_t;
-
 extern bool tunnelserver;
 extern bool strictsubnets;
 
@@ -63,6 +69,20 @@ extern bool strictsubnets;
 #define MAX_STRING_SIZE 2049
 #define MAX_STRING "%2048s"
 
+/* Limits of ADD_SUBNETS and ADD_EDGES, so every version of tinc can receive them */
+
+#define BULK_SIZE 2048
+#define BULK_ITEMS 50
+
+typedef struct bulk_request_t {
+	struct connection_t *c;
+	request_t request;
+	const char *name;			/* the owner of the subnets, or the node the edges are from */
+	int items;
+	int len;
+	char buffer[BULK_SIZE];			/* the items, each with a space in front */
+} bulk_request_t;
+
 #include "edge.h"
 #include "net.h"
 #include "node.h"
@@ -72,18 +92,27 @@ extern bool strictsubnets;
 
 extern bool send_request(struct connection_t *, const char *, ...) __attribute__ ((__format__(printf, 2, 3)));
 extern void forward_request(struct connection_t *);
+extern void forward_bulk_request(struct connection_t *, request_t, int, const bool *);
+extern void bulk_begin(bulk_request_t *, struct connection_t *, request_t, const char *);
+extern void bulk_add(bulk_request_t *, const char *, ...) __attribute__ ((__format__(printf, 2, 3)));
+extern void bulk_end(bulk_request_t *);
 extern bool receive_request(struct connection_t *);
+extern void split_request(struct connection_t *);
+extern bool arg2int(const char *, int *);
+extern bool arg2hex(const char *, uint32_t *);
 extern bool check_id(const char *);
 
 extern void init_requests(void);
 extern void exit_requests(void);
 extern bool seen_request(char *);
+extern unsigned long past_requests_memory(int *);
 extern void age_past_requests(void);
 
 /* Requests */
 
 extern bool send_id(struct connection_t *);
 extern bool send_metakey(struct connection_t *);
+extern bool send_resume(struct connection_t *);
 extern bool send_challenge(struct connection_t *);
 extern bool send_chal_reply(struct connection_t *);
 extern bool send_ack(struct connection_t *);
@@ -93,10 +122,13 @@ extern bool send_termreq(struct connection_t *);
 extern bool send_ping(struct connection_t *);
 extern bool send_pong(struct connection_t *);
 extern bool send_add_subnet(struct connection_t *, const struct subnet_t *);
+extern void send_add_subnets(struct connection_t *, const struct node_t *);
 extern bool send_del_subnet(struct connection_t *, const struct subnet_t *);
 extern bool send_add_edge(struct connection_t *, const struct edge_t *);
+extern void send_add_edges(struct connection_t *, const struct node_t *);
 extern bool send_del_edge(struct connection_t *, const struct edge_t *);
-extern void send_key_changed(void);
+extern void rotate_keys(void);
+extern void schedule_rekey(struct node_t *, int);
 extern bool send_req_key(struct node_t *);
 extern bool send_ans_key(struct node_t *);
 extern bool send_tcppacket(struct connection_t *, const struct vpn_packet_t *);
@@ -105,6 +137,7 @@ extern bool send_tcppacket(struct connection_t *, const struct vpn_packet_t *);
 
 extern bool id_h(struct connection_t *);
 extern bool metakey_h(struct connection_t *);
+extern bool resume_h(struct connection_t *);
 extern bool challenge_h(struct connection_t *);
 extern bool chal_reply_h(struct connection_t *);
 extern bool ack_h(struct connection_t *);
@@ -114,8 +147,10 @@ extern bool termreq_h(struct connection_t *);
 extern bool ping_h(struct connection_t *);
 extern bool pong_h(struct connection_t *);
 extern bool add_subnet_h(struct connection_t *);
+extern bool add_subnets_h(struct connection_t *);
 extern bool del_subnet_h(struct connection_t *);
 extern bool add_edge_h(struct connection_t *);
+extern bool add_edges_h(struct connection_t *);
 extern bool del_edge_h(struct connection_t *);
 extern bool key_changed_h(struct connection_t *);
 extern bool req_key_h(struct connection_t *);
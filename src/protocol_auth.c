@@ -36,7 +36,9 @@
 #include "netutl.h"
 #include "node.h"
 #include "protocol.h"
+#include "resume.h"
 #include "utils.h"
+#include "worker.h"
 #include "xalloc.h"
 
 static bool send_proxyrequest(connection_t *c) {
@@ -126,23 +128,82 @@ static bool send_proxyrequest(connection_t *c) {
 }
 
 bool send_id(connection_t *c) {
+	char resume[sizeof ID_EXT_RESUME + 2 * RESUME_NONCE_LENGTH + 2 * RESUME_TICKET_LENGTH + 3] = "";
+
 	if(proxytype && c->outgoing)
 		if(!send_proxyrequest(c))
 			return false;
 
-	return send_request(c, "%d %s %d", ID, myself->connection->name,
-						myself->connection->protocol_version);
+	/* Send a nonce, so he can resume a session with us, and the ticket of the session
+	   we have with him if we are connecting to him. Older versions ignore this as well. */
+
+	if(resume_timeout && !bypass_security && RAND_bytes((unsigned char *)c->mynonce, RESUME_NONCE_LENGTH) == 1) {
+		int len = snprintf(resume, sizeof resume, " %s=", ID_EXT_RESUME);
+
+		bin2hex(c->mynonce, resume + len, RESUME_NONCE_LENGTH);
+		len += 2 * RESUME_NONCE_LENGTH;
+
+		if(c->outgoing && (c->resume = resume_take(c->name))) {
+			resume[len++] = ':';
+			bin2hex((char *)c->resume->ticket, resume + len, RESUME_TICKET_LENGTH);
+			len += 2 * RESUME_TICKET_LENGTH;
+		}
+
+		resume[len] = '\0';
+	}
+
+	/* Tell him we can decompress meta data, older versions ignore this */
+
+#ifdef HAVE_ZLIB
+	return send_request(c, "%d %s %d %s%s", ID, myself->connection->name,
+						myself->connection->protocol_version, ID_EXT_METACOMPRESSION, resume);
+#else
+	return send_request(c, "%d %s %d%s", ID, myself->connection->name,
+						myself->connection->protocol_version, resume);
+#endif
+}
+
+/* Take the nonce from the Resume=<nonce>[:<ticket>] in his ID; true if there is a ticket as well */
+
+static bool parse_resume(connection_t *c, char *arg, char *ticket) {
+	char *colon = strchr(arg, ':');
+
+	if(colon)
+		*colon++ = '\0';
+
+	if(strlen(arg) != 2 * RESUME_NONCE_LENGTH || !hex2bin(arg, c->hisnonce, RESUME_NONCE_LENGTH))
+		return false;
+
+	c->status.resumable = true;
+
+	return colon && strlen(colon) == 2 * RESUME_TICKET_LENGTH && hex2bin(colon, ticket, RESUME_TICKET_LENGTH);
 }
 
 bool id_h(connection_t *c) {
-	char name[MAX_STRING_SIZE];
+	char ticket[RESUME_TICKET_LENGTH];
+	bool hasticket = false;
+	resume_t *r;
+	char *name;
+	int i;
 
-	if(sscanf(c->buffer, "%*d " MAX_STRING " %d", name, &c->protocol_version) != 2) {
+	if(c->argc < 3 || !arg2int(c->argv[2], &c->protocol_version)) {
 		logger(LOG_ERR, "Got bad %s from %s (%s)", "ID", c->name,
 			   c->hostname);
 		return false;
 	}
 
+	name = c->argv[1];
+
+	c->status.metacompression = false;
+	c->status.resumable = false;
+
+	for(i = 3; i < c->argc; i++) {
+		if(!strcmp(c->argv[i], ID_EXT_METACOMPRESSION))
+			c->status.metacompression = true;
+		else if(!strncmp(c->argv[i], ID_EXT_RESUME "=", sizeof ID_EXT_RESUME))
+			hasticket = parse_resume(c, c->argv[i] + sizeof ID_EXT_RESUME, ticket);
+	}
+
 	/* Check if identity is a valid name */
 
 	if(!check_id(name)) {
@@ -194,11 +255,124 @@ bool id_h(connection_t *c) {
 		return false;
 	}
 
+	/* If we offered him a session, he answers with a RESUME if he still has it, or a METAKEY */
+
+	if(c->resume) {
+		if(c->status.resumable) {
+			c->status.resuming = true;
+			c->allow_request = RESUME;
+			return true;
+		}
+
+		free_resume(c->resume);
+		c->resume = NULL;
+	}
+
+	/* If he offered us one we still have, resume it */
+
+	if(hasticket && !c->outgoing && c->status.resumable && (r = resume_take(c->name))) {
+		if(!memcmp(r->ticket, ticket, RESUME_TICKET_LENGTH)) {
+			c->resume = r;
+			c->allow_request = RESUME;
+			return send_resume(c);
+		}
+
+		free_resume(r);
+	}
+
 	c->allow_request = METAKEY;
 
 	return send_metakey(c);
 }
 
+/* Encrypt and compress everything we send after our METAKEY or RESUME, with c->outkey */
+
+static bool start_meta_out(connection_t *c) {
+	int len = c->outkeylength;
+
+	if(c->outcipher) {
+		if(!EVP_EncryptInit(c->outctx, c->outcipher,
+					(unsigned char *)c->outkey + len - c->outcipher->key_len,
+					(unsigned char *)c->outkey + len - c->outcipher->key_len -
+					c->outcipher->iv_len)) {
+			logger(LOG_ERR, "Error during initialisation of cipher for %s (%s): %s",
+					c->name, c->hostname, ERR_error_string(ERR_get_error(), NULL));
+			return false;
+		}
+
+		c->status.encryptout = true;
+	}
+
+	if(c->outcompression && !start_compress_meta(c, c->outcompression))
+		return false;
+
+	return true;
+}
+
+/* Decrypt and decompress everything he sends after his METAKEY or RESUME, with c->inkey */
+
+static bool start_meta_in(connection_t *c, int cipher, int digest, int maclength, int compression) {
+	int len = c->inkeylength;
+
+	/* All incoming requests will now be encrypted. */
+
+	/* Check and lookup cipher and digest algorithms */
+
+	if(cipher) {
+		c->incipher = EVP_get_cipherbynid(cipher);
+		
+		if(!c->incipher) {
+			logger(LOG_ERR, "%s (%s) uses unknown cipher!", c->name, c->hostname);
+			return false;
+		}
+
+		if(!EVP_DecryptInit(c->inctx, c->incipher,
+					(unsigned char *)c->inkey + len - c->incipher->key_len,
+					(unsigned char *)c->inkey + len - c->incipher->key_len -
+					c->incipher->iv_len)) {
+			logger(LOG_ERR, "Error during initialisation of cipher from %s (%s): %s",
+					c->name, c->hostname, ERR_error_string(ERR_get_error(), NULL));
+			return false;
+		}
+
+		c->status.decryptin = true;
+	} else {
+		c->incipher = NULL;
+	}
+
+	c->inmaclength = maclength;
+
+	if(digest) {
+		c->indigest = EVP_get_digestbynid(digest);
+
+		if(!c->indigest) {
+			logger(LOG_ERR, "Node %s (%s) uses unknown digest!", c->name, c->hostname);
+			return false;
+		}
+
+		if(c->inmaclength > c->indigest->md_size || c->inmaclength < 0) {
+			logger(LOG_ERR, "%s (%s) uses bogus MAC length!", c->name, c->hostname);
+			return false;
+		}
+	} else {
+		c->indigest = NULL;
+	}
+
+	/* Further incoming requests are compressed if he asked for it */
+
+	if(compression < 0 || compression > 9) {
+		logger(LOG_ERR, "%s (%s) uses bogus compression level!", c->name, c->hostname);
+		return false;
+	}
+
+	c->incompression = compression;
+
+	if(c->incompression && !start_decompress_meta(c))
+		return false;
+
+	return true;
+}
+
 bool send_metakey(connection_t *c) {
 	bool x;
 
@@ -209,6 +383,7 @@ bool send_metakey(connection_t *c) {
 	char buffer[2 * len + 1];
 	
 	c->outkey = xrealloc(c->outkey, len);
+	c->outkeylength = len;
 
 	if(!c->outctx)
 		c->outctx = xmalloc_and_zero(sizeof(*c->outctx));
@@ -259,7 +434,9 @@ bool send_metakey(connection_t *c) {
 	bin2hex(buffer, buffer, len);
 	buffer[len * 2] = '\0';
 
-	/* Send the meta key */
+	/* Send the meta key, and the level we compress everything after it with if he can handle that */
+
+	c->outcompression = c->status.metacompression ? metacompression : 0;
 
 	x = send_request(c, "%d %d %d %d %d %s", METAKEY,
 					 c->outcipher ? c->outcipher->nid : 0,
@@ -268,33 +445,100 @@ bool send_metakey(connection_t *c) {
 
 	/* Further outgoing requests are encrypted with the key we just generated */
 
-	if(c->outcipher) {
-		if(!EVP_EncryptInit(c->outctx, c->outcipher,
-					(unsigned char *)c->outkey + len - c->outcipher->key_len,
-					(unsigned char *)c->outkey + len - c->outcipher->key_len -
-					c->outcipher->iv_len)) {
-			logger(LOG_ERR, "Error during initialisation of cipher for %s (%s): %s",
-					c->name, c->hostname, ERR_error_string(ERR_get_error(), NULL));
-			return false;
-		}
+	return start_meta_out(c) && x;
+}
 
-		c->status.encryptout = true;
+/* The rest of METAKEY, once his meta key has been decrypted into c->inkey */
+
+static bool metakey_finish(connection_t *c, int cipher, int digest, int maclength, int compression) {
+	int len = c->inkeylength;
+
+	ifdebug(SCARY_THINGS) {
+		char buffer[len * 2 + 1];
+		bin2hex(c->inkey, buffer, len);
+		buffer[len * 2] = '\0';
+		logger(LOG_DEBUG, "Received random meta key (unencrypted): %s", buffer);
+	}
+
+	if(!start_meta_in(c, cipher, digest, maclength, compression))
+		return false;
+
+	c->allow_request = CHALLENGE;
+
+	return send_challenge(c);
+}
+
+/* Decrypting his meta key with our private key is left to a worker thread */
+
+typedef struct metakey_job_t {
+	job_t job;
+	int cipher, digest, maclength, compression;
+	int len;
+	unsigned long error;		/* set by the worker if decryption failed */
+	char key[];			/* encrypted, then decrypted in place */
+} metakey_job_t;
+
+static void metakey_work(job_t *job) {
+	metakey_job_t *mj = (metakey_job_t *)job;
+
+	if(RSA_private_decrypt(mj->len, (unsigned char *)mj->key, (unsigned char *)mj->key, myself->connection->rsa_key, RSA_NO_PADDING) != mj->len)	/* See challenge() */
+		mj->error = ERR_get_error() ? : ERR_PACK(ERR_LIB_RSA, 0, 0);
+}
+
+static void metakey_done(job_t *job) {
+	metakey_job_t *mj = (metakey_job_t *)job;
+	connection_t *c = job->data;
+	bool success;
+
+	/* The connection may have been closed in the meantime */
+
+	if(!c) {
+		free(mj);
+		return;
 	}
 
-	return x;
+	c->job = NULL;
+
+	if(mj->error) {
+		logger(LOG_ERR, "Error during decryption of meta key for %s (%s): %s",
+			   c->name, c->hostname, ERR_error_string(mj->error, NULL));
+		success = false;
+	} else {
+		memcpy(c->inkey, mj->key, mj->len);
+		success = metakey_finish(c, mj->cipher, mj->digest, mj->maclength, mj->compression);
+	}
+
+	free(mj);
+
+	if(!success || !resume_meta(c))
+		terminate_connection(c, c->status.active);
 }
 
 bool metakey_h(connection_t *c) {
-	char buffer[MAX_STRING_SIZE];
+	char *buffer;
 	int cipher, digest, maclength, compression;
 	int len;
 
-	if(sscanf(c->buffer, "%*d %d %d %d %d " MAX_STRING, &cipher, &digest, &maclength, &compression, buffer) != 5) {
+	if(c->argc < 6 || !arg2int(c->argv[1], &cipher) || !arg2int(c->argv[2], &digest)
+			|| !arg2int(c->argv[3], &maclength) || !arg2int(c->argv[4], &compression)) {
 		logger(LOG_ERR, "Got bad %s from %s (%s)", "METAKEY", c->name,
 			   c->hostname);
 		return false;
 	}
 
+	/* He did not resume the session we offered, so we send our METAKEY only now */
+
+	if(c->status.resuming) {
+		c->status.resuming = false;
+		free_resume(c->resume);
+		c->resume = NULL;
+
+		if(!send_metakey(c))
+			return false;
+	}
+
+	buffer = c->argv[5];
+
 	len = RSA_size(myself->connection->rsa_key);
 
 	/* Check if the length of the meta key is all right */
@@ -307,6 +551,7 @@ bool metakey_h(connection_t *c) {
 	/* Allocate buffers for the meta key */
 
 	c->inkey = xrealloc(c->inkey, len);
+	c->inkeylength = len;
 
 	if(!c->inctx)
 		c->inctx = xmalloc_and_zero(sizeof(*c->inctx));
@@ -318,7 +563,28 @@ bool metakey_h(connection_t *c) {
 		return false;
 	}
 
-	/* Decrypt the meta key */
+	/* Decrypt the meta key, in a worker thread if there are any */
+
+	if(worker_threads) {
+		metakey_job_t *mj = xmalloc_and_zero(sizeof *mj + len);
+
+		mj->job.work = metakey_work;
+		mj->job.done = metakey_done;
+		mj->job.data = c;
+		mj->cipher = cipher;
+		mj->digest = digest;
+		mj->maclength = maclength;
+		mj->compression = compression;
+		mj->len = len;
+		memcpy(mj->key, buffer, len);
+
+		if(submit_job(&mj->job)) {
+			suspend_meta(c, &mj->job);
+			return true;
+		}
+
+		free(mj);
+	}
 
 	if(RSA_private_decrypt(len, (unsigned char *)buffer, (unsigned char *)c->inkey, myself->connection->rsa_key, RSA_NO_PADDING) != len) {	/* See challenge() */
 		logger(LOG_ERR, "Error during decryption of meta key for %s (%s): %s",
@@ -326,61 +592,110 @@ bool metakey_h(connection_t *c) {
 		return false;
 	}
 
-	ifdebug(SCARY_THINGS) {
-		bin2hex(c->inkey, buffer, len);
-		buffer[len * 2] = '\0';
-		logger(LOG_DEBUG, "Received random meta key (unencrypted): %s", buffer);
+	return metakey_finish(c, cipher, digest, maclength, compression);
+}
+
+/* Instead of METAKEY, derive our meta key from the session being resumed, and prove we know it */
+
+bool send_resume(connection_t *c) {
+	char proof[RESUME_PROOF_LENGTH * 2 + 1];
+	int len = RSA_size(c->rsa_key);
+	bool x;
+
+	c->outkey = xrealloc(c->outkey, len);
+	c->outkeylength = len;
+
+	if(!c->outctx)
+		c->outctx = xmalloc_and_zero(sizeof(*c->outctx));
+
+	if(!resume_key(c, myself->name, c->outkey, len) || !resume_proof(c, myself->name, proof)) {
+		logger(LOG_ERR, "Error during derivation of meta key for %s (%s): %s",
+			   c->name, c->hostname, ERR_error_string(ERR_get_error(), NULL));
+		return false;
 	}
 
-	/* All incoming requests will now be encrypted. */
+	bin2hex(proof, proof, RESUME_PROOF_LENGTH);
+	proof[RESUME_PROOF_LENGTH * 2] = '\0';
 
-	/* Check and lookup cipher and digest algorithms */
+	c->outcompression = c->status.metacompression ? metacompression : 0;
 
-	if(cipher) {
-		c->incipher = EVP_get_cipherbynid(cipher);
-		
-		if(!c->incipher) {
-			logger(LOG_ERR, "%s (%s) uses unknown cipher!", c->name, c->hostname);
-			return false;
-		}
+	x = send_request(c, "%d %d %d %d %d %s", RESUME,
+					 c->outcipher ? c->outcipher->nid : 0,
+					 c->outdigest ? c->outdigest->type : 0, c->outmaclength,
+					 c->outcompression, proof);
 
-		if(!EVP_DecryptInit(c->inctx, c->incipher,
-					(unsigned char *)c->inkey + len - c->incipher->key_len,
-					(unsigned char *)c->inkey + len - c->incipher->key_len -
-					c->incipher->iv_len)) {
-			logger(LOG_ERR, "Error during initialisation of cipher from %s (%s): %s",
-					c->name, c->hostname, ERR_error_string(ERR_get_error(), NULL));
-			return false;
-		}
+	return start_meta_out(c) && x;
+}
 
-		c->status.decryptin = true;
-	} else {
-		c->incipher = NULL;
+bool resume_h(connection_t *c) {
+	char myproof[RESUME_PROOF_LENGTH];
+	int cipher, digest, maclength, compression;
+	int len = RSA_size(myself->connection->rsa_key);
+	char *hisproof;
+
+	if(c->argc < 6 || !arg2int(c->argv[1], &cipher) || !arg2int(c->argv[2], &digest)
+			|| !arg2int(c->argv[3], &maclength) || !arg2int(c->argv[4], &compression)) {
+		logger(LOG_ERR, "Got bad %s from %s (%s)", "RESUME", c->name,
+			   c->hostname);
+		return false;
 	}
 
-	c->inmaclength = maclength;
+	hisproof = c->argv[5];
 
-	if(digest) {
-		c->indigest = EVP_get_digestbynid(digest);
+	if(strlen(hisproof) != RESUME_PROOF_LENGTH * 2 || !hex2bin(hisproof, hisproof, RESUME_PROOF_LENGTH)) {
+		logger(LOG_ERR, "Got bad %s from %s(%s): %s", "RESUME", c->name, c->hostname, "invalid proof");
+		return false;
+	}
 
-		if(!c->indigest) {
-			logger(LOG_ERR, "Node %s (%s) uses unknown digest!", c->name, c->hostname);
-			return false;
-		}
+	/* Check that he knows the secret of the session as well */
 
-		if(c->inmaclength > c->indigest->md_size || c->inmaclength < 0) {
-			logger(LOG_ERR, "%s (%s) uses bogus MAC length!", c->name, c->hostname);
+	if(!resume_proof(c, c->name, myproof)) {
+		logger(LOG_ERR, "Error during calculation of resume proof from %s (%s): %s",
+			   c->name, c->hostname, ERR_error_string(ERR_get_error(), NULL));
+		return false;
+	}
+
+	if(CRYPTO_memcmp(hisproof, myproof, RESUME_PROOF_LENGTH)) {
+		logger(LOG_ERR, "Possible intruder %s (%s): %s", c->name,
+			   c->hostname, "wrong resume proof");
+		return false;
+	}
+
+	/* Identity has now been positively verified, derive his meta key */
+
+	c->inkey = xrealloc(c->inkey, len);
+	c->inkeylength = len;
+
+	if(!c->inctx)
+		c->inctx = xmalloc_and_zero(sizeof(*c->inctx));
+
+	if(!resume_key(c, c->name, c->inkey, len)) {
+		logger(LOG_ERR, "Error during derivation of meta key from %s (%s): %s",
+			   c->name, c->hostname, ERR_error_string(ERR_get_error(), NULL));
+		return false;
+	}
+
+	if(!start_meta_in(c, cipher, digest, maclength, compression))
+		return false;
+
+	/* If we offered the session, he has taken it now, and we send our RESUME in return */
+
+	if(c->status.resuming) {
+		c->status.resuming = false;
+
+		if(!send_resume(c))
 			return false;
-		}
-	} else {
-		c->indigest = NULL;
 	}
 
-	c->incompression = compression;
+	free_resume(c->resume);
+	c->resume = NULL;
+	connections_resumed++;
 
-	c->allow_request = CHALLENGE;
+	ifdebug(CONNECTIONS) logger(LOG_INFO, "Resumed session with %s (%s)", c->name, c->hostname);
 
-	return send_challenge(c);
+	c->allow_request = ACK;
+
+	return send_ack(c);
 }
 
 bool send_challenge(connection_t *c) {
@@ -413,15 +728,17 @@ bool send_challenge(connection_t *c) {
 }
 
 bool challenge_h(connection_t *c) {
-	char buffer[MAX_STRING_SIZE];
+	char *buffer;
 	int len;
 
-	if(sscanf(c->buffer, "%*d " MAX_STRING, buffer) != 1) {
+	if(c->argc < 2) {
 		logger(LOG_ERR, "Got bad %s from %s (%s)", "CHALLENGE", c->name,
 			   c->hostname);
 		return false;
 	}
 
+	buffer = c->argv[1];
+
 	len = RSA_size(myself->connection->rsa_key);
 
 	/* Check if the length of the challenge is all right */
@@ -475,11 +792,11 @@ bool send_chal_reply(connection_t *c) {
 }
 
 bool chal_reply_h(connection_t *c) {
-	char hishash[MAX_STRING_SIZE];
+	char hishash[EVP_MAX_MD_SIZE * 2 + 1];
 	char myhash[EVP_MAX_MD_SIZE];
 	EVP_MD_CTX ctx;
 
-	if(sscanf(c->buffer, "%*d " MAX_STRING, hishash) != 1) {
+	if(c->argc < 2) {
 		logger(LOG_ERR, "Got bad %s from %s (%s)", "CHAL_REPLY", c->name,
 			   c->hostname);
 		return false;
@@ -487,12 +804,14 @@ bool chal_reply_h(connection_t *c) {
 
 	/* Check if the length of the hash is all right */
 
-	if(strlen(hishash) != c->outdigest->md_size * 2) {
+	if(strlen(c->argv[1]) != c->outdigest->md_size * 2) {
 		logger(LOG_ERR, "Possible intruder %s (%s): %s", c->name,
 			   c->hostname, "wrong challenge reply length");
 		return false;
 	}
 
+	strcpy(hishash, c->argv[1]);
+
 	/* Convert the hash to binary format */
 
 	if(!hex2bin(hishash, hishash, c->outdigest->md_size)) {
@@ -538,13 +857,11 @@ bool send_ack(connection_t *c) {
 	/* ACK message contains rest of the information the other end needs
 	   to create node_t and edge_t structures. */
 
-	struct timeval now;
 	bool choice;
 
 	/* Estimate weight */
 
-	gettimeofday(&now, NULL);
-	c->estimated_weight = (now.tv_sec - c->start.tv_sec) * 1000 + (now.tv_usec - c->start.tv_usec) / 1000;
+	c->estimated_weight = event_clock() - c->start;
 
 	/* Check some options */
 
@@ -557,6 +874,11 @@ bool send_ack(connection_t *c) {
 	if(myself->options & OPTION_PMTU_DISCOVERY)
 		c->options |= OPTION_PMTU_DISCOVERY;
 
+	/* We can always split up aggregates and put fragments together, see net_packet.c,
+	   and take ADD_SUBNETS and ADD_EDGES, see protocol.c */
+
+	c->options |= OPTION_AGGREGATE | OPTION_FRAGMENT | OPTION_BULK;
+
 	choice = myself->options & OPTION_CLAMP_MSS;
 	get_config_bool(lookup_config(c->config_tree, "ClampMSS"), &choice);
 	if(choice)
@@ -573,7 +895,22 @@ static void send_everything(connection_t *c) {
 	subnet_t *s;
 	edge_t *e;
 
-	/* Send all known subnets and edges */
+	/* Send all known subnets and edges, many per request if he can take that */
+
+	if(c->options & OPTION_BULK) {
+		if(tunnelserver) {
+			send_add_subnets(c, myself);
+			return;
+		}
+
+		for(node = node_tree->head; node; node = node->next) {
+			n = node->data;
+			send_add_subnets(c, n);
+			send_add_edges(c, n);
+		}
+
+		return;
+	}
 
 	if(tunnelserver) {
 		for(node = myself->subnet_tree->head; node; node = node->next) {
@@ -600,19 +937,22 @@ static void send_everything(connection_t *c) {
 }
 
 bool ack_h(connection_t *c) {
-	char hisport[MAX_STRING_SIZE];
+	char *hisport;
 	char *hisaddress;
-	int weight, mtu;
+	int weight, mtu, rate;
 	uint32_t options;
 	node_t *n;
 	bool choice;
+	uint64_t spread;
 
-	if(sscanf(c->buffer, "%*d " MAX_STRING " %d %x", hisport, &weight, &options) != 3) {
+	if(c->argc < 4 || !arg2int(c->argv[2], &weight) || !arg2hex(c->argv[3], &options)) {
 		logger(LOG_ERR, "Got bad %s from %s (%s)", "ACK", c->name,
 			   c->hostname);
 		return false;
 	}
 
+	hisport = c->argv[1];
+
 	/* Check if we already have a node_t for him */
 
 	n = lookup_node(c->name);
@@ -638,6 +978,18 @@ bool ack_h(connection_t *c) {
 		c->options &= ~OPTION_PMTU_DISCOVERY;
 		options &= ~OPTION_PMTU_DISCOVERY;
 	}
+	if(!(c->options & options & OPTION_AGGREGATE)) {
+		c->options &= ~OPTION_AGGREGATE;
+		options &= ~OPTION_AGGREGATE;
+	}
+	if(!(c->options & options & OPTION_FRAGMENT)) {
+		c->options &= ~OPTION_FRAGMENT;
+		options &= ~OPTION_FRAGMENT;
+	}
+	if(!(c->options & options & OPTION_BULK)) {
+		c->options &= ~OPTION_BULK;
+		options &= ~OPTION_BULK;
+	}
 	c->options |= options;
 
 	if(get_config_int(lookup_config(c->config_tree, "PMTU"), &mtu) && mtu < n->mtu)
@@ -646,6 +998,16 @@ bool ack_h(connection_t *c) {
 	if(get_config_int(lookup_config(config_tree, "PMTU"), &mtu) && mtu < n->mtu)
 		n->mtu = mtu;
 
+	/* Rates from his host config override the defaults from tinc.conf */
+
+	if(!get_config_int(lookup_config(c->config_tree, "IngressRate"), &rate))
+		rate = ingress_rate;
+	set_rate_limit(&n->inbucket, rate);
+
+	if(!get_config_int(lookup_config(c->config_tree, "EgressRate"), &rate))
+		rate = egress_rate;
+	set_rate_limit(&n->outbucket, rate);
+
 	if(get_config_bool(lookup_config(c->config_tree, "ClampMSS"), &choice)) {
 		if(choice)
 			c->options |= OPTION_CLAMP_MSS;
@@ -657,6 +1019,19 @@ bool ack_h(connection_t *c) {
 
 	c->allow_request = ALL;
 	c->status.active = true;
+	check_handshakes();
+
+	/* Remember the session, so a new connection can resume it */
+
+	resume_store(c);
+
+	/* Pretend the last PING was at a random point of the interval, so PINGs to different peers do not go out together */
+
+	spread = rand() % (pinginterval * 1000);
+	c->last_ping_time = now_msec;
+	if(spread < c->last_ping_time)
+		c->last_ping_time -= spread;
+	schedule_connection_check(c);
 
 	ifdebug(CONNECTIONS) logger(LOG_NOTICE, "Connection with %s (%s) activated", c->name,
 			   c->hostname);
@@ -677,8 +1052,6 @@ bool ack_h(connection_t *c) {
 	c->edge->connection = c;
 	c->edge->options = c->options;
 
-	edge_add(c->edge);
-
 	/* Notify everyone of the new edge */
 
 	if(tunnelserver)
@@ -688,7 +1061,7 @@ bool ack_h(connection_t *c) {
 
 	/* Run MST and SSSP algorithms */
 
-	graph();
+	graph_add_edge(c->edge);
 
 	return true;
 }
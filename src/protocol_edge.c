@@ -24,6 +24,7 @@
 #include "avl_tree.h"
 #include "conf.h"
 #include "connection.h"
+#include "damping.h"
 #include "edge.h"
 #include "graph.h"
 #include "logger.h"
@@ -50,34 +51,52 @@ bool send_add_edge(connection_t *c, const edge_t *e) {
 	return x;
 }
 
-bool add_edge_h(connection_t *c) {
-	edge_t *e;
-	node_t *from, *to;
-	char from_name[MAX_STRING_SIZE];
-	char to_name[MAX_STRING_SIZE];
-	char to_address[MAX_STRING_SIZE];
-	char to_port[MAX_STRING_SIZE];
-	sockaddr_t address;
-	uint32_t options;
-	int weight;
+void send_add_edges(connection_t *c, const node_t *from) {
+	bulk_request_t b;
+	char *address, *port;
 
-	if(sscanf(c->buffer, "%*d %*x "MAX_STRING" "MAX_STRING" "MAX_STRING" "MAX_STRING" %x %d",
-			  from_name, to_name, to_address, to_port, &options, &weight) != 6) {
-		logger(LOG_ERR, "Got bad %s from %s (%s)", "ADD_EDGE", c->name,
+	bulk_begin(&b, c, ADD_EDGES, from->name);
+
+	for(avl_node_t *node = from->edge_tree->head; node; node = node->next) {
+		edge_t *e = node->data;
+
+		sockaddr2str(&e->address, &address, &port);
+		bulk_add(&b, " %s %s %s %x %d", e->to->name, address, port, e->options, e->weight);
+		free(address);
+		free(port);
+	}
+
+	bulk_end(&b);
+}
+
+/* Check an ADD_EDGE, or one of the edges in an ADD_EDGES: the name of the node it goes to,
+   its address and port, its options and its weight */
+
+static bool check_edge(connection_t *c, const char *request, const char *from_name, char **item, uint32_t *options, int *weight) {
+	if(!arg2hex(item[3], options) || !arg2int(item[4], weight)) {
+		logger(LOG_ERR, "Got bad %s from %s (%s)", request, c->name,
 			   c->hostname);
 		return false;
 	}
 
 	/* Check if names are valid */
 
-	if(!check_id(from_name) || !check_id(to_name)) {
-		logger(LOG_ERR, "Got bad %s from %s (%s): %s", "ADD_EDGE", c->name,
+	if(!check_id(from_name) || !check_id(item[0])) {
+		logger(LOG_ERR, "Got bad %s from %s (%s): %s", request, c->name,
 			   c->hostname, "invalid name");
 		return false;
 	}
 
-	if(seen_request(c->buffer))
-		return true;
+	return true;
+}
+
+/* Add an edge we have not seen a request for yet; returns true if it should be forwarded */
+
+static bool add_edge(connection_t *c, const char *request, char *from_name, char **item, uint32_t options, int weight) {
+	edge_t *e;
+	node_t *from, *to;
+	char *to_name = item[0];
+	sockaddr_t address;
 
 	/* Lookup nodes */
 
@@ -90,8 +109,8 @@ bool add_edge_h(connection_t *c) {
 		/* ignore indirect edge registrations for tunnelserver */
 		ifdebug(PROTOCOL) logger(LOG_WARNING,
 		   "Ignoring indirect %s from %s (%s)",
-		   "ADD_EDGE", c->name, c->hostname);
-		return true;
+		   request, c->name, c->hostname);
+		return false;
 	}
 
 	if(!from) {
@@ -109,7 +128,7 @@ bool add_edge_h(connection_t *c) {
 
 	/* Convert addresses */
 
-	address = str2sockaddr(to_address, to_port);
+	address = str2sockaddr(item[1], item[2]);
 
 	/* Check if edge already exists */
 
@@ -119,27 +138,37 @@ bool add_edge_h(connection_t *c) {
 		if(e->weight != weight || e->options != options || sockaddrcmp(&e->address, &address)) {
 			if(from == myself) {
 				ifdebug(PROTOCOL) logger(LOG_WARNING, "Got %s from %s (%s) for ourself which does not match existing entry",
-						   "ADD_EDGE", c->name, c->hostname);
+						   request, c->name, c->hostname);
 				send_add_edge(c, e);
-				return true;
+				return false;
 			} else {
 				ifdebug(PROTOCOL) logger(LOG_WARNING, "Got %s from %s (%s) which does not match existing entry",
-						   "ADD_EDGE", c->name, c->hostname);
-				edge_del(e);
-				graph();
+						   request, c->name, c->hostname);
+
+				if(damp_add_edge(from, to, &address, options, weight,
+						e->options == options && !sockaddrcmp(&e->address, &address)
+						? DAMPING_PENALTY_WEIGHT : DAMPING_PENALTY_CHANGE)) {
+					sockaddrfree(&address);
+					return false;
+				}
+
+				graph_del_edge(e);
 			}
 		} else
-			return true;
+			return false;
 	} else if(from == myself) {
 		ifdebug(PROTOCOL) logger(LOG_WARNING, "Got %s from %s (%s) for ourself which does not exist",
-				   "ADD_EDGE", c->name, c->hostname);
+				   request, c->name, c->hostname);
 		contradicting_add_edge++;
 		e = new_edge();
 		e->from = from;
 		e->to = to;
 		send_del_edge(c, e);
 		free_edge(e);
-		return true;
+		return false;
+	} else if(damp_add_edge(from, to, &address, options, weight, 0)) {
+		sockaddrfree(&address);
+		return false;
 	}
 
 	e = new_edge();
@@ -148,16 +177,59 @@ bool add_edge_h(connection_t *c) {
 	e->address = address;
 	e->options = options;
 	e->weight = weight;
-	edge_add(e);
+
+	graph_add_edge(e);
 
 	/* Tell the rest about the new edge */
 
-	if(!tunnelserver)
+	return !tunnelserver;
+}
+
+bool add_edge_h(connection_t *c) {
+	uint32_t options;
+	int weight;
+
+	if(c->argc < 8) {
+		logger(LOG_ERR, "Got bad %s from %s (%s)", "ADD_EDGE", c->name,
+			   c->hostname);
+		return false;
+	}
+
+	if(!check_edge(c, "ADD_EDGE", c->argv[2], c->argv + 3, &options, &weight))
+		return false;
+
+	if(seen_request(c->request))
+		return true;
+
+	if(add_edge(c, "ADD_EDGE", c->argv[2], c->argv + 3, options, weight))
 		forward_request(c);
 
-	/* Run MST before or after we tell the rest? */
+	return true;
+}
+
+bool add_edges_h(connection_t *c) {
+	uint32_t options[MAX_REQUEST_ARGS / 5];
+	int weight[MAX_REQUEST_ARGS / 5];
+	bool forward[MAX_REQUEST_ARGS / 5];
+	int items = (c->argc - 3) / 5;
 
-	graph();
+	if(items < 1 || (c->argc - 3) % 5) {
+		logger(LOG_ERR, "Got bad %s from %s (%s)", "ADD_EDGES", c->name,
+			   c->hostname);
+		return false;
+	}
+
+	for(int i = 0; i < items; i++)
+		if(!check_edge(c, "ADD_EDGES", c->argv[2], c->argv + 3 + i * 5, &options[i], &weight[i]))
+			return false;
+
+	if(seen_request(c->request))
+		return true;
+
+	for(int i = 0; i < items; i++)
+		forward[i] = add_edge(c, "ADD_EDGES", c->argv[2], c->argv + 3 + i * 5, options[i], weight[i]);
+
+	forward_bulk_request(c, ADD_EDGE, 5, forward);
 
 	return true;
 }
@@ -169,16 +241,18 @@ bool send_del_edge(connection_t *c, const edge_t *e) {
 
 bool del_edge_h(connection_t *c) {
 	edge_t *e;
-	char from_name[MAX_STRING_SIZE];
-	char to_name[MAX_STRING_SIZE];
+	char *from_name, *to_name;
 	node_t *from, *to;
 
-	if(sscanf(c->buffer, "%*d %*x "MAX_STRING" "MAX_STRING, from_name, to_name) != 2) {
+	if(c->argc < 4) {
 		logger(LOG_ERR, "Got bad %s from %s (%s)", "DEL_EDGE", c->name,
 			   c->hostname);
 		return false;
 	}
 
+	from_name = c->argv[2];
+	to_name = c->argv[3];
+
 	/* Check if names are valid */
 
 	if(!check_id(from_name) || !check_id(to_name)) {
@@ -187,7 +261,7 @@ bool del_edge_h(connection_t *c) {
 		return false;
 	}
 
-	if(seen_request(c->buffer))
+	if(seen_request(c->request))
 		return true;
 
 	/* Lookup nodes */
@@ -221,6 +295,11 @@ bool del_edge_h(connection_t *c) {
 
 	e = lookup_edge(from, to);
 
+	/* Suppressed edges are not in the tree, but their state is still held */
+
+	if(damp_del_edge(from, to, e != NULL))
+		return true;
+
 	if(!e) {
 		ifdebug(PROTOCOL) logger(LOG_WARNING, "Got %s from %s (%s) which does not appear in the edge tree",
 				   "DEL_EDGE", c->name, c->hostname);
@@ -240,24 +319,9 @@ bool del_edge_h(connection_t *c) {
 	if(!tunnelserver)
 		forward_request(c);
 
-	/* Delete the edge */
-
-	edge_del(e);
+	/* Delete the edge, and run MST before or after we tell the rest? */
 
-	/* Run MST before or after we tell the rest? */
-
-	graph();
-
-	/* If the node is not reachable anymore but we remember it had an edge to us, clean it up */
-
-	if(!to->status.reachable) {
-		e = lookup_edge(to, myself);
-		if(e) {
-			if(!tunnelserver)
-				send_del_edge(everyone, e);
-			edge_del(e);
-		}
-	}
+	graph_del_edge(e);
 
 	return true;
 }
@@ -25,6 +25,7 @@
 #include <openssl/rand.h>
 
 #include "avl_tree.h"
+#include "compress.h"
 #include "connection.h"
 #include "logger.h"
 #include "net.h"
@@ -36,37 +37,82 @@
 
 static bool mykeyused = false;
 
-void send_key_changed(void) {
+/* Both sides derive the session ID from the packet key, so it never has to be sent separately */
+
+static uint32_t derive_sessionid(const char *key, int keylength) {
+	unsigned char hash[EVP_MAX_MD_SIZE];
+	uint32_t id;
+
+	if(!EVP_Digest(key, keylength, hash, NULL, EVP_sha1(), NULL))
+		return 0;
+
+	memcpy(&id, hash, sizeof id);
+	return id;
+}
+
+/*
+  Our keys are not all replaced at the same moment. When keyexpires passes,
+  every node gets its new key at a random time within the next KEY_SPREAD
+  seconds, with an unsolicited ANS_KEY. The key he used until then stays
+  valid for KEY_GRACE seconds, for packets that were already underway, so
+  nothing falls back to TCP and no KEY_CHANGED is flooded through the VPN.
+*/
+
+#define KEY_SPREAD 60
+#define KEY_GRACE 30
+
+static void rekey_handler(void *data) {
+	node_t *n = data;
+
+	if(n->status.reachable && n->tunnel->inkey && n->nexthop && n->nexthop->connection)
+		send_ans_key(n);
+}
+
+void schedule_rekey(node_t *n, int timeout) {
+	if(!event_pending(&n->tunnel->keyevent))
+		event_add(&n->tunnel->keyevent, rekey_handler, n, timeout);
+}
+
+void rotate_keys(void) {
 	avl_node_t *node;
-	connection_t *c;
+	node_t *n;
+	int spread = keylifetime / 2 < KEY_SPREAD ? keylifetime / 2 : KEY_SPREAD;
+
+	for(node = node_tree->head; node; node = node->next) {
+		n = node->data;
 
-	send_request(everyone, "%d %x %s", KEY_CHANGED, rand(), myself->name);
+		if(n == myself || !n->tunnel || !n->tunnel->inkey)
+			continue;
 
-	/* Immediately send new keys to directly connected nodes to keep UDP mappings alive */
+		/* He will ask for a new key when he becomes reachable again */
 
-	for(node = connection_tree->head; node; node = node->next) {
-		c = node->data;
-		if(c->status.active && c->node && c->node->status.reachable)
-			send_ans_key(c->node);
+		if(!n->status.reachable) {
+			free_node_tunnel(n);
+			continue;
+		}
+
+		schedule_rekey(n, spread > 0 ? rand() % (spread * 1000) : 0);
 	}
 }
 
 bool key_changed_h(connection_t *c) {
-	char name[MAX_STRING_SIZE];
+	char *name;
 	node_t *n;
 
-	if(sscanf(c->buffer, "%*d %*x " MAX_STRING, name) != 1) {
+	if(c->argc < 3) {
 		logger(LOG_ERR, "Got bad %s from %s (%s)", "KEY_CHANGED",
 			   c->name, c->hostname);
 		return false;
 	}
 
+	name = c->argv[2];
+
 	if(!check_id(name)) {
 		logger(LOG_ERR, "Got bad %s from %s (%s): %s", "KEY_CHANGED", c->name, c->hostname, "invalid name");
 		return false;
 	}
 
-	if(seen_request(c->buffer))
+	if(seen_request(c->request))
 		return true;
 
 	n = lookup_node(name);
@@ -89,20 +135,24 @@ bool key_changed_h(connection_t *c) {
 }
 
 bool send_req_key(node_t *to) {
-	return send_request(to->nexthop->connection, "%d %s %s", REQ_KEY, myself->name, to->name);
+	return send_request(to->nexthop->connection, "%d %s %s %s%s", REQ_KEY, myself->name, to->name,
+			sessionids ? KEY_EXT_SESSIONID " " : "", KEY_EXT_RAWPACKETS);
 }
 
 bool req_key_h(connection_t *c) {
-	char from_name[MAX_STRING_SIZE];
-	char to_name[MAX_STRING_SIZE];
+	char *from_name, *to_name;
 	node_t *from, *to;
+	int i;
 
-	if(sscanf(c->buffer, "%*d " MAX_STRING " " MAX_STRING, from_name, to_name) != 2) {
+	if(c->argc < 3) {
 		logger(LOG_ERR, "Got bad %s from %s (%s)", "REQ_KEY", c->name,
 			   c->hostname);
 		return false;
 	}
 
+	from_name = c->argv[1];
+	to_name = c->argv[2];
+
 	if(!check_id(from_name) || !check_id(to_name)) {
 		logger(LOG_ERR, "Got bad %s from %s (%s): %s", "REQ_KEY", c->name, c->hostname, "invalid name");
 		return false;
@@ -127,6 +177,16 @@ bool req_key_h(connection_t *c) {
 	/* Check if this key request is for us */
 
 	if(to == myself) {			/* Yes, send our own key back */
+		from->status.sessionid = false;
+		from->status.rawpackets = false;
+
+		for(i = 3; i < c->argc; i++) {
+			if(!strcmp(c->argv[i], KEY_EXT_SESSIONID))
+				from->status.sessionid = true;
+			else if(!strcmp(c->argv[i], KEY_EXT_RAWPACKETS))
+				from->status.rawpackets = true;
+		}
+
 		if (!send_ans_key(from))
 			return false;
 	} else {
@@ -139,67 +199,117 @@ bool req_key_h(connection_t *c) {
 			return true;
 		}
 
-		send_request(to->nexthop->connection, "%s", c->buffer);
+		send_request(to->nexthop->connection, "%s", c->request);
 	}
 
 	return true;
 }
 
 bool send_ans_key(node_t *to) {
+	node_tunnel_t *t = node_tunnel(to);
+	uint32_t sessionid = 0;
+
+	/* Keep accepting the key he uses now for a while, unless nothing tells his packets apart */
+
+	if(t->inkey && (t->indigest || CIPHER_IS_AEAD(t->incipher))) {
+		swap_inkey(to);
+		t->oldkey.expires = now + KEY_GRACE;
+	} else {
+		t->oldkey.expires = 0;
+	}
+
+	flush_node_batches(to, false);
+
+	event_del(&t->keyevent);
+
 	// Set key parameters
-	to->incipher = myself->incipher;
-	to->inkeylength = myself->inkeylength;
-	to->indigest = myself->indigest;
-	to->inmaclength = myself->inmaclength;
-	to->incompression = myself->incompression;
+	t->incipher = myself->tunnel->incipher;
+	t->inkeylength = myself->tunnel->inkeylength;
+	t->indigest = myself->tunnel->indigest;
+	t->inmaclength = myself->tunnel->inmaclength;
+	t->incompression = myself->tunnel->incompression;
 
 	// Allocate memory for key
-	to->inkey = xrealloc(to->inkey, to->inkeylength);
+	t->inkey = xrealloc(t->inkey, t->inkeylength);
+
+	// Create a new key, and if he wants one, a session ID no other node is using
+	for(int tries = 0; ; tries++) {
+		if (1 != RAND_bytes((unsigned char *)t->inkey, t->inkeylength)) {
+			int err = ERR_get_error();
+			logger(LOG_ERR, "Failed to generate random for key (%s)", ERR_error_string(err, NULL));
+			return false; // Do not send insecure keys, let connection attempt fail.
+		}
+
+		if(!sessionids || !to->status.sessionid)
+			break;
 
-	// Create a new key
-	if (1 != RAND_bytes((unsigned char *)to->inkey, to->inkeylength)) {
-		int err = ERR_get_error();
-		logger(LOG_ERR, "Failed to generate random for key (%s)", ERR_error_string(err, NULL));
-		return false; // Do not send insecure keys, let connection attempt fail.
+		sessionid = derive_sessionid(t->inkey, t->inkeylength);
+
+		if(sessionid) {
+			node_t *other = lookup_node_id(sessionid);
+
+			if(!other || other == to)
+				break;
+		}
+
+		if(tries >= 16) {
+			logger(LOG_WARNING, "Could not find an unused session ID for %s (%s)", to->name, to->hostname);
+			sessionid = 0;
+			break;
+		}
 	}
 
-	if(to->incipher)
-		EVP_DecryptInit_ex(&to->inctx, to->incipher, NULL, (unsigned char *)to->inkey, (unsigned char *)to->inkey + to->incipher->key_len);
+	update_node_id(to, sessionid);
+
+	if(t->incipher)
+		EVP_DecryptInit_ex(&t->inctx, t->incipher, NULL, (unsigned char *)t->inkey, (unsigned char *)t->inkey + t->incipher->key_len);
 
-	// Reset sequence number and late packet window
+	// Derive the HMAC key schedule once, instead of for every packet
+	if(t->indigest && !HMAC_Init_ex(&t->inhmac, t->inkey, t->inkeylength, t->indigest, NULL)) {
+		logger(LOG_ERR, "Error during initialisation of HMAC for %s (%s): %s",
+				to->name, to->hostname, ERR_error_string(ERR_get_error(), NULL));
+		return false;
+	}
+
+	// Reset sequence number and replay window
 	mykeyused = true;
-	to->received_seqno = 0;
-	if(replaywin) memset(to->late, 0, replaywin);
+	t->received_seqno = 0;
+	if(replaywin) memset(t->replay, 0, REPLAY_SIZE);
 
 	// Convert to hexadecimal and send
-	char key[2 * to->inkeylength + 1];
-	bin2hex(to->inkey, key, to->inkeylength);
-	key[to->inkeylength * 2] = '\0';
+	char key[2 * t->inkeylength + 1];
+	bin2hex(t->inkey, key, t->inkeylength);
+	key[t->inkeylength * 2] = '\0';
 
 	return send_request(to->nexthop->connection, "%d %s %s %s %d %d %d %d", ANS_KEY,
 			myself->name, to->name, key,
-			to->incipher ? to->incipher->nid : 0,
-			to->indigest ? to->indigest->type : 0, to->inmaclength,
-			to->incompression);
+			t->incipher ? t->incipher->nid : 0,
+			t->indigest ? t->indigest->type : 0, t->inmaclength,
+			t->incompression | (sessionid ? KEY_EXT_SESSIONID_FLAG : 0)
+			| (t->incompression && to->status.rawpackets ? KEY_EXT_RAWPACKETS_FLAG : 0));
 }
 
 bool ans_key_h(connection_t *c) {
-	char from_name[MAX_STRING_SIZE];
-	char to_name[MAX_STRING_SIZE];
-	char key[MAX_STRING_SIZE];
-	char address[MAX_STRING_SIZE] = "";
-	char port[MAX_STRING_SIZE] = "";
+	char *from_name, *to_name, *key;
+	char *address, *port;
 	int cipher, digest, maclength, compression;
+	bool sessionid, sendraw;
 	node_t *from, *to;
+	node_tunnel_t *t;
 
-	if(sscanf(c->buffer, "%*d "MAX_STRING" "MAX_STRING" "MAX_STRING" %d %d %d %d "MAX_STRING" "MAX_STRING,
-		from_name, to_name, key, &cipher, &digest, &maclength,
-		&compression, address, port) < 7) {
+	if(c->argc < 8 || !arg2int(c->argv[4], &cipher) || !arg2int(c->argv[5], &digest)
+			|| !arg2int(c->argv[6], &maclength) || !arg2int(c->argv[7], &compression)) {
 		logger(LOG_ERR, "Got bad %s from %s (%s)", "ANS_KEY", c->name,
 			   c->hostname);
 		return false;
 	}
 
+	from_name = c->argv[1];
+	to_name = c->argv[2];
+	key = c->argv[3];
+	address = c->argc > 8 ? c->argv[8] : "";
+	port = c->argc > 9 ? c->argv[9] : "";
+
 	if(!check_id(from_name) || !check_id(to_name)) {
 		logger(LOG_ERR, "Got bad %s from %s (%s): %s", "ANS_KEY", c->name, c->hostname, "invalid name");
 		return false;
@@ -237,22 +347,24 @@ bool ans_key_h(connection_t *c) {
 			char *address, *port;
 			ifdebug(PROTOCOL) logger(LOG_DEBUG, "Appending reflexive UDP address to ANS_KEY from %s to %s", from->name, to->name);
 			sockaddr2str(&from->address, &address, &port);
-			send_request(to->nexthop->connection, "%s %s %s", c->buffer, address, port);
+			send_request(to->nexthop->connection, "%s %s %s", c->request, address, port);
 			free(address);
 			free(port);
 			return true;
 		}
 
-		return send_request(to->nexthop->connection, "%s", c->buffer);
+		return send_request(to->nexthop->connection, "%s", c->request);
 	}
 
 	/* Don't use key material until every check has passed. */
 	from->status.validkey = false;
+	t = node_tunnel(from);
+	flush_node_batches(from, false);
 
 	/* Update our copy of the origin's packet key */
-	from->outkey = xrealloc(from->outkey, strlen(key) / 2);
-	from->outkeylength = strlen(key) / 2;
-	if(!hex2bin(key, from->outkey, from->outkeylength)) {
+	t->outkey = xrealloc(t->outkey, strlen(key) / 2);
+	t->outkeylength = strlen(key) / 2;
+	if(!hex2bin(key, t->outkey, t->outkeylength)) {
 		logger(LOG_ERR, "Got bad %s from %s(%s): %s", "ANS_KEY", from->name, from->hostname, "invalid key");
 		return true;
 	}
@@ -260,59 +372,80 @@ bool ans_key_h(connection_t *c) {
 	/* Check and lookup cipher and digest algorithms */
 
 	if(cipher) {
-		from->outcipher = EVP_get_cipherbynid(cipher);
+		t->outcipher = EVP_get_cipherbynid(cipher);
 
-		if(!from->outcipher) {
+		if(!t->outcipher) {
 			logger(LOG_ERR, "Node %s (%s) uses unknown cipher!", from->name,
 				   from->hostname);
 			return true;
 		}
 
-		if(from->outkeylength != from->outcipher->key_len + from->outcipher->iv_len) {
+		if(t->outkeylength != t->outcipher->key_len + t->outcipher->iv_len) {
 			logger(LOG_ERR, "Node %s (%s) uses wrong keylength!", from->name,
 				   from->hostname);
 			return true;
 		}
 	} else {
-		from->outcipher = NULL;
+		t->outcipher = NULL;
 	}
 
-	from->outmaclength = maclength;
+	t->outmaclength = maclength;
 
 	if(digest) {
-		from->outdigest = EVP_get_digestbynid(digest);
+		t->outdigest = EVP_get_digestbynid(digest);
 
-		if(!from->outdigest) {
+		if(!t->outdigest) {
 			logger(LOG_ERR, "Node %s (%s) uses unknown digest!", from->name,
 				   from->hostname);
 			return true;
 		}
 
-		if(from->outmaclength > from->outdigest->md_size || from->outmaclength < 0) {
+		if(t->outmaclength > t->outdigest->md_size || t->outmaclength < 0) {
 			logger(LOG_ERR, "Node %s (%s) uses bogus MAC length!",
 				   from->name, from->hostname);
 			return true;
 		}
 	} else {
-		from->outdigest = NULL;
+		t->outdigest = NULL;
 	}
 
-	if(compression < 0 || compression > 11) {
+	sessionid = compression & KEY_EXT_SESSIONID_FLAG;
+	sendraw = compression & KEY_EXT_RAWPACKETS_FLAG;
+	compression &= ~(KEY_EXT_SESSIONID_FLAG | KEY_EXT_RAWPACKETS_FLAG);
+
+	if(compression < 0 || compression > COMPRESS_MAX_LEVEL) {
 		logger(LOG_ERR, "Node %s (%s) uses bogus compression level!", from->name, from->hostname);
 		return true;
 	}
+
+	if(!compression_supported(compression)) {
+		logger(LOG_ERR, "Node %s (%s) uses unsupported compression level %d!", from->name, from->hostname, compression);
+		return true;
+	}
 	
-	from->outcompression = compression;
+	t->outcompression = compression;
+	from->status.sendraw = sendraw;
+	t->compressskip = 0;
+	t->compressbackoff = 0;
 
-	if(from->outcipher)
-		if(!EVP_EncryptInit_ex(&from->outctx, from->outcipher, NULL, (unsigned char *)from->outkey, (unsigned char *)from->outkey + from->outcipher->key_len)) {
+	if(t->outcipher)
+		if(!EVP_EncryptInit_ex(&t->outctx, t->outcipher, NULL, (unsigned char *)t->outkey, (unsigned char *)t->outkey + t->outcipher->key_len)) {
 			logger(LOG_ERR, "Error during initialisation of key from %s (%s): %s",
 					from->name, from->hostname, ERR_error_string(ERR_get_error(), NULL));
 			return true;
 		}
 
+	if(t->outdigest)
+		if(!HMAC_Init_ex(&t->outhmac, t->outkey, t->outkeylength, t->outdigest, NULL)) {
+			logger(LOG_ERR, "Error during initialisation of HMAC for %s (%s): %s",
+					from->name, from->hostname, ERR_error_string(ERR_get_error(), NULL));
+			return true;
+		}
+
+	from->outsessionid = sessionid ? derive_sessionid(t->outkey, t->outkeylength) : 0;
+	update_node_forwarding(from);
 	from->status.validkey = true;
-	from->sent_seqno = 0;
+	t->sent_seqno = 0;
 
 	if(*address && *port) {
 		ifdebug(PROTOCOL) logger(LOG_DEBUG, "Using reflexive UDP address from %s: %s port %s", from->name, address, port);
@@ -320,7 +453,7 @@ bool ans_key_h(connection_t *c) {
 		update_node_udp(from, &sa);
 	}
 
-	if(from->options & OPTION_PMTU_DISCOVERY && !from->mtuevent)
+	if(from->options & OPTION_PMTU_DISCOVERY && !event_pending(&t->mtuevent))
 		send_mtu_probe(from);
 
 	return true;
@@ -22,6 +22,7 @@
 
 #include "conf.h"
 #include "connection.h"
+#include "graph.h"
 #include "logger.h"
 #include "meta.h"
 #include "net.h"
@@ -42,16 +43,15 @@ bool send_status(connection_t *c, int statusno, const char *statusstring) {
 
 bool status_h(connection_t *c) {
 	int statusno;
-	char statusstring[MAX_STRING_SIZE];
 
-	if(sscanf(c->buffer, "%*d %d " MAX_STRING, &statusno, statusstring) != 2) {
+	if(c->argc < 3 || !arg2int(c->argv[1], &statusno)) {
 		logger(LOG_ERR, "Got bad %s from %s (%s)", "STATUS",
 			   c->name, c->hostname);
 		return false;
 	}
 
 	ifdebug(STATUS) logger(LOG_NOTICE, "Status message from %s (%s): %d: %s",
-			   c->name, c->hostname, statusno, statusstring);
+			   c->name, c->hostname, statusno, c->argv[2]);
 
 	return true;
 }
@@ -65,16 +65,15 @@ bool send_error(connection_t *c, int err, const char *errstring) {
 
 bool error_h(connection_t *c) {
 	int err;
-	char errorstring[MAX_STRING_SIZE];
 
-	if(sscanf(c->buffer, "%*d %d " MAX_STRING, &err, errorstring) != 2) {
+	if(c->argc < 3 || !arg2int(c->argv[1], &err)) {
 		logger(LOG_ERR, "Got bad %s from %s (%s)", "ERROR",
 			   c->name, c->hostname);
 		return false;
 	}
 
 	ifdebug(ERROR) logger(LOG_NOTICE, "Error message from %s (%s): %d: %s",
-			   c->name, c->hostname, err, errorstring);
+			   c->name, c->hostname, err, c->argv[2]);
 
 	terminate_connection(c, c->status.active);
 
@@ -93,7 +92,9 @@ bool termreq_h(connection_t *c) {
 
 bool send_ping(connection_t *c) {
 	c->status.pinged = true;
-	c->last_ping_time = now;
+	c->last_ping_time = now_msec;
+	c->ping_sent = event_clock_usec();
+	schedule_connection_check(c);
 
 	return send_request(c, "%d", PING);
 }
@@ -106,18 +107,54 @@ bool send_pong(connection_t *c) {
 	return send_request(c, "%d", PONG);
 }
 
+/* With LatencyRouting, publish the round trip time of our edge to him in milliseconds as its weight.
+   Only changes of more than LATENCY_HYSTERESIS percent are sent, and never if a Weight was configured. */
+
+static void publish_rtt(connection_t *c) {
+	edge_t *e = c->edge;
+	int weight = e->rtt / 1000;
+
+	if(weight < 1)
+		weight = 1;
+
+	if(abs(weight - e->weight) < 2 || abs(weight - e->weight) * 100 <= e->weight * LATENCY_HYSTERESIS)
+		return;
+
+	if(lookup_config(c->config_tree, "Weight"))
+		return;
+
+	ifdebug(TRAFFIC) logger(LOG_DEBUG, "Round trip time to %s (%s) is now %d ms", c->name, c->hostname, weight);
+
+	graph_set_weight(e, weight);
+
+	if(tunnelserver)
+		send_add_edge(c, e);
+	else
+		send_add_edge(everyone, e);
+}
+
 bool pong_h(connection_t *c) {
+	/* Measure the round trip time of our edge to him, smoothed like TCP does (RFC 6298) */
+
+	if(c->status.pinged && c->edge) {
+		int rtt = event_clock_usec() - c->ping_sent;
+
+		if(rtt < 1)
+			rtt = 1;
+
+		c->edge->rtt = c->edge->rtt ? c->edge->rtt + (rtt - c->edge->rtt) / 8 : rtt;
+
+		if(latency_routing)
+			publish_rtt(c);
+	}
+
 	c->status.pinged = false;
 
 	/* Succesful connection, reset timeout if this is an outgoing connection. */
 
 	if(c->outgoing) {
 		c->outgoing->timeout = 0;
-		c->outgoing->cfg = NULL;
-		if(c->outgoing->ai)
-			freeaddrinfo(c->outgoing->ai);
-		c->outgoing->ai = NULL;
-		c->outgoing->aip = NULL;
+		forget_addresses(c->outgoing);
 	}
 
 	return true;
@@ -125,23 +162,19 @@ bool pong_h(connection_t *c) {
 
 /* Sending and receiving packets via TCP */
 
-bool send_tcppacket(connection_t *c, const vpn_packet_t *packet) {
-	/* If there already is a lot of data in the outbuf buffer, discard this packet.
-           We use a very simple Random Early Drop algorithm. */
-
-	if(2.0 * c->outbuflen / (float)maxoutbufsize - 1 > (float)rand()/(float)RAND_MAX)
-		return true;
+/* Packets are queued separately from requests, and sent by flush_meta(), see send_meta_packet() */
 
-	if(!send_request(c, "%d %hd", PACKET, packet->len))
-		return false;
+bool send_tcppacket(connection_t *c, const vpn_packet_t *packet) {
+	if(!send_meta_packet(c, packet) && c->node)
+		c->node->stats.tcp_drops++;
 
-	return send_meta(c, (char *)packet->data, packet->len) && flush_meta(c);
+	return true;
 }
 
 bool tcppacket_h(connection_t *c) {
-	short int len;
+	int len;
 
-	if(sscanf(c->buffer, "%*d %hd", &len) != 1) {
+	if(c->argc < 2 || !arg2int(c->argv[1], &len) || len < 0 || len > MAXBUFSIZE) {
 		logger(LOG_ERR, "Got bad %s from %s (%s)", "PACKET", c->name,
 			   c->hostname);
 		return false;
@@ -21,6 +21,7 @@
 
 #include "system.h"
 
+#include "avl_tree.h"
 #include "conf.h"
 #include "connection.h"
 #include "logger.h"
@@ -41,36 +42,46 @@ bool send_add_subnet(connection_t *c, const subnet_t *subnet) {
 	return send_request(c, "%d %x %s %s", ADD_SUBNET, rand(), subnet->owner->name, netstr);
 }
 
-bool add_subnet_h(connection_t *c) {
-	char subnetstr[MAX_STRING_SIZE];
-	char name[MAX_STRING_SIZE];
-	node_t *owner;
-	subnet_t s = {NULL}, *new, *old;
+void send_add_subnets(connection_t *c, const node_t *owner) {
+	bulk_request_t b;
+	char netstr[MAXNETSTR];
 
-	if(sscanf(c->buffer, "%*d %*x " MAX_STRING " " MAX_STRING, name, subnetstr) != 2) {
-		logger(LOG_ERR, "Got bad %s from %s (%s)", "ADD_SUBNET", c->name,
-			   c->hostname);
-		return false;
-	}
+	bulk_begin(&b, c, ADD_SUBNETS, owner->name);
+
+	for(avl_node_t *node = owner->subnet_tree->head; node; node = node->next)
+		if(net2str(netstr, sizeof netstr, node->data))
+			bulk_add(&b, " %s", netstr);
 
+	bulk_end(&b);
+}
+
+/* Check the owner and subnet of an ADD_SUBNET, or of one of the subnets in an ADD_SUBNETS */
+
+static bool check_subnet(connection_t *c, const char *request, const char *name, const char *subnetstr, subnet_t *s) {
 	/* Check if owner name is valid */
 
 	if(!check_id(name)) {
-		logger(LOG_ERR, "Got bad %s from %s (%s): %s", "ADD_SUBNET", c->name,
+		logger(LOG_ERR, "Got bad %s from %s (%s): %s", request, c->name,
 			   c->hostname, "invalid name");
 		return false;
 	}
 
 	/* Check if subnet string is valid */
 
-	if(!str2net(&s, subnetstr)) {
-		logger(LOG_ERR, "Got bad %s from %s (%s): %s", "ADD_SUBNET", c->name,
+	if(!str2net(s, subnetstr)) {
+		logger(LOG_ERR, "Got bad %s from %s (%s): %s", request, c->name,
 			   c->hostname, "invalid subnet string");
 		return false;
 	}
 
-	if(seen_request(c->buffer))
-		return true;
+	return true;
+}
+
+/* Add a subnet we have not seen a request for yet; returns true if it should be forwarded */
+
+static bool add_subnet(connection_t *c, const char *request, char *name, const char *subnetstr, const subnet_t *s) {
+	node_t *owner;
+	subnet_t *new, *old;
 
 	/* Check if the owner of the new subnet is in the connection list */
 
@@ -79,8 +90,8 @@ bool add_subnet_h(connection_t *c) {
 	if(tunnelserver && owner != myself && owner != c->node) {
 		/* in case of tunnelserver, ignore indirect subnet registrations */
 		ifdebug(PROTOCOL) logger(LOG_WARNING, "Ignoring indirect %s from %s (%s) for %s",
-				   "ADD_SUBNET", c->name, c->hostname, subnetstr);
-		return true;
+				   request, c->name, c->hostname, subnetstr);
+		return false;
 	}
 
 	if(!owner) {
@@ -91,52 +102,104 @@ bool add_subnet_h(connection_t *c) {
 
 	/* Check if we already know this subnet */
 
-	if(lookup_subnet(owner, &s))
-		return true;
+	if(lookup_subnet(owner, s))
+		return false;
 
 	/* If we don't know this subnet, but we are the owner, retaliate with a DEL_SUBNET */
 
 	if(owner == myself) {
+		subnet_t mine = *s;
+
 		ifdebug(PROTOCOL) logger(LOG_WARNING, "Got %s from %s (%s) for ourself",
-				   "ADD_SUBNET", c->name, c->hostname);
-		s.owner = myself;
-		send_del_subnet(c, &s);
-		return true;
+				   request, c->name, c->hostname);
+		mine.owner = myself;
+		send_del_subnet(c, &mine);
+		return false;
 	}
 
 	/* In tunnel server mode, we should already know all allowed subnets */
 
 	if(tunnelserver) {
 		logger(LOG_WARNING, "Ignoring unauthorized %s from %s (%s): %s",
-				"ADD_SUBNET", c->name, c->hostname, subnetstr);
-		return true;
+				request, c->name, c->hostname, subnetstr);
+		return false;
 	}
 
 	/* Ignore if strictsubnets is true, but forward it to others */
 
 	if(strictsubnets) {
 		logger(LOG_WARNING, "Ignoring unauthorized %s from %s (%s): %s",
-				"ADD_SUBNET", c->name, c->hostname, subnetstr);
-		forward_request(c);
+				request, c->name, c->hostname, subnetstr);
 		return true;
 	}
 
 	/* If everything is correct, add the subnet to the list of the owner */
 
-	*(new = new_subnet()) = s;
+	*(new = new_subnet()) = *s;
 	subnet_add(owner, new);
 
 	if(owner->status.reachable)
 		subnet_update(owner, new, true);
 
+	/* Fast handoff of roaming MAC addresses */
+
+	if(s->type == SUBNET_MAC && owner != myself && (old = lookup_subnet(myself, s)) && old->expires)
+		subnet_set_expires(old, now);
+
 	/* Tell the rest */
 
-	forward_request(c);
+	return true;
+}
 
-	/* Fast handoff of roaming MAC addresses */
+bool add_subnet_h(connection_t *c) {
+	subnet_t s = {NULL};
+
+	if(c->argc < 4) {
+		logger(LOG_ERR, "Got bad %s from %s (%s)", "ADD_SUBNET", c->name,
+			   c->hostname);
+		return false;
+	}
+
+	if(!check_subnet(c, "ADD_SUBNET", c->argv[2], c->argv[3], &s))
+		return false;
+
+	if(seen_request(c->request))
+		return true;
 
-	if(s.type == SUBNET_MAC && owner != myself && (old = lookup_subnet(myself, &s)) && old->expires)
-		old->expires = now;
+	if(add_subnet(c, "ADD_SUBNET", c->argv[2], c->argv[3], &s))
+		forward_request(c);
+
+	return true;
+}
+
+bool add_subnets_h(connection_t *c) {
+	subnet_t s;
+	bool forward[MAX_REQUEST_ARGS];
+	int items = c->argc - 3;
+
+	if(items < 1) {
+		logger(LOG_ERR, "Got bad %s from %s (%s)", "ADD_SUBNETS", c->name,
+			   c->hostname);
+		return false;
+	}
+
+	for(int i = 0; i < items; i++) {
+		s = (subnet_t){NULL};
+
+		if(!check_subnet(c, "ADD_SUBNETS", c->argv[2], c->argv[3 + i], &s))
+			return false;
+	}
+
+	if(seen_request(c->request))
+		return true;
+
+	for(int i = 0; i < items; i++) {
+		s = (subnet_t){NULL};
+		str2net(&s, c->argv[3 + i]);
+		forward[i] = add_subnet(c, "ADD_SUBNETS", c->argv[2], c->argv[3 + i], &s);
+	}
+
+	forward_bulk_request(c, ADD_SUBNET, 1, forward);
 
 	return true;
 }
@@ -151,17 +214,20 @@ bool send_del_subnet(connection_t *c, const subnet_t *s) {
 }
 
 bool del_subnet_h(connection_t *c) {
-	char subnetstr[MAX_STRING_SIZE];
-	char name[MAX_STRING_SIZE];
+	char *subnetstr;
+	char *name;
 	node_t *owner;
 	subnet_t s = {NULL}, *find;
 
-	if(sscanf(c->buffer, "%*d %*x " MAX_STRING " " MAX_STRING, name, subnetstr) != 2) {
+	if(c->argc < 4) {
 		logger(LOG_ERR, "Got bad %s from %s (%s)", "DEL_SUBNET", c->name,
 			   c->hostname);
 		return false;
 	}
 
+	name = c->argv[2];
+	subnetstr = c->argv[3];
+
 	/* Check if owner name is valid */
 
 	if(!check_id(name)) {
@@ -178,7 +244,7 @@ bool del_subnet_h(connection_t *c) {
 		return false;
 	}
 
-	if(seen_request(c->buffer))
+	if(seen_request(c->request))
 		return true;
 
 	/* Check if the owner of the subnet being deleted is in the connection list */
@@ -20,10 +20,18 @@
 
 #include "system.h"
 
-#ifdef HAVE_NETPACKET_PACKET_H
+/* The kernel's header has everything the C library's has, and the packet ring too */
+
+#if defined(HAVE_LINUX_IF_PACKET_H)
+#include <linux/if_packet.h>
+#elif defined(HAVE_NETPACKET_PACKET_H)
 #include <netpacket/packet.h>
 #endif
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 #include "conf.h"
 #include "device.h"
 #include "net.h"
@@ -38,6 +46,181 @@ static char *device_info;
 static uint64_t device_total_in = 0;
 static uint64_t device_total_out = 0;
 
+#if defined(TPACKET3_HDRLEN) && defined(HAVE_SYS_MMAN_H)
+#define HAVE_PACKET_RING
+#endif
+
+#ifdef HAVE_PACKET_RING
+/*
+  With RawSocketRing, frames are exchanged with the kernel through rings of
+  buffers that are mapped into our memory, instead of one read() or write()
+  per frame. Received frames come in blocks. We go through all frames of
+  the blocks the kernel has filled, without a system call, and then hand the
+  blocks back. Frames to send are put in the transmit ring, and the kernel
+  is told to send them all once per iteration of the main loop.
+*/
+
+#define RING_BLOCK_SIZE (1 << 18)
+#define RING_RX_BLOCKS 16
+#define RING_TX_BLOCKS 4
+
+static bool use_ring = false;
+static uint8_t *ring = NULL;
+static size_t ring_size;
+static struct tpacket_req3 rx_req, tx_req;
+
+static int rx_block;				/* block we are reading, or waiting for */
+static int rx_left = 0;				/* frames in it we have not read yet */
+static struct tpacket3_hdr *rx_frame;		/* the next one of those */
+
+static bool tx_ring = false;
+static int tx_frame;				/* next slot to put a frame in */
+static int tx_queued = 0;			/* frames put in the ring since the last flush */
+
+static struct tpacket_block_desc *rx_desc(int block) {
+	return (struct tpacket_block_desc *)(ring + (size_t)block * rx_req.tp_block_size);
+}
+
+static struct tpacket3_hdr *tx_slot(int frame) {
+	return (struct tpacket3_hdr *)(ring + (size_t)rx_req.tp_block_size * rx_req.tp_block_nr + (size_t)frame * tx_req.tp_frame_size);
+}
+
+static bool setup_ring(void) {
+	int version = TPACKET_V3;
+	unsigned int frame_size = 2048;
+
+	while(frame_size < max_frame_size + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)))
+		frame_size <<= 1;
+
+	if(setsockopt(device_fd, SOL_PACKET, PACKET_VERSION, &version, sizeof version)) {
+		logger(LOG_WARNING, "Could not use TPACKET_V3 on %s: %s", device_info, strerror(errno));
+		return false;
+	}
+
+	memset(&rx_req, 0, sizeof rx_req);
+	rx_req.tp_block_size = RING_BLOCK_SIZE;
+	rx_req.tp_block_nr = RING_RX_BLOCKS;
+	rx_req.tp_frame_size = frame_size;
+	rx_req.tp_frame_nr = RING_BLOCK_SIZE / frame_size * RING_RX_BLOCKS;
+	rx_req.tp_retire_blk_tov = 1;		/* ms before a block that is not full is handed to us */
+
+	if(setsockopt(device_fd, SOL_PACKET, PACKET_RX_RING, &rx_req, sizeof rx_req)) {
+		logger(LOG_WARNING, "Could not set up receive ring on %s: %s", device_info, strerror(errno));
+		return false;
+	}
+
+	/* Older kernels only have a receive ring for TPACKET_V3, then we write() as before */
+
+	memset(&tx_req, 0, sizeof tx_req);
+	tx_req.tp_block_size = RING_BLOCK_SIZE;
+	tx_req.tp_block_nr = RING_TX_BLOCKS;
+	tx_req.tp_frame_size = frame_size;
+	tx_req.tp_frame_nr = RING_BLOCK_SIZE / frame_size * RING_TX_BLOCKS;
+
+	tx_ring = !setsockopt(device_fd, SOL_PACKET, PACKET_TX_RING, &tx_req, sizeof tx_req);
+
+	if(!tx_ring) {
+		ifdebug(STATUS) logger(LOG_DEBUG, "No transmit ring on %s: %s", device_info, strerror(errno));
+		memset(&tx_req, 0, sizeof tx_req);
+	}
+
+	ring_size = (size_t)rx_req.tp_block_size * rx_req.tp_block_nr + (size_t)tx_req.tp_block_size * tx_req.tp_block_nr;
+	ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, device_fd, 0);
+
+	if(ring == MAP_FAILED) {
+		logger(LOG_WARNING, "Could not map the rings of %s: %s", device_info, strerror(errno));
+		ring = NULL;
+		return false;
+	}
+
+	rx_block = 0;
+	rx_left = 0;
+	tx_frame = 0;
+	tx_queued = 0;
+
+	ifdebug(STATUS) logger(LOG_DEBUG, "Using a %d kB receive ring%s on %s", (int)(rx_req.tp_block_size / 1024 * rx_req.tp_block_nr),
+			tx_ring ? " and a transmit ring" : "", device_info);
+
+	return true;
+}
+
+static bool rx_ready(void) {
+	return rx_desc(rx_block)->hdr.bh1.block_status & TP_STATUS_USER;
+}
+
+static void read_ring(vpn_packet_t *packet) {
+	packet->len = 0;
+
+	if(!rx_left) {
+		struct tpacket_block_desc *desc = rx_desc(rx_block);
+
+		if(!rx_ready())
+			return;
+
+		__sync_synchronize();
+		rx_left = desc->hdr.bh1.num_pkts;
+		rx_frame = (struct tpacket3_hdr *)((uint8_t *)desc + desc->hdr.bh1.offset_to_first_pkt);
+
+		if(!rx_left)
+			goto release;
+	}
+
+	/* Longer frames are cut off, as read() would have done */
+
+	packet->len = rx_frame->tp_snaplen < max_frame_size ? rx_frame->tp_snaplen : max_frame_size;
+	memcpy(packet->data, (uint8_t *)rx_frame + rx_frame->tp_mac, packet->len);
+
+	rx_frame = (struct tpacket3_hdr *)((uint8_t *)rx_frame + rx_frame->tp_next_offset);
+
+	if(--rx_left)
+		return;
+
+release:
+	__sync_synchronize();
+	rx_desc(rx_block)->hdr.bh1.block_status = TP_STATUS_KERNEL;
+	rx_block = (rx_block + 1) % rx_req.tp_block_nr;
+}
+
+static void flush_ring(void) {
+	if(!tx_queued)
+		return;
+
+	tx_queued = 0;
+
+	if(send(device_fd, NULL, 0, MSG_DONTWAIT) < 0 && !sockwouldblock(errno))
+		logger(LOG_ERR, "Can't write to %s %s: %s", device_info, device, strerror(errno));
+}
+
+/* Returns false if the ring is full even after telling the kernel to empty it */
+
+static bool write_ring(vpn_packet_t *packet) {
+	struct tpacket3_hdr *slot = tx_slot(tx_frame);
+
+	if(slot->tp_status != TP_STATUS_AVAILABLE) {
+		flush_ring();
+
+		if(slot->tp_status != TP_STATUS_AVAILABLE)
+			return false;
+	}
+
+	memcpy((uint8_t *)slot + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)), packet->data, packet->len);
+	slot->tp_len = packet->len;
+	slot->tp_next_offset = 0;
+	__sync_synchronize();
+	slot->tp_status = TP_STATUS_SEND_REQUEST;
+
+	tx_frame = (tx_frame + 1) % tx_req.tp_frame_nr;
+	tx_queued++;
+
+	return true;
+}
+
+static bool pending_packets(void) {
+	return use_ring && (rx_left || rx_ready());
+}
+
+#endif
+
 static bool setup_device(void) {
 	struct ifreq ifr;
 	struct sockaddr_ll sa;
@@ -75,6 +258,30 @@ static bool setup_device(void) {
 	sa.sll_protocol = htons(ETH_P_ALL);
 	sa.sll_ifindex = ifr.ifr_ifindex;
 
+#ifdef HAVE_PACKET_RING
+	/* The rings have to be set up before binding */
+
+	get_config_bool(lookup_config(config_tree, "RawSocketRing"), &use_ring);
+
+	if(use_ring && !setup_ring()) {
+		close(device_fd);
+
+		if((device_fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0) {
+			logger(LOG_ERR, "Could not open %s: %s", device_info, strerror(errno));
+			return false;
+		}
+
+#ifdef FD_CLOEXEC
+		fcntl(device_fd, F_SETFD, FD_CLOEXEC);
+#endif
+
+		use_ring = false;
+	}
+#else
+	if(lookup_config(config_tree, "RawSocketRing"))
+		logger(LOG_WARNING, "RawSocketRing is not supported on this platform");
+#endif
+
 	if(bind(device_fd, (struct sockaddr *) &sa, (socklen_t) sizeof(sa))) {
 		logger(LOG_ERR, "Could not bind %s to %s: %s", device, ifr.ifr_ifrn.ifrn_name, strerror(errno));
 		return false;
@@ -86,6 +293,16 @@ static bool setup_device(void) {
 }
 
 static void close_device(void) {
+#ifdef HAVE_PACKET_RING
+	if(ring) {
+		flush_ring();
+		munmap(ring, ring_size);
+		ring = NULL;
+	}
+
+	use_ring = tx_ring = false;
+#endif
+
 	close(device_fd);
 
 	free(device);
@@ -95,14 +312,21 @@ static void close_device(void) {
 static bool read_packet(vpn_packet_t *packet) {
 	int lenin;
 
-	if((lenin = read(device_fd, packet->data, MTU)) <= 0) {
-		logger(LOG_ERR, "Error while reading from %s %s: %s", device_info,
-			   device, strerror(errno));
-		return false;
+#ifdef HAVE_PACKET_RING
+	if(use_ring) {
+		read_ring(packet);
+	} else
+#endif
+	{
+		if((lenin = read(device_fd, packet->data, max_frame_size)) <= 0) {
+			logger(LOG_ERR, "Error while reading from %s %s: %s", device_info,
+				   device, strerror(errno));
+			return false;
+		}
+
+		packet->len = lenin;
 	}
 
-	packet->len = lenin;
-
 	device_total_in += packet->len;
 
 	ifdebug(TRAFFIC) logger(LOG_DEBUG, "Read packet of %d bytes from %s", packet->len,
@@ -115,6 +339,13 @@ static bool write_packet(vpn_packet_t *packet) {
 	ifdebug(TRAFFIC) logger(LOG_DEBUG, "Writing packet of %d bytes to %s",
 			   packet->len, device_info);
 
+#ifdef HAVE_PACKET_RING
+	if(tx_ring && write_ring(packet)) {
+		device_total_out += packet->len;
+		return true;
+	}
+#endif
+
 	if(write(device_fd, packet->data, packet->len) < 0) {
 		logger(LOG_ERR, "Can't write to %s %s: %s", device_info, device,
 			   strerror(errno));
@@ -126,6 +357,67 @@ static bool write_packet(vpn_packet_t *packet) {
 	return true;
 }
 
+/* Without the rings, recvmmsg() and sendmmsg() still read or write many frames with one system call */
+
+static int read_batch(vpn_packet_t **packets, int n) {
+	int num = 0;
+
+#ifdef HAVE_PACKET_RING
+	if(use_ring) {
+		do
+			read_ring(packets[num++]);
+		while(num < n && pending_packets());
+	} else
+#endif
+	{
+		num = recv_packets(device_fd, packets, n);
+
+		if(num < 0) {
+			logger(LOG_ERR, "Error while reading from %s %s: %s", device_info,
+				   device, strerror(errno));
+			return -1;
+		}
+	}
+
+	for(int i = 0; i < num; i++) {
+		device_total_in += packets[i]->len;
+
+		ifdebug(TRAFFIC) logger(LOG_DEBUG, "Read packet of %d bytes from %s", packets[i]->len,
+				   device_info);
+	}
+
+	return num;
+}
+
+static int write_batch(vpn_packet_t **packets, int n) {
+	int num;
+
+#ifdef HAVE_PACKET_RING
+	if(tx_ring) {
+		for(num = 0; num < n; num++)
+			if(!write_packet(packets[num]))
+				break;
+
+		return num ? num : -1;
+	}
+#endif
+
+	ifdebug(TRAFFIC) logger(LOG_DEBUG, "Writing %d packets to %s", n, device_info);
+
+	num = send_packets(device_fd, packets, n, NULL, 0);
+
+	if(num < 0) {
+		logger(LOG_ERR, "Can't write to %s %s: %s", device_info, device,
+			   strerror(errno));
+		return -1;
+	}
+
+	for(int i = 0; i < num; i++)
+		device_total_out += packets[i]->len;
+
+	return num;
+}
+
 static void dump_device_stats(void) {
 	logger(LOG_DEBUG, "Statistics for %s %s:", device_info, device);
 	logger(LOG_DEBUG, " total bytes in:  %10"PRIu64, device_total_in);
@@ -138,6 +430,16 @@ const devops_t raw_socket_devops = {
 	.read = read_packet,
 	.write = write_packet,
 	.dump_stats = dump_device_stats,
+#ifdef HAVE_PACKET_RING
+	.pending = pending_packets,
+	.flush = flush_ring,
+#endif
+#ifdef HAVE_RECVMMSG
+	.read_batch = read_batch,
+#endif
+#ifdef HAVE_SENDMMSG
+	.write_batch = write_batch,
+#endif
 };
 
 #else
@@ -0,0 +1,224 @@
+/*
+    resume.c -- resumption of meta connection sessions
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "system.h"
+
+#include <openssl/hmac.h>
+
+#include "avl_tree.h"
+#include "connection.h"
+#include "logger.h"
+#include "net.h"
+#include "node.h"
+#include "resume.h"
+#include "xalloc.h"
+
+/*
+  Authenticating a meta connection costs an RSA decryption on both sides.
+  When a link goes down for a moment, every peer behind it reconnects at
+  once and pays for that again, for a peer it authenticated seconds ago.
+
+  So once a connection is activated, both sides remember a secret hashed
+  from the two meta keys, which only they know. For resume_timeout seconds
+  after the connection has been closed, the side that connects out can
+  offer it again, by sending its ticket in its ID. If the other side still
+  has the same session, both send a RESUME instead of a METAKEY, with a
+  proof that they know the secret. The new meta keys are derived from the
+  secret and the nonces both sides sent in their ID, so nothing of an old
+  connection can be replayed. Otherwise the usual authentication follows.
+
+  A session can only be offered and taken once; the new connection gets a
+  new one. They are forgotten when the configuration is reloaded, so a
+  changed or removed host configuration file is taken into account.
+*/
+
+int resume_timeout = 60;
+uint64_t connections_resumed = 0;
+
+static avl_tree_t *resume_tree;
+
+static int resume_compare(const resume_t *a, const resume_t *b) {
+	return strcmp(a->name, b->name);
+}
+
+void free_resume(resume_t *r) {
+	event_del(&r->event);
+	OPENSSL_cleanse(r->secret, sizeof r->secret);
+	free(r->name);
+	free(r);
+}
+
+void init_resume(void) {
+	resume_tree = avl_alloc_tree((avl_compare_t) resume_compare, (avl_action_t) free_resume);
+}
+
+void exit_resume(void) {
+	avl_delete_tree(resume_tree);
+	resume_tree = NULL;
+}
+
+void flush_resume(void) {
+	avl_delete_tree(resume_tree);
+	init_resume();
+}
+
+static void resume_expire(void *data) {
+	resume_t *r = data;
+
+	ifdebug(CONNECTIONS) logger(LOG_DEBUG, "Session with %s can no longer be resumed", r->name);
+
+	avl_delete(resume_tree, r);
+}
+
+/* Remember the session of a connection that has just been activated */
+
+void resume_store(connection_t *c) {
+	bool first = strcmp(myself->name, c->name) < 0;
+	unsigned char ticket[SHA256_DIGEST_LENGTH];
+	resume_t *r, *old;
+	EVP_MD_CTX ctx;
+
+	if(!resume_timeout || !c->inkey || !c->outkey)
+		return;
+
+	r = xmalloc_and_zero(sizeof *r);
+	r->name = xstrdup(c->name);
+	r->connection = c;
+
+	/* Both sides put the key of the node with the smaller name first */
+
+	if(!EVP_DigestInit(&ctx, EVP_sha256())
+			|| !EVP_DigestUpdate(&ctx, "tinc resume", sizeof "tinc resume")
+			|| !EVP_DigestUpdate(&ctx, first ? c->outkey : c->inkey, first ? c->outkeylength : c->inkeylength)
+			|| !EVP_DigestUpdate(&ctx, first ? c->inkey : c->outkey, first ? c->inkeylength : c->outkeylength)
+			|| !EVP_DigestFinal(&ctx, r->secret, NULL)
+			|| !HMAC(EVP_sha256(), r->secret, sizeof r->secret, (unsigned char *)"ticket", sizeof "ticket", ticket, NULL)) {
+		free_resume(r);
+		return;
+	}
+
+	memcpy(r->ticket, ticket, sizeof r->ticket);
+
+	old = avl_search(resume_tree, r);
+
+	if(old)
+		avl_delete(resume_tree, old);
+
+	avl_insert(resume_tree, r);
+}
+
+/* Start the expiry of the session of a connection that has been closed */
+
+void resume_closed(connection_t *c) {
+	resume_t v, *r;
+
+	if(!resume_tree || !c->name)
+		return;
+
+	v.name = c->name;
+	r = avl_search(resume_tree, &v);
+
+	if(!r || r->connection != c)
+		return;
+
+	r->connection = NULL;
+	event_add(&r->event, resume_expire, r, resume_timeout * 1000);
+}
+
+/* Take the session with a node out, it can be used for one connection only */
+
+resume_t *resume_take(const char *name) {
+	resume_t v, *r;
+
+	if(!resume_timeout || !resume_tree)
+		return NULL;
+
+	v.name = (char *)name;
+	r = avl_search(resume_tree, &v);
+
+	if(!r)
+		return NULL;
+
+	avl_unlink(resume_tree, r);
+	event_del(&r->event);
+	r->connection = NULL;
+
+	return r;
+}
+
+/* HMAC of the secret of the session being resumed, the node that uses it and both nonces */
+
+static bool resume_hmac(const connection_t *c, const char *label, unsigned char counter, const char *name, unsigned char *out) {
+	bool first = strcmp(myself->name, c->name) < 0;
+	HMAC_CTX ctx;
+	bool result;
+
+	HMAC_CTX_init(&ctx);
+
+	result = HMAC_Init_ex(&ctx, c->resume->secret, sizeof c->resume->secret, EVP_sha256(), NULL)
+		&& HMAC_Update(&ctx, (unsigned char *)label, strlen(label) + 1)
+		&& HMAC_Update(&ctx, &counter, 1)
+		&& HMAC_Update(&ctx, (unsigned char *)name, strlen(name) + 1)
+		&& HMAC_Update(&ctx, (unsigned char *)(first ? c->mynonce : c->hisnonce), RESUME_NONCE_LENGTH)
+		&& HMAC_Update(&ctx, (unsigned char *)(first ? c->hisnonce : c->mynonce), RESUME_NONCE_LENGTH)
+		&& HMAC_Final(&ctx, out, NULL);
+
+	HMAC_CTX_cleanup(&ctx);
+
+	return result;
+}
+
+/* The meta key the named side of the connection sends with */
+
+bool resume_key(const connection_t *c, const char *name, char *key, int len) {
+	unsigned char block[SHA256_DIGEST_LENGTH];
+
+	for(unsigned char counter = 0; len > 0; counter++) {
+		int size = len < sizeof block ? len : sizeof block;
+
+		if(!resume_hmac(c, "key", counter, name, block))
+			return false;
+
+		memcpy(key, block, size);
+		key += size;
+		len -= size;
+	}
+
+	OPENSSL_cleanse(block, sizeof block);
+
+	return true;
+}
+
+/* The proof the named side of the connection sends in its RESUME */
+
+bool resume_proof(const connection_t *c, const char *name, char *proof) {
+	return resume_hmac(c, "proof", 0, name, (unsigned char *)proof);
+}
+
+int resume_count(void) {
+	int count = 0;
+
+	if(!resume_tree)
+		return 0;
+
+	for(avl_node_t *node = resume_tree->head; node; node = node->next)
+		count++;
+
+	return count;
+}
@@ -0,0 +1,53 @@
+/*
+    resume.h -- header for resume.c
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __TINC_RESUME_H__
+#define __TINC_RESUME_H__
+
+#include <openssl/sha.h>
+
+#include "connection.h"
+#include "event.h"
+
+#define RESUME_TICKET_LENGTH 16		/* of the ticket that names a session, sent in the clear */
+#define RESUME_PROOF_LENGTH SHA256_DIGEST_LENGTH
+
+typedef struct resume_t {
+	char *name;				/* of the node the session was with */
+	unsigned char secret[SHA256_DIGEST_LENGTH];
+	unsigned char ticket[RESUME_TICKET_LENGTH];
+	struct connection_t *connection;	/* the connection it was derived from, while that is up */
+	event_t event;				/* expiry, once that connection has been closed */
+} resume_t;
+
+extern int resume_timeout;
+extern uint64_t connections_resumed;
+
+extern void init_resume(void);
+extern void exit_resume(void);
+extern void flush_resume(void);
+extern void free_resume(resume_t *);
+extern void resume_store(connection_t *);
+extern void resume_closed(connection_t *);
+extern resume_t *resume_take(const char *);
+extern bool resume_key(const connection_t *, const char *, char *, int);
+extern bool resume_proof(const connection_t *, const char *, char *);
+extern int resume_count(void);
+
+#endif							/* __TINC_RESUME_H__ */
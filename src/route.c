@@ -27,10 +27,12 @@
 #include "ipv6.h"
 #include "logger.h"
 #include "net.h"
+#include "profile.h"
 #include "protocol.h"
 #include "route.h"
 #include "subnet.h"
 #include "utils.h"
+#include "xalloc.h"
 
 rmode_t routing_mode = RMODE_ROUTER;
 fmode_t forwarding_mode = FMODE_INTERNAL;
@@ -59,17 +61,53 @@ static const size_t opt_size = sizeof(struct nd_opt_hdr);
 
 /* RFC 1071 */
 
-static uint16_t inet_checksum(void *data, int len, uint16_t prevsum) {
-	uint16_t *p = data;
-	uint32_t checksum = prevsum ^ 0xFFFF;
+/* The one's complement sum does not depend on the order in which words are added, so add
+   32-bit words into four independent 64-bit sums, and fold the total into 16 bits at the end */
+
+uint16_t inet_checksum(const void *data, int len, uint16_t prevsum) {
+	const uint8_t *p = data;
+	uint64_t sum[4] = {prevsum ^ 0xFFFF, 0, 0, 0};
+	uint64_t checksum;
+	uint32_t word[8];
+	uint16_t tail = 0;
+
+	while(len >= 32) {
+		memcpy(word, p, 32);
+		sum[0] += word[0];
+		sum[1] += word[1];
+		sum[2] += word[2];
+		sum[3] += word[3];
+		sum[0] += word[4];
+		sum[1] += word[5];
+		sum[2] += word[6];
+		sum[3] += word[7];
+		p += 32;
+		len -= 32;
+	}
+
+	while(len >= 4) {
+		memcpy(word, p, 4);
+		sum[0] += word[0];
+		p += 4;
+		len -= 4;
+	}
 
-	while(len >= 2) {
-		checksum += *p++;
+	if(len >= 2) {
+		memcpy(&tail, p, 2);
+		sum[1] += tail;
+		p += 2;
 		len -= 2;
 	}
-	
-	if(len)
-		checksum += *(uint8_t *)p;
+
+	/* An odd byte at the end is padded with zero, as if it was the first of a pair */
+
+	if(len) {
+		tail = 0;
+		memcpy(&tail, p, 1);
+		sum[2] += tail;
+	}
+
+	checksum = sum[0] + sum[1] + sum[2] + sum[3];
 
 	while(checksum >> 16)
 		checksum = (checksum & 0xFFFF) + (checksum >> 16);
@@ -77,20 +115,38 @@ static uint16_t inet_checksum(void *data, int len, uint16_t prevsum) {
 	return ~checksum;
 }
 
-static bool ratelimit(int frequency) {
-	static time_t lasttime = 0;
-	static int count = 0;
-	
-	if(lasttime == now) {
-		if(count >= frequency)
-			return true;
-	} else {
-		lasttime = now;
-		count = 0;
+/* Update a checksum in place after a 16-bit word it covers has changed from old to new, see RFC 1624 eqn. 3 */
+
+static void inet_checksum_update(uint8_t *sum, uint16_t old, uint16_t new) {
+	uint32_t checksum = (sum[0] << 8 | sum[1]) ^ 0xFFFF;
+
+	checksum += (old ^ 0xFFFF) + new;
+	checksum = (checksum & 0xFFFF) + (checksum >> 16);
+	checksum = (checksum & 0xFFFF) + (checksum >> 16);
+	checksum ^= 0xFFFF;
+
+	sum[0] = checksum >> 8;
+	sum[1] = checksum & 0xff;
+}
+
+/*
+  ICMP errors we generate are limited per source node, so a scan from one node
+  behind us cannot make us spend our time building replies, and in total, so
+  many nodes together cannot either.
+*/
+
+#define ICMP_RATE 3
+#define ICMP_TOTAL_RATE 30
+
+static bool ratelimit(node_t *source) {
+	static bucket_t total = {ICMP_TOTAL_RATE, ICMP_TOTAL_RATE};
+
+	if(!source->icmpbucket.rate) {
+		source->icmpbucket.rate = ICMP_RATE;
+		source->icmpbucket.burst = ICMP_RATE;
 	}
 
-	count++;
-	return false;
+	return !bucket_take(&source->icmpbucket, now_msec, 1) || !bucket_take(&total, now_msec, 1);
 }
 
 static bool checklength(node_t *source, vpn_packet_t *packet, length_t length) {
@@ -154,13 +210,12 @@ static void clamp_mss(const node_t *source, const node_t *via, vpn_packet_t *pac
 			continue;
 		}
 
-		if(packet->data[start + 21] != 4)
+		if(packet->data[start + 21 + i] != 4)
 			break;
 
 		/* Found it */
 		uint16_t oldmss = packet->data[start + 22 + i] << 8 | packet->data[start + 23 + i];
 		uint16_t newmss = mtu - start - 20;
-		uint16_t csum = packet->data[start + 16] << 8 | packet->data[start + 17];
 
 		if(oldmss <= newmss)
 			break;
@@ -170,12 +225,7 @@ static void clamp_mss(const node_t *source, const node_t *via, vpn_packet_t *pac
 		/* Update the MSS value and the checksum */
 		packet->data[start + 22 + i] = newmss >> 8;
 		packet->data[start + 23 + i] = newmss & 0xff;
-		csum ^= 0xffff;
-		csum -= oldmss;
-		csum += newmss;
-		csum ^= 0xffff;
-		packet->data[start + 16] = csum >> 8;
-		packet->data[start + 17] = csum & 0xff;
+		inet_checksum_update(packet->data + start + 16, oldmss, newmss);
 		break;
 	}
 }
@@ -219,34 +269,196 @@ static void learn_mac(mac_t *address) {
 	}
 
 	if(subnet->expires)
-		subnet->expires = now + macexpire;
+		subnet_set_expires(subnet, now + macexpire);
 }
 
 void age_subnets(void) {
 	subnet_t *s;
 	connection_t *c;
-	avl_node_t *node, *next, *node2;
-
-	for(node = myself->subnet_tree->head; node; node = next) {
-		next = node->next;
-		s = node->data;
-		if(s->expires && s->expires <= now) {
-			ifdebug(TRAFFIC) {
-				char netstr[MAXNETSTR];
-				if(net2str(netstr, sizeof netstr, s))
-					logger(LOG_INFO, "Subnet %s expired", netstr);
+	avl_node_t *node;
+
+	while((s = get_expired_subnet())) {
+		ifdebug(TRAFFIC) {
+			char netstr[MAXNETSTR];
+			if(net2str(netstr, sizeof netstr, s))
+				logger(LOG_INFO, "Subnet %s expired", netstr);
+		}
+
+		for(node = connection_tree->head; node; node = node->next) {
+			c = node->data;
+			if(c->status.active)
+				send_del_subnet(c, s);
+		}
+
+		subnet_update(myself, s, false);
+		subnet_del(myself, s);
+	}
+}
+
+/*
+  MulticastSnooping.
+
+  Without it, multicast goes to every node, like broadcasts. With it, IGMP
+  and MLD membership reports from our own device are snooped, and the
+  Ethernet address of each group that is joined is learned as one of our
+  MAC subnets, so it is announced to the other nodes and expires like any
+  other learned address unless reports keep coming. Packets for a group
+  then only go along the MST branches that lead to its members.
+
+  Link-local groups, IGMP and MLD themselves, and all other multicast are
+  still broadcast, so queriers and neighbor discovery keep working.
+  Leaving a group is not acted upon: another host behind us may still be a
+  member, and only a querier can find out.
+*/
+
+bool multicast_snooping = false;
+
+static void join_ipv4_group(const uint8_t *group) {
+	mac_t mac = {{0x01, 0x00, 0x5e, group[1] & 0x7f, group[2], group[3]}};
+
+	if(group[0] == 224 && !group[1] && !group[2])
+		return;
+
+	learn_mac(&mac);
+}
+
+static void join_ipv6_group(const uint8_t *group) {
+	mac_t mac = {{0x33, 0x33, group[12], group[13], group[14], group[15]}};
+
+	if(group[0] != 0xff || (group[1] & 0x0f) <= 2)
+		return;
+
+	learn_mac(&mac);
+}
+
+/* Group records of IGMPv3 and MLDv2 reports that mean there is at least one listener */
+
+static bool record_joins(uint8_t type, int sources) {
+	switch(type) {
+		case 2:		/* MODE_IS_EXCLUDE */
+		case 4:		/* CHANGE_TO_EXCLUDE_MODE */
+			return true;
+
+		case 1:		/* MODE_IS_INCLUDE */
+		case 3:		/* CHANGE_TO_INCLUDE_MODE */
+		case 5:		/* ALLOW_NEW_SOURCES */
+			return sources > 0;
+
+		default:
+			return false;
+	}
+}
+
+/* RFC 2236, RFC 3376 */
+
+static void snoop_igmp(const uint8_t *igmp, length_t len) {
+	if(len < 8)
+		return;
+
+	switch(igmp[0]) {
+		case IGMP_V1_MEMBERSHIP_REPORT:
+		case IGMP_V2_MEMBERSHIP_REPORT:
+			join_ipv4_group(igmp + 4);
+			break;
+
+		case IGMP_V3_MEMBERSHIP_REPORT: {
+			int records = igmp[6] << 8 | igmp[7];
+			length_t p = 8;
+
+			while(records-- && p + 8 <= len) {
+				int sources = igmp[p + 2] << 8 | igmp[p + 3];
+
+				if(record_joins(igmp[p], sources))
+					join_ipv4_group(igmp + p + 4);
+
+				p += 8 + sources * 4 + igmp[p + 1] * 4;
 			}
+			break;
+		}
+
+		default:
+			break;
+	}
+}
 
-			for(node2 = connection_tree->head; node2; node2 = node2->next) {
-				c = node2->data;
-				if(c->status.active)
-					send_del_subnet(c, s);
+/* RFC 2710, RFC 3810 */
+
+static void snoop_mld(const uint8_t *mld, length_t len) {
+	switch(mld[0]) {
+		case MLD_LISTENER_REPORT:
+			if(len >= 24)
+				join_ipv6_group(mld + 8);
+			break;
+
+		case MLD2_LISTENER_REPORT: {
+			int records = len >= 8 ? mld[6] << 8 | mld[7] : 0;
+			length_t p = 8;
+
+			while(records-- && p + 20 <= len) {
+				int sources = mld[p + 2] << 8 | mld[p + 3];
+
+				if(record_joins(mld[p], sources))
+					join_ipv6_group(mld + p + 4);
+
+				p += 20 + sources * 16 + mld[p + 1] * 4;
 			}
+			break;
+		}
+
+		default:
+			break;
+	}
+}
+
+/* Send a multicast packet to the members of its group, returns false if it has to be broadcast */
+
+static bool route_multicast(node_t *source, vpn_packet_t *packet) {
+	uint16_t type = packet->data[12] << 8 | packet->data[13];
+	const uint8_t *ip = packet->data + ether_size;
+	length_t len = packet->len - ether_size;
+	mac_t group;
+
+	if(type == ETH_P_IP && packet->len >= ether_size + ip_size) {
+		length_t hl = (ip[0] & 0x0f) * 4;
+
+		if(ip[9] == IPPROTO_IGMP) {
+			if(source == myself && len > hl)
+				snoop_igmp(ip + hl, len - hl);
+			return false;
+		}
+
+		if((ip[16] & 0xf0) != 0xe0 || (ip[16] == 224 && !ip[17] && !ip[18]))
+			return false;
+
+		group = (mac_t){{0x01, 0x00, 0x5e, ip[17] & 0x7f, ip[18], ip[19]}};
+	} else if(type == ETH_P_IPV6 && packet->len >= ether_size + ip6_size) {
+		uint8_t next = ip[6];
+		length_t off = ip6_size;
+
+		/* MLD messages carry a router alert in a hop-by-hop options header */
+
+		if(next == IPPROTO_HOPOPTS && len >= off + 8) {
+			next = ip[off];
+			off += (ip[off + 1] + 1) * 8;
+		}
 
-			subnet_update(myself, s, false);
-			subnet_del(myself, s);
+		if(next == IPPROTO_ICMPV6 && len >= off + 4 && ip[off] >= MLD_LISTENER_QUERY
+				&& (ip[off] <= MLD_LISTENER_REDUCTION || ip[off] == MLD2_LISTENER_REPORT)) {
+			if(source == myself)
+				snoop_mld(ip + off, len - off);
+			return false;
 		}
+
+		if(ip[24] != 0xff || (ip[25] & 0x0f) <= 2)
+			return false;
+
+		group = (mac_t){{0x33, 0x33, ip[36], ip[37], ip[38], ip[39]}};
+	} else {
+		return false;
 	}
+
+	multicast_packet(source, packet, lookup_subnets_mac(&group));
+	return true;
 }
 
 /* RFC 792 */
@@ -259,7 +471,7 @@ static void route_ipv4_unreachable(node_t *source, vpn_packet_t *packet, length_
 	struct in_addr ip_dst;
 	uint32_t oldlen;
 
-	if(ratelimit(3))
+	if(ratelimit(source))
 		return;
 	
 	/* Swap Ethernet source and destination addresses */
@@ -326,13 +538,12 @@ static void route_ipv4_unreachable(node_t *source, vpn_packet_t *packet, length_
 
 static void fragment_ipv4_packet(node_t *dest, vpn_packet_t *packet, length_t ether_size) {
 	struct ip ip;
-	vpn_packet_t fragment;
+	vpn_packet_t *fragment;
 	int len, maxlen, todo;
 	uint8_t *offset;
 	uint16_t ip_off, origf;
 	
 	memcpy(&ip, packet->data + ether_size, ip_size);
-	fragment.priority = packet->priority;
 
 	if(ip.ip_hl != ip_size / 4)
 		return;
@@ -351,10 +562,13 @@ static void fragment_ipv4_packet(node_t *dest, vpn_packet_t *packet, length_t et
 	ip_off = ntohs(ip.ip_off);
 	origf = ip_off & ~IP_OFFMASK;
 	ip_off &= IP_OFFMASK;
+
+	fragment = new_packet();
+	fragment->priority = packet->priority;
 	
 	while(todo) {
 		len = todo > maxlen ? maxlen : todo;
-		memcpy(fragment.data + ether_size + ip_size, offset, len);
+		memcpy(fragment->data + ether_size + ip_size, offset, len);
 		todo -= len;
 		offset += len;
 
@@ -362,14 +576,16 @@ static void fragment_ipv4_packet(node_t *dest, vpn_packet_t *packet, length_t et
 		ip.ip_off = htons(ip_off | origf | (todo ? IP_MF : 0));
 		ip.ip_sum = 0;
 		ip.ip_sum = inet_checksum(&ip, ip_size, ~0);
-		memcpy(fragment.data, packet->data, ether_size);
-		memcpy(fragment.data + ether_size, &ip, ip_size);
-		fragment.len = ether_size + ip_size + len;
+		memcpy(fragment->data, packet->data, ether_size);
+		memcpy(fragment->data + ether_size, &ip, ip_size);
+		fragment->len = ether_size + ip_size + len;
 
-		send_packet(dest, &fragment);
+		send_packet(dest, fragment);
 
 		ip_off += len / 8;
 	}	
+
+	free_packet(fragment);
 }
 
 static void route_ipv4_unicast(node_t *source, vpn_packet_t *packet) {
@@ -378,7 +594,9 @@ static void route_ipv4_unicast(node_t *source, vpn_packet_t *packet) {
 	ipv4_t dest;
 
 	memcpy(&dest, &packet->data[30], sizeof dest);
+	profile_begin(start);
 	subnet = lookup_subnet_ipv4(&dest);
+	profile_end(PROFILE_LOOKUP, start);
 
 	if(!subnet) {
 		ifdebug(TRAFFIC) logger(LOG_WARNING, "Cannot route packet from %s (%s): unknown IPv4 destination address %d.%d.%d.%d",
@@ -403,7 +621,7 @@ static void route_ipv4_unicast(node_t *source, vpn_packet_t *packet) {
 	if(forwarding_mode == FMODE_OFF && source != myself && subnet->owner != myself)
 		return route_ipv4_unreachable(source, packet, ether_size, ICMP_DEST_UNREACH, ICMP_NET_ANO);
 
-	if(priorityinheritance)
+	if(priorityinheritance || fair_queueing)
 		packet->priority = packet->data[15];
 
 	via = (subnet->owner->via == myself) ? subnet->owner->nexthop : subnet->owner->via;
@@ -416,7 +634,7 @@ static void route_ipv4_unicast(node_t *source, vpn_packet_t *packet) {
 	if(directonly && subnet->owner != via)
 		return route_ipv4_unreachable(source, packet, ether_size, ICMP_DEST_UNREACH, ICMP_NET_ANO);
 
-	if(via && packet->len > MAX(via->mtu, 590) && via != myself) {
+	if(via && packet->len > MAX(via->mtu, 590) && via != myself && !can_fragment(via)) {
 		ifdebug(TRAFFIC) logger(LOG_INFO, "Packet for %s (%s) length %d larger than MTU %d", subnet->owner->name, subnet->owner->hostname, packet->len, via->mtu);
 		if(packet->data[20] & 0x40) {
 			packet->len = MAX(via->mtu, 590);
@@ -441,9 +659,10 @@ static void route_ipv4(node_t *source, vpn_packet_t *packet) {
 			packet->data[30] == 255 &&
 			packet->data[31] == 255 &&
 			packet->data[32] == 255 &&
-			packet->data[33] == 255)))
-		broadcast_packet(source, packet);
-	else
+			packet->data[33] == 255))) {
+		if(!multicast_snooping || !route_multicast(source, packet))
+			broadcast_packet(source, packet);
+	} else
 		route_ipv4_unicast(source, packet);
 }
 
@@ -461,7 +680,7 @@ static void route_ipv6_unreachable(node_t *source, vpn_packet_t *packet, length_
 		uint32_t next;
 	} pseudo;
 
-	if(ratelimit(3))
+	if(ratelimit(source))
 		return;
 	
 	/* Swap Ethernet source and destination addresses */
@@ -533,7 +752,9 @@ static void route_ipv6_unicast(node_t *source, vpn_packet_t *packet) {
 	ipv6_t dest;
 
 	memcpy(&dest, &packet->data[38], sizeof dest);
+	profile_begin(start);
 	subnet = lookup_subnet_ipv6(&dest);
+	profile_end(PROFILE_LOOKUP, start);
 
 	if(!subnet) {
 		ifdebug(TRAFFIC) logger(LOG_WARNING, "Cannot route packet from %s (%s): unknown IPv6 destination address %hx:%hx:%hx:%hx:%hx:%hx:%hx:%hx",
@@ -562,6 +783,9 @@ static void route_ipv6_unicast(node_t *source, vpn_packet_t *packet) {
 	if(forwarding_mode == FMODE_OFF && source != myself && subnet->owner != myself)
 		return route_ipv6_unreachable(source, packet, ether_size, ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_ADMIN);
 
+	if(priorityinheritance || fair_queueing)
+		packet->priority = (packet->data[14] & 0x0f) << 4 | packet->data[15] >> 4;
+
 	via = (subnet->owner->via == myself) ? subnet->owner->nexthop : subnet->owner->via;
 	
 	if(via == source) {
@@ -572,7 +796,7 @@ static void route_ipv6_unicast(node_t *source, vpn_packet_t *packet) {
 	if(directonly && subnet->owner != via)
 		return route_ipv6_unreachable(source, packet, ether_size, ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_ADMIN);
 
-	if(via && packet->len > MAX(via->mtu, 1294) && via != myself) {
+	if(via && packet->len > MAX(via->mtu, 1294) && via != myself && !can_fragment(via)) {
 		ifdebug(TRAFFIC) logger(LOG_INFO, "Packet for %s (%s) length %d larger than MTU %d", subnet->owner->name, subnet->owner->hostname, packet->len, via->mtu);
 		packet->len = MAX(via->mtu, 1294);
 		route_ipv6_unreachable(source, packet, ether_size, ICMP6_PACKET_TOO_BIG, 0);
@@ -734,9 +958,10 @@ static void route_ipv6(node_t *source, vpn_packet_t *packet) {
 		return;
 	}
 
-	if(broadcast_mode && packet->data[38] == 255)
-		broadcast_packet(source, packet);
-	else
+	if(broadcast_mode && packet->data[38] == 255) {
+		if(!multicast_snooping || !route_multicast(source, packet))
+			broadcast_packet(source, packet);
+	} else
 		route_ipv6_unicast(source, packet);
 }
 
@@ -806,6 +1031,294 @@ static void route_arp(node_t *source, vpn_packet_t *packet) {
 	send_packet(source, packet);
 }
 
+/*
+  Neighbor cache for switch mode.
+
+  In switch mode every ARP request and neighbor solicitation is flooded to
+  the whole VPN. With NeighborCacheSize set, the IPv4 and IPv6 addresses
+  announced by ARP and neighbor discovery packets passing through are
+  remembered along with their MAC address, and a broadcast request from our
+  own device for an address we know is answered right away, on behalf of
+  the host that has it, as long as that MAC address is still known to live
+  behind another node. Anything else is flooded as before, including
+  gratuitous ARP and duplicate address detection, so conflicts are still
+  noticed and moved hosts update the cache.
+
+  Like the subnet cache, this is a fixed size set associative table, so it
+  needs no allocations or expiry timers. Entries are refreshed as long as
+  the hosts talk, and forgotten MACExpire seconds after they were last seen.
+*/
+
+#define NEIGHBOR_WAYS 4
+
+typedef struct neighbor_t {
+	time_t expires;				/* 0 if this entry is unused */
+	uint8_t len;				/* 4 for IPv4 addresses, 16 for IPv6 */
+	uint8_t address[16];
+	mac_t mac;
+} neighbor_t;
+
+int neighbor_cache_size = 0;
+
+static neighbor_t *neighbors;
+static uint8_t *neighbor_victim;		/* next way to replace in each set */
+static unsigned int neighbor_sets;
+static uint64_t neighbor_hits;
+static uint64_t neighbor_misses;
+
+void init_neighbors(void) {
+	unsigned int sets = 1;
+
+	if(routing_mode != RMODE_SWITCH || neighbor_cache_size < NEIGHBOR_WAYS)
+		return;
+
+	while(sets * 2 * NEIGHBOR_WAYS <= (unsigned int)neighbor_cache_size)
+		sets *= 2;
+
+	neighbors = xmalloc_and_zero(sets * NEIGHBOR_WAYS * sizeof *neighbors);
+	neighbor_victim = xmalloc_and_zero(sets);
+	neighbor_sets = sets;
+}
+
+void exit_neighbors(void) {
+	free(neighbors);
+	free(neighbor_victim);
+	neighbors = NULL;
+	neighbor_victim = NULL;
+	neighbor_sets = 0;
+}
+
+static neighbor_t *neighbor_set(const void *address, size_t len) {
+	const uint8_t *p = address;
+	uint32_t hash = 2166136261U;
+
+	for(size_t i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 16777619U;
+
+	hash ^= hash >> 16;
+
+	return neighbors + (hash & (neighbor_sets - 1)) * NEIGHBOR_WAYS;
+}
+
+static const neighbor_t *lookup_neighbor(const void *address, size_t len) {
+	const neighbor_t *e = neighbor_set(address, len);
+
+	for(int i = 0; i < NEIGHBOR_WAYS; i++)
+		if(e[i].expires > now && e[i].len == len && !memcmp(e[i].address, address, len))
+			return &e[i];
+
+	return NULL;
+}
+
+static void learn_neighbor(const void *address, size_t len, const uint8_t *mac) {
+	neighbor_t *e = neighbor_set(address, len);
+	int i, unused = -1;
+
+	/* Multicast and all-zero addresses belong to nobody */
+
+	if((mac[0] & 1) || !(mac[0] | mac[1] | mac[2] | mac[3] | mac[4] | mac[5]))
+		return;
+
+	for(i = 0; i < NEIGHBOR_WAYS; i++) {
+		if(e[i].expires > now && e[i].len == len && !memcmp(e[i].address, address, len))
+			break;
+
+		if(unused < 0 && e[i].expires <= now)
+			unused = i;
+	}
+
+	if(i == NEIGHBOR_WAYS) {
+		if(unused >= 0) {
+			i = unused;
+		} else {
+			uint8_t *victim = &neighbor_victim[(e - neighbors) / NEIGHBOR_WAYS];
+			i = *victim;
+			*victim = (i + 1) % NEIGHBOR_WAYS;
+		}
+
+		e[i].len = len;
+		memcpy(e[i].address, address, len);
+	}
+
+	memcpy(e[i].mac.x, mac, ETH_ALEN);
+	e[i].expires = now + macexpire;
+}
+
+/* The MAC address we know for this IP address, if it is behind another node */
+
+static const mac_t *answer_neighbor(const void *address, size_t len) {
+	const neighbor_t *e = lookup_neighbor(address, len);
+	subnet_t *subnet;
+
+	if(e && (subnet = lookup_subnet_mac(NULL, &e->mac)) && subnet->owner != myself) {
+		neighbor_hits++;
+		return &e->mac;
+	}
+
+	neighbor_misses++;
+	return NULL;
+}
+
+static bool snoop_arp(node_t *source, vpn_packet_t *packet) {
+	struct ether_arp arp;
+	const mac_t *mac;
+	uint8_t addr[4];
+	static const uint8_t zero[4];
+
+	if(packet->len < ether_size + arp_size)
+		return false;
+
+	memcpy(&arp, packet->data + ether_size, arp_size);
+
+	if(ntohs(arp.arp_hrd) != ARPHRD_ETHER || ntohs(arp.arp_pro) != ETH_P_IP ||
+	   arp.arp_hln != ETH_ALEN || arp.arp_pln != sizeof addr)
+		return false;
+
+	/* Probes have no sender address, only learn what the sender says about himself */
+
+	if(memcmp(arp.arp_spa, zero, sizeof addr) && !memcmp(arp.arp_sha, packet->data + ETH_ALEN, ETH_ALEN))
+		learn_neighbor(arp.arp_spa, sizeof addr, arp.arp_sha);
+
+	if(source != myself || ntohs(arp.arp_op) != ARPOP_REQUEST || !(packet->data[0] & 1)
+	   || !memcmp(arp.arp_spa, zero, sizeof addr) || !memcmp(arp.arp_spa, arp.arp_tpa, sizeof addr))
+		return false;
+
+	if(!(mac = answer_neighbor(arp.arp_tpa, sizeof addr)))
+		return false;
+
+	/* Reply as the host that has the address would */
+
+	memcpy(packet->data, packet->data + ETH_ALEN, ETH_ALEN);
+	memcpy(packet->data + ETH_ALEN, mac->x, ETH_ALEN);
+
+	memcpy(addr, arp.arp_tpa, sizeof addr);
+	memcpy(arp.arp_tpa, arp.arp_spa, sizeof addr);
+	memcpy(arp.arp_spa, addr, sizeof addr);
+
+	memcpy(arp.arp_tha, arp.arp_sha, ETH_ALEN);
+	memcpy(arp.arp_sha, mac->x, ETH_ALEN);
+	arp.arp_op = htons(ARPOP_REPLY);
+
+	memcpy(packet->data + ether_size, &arp, arp_size);
+
+	send_packet(myself, packet);
+	return true;
+}
+
+static bool snoop_neighbor_discovery(node_t *source, vpn_packet_t *packet) {
+	struct ip6_hdr ip6;
+	struct nd_neighbor_solicit ns;
+	struct nd_opt_hdr opt;
+	const uint8_t *lladdr = packet->data + ether_size + ip6_size + ns_size + opt_size;
+	const mac_t *mac;
+	uint16_t checksum;
+	static const struct in6_addr unspecified;
+
+	struct {
+		struct in6_addr ip6_src;
+		struct in6_addr ip6_dst;
+		uint32_t length;
+		uint32_t next;
+	} pseudo;
+
+	if(packet->len < ether_size + ip6_size + ns_size || packet->data[20] != IPPROTO_ICMPV6)
+		return false;
+
+	memcpy(&ip6, packet->data + ether_size, ip6_size);
+	memcpy(&ns, packet->data + ether_size + ip6_size, ns_size);
+
+	if(ns.nd_ns_type != ND_NEIGHBOR_SOLICIT && ns.nd_ns_type != ND_NEIGHBOR_ADVERT)
+		return false;
+
+	/* Advertisements tell the target's link address, solicitations the sender's */
+
+	if(packet->len >= ether_size + ip6_size + ns_size + opt_size + ETH_ALEN) {
+		memcpy(&opt, packet->data + ether_size + ip6_size + ns_size, opt_size);
+
+		if(ns.nd_ns_type == ND_NEIGHBOR_ADVERT && opt.nd_opt_type == ND_OPT_TARGET_LINKADDR)
+			learn_neighbor(&ns.nd_ns_target, sizeof ns.nd_ns_target, lladdr);
+		else if(ns.nd_ns_type == ND_NEIGHBOR_SOLICIT && opt.nd_opt_type == ND_OPT_SOURCE_LINKADDR
+				&& memcmp(&ip6.ip6_src, &unspecified, sizeof unspecified))
+			learn_neighbor(&ip6.ip6_src, sizeof ip6.ip6_src, lladdr);
+	}
+
+	/* Only answer solicitations for address resolution, not duplicate address detection or unicast probes */
+
+	if(source != myself || ns.nd_ns_type != ND_NEIGHBOR_SOLICIT || !(packet->data[0] & 1)
+	   || !memcmp(&ip6.ip6_src, &unspecified, sizeof unspecified))
+		return false;
+
+	if(!(mac = answer_neighbor(&ns.nd_ns_target, sizeof ns.nd_ns_target)))
+		return false;
+
+	/* Create a neighbor advertisement from the host that has the address */
+
+	memcpy(packet->data, packet->data + ETH_ALEN, ETH_ALEN);
+	memcpy(packet->data + ETH_ALEN, mac->x, ETH_ALEN);
+
+	ip6.ip6_dst = ip6.ip6_src;
+	ip6.ip6_src = ns.nd_ns_target;
+	ip6.ip6_plen = htons(ns_size + opt_size + ETH_ALEN);
+	ip6.ip6_hlim = 255;
+
+	ns.nd_ns_type = ND_NEIGHBOR_ADVERT;
+	ns.nd_ns_code = 0;
+	ns.nd_ns_cksum = 0;
+	ns.nd_ns_reserved = htonl(0x60000000UL);	/* Set solicited and override flags */
+
+	opt.nd_opt_type = ND_OPT_TARGET_LINKADDR;
+	opt.nd_opt_len = 1;
+
+	pseudo.ip6_src = ip6.ip6_src;
+	pseudo.ip6_dst = ip6.ip6_dst;
+	pseudo.length = htonl(ns_size + opt_size + ETH_ALEN);
+	pseudo.next = htonl(IPPROTO_ICMPV6);
+
+	checksum = inet_checksum(&pseudo, sizeof pseudo, ~0);
+	checksum = inet_checksum(&ns, ns_size, checksum);
+	checksum = inet_checksum(&opt, opt_size, checksum);
+	checksum = inet_checksum(mac->x, ETH_ALEN, checksum);
+
+	ns.nd_ns_hdr.icmp6_cksum = checksum;
+
+	memcpy(packet->data + ether_size, &ip6, ip6_size);
+	memcpy(packet->data + ether_size + ip6_size, &ns, ns_size);
+	memcpy(packet->data + ether_size + ip6_size + ns_size, &opt, opt_size);
+	memcpy(packet->data + ether_size + ip6_size + ns_size + opt_size, mac->x, ETH_ALEN);
+	packet->len = ether_size + ip6_size + ns_size + opt_size + ETH_ALEN;
+
+	send_packet(myself, packet);
+	return true;
+}
+
+/* Learn from neighbor discovery packets, returns true if we answered one ourself */
+
+static bool snoop_neighbors(node_t *source, vpn_packet_t *packet) {
+	uint16_t type = packet->data[12] << 8 | packet->data[13];
+
+	if(type == ETH_P_ARP)
+		return snoop_arp(source, packet);
+
+	if(type == ETH_P_IPV6)
+		return snoop_neighbor_discovery(source, packet);
+
+	return false;
+}
+
+void dump_neighbors(void) {
+	int used = 0;
+
+	if(!neighbors)
+		return;
+
+	for(unsigned int i = 0; i < neighbor_sets * NEIGHBOR_WAYS; i++)
+		if(neighbors[i].expires > now)
+			used++;
+
+	logger(LOG_DEBUG, "Neighbor cache statistics (%d of %d entries used):", used, neighbor_sets * NEIGHBOR_WAYS);
+	logger(LOG_DEBUG, " answered %10"PRIu64" flooded %10"PRIu64, neighbor_hits, neighbor_misses);
+}
+
 static void route_mac(node_t *source, vpn_packet_t *packet) {
 	subnet_t *subnet;
 	mac_t dest;
@@ -818,10 +1331,26 @@ static void route_mac(node_t *source, vpn_packet_t *packet) {
 		learn_mac(&src);
 	}
 
+	/* Answer ARP and neighbor solicitations for known addresses ourself */
+
+	if(neighbors && snoop_neighbors(source, packet))
+		return;
+
 	/* Lookup destination address */
 
 	memcpy(&dest, &packet->data[0], sizeof dest);
+
+	/* Group addresses are learned as our subnets too, but are not unicast */
+
+	if(multicast_snooping && (dest.x[0] & 1)) {
+		if(!route_multicast(source, packet))
+			broadcast_packet(source, packet);
+		return;
+	}
+
+	profile_begin(start);
 	subnet = lookup_subnet_mac(NULL, &dest);
+	profile_end(PROFILE_LOOKUP, start);
 
 	if(!subnet) {
 		broadcast_packet(source, packet);
@@ -838,7 +1367,7 @@ static void route_mac(node_t *source, vpn_packet_t *packet) {
 
 	uint16_t type = packet->data[12] << 8 | packet->data[13];
 
-	if(priorityinheritance && type == ETH_P_IP && packet->len >= ether_size + ip_size)
+	if((priorityinheritance || fair_queueing) && type == ETH_P_IP && packet->len >= ether_size + ip_size)
 		packet->priority = packet->data[15];
 
 	// Handle packets larger than PMTU
@@ -848,7 +1377,7 @@ static void route_mac(node_t *source, vpn_packet_t *packet) {
 	if(directonly && subnet->owner != via)
 		return;
 	
-	if(via && packet->len > via->mtu && via != myself) {
+	if(via && packet->len > via->mtu && via != myself && !can_fragment(via)) {
 		ifdebug(TRAFFIC) logger(LOG_INFO, "Packet for %s (%s) length %d larger than MTU %d", subnet->owner->name, subnet->owner->hostname, packet->len, via->mtu);
 		length_t ethlen = 14;
 
@@ -901,12 +1430,7 @@ static bool do_decrement_ttl(node_t *source, vpn_packet_t *packet) {
 			packet->data[ethlen + 8]--;
 			uint16_t new = packet->data[ethlen + 8] << 8 | packet->data[ethlen + 9];
 
-			uint32_t checksum = packet->data[ethlen + 10] << 8 | packet->data[ethlen + 11];
-			checksum += old + (~new & 0xFFFF);
-			while(checksum >> 16)
-				checksum = (checksum & 0xFFFF) + (checksum >> 16);
-			packet->data[ethlen + 10] = checksum >> 8;
-			packet->data[ethlen + 11] = checksum & 0xff;
+			inet_checksum_update(packet->data + ethlen + 10, old, new);
 
 			return true;
 
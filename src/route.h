@@ -48,12 +48,18 @@ extern bmode_t broadcast_mode;
 extern bool decrement_ttl;
 extern bool directonly;
 extern bool overwrite_mac;
+extern bool multicast_snooping;
 extern bool priorityinheritance;
 extern int macexpire;
+extern int neighbor_cache_size;
 
 extern mac_t mymac;
 
 extern void age_subnets(void);
+extern void init_neighbors(void);
+extern void exit_neighbors(void);
+extern void dump_neighbors(void);
 extern void route(struct node_t *, struct vpn_packet_t *);
+extern uint16_t inet_checksum(const void *, int, uint16_t);
 
 #endif							/* __TINC_ROUTE_H__ */
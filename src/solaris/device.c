@@ -301,7 +301,7 @@ static bool read_packet(vpn_packet_t *packet) {
 
 	switch(device_type) {
 		case DEVICE_TYPE_TUN:
-			if((inlen = read(device_fd, packet->data + 14, MTU - 14)) <= 0) {
+			if((inlen = read(device_fd, packet->data + 14, max_frame_size - 14)) <= 0) {
 				logger(LOG_ERR, "Error while reading from %s %s: %s", device_info, device, strerror(errno));
 				return false;
 			}
@@ -325,7 +325,7 @@ static bool read_packet(vpn_packet_t *packet) {
 			break;
 
 		case DEVICE_TYPE_TAP:
-			if((inlen = read(device_fd, packet->data, MTU)) <= 0) {
+			if((inlen = read(device_fd, packet->data, max_frame_size)) <= 0) {
 				logger(LOG_ERR, "Error while reading from %s %s: %s", device_info, device, strerror(errno));
 				return false;
 			}
@@ -21,6 +21,7 @@
 #include "system.h"
 
 #include "avl_tree.h"
+#include "control.h"
 #include "device.h"
 #include "logger.h"
 #include "net.h"
@@ -35,27 +36,194 @@
 
 avl_tree_t *subnet_tree;
 
-/* Subnet lookup cache */
+/* Subnet lookup cache
 
-static ipv4_t cache_ipv4_address[2];
-static subnet_t *cache_ipv4_subnet[2];
-static bool cache_ipv4_valid[2];
-static int cache_ipv4_slot;
+   There is a set-associative cache for each type of address. An entry is only
+   valid if its generation matches that of the cache, so subnet_cache_flush()
+   invalidates everything at once by incrementing the generation. Adding or
+   deleting a subnet only invalidates the entries for addresses it covers.
+*/
+
+#define SUBNET_CACHE_WAYS 4
+
+typedef struct subnet_cache_entry_t {
+	uint32_t generation;
+	const node_t *owner;		/* owner the lookup was restricted to, if any */
+	subnet_t *subnet;
+	union {
+		mac_t mac;
+		ipv4_t ipv4;
+		ipv6_t ipv6;
+	} address;
+} subnet_cache_entry_t;
+
+typedef struct subnet_cache_t {
+	subnet_cache_entry_t *entries;
+	uint8_t *victim;		/* next way to replace in each set */
+	unsigned int sets;
+	uint32_t generation;
+	unsigned int filled;		/* entries stored since the last flush */
+	uint64_t hits;
+	uint64_t misses;
+} subnet_cache_t;
+
+int subnet_cache_size = 1024;
+
+static subnet_cache_t cache_mac;
+static subnet_cache_t cache_ipv4;
+static subnet_cache_t cache_ipv6;
+
+static void init_subnet_cache(subnet_cache_t *cache) {
+	unsigned int sets = 1;
+
+	memset(cache, 0, sizeof *cache);
+
+	if(subnet_cache_size < SUBNET_CACHE_WAYS)
+		return;
+
+	while(sets * 2 * SUBNET_CACHE_WAYS <= (unsigned int)subnet_cache_size)
+		sets *= 2;
+
+	cache->entries = xmalloc_and_zero(sets * SUBNET_CACHE_WAYS * sizeof *cache->entries);
+	cache->victim = xmalloc_and_zero(sets);
+	cache->sets = sets;
+	cache->generation = 1;
+}
+
+static void exit_subnet_cache(subnet_cache_t *cache) {
+	free(cache->entries);
+	free(cache->victim);
+	memset(cache, 0, sizeof *cache);
+}
+
+static unsigned long subnet_cache_bytes(const subnet_cache_t *cache) {
+	return cache->sets * (SUBNET_CACHE_WAYS * sizeof *cache->entries + 1);
+}
+
+unsigned long subnet_cache_memory(int *entries) {
+	*entries = (cache_mac.sets + cache_ipv4.sets + cache_ipv6.sets) * SUBNET_CACHE_WAYS;
+	return subnet_cache_bytes(&cache_mac) + subnet_cache_bytes(&cache_ipv4) + subnet_cache_bytes(&cache_ipv6);
+}
+
+static void flush_subnet_cache(subnet_cache_t *cache) {
+	if(!cache->sets)
+		return;
+
+	if(!++cache->generation) {
+		memset(cache->entries, 0, cache->sets * SUBNET_CACHE_WAYS * sizeof *cache->entries);
+		cache->generation = 1;
+	}
+
+	cache->filled = 0;
+}
+
+static subnet_cache_entry_t *subnet_cache_set(const subnet_cache_t *cache, const void *address, size_t len, const node_t *owner) {
+	const uint8_t *p = address;
+	uint32_t hash = 2166136261U;
+
+	for(size_t i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 16777619U;
+
+	hash ^= (uintptr_t)owner;
+	hash ^= hash >> 16;
+
+	return cache->entries + (hash & (cache->sets - 1)) * SUBNET_CACHE_WAYS;
+}
+
+static bool subnet_cache_lookup(subnet_cache_t *cache, const void *address, size_t len, const node_t *owner, subnet_t **subnet) {
+	subnet_cache_entry_t *e;
+
+	if(!cache->sets)
+		return false;
+
+	e = subnet_cache_set(cache, address, len, owner);
+
+	for(int i = 0; i < SUBNET_CACHE_WAYS; i++) {
+		if(e[i].generation == cache->generation && e[i].owner == owner && !memcmp(&e[i].address, address, len)) {
+			cache->hits++;
+			*subnet = e[i].subnet;
+			return true;
+		}
+	}
+
+	cache->misses++;
+	return false;
+}
 
-static ipv6_t cache_ipv6_address[2];
-static subnet_t *cache_ipv6_subnet[2];
-static bool cache_ipv6_valid[2];
-static int cache_ipv6_slot;
+static void subnet_cache_store(subnet_cache_t *cache, const void *address, size_t len, const node_t *owner, subnet_t *subnet) {
+	subnet_cache_entry_t *e;
+	int i;
+
+	if(!cache->sets)
+		return;
+
+	e = subnet_cache_set(cache, address, len, owner);
+
+	for(i = 0; i < SUBNET_CACHE_WAYS; i++)
+		if(e[i].generation != cache->generation)
+			break;
+
+	if(i == SUBNET_CACHE_WAYS) {
+		uint8_t *victim = &cache->victim[(e - cache->entries) / SUBNET_CACHE_WAYS];
+		i = *victim;
+		*victim = (i + 1) % SUBNET_CACHE_WAYS;
+	}
+
+	e[i].generation = cache->generation;
+	e[i].owner = owner;
+	e[i].subnet = subnet;
+	memcpy(&e[i].address, address, len);
 
-static mac_t cache_mac_address[2];
-static subnet_t *cache_mac_subnet[2];
-static bool cache_mac_valid[2];
-static int cache_mac_slot;
+	cache->filled++;
+}
+
+/* Invalidate the cached lookups of all addresses covered by this subnet */
+
+static void subnet_cache_invalidate(const subnet_t *subnet) {
+	subnet_cache_t *cache;
+	subnet_cache_entry_t *e, *end;
+
+	switch(subnet->type) {
+		case SUBNET_MAC: cache = &cache_mac; break;
+		case SUBNET_IPV4: cache = &cache_ipv4; break;
+		case SUBNET_IPV6: cache = &cache_ipv6; break;
+		default: return;
+	}
+
+	if(!cache->filled)
+		return;
+
+	end = cache->entries + cache->sets * SUBNET_CACHE_WAYS;
+
+	for(e = cache->entries; e < end; e++) {
+		if(e->generation != cache->generation)
+			continue;
+
+		switch(subnet->type) {
+			case SUBNET_MAC:
+				if(memcmp(&e->address.mac, &subnet->net.mac.address, sizeof(mac_t)))
+					continue;
+				break;
+			case SUBNET_IPV4:
+				if(maskcmp(&e->address.ipv4, &subnet->net.ipv4.address, subnet->net.ipv4.prefixlength))
+					continue;
+				break;
+			case SUBNET_IPV6:
+				if(maskcmp(&e->address.ipv6, &subnet->net.ipv6.address, subnet->net.ipv6.prefixlength))
+					continue;
+				break;
+			default:
+				break;
+		}
+
+		e->generation = 0;
+	}
+}
 
 void subnet_cache_flush(void) {
-	cache_ipv4_valid[0] = cache_ipv4_valid[1] = false;
-	cache_ipv6_valid[0] = cache_ipv6_valid[1] = false;
-	cache_mac_valid[0] = cache_mac_valid[1] = false;
+	flush_subnet_cache(&cache_mac);
+	flush_subnet_cache(&cache_ipv4);
+	flush_subnet_cache(&cache_ipv6);
 }
 
 /* Subnet comparison */
@@ -142,15 +310,387 @@ int subnet_compare(const subnet_t *a, const subnet_t *b) {
 	return 0;
 }
 
+/* Longest prefix match tries
+
+   There is one path compressed binary trie for IPv4 and one for IPv6 subnets.
+   Each node holds a prefix and all subnets that have exactly that prefix,
+   ordered the same way as in subnet_tree. Nodes without subnets only exist
+   where two branches split.
+*/
+
+typedef struct subnet_trie_t {
+	struct subnet_trie_t *child[2];
+	avl_tree_t *subnets;
+	int prefixlength;
+	uint8_t key[sizeof(ipv6_t)];
+} subnet_trie_t;
+
+static subnet_trie_t *ipv4_trie;
+static subnet_trie_t *ipv6_trie;
+
+static int key_bit(const void *key, int bit) {
+	return (((const uint8_t *)key)[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+static int common_prefix(const uint8_t *a, const uint8_t *b, int maxlen) {
+	int len = 0;
+
+	while(len + 8 <= maxlen && a[len / 8] == b[len / 8])
+		len += 8;
+
+	while(len < maxlen && key_bit(a, len) == key_bit(b, len))
+		len++;
+
+	return len;
+}
+
+static xslab_t subnet_trie_slab = XSLAB_INIT("subnet_trie", subnet_trie_t);
+
+static subnet_trie_t *new_trie_node(const uint8_t *key, int prefixlength, int keylen) {
+	subnet_trie_t *node = xslab_alloc_and_zero(&subnet_trie_slab);
+
+	maskcpy(node->key, key, prefixlength, keylen);
+	node->prefixlength = prefixlength;
+
+	return node;
+}
+
+static void free_trie(subnet_trie_t *node) {
+	if(!node)
+		return;
+
+	free_trie(node->child[0]);
+	free_trie(node->child[1]);
+
+	if(node->subnets)
+		avl_delete_tree(node->subnets);
+
+	xslab_free(&subnet_trie_slab, node);
+}
+
+static void trie_insert(subnet_trie_t **root, const void *address, int prefixlength, int keylen, subnet_t *subnet) {
+	uint8_t key[sizeof(ipv6_t)];
+	subnet_trie_t **pp = root, *node, *split;
+	int common;
+
+	maskcpy(key, address, prefixlength, keylen);
+
+	while((node = *pp)) {
+		common = common_prefix(key, node->key, prefixlength < node->prefixlength ? prefixlength : node->prefixlength);
+
+		if(common < node->prefixlength) {
+			/* Our prefix is shorter than or diverges from this node's, insert a new node above it */
+
+			split = new_trie_node(key, common, keylen);
+			split->child[key_bit(node->key, common)] = node;
+			*pp = split;
+
+			if(common == prefixlength) {
+				node = split;
+				goto found;
+			}
+
+			pp = &split->child[key_bit(key, common)];
+			break;
+		}
+
+		if(node->prefixlength == prefixlength)
+			goto found;
+
+		pp = &node->child[key_bit(key, node->prefixlength)];
+	}
+
+	node = *pp = new_trie_node(key, prefixlength, keylen);
+
+found:
+	if(!node->subnets)
+		node->subnets = new_subnet_tree();
+
+	avl_insert(node->subnets, subnet);
+}
+
+/* Remove a node without subnets if it does not separate two branches anymore */
+
+static void trie_prune(subnet_trie_t **pp) {
+	subnet_trie_t *node = *pp;
+
+	if(node->subnets || (node->child[0] && node->child[1]))
+		return;
+
+	*pp = node->child[0] ? node->child[0] : node->child[1];
+	xslab_free(&subnet_trie_slab, node);
+}
+
+static void trie_delete(subnet_trie_t **root, const void *address, int prefixlength, int keylen, subnet_t *subnet) {
+	uint8_t key[sizeof(ipv6_t)];
+	subnet_trie_t **pp = root, **parent = NULL, *node;
+
+	maskcpy(key, address, prefixlength, keylen);
+
+	while((node = *pp) && node->prefixlength < prefixlength) {
+		parent = pp;
+		pp = &node->child[key_bit(key, node->prefixlength)];
+	}
+
+	if(!node || node->prefixlength != prefixlength || memcmp(node->key, key, keylen) || !node->subnets)
+		return;
+
+	avl_delete(node->subnets, subnet);
+
+	if(node->subnets->head)
+		return;
+
+	avl_delete_tree(node->subnets);
+	node->subnets = NULL;
+
+	trie_prune(pp);
+	if(parent)
+		trie_prune(parent);
+}
+
+/* Walk down the trie, and return the first subnet with a reachable owner,
+   trying longer prefixes first. If no owner is reachable, return the last match. */
+
+static subnet_t *trie_lookup(const subnet_trie_t *node, const void *address, int keylen) {
+	const subnet_trie_t *matches[sizeof(ipv6_t) * 8 + 1];
+	int nmatches = 0;
+	avl_node_t *n;
+	subnet_t *p, *r = NULL;
+
+	while(node && !maskcmp(address, node->key, node->prefixlength)) {
+		if(node->subnets)
+			matches[nmatches++] = node;
+
+		if(node->prefixlength == keylen * 8)
+			break;
+
+		node = node->child[key_bit(address, node->prefixlength)];
+	}
+
+	while(nmatches--) {
+		for(n = matches[nmatches]->subnets->head; n; n = n->next) {
+			p = n->data;
+			r = p;
+			if(p->owner->status.reachable)
+				return p;
+		}
+	}
+
+	return r;
+}
+
+/* Hash table for MAC subnets
+
+   This uses open addressing with linear probing. Each slot holds a tree of
+   all subnets with the same MAC address, in the same order as in subnet_tree.
+   Empty trees are never kept, so the address of the first subnet is the key.
+*/
+
+static avl_tree_t **mac_table;
+static unsigned int mac_table_size;
+static unsigned int mac_table_count;
+
+static unsigned int mac_hash(const mac_t *address) {
+	uint32_t hash = (address->x[0] << 8 | address->x[1]) ^ ((uint32_t)address->x[2] << 24 | address->x[3] << 16 | address->x[4] << 8 | address->x[5]);
+
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3b;
+	hash ^= hash >> 16;
+
+	return hash & (mac_table_size - 1);
+}
+
+static const mac_t *mac_table_key(const avl_tree_t *tree) {
+	return &((subnet_t *)tree->head->data)->net.mac.address;
+}
+
+/* Return the slot containing this address, or the empty slot where it should go */
+
+static unsigned int mac_table_slot(const mac_t *address) {
+	unsigned int i = mac_hash(address);
+
+	while(mac_table[i] && memcmp(mac_table_key(mac_table[i]), address, sizeof *address))
+		i = (i + 1) & (mac_table_size - 1);
+
+	return i;
+}
+
+static void mac_table_resize(unsigned int size) {
+	avl_tree_t **old = mac_table;
+	unsigned int oldsize = mac_table_size;
+
+	mac_table = xmalloc_and_zero(size * sizeof *mac_table);
+	mac_table_size = size;
+
+	for(unsigned int i = 0; i < oldsize; i++)
+		if(old[i])
+			mac_table[mac_table_slot(mac_table_key(old[i]))] = old[i];
+
+	free(old);
+}
+
+static void mac_table_insert(subnet_t *subnet) {
+	unsigned int i;
+
+	if((mac_table_count + 1) * 2 > mac_table_size)
+		mac_table_resize(mac_table_size ? mac_table_size * 2 : 16);
+
+	i = mac_table_slot(&subnet->net.mac.address);
+
+	if(!mac_table[i]) {
+		mac_table[i] = new_subnet_tree();
+		mac_table_count++;
+	}
+
+	avl_insert(mac_table[i], subnet);
+}
+
+static void mac_table_delete(subnet_t *subnet) {
+	unsigned int i, j, k, mask = mac_table_size - 1;
+
+	if(!mac_table_size)
+		return;
+
+	i = mac_table_slot(&subnet->net.mac.address);
+
+	if(!mac_table[i])
+		return;
+
+	avl_delete(mac_table[i], subnet);
+
+	if(mac_table[i]->head)
+		return;
+
+	avl_delete_tree(mac_table[i]);
+	mac_table[i] = NULL;
+	mac_table_count--;
+
+	/* Move back entries that would otherwise become unreachable through the new hole */
+
+	for(j = (i + 1) & mask; mac_table[j]; j = (j + 1) & mask) {
+		k = mac_hash(mac_table_key(mac_table[j]));
+
+		if(((j - k) & mask) >= ((j - i) & mask)) {
+			mac_table[i] = mac_table[j];
+			mac_table[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+static void free_mac_table(void) {
+	for(unsigned int i = 0; i < mac_table_size; i++)
+		if(mac_table[i])
+			avl_delete_tree(mac_table[i]);
+
+	free(mac_table);
+	mac_table = NULL;
+	mac_table_size = 0;
+	mac_table_count = 0;
+}
+
+/* Timing wheel for expiring subnets
+
+   Subnets with an expiry time, which are the MAC addresses we learned, are kept
+   in the slot for the second they expire. Refreshing a subnet only updates its
+   expiry time; when its old slot comes up it is simply moved to the right one.
+*/
+
+#define AGEING_SLOTS 256
+
+static subnet_t *ageing_wheel[AGEING_SLOTS];
+static time_t ageing_time;
+
+static void ageing_link(subnet_t *subnet) {
+	time_t when = subnet->expires;
+	subnet_t **slot;
+
+	if(when < ageing_time)
+		when = ageing_time;
+	else if(when >= ageing_time + AGEING_SLOTS)
+		when = ageing_time + AGEING_SLOTS - 1;
+
+	slot = &ageing_wheel[when % AGEING_SLOTS];
+
+	subnet->ageing_next = *slot;
+	subnet->ageing_pprev = slot;
+	if(*slot)
+		(*slot)->ageing_pprev = &subnet->ageing_next;
+	*slot = subnet;
+}
+
+static void ageing_unlink(subnet_t *subnet) {
+	if(!subnet->ageing_pprev)
+		return;
+
+	*subnet->ageing_pprev = subnet->ageing_next;
+	if(subnet->ageing_next)
+		subnet->ageing_next->ageing_pprev = subnet->ageing_pprev;
+
+	subnet->ageing_next = NULL;
+	subnet->ageing_pprev = NULL;
+}
+
+void subnet_set_expires(subnet_t *subnet, time_t expires) {
+	time_t old = subnet->expires;
+
+	subnet->expires = expires;
+
+	/* Waiting for the old slot is fine if the subnet expires later than before */
+
+	if(subnet->ageing_pprev && expires < old) {
+		ageing_unlink(subnet);
+		ageing_link(subnet);
+	}
+}
+
+/* Return an expired subnet, or NULL if there are none */
+
+subnet_t *get_expired_subnet(void) {
+	subnet_t *subnet;
+
+	if(now - ageing_time >= AGEING_SLOTS)
+		ageing_time = now - AGEING_SLOTS + 1;
+
+	for(; ageing_time <= now; ageing_time++) {
+		while((subnet = ageing_wheel[ageing_time % AGEING_SLOTS])) {
+			ageing_unlink(subnet);
+
+			if(subnet->expires > now)
+				ageing_link(subnet);
+			else if(subnet->expires > 0)
+				return subnet;
+		}
+	}
+
+	return NULL;
+}
+
 /* Initialising trees */
 
 void init_subnets(void) {
 	subnet_tree = avl_alloc_tree((avl_compare_t) subnet_compare, (avl_action_t) free_subnet);
-
-	subnet_cache_flush();
+	ipv4_trie = NULL;
+	ipv6_trie = NULL;
+	memset(ageing_wheel, 0, sizeof ageing_wheel);
+	ageing_time = now;
+
+	init_subnet_cache(&cache_mac);
+	init_subnet_cache(&cache_ipv4);
+	init_subnet_cache(&cache_ipv6);
 }
 
 void exit_subnets(void) {
+	free_trie(ipv4_trie);
+	free_trie(ipv6_trie);
+	ipv4_trie = NULL;
+	ipv6_trie = NULL;
+	free_mac_table();
+
+	exit_subnet_cache(&cache_mac);
+	exit_subnet_cache(&cache_ipv4);
+	exit_subnet_cache(&cache_ipv6);
+
 	avl_delete_tree(subnet_tree);
 }
 
@@ -164,12 +704,14 @@ void free_subnet_tree(avl_tree_t *subnet_tree) {
 
 /* Allocating and freeing space for subnets */
 
+static xslab_t subnet_slab = XSLAB_INIT("subnet", subnet_t);
+
 subnet_t *new_subnet(void) {
-	return xmalloc_and_zero(sizeof(subnet_t));
+	return xslab_alloc_and_zero(&subnet_slab);
 }
 
 void free_subnet(subnet_t *subnet) {
-	free(subnet);
+	xslab_free(&subnet_slab, subnet);
 }
 
 /* Adding and removing subnets */
@@ -180,14 +722,38 @@ void subnet_add(node_t *n, subnet_t *subnet) {
 	avl_insert(subnet_tree, subnet);
 	avl_insert(n->subnet_tree, subnet);
 
-	subnet_cache_flush();
+	if(subnet->type == SUBNET_MAC)
+		mac_table_insert(subnet);
+	else if(subnet->type == SUBNET_IPV4)
+		trie_insert(&ipv4_trie, &subnet->net.ipv4.address, subnet->net.ipv4.prefixlength, sizeof(ipv4_t), subnet);
+	else if(subnet->type == SUBNET_IPV6)
+		trie_insert(&ipv6_trie, &subnet->net.ipv6.address, subnet->net.ipv6.prefixlength, sizeof(ipv6_t), subnet);
+
+	subnet->ageing_next = NULL;
+	subnet->ageing_pprev = NULL;
+
+	if(subnet->expires > 0)
+		ageing_link(subnet);
+
+	subnet_cache_invalidate(subnet);
+	control_subnet_changed(subnet, "add");
 }
 
 void subnet_del(node_t *n, subnet_t *subnet) {
+	control_subnet_changed(subnet, "del");
+	ageing_unlink(subnet);
+
+	if(subnet->type == SUBNET_MAC)
+		mac_table_delete(subnet);
+	else if(subnet->type == SUBNET_IPV4)
+		trie_delete(&ipv4_trie, &subnet->net.ipv4.address, subnet->net.ipv4.prefixlength, sizeof(ipv4_t), subnet);
+	else if(subnet->type == SUBNET_IPV6)
+		trie_delete(&ipv6_trie, &subnet->net.ipv6.address, subnet->net.ipv6.prefixlength, sizeof(ipv6_t), subnet);
+
 	avl_delete(n->subnet_tree, subnet);
 	avl_delete(subnet_tree, subnet);
 
-	subnet_cache_flush();
+	subnet_cache_invalidate(subnet);
 }
 
 /* Ascii representation of subnets */
@@ -404,28 +970,24 @@ subnet_t *lookup_subnet(const node_t *owner, const subnet_t *subnet) {
 subnet_t *lookup_subnet_mac(const node_t *owner, const mac_t *address) {
 	subnet_t *p, *r = NULL;
 	avl_node_t *n;
-	int i;
+	unsigned int i;
 
 	// Check if this address is cached
 
-	for(i = 0; i < 2; i++) {
-		if(!cache_mac_valid[i])
-			continue;
-		if(owner && cache_mac_subnet[i] && cache_mac_subnet[i]->owner != owner)
-			continue;
-		if(!memcmp(address, &cache_mac_address[i], sizeof *address))
-			return cache_mac_subnet[i];
-	}
+	if(subnet_cache_lookup(&cache_mac, address, sizeof *address, owner, &r))
+		return r;
 
-	// Search all subnets for a matching one
+	// Look up all subnets with this address, optionally only those of the given owner
 
-	for(n = owner ? owner->subnet_tree->head : subnet_tree->head; n; n = n->next) {
-		p = n->data;
-		
-		if(!p || p->type != SUBNET_MAC)
-			continue;
+	i = mac_table_size ? mac_table_slot(address) : 0;
+
+	if(mac_table_size && mac_table[i]) {
+		for(n = mac_table[i]->head; n; n = n->next) {
+			p = n->data;
+
+			if(owner && p->owner != owner)
+				continue;
 
-		if(!memcmp(address, &p->net.mac.address, sizeof *address)) {
 			r = p;
 			if(p->owner->status.reachable)
 				break;
@@ -434,88 +996,51 @@ subnet_t *lookup_subnet_mac(const node_t *owner, const mac_t *address) {
 
 	// Cache the result
 
-	cache_mac_slot = !cache_mac_slot;
-	memcpy(&cache_mac_address[cache_mac_slot], address, sizeof *address);
-	cache_mac_subnet[cache_mac_slot] = r;
-	cache_mac_valid[cache_mac_slot] = true;
+	subnet_cache_store(&cache_mac, address, sizeof *address, owner, r);
 
 	return r;
 }
 
+/* All subnets with this MAC address, in the order of subnet_tree, NULL if there are none */
+
+const avl_tree_t *lookup_subnets_mac(const mac_t *address) {
+	return mac_table_size ? mac_table[mac_table_slot(address)] : NULL;
+}
+
 subnet_t *lookup_subnet_ipv4(const ipv4_t *address) {
-	subnet_t *p, *r = NULL;
-	avl_node_t *n;
-	int i;
+	subnet_t *r;
 
 	// Check if this address is cached
 
-	for(i = 0; i < 2; i++) {
-		if(!cache_ipv4_valid[i])
-			continue;
-		if(!memcmp(address, &cache_ipv4_address[i], sizeof *address))
-			return cache_ipv4_subnet[i];
-	}
+	if(subnet_cache_lookup(&cache_ipv4, address, sizeof *address, NULL, &r))
+		return r;
 
-	// Search all subnets for a matching one
-
-	for(n = subnet_tree->head; n; n = n->next) {
-		p = n->data;
-		
-		if(!p || p->type != SUBNET_IPV4)
-			continue;
+	// Find the longest matching prefix
 
-		if(!maskcmp(address, &p->net.ipv4.address, p->net.ipv4.prefixlength)) {
-			r = p;
-			if(p->owner->status.reachable)
-				break;
-		}
-	}
+	r = trie_lookup(ipv4_trie, address, sizeof *address);
 
 	// Cache the result
 
-	cache_ipv4_slot = !cache_ipv4_slot;
-	memcpy(&cache_ipv4_address[cache_ipv4_slot], address, sizeof *address);
-	cache_ipv4_subnet[cache_ipv4_slot] = r;
-	cache_ipv4_valid[cache_ipv4_slot] = true;
+	subnet_cache_store(&cache_ipv4, address, sizeof *address, NULL, r);
 
 	return r;
 }
 
 subnet_t *lookup_subnet_ipv6(const ipv6_t *address) {
-	subnet_t *p, *r = NULL;
-	avl_node_t *n;
-	int i;
+	subnet_t *r;
 
 	// Check if this address is cached
 
-	for(i = 0; i < 2; i++) {
-		if(!cache_ipv6_valid[i])
-			continue;
-		if(!memcmp(address, &cache_ipv6_address[i], sizeof *address))
-			return cache_ipv6_subnet[i];
-	}
+	if(subnet_cache_lookup(&cache_ipv6, address, sizeof *address, NULL, &r))
+		return r;
 
-	// Search all subnets for a matching one
+	// Find the longest matching prefix
 
-	for(n = subnet_tree->head; n; n = n->next) {
-		p = n->data;
-		
-		if(!p || p->type != SUBNET_IPV6)
-			continue;
-
-		if(!maskcmp(address, &p->net.ipv6.address, p->net.ipv6.prefixlength)) {
-			r = p;
-			if(p->owner->status.reachable)
-				break;
-		}
-	}
+	r = trie_lookup(ipv6_trie, address, sizeof *address);
 
 	// Cache the result
 
-	cache_ipv6_slot = !cache_ipv6_slot;
-	memcpy(&cache_ipv6_address[cache_ipv6_slot], address, sizeof *address);
-	cache_ipv6_subnet[cache_ipv6_slot] = r;
-	cache_ipv6_valid[cache_ipv6_slot] = true;
+	subnet_cache_store(&cache_ipv6, address, sizeof *address, NULL, r);
 
 	return r;
 }
@@ -568,7 +1093,7 @@ void subnet_update(node_t *owner, subnet_t *subnet, bool up) {
 			xasprintf(&envp[4], "SUBNET=%s", netstr);
 			xasprintf(&envp[5], "WEIGHT=%s", weight);
 
-			execute_script(name, envp);
+			queue_script(name, envp);
 		}
 	} else {
 		if(net2str(netstr, sizeof netstr, subnet)) {
@@ -583,7 +1108,7 @@ void subnet_update(node_t *owner, subnet_t *subnet, bool up) {
 			xasprintf(&envp[4], "SUBNET=%s", netstr);
 			xasprintf(&envp[5], "WEIGHT=%s", weight);
 
-			execute_script(name, envp);
+			queue_script(name, envp);
 		}
 	}
 
@@ -606,4 +1131,9 @@ void dump_subnets(void) {
 	}
 
 	logger(LOG_DEBUG, "End of subnet list.");
+
+	logger(LOG_DEBUG, "Subnet cache statistics (%d entries per type):", subnet_cache_size);
+	logger(LOG_DEBUG, " MAC  hits %10"PRIu64" misses %10"PRIu64, cache_mac.hits, cache_mac.misses);
+	logger(LOG_DEBUG, " IPv4 hits %10"PRIu64" misses %10"PRIu64, cache_ipv4.hits, cache_ipv4.misses);
+	logger(LOG_DEBUG, " IPv6 hits %10"PRIu64" misses %10"PRIu64, cache_ipv6.hits, cache_ipv6.misses);
 }
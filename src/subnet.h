@@ -53,6 +53,9 @@ typedef struct subnet_t {
 	time_t expires;			/* expiry time */
 	int weight;			/* weight (higher value is higher priority) */
 
+	struct subnet_t *ageing_next;	/* next subnet in the same slot of the ageing wheel */
+	struct subnet_t **ageing_pprev;	/* pointer to the pointer to this subnet in the ageing wheel */
+
 	/* And now for the actual subnet: */
 
 	union net {
@@ -65,6 +68,7 @@ typedef struct subnet_t {
 #define MAXNETSTR 64
 
 extern avl_tree_t *subnet_tree;
+extern int subnet_cache_size;
 
 extern int subnet_compare(const struct subnet_t *, const struct subnet_t *);
 extern subnet_t *new_subnet(void) __attribute__ ((__malloc__));
@@ -80,9 +84,13 @@ extern bool net2str(char *, int, const subnet_t *);
 extern bool str2net(subnet_t *, const char *);
 extern subnet_t *lookup_subnet(const struct node_t *, const subnet_t *);
 extern subnet_t *lookup_subnet_mac(const struct node_t *, const mac_t *);
+extern const avl_tree_t *lookup_subnets_mac(const mac_t *);
 extern subnet_t *lookup_subnet_ipv4(const ipv4_t *);
 extern subnet_t *lookup_subnet_ipv6(const ipv6_t *);
 extern void dump_subnets(void);
 extern void subnet_cache_flush(void);
+extern unsigned long subnet_cache_memory(int *);
+extern void subnet_set_expires(subnet_t *, time_t);
+extern subnet_t *get_expired_subnet(void);
 
 #endif							/* __TINC_SUBNET_H__ */
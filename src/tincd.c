@@ -52,6 +52,8 @@
 #include <getopt.h>
 #include "pidfile.h"
 
+#include "bench.h"
+
 #include "conf.h"
 #include "device.h"
 #include "logger.h"
@@ -115,6 +117,8 @@ static struct option const long_options[] = {
 	{"logfile", optional_argument, NULL, 4},
 	{"pidfile", required_argument, NULL, 5},
 	{"option", required_argument, NULL, 'o'},
+	{"bench", optional_argument, NULL, 6},
+	{"bench-crypto", no_argument, NULL, 7},
 	{NULL, 0, NULL, 0}
 };
 
@@ -142,6 +146,8 @@ static void usage(bool status) {
 				"  -o, --option=[HOST.]KEY=VALUE  Set global/host configuration value.\n"
 				"  -R, --chroot                   chroot to NET dir at startup.\n"
 				"  -U, --user=USER                setuid to given USER at startup.\n"
+				"      --bench[=PACKETS]          Measure the throughput of the data path and exit.\n"
+				"      --bench-crypto             Measure the speed of packet encryption and exit.\n"
 				"      --help                     Display this help and exit.\n"
 				"      --version                  Output version information and exit.\n\n");
 		printf("Report bugs to tinc@tinc-vpn.org.\n");
@@ -310,6 +316,28 @@ static bool parse_options(int argc, char **argv) {
 				pidfilename = xstrdup(optarg);
 				break;
 
+			case 6:					/* run the benchmark */
+				if(!optarg && optind < argc && *argv[optind] != '-')
+					optarg = argv[optind++];
+				if(optarg) {
+					bench_packets = atoi(optarg);
+
+					if(bench_packets < 1) {
+						fprintf(stderr, "Invalid argument `%s'; PACKETS must be a positive number.\n",
+								optarg);
+						usage(true);
+						return false;
+					}
+				} else
+					bench_packets = 100000;
+				do_detach = false;
+				break;
+
+			case 7:					/* run the crypto benchmark */
+				bench_crypto = true;
+				do_detach = false;
+				break;
+
 			case '?':
 				usage(true);
 				return false;
@@ -639,6 +667,18 @@ int main2(int argc, char **argv) {
 	if(!setup_network())
 		goto end;
 
+	if(bench_packets) {
+		status = run_benchmark() ? 0 : 1;
+		close_network_connections();
+		goto end;
+	}
+
+	if(bench_crypto) {
+		status = run_crypto_benchmark() ? 0 : 1;
+		close_network_connections();
+		goto end;
+	}
+
 	/* Initiate all outgoing connections. */
 
 	try_outgoing_connections();
@@ -242,7 +242,7 @@ static bool read_packet(vpn_packet_t *packet) {
 		}
 
 		case 2: {
-			if((lenin = read(data_fd, packet->data, MTU)) <= 0) {
+			if((lenin = read(data_fd, packet->data, max_frame_size)) <= 0) {
 				logger(LOG_ERR, "Error while reading from %s %s: %s", device_info,
 					   device, strerror(errno));
 				running = false;
@@ -289,6 +289,61 @@ static bool write_packet(vpn_packet_t *packet) {
 	return true;
 }
 
+/* Once connected, frames are read and written many at a time with recvmmsg() and sendmmsg() */
+
+static int read_batch(vpn_packet_t **packets, int n) {
+	int num;
+
+	if(state != 2)
+		return read_packet(packets[0]) ? 1 : -1;
+
+	num = recv_packets(data_fd, packets, n);
+
+	if(num < 0) {
+		logger(LOG_ERR, "Error while reading from %s %s: %s", device_info,
+			   device, strerror(errno));
+		running = false;
+		return -1;
+	}
+
+	for(int i = 0; i < num; i++) {
+		device_total_in += packets[i]->len;
+
+		ifdebug(TRAFFIC) logger(LOG_DEBUG, "Read packet of %d bytes from %s", packets[i]->len,
+				   device_info);
+	}
+
+	return num;
+}
+
+static int write_batch(vpn_packet_t **packets, int n) {
+	int num;
+
+	if(state != 2) {
+		ifdebug(TRAFFIC) logger(LOG_DEBUG, "Dropping %d packets to %s: not connected to UML yet",
+				n, device_info);
+		return -1;
+	}
+
+	ifdebug(TRAFFIC) logger(LOG_DEBUG, "Writing %d packets to %s", n, device_info);
+
+	num = send_packets(write_fd, packets, n, NULL, 0);
+
+	if(num < 0) {
+		if(errno != EINTR && errno != EAGAIN) {
+			logger(LOG_ERR, "Can't write to %s %s: %s", device_info, device, strerror(errno));
+			running = false;
+		}
+
+		return -1;
+	}
+
+	for(int i = 0; i < num; i++)
+		device_total_out += packets[i]->len;
+
+	return num;
+}
+
 static void dump_device_stats(void) {
 	logger(LOG_DEBUG, "Statistics for %s %s:", device_info, device);
 	logger(LOG_DEBUG, " total bytes in:  %10"PRIu64, device_total_in);
@@ -301,4 +356,10 @@ const devops_t uml_devops = {
 	.read = read_packet,
 	.write = write_packet,
 	.dump_stats = dump_device_stats,
+#ifdef HAVE_RECVMMSG
+	.read_batch = read_batch,
+#endif
+#ifdef HAVE_SENDMMSG
+	.write_batch = write_batch,
+#endif
 };
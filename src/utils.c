@@ -93,3 +93,29 @@ int memcmp_constant_time (const void *a, const void *b, size_t size) {
 
   return ret;
 }
+
+/*
+ * Take amount units from a token bucket after refilling it up to clock, in milliseconds.
+ * Returns false, leaving the bucket untouched, if there are not enough tokens.
+ * A zeroed bucket with a non-zero rate starts out full.
+ */
+bool bucket_take(bucket_t *bucket, uint64_t clock, uint64_t amount) {
+	uint64_t elapsed;
+
+	if(!bucket->rate)
+		return true;
+
+	elapsed = clock - bucket->time;
+	bucket->time = clock;
+
+	/* Compare before multiplying so a long idle period cannot overflow */
+
+	if(elapsed >= bucket->burst * 1000 / bucket->rate + 1 || (bucket->tokens += elapsed * bucket->rate) > bucket->burst * 1000)
+		bucket->tokens = bucket->burst * 1000;
+
+	if(bucket->tokens < amount * 1000)
+		return false;
+
+	bucket->tokens -= amount * 1000;
+	return true;
+}
@@ -31,12 +31,14 @@ extern const char *winerror(int);
 #define sockstrerror(x) winerror(x)
 #define sockwouldblock(x) ((x) == WSAEWOULDBLOCK || (x) == WSAEINTR)
 #define sockmsgsize(x) ((x) == WSAEMSGSIZE)
+#define socknobufs(x) ((x) == WSAENOBUFS)
 #define sockinprogress(x) ((x) == WSAEINPROGRESS || (x) == WSAEWOULDBLOCK)
 #else
 #define sockerrno errno
 #define sockstrerror(x) strerror(x)
 #define sockwouldblock(x) ((x) == EWOULDBLOCK || (x) == EINTR)
 #define sockmsgsize(x) ((x) == EMSGSIZE)
+#define socknobufs(x) ((x) == ENOBUFS)
 #define sockinprogress(x) ((x) == EINPROGRESS)
 #endif
 
@@ -44,4 +46,15 @@ extern unsigned int bitfield_to_int(const void *bitfield, size_t size);
 
 int memcmp_constant_time (const void *a, const void *b, size_t size);
 
+/* A token bucket that refills with rate units per second, up to burst units */
+
+typedef struct bucket_t {
+	uint64_t rate;				/* Units added per second, 0 means unlimited */
+	uint64_t burst;				/* Maximum number of units in the bucket */
+	uint64_t tokens;			/* Units in the bucket, in thousandths */
+	uint64_t time;				/* Time of the last refill, in milliseconds */
+} bucket_t;
+
+extern bool bucket_take(bucket_t *bucket, uint64_t clock, uint64_t amount);
+
 #endif							/* __TINC_UTILS_H__ */
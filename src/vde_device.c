@@ -99,7 +99,7 @@ static void close_device(void) {
 }
 
 static bool read_packet(vpn_packet_t *packet) {
-	int lenin = (ssize_t)plug.vde_recv(conn, packet->data, MTU, 0);
+	int lenin = (ssize_t)plug.vde_recv(conn, packet->data, max_frame_size, 0);
 	if(lenin <= 0) {
 		logger(LOG_ERR, "Error while reading from %s %s: %s", device_info, device, strerror(errno));
 		running = false;
@@ -128,6 +128,26 @@ static bool write_packet(vpn_packet_t *packet) {
 	return true;
 }
 
+/* The data socket of libvdeplug is a datagram socket, so many frames can be read from it at once.
+   Writes have to go through vde_send(), which knows the address of the switch. */
+
+static int read_batch(vpn_packet_t **packets, int n) {
+	int num = recv_packets(device_fd, packets, n);
+
+	if(num < 0) {
+		logger(LOG_ERR, "Error while reading from %s %s: %s", device_info, device, strerror(errno));
+		running = false;
+		return -1;
+	}
+
+	for(int i = 0; i < num; i++) {
+		device_total_in += packets[i]->len;
+		ifdebug(TRAFFIC) logger(LOG_DEBUG, "Read packet of %d bytes from %s", packets[i]->len, device_info);
+	}
+
+	return num;
+}
+
 static void dump_device_stats(void) {
 	logger(LOG_DEBUG, "Statistics for %s %s:", device_info, device);
 	logger(LOG_DEBUG, " total bytes in:  %10"PRIu64, device_total_in);
@@ -140,4 +160,7 @@ const devops_t vde_devops = {
 	.read = read_packet,
 	.write = write_packet,
 	.dump_stats = dump_device_stats,
+#ifdef HAVE_RECVMMSG
+	.read_batch = read_batch,
+#endif
 };
@@ -0,0 +1,309 @@
+/*
+    worker.c -- run expensive computations outside the main loop
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "system.h"
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE) && !defined(HAVE_MINGW)
+#include <pthread.h>
+#include <openssl/crypto.h>
+#define HAVE_WORKERS
+#endif
+
+#include "conf.h"
+#include "io.h"
+#include "logger.h"
+#include "net.h"
+#include "worker.h"
+#include "xalloc.h"
+
+/*
+  A job's work() is done by one of a few worker threads, after which its
+  done() is called from the main loop, in the order the jobs finished. The
+  threads share nothing with the rest of tincd except what the job points
+  to, and they block all signals. Finished jobs are handed back through a
+  list and a pipe that the main loop watches, so done() can use everything
+  the main loop can.
+
+  Jobs that may block for a long time, like looking up host names, are
+  submitted with submit_slow_job() instead. They get a thread of their own,
+  so an unresponsive DNS server never keeps the other workers from the
+  cryptography that the meta connections and the CryptoPipeline wait for.
+
+  Without threads, or with CryptoThreads = 0, submit_job() and
+  submit_slow_job() return false and the caller does the work itself.
+*/
+
+int worker_threads = 0;
+
+#ifdef HAVE_WORKERS
+
+#define MAX_WORKERS 16
+
+typedef struct job_queue_t {
+	job_t *head, *tail;			/* jobs waiting for a thread */
+	pthread_cond_t cond;
+} job_queue_t;
+
+static pthread_t workers[MAX_WORKERS];
+static int nworkers;
+static pthread_t slow_worker;
+static bool slow_started;
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static job_queue_t jobs = {NULL, NULL, PTHREAD_COND_INITIALIZER};
+static job_queue_t slow_jobs = {NULL, NULL, PTHREAD_COND_INITIALIZER};
+static job_t *done_head, *done_tail;		/* jobs waiting for done() */
+static bool stopping;
+static int done_pipe[2] = {-1, -1};
+static io_t done_io;
+
+static void push(job_t **head, job_t **tail, job_t *job) {
+	job->next = NULL;
+
+	if(*tail)
+		(*tail)->next = job;
+	else
+		*head = job;
+
+	*tail = job;
+}
+
+static void *worker(void *arg) {
+	job_queue_t *queue = arg;
+
+	pthread_mutex_lock(&job_mutex);
+
+	for(;;) {
+		while(!queue->head && !stopping)
+			pthread_cond_wait(&queue->cond, &job_mutex);
+
+		if(stopping)
+			break;
+
+		job_t *job = queue->head;
+		queue->head = job->next;
+		if(!queue->head)
+			queue->tail = NULL;
+
+		pthread_mutex_unlock(&job_mutex);
+		job->work(job);
+		pthread_mutex_lock(&job_mutex);
+
+		bool wake = !done_head;
+		push(&done_head, &done_tail, job);
+
+		if(wake && write(done_pipe[1], "", 1) < 0 && errno != EAGAIN)
+			abort();
+	}
+
+	pthread_mutex_unlock(&job_mutex);
+
+	return NULL;
+}
+
+static void handle_done_jobs(void *data, int flags) {
+	char buf[16];
+	job_t *job, *next;
+
+	pthread_mutex_lock(&job_mutex);
+
+	while(read(done_pipe[0], buf, sizeof buf) > 0);
+
+	job = done_head;
+	done_head = done_tail = NULL;
+	pthread_mutex_unlock(&job_mutex);
+
+	for(; job; job = next) {
+		next = job->next;
+		job->done(job);
+	}
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/* OpenSSL before 1.1.0 needs to be told how to lock its shared state */
+
+static pthread_mutex_t *openssl_locks;
+
+static void openssl_lock(int mode, int n, const char *file, int line) {
+	if(mode & CRYPTO_LOCK)
+		pthread_mutex_lock(&openssl_locks[n]);
+	else
+		pthread_mutex_unlock(&openssl_locks[n]);
+}
+
+static unsigned long openssl_thread_id(void) {
+	return (unsigned long)pthread_self();
+}
+#endif
+
+static void submit(job_queue_t *queue, job_t *job) {
+	pthread_mutex_lock(&job_mutex);
+	push(&queue->head, &queue->tail, job);
+	pthread_cond_signal(&queue->cond);
+	pthread_mutex_unlock(&job_mutex);
+}
+
+bool submit_job(job_t *job) {
+	if(!nworkers)
+		return false;
+
+	submit(&jobs, job);
+	return true;
+}
+
+bool submit_slow_job(job_t *job) {
+	if(!slow_started)
+		return false;
+
+	submit(&slow_jobs, job);
+	return true;
+}
+
+/* Jobs that no thread got to yet are passed to done() with their data set to NULL */
+
+static void cancel_jobs(job_queue_t *queue) {
+	for(job_t *job = queue->head, *next; job; job = next) {
+		next = job->next;
+		job->data = NULL;
+		job->done(job);
+	}
+
+	queue->head = queue->tail = NULL;
+}
+
+bool init_workers(void) {
+	sigset_t all, old;
+
+	if(!get_config_int(lookup_config(config_tree, "CryptoThreads"), &worker_threads))
+		worker_threads = low_memory ? 0 : 2;
+
+	if(worker_threads < 0 || worker_threads > MAX_WORKERS) {
+		logger(LOG_ERR, "CryptoThreads must be between 0 and %d!", MAX_WORKERS);
+		return false;
+	}
+
+	if(!worker_threads)
+		return true;
+
+	if(pipe(done_pipe)) {
+		logger(LOG_ERR, "Could not create pipe for worker threads: %s", strerror(errno));
+		return false;
+	}
+
+	fcntl(done_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(done_pipe[1], F_SETFL, O_NONBLOCK);
+	io_add(&done_io, handle_done_jobs, NULL, done_pipe[0], IO_READ);
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	openssl_locks = xmalloc(CRYPTO_num_locks() * sizeof *openssl_locks);
+
+	for(int i = 0; i < CRYPTO_num_locks(); i++)
+		pthread_mutex_init(&openssl_locks[i], NULL);
+
+	CRYPTO_set_id_callback(openssl_thread_id);
+	CRYPTO_set_locking_callback(openssl_lock);
+#endif
+
+	/* Signals are for the main loop only */
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	stopping = false;
+
+	for(nworkers = 0; nworkers < worker_threads; nworkers++) {
+		if(pthread_create(&workers[nworkers], NULL, worker, &jobs)) {
+			logger(LOG_ERR, "Could not start worker thread: %s", strerror(errno));
+			break;
+		}
+	}
+
+	if(pthread_create(&slow_worker, NULL, worker, &slow_jobs))
+		logger(LOG_ERR, "Could not start worker thread: %s", strerror(errno));
+	else
+		slow_started = true;
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	ifdebug(CONNECTIONS) logger(LOG_DEBUG, "Started %d worker threads", nworkers);
+
+	return true;
+}
+
+void exit_workers(void) {
+	if(!nworkers && !slow_started)
+		return;
+
+	pthread_mutex_lock(&job_mutex);
+	stopping = true;
+	pthread_cond_broadcast(&jobs.cond);
+	pthread_cond_broadcast(&slow_jobs.cond);
+	pthread_mutex_unlock(&job_mutex);
+
+	for(int i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+
+	if(slow_started)
+		pthread_join(slow_worker, NULL);
+
+	nworkers = 0;
+	slow_started = false;
+
+	handle_done_jobs(NULL, IO_READ);
+	cancel_jobs(&jobs);
+	cancel_jobs(&slow_jobs);
+
+	io_del(&done_io);
+	close(done_pipe[0]);
+	close(done_pipe[1]);
+	done_pipe[0] = done_pipe[1] = -1;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	CRYPTO_set_locking_callback(NULL);
+	CRYPTO_set_id_callback(NULL);
+
+	for(int i = 0; i < CRYPTO_num_locks(); i++)
+		pthread_mutex_destroy(&openssl_locks[i]);
+
+	free(openssl_locks);
+	openssl_locks = NULL;
+#endif
+}
+
+#else
+
+bool submit_job(job_t *job) {
+	return false;
+}
+
+bool submit_slow_job(job_t *job) {
+	return false;
+}
+
+bool init_workers(void) {
+	if(get_config_int(lookup_config(config_tree, "CryptoThreads"), &worker_threads) && worker_threads)
+		logger(LOG_WARNING, "This build of tinc has no support for worker threads, ignoring CryptoThreads");
+
+	worker_threads = 0;
+
+	return true;
+}
+
+void exit_workers(void) {
+}
+
+#endif
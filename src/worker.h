@@ -0,0 +1,37 @@
+/*
+    worker.h -- header for worker.c
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __TINC_WORKER_H__
+#define __TINC_WORKER_H__
+
+typedef struct job_t {
+	void (*work)(struct job_t *);		/* called in a worker thread */
+	void (*done)(struct job_t *);		/* called in the main loop once work() has returned */
+	void *data;				/* for done(), set to NULL to cancel the job */
+	struct job_t *next;
+} job_t;
+
+extern int worker_threads;
+
+extern bool submit_job(job_t *);
+extern bool submit_slow_job(job_t *);
+extern bool init_workers(void);
+extern void exit_workers(void);
+
+#endif							/* __TINC_WORKER_H__ */
@@ -27,3 +27,22 @@ char *xstrdup PARAMS ((const char *s)) __attribute__ ((__malloc__));
 
 extern int xasprintf(char **strp, const char *fmt, ...);
 extern int xvasprintf(char **strp, const char *fmt, va_list ap);
+
+/* Fixed-size object caches.  Freed objects are kept on a free list and
+   reused, memory is taken from the system in chunks and never returned.  */
+typedef struct xslab_t {
+  const char *name;
+  size_t size;			/* object size, rounded up for alignment */
+  void *free;			/* free list, linked through the objects */
+  size_t used;			/* objects handed out */
+  size_t total;			/* objects allocated in chunks */
+  struct xslab_t *next;		/* all slabs that have been used, for stats */
+} xslab_t;
+
+#define XSLAB_INIT(name, type) {name, (sizeof(type) + 7) & ~(size_t)7, NULL, 0, 0, NULL}
+
+extern xslab_t *xslabs;
+
+void *xslab_alloc PARAMS ((xslab_t *slab)) __attribute__ ((__malloc__));
+void *xslab_alloc_and_zero PARAMS ((xslab_t *slab)) __attribute__ ((__malloc__));
+void xslab_free PARAMS ((xslab_t *slab, void *p));
@@ -165,3 +165,76 @@ int xvasprintf(char **strp, const char *fmt, va_list ap) {
 #endif
 	return result;
 }
+
+/* Slabs of fixed-size objects.  Every avl_node_t, list_node_t, edge_t and
+   subnet_t used to be a separate malloc(), and churn in the topology turned
+   that into a lot of allocator traffic and a fragmented heap.  A slab hands
+   out objects from chunks of XSLAB_CHUNK bytes and keeps freed objects on a
+   free list, so the steady state does not call malloc() at all.  Chunks are
+   never given back; the high water mark is visible in the slab statistics. */
+
+#define XSLAB_CHUNK 4096
+#define XSLAB_MIN_OBJECTS 8
+
+xslab_t *xslabs = NULL;
+
+static void
+xslab_grow (xslab_t *slab)
+{
+  size_t count = XSLAB_CHUNK / slab->size;
+  char *chunk;
+  size_t i;
+
+  if (count < XSLAB_MIN_OBJECTS)
+    count = XSLAB_MIN_OBJECTS;
+
+  chunk = xmalloc (count * slab->size);
+
+  for (i = 0; i < count; i++)
+    {
+      *(void **)(chunk + i * slab->size) = slab->free;
+      slab->free = chunk + i * slab->size;
+    }
+
+  if (!slab->total)
+    {
+      slab->next = xslabs;
+      xslabs = slab;
+    }
+
+  slab->total += count;
+}
+
+void *
+xslab_alloc (xslab_t *slab)
+{
+  void *p;
+
+  if (!slab->free)
+    xslab_grow (slab);
+
+  p = slab->free;
+  slab->free = *(void **)p;
+  slab->used++;
+  return p;
+}
+
+void *
+xslab_alloc_and_zero (xslab_t *slab)
+{
+  void *p = xslab_alloc (slab);
+
+  memset (p, 0, slab->size);
+  return p;
+}
+
+void
+xslab_free (xslab_t *slab, void *p)
+{
+  if (!p)
+    return;
+
+  *(void **)p = slab->free;
+  slab->free = p;
+  slab->used--;
+}